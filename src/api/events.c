@@ -5,6 +5,8 @@
 
 #include "kernel.h"
 #include "api.h"
+#include "vdso.h"
+#include "io.h"
 
 // ============================================================================
 // EVENT QUEUE IMPLEMENTATION
@@ -18,12 +20,9 @@ typedef struct event_listeners {
 
 struct event_queue {
     pid_t owner_pid;
-    event_t* events;          // Circular buffer
-    size_t capacity;
-    size_t head;
-    size_t tail;
-    size_t count;
+    event_ring_t* ring;       // Fixed SPSC ring: pushes never allocate
     event_listener_t* listeners;  // For broadcasting
+    wait_queue_t waiters;         // Tasks blocked in event_queue_wait()
     struct event_queue* next_global; // For global queue list
 };
 
@@ -35,17 +34,15 @@ event_queue_t* event_queue_create(void) {
     if (!queue) return NULL;
 
     queue->owner_pid = scheduler_get_current_task_id();
-    queue->capacity = 256;  // Default capacity
-    queue->events = kmalloc_tracked(sizeof(event_t) * queue->capacity, "event_queue_buffer");
-    if (!queue->events) {
+    queue->ring = kmalloc_tracked(sizeof(event_ring_t), "event_queue_ring");
+    if (!queue->ring) {
         kfree_tracked(queue);
         return NULL;
     }
+    memset(queue->ring, 0, sizeof(event_ring_t));
 
-    queue->head = 0;
-    queue->tail = 0;
-    queue->count = 0;
     queue->listeners = NULL;
+    wait_queue_init(&queue->waiters);
 
     // Add to global list for broadcasting
     queue->next_global = global_queues;
@@ -75,62 +72,28 @@ void event_queue_destroy(event_queue_t* queue) {
         listener = next;
     }
 
-    if (queue->events) {
-        kfree_tracked(queue->events);
-    }
+    kfree_tracked(queue->ring);
     kfree_tracked(queue);
 }
 
-static bool event_queue_resize(event_queue_t* queue, size_t new_capacity) {
-    event_t* new_events = kmalloc_tracked(sizeof(event_t) * new_capacity, "event_queue_resize");
-    if (!new_events) return false;
-
-    // Copy existing events
-    size_t copy_count = 0;
-    size_t index = queue->head;
-    while (copy_count < queue->count && copy_count < new_capacity) {
-        new_events[copy_count] = queue->events[index];
-        index = (index + 1) % queue->capacity;
-        copy_count++;
-    }
-
-    kfree_tracked(queue->events);
-    queue->events = new_events;
-    queue->capacity = new_capacity;
-    queue->head = 0;
-    queue->tail = copy_count;
-    queue->count = copy_count;
-
-    return true;
-}
-
 bool event_queue_poll(event_queue_t* queue, event_t* event) {
     if (!queue || !event) return false;
-
-    if (queue->count == 0) return false;
-
-    // Copy event to user buffer
-    *event = queue->events[queue->head];
-    queue->head = (queue->head + 1) % queue->capacity;
-    queue->count--;
-
-    return true;
+    return event_ring_pop(queue->ring, event);
 }
 
 bool event_queue_wait(event_queue_t* queue, event_t* event, uint32_t timeout_ms) {
     if (!queue || !event) return false;
 
-    uint64_t start_time = time_monotonic_ms();
-    uint64_t timeout_point = start_time + timeout_ms;
+    uint64_t deadline = time_monotonic_us() + (uint64_t)timeout_ms * 1000;
 
-    // Poll until event available or timeout
-    while (queue->count == 0) {
-        schedule_delay(1);  // Brief delay
-
-        if (time_monotonic_ms() >= timeout_point) {
-            return false;  // Timeout
-        }
+    // Block until an event is pushed or the timeout expires
+    wait_entry_t wait;
+    for (;;) {
+        wait_prepare(&queue->waiters, &wait);
+        if (queue->ring->head != queue->ring->tail) break;
+        if (wait_schedule(&wait, deadline) < 0) break;  // Timeout
     }
+    wait_finish(&wait);
 
     return event_queue_poll(queue, event);
 }
@@ -138,19 +101,18 @@ bool event_queue_wait(event_queue_t* queue, event_t* event, uint32_t timeout_ms)
 bool event_queue_push(event_queue_t* queue, const event_t* event) {
     if (!queue || !event) return false;
 
-    // Resize if necessary (simple growth strategy)
-    if (queue->count >= queue->capacity - 1) {
-        size_t new_capacity = queue->capacity * 2;
-        if (!event_queue_resize(queue, new_capacity)) {
-            return false;
-        }
+    // Full rings drop rather than grow: this runs from input handlers
+    event_ring_t* ring = queue->ring;
+    uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= EVENT_RING_SIZE) {
+        ring->dropped++;
+        return false;
     }
 
-    // Add event to queue
-    queue->events[queue->tail] = *event;
-    queue->tail = (queue->tail + 1) % queue->capacity;
-    queue->count++;
+    ring->events[head & EVENT_RING_MASK] = *event;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 
+    wake_up_one(&queue->waiters);
     return true;
 }
 
@@ -209,6 +171,8 @@ void event_send_to_window(window_id_t window, const event_t* event) {
 // EVENT LOOP
 // ============================================================================
 
+#define EVENT_LOOP_WAIT_MS 100
+
 static bool event_loop_running = false;
 static event_handler_t current_handler = NULL;
 static void* current_user_data = NULL;
@@ -230,20 +194,14 @@ void event_loop_run(event_handler_t handler, void* user_data) {
 
     event_t event;
     while (event_loop_running) {
-        // Poll for events
-        if (event_queue_poll(default_queue, &event)) {
+        // Block for the next event; wake periodically to notice a quit
+        if (event_queue_wait(default_queue, &event, EVENT_LOOP_WAIT_MS)) {
             // Handle the event
             bool continue_loop = handler(&event, user_data);
             if (!continue_loop) {
                 break;
             }
         }
-
-        // Yield CPU to other processes
-        scheduler_yield();
-
-        // Prevent busy waiting
-        schedule_delay(1);
     }
 
     KINFO("Event loop exited for process %d", scheduler_get_current_task_id());
@@ -261,7 +219,7 @@ void event_loop_quit(void) {
 void event_from_keyboard(uint32_t keycode, uint32_t modifiers, uint32_t state) {
     event_t event = {
         .type = EVENT_TYPE_KEYBOARD,
-        .timestamp = time_monotonic_ms(),
+        .timestamp = rdtsc(),
         .data.keyboard = {
             .keycode = keycode,
             .modifiers = modifiers,
@@ -275,7 +233,7 @@ void event_from_keyboard(uint32_t keycode, uint32_t modifiers, uint32_t state) {
 void event_from_mouse(int32_t x, int32_t y, uint32_t buttons, int32_t wheel) {
     event_t event = {
         .type = EVENT_TYPE_MOUSE,
-        .timestamp = time_monotonic_ms(),
+        .timestamp = rdtsc(),
         .data.mouse = {
             .x = x,
             .y = y,
@@ -290,7 +248,7 @@ void event_from_mouse(int32_t x, int32_t y, uint32_t buttons, int32_t wheel) {
 void event_from_window(window_id_t window_id, int action) {
     event_t event = {
         .type = EVENT_TYPE_WINDOW,
-        .timestamp = time_monotonic_ms()
+        .timestamp = rdtsc()
         // Window events would need additional fields in kernel.h event_t
     };
     (void)window_id;  // Unused for now
@@ -330,8 +288,8 @@ void log_set_level(log_level_t level) {
 // ============================================================================
 
 uint64_t time_realtime_ms(void) {
-    // Would be different from monotonic if RTC supported
-    return time_monotonic_ms();
+    // CMOS wall clock at boot plus the monotonic clock (offset kept in the vDSO page)
+    return (time_monotonic_ns() + vdso_realtime_offset_ns()) / 1000000;
 }
 
 void sleep_ms(uint32_t milliseconds) {
@@ -339,9 +297,7 @@ void sleep_ms(uint32_t milliseconds) {
 }
 
 void sleep_us(uint32_t microseconds) {
-    // Convert to ms, minimum 1ms granularity
-    uint32_t ms = (microseconds + 999) / 1000;  // Round up
-    schedule_delay(ms);
+    schedule_delay_us(microseconds);
 }
 
 // ============================================================================
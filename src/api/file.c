@@ -5,6 +5,7 @@
 
 #include "kernel.h"
 #include "api.h"
+#include "vfs.h"
 
 // File operation constants (if not defined elsewhere)
 #ifndef O_RDONLY
@@ -177,6 +178,13 @@ int file_copy(const char* src, const char* dst) {
 }
 
 int file_exists(const char* path) {
+    // A path the dentry cache resolves needs no open
+    struct dentry* dentry = path ? vfs_path_lookup(path) : NULL;
+    if (dentry) {
+        dput(dentry);
+        return 1;
+    }
+
     file_t* file = file_open(path, FILE_MODE_READ);
     if (!file) return 0;
 
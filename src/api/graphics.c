@@ -43,6 +43,24 @@ bool window_is_visible(window_id_t window) {
 // GRAPHICS CONTEXT MANAGEMENT
 // ============================================================================
 
+// Damage drawn since graphics_begin_frame, per window being drawn. A
+// window with no slot free commits whole.
+#define MAX_FRAMES 8
+
+typedef struct {
+    window_id_t window;     // 0 = free
+    damage_t damage;
+} frame_state_t;
+
+static frame_state_t frames[MAX_FRAMES];
+
+static frame_state_t* frame_find(window_id_t window) {
+    for (int i = 0; i < MAX_FRAMES; i++) {
+        if (frames[i].window == window) return &frames[i];
+    }
+    return NULL;
+}
+
 void graphics_begin_frame(window_id_t window, graphics_context_t* ctx) {
     if (!ctx) return;
 
@@ -52,9 +70,13 @@ void graphics_begin_frame(window_id_t window, graphics_context_t* ctx) {
     ctx->bg_color = 0xFF000000; // Black
     ctx->fg_color = 0xFFFFFFFF; // White
 
-    // Get window dimensions - simplified
-    ctx->width = 800;  // Default assumptions
-    ctx->height = 600;
+    // The window's pixels, mapped into this address space: drawing below
+    // is plain stores, no system calls
+    uint32_t width = 0, height = 0;
+    ctx->buffer = (uint32_t*)sys_window_map((int)window, &width, &height);
+    ctx->width = ctx->buffer ? (int)width : 0;
+    ctx->height = ctx->buffer ? (int)height : 0;
+    ctx->pitch = ctx->width;
 
     // Set default clipping to full window
     ctx->clip_x = 0;
@@ -62,14 +84,28 @@ void graphics_begin_frame(window_id_t window, graphics_context_t* ctx) {
     ctx->clip_w = ctx->width;
     ctx->clip_h = ctx->height;
 
-    (void)window; // Use window if needed for real implementation
+    frame_state_t* frame = frame_find(window);
+    if (!frame) frame = frame_find(0);
+    if (frame) {
+        frame->window = window;
+        damage_clear(&frame->damage);
+    }
+    ctx->damage = frame ? &frame->damage : NULL;
 }
 
 void graphics_end_frame(window_id_t window) {
     if (window == 0) return;
 
-    // Tell display server to composite/update this window
-    sys_window_composite((int)window);
+    // One call hands the display server everything drawn this frame
+    frame_state_t* frame = frame_find(window);
+    if (!frame) {
+        sys_window_commit((int)window, NULL, 0);
+        return;
+    }
+    if (frame->damage.count > 0) {
+        sys_window_commit((int)window, frame->damage.rects, frame->damage.count);
+    }
+    frame->window = 0;
 }
 
 // ============================================================================
@@ -94,26 +130,52 @@ static bool clip_rect(const graphics_context_t* ctx, int* x, int* y, int* w, int
     return (*w > 0 && *h > 0);
 }
 
+// Note pixels drawn, for the commit at graphics_end_frame
+static void mark_damage(const graphics_context_t* ctx, int x, int y, int w, int h) {
+    if (ctx->damage && clip_rect(ctx, &x, &y, &w, &h)) {
+        damage_add(ctx->damage, x, y, w, h);
+    }
+}
+
+// Already clipped
+static void fill_rect(const graphics_context_t* ctx, int x, int y, int w, int h, uint32_t color) {
+    uint32_t* row = ctx->buffer + (size_t)y * ctx->pitch + x;
+    for (int dy = 0; dy < h; dy++, row += ctx->pitch) {
+        for (int dx = 0; dx < w; dx++) {
+            row[dx] = color;
+        }
+    }
+    if (ctx->damage) damage_add(ctx->damage, x, y, w, h);
+}
+
+// One pixel, if inside the clip; the caller marks the damage
+static inline void plot(const graphics_context_t* ctx, int x, int y, uint32_t color) {
+    if (x >= ctx->clip_x && x < ctx->clip_x + ctx->clip_w &&
+        y >= ctx->clip_y && y < ctx->clip_y + ctx->clip_h &&
+        x >= 0 && x < ctx->width && y >= 0 && y < ctx->height) {
+        ctx->buffer[(size_t)y * ctx->pitch + x] = color;
+    }
+}
+
 void graphics_clear(const graphics_context_t* ctx) {
-    if (!ctx) return;
+    if (!ctx || !ctx->buffer) return;
 
     int x = 0, y = 0, w = ctx->width, h = ctx->height;
     if (clip_rect(ctx, &x, &y, &w, &h)) {
-        // Use syscall to draw the rectangle
-        sys_draw_rect(0, x, y, w, h, ctx->bg_color); // Window 0 = current window
+        fill_rect(ctx, x, y, w, h, ctx->bg_color);
     }
 }
 
 void graphics_draw_rect(const graphics_context_t* ctx, int x, int y, int w, int h, uint32_t color) {
-    if (!ctx || w <= 0 || h <= 0) return;
+    if (!ctx || !ctx->buffer || w <= 0 || h <= 0) return;
 
     if (clip_rect(ctx, &x, &y, &w, &h)) {
-        sys_draw_rect(0, x, y, w, h, color);
+        fill_rect(ctx, x, y, w, h, color);
     }
 }
 
 void graphics_draw_circle(const graphics_context_t* ctx, int cx, int cy, int radius, uint32_t color) {
-    if (!ctx || radius <= 0) return;
+    if (!ctx || !ctx->buffer || radius <= 0) return;
 
     // Basic circle drawing using Bresenham's algorithm
     int x = 0;
@@ -123,38 +185,14 @@ void graphics_draw_circle(const graphics_context_t* ctx, int cx, int cy, int rad
     // Draw circle outline
     while (x <= y) {
         // Draw 8 octants
-        if (cx + x >= ctx->clip_x && cx + x < ctx->clip_x + ctx->clip_w &&
-            cy + y >= ctx->clip_y && cy + y < ctx->clip_y + ctx->clip_h) {
-            sys_draw_rect(0, cx + x, cy + y, 1, 1, color);
-        }
-        if (cx + x >= ctx->clip_x && cx + x < ctx->clip_x + ctx->clip_w &&
-            cy - y >= ctx->clip_y && cy - y < ctx->clip_y + ctx->clip_h) {
-            sys_draw_rect(0, cx + x, cy - y, 1, 1, color);
-        }
-        if (cx - x >= ctx->clip_x && cx - x < ctx->clip_x + ctx->clip_w &&
-            cy + y >= ctx->clip_y && cy + y < ctx->clip_y + ctx->clip_h) {
-            sys_draw_rect(0, cx - x, cy + y, 1, 1, color);
-        }
-        if (cx - x >= ctx->clip_x && cx - x < ctx->clip_x + ctx->clip_w &&
-            cy - y >= ctx->clip_y && cy - y < ctx->clip_y + ctx->clip_h) {
-            sys_draw_rect(0, cx - x, cy - y, 1, 1, color);
-        }
-        if (cx + y >= ctx->clip_x && cx + y < ctx->clip_x + ctx->clip_w &&
-            cy + x >= ctx->clip_y && cy + x < ctx->clip_y + ctx->clip_h) {
-            sys_draw_rect(0, cx + y, cy + x, 1, 1, color);
-        }
-        if (cx + y >= ctx->clip_x && cx + y < ctx->clip_x + ctx->clip_w &&
-            cy - x >= ctx->clip_y && cy - x < ctx->clip_y + ctx->clip_h) {
-            sys_draw_rect(0, cx + y, cy - x, 1, 1, color);
-        }
-        if (cx - y >= ctx->clip_x && cx - y < ctx->clip_x + ctx->clip_w &&
-            cy + x >= ctx->clip_y && cy + x < ctx->clip_y + ctx->clip_h) {
-            sys_draw_rect(0, cx - y, cy + x, 1, 1, color);
-        }
-        if (cx - y >= ctx->clip_x && cx - y < ctx->clip_x + ctx->clip_w &&
-            cy - x >= ctx->clip_y && cy - x < ctx->clip_y + ctx->clip_h) {
-            sys_draw_rect(0, cx - y, cy - x, 1, 1, color);
-        }
+        plot(ctx, cx + x, cy + y, color);
+        plot(ctx, cx + x, cy - y, color);
+        plot(ctx, cx - x, cy + y, color);
+        plot(ctx, cx - x, cy - y, color);
+        plot(ctx, cx + y, cy + x, color);
+        plot(ctx, cx + y, cy - x, color);
+        plot(ctx, cx - y, cy + x, color);
+        plot(ctx, cx - y, cy - x, color);
 
         if (d < 0) {
             d = d + 4 * x + 6;
@@ -164,10 +202,11 @@ void graphics_draw_circle(const graphics_context_t* ctx, int cx, int cy, int rad
         }
         x++;
     }
+    mark_damage(ctx, cx - radius, cy - radius, 2 * radius + 1, 2 * radius + 1);
 }
 
 void graphics_draw_line(const graphics_context_t* ctx, int x1, int y1, int x2, int y2, uint32_t color) {
-    if (!ctx) return;
+    if (!ctx || !ctx->buffer) return;
 
     // Bresenham's line algorithm
     int dx = abs(x2 - x1);
@@ -181,10 +220,7 @@ void graphics_draw_line(const graphics_context_t* ctx, int x1, int y1, int x2, i
 
     while (1) {
         // Draw pixel if within bounds
-        if (x >= ctx->clip_x && x < ctx->clip_x + ctx->clip_w &&
-            y >= ctx->clip_y && y < ctx->clip_y + ctx->clip_h) {
-            sys_draw_rect(0, x, y, 1, 1, color);
-        }
+        plot(ctx, x, y, color);
 
         // Check if we're done
         if (x == x2 && y == y2) break;
@@ -199,34 +235,19 @@ void graphics_draw_line(const graphics_context_t* ctx, int x1, int y1, int x2, i
             y += sy;
         }
     }
+    mark_damage(ctx, x1 < x2 ? x1 : x2, y1 < y2 ? y1 : y2, dx + 1, dy + 1);
 }
 
 void graphics_draw_text(const graphics_context_t* ctx, int x, int y, const char* text, uint32_t color) {
-    if (!ctx || !text) return;
-
-    // Very basic text rendering - would need real font in full implementation
-    int current_x = x;
-    const char* p = text;
-
-    while (*p) {
-        // Draw a simple block character (8x8 pixels)
-        for (int dy = 0; dy < 8; dy++) {
-            for (int dx = 0; dx < 6; dx++) {
-                int draw_x = current_x + dx;
-                int draw_y = y + dy;
-
-                if (draw_x >= ctx->clip_x && draw_x < ctx->clip_x + ctx->clip_w &&
-                    draw_y >= ctx->clip_y && draw_y < ctx->clip_y + ctx->clip_h) {
-                    // Simple pattern for each character
-                    uint32_t pixel_color = (dx < 4 && dy < 6) ? color : ctx->bg_color;
-                    sys_draw_rect(0, draw_x, draw_y, 1, 1, pixel_color);
-                }
-            }
-        }
+    if (!ctx || !ctx->buffer || !text) return;
 
-        current_x += 7; // 6px width + 1px spacing
-        p++;
-    }
+    // The context clip, inside the window
+    int cx = ctx->clip_x, cy = ctx->clip_y, cw = ctx->clip_w, ch = ctx->clip_h;
+    if (!clip_rect(ctx, &cx, &cy, &cw, &ch)) return;
+    rect_t clip = { cx, cy, cw, ch };
+
+    int width = text_draw(ctx->buffer, ctx->pitch, &clip, x, y, text, color, ctx->bg_color);
+    mark_damage(ctx, x, y, width, TEXT_CELL_H);
 }
 
 // ============================================================================
@@ -237,6 +258,7 @@ void graphics_draw_gradient_rect(const graphics_context_t* ctx, int x, int y, in
                                 uint32_t color1, uint32_t color2, bool vertical) {
     if (!ctx || w <= 0 || h <= 0) return;
 
+    if (!ctx->buffer) return;
     int clip_x = x, clip_y = y, clip_w = w, clip_h = h;
     if (!clip_rect(ctx, &clip_x, &clip_y, &clip_w, &clip_h)) return;
 
@@ -259,9 +281,10 @@ void graphics_draw_gradient_rect(const graphics_context_t* ctx, int x, int y, in
 
             uint32_t color = 0xFF000000 | (r << 16) | (g << 8) | b;
 
-            sys_draw_rect(0, clip_x + dx, clip_y + dy, 1, 1, color);
+            ctx->buffer[(size_t)(clip_y + dy) * ctx->pitch + clip_x + dx] = color;
         }
     }
+    if (ctx->damage) damage_add(ctx->damage, clip_x, clip_y, clip_w, clip_h);
 }
 
 void graphics_draw_border(const graphics_context_t* ctx, int x, int y, int w, int h,
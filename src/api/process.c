@@ -34,7 +34,8 @@ process_t process_create(process_entry_t entry, void* arg, process_attr_t* attr)
     if (attr->priority > 255) attr->priority = 255;
 
     // Create the process using scheduler
-    pid_t pid = scheduler_create_task(entry, arg, attr->stack_size, attr->priority, attr->name);
+    pid_t pid = scheduler_create_task_ex(entry, arg, attr->stack_size, attr->priority,
+                                         attr->name, attr->sched_flags);
     if (pid <= 0) {
         return -1;
     }
@@ -0,0 +1,319 @@
+#include "kernel.h"
+#include "io.h"
+#include "cpu.h"
+#include "smp.h"
+
+/*
+ * Local APIC driver
+ * Per-core timer, inter-processor interrupts and end-of-interrupt
+ */
+
+// Register offsets from the LAPIC base
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_PERF      0x340
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+// Register bits
+#define LAPIC_SVR_ENABLE        0x100
+#define LAPIC_LVT_MASKED        0x10000
+#define LAPIC_TIMER_PERIODIC    0x20000
+#define LAPIC_TIMER_TSC_DEADLINE 0x40000
+#define LAPIC_TIMER_DIV_16      0x3
+#define LAPIC_DELIVERY_NMI      0x400
+#define APIC_BASE_ENABLE        0x800
+
+#define ICR_DELIVERY_PENDING    0x1000
+#define ICR_LEVEL_ASSERT        0x4000
+#define ICR_DELIVERY_INIT       0x500
+#define ICR_DELIVERY_STARTUP    0x600
+
+// PIT channel 2 is used for calibration; channel 0 keeps the system tick
+#define PIT_CH2_DATA        0x42
+#define PIT_COMMAND         0x43
+#define PIT_GATE_PORT       0x61
+#define PIT_BASE_FREQUENCY  1193182
+
+#define CALIBRATION_MS      10
+
+#define MSR_TSC_DEADLINE    0x6E0
+#define CPUID_ECX_TSC_DEADLINE (1U << 24)
+
+static volatile uint32_t* lapic_base = NULL;
+static uint32_t lapic_ticks_per_ms = 0;   // At divide-by-16, measured on the BSP
+static bool bsp_timer_running = false;
+static bool tsc_deadline = false;         // All CPUs use TSC-deadline mode
+
+// Device MSI vectors, claimed once at driver init and never released
+static struct {
+    msi_handler_t handler;
+    void* arg;
+} msi_vectors[APIC_MSI_VECTOR_COUNT];
+static int msi_vectors_used = 0;
+static spinlock_t msi_lock = SPINLOCK_INIT;
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    return lapic_base[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value)
+{
+    lapic_base[reg / 4] = value;
+    (void)lapic_base[LAPIC_ID / 4];  // Read back to post the write
+}
+
+// Busy-wait for count PIT cycles using channel 2 in one-shot mode
+static void pit_wait(uint16_t count)
+{
+    uint8_t gate = inb(PIT_GATE_PORT);
+    outb(PIT_GATE_PORT, (gate & ~0x02) | 0x01);  // Speaker off, gate on
+
+    outb(PIT_COMMAND, 0xB0);                      // Channel 2, lo/hi, mode 0
+    outb(PIT_CH2_DATA, count & 0xFF);
+    outb(PIT_CH2_DATA, count >> 8);
+
+    // Pulse the gate to restart the count
+    gate = inb(PIT_GATE_PORT) & ~0x01;
+    outb(PIT_GATE_PORT, gate);
+    outb(PIT_GATE_PORT, gate | 0x01);
+
+    while (!(inb(PIT_GATE_PORT) & 0x20)) {
+        __asm__ volatile("pause");
+    }
+}
+
+void lapic_delay_us(uint32_t us)
+{
+    while (us > 0) {
+        uint32_t chunk = us > 50000 ? 50000 : us;
+        uint32_t count = (uint32_t)(((uint64_t)chunk * PIT_BASE_FREQUENCY) / 1000000);
+        pit_wait(count ? count : 1);
+        us -= chunk;
+    }
+}
+
+// Enable the local APIC of the calling CPU (maps the MMIO page once)
+bool lapic_init(void)
+{
+    if (!lapic_base) {
+        uint32_t eax, ebx, ecx, edx;
+        __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+        if (!(edx & (1 << 9))) {
+            return false;
+        }
+
+        uintptr_t phys = rdmsr(MSR_APIC_BASE) & ~0xFFFULL;
+        if (vmm_map_page(phys, phys, PAGE_PRESENT | PAGE_WRITABLE | PAGE_CACHE_DISABLE) != 0) {
+            KERROR("Failed to map local APIC at 0x%lx", phys);
+            return false;
+        }
+        lapic_base = (volatile uint32_t*)phys;
+        KINFO("Local APIC at 0x%lx", phys);
+    }
+
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_PERF, LAPIC_DELIVERY_NMI | LAPIC_LVT_MASKED);
+
+    return true;
+}
+
+// Counter overflow interrupts arrive as NMIs. Delivering one masks the
+// entry again, so the handler re-enables it for the next sample.
+void lapic_perf_nmi(bool enable)
+{
+    if (!lapic_base) return;
+    lapic_write(LAPIC_LVT_PERF, LAPIC_DELIVERY_NMI | (enable ? 0 : LAPIC_LVT_MASKED));
+}
+
+uint32_t lapic_id(void)
+{
+    return lapic_base ? lapic_read(LAPIC_ID) >> 24 : 0;
+}
+
+void lapic_eoi(void)
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr_low)
+{
+    if (!lapic_base) return;
+
+    uint64_t flags = irq_save();
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING) {
+        __asm__ volatile("pause");
+    }
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr_low);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING) {
+        __asm__ volatile("pause");
+    }
+    irq_restore(flags);
+}
+
+void lapic_send_init(uint32_t apic_id)
+{
+    lapic_send_ipi(apic_id, ICR_DELIVERY_INIT | ICR_LEVEL_ASSERT);
+}
+
+void lapic_send_startup(uint32_t apic_id, uint8_t vector_page)
+{
+    lapic_send_ipi(apic_id, ICR_DELIVERY_STARTUP | ICR_LEVEL_ASSERT | vector_page);
+}
+
+// Count LAPIC timer cycles over a fixed PIT interval
+static void lapic_timer_calibrate(void)
+{
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+
+    pit_wait(PIT_BASE_FREQUENCY / (1000 / CALIBRATION_MS));
+
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    lapic_ticks_per_ms = elapsed / CALIBRATION_MS;
+    KINFO("LAPIC timer: %u ticks/ms (div 16)", lapic_ticks_per_ms);
+}
+
+// Put this CPU's LAPIC timer in one-shot mode; timer.c programs each event
+void lapic_timer_start(void)
+{
+    if (!lapic_base) return;
+
+    // All cores share one bus clock, so the BSP's measurement is reused
+    if (lapic_ticks_per_ms == 0) {
+        lapic_timer_calibrate();
+
+        uint32_t a, b, c, d;
+        __asm__ volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1), "c"(0));
+        tsc_deadline = (c & CPUID_ECX_TSC_DEADLINE) && timer_has_tsc();
+        KINFO("LAPIC timer: %s one-shot", tsc_deadline ? "TSC-deadline" : "count-down");
+    }
+
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    lapic_write(LAPIC_LVT_TIMER, (tsc_deadline ? LAPIC_TIMER_TSC_DEADLINE : 0) |
+                                 APIC_TIMER_VECTOR);
+
+    if (smp_cpu_id() == 0) {
+        bsp_timer_running = true;
+
+        // The TSC keeps time now, so the PIT need not wake the BSP
+        if (timer_has_tsc()) {
+            pic_mask(0);
+        }
+    }
+
+    timer_cpu_start();
+}
+
+// Fire this CPU's timer interrupt at a monotonic time (us)
+void lapic_timer_arm(uint64_t deadline_us)
+{
+    if (tsc_deadline) {
+        // A deadline already in the past fires immediately
+        wrmsr(MSR_TSC_DEADLINE, timer_us_to_tsc(deadline_us));
+        return;
+    }
+
+    uint64_t now = time_monotonic_us();
+    uint64_t delta = deadline_us > now ? deadline_us - now : 1;
+    uint64_t count = (delta * lapic_ticks_per_ms) / 1000;
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;  // Fires early and re-arms
+    lapic_write(LAPIC_TIMER_INIT, (uint32_t)count);
+}
+
+void lapic_timer_disarm(void)
+{
+    if (tsc_deadline) {
+        wrmsr(MSR_TSC_DEADLINE, 0);
+    } else {
+        lapic_write(LAPIC_TIMER_INIT, 0);
+    }
+}
+
+bool lapic_timer_active(void)
+{
+    return bsp_timer_running;
+}
+
+int apic_alloc_msi_vector(msi_handler_t handler, void* arg)
+{
+    if (!lapic_base || !handler) {
+        return -1;  // MSIs are delivered to a local APIC
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&msi_lock);
+    int slot = msi_vectors_used < APIC_MSI_VECTOR_COUNT ? msi_vectors_used++ : -1;
+    if (slot >= 0) {
+        msi_vectors[slot].arg = arg;
+        msi_vectors[slot].handler = handler;
+    }
+    spin_unlock_irqrestore(&msi_lock, flags);
+    
+    return slot < 0 ? -1 : APIC_MSI_VECTOR_BASE + slot;
+}
+
+// Fixed delivery, physical destination mode
+uint64_t apic_msi_address(uint32_t apic_id)
+{
+    return 0xFEE00000ULL | ((uint64_t)(apic_id & 0xFF) << 12);
+}
+
+// Vectors owned by the LAPIC (dispatched from interrupt.c)
+void apic_handle_interrupt(uint8_t vector)
+{
+    if (vector >= APIC_MSI_VECTOR_BASE && vector < APIC_MSI_VECTOR_BASE + APIC_MSI_VECTOR_COUNT) {
+        int slot = vector - APIC_MSI_VECTOR_BASE;
+        if (msi_vectors[slot].handler) {
+            msi_vectors[slot].handler(msi_vectors[slot].arg);
+        }
+        lapic_eoi();
+        return;
+    }
+    
+    switch (vector) {
+        case APIC_TIMER_VECTOR:
+            if (percpu_ready) {
+                this_cpu()->lapic_ticks++;
+            }
+            pmu_tick();
+            lapic_eoi();
+            timer_lapic_interrupt();
+            break;
+        case APIC_RESCHED_VECTOR:
+            lapic_eoi();
+            scheduler_schedule();
+            break;
+        case APIC_TLB_VECTOR:
+            vmm_tlb_ipi();
+            lapic_eoi();
+            break;
+        case APIC_DRAIN_VECTOR:
+            kheap_drain_ipi();
+            lapic_eoi();
+            break;
+        case APIC_SPURIOUS_VECTOR:
+            // Spurious interrupts must not be acknowledged
+            break;
+        default:
+            lapic_eoi();
+            KWARN("Unhandled APIC vector %u", vector);
+            break;
+    }
+}
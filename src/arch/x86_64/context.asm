@@ -0,0 +1,92 @@
+; Kernel context switch for x86_64
+; Only the callee-saved registers live across switch_context(); everything
+; else was already spilled by the C caller (or by the ISR stub when the
+; switch happens from the timer interrupt)
+
+BITS 64
+SECTION .text
+
+EXTERN scheduler_finish_switch
+EXTERN scheduler_terminate
+
+USER_DATA_SELECTOR equ 0x1B     ; GDT user data | RPL 3
+USER_CODE_SELECTOR equ 0x23     ; GDT user code | RPL 3 (SYSRET layout)
+
+; void switch_context(uint64_t** prev_sp, uint64_t* next_sp)
+; Saves the current stack pointer to *prev_sp and resumes next_sp, which
+; must point at a frame built by a previous switch_context() or by the
+; scheduler's initial frame (r15..rbx, then a return address)
+GLOBAL switch_context
+switch_context:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov [rdi], rsp
+    mov rsp, rsi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
+
+; First return of a new kernel task: rbx = entry, r12 = argument
+GLOBAL task_entry_trampoline
+task_entry_trampoline:
+    and rsp, -16
+    call scheduler_finish_switch
+    sti
+
+    mov rdi, r12
+    call rbx
+
+    ; Entry returned: the task is done
+    call scheduler_terminate
+.hang:
+    hlt
+    jmp .hang
+
+; First return of a new user task: rbx = user entry, r12 = user stack
+GLOBAL task_user_trampoline
+task_user_trampoline:
+    and rsp, -16
+    call scheduler_finish_switch
+
+    mov ax, USER_DATA_SELECTOR
+    mov ds, ax
+    mov es, ax
+
+    ; iretq frame to ring 3 with interrupts enabled
+    push USER_DATA_SELECTOR     ; SS
+    push r12                    ; RSP
+    push 0x202                  ; RFLAGS
+    push USER_CODE_SELECTOR     ; CS
+    push rbx                    ; RIP
+
+    ; Don't leak kernel values into user registers
+    xor eax, eax
+    xor ebx, ebx
+    xor ecx, ecx
+    xor edx, edx
+    xor esi, esi
+    xor edi, edi
+    xor ebp, ebp
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+    xor r11d, r11d
+    xor r12d, r12d
+    xor r13d, r13d
+    xor r14d, r14d
+    xor r15d, r15d
+
+    ; No interrupt may see ring 0 with the user's GS base
+    cli
+    swapgs                      ; User GS base in, per-CPU block parked
+    iretq
@@ -0,0 +1,133 @@
+#include "kernel.h"
+#include "cpu.h"
+#include "smp.h"
+#include "io.h"
+
+/*
+ * CPU feature setup
+ * FPU/SSE/AVX control bits for lazy state switching, PCID-tagged TLBs, and
+ * a write-combining page attribute for framebuffers
+ */
+
+static bool pcid_enabled = false;
+static bool avx2_enabled = false;
+static bool pat_enabled = false;
+static bool erms_enabled = false;   // Fast rep movsb/stosb
+static bool fsrm_enabled = false;   // ... also for short copies
+static bool cpu_init_done = false;  // BSP has picked the feature set
+
+bool fpu_xsave = false;
+uint32_t fpu_state_size = FPU_STATE_SIZE;
+
+bool cpu_has_pcid(void)
+{
+    return pcid_enabled;
+}
+
+bool cpu_has_avx2(void)
+{
+    return avx2_enabled;
+}
+
+bool cpu_has_pat_wc(void)
+{
+    return pat_enabled;
+}
+
+// SYSCALL/SYSRET: kernel CS/SS from 0x08, user SS/CS from 0x10 + 8 / + 16
+static void cpu_init_syscall(void)
+{
+    wrmsr(MSR_STAR, (0x10ULL << 48) | (0x08ULL << 32));
+    wrmsr(MSR_LSTAR, (uint64_t)(uintptr_t)syscall_entry);
+    // Enter with IF, TF, DF and AC clear
+    wrmsr(MSR_FMASK, 0x200 | 0x100 | 0x400 | 0x40000);
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+
+    // vmm marks every non-PROT_EXEC user page no-execute
+    uint32_t a, b, c, d;
+    cpuid(0x80000001, &a, &b, &c, &d);
+    if (d & CPUID_EXT_EDX_NX) {
+        wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+    }
+}
+
+void cpu_init(void)
+{
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+
+    if (!(d & CPUID_EDX_FXSR)) {
+        PANIC("CPU lacks FXSAVE/FXRSTOR");
+    }
+
+    // Every CPU needs the same table, or a mapping's type depends on who touches it
+    bool has_pat = (d & CPUID_EDX_PAT) != 0;
+    if (!cpu_init_done) {
+        pat_enabled = has_pat;
+    } else if (pat_enabled && !has_pat) {
+        PANIC("PAT support differs between CPUs");
+    }
+    if (pat_enabled) {
+        wrmsr(MSR_PAT, PAT_VALUE);  // No PWT-only mappings exist yet to go stale
+    }
+
+    // Real FPU, and start with TS set so the first FPU/SSE use traps (#NM)
+    uint64_t cr0 = read_cr0();
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP | CR0_NE | CR0_TS;
+    write_cr0(cr0);
+
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+
+    // AVX needs its YMM halves switched with the rest: XSAVE in place of
+    // FXSAVE, for tasks and kernel SIMD alike. All CPUs use the BSP's choice.
+    bool has_avx = (c & CPUID_ECX_XSAVE) && (c & CPUID_ECX_AVX);
+    if (!cpu_init_done) {
+        fpu_xsave = has_avx;
+    } else if (fpu_xsave && !has_avx) {
+        PANIC("AVX support differs between CPUs");
+    }
+    if (fpu_xsave) {
+        cr4 |= CR4_OSXSAVE;
+    }
+
+    // PCIDE may only be set while CR3 selects PCID 0; every CPU must agree
+    bool has_pcid = (c & CPUID_ECX_PCID) && (read_cr3() & CR3_PCID_MASK) == 0;
+    if (!cpu_init_done) {
+        pcid_enabled = has_pcid;
+    } else if (pcid_enabled && !has_pcid) {
+        PANIC("PCID support differs between CPUs");
+    }
+    if (pcid_enabled) {
+        cr4 |= CR4_PCIDE;
+    }
+    write_cr4(cr4);
+
+    if (fpu_xsave) {
+        xsetbv(0, XCR0_X87 | XCR0_SSE | XCR0_AVX);
+        if (!cpu_init_done) {
+            cpuid(0x0D, &a, &b, &c, &d);
+            fpu_state_size = b;  // Area for the components now enabled
+        }
+    }
+
+    cpu_init_syscall();
+
+    if (!cpu_init_done) {
+        cpuid(0, &a, &b, &c, &d);
+        if (a >= 7) {
+            cpuid(7, &a, &b, &c, &d);
+            avx2_enabled = fpu_xsave && (b & CPUID_7_EBX_AVX2);
+            erms_enabled = (b & CPUID_7_EBX_ERMS) != 0;
+            fsrm_enabled = (d & CPUID_7_EDX_FSRM) != 0;
+        }
+        // String routines pick their strategy once; APs share the BSP's choice
+        mem_init(erms_enabled, fsrm_enabled);
+
+        cpu_init_done = true;
+        KINFO("CPU features: %s, lazy FPU, SYSCALL%s%s%s%s%s", fpu_xsave ? "XSAVE" : "FXSR",
+              pcid_enabled ? ", PCID" : "", avx2_enabled ? ", AVX2" : "",
+              pat_enabled ? ", PAT" : "", erms_enabled ? ", ERMS" : "",
+              fsrm_enabled ? ", FSRM" : "");
+    }
+}
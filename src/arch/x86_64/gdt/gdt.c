@@ -1,4 +1,5 @@
 #include "kernel.h"
+#include "cpu.h"
 
 /*
  * Global Descriptor Table (GDT) management for x86-64
@@ -33,10 +34,31 @@ typedef struct {
     uintptr_t base;
 } __attribute__((packed)) gdt_pointer_t;
 
+// 64-bit task state segment: only the stack pointers are used
+typedef struct {
+    uint32_t reserved0;
+    uint64_t rsp[3];              // rsp[0]: stack for interrupts from ring 3
+    uint64_t reserved1;
+    uint64_t ist[7];              // ist[n - 1]: stack for IDT entries with IST n
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;          // Past the limit: no I/O permission bitmap
+} __attribute__((packed)) tss_t;
+
+// Five segments, then a 16-byte TSS descriptor (two slots) per CPU
+#define GDT_SEGMENTS   5
+#define GDT_ENTRIES    (GDT_SEGMENTS + 2 * MAX_CPUS)
+
+// Only needs to last long enough to report the fault
+#define IST_STACK_SIZE 4096
+
 // Global GDT table and descriptor
-static gdt_entry_t gdt[5];
+static gdt_entry_t gdt[GDT_ENTRIES];
 static gdt_pointer_t gdt_ptr;
 
+static tss_t tss[MAX_CPUS];
+static uint8_t ist_stacks[MAX_CPUS][IST_COUNT][IST_STACK_SIZE] __attribute__((aligned(16)));
+
 // Access byte bitfield definitions
 #define GDT_ACCESS_PRESENT        0x80  // Segment is present in memory
 #define GDT_ACCESS_RING0          0x00  // Privilege level 0 (kernel)
@@ -50,19 +72,25 @@ static gdt_pointer_t gdt_ptr;
 // Granularity byte settings
 #define GDT_GRANULARITY_4K        0x80  // 4KB granularity for limit
 #define GDT_GRANULARITY_32BIT     0x40  // 32-bit operand size default
+#define GDT_GRANULARITY_LONG      0x20  // 64-bit code segment (L bit)
+
+// System descriptor type for an available 64-bit TSS
+#define GDT_TYPE_TSS_AVAILABLE    0x09
 
 // Common segment selectors used throughout the kernel
 #define KERNEL_CODE_SEGMENT 0x08  // Kernel code segment selector
 #define KERNEL_DATA_SEGMENT 0x10  // Kernel data segment selector
-#define USER_CODE_SEGMENT   0x18  // User code segment selector
-#define USER_DATA_SEGMENT   0x20  // User data segment selector
-#define TSS_SEGMENT         0x28  // Task State Segment selector
+// SYSRET loads SS from STAR+8 and CS from STAR+16, so user data comes first
+#define USER_DATA_SEGMENT   0x18  // User data segment selector
+#define USER_CODE_SEGMENT   0x20  // User code segment selector
+#define TSS_SEGMENT         0x28  // CPU 0's Task State Segment; CPU n's is 16n above
 
 /*
  * Forward declaration for GDT entry setup function
  */
 static void gdt_set_entry(int index, uint32_t base, uint32_t limit,
                          uint8_t access, uint8_t granularity);
+void gdt_load(void);
 
 /*
  * Initialize the Global Descriptor Table
@@ -79,11 +107,11 @@ void gdt_init(void)
     // Null descriptor - required by x86 architecture
     gdt_set_entry(0, 0, 0, 0, 0);
 
-    // Kernel code segment: ring 0, executable, readable
+    // Kernel code segment: ring 0, executable, readable, 64-bit
     gdt_set_entry(1, 0, 0xFFFFFFFF,
                   GDT_ACCESS_PRESENT | GDT_ACCESS_RING0 | GDT_ACCESS_SYSTEM |
                   GDT_ACCESS_EXECUTABLE | GDT_ACCESS_PRIVILEGE,
-                  GDT_GRANULARITY_4K | GDT_GRANULARITY_32BIT);
+                  GDT_GRANULARITY_4K | GDT_GRANULARITY_LONG);
 
     // Kernel data segment: ring 0, writable, accessible
     gdt_set_entry(2, 0, 0xFFFFFFFF,
@@ -91,18 +119,75 @@ void gdt_init(void)
                   GDT_ACCESS_PRIVILEGE | GDT_ACCESS_DATA_WRITABLE,
                   GDT_GRANULARITY_4K | GDT_GRANULARITY_32BIT);
 
-    // User code segment: ring 3, executable, readable
+    // User data segment: ring 3, writable, accessible
     gdt_set_entry(3, 0, 0xFFFFFFFF,
                   GDT_ACCESS_PRESENT | GDT_ACCESS_RING3 | GDT_ACCESS_SYSTEM |
-                  GDT_ACCESS_EXECUTABLE | GDT_ACCESS_PRIVILEGE,
+                  GDT_ACCESS_PRIVILEGE | GDT_ACCESS_DATA_WRITABLE,
                   GDT_GRANULARITY_4K | GDT_GRANULARITY_32BIT);
 
-    // User data segment: ring 3, writable, accessible
+    // User code segment: ring 3, executable, readable, 64-bit
     gdt_set_entry(4, 0, 0xFFFFFFFF,
                   GDT_ACCESS_PRESENT | GDT_ACCESS_RING3 | GDT_ACCESS_SYSTEM |
-                  GDT_ACCESS_PRIVILEGE | GDT_ACCESS_DATA_WRITABLE,
-                  GDT_GRANULARITY_4K | GDT_GRANULARITY_32BIT);
+                  GDT_ACCESS_EXECUTABLE | GDT_ACCESS_PRIVILEGE,
+                  GDT_GRANULARITY_4K | GDT_GRANULARITY_LONG);
+
+    gdt_load();
+    tss_install(0);
+
+    KINFO("GDT initialized successfully");
+}
 
+/*
+ * Give the calling CPU its TSS: the descriptor, the IST stacks for double
+ * faults, NMIs and machine checks, and LTR. APs call this after gdt_load().
+ */
+void tss_install(int cpu)
+{
+    tss_t* t = &tss[cpu];
+    memset(t, 0, sizeof(*t));
+    t->iomap_base = sizeof(tss_t);
+
+    // Each IST entry sits 16 bytes below its stack top, so the hardware
+    // frame goes below it: the slot at the entry holds this CPU's per-CPU
+    // block for the IST stubs (tss_set_percpu), the one above is padding
+    for (int i = 0; i < IST_COUNT; i++) {
+        t->ist[i] = (uintptr_t)&ist_stacks[cpu][i][IST_STACK_SIZE - 16];
+    }
+
+    uintptr_t base = (uintptr_t)t;
+    gdt_extended_entry_t* desc = (gdt_extended_entry_t*)&gdt[GDT_SEGMENTS + 2 * cpu];
+    desc->limit_low = sizeof(tss_t) - 1;
+    desc->base_low = base & 0xFFFF;
+    desc->base_middle = (base >> 16) & 0xFF;
+    desc->access = GDT_ACCESS_PRESENT | GDT_ACCESS_RING0 | GDT_TYPE_TSS_AVAILABLE;
+    desc->granularity = 0;
+    desc->base_high = (base >> 24) & 0xFF;
+    desc->base_upper = base >> 32;
+    desc->reserved = 0;
+
+    uint16_t selector = TSS_SEGMENT + 16 * cpu;
+    __asm__ volatile("ltr %0" : : "r"(selector));
+}
+
+void tss_set_percpu(int cpu, void* percpu)
+{
+    for (int i = 0; i < IST_COUNT; i++) {
+        *(void**)&ist_stacks[cpu][i][IST_STACK_SIZE - 16] = percpu;
+    }
+}
+
+// Context switch: the next task's kernel stack takes ring 3 interrupts
+void tss_set_rsp0(int cpu, uintptr_t rsp0)
+{
+    tss[cpu].rsp[0] = rsp0;
+}
+
+/*
+ * Load the GDT on the calling CPU and reload segment registers
+ * (BSP from gdt_init, APs during SMP bring-up)
+ */
+void gdt_load(void)
+{
     // Load GDT register with our table
     __asm__ volatile("lgdt %0" : : "m"(gdt_ptr));
 
@@ -115,12 +200,10 @@ void gdt_init(void)
         "mov %ax, %gs\n"
         "mov %ax, %ss\n"
         "push $0x08\n"
-        "push $.reload_cs\n"
+        "push $1f\n"
         ".byte 0x48, 0xcb\n"  // RETFQ: return from far, quadword (64-bit)
-        ".reload_cs:\n"
+        "1:\n"
     );
-
-    KINFO("GDT initialized successfully");
 }
 
 /*
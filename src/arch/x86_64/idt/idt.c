@@ -1,4 +1,6 @@
 #include "kernel.h"
+#include "smp.h"
+#include "cpu.h"
 
 /*
  * Interrupt Descriptor Table (IDT) for x86-64
@@ -72,14 +74,18 @@ static idt_pointer_t idt_ptr;
 // External function declarations
 extern void interrupt_handler(void);  // C handler for interrupts
 extern void* isr_table[];             // Table of ISR entry points
+extern void* isr_apic_table[];        // LAPIC timer, reschedule IPI, spurious, TLB IPI, drain IPI
+extern void* isr_msi_table[];         // Device MSI vectors
 
 // Type attributes for IDT entries
 #define IDT_TYPE_INTERRUPT_GATE 0x8E
 #define IDT_TYPE_TRAP_GATE      0x8F
+#define IDT_TYPE_USER_INTERRUPT 0xEE  // DPL 3: reachable with INT from ring 3
 
 // Forward declarations
 static void idt_set_entry(uint8_t num, uintptr_t offset, uint16_t selector,
                          uint8_t type_attr);
+void idt_load(void);
 
 // Initialize IDT
 void idt_init(void)
@@ -99,12 +105,33 @@ void idt_init(void)
     }
 
     // Set up system call ISR (128) - stored at index 48 in the table
-    idt_set_entry(128, (uintptr_t)isr_table[48], 0x08, IDT_TYPE_INTERRUPT_GATE);
+    idt_set_entry(128, (uintptr_t)isr_table[48], 0x08, IDT_TYPE_USER_INTERRUPT);
+
+    // Their own stacks (gdt.c): no trust in RSP, and the stubs fix up GS
+    idt[DOUBLE_FAULT].ist = IST_DOUBLE_FAULT;
+    idt[NON_MASKABLE_INT].ist = IST_NMI;
+    idt[MACHINE_CHECK].ist = IST_MACHINE_CHECK;
+
+    // Local APIC vectors
+    idt_set_entry(APIC_TIMER_VECTOR, (uintptr_t)isr_apic_table[0], 0x08, IDT_TYPE_INTERRUPT_GATE);
+    idt_set_entry(APIC_RESCHED_VECTOR, (uintptr_t)isr_apic_table[1], 0x08, IDT_TYPE_INTERRUPT_GATE);
+    idt_set_entry(APIC_SPURIOUS_VECTOR, (uintptr_t)isr_apic_table[2], 0x08, IDT_TYPE_INTERRUPT_GATE);
+    idt_set_entry(APIC_TLB_VECTOR, (uintptr_t)isr_apic_table[3], 0x08, IDT_TYPE_INTERRUPT_GATE);
+    idt_set_entry(APIC_DRAIN_VECTOR, (uintptr_t)isr_apic_table[4], 0x08, IDT_TYPE_INTERRUPT_GATE);
+    for (int i = 0; i < APIC_MSI_VECTOR_COUNT; i++) {
+        idt_set_entry(APIC_MSI_VECTOR_BASE + i, (uintptr_t)isr_msi_table[i], 0x08,
+                      IDT_TYPE_INTERRUPT_GATE);
+    }
 
-    // Load IDT
-    __asm__ volatile("lidt %0" : : "m"(idt_ptr));
+    idt_load();
+
+    KINFO("IDT initialized with %d entries", 52);
+}
 
-    KINFO("IDT initialized with %d entries", 49);
+// Load the shared IDT on the calling CPU (APs reuse the BSP's table)
+void idt_load(void)
+{
+    __asm__ volatile("lidt %0" : : "m"(idt_ptr));
 }
 
 // Set an IDT entry
@@ -1,20 +1,24 @@
 #include "kernel.h"
+#include "smp.h"
+#include "vmm.h"
+#include "cpu.h"
+#include "syscalls.h"
 
 /*
  * Interrupt dispatcher
  * Routes interrupts to appropriate handlers
  */
 
-// Interrupt frame structure (matches assembly push order)
+// Interrupt frame structure (SAVE_REGS in isrs.asm), lowest address first
 typedef struct interrupt_frame {
-    // Bottom of stack (pushed first)
-    uint64_t error_code;
-    uint64_t interrupt_number;
+    // Pushed by the ISR stub, last first
+    uint64_t gs, fs, es, ds;
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
 
-    // Pushed by isr_common_stub
-    uint64_t rax, rbx, rcx, rdx, rsi, rdi, rbp;
-    uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
-    uint64_t ds, es, fs, gs;
+    // Pushed by the per-vector entry (error code by the CPU for some)
+    uint64_t interrupt_number;
+    uint64_t error_code;
 
     // Pushed by CPU
     uint64_t rip, cs, rflags, rsp, ss;
@@ -66,7 +70,13 @@ void interrupt_handler(interrupt_frame_t* frame)
 {
     uint8_t int_num = frame->interrupt_number;
 
-    if (int_num < 32) {
+    if (int_num == 7) {
+        // Device not available: lazy FPU/SSE state load
+        scheduler_fpu_trap();
+    } else if (int_num == 2 && pmu_handle_nmi(frame->rip, frame->rbp, frame->rsp,
+                                              (frame->cs & 3) != 0)) {
+        // NMI from the profiler's sampling counter
+    } else if (int_num < 32) {
         // CPU exception
         handle_exception(frame);
     } else if (int_num >= 32 && int_num < 48) {
@@ -75,6 +85,13 @@ void interrupt_handler(interrupt_frame_t* frame)
     } else if (int_num == 128) {
         // System call
         handle_syscall(frame);
+    } else if (int_num == APIC_TIMER_VECTOR || int_num == APIC_RESCHED_VECTOR ||
+               int_num == APIC_TLB_VECTOR || int_num == APIC_DRAIN_VECTOR ||
+               int_num == APIC_SPURIOUS_VECTOR ||
+               (int_num >= APIC_MSI_VECTOR_BASE &&
+                int_num < APIC_MSI_VECTOR_BASE + APIC_MSI_VECTOR_COUNT)) {
+        // Local APIC (per-CPU timer, IPIs, device MSIs)
+        apic_handle_interrupt(int_num);
     } else {
         // Unknown interrupt
         KERROR("Unknown interrupt: %u", int_num);
@@ -86,6 +103,15 @@ static void handle_exception(interrupt_frame_t* frame)
 {
     uint8_t exception = frame->interrupt_number;
 
+    // Demand paging and copy-on-write: retry the access once it is mapped
+    if (exception == 14) {
+        uint64_t cr2;
+        __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+        if (vmm_page_fault_handler(cr2, (uint32_t)frame->error_code) == 0) {
+            return;
+        }
+    }
+
     KERROR("CPU Exception %u: %s", exception, exception_messages[exception]);
 
     // Print additional info for page faults
@@ -133,11 +159,16 @@ static void handle_irq(interrupt_frame_t* frame)
     // Handle specific IRQs
     switch (irq_num) {
         case 0:  // Timer
+            // EOI first: the tick may switch to another task's stack
+            pic_eoi(irq_num);
             timer_tick();
-            break;
+            return;
         case 1:  // Keyboard
             keyboard_handler();
             break;
+        case 4:  // COM1: transmit FIFO empty
+            serial_irq_handler();
+            break;
         default:
             // Unknown IRQ - just log it
             KWARN("Unhandled IRQ: %u (INT %u)", irq_num, int_num);
@@ -159,6 +190,13 @@ static void handle_syscall(interrupt_frame_t* frame)
     uint64_t arg5 = frame->r8;
     uint64_t arg6 = frame->r9;
 
+    // fork copies and execve rewrites the syscall_frame_t that only
+    // syscall_entry builds; here the user state is in this interrupt frame
+    if (syscall_num == SYS_fork || syscall_num == SYS_execve) {
+        frame->rax = (uint64_t)-1;
+        return;
+    }
+
     // Dispatch to syscall table
     int64_t retval = syscall_dispatch(syscall_num, arg1, arg2, arg3, arg4, arg5, arg6);
 
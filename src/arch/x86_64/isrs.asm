@@ -24,16 +24,30 @@ isr%1:
     jmp isr_common_stub
 %endmacro
 
+; Vectors with an IST stack: the same, through isr_paranoid_stub
+%macro ISR_PARANOID 1
+isr%1:
+    push byte 0                 ; Push dummy error code
+    push byte %1                ; Push interrupt number
+    jmp isr_paranoid_stub
+%endmacro
+
+%macro ISR_PARANOID_ERRCODE 1
+isr%1:
+    push byte %1                ; Push interrupt number
+    jmp isr_paranoid_stub
+%endmacro
+
 ; CPU exception ISRs (0-31)
 ISR_NOERRCODE 0         ; Division by zero
 ISR_NOERRCODE 1         ; Debug
-ISR_NOERRCODE 2         ; Non-maskable interrupt
+ISR_PARANOID  2         ; Non-maskable interrupt
 ISR_NOERRCODE 3         ; Breakpoint
 ISR_NOERRCODE 4         ; Overflow
 ISR_NOERRCODE 5         ; Bound range exceeded
 ISR_NOERRCODE 6         ; Invalid opcode
 ISR_NOERRCODE 7         ; Device not available
-ISR_ERRCODE   8         ; Double fault
+ISR_PARANOID_ERRCODE 8  ; Double fault
 ISR_NOERRCODE 9         ; Coprocessor segment overrun
 ISR_ERRCODE   10        ; Invalid TSS
 ISR_ERRCODE   11        ; Segment not present
@@ -43,7 +57,7 @@ ISR_ERRCODE   14        ; Page fault
 ISR_NOERRCODE 15        ; Reserved
 ISR_NOERRCODE 16        ; x87 FPU error
 ISR_ERRCODE   17        ; Alignment check
-ISR_NOERRCODE 18        ; Machine check
+ISR_PARANOID  18        ; Machine check
 ISR_NOERRCODE 19        ; SIMD floating point exception
 ISR_NOERRCODE 20        ; Virtualization exception
 ISR_NOERRCODE 21        ; Reserved
@@ -79,9 +93,23 @@ ISR_NOERRCODE 47        ; IRQ 15 - Secondary ATA
 ; System call interrupt (int 0x80)
 ISR_NOERRCODE 128       ; System call
 
-; Common ISR stub
-isr_common_stub:
-    ; Save all registers
+; Local APIC vectors
+ISR_NOERRCODE 48        ; LAPIC timer
+ISR_NOERRCODE 49        ; Reschedule IPI
+ISR_NOERRCODE 50        ; TLB shootdown IPI
+ISR_NOERRCODE 51        ; Heap drain IPI
+ISR_NOERRCODE 255       ; Spurious
+
+; Device MSI vectors (APIC_MSI_VECTOR_BASE..)
+%assign i 64
+%rep 24
+ISR_NOERRCODE i
+%assign i i+1
+%endrep
+
+; Register save area, laid out as interrupt_frame_t (interrupt.c) from
+; the lowest address up. Segment selectors take a full slot each.
+%macro SAVE_REGS 0
     push rax
     push rbx
     push rcx
@@ -98,38 +126,32 @@ isr_common_stub:
     push r14
     push r15
 
-    ; Save segment registers
     mov ax, ds
-    push ax
+    push rax
     mov ax, es
-    push ax
+    push rax
     mov ax, fs
-    push ax
+    push rax
     mov ax, gs
-    push ax
+    push rax
 
-    ; Load kernel data segment
+    ; Load kernel data segment (GS is left alone: writing the selector
+    ; would clear the GS base)
     mov ax, 0x10
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
-
-    ; Pass pointer to interrupt frame
-    mov rdi, rsp
-    call interrupt_handler
+%endmacro
 
-    ; Restore segment registers
-    pop ax
-    mov gs, ax
-    pop ax
+%macro RESTORE_REGS 0
+    pop rax                     ; GS selector, see above
+    pop rax
     mov fs, ax
-    pop ax
+    pop rax
     mov es, ax
-    pop ax
+    pop rax
     mov ds, ax
 
-    ; Restore all registers
     pop r15
     pop r14
     pop r13
@@ -145,14 +167,68 @@ isr_common_stub:
     pop rcx
     pop rbx
     pop rax
+%endmacro
+
+REGS_SIZE    equ 19 * 8         ; What SAVE_REGS pushes
+MSR_GS_BASE  equ 0xC0000101
+
+; Common ISR stub. From ring 3 (CS RPL 3 in the CPU's frame) the GS base
+; is the user's, so swapgs fetches the per-CPU block on the way in and puts
+; it back on the way out; from ring 0 it is already in place.
+isr_common_stub:
+    test qword [rsp + 24], 3    ; CS, above the vector and error code
+    jz .from_kernel
+    swapgs
+.from_kernel:
+
+    SAVE_REGS
+
+    ; Pass pointer to interrupt frame
+    mov rdi, rsp
+    call interrupt_handler
+
+    RESTORE_REGS
 
     ; Clean up error code and interrupt number
     add rsp, 16
 
+    test qword [rsp + 8], 3     ; CS
+    jz .to_kernel
+    swapgs
+.to_kernel:
+
     ; Re-enable interrupts and return
     sti
     iretq
 
+; IST vectors (#DF, NMI, #MC) can land in ring 0 between syscall_entry and
+; its swapgs, or between the exit swapgs and SYSRET, so CS says nothing
+; about the GS base. They take this CPU's per-CPU block from the slot at
+; their IST entry (tss_install) and put the interrupted base back after.
+isr_paranoid_stub:
+    SAVE_REGS
+
+    mov ecx, MSR_GS_BASE
+    rdmsr
+    mov r12d, eax               ; Callee-saved: survives the handler
+    mov r13d, edx
+    mov rax, [rsp + REGS_SIZE + 16 + 40]  ; Past vector, error code and CPU frame
+    mov rdx, rax
+    shr rdx, 32
+    wrmsr
+
+    mov rdi, rsp
+    call interrupt_handler
+
+    mov ecx, MSR_GS_BASE
+    mov eax, r12d
+    mov edx, r13d
+    wrmsr
+
+    RESTORE_REGS
+    add rsp, 16
+    iretq
+
 ; ISR handler table (only defined ISRs)
 GLOBAL isr_table
 isr_table:
@@ -171,3 +247,21 @@ isr_table:
 
     ; Fill the rest of potential IDT entries with null
     times (256-49) dq 0
+
+; Local APIC handlers, installed by idt_init()
+GLOBAL isr_apic_table
+isr_apic_table:
+    dq isr48
+    dq isr49
+    dq isr255
+    dq isr50
+    dq isr51
+
+; Device MSI handlers, one per APIC_MSI_VECTOR_COUNT
+GLOBAL isr_msi_table
+isr_msi_table:
+    %assign i 64
+    %rep 24
+        dq isr%+i
+    %assign i i+1
+    %endrep
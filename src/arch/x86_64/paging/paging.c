@@ -1,4 +1,5 @@
 #include "kernel.h"
+#include "cpu.h"
 
 /*
  * 4-level paging implementation for x86-64
@@ -18,6 +19,15 @@
 #define PTE_GLOBAL        0x100
 #define PTE_PAT           0x080
 #define PTE_NX            (1ULL << 63)
+#define PTE_ADDR_MASK     0x000FFFFFFFFFF000ULL
+#define PTE_FLAGS_MASK    (PTE_NX | 0xFFFULL)
+
+// CPUID.80000001H:EDX
+#define CPUID_EXT_PDPE1GB (1U << 26)
+
+// Direct map of physical memory, RAM and the MMIO hole below 4GB
+#define DIRECT_MAP_GB_1G  64   // 1GB pages: entries in the existing PDPT only
+#define DIRECT_MAP_GB_2M  4    // 2MB fallback: one static page directory per GB
 
 // Page table entry structure (64-bit)
 typedef uint64_t pte_t;
@@ -31,6 +41,10 @@ static pte_t* pml4;
 // Physical address of current page table
 static uintptr_t current_page_table;
 
+// Page directories for the 2MB direct map: static, so they exist before the PMM
+static pte_t direct_map_pds[DIRECT_MAP_GB_2M][512] __attribute__((aligned(PAGE_SIZE)));
+static bool huge_1g_supported = false;
+
 // Memory layout constants
 #define KERNEL_PML4_INDEX   511  // Higher half (0xFFFFFFFF80000000)
 #define KERNEL_PDPT_INDEX   510
@@ -38,6 +52,7 @@ static uintptr_t current_page_table;
 // Forward declarations
 static void paging_create_kernel_tables(void);
 static pte_t* paging_alloc_page_table(void);
+static void paging_build_direct_map(void);
 
 // Initialize paging (bootloader already set up identity mapping)
 void paging_init(void)
@@ -63,6 +78,15 @@ void paging_init(void)
         KINFO("Paging enabled and verified");
     }
 
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, &a, &b, &c, &d);
+    if (a >= 0x80000001) {
+        cpuid(0x80000001, &a, &b, &c, &d);
+        huge_1g_supported = (d & CPUID_EXT_PDPE1GB) != 0;
+    }
+
+    paging_build_direct_map();
+
     KINFO("Paging setup verified (identity mapping active)");
 }
 
@@ -102,10 +126,84 @@ static void paging_create_kernel_tables(void)
     current_page_table = (uintptr_t)pml4;
 }
 
+// The boot tables only cover the first 2MB: identity-map physical memory
+// with the largest pages the CPU offers. All of PML4[0] stays the
+// kernel's; user mappings start above it (USER_SPACE_START, vmm.h).
+static void paging_build_direct_map(void)
+{
+    pte_t* pdpt = (pte_t*)(pml4[0] & PTE_ADDR_MASK);
+
+    if (huge_1g_supported) {
+        for (uint64_t gb = 0; gb < DIRECT_MAP_GB_1G; gb++) {
+            pdpt[gb] = (gb * PAGE_SIZE_1G) | PTE_PRESENT | PTE_WRITABLE | PTE_PAGE_SIZE_BIT;
+        }
+    } else {
+        for (uint64_t gb = 0; gb < DIRECT_MAP_GB_2M; gb++) {
+            for (uint64_t i = 0; i < 512; i++) {
+                direct_map_pds[gb][i] = (gb * PAGE_SIZE_1G + i * PAGE_SIZE_2M) |
+                                        PTE_PRESENT | PTE_WRITABLE | PTE_PAGE_SIZE_BIT;
+            }
+            pdpt[gb] = (uintptr_t)direct_map_pds[gb] | PTE_PRESENT | PTE_WRITABLE;
+        }
+    }
+    write_cr3(read_cr3());
+
+    KINFO("Direct map: %u GB with %s pages",
+          huge_1g_supported ? DIRECT_MAP_GB_1G : DIRECT_MAP_GB_2M,
+          huge_1g_supported ? "1GB" : "2MB");
+}
+
+bool paging_has_1g_pages(void)
+{
+    return huge_1g_supported;
+}
+
 /*
  * Virtual Memory Manager functions
  */
 
+// Break a huge entry into a table of the next smaller size, same translation
+static int paging_split_huge(pte_t* entry, uint64_t huge_size)
+{
+    page_table_t table = paging_alloc_page_table();
+    if (!table) return -1;
+
+    uint64_t child_size = huge_size / 512;
+    uint64_t base = *entry & PTE_ADDR_MASK & ~(huge_size - 1);
+    uint64_t flags = *entry & PTE_FLAGS_MASK & ~(PTE_ACCESSED | PTE_DIRTY);
+    if (child_size == PAGE_SIZE) {
+        flags &= ~PTE_PAGE_SIZE_BIT;  // Bit 7 is PAT in a 4KB PTE
+    }
+
+    for (uint64_t i = 0; i < 512; i++) {
+        table[i] = (base + i * child_size) | flags;
+    }
+    *entry = (uintptr_t)table | PTE_PRESENT | PTE_WRITABLE | (*entry & PTE_USER);
+
+    // The large TLB entry may cover more than the page about to change
+    write_cr3(read_cr3());
+    return 0;
+}
+
+// Table below entry; allocates a missing one if asked, splits a huge page
+static page_table_t paging_next_table(pte_t* entry, uint64_t entry_size,
+                                      uint64_t table_user, bool create)
+{
+    if (!(*entry & PTE_PRESENT)) {
+        if (!create) return NULL;
+        page_table_t table = paging_alloc_page_table();
+        if (!table) return NULL;
+        memset(table, 0, PAGE_SIZE);
+        *entry = ((uintptr_t)table) | PTE_PRESENT | PTE_WRITABLE;
+    } else if (*entry & PTE_PAGE_SIZE_BIT) {
+        if (paging_split_huge(entry, entry_size) < 0) return NULL;
+    }
+
+    // User mappings need the U bit on every level of the walk, not just the PTE
+    *entry |= table_user;
+    return (page_table_t)(*entry & PTE_ADDR_MASK);
+}
+
 // Map a virtual page to a physical page
 int vmm_map_page(uint64_t virtual_addr, uintptr_t physical_addr, uint32_t flags)
 {
@@ -118,35 +216,15 @@ int vmm_map_page(uint64_t virtual_addr, uintptr_t physical_addr, uint32_t flags)
     uint16_t pdpt_index = (virtual_addr >> 30) & 0x1FF;
     uint16_t pd_index = (virtual_addr >> 21) & 0x1FF;
     uint16_t pt_index = (virtual_addr >> 12) & 0x1FF;
+    uint64_t table_user = flags & PTE_USER;
 
-    // Ensure PML4 entry exists
-    if (!(pml4[pml4_index] & PTE_PRESENT)) {
-        page_table_t pdpt = paging_alloc_page_table();
-        if (!pdpt) return -1;
-        memset(pdpt, 0, PAGE_SIZE);
-        pml4[pml4_index] = ((uintptr_t)pdpt) | PTE_PRESENT | PTE_WRITABLE;
-    }
-
-    // Get PDPT
-    page_table_t pdpt = (page_table_t)(pml4[pml4_index] & ~0xFFFULL);
-    if (!(pdpt[pdpt_index] & PTE_PRESENT)) {
-        page_table_t pd = paging_alloc_page_table();
-        if (!pd) return -1;
-        memset(pd, 0, PAGE_SIZE);
-        pdpt[pdpt_index] = ((uintptr_t)pd) | PTE_PRESENT | PTE_WRITABLE;
-    }
-
-    // Get PD
-    page_table_t pd = (page_table_t)(pdpt[pdpt_index] & ~0xFFFULL);
-    if (!(pd[pd_index] & PTE_PRESENT)) {
-        page_table_t pt = paging_alloc_page_table();
-        if (!pt) return -1;
-        memset(pt, 0, PAGE_SIZE);
-        pd[pd_index] = ((uintptr_t)pt) | PTE_PRESENT | PTE_WRITABLE;
-    }
+    page_table_t pdpt = paging_next_table(&pml4[pml4_index], 0, table_user, true);
+    if (!pdpt) return -1;
+    page_table_t pd = paging_next_table(&pdpt[pdpt_index], PAGE_SIZE_1G, table_user, true);
+    if (!pd) return -1;
+    page_table_t pt = paging_next_table(&pd[pd_index], PAGE_SIZE_2M, table_user, true);
+    if (!pt) return -1;
 
-    // Get PT and set PTE
-    page_table_t pt = (page_table_t)(pd[pd_index] & ~0xFFFULL);
     pt[pt_index] = (physical_addr) | flags | PTE_PRESENT;
 
     // Flush TLB for this page
@@ -155,31 +233,60 @@ int vmm_map_page(uint64_t virtual_addr, uintptr_t physical_addr, uint32_t flags)
     return 0;
 }
 
-// Unmap a virtual page
-int vmm_unmap_page(uint64_t virtual_addr)
+// Map one 2MB or 1GB page (both addresses aligned to size)
+int vmm_map_huge_page(uint64_t virtual_addr, uintptr_t physical_addr, uint32_t flags,
+                      uint64_t size)
 {
-    virtual_addr &= ~(PAGE_SIZE - 1);
+    if (size != PAGE_SIZE_2M && (size != PAGE_SIZE_1G || !huge_1g_supported)) {
+        return -1;
+    }
+    if ((virtual_addr | physical_addr) & (size - 1)) {
+        return -1;
+    }
 
     uint16_t pml4_index = (virtual_addr >> 39) & 0x1FF;
+    uint16_t pdpt_index = (virtual_addr >> 30) & 0x1FF;
+    uint16_t pd_index = (virtual_addr >> 21) & 0x1FF;
+    uint64_t table_user = flags & PTE_USER;
 
-    if (!(pml4[pml4_index] & PTE_PRESENT))
-        return -1;
+    page_table_t pdpt = paging_next_table(&pml4[pml4_index], 0, table_user, true);
+    if (!pdpt) return -1;
 
-    page_table_t pdpt = (page_table_t)(pml4[pml4_index] & ~0xFFFULL);
+    pte_t* entry = &pdpt[pdpt_index];
+    if (size == PAGE_SIZE_2M) {
+        page_table_t pd = paging_next_table(entry, PAGE_SIZE_1G, table_user, true);
+        if (!pd) return -1;
+        entry = &pd[pd_index];
+    }
 
-    uint16_t pdpt_index = (virtual_addr >> 30) & 0x1FF;
-    if (!(pdpt[pdpt_index] & PTE_PRESENT))
+    // Refuse to drop a table of smaller mappings; the caller falls back to 4KB
+    if ((*entry & PTE_PRESENT) && !(*entry & PTE_PAGE_SIZE_BIT)) {
         return -1;
+    }
 
-    page_table_t pd = (page_table_t)(pdpt[pdpt_index] & ~0xFFFULL);
+    *entry = physical_addr | flags | PTE_PAGE_SIZE_BIT | PTE_PRESENT;
+    __asm__ volatile("invlpg (%0)" : : "r"(virtual_addr));
 
-    uint16_t pd_index = (virtual_addr >> 21) & 0x1FF;
-    if (!(pd[pd_index] & PTE_PRESENT))
-        return -1;
+    return 0;
+}
 
-    page_table_t pt = (page_table_t)(pd[pd_index] & ~0xFFFULL);
+// Unmap a virtual page (part of a huge page is split out first)
+int vmm_unmap_page(uint64_t virtual_addr)
+{
+    virtual_addr &= ~(PAGE_SIZE - 1);
 
+    uint16_t pml4_index = (virtual_addr >> 39) & 0x1FF;
+    uint16_t pdpt_index = (virtual_addr >> 30) & 0x1FF;
+    uint16_t pd_index = (virtual_addr >> 21) & 0x1FF;
     uint16_t pt_index = (virtual_addr >> 12) & 0x1FF;
+
+    page_table_t pdpt = paging_next_table(&pml4[pml4_index], 0, 0, false);
+    if (!pdpt) return -1;
+    page_table_t pd = paging_next_table(&pdpt[pdpt_index], PAGE_SIZE_1G, 0, false);
+    if (!pd) return -1;
+    page_table_t pt = paging_next_table(&pd[pd_index], PAGE_SIZE_2M, 0, false);
+    if (!pt) return -1;
+
     if (!(pt[pt_index] & PTE_PRESENT))
         return -1;
 
@@ -242,3 +349,9 @@ uintptr_t paging_get_physical_address(uintptr_t virtual_addr)
     // 4KB page
     return (pt[pt_index] & ~0xFFFULL) + (virtual_addr & 0xFFFULL);
 }
+
+// Translate through the active page tables (kernel.h API)
+uintptr_t vmm_get_physical(uint64_t virtual_addr)
+{
+    return paging_get_physical_address(virtual_addr);
+}
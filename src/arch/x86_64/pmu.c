@@ -0,0 +1,417 @@
+#include "kernel.h"
+#include "cpu.h"
+#include "smp.h"
+#include "io.h"
+
+/*
+ * Performance monitoring unit
+ *
+ * Architectural performance monitoring (CPUID leaf 0xA, version 2 or
+ * later) on every CPU: fixed counter 0 counts retired instructions, fixed
+ * counter 1 unhalted cycles and PMC0 last-level cache misses. They run
+ * free; the scheduler charges each task the difference between two reads
+ * at its context switches, which costs two or three RDPMCs per switch
+ * rather than saving and reloading the counter MSRs.
+ *
+ * Sampling uses PMC1, preloaded so that it overflows after a period of
+ * unhalted cycles. The overflow interrupt is delivered as an NMI, so even
+ * code running with interrupts off is sampled; the handler records the
+ * interrupted RIP and a frame-pointer walk of the kernel stack into the
+ * trace rings and reloads the counter.
+ */
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+#define MSR_PMC0              0xC1
+#define MSR_PMC1              0xC2
+#define MSR_PERFEVTSEL0       0x186
+#define MSR_PERFEVTSEL1       0x187
+#define MSR_FIXED_CTR0        0x309     // Instructions retired
+#define MSR_FIXED_CTR1        0x30A     // Unhalted core cycles
+#define MSR_FIXED_CTR_CTRL    0x38D
+#define MSR_PERF_GLOBAL_STATUS   0x38E
+#define MSR_PERF_GLOBAL_CTRL     0x38F
+#define MSR_PERF_GLOBAL_OVF_CTRL 0x390
+
+// PERFEVTSELx bits
+#define EVTSEL_USR            (1U << 16)
+#define EVTSEL_OS             (1U << 17)
+#define EVTSEL_INT            (1U << 20)
+#define EVTSEL_EN             (1U << 22)
+
+// Architectural events: event select | unit mask << 8
+#define EVENT_CYCLES          0x003C
+#define EVENT_LLC_MISSES      0x412E
+
+// CPUID 0xA EBX: set bits are events the CPU does not have
+#define CPUID_A_NO_LLC_MISSES (1U << 5)
+
+// Fixed counters 0 and 1 in ring 0 and ring 3, without PMI
+#define FIXED_CTRL_COUNT      0x33
+
+#define GLOBAL_PMC0           (1ULL << 0)
+#define GLOBAL_PMC1           (1ULL << 1)
+#define GLOBAL_FIXED0         (1ULL << 32)
+#define GLOBAL_FIXED1         (1ULL << 33)
+
+#define RDPMC_FIXED           (1U << 30)
+
+#define PROF_MIN_PERIOD       10000     // Cycles; below this the NMIs swamp the CPU
+#define PROF_MAX_PERIOD       0x7FFFFFFF // Legacy PMC writes sign-extend bit 31
+#define PROF_STACK_DEPTH      8         // Return addresses recorded per sample
+#define PROF_STACK_SPAN       16384     // How far above RSP a frame may lie
+#define PROF_REPORT_SLOTS     512       // Distinct RIPs a report can tell apart
+#define PROF_REPORT_TOP       20
+
+// Kernel text, from kernel.ld: return addresses outside it end a walk
+extern char __kernel_text_start[];
+extern char __kernel_text_end[];
+
+// ============================================================================
+// STATE
+// ============================================================================
+
+typedef struct {
+    pmu_counts_t last;         // Counter values at the last pmu_account()
+    uint32_t prof_gen;         // Sampling setup this CPU has applied
+    uint32_t prof_period;      // ... and its period (0: not sampling)
+    uint64_t samples;
+} __attribute__((aligned(64))) pmu_cpu_t;
+
+static bool pmu_enabled = false;
+static bool llc_enabled = false;
+static uint8_t pmu_version = 0;
+static uint64_t gp_mask = 0;       // Width of the programmable counters
+static uint64_t fixed_mask = 0;    // Width of the fixed counters
+static pmu_cpu_t pmu_cpus[MAX_CPUS];
+
+// Sampling setup: prof_period is published by bumping prof_gen, which
+// every CPU compares with its own on its next LAPIC tick
+static volatile uint32_t prof_period = 0;
+static volatile uint32_t prof_gen = 0;
+
+static struct {
+    uint64_t rip;
+    uint64_t count;
+} prof_slots[PROF_REPORT_SLOTS];
+static spinlock_t report_lock = SPINLOCK_INIT;
+
+static inline uint64_t rdpmc(uint32_t counter)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void pmu_read(pmu_counts_t* now)
+{
+    now->instructions = rdpmc(RDPMC_FIXED | 0);
+    now->cycles = rdpmc(RDPMC_FIXED | 1);
+    now->llc_misses = llc_enabled ? rdpmc(0) : 0;
+}
+
+// ============================================================================
+// COUNTING
+// ============================================================================
+
+bool pmu_available(void)
+{
+    return pmu_enabled;
+}
+
+// Counters wrap at their width, so deltas are taken modulo it. NULL just
+// moves the baseline (nothing to charge the elapsed counts to).
+void pmu_account(pmu_counts_t* acc)
+{
+    if (!pmu_enabled) return;
+
+    pmu_cpu_t* pc = &pmu_cpus[smp_cpu_id()];
+    pmu_counts_t now;
+    pmu_read(&now);
+    if (acc) {
+        acc->instructions += (now.instructions - pc->last.instructions) & fixed_mask;
+        acc->cycles += (now.cycles - pc->last.cycles) & fixed_mask;
+        acc->llc_misses += (now.llc_misses - pc->last.llc_misses) & gp_mask;
+    }
+    pc->last = now;
+}
+
+// ============================================================================
+// SAMPLING
+// ============================================================================
+
+static void pmu_arm_sampler(uint32_t period)
+{
+    wrmsr(MSR_PMC1, (uint64_t)(-(int64_t)period) & gp_mask);
+}
+
+// Bring this CPU's sampler in line with the current setup (IRQs off)
+static void pmu_apply(pmu_cpu_t* pc)
+{
+    uint32_t gen = __atomic_load_n(&prof_gen, __ATOMIC_ACQUIRE);
+    uint32_t period = prof_period;
+
+    uint64_t global = GLOBAL_FIXED0 | GLOBAL_FIXED1 | (llc_enabled ? GLOBAL_PMC0 : 0);
+    wrmsr(MSR_PERF_GLOBAL_CTRL, global);
+    wrmsr(MSR_PERFEVTSEL1, 0);
+    wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, GLOBAL_PMC1);
+    pc->prof_period = period;
+
+    if (period) {
+        pmu_arm_sampler(period);
+        wrmsr(MSR_PERFEVTSEL1, EVENT_CYCLES | EVTSEL_USR | EVTSEL_OS | EVTSEL_INT | EVTSEL_EN);
+        lapic_perf_nmi(true);
+        wrmsr(MSR_PERF_GLOBAL_CTRL, global | GLOBAL_PMC1);
+    } else {
+        lapic_perf_nmi(false);
+    }
+    pc->prof_gen = gen;
+}
+
+void pmu_tick(void)
+{
+    if (!pmu_enabled) return;
+
+    pmu_cpu_t* pc = &pmu_cpus[smp_cpu_id()];
+    if (pc->prof_gen != __atomic_load_n(&prof_gen, __ATOMIC_RELAXED)) {
+        pmu_apply(pc);
+    }
+}
+
+// Follow saved RBPs up the interrupted kernel stack. Nothing here may
+// fault, so every frame must lie above the last one and within
+// PROF_STACK_SPAN of the interrupted RSP, and stop at the first return
+// address outside kernel text (assembly, or code without frame pointers).
+static void pmu_walk_stack(uint64_t rbp, uint64_t rsp)
+{
+    uint64_t ret[PROF_STACK_DEPTH];
+    int depth = 0;
+    uint64_t limit = rsp + PROF_STACK_SPAN;
+
+    while (depth < PROF_STACK_DEPTH && rbp >= rsp && rbp <= limit - 16 && !(rbp & 7)) {
+        const uint64_t* frame = (const uint64_t*)rbp;
+        uint64_t addr = frame[1];
+        if (addr < (uintptr_t)__kernel_text_start || addr >= (uintptr_t)__kernel_text_end) {
+            break;
+        }
+        ret[depth++] = addr;
+        if (frame[0] <= rbp) break;
+        rbp = frame[0];
+    }
+
+    for (int i = 0; i < depth; i += 2) {
+        TRACE(TRACE_PROF_STACK, ret[i], i + 1 < depth ? ret[i + 1] : 0);
+    }
+}
+
+// NMI: a sample if the sampling counter overflowed, else someone else's
+bool pmu_handle_nmi(uint64_t rip, uint64_t rbp, uint64_t rsp, bool user)
+{
+    if (!pmu_enabled) return false;
+    if (!(rdmsr(MSR_PERF_GLOBAL_STATUS) & GLOBAL_PMC1)) return false;
+
+    pmu_cpu_t* pc = &pmu_cpus[smp_cpu_id()];
+    if (pc->prof_period) {
+        TRACE(TRACE_PROF_SAMPLE, rip, user);
+        if (!user) {
+            pmu_walk_stack(rbp, rsp);
+        }
+        pc->samples++;
+        pmu_arm_sampler(pc->prof_period);
+    }
+    wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, GLOBAL_PMC1);
+    if (pc->prof_period) {
+        lapic_perf_nmi(true);
+    }
+    return true;
+}
+
+int pmu_profile_start(uint32_t period)
+{
+    if (!pmu_enabled || period < PROF_MIN_PERIOD || period > PROF_MAX_PERIOD) {
+        return -1;
+    }
+
+    // Samples go to the trace rings; without them there is nowhere to put one
+    trace_set_mask(trace_mask | (1U << TRACE_CAT_PROF));
+    if (!(trace_mask & (1U << TRACE_CAT_PROF))) {
+        return -1;
+    }
+
+    prof_period = period;
+    __atomic_fetch_add(&prof_gen, 1, __ATOMIC_RELEASE);
+
+    uint64_t flags = irq_save();
+    pmu_apply(&pmu_cpus[smp_cpu_id()]);
+    irq_restore(flags);
+
+    KINFO("PMU: sampling every %u cycles", period);
+    return 0;
+}
+
+void pmu_profile_stop(void)
+{
+    if (!pmu_enabled) return;
+
+    prof_period = 0;
+    __atomic_fetch_add(&prof_gen, 1, __ATOMIC_RELEASE);
+
+    uint64_t flags = irq_save();
+    pmu_apply(&pmu_cpus[smp_cpu_id()]);
+    irq_restore(flags);
+
+    trace_set_mask(trace_mask & ~(1U << TRACE_CAT_PROF));
+}
+
+// ============================================================================
+// REPORTING
+// ============================================================================
+
+// Tally the kernel samples still held in the trace rings by RIP and print
+// the hottest. `make symbolize LOG=<serial log>` resolves the addresses.
+void pmu_profile_report(size_t top)
+{
+    spin_lock(&report_lock);
+    memset(prof_slots, 0, sizeof(prof_slots));
+
+    uint64_t total = 0, user = 0, unsorted = 0;
+    trace_record_t batch[16];
+    for (int cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        uint64_t cursor = 0;
+        size_t n;
+        while ((n = trace_read(cpu, &cursor, batch, sizeof(batch) / sizeof(batch[0]))) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                if (batch[i].id != TRACE_PROF_SAMPLE) continue;
+                total++;
+                if (batch[i].arg[1]) {
+                    user++;
+                    continue;
+                }
+
+                uint64_t rip = batch[i].arg[0];
+                uint32_t slot = (uint32_t)((rip * 0x9E3779B97F4A7C15ULL) >> 32) % PROF_REPORT_SLOTS;
+                uint32_t probes = 0;
+                while (prof_slots[slot].count && prof_slots[slot].rip != rip &&
+                       ++probes < PROF_REPORT_SLOTS) {
+                    slot = (slot + 1) % PROF_REPORT_SLOTS;
+                }
+                if (probes == PROF_REPORT_SLOTS) {
+                    unsorted++;
+                    continue;
+                }
+                prof_slots[slot].rip = rip;
+                prof_slots[slot].count++;
+            }
+        }
+    }
+
+    KINFO("=== Profile: %lu samples (%lu user, %lu kernel RIPs not tallied) ===",
+          total, user, unsorted);
+    for (size_t k = 0; k < top; k++) {
+        int best = -1;
+        for (int s = 0; s < PROF_REPORT_SLOTS; s++) {
+            if (prof_slots[s].count && (best < 0 || prof_slots[s].count > prof_slots[best].count)) {
+                best = s;
+            }
+        }
+        if (best < 0) break;
+        KINFO("prof: 0x%lx %lu samples", prof_slots[best].rip, prof_slots[best].count);
+        prof_slots[best].count = 0;
+    }
+    spin_unlock(&report_lock);
+}
+
+// ============================================================================
+// INITIALIZATION
+// ============================================================================
+
+static bool pmu_detect(void)
+{
+    uint32_t a, b, c, d;
+    cpuid(0, &a, &b, &c, &d);
+    if (a < 0x0A) return false;
+
+    cpuid(0x0A, &a, &b, &c, &d);
+    pmu_version = a & 0xFF;
+    uint32_t gp_count = (a >> 8) & 0xFF;
+    uint32_t gp_width = (a >> 16) & 0xFF;
+    uint32_t fixed_count = d & 0x1F;
+    uint32_t fixed_width = (d >> 5) & 0xFF;
+
+    // Version 2 brings the fixed counters and the global control MSRs
+    if (pmu_version < 2 || gp_count < 2 || fixed_count < 2 || !gp_width || !fixed_width) {
+        KINFO("PMU: no usable architectural counters (version %u)", pmu_version);
+        return false;
+    }
+
+    gp_mask = gp_width >= 64 ? ~0ULL : (1ULL << gp_width) - 1;
+    fixed_mask = fixed_width >= 64 ? ~0ULL : (1ULL << fixed_width) - 1;
+    llc_enabled = !(b & CPUID_A_NO_LLC_MISSES);
+    KINFO("PMU: version %u, %u x %u-bit counters, %u fixed%s", pmu_version, gp_count,
+          gp_width, fixed_count, llc_enabled ? ", LLC misses" : "");
+    return true;
+}
+
+// The BSP decides; APs follow (QEMU and real CPUs report the same leaf)
+void pmu_init_cpu(void)
+{
+    int cpu = smp_cpu_id();
+    if (cpu == 0) {
+        pmu_enabled = pmu_detect();
+    }
+    if (!pmu_enabled) return;
+
+    wrmsr(MSR_PERF_GLOBAL_CTRL, 0);
+    wrmsr(MSR_PERFEVTSEL0, llc_enabled ? (EVENT_LLC_MISSES | EVTSEL_USR | EVTSEL_OS | EVTSEL_EN) : 0);
+    wrmsr(MSR_PERFEVTSEL1, 0);
+    wrmsr(MSR_PMC0, 0);
+    wrmsr(MSR_FIXED_CTR0, 0);
+    wrmsr(MSR_FIXED_CTR1, 0);
+    wrmsr(MSR_FIXED_CTR_CTRL, FIXED_CTRL_COUNT);
+    wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, GLOBAL_PMC0 | GLOBAL_PMC1 | GLOBAL_FIXED0 | GLOBAL_FIXED1);
+
+    // Sampling, if it is on, starts with the next tick
+    pmu_cpus[cpu].prof_gen = (uint32_t)-1;
+    memset(&pmu_cpus[cpu].last, 0, sizeof(pmu_counts_t));
+    wrmsr(MSR_PERF_GLOBAL_CTRL, GLOBAL_FIXED0 | GLOBAL_FIXED1 | (llc_enabled ? GLOBAL_PMC0 : 0));
+}
+
+void pmu_get_stats(void)
+{
+    KINFO("=== PMU Statistics ===");
+    if (!pmu_enabled) {
+        KINFO("No architectural performance counters");
+        return;
+    }
+
+    KINFO("Sampling: %s (period %u cycles)", prof_period ? "on" : "off", prof_period);
+    for (int cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        KINFO("CPU %d: %lu samples", cpu, pmu_cpus[cpu].samples);
+    }
+}
+
+// ============================================================================
+// SYSCALL INTERFACE
+// ============================================================================
+
+// Nonzero: start sampling every period cycles. Zero: stop and print the
+// report to the kernel log.
+int64_t sys_prof_ctl(uint32_t period)
+{
+    if (period) {
+        return pmu_profile_start(period);
+    }
+    if (!pmu_enabled) return -1;
+    pmu_profile_stop();
+    pmu_profile_report(PROF_REPORT_TOP);
+    return 0;
+}
+
+int64_t sys_task_counters(pmu_counts_t* out)
+{
+    if (!out || !pmu_enabled) return -1;
+    scheduler_get_task_counters(out);
+    return 0;
+}
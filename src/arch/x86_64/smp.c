@@ -0,0 +1,343 @@
+#include "kernel.h"
+#include "io.h"
+#include "smp.h"
+#include "cpu.h"
+#include "numa.h"
+
+/*
+ * Symmetric multiprocessing bring-up
+ * Finds CPUs in the ACPI MADT, starts each AP through a real-mode
+ * trampoline and gives every CPU a GS-based per-CPU block
+ */
+
+#define TRAMPOLINE_BASE     0x8000   // Below 1MB, page aligned (SIPI vector 0x08)
+#define AP_STACK_SIZE       16384
+#define AP_BOOT_TIMEOUT_MS  100
+
+// ACPI table layouts
+typedef struct {
+    char signature[8];         // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    // ACPI 2.0+
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    acpi_sdt_header_t header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    uint8_t entries[];
+} __attribute__((packed)) acpi_madt_t;
+
+#define MADT_TYPE_LAPIC             0
+#define MADT_LAPIC_ENABLED          0x1
+#define MADT_LAPIC_ONLINE_CAPABLE   0x2
+
+// Parameter block at the end of smp_trampoline.asm
+typedef struct {
+    uint64_t cr3;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t cpu;
+    uint64_t ack;              // The AP stores cpu here once it has read the rest
+} __attribute__((packed)) ap_boot_params_t;
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_trampoline_params[];
+
+// CPU tables (gdt.c, idt.c)
+void gdt_load(void);
+void idt_load(void);
+
+static percpu_t cpus[MAX_CPUS];
+static uint32_t madt_apic_ids[MAX_CPUS];
+static int madt_cpu_count = 0;
+static volatile int cpus_online = 1;
+bool percpu_ready = false;
+
+// ============================================================================
+// ACPI DISCOVERY
+// ============================================================================
+
+static bool acpi_checksum_ok(const void* table, size_t length)
+{
+    const uint8_t* bytes = table;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+static acpi_rsdp_t* acpi_scan_rsdp(uintptr_t start, size_t length)
+{
+    for (uintptr_t addr = start; addr < start + length; addr += 16) {
+        acpi_rsdp_t* rsdp = (acpi_rsdp_t*)addr;
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 &&
+            acpi_checksum_ok(rsdp, 20)) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+// The RSDP lives in the first KB of the EBDA or in the BIOS ROM area
+static acpi_rsdp_t* acpi_find_rsdp(void)
+{
+    // BIOS data area word 0x40E holds the EBDA segment
+    uint16_t ebda_segment;
+    __asm__ volatile("movw 0x40E, %0" : "=r"(ebda_segment));
+    uintptr_t ebda = (uintptr_t)ebda_segment << 4;
+    acpi_rsdp_t* rsdp = NULL;
+
+    if (ebda >= 0x80000 && ebda < 0xA0000) {
+        rsdp = acpi_scan_rsdp(ebda, 1024);
+    }
+    if (!rsdp) {
+        rsdp = acpi_scan_rsdp(0xE0000, 0x20000);
+    }
+    return rsdp;
+}
+
+static acpi_sdt_header_t* acpi_find_table(acpi_rsdp_t* rsdp, const char* signature)
+{
+    bool xsdt = rsdp->revision >= 2 && rsdp->xsdt_address;
+    acpi_sdt_header_t* root = xsdt ? (acpi_sdt_header_t*)(uintptr_t)rsdp->xsdt_address
+                                   : (acpi_sdt_header_t*)(uintptr_t)rsdp->rsdt_address;
+    if (!acpi_checksum_ok(root, root->length)) {
+        KWARN("ACPI: bad %s checksum", xsdt ? "XSDT" : "RSDT");
+        return NULL;
+    }
+
+    size_t entry_size = xsdt ? 8 : 4;
+    size_t entries = (root->length - sizeof(acpi_sdt_header_t)) / entry_size;
+    uint8_t* base = (uint8_t*)root + sizeof(acpi_sdt_header_t);
+
+    for (size_t i = 0; i < entries; i++) {
+        uintptr_t addr = xsdt ? ((uint64_t*)base)[i] : ((uint32_t*)base)[i];
+        acpi_sdt_header_t* table = (acpi_sdt_header_t*)addr;
+        if (memcmp(table->signature, signature, 4) == 0 &&
+            acpi_checksum_ok(table, table->length)) {
+            return table;
+        }
+    }
+    return NULL;
+}
+
+// A checksummed table by signature ("SRAT", "SLIT", ...), or NULL
+acpi_sdt_header_t* acpi_get_table(const char* signature)
+{
+    acpi_rsdp_t* rsdp = acpi_find_rsdp();
+    return rsdp ? acpi_find_table(rsdp, signature) : NULL;
+}
+
+// Collect usable local APIC IDs from the MADT
+static void smp_parse_madt(void)
+{
+    acpi_rsdp_t* rsdp = acpi_find_rsdp();
+    if (!rsdp) {
+        KWARN("SMP: no ACPI RSDP found");
+        return;
+    }
+
+    acpi_madt_t* madt = (acpi_madt_t*)acpi_find_table(rsdp, "APIC");
+    if (!madt) {
+        KWARN("SMP: no MADT found");
+        return;
+    }
+
+    uint8_t* entry = madt->entries;
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+
+    while (entry + 2 <= end && entry[1] >= 2) {
+        // Processor Local APIC: type, length, ACPI id, APIC id, flags
+        if (entry[0] == MADT_TYPE_LAPIC && entry[1] >= 8) {
+            uint32_t flags = *(uint32_t*)(entry + 4);
+            if ((flags & (MADT_LAPIC_ENABLED | MADT_LAPIC_ONLINE_CAPABLE)) &&
+                madt_cpu_count < MAX_CPUS) {
+                madt_apic_ids[madt_cpu_count++] = entry[3];
+            }
+        }
+        entry += entry[1];
+    }
+}
+
+// ============================================================================
+// PER-CPU DATA
+// ============================================================================
+
+// The kernel runs with GS on its per-CPU block; syscall_entry and the ISR
+// stubs swapgs it out to MSR_KERNEL_GS_BASE for as long as ring 3 runs
+static void percpu_install(percpu_t* cpu)
+{
+    cpu->self = cpu;
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);  // User GS base until a task sets its own
+    tss_set_percpu(cpu->cpu_id, cpu);
+}
+
+percpu_t* smp_get_cpu(int cpu)
+{
+    if (cpu < 0 || cpu >= MAX_CPUS || !cpus[cpu].self) return NULL;
+    return &cpus[cpu];
+}
+
+int smp_cpu_count(void)
+{
+    return cpus_online;
+}
+
+// ============================================================================
+// AP STARTUP
+// ============================================================================
+
+// First C code on an AP, on its own stack, called from the trampoline
+static void smp_ap_main(percpu_t* cpu)
+{
+    gdt_load();
+    tss_install(cpu->cpu_id);
+    idt_load();
+    percpu_install(cpu);
+    cpu_init();
+
+    lapic_init();
+    pmu_init_cpu();
+    scheduler_cpu_online(cpu->cpu_id);
+    lapic_timer_start();
+
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&cpus_online, 1, __ATOMIC_RELAXED);
+
+    // Idle until the LAPIC tick hands this CPU work
+    __asm__ volatile("sti");
+    for (;;) {
+        __asm__ volatile("hlt");
+    }
+}
+
+typedef enum {
+    AP_STARTED,
+    AP_PARKED,                 // Never took its parameters; held in INIT
+    AP_DEAD                    // Took them and stalled: owns its slot and stack
+} ap_start_t;
+
+static inline bool ap_acked(ap_boot_params_t* params, percpu_t* cpu)
+{
+    return __atomic_load_n(&params->ack, __ATOMIC_ACQUIRE) == (uint64_t)cpu;
+}
+
+// INIT-SIPI-SIPI, then wait for the AP to report in. The parameter block
+// is shared, so it is only handed to the next AP once this one has
+// acknowledged it or been put back in INIT.
+static ap_start_t smp_start_ap(percpu_t* cpu, ap_boot_params_t* params)
+{
+    uint8_t vector_page = TRAMPOLINE_BASE >> 12;
+
+    lapic_send_init(cpu->apic_id);
+    lapic_delay_us(10000);
+
+    for (int attempt = 0; attempt < 2 && !ap_acked(params, cpu); attempt++) {
+        lapic_send_startup(cpu->apic_id, vector_page);
+        lapic_delay_us(200);
+    }
+
+    for (int ms = 0; ms < AP_BOOT_TIMEOUT_MS; ms++) {
+        if (__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) {
+            return AP_STARTED;
+        }
+        lapic_delay_us(1000);
+    }
+
+    if (ap_acked(params, cpu)) return AP_DEAD;
+
+    // Still in the trampoline, or never got there: stop it for good
+    lapic_send_init(cpu->apic_id);
+    lapic_delay_us(10000);
+    return ap_acked(params, cpu) ? AP_DEAD : AP_PARKED;
+}
+
+void smp_init(void)
+{
+    KINFO("Initializing SMP...");
+
+    // BSP per-CPU block first, so everything below can use smp_cpu_id()
+    percpu_t* bsp = &cpus[0];
+    bsp->cpu_id = 0;
+    bsp->online = true;
+    percpu_install(bsp);
+    percpu_ready = true;
+
+    if (!lapic_init()) {
+        KWARN("SMP: no local APIC, running uniprocessor");
+        return;
+    }
+    bsp->apic_id = lapic_id();
+    numa_cpu_online(0, bsp->apic_id);
+    pmu_init_cpu();
+    lapic_timer_start();
+
+    smp_parse_madt();
+    if (madt_cpu_count <= 1) {
+        KINFO("SMP: 1 CPU");
+        return;
+    }
+
+    // Trampoline and its parameter block go to low memory
+    size_t size = ap_trampoline_end - ap_trampoline_start;
+    memcpy((void*)TRAMPOLINE_BASE, ap_trampoline_start, size);
+
+    ap_boot_params_t* params = (ap_boot_params_t*)(TRAMPOLINE_BASE +
+                               (ap_trampoline_params - ap_trampoline_start));
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    params->cr3 = cr3;
+    params->entry = (uint64_t)smp_ap_main;
+
+    int next = 1;
+    for (int i = 0; i < madt_cpu_count && next < MAX_CPUS; i++) {
+        if (madt_apic_ids[i] == bsp->apic_id) continue;
+
+        void* stack = kmalloc_tracked(AP_STACK_SIZE, "ap_stack");
+        if (!stack) {
+            KERROR("SMP: no memory for AP stack");
+            break;
+        }
+
+        percpu_t* cpu = &cpus[next];
+        cpu->self = cpu;
+        cpu->cpu_id = next;
+        cpu->apic_id = madt_apic_ids[i];
+        cpu->stack_top = (uintptr_t)stack + AP_STACK_SIZE;
+        cpu->lapic_ticks = 0;
+        cpu->online = false;
+        numa_cpu_online(next, cpu->apic_id);
+
+        params->stack = cpu->stack_top;
+        params->cpu = (uint64_t)cpu;
+        params->ack = 0;
+
+        ap_start_t result = smp_start_ap(cpu, params);
+        if (result == AP_STARTED) {
+            next++;
+        } else if (result == AP_PARKED) {
+            KWARN("SMP: CPU with APIC ID %u did not start", cpu->apic_id);
+            cpu->self = NULL;
+            kfree_tracked(stack);
+        } else {
+            // It may still be running on this slot (and may have joined the
+            // scheduler), and CPU numbers have no gaps: start no more APs
+            KERROR("SMP: CPU with APIC ID %u stalled during startup, marked dead",
+                   cpu->apic_id);
+            break;
+        }
+    }
+
+    KINFO("SMP: %d of %d CPUs online", cpus_online, madt_cpu_count);
+}
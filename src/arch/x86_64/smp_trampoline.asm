@@ -0,0 +1,98 @@
+; AP startup trampoline for x86_64
+; Copied to 0x8000 by smp_init(); each AP starts here in real mode after
+; the startup IPI and climbs to long mode on the BSP's page tables
+
+TRAMPOLINE_BASE equ 0x8000
+
+; Address of a trampoline label once copied to TRAMPOLINE_BASE
+%define TRAMP(label) (TRAMPOLINE_BASE + (label) - ap_trampoline_start)
+
+SECTION .data
+align 16
+
+GLOBAL ap_trampoline_start
+GLOBAL ap_trampoline_end
+GLOBAL ap_trampoline_params
+
+BITS 16
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; Protected mode with the trampoline's own flat GDT
+    lgdt [TRAMP(tramp_gdt_pointer)]
+    mov eax, cr0
+    or  eax, 1
+    mov cr0, eax
+    jmp dword 0x08:TRAMP(tramp_protected)
+
+BITS 32
+tramp_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; PAE, then the BSP's PML4
+    mov eax, cr4
+    or  eax, 1 << 5
+    mov cr4, eax
+
+    mov eax, [TRAMP(ap_trampoline_params)]
+    mov cr3, eax
+
+    ; Long mode enable
+    mov ecx, 0xC0000080
+    rdmsr
+    or  eax, 1 << 8
+    wrmsr
+
+    ; Paging on
+    mov eax, cr0
+    or  eax, 1 << 31
+    mov cr0, eax
+
+    jmp 0x18:TRAMP(tramp_long)
+
+BITS 64
+tramp_long:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov rsp, [TRAMP(ap_trampoline_params) + 8]    ; stack
+    mov rdi, [TRAMP(ap_trampoline_params) + 24]   ; percpu_t*
+    mov rax, [TRAMP(ap_trampoline_params) + 16]   ; entry
+    mov [TRAMP(ap_trampoline_params) + 32], rdi   ; ack: done with the block
+    call rax
+
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+align 8
+tramp_gdt:
+    dq 0                        ; Null descriptor
+    dq 0x00CF9A000000FFFF       ; 0x08: 32-bit code
+    dq 0x00CF92000000FFFF       ; 0x10: data
+    dq 0x00AF9A000000FFFF       ; 0x18: 64-bit code
+
+tramp_gdt_pointer:
+    dw $ - tramp_gdt - 1
+    dd TRAMP(tramp_gdt)
+
+; Filled in by smp_init() (layout matches ap_boot_params_t)
+align 8
+ap_trampoline_params:
+    dq 0                        ; cr3
+    dq 0                        ; stack
+    dq 0                        ; entry
+    dq 0                        ; cpu
+    dq 0                        ; ack
+ap_trampoline_end:
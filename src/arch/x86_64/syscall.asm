@@ -0,0 +1,93 @@
+; SYSCALL/SYSRET fast system call entry for x86_64
+; The CPU arrives here from ring 3 with RCX = user RIP, R11 = user RFLAGS,
+; interrupts masked by FMASK and RSP still on the user stack. The GS base
+; is still the user's: swapgs brings in this CPU's per-CPU block, which
+; MSR_KERNEL_GS_BASE holds while ring 3 runs, and the exit swaps it back.
+
+BITS 64
+SECTION .text
+
+EXTERN syscall_dispatch
+EXTERN scheduler_finish_switch
+
+PERCPU_KERNEL_RSP equ 8         ; percpu_t.kernel_rsp
+PERCPU_USER_RSP   equ 16        ; percpu_t.user_rsp
+
+; Linux ABI: RAX = number, args in RDI, RSI, RDX, R10, R8, R9; RAX returns
+; the result and only RCX/R11 may be clobbered besides it
+GLOBAL syscall_entry
+syscall_entry:
+    swapgs
+    mov [gs:PERCPU_USER_RSP], rsp
+    mov rsp, [gs:PERCPU_KERNEL_RSP]
+
+    ; Return state first, so a preempted syscall keeps it on its own stack
+    push qword [gs:PERCPU_USER_RSP]
+    push r11
+    push rcx
+
+    push rdi
+    push rsi
+    push rdx
+    push r10
+    push r8
+    push r9
+
+    ; Callee-saved too, so the frame (syscall_frame_t) is the whole user
+    ; register state and fork can hand a copy to the child
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+
+    sti
+
+    ; syscall_dispatch(num, arg1..arg6): arg6 goes on the stack
+    push r9
+    mov r9, r8
+    mov r8, r10
+    mov rcx, rdx
+    mov rdx, rsi
+    mov rsi, rdi
+    mov rdi, rax
+    call syscall_dispatch
+    add rsp, 8
+
+.return:
+    cli
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+
+    pop r9
+    pop r8
+    pop r10
+    pop rdx
+    pop rsi
+    pop rdi
+
+    pop rcx
+    pop r11
+    pop rsp
+    swapgs
+
+    ; RCX is the address right after the user's SYSCALL, or an entry point
+    ; execve checked to be in user space, so it is always canonical and
+    ; SYSRET cannot fault in ring 0
+    o64 sysret
+
+; First return of a forked child: switch_context() lands here with the
+; parent's syscall_frame_t copied to the top of the child's kernel stack,
+; just above the alignment pad of the switch frame
+GLOBAL task_fork_trampoline
+task_fork_trampoline:
+    call scheduler_finish_switch
+    add rsp, 8
+    xor eax, eax                ; fork() returns 0 in the child
+    jmp syscall_entry.return
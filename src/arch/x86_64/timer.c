@@ -1,9 +1,18 @@
 #include "kernel.h"
 #include "io.h"
+#include "smp.h"
+#include "cpu.h"
+#include "vdso.h"
 
 /*
- * Timer system using Programmable Interval Timer (PIT)
- * Provides system ticks at a configurable frequency
+ * Timer system
+ * - TSC clock source, calibrated against the PIT, for ns/us/ms time
+ * - Per-CPU hierarchical timer wheels with microsecond resolution
+ * - One-shot LAPIC (TSC-deadline when available) interrupts programmed
+ *   for the next wheel event; the scheduler tick only runs on CPUs that
+ *   have work, so idle cores stop taking interrupts
+ * - The PIT at TIMER_FREQUENCY drives everything until the BSP's LAPIC
+ *   timer takes over
  */
 
 // PIT I/O ports
@@ -34,11 +43,424 @@
 #define PIT_BCD         0x01
 
 // Configuration
-#define TIMER_FREQUENCY     100     // 100 Hz
+#define TIMER_FREQUENCY     100     // Scheduler tick rate (Hz)
 #define PIT_BASE_FREQUENCY  1193182 // 1.193182 MHz
+#define TICK_US             (1000000 / TIMER_FREQUENCY)
+#define TSC_CALIBRATION_US  10000
+
+// Timer wheel: 6 levels of 64 slots, level 0 in 1 us steps. Level n
+// slots are 64^n us wide; together they reach ~19 hours ahead.
+#define WHEEL_BITS      6
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    6
+
+#define TIMER_NEVER     (~0ULL)
+
+// CPUID bits
+#define CPUID_EXT_INVARIANT_TSC (1U << 8)   // 0x80000007 EDX
+
+typedef struct {
+    spinlock_t lock;
+    ktimer_t* slots[WHEEL_LEVELS][WHEEL_SIZE];
+    uint64_t pending[WHEEL_LEVELS];  // Bit per non-empty slot
+    uint64_t clk;                    // Wheel time processed up to (us)
+    uint64_t next_tick;              // Scheduler tick deadline (0 = stopped)
+    uint64_t programmed;             // Deadline loaded into the LAPIC
+    bool oneshot;                    // LAPIC timer owns this CPU's events
+    ktimer_t* volatile running;      // Callback in progress (lock dropped)
+
+    // Statistics
+    uint64_t interrupts;
+    uint64_t expired;
+    uint64_t ticks;
+    uint64_t tick_stops;
+} timer_wheel_t;
 
 // Timer state
-static uint64_t timer_ticks = 0;
+static volatile uint64_t timer_ticks = 0;  // PIT interrupts
+static timer_wheel_t wheels[MAX_CPUS];
+
+// TSC clock source
+static uint64_t tsc_hz = 0;        // 0 until calibrated
+static uint64_t tsc_base = 0;      // TSC value at monotonic time zero
+static uint64_t tsc_ns_mult = 0;   // ns = (cycles * tsc_ns_mult) >> 32
+static uint64_t tsc_us_inv = 0;    // cycles = (us * tsc_us_inv) >> 20
+static bool tsc_invariant = false;
+
+// ============================================================================
+// CLOCK SOURCE
+// ============================================================================
+
+static void tsc_calibrate(void)
+{
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, &a, &b, &c, &d);
+    if (a >= 0x80000007) {
+        cpuid(0x80000007, &a, &b, &c, &d);
+        tsc_invariant = (d & CPUID_EXT_INVARIANT_TSC) != 0;
+    }
+
+    // PIT channel 2 busy-wait, independent of the tick on channel 0
+    uint64_t start = rdtsc();
+    lapic_delay_us(TSC_CALIBRATION_US);
+    uint64_t cycles = rdtsc() - start;
+
+    if (cycles == 0) {
+        KWARN("TSC calibration failed, using the %u Hz PIT clock", TIMER_FREQUENCY);
+        return;
+    }
+
+    tsc_hz = cycles * (1000000 / TSC_CALIBRATION_US);
+    tsc_ns_mult = (1000000000ULL << 32) / tsc_hz;
+    tsc_us_inv = (tsc_hz << 20) / 1000000;
+
+    // Line the TSC clock up with the ticks the PIT has counted so far
+    tsc_base = rdtsc() - ((timer_ticks * TICK_US * tsc_us_inv) >> 20);
+
+    KINFO("TSC clock: %lu.%03lu MHz%s", tsc_hz / 1000000, (tsc_hz / 1000) % 1000,
+          tsc_invariant ? " (invariant)" : "");
+}
+
+uint64_t time_monotonic_ns(void)
+{
+    if (!tsc_hz) {
+        return timer_ticks * TICK_US * 1000;
+    }
+    uint64_t cycles = rdtsc() - tsc_base;
+    return (uint64_t)(((unsigned __int128)cycles * tsc_ns_mult) >> 32);
+}
+
+uint64_t time_monotonic_us(void)
+{
+    return time_monotonic_ns() / 1000;
+}
+
+// Get monotonic time in milliseconds
+uint64_t time_monotonic_ms(void)
+{
+    return time_monotonic_ns() / 1000000;
+}
+
+// TSC value at a monotonic time (for TSC-deadline programming)
+uint64_t timer_us_to_tsc(uint64_t us)
+{
+    return tsc_base + (uint64_t)(((unsigned __int128)us * tsc_us_inv) >> 20);
+}
+
+bool timer_has_tsc(void)
+{
+    return tsc_hz != 0;
+}
+
+// Calibrated TSC rate (0 without one)
+uint64_t timer_tsc_khz(void)
+{
+    return tsc_hz / 1000;
+}
+
+// TSC scale for the vDSO page (both zero without a calibrated TSC)
+void timer_get_clock(uint64_t* base, uint64_t* ns_mult)
+{
+    *base = tsc_base;
+    *ns_mult = tsc_ns_mult;
+}
+
+// ============================================================================
+// TIMER WHEEL
+// ============================================================================
+
+static inline timer_wheel_t* this_wheel(void)
+{
+    return &wheels[smp_cpu_id()];
+}
+
+// File a timer under the lowest level whose slots still reach its expiry
+static void wheel_insert(timer_wheel_t* w, ktimer_t* t)
+{
+    uint64_t expires = t->expires < w->clk ? w->clk : t->expires;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 &&
+           (expires >> (level * WHEEL_BITS)) - (w->clk >> (level * WHEEL_BITS)) >= WHEEL_SIZE) {
+        level++;
+    }
+
+    uint64_t slot = expires >> (level * WHEEL_BITS);
+    uint64_t cur = w->clk >> (level * WHEEL_BITS);
+    if (slot - cur >= WHEEL_SIZE) {
+        // Beyond the top level: park in its furthest slot and re-file later
+        slot = cur + WHEEL_SIZE - 1;
+    }
+
+    int idx = slot & WHEEL_MASK;
+    t->next = w->slots[level][idx];
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = &w->slots[level][idx];
+    w->slots[level][idx] = t;
+    w->pending[level] |= 1ULL << idx;
+}
+
+static void wheel_remove(timer_wheel_t* w, ktimer_t* t)
+{
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+
+    // Emptied a slot: find it from the timer's own slot pointer
+    if (!*t->pprev) {
+        for (int level = 0; level < WHEEL_LEVELS; level++) {
+            ktimer_t** base = w->slots[level];
+            if (t->pprev >= base && t->pprev < base + WHEEL_SIZE) {
+                w->pending[level] &= ~(1ULL << (t->pprev - base));
+                break;
+            }
+        }
+    }
+
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+// Earliest time the wheel needs attention: a level 0 expiry, or the
+// start of a higher-level slot that must cascade down
+static uint64_t wheel_next_event(timer_wheel_t* w)
+{
+    uint64_t best = TIMER_NEVER;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t mask = w->pending[level];
+        if (!mask) continue;
+
+        int shift = level * WHEEL_BITS;
+        uint64_t cur = w->clk >> shift;
+        int pos = cur & WHEEL_MASK;
+        uint64_t rotated = pos ? (mask >> pos) | (mask << (WHEEL_SIZE - pos)) : mask;
+
+        uint64_t when = (cur + __builtin_ctzll(rotated)) << shift;
+        if (when < w->clk) {
+            when = w->clk;  // Current higher-level slot: due now
+        }
+        if (when < best) {
+            best = when;
+        }
+    }
+
+    return best;
+}
+
+// Advance the wheel to now, cascading and firing as it goes.
+// Caller holds w->lock; it is dropped around each callback.
+static void wheel_run(timer_wheel_t* w, uint64_t now)
+{
+    uint64_t next;
+
+    while ((next = wheel_next_event(w)) <= now) {
+        w->clk = next;
+
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            int idx = (w->clk >> (level * WHEEL_BITS)) & WHEEL_MASK;
+            if (!(w->pending[level] & (1ULL << idx))) continue;
+
+            ktimer_t* list = w->slots[level][idx];
+            w->slots[level][idx] = NULL;
+            w->pending[level] &= ~(1ULL << idx);
+
+            while (list) {
+                ktimer_t* t = list;
+                list = t->next;
+                wheel_insert(w, t);
+            }
+        }
+
+        int idx = w->clk & WHEEL_MASK;
+        while (w->slots[0][idx]) {
+            ktimer_t* t = w->slots[0][idx];
+            wheel_remove(w, t);
+            w->expired++;
+            w->running = t;
+
+            spin_unlock(&w->lock);
+            t->fn(t->arg);
+            spin_lock(&w->lock);
+            w->running = NULL;
+        }
+    }
+
+    w->clk = now;
+}
+
+// Load the next deadline (wheel event or scheduler tick) into the LAPIC
+static void wheel_program(timer_wheel_t* w)
+{
+    if (!w->oneshot) return;
+
+    uint64_t deadline = wheel_next_event(w);
+    if (w->next_tick && w->next_tick < deadline) {
+        deadline = w->next_tick;
+    }
+
+    if (deadline == w->programmed) return;
+    w->programmed = deadline;
+
+    if (deadline == TIMER_NEVER) {
+        lapic_timer_disarm();
+    } else {
+        lapic_timer_arm(deadline);
+    }
+}
+
+void ktimer_init(ktimer_t* timer, ktimer_fn_t fn, void* arg)
+{
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->cpu = -1;
+}
+
+// Arm (or re-arm) a timer on the calling CPU's wheel
+void ktimer_arm(ktimer_t* timer, uint64_t expires_us)
+{
+    ktimer_cancel(timer);
+
+    timer_wheel_t* w = this_wheel();
+    uint64_t flags = spin_lock_irqsave(&w->lock);
+
+    timer->expires = expires_us;
+    timer->cpu = smp_cpu_id();
+    wheel_insert(w, timer);
+    if (expires_us < w->programmed) {
+        wheel_program(w);
+    }
+
+    spin_unlock_irqrestore(&w->lock, flags);
+}
+
+void ktimer_arm_in(ktimer_t* timer, uint64_t delay_us)
+{
+    ktimer_arm(timer, time_monotonic_us() + delay_us);
+}
+
+// Returns true if the timer was pending (it will not fire). Also waits out
+// a callback already running on another CPU, so the timer and whatever
+// holds it can go away once this returns. Must not be called with a lock
+// the callback takes. On the timer's own CPU the callback can only be the
+// caller, and waiting for it would never end.
+bool ktimer_cancel(ktimer_t* timer)
+{
+    int cpu = timer->cpu;
+    if (cpu < 0) return false;
+
+    timer_wheel_t* w = &wheels[cpu];
+    uint64_t flags = spin_lock_irqsave(&w->lock);
+
+    bool pending = timer->pprev != NULL;
+    if (pending) {
+        wheel_remove(w, timer);
+    }
+
+    if (cpu != smp_cpu_id()) {
+        while (w->running == timer) {
+            spin_unlock(&w->lock);
+            __asm__ volatile("pause");
+            spin_lock(&w->lock);
+        }
+    }
+
+    spin_unlock_irqrestore(&w->lock, flags);
+    return pending;
+}
+
+bool ktimer_pending(ktimer_t* timer)
+{
+    return timer->pprev != NULL;
+}
+
+// ============================================================================
+// CLOCK EVENTS
+// ============================================================================
+
+// Timer interrupt on this CPU (LAPIC one-shot, or the PIT before that)
+static void timer_interrupt(void)
+{
+    timer_wheel_t* w = this_wheel();
+    uint64_t now = time_monotonic_us();
+
+    spin_lock(&w->lock);  // Interrupt context: IF already clear
+    w->interrupts++;
+    w->programmed = TIMER_NEVER;  // One-shot: it just fired
+    wheel_run(w, now);
+
+    // The periodic PIT can land just short of the deadline
+    uint64_t slack = w->oneshot ? 0 : TICK_US / 2;
+    bool tick = w->next_tick && now + slack >= w->next_tick;
+    if (tick) {
+        // Stay on the tick grid, dropping ticks missed while held off
+        w->next_tick += TICK_US;
+        if (w->next_tick <= now) {
+            w->next_tick = now + TICK_US - (now - w->next_tick) % TICK_US;
+        }
+        w->ticks++;
+    }
+
+    wheel_program(w);
+    spin_unlock(&w->lock);
+
+    // Last, since it may switch to another task's stack
+    if (tick) {
+        scheduler_tick();
+    }
+}
+
+// LAPIC timer vector (apic.c)
+void timer_lapic_interrupt(void)
+{
+    timer_interrupt();
+}
+
+// Per-CPU scheduler tick: stopped while the CPU is idle
+void timer_set_tick(bool enabled)
+{
+    timer_wheel_t* w = this_wheel();
+    uint64_t flags = spin_lock_irqsave(&w->lock);
+
+    if (enabled && !w->next_tick) {
+        w->next_tick = time_monotonic_us() + TICK_US;
+        wheel_program(w);
+    } else if (!enabled && w->next_tick) {
+        w->next_tick = 0;
+        w->tick_stops++;
+        wheel_program(w);
+    }
+
+    spin_unlock_irqrestore(&w->lock, flags);
+}
+
+// This CPU's LAPIC timer is ready: hand its events over to one-shot mode
+void timer_cpu_start(void)
+{
+    timer_wheel_t* w = this_wheel();
+    uint64_t flags = spin_lock_irqsave(&w->lock);
+
+    w->clk = time_monotonic_us();
+    w->oneshot = true;
+    w->programmed = TIMER_NEVER;
+    if (!w->next_tick) {
+        w->next_tick = w->clk + TICK_US;
+    }
+    wheel_program(w);
+
+    spin_unlock_irqrestore(&w->lock, flags);
+}
+
+// ============================================================================
+// LEGACY PIT TICK
+// ============================================================================
 
 // Initialize the timer
 void timer_init(void)
@@ -57,55 +479,72 @@ void timer_init(void)
     io_wait();
     outb(PIT_DATA0, (divisor >> 8) & 0xFF);
 
-    KINFO("Timer initialized: divisor=%u", divisor);
+    for (int i = 0; i < MAX_CPUS; i++) {
+        spin_lock_init(&wheels[i].lock);
+        wheels[i].programmed = TIMER_NEVER;
+    }
+    wheels[0].next_tick = TICK_US;  // BSP ticks from the PIT for now
+
+    tsc_calibrate();
+
+    KINFO("Timer initialized: divisor=%u, wheel %d x %d slots", divisor,
+          WHEEL_LEVELS, WHEEL_SIZE);
 }
 
 // Handle timer tick (called by interrupt handler)
 void timer_tick(void)
 {
     timer_ticks++;
+    if (!tsc_hz) {
+        vdso_update_coarse(timer_ticks * TICK_US * 1000);
+    }
 
-    // Call scheduler tick for context switching
-    scheduler_tick();
+    // Once the BSP's LAPIC timer runs the PIT only backs the clock (and
+    // is masked entirely when the TSC is usable)
+    if (!lapic_timer_active()) {
+        timer_interrupt();
+    }
 }
 
-// Get current timer ticks
+// Scheduler ticks elapsed (derived from the clock, so tickless CPUs agree)
 uint64_t timer_get_ticks(void)
 {
-    return timer_ticks;
+    return time_monotonic_us() / TICK_US;
 }
 
-// System call wrapper
-uint64_t sys_get_ticks(void)
+// Tick rate shared by the PIT and the per-CPU LAPIC timers
+uint32_t timer_get_frequency(void)
 {
-    return timer_ticks;
+    return TIMER_FREQUENCY;
 }
 
-// Get monotonic time in milliseconds
-uint64_t time_monotonic_ms(void)
+// System call wrapper
+uint64_t sys_get_ticks(void)
 {
-    return (timer_ticks * 1000) / TIMER_FREQUENCY;
+    return timer_get_ticks();
 }
 
-// Sleep for specified number of milliseconds
+// Sleep for specified number of milliseconds (blocks the calling task)
 void timer_sleep(uint32_t milliseconds)
 {
-    uint64_t start_ticks = timer_ticks;
-    uint64_t target_ticks = start_ticks + (milliseconds * TIMER_FREQUENCY / 1000);
-
-    // Busy wait (not efficient, but simple)
-    while (timer_ticks < target_ticks) {
-        __asm__ volatile("nop");
-    }
+    scheduler_sleep_us((uint64_t)milliseconds * 1000);
 }
 
 // Sleep for specified number of ticks
 void timer_sleep_ticks(uint32_t ticks)
 {
-    uint64_t target_ticks = timer_ticks + ticks;
+    scheduler_sleep_us((uint64_t)ticks * TICK_US);
+}
 
-    // Busy wait
-    while (timer_ticks < target_ticks) {
-        __asm__ volatile("nop");
+void timer_get_stats(void)
+{
+    KINFO("=== Timer Statistics ===");
+    KINFO("Clock: %s, %lu us", tsc_hz ? "TSC" : "PIT", time_monotonic_us());
+    int cpus = smp_cpu_count() > 0 ? smp_cpu_count() : 1;
+    for (int i = 0; i < cpus; i++) {
+        timer_wheel_t* w = &wheels[i];
+        KINFO("CPU %d: %lu irqs, %lu ticks, %lu expired, %lu tick stops%s",
+              i, w->interrupts, w->ticks, w->expired, w->tick_stops,
+              w->next_tick ? "" : " (tickless)");
     }
 }
@@ -0,0 +1,317 @@
+/*
+ * Pixel Blitters
+ * Fill, copy and alpha-blend kernels for 32-bit ARGB surfaces, with
+ * SSE2 and AVX2 versions picked by CPUID at boot
+ */
+
+#include "kernel.h"
+#include "cpu.h"
+
+// The intrinsics headers pull in the hosted malloc helpers otherwise
+#define _MM_MALLOC_H_INCLUDED
+#include <immintrin.h>
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+#define BLIT_BAND_ROWS     64      // Rows per kernel_fpu_begin(): bounds the interrupts-off time
+#define BLIT_SIMD_MIN      64      // Pixels below which the FPU switch costs more than it saves
+#define BLIT_STREAM_MIN    256     // Row length from which stores bypass the cache
+
+typedef struct {
+    const char* name;
+    bool simd;                     // Needs kernel_fpu_begin()
+    void (*fill)(uint32_t* dst, uint32_t color, size_t count);
+    void (*copy)(uint32_t* dst, const uint32_t* src, size_t count);
+    void (*over)(uint32_t* dst, const uint32_t* src, size_t count);
+} blit_ops_t;
+
+// ============================================================================
+// SCALAR
+// ============================================================================
+
+// x / 255, rounded, for x up to 255 * 255
+static inline uint32_t div255(uint32_t x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// Source over an opaque destination, straight alpha: every channel is
+// s * a + d * (255 - a), alpha included, so a = 0 leaves d as it was and
+// a = 255 gives s. The SIMD versions compute exactly this.
+static inline uint32_t blend_over(uint32_t s, uint32_t d)
+{
+    uint32_t a = s >> 24;
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t c = ((s >> shift) & 0xFF) * a + ((d >> shift) & 0xFF) * (255 - a);
+        out |= div255(c) << shift;
+    }
+    return out;
+}
+
+static void fill_scalar(uint32_t* dst, uint32_t color, size_t count)
+{
+    for (size_t i = 0; i < count; i++) dst[i] = color;
+}
+
+static void copy_scalar(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    for (size_t i = 0; i < count; i++) dst[i] = src[i];
+}
+
+static void over_scalar(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint32_t a = src[i] >> 24;
+        if (a == 255) {
+            dst[i] = src[i];
+        } else if (a != 0) {
+            dst[i] = blend_over(src[i], dst[i]);
+        }
+    }
+}
+
+static const blit_ops_t blit_scalar = { "scalar", false, fill_scalar, copy_scalar, over_scalar };
+
+// ============================================================================
+// SSE2
+// ============================================================================
+
+// Two pixels widened to 16-bit channels, blended
+__attribute__((target("sse2")))
+static inline __m128i over_half_sse2(__m128i s, __m128i d)
+{
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+    __m128i ia = _mm_sub_epi16(_mm_set1_epi16(255), a);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia));
+    t = _mm_add_epi16(t, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void fill_sse2(uint32_t* dst, uint32_t color, size_t count)
+{
+    while (count && ((uintptr_t)dst & 15)) {
+        *dst++ = color;
+        count--;
+    }
+
+    __m128i v = _mm_set1_epi32((int)color);
+    if (count >= BLIT_STREAM_MIN) {
+        for (; count >= 16; count -= 16, dst += 16) {
+            _mm_stream_si128((__m128i*)dst, v);
+            _mm_stream_si128((__m128i*)dst + 1, v);
+            _mm_stream_si128((__m128i*)dst + 2, v);
+            _mm_stream_si128((__m128i*)dst + 3, v);
+        }
+        _mm_sfence();
+    }
+    for (; count >= 4; count -= 4, dst += 4) _mm_store_si128((__m128i*)dst, v);
+    while (count--) *dst++ = color;
+}
+
+__attribute__((target("sse2")))
+static void copy_sse2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    while (count && ((uintptr_t)dst & 15)) {
+        *dst++ = *src++;
+        count--;
+    }
+
+    if (count >= BLIT_STREAM_MIN) {
+        for (; count >= 8; count -= 8, dst += 8, src += 8) {
+            __m128i a = _mm_loadu_si128((const __m128i*)src);
+            __m128i b = _mm_loadu_si128((const __m128i*)src + 1);
+            _mm_stream_si128((__m128i*)dst, a);
+            _mm_stream_si128((__m128i*)dst + 1, b);
+        }
+        _mm_sfence();
+    }
+    for (; count >= 4; count -= 4, dst += 4, src += 4) {
+        _mm_store_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+    }
+    while (count--) *dst++ = *src++;
+}
+
+__attribute__((target("sse2")))
+static void over_sse2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+
+    for (; count >= 4; count -= 4, dst += 4, src += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)src);
+        __m128i alpha = _mm_and_si128(s, opaque);
+
+        // Whole groups clear or solid skip the destination read, which is
+        // slow when it is the framebuffer
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, zero)) == 0xFFFF) continue;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, opaque)) == 0xFFFF) {
+            _mm_storeu_si128((__m128i*)dst, s);
+            continue;
+        }
+
+        __m128i d = _mm_loadu_si128((const __m128i*)dst);
+        __m128i lo = over_half_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i hi = over_half_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(lo, hi));
+    }
+    over_scalar(dst, src, count);
+}
+
+static const blit_ops_t blit_sse2 = { "SSE2", true, fill_sse2, copy_sse2, over_sse2 };
+
+// ============================================================================
+// AVX2
+// ============================================================================
+
+__attribute__((target("avx2")))
+static inline __m256i over_half_avx2(__m256i s, __m256i d)
+{
+    __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+    __m256i ia = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, ia));
+    t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(uint32_t* dst, uint32_t color, size_t count)
+{
+    while (count && ((uintptr_t)dst & 31)) {
+        *dst++ = color;
+        count--;
+    }
+
+    __m256i v = _mm256_set1_epi32((int)color);
+    if (count >= BLIT_STREAM_MIN) {
+        for (; count >= 32; count -= 32, dst += 32) {
+            _mm256_stream_si256((__m256i*)dst, v);
+            _mm256_stream_si256((__m256i*)dst + 1, v);
+            _mm256_stream_si256((__m256i*)dst + 2, v);
+            _mm256_stream_si256((__m256i*)dst + 3, v);
+        }
+        _mm_sfence();
+    }
+    for (; count >= 8; count -= 8, dst += 8) _mm256_store_si256((__m256i*)dst, v);
+    while (count--) *dst++ = color;
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    while (count && ((uintptr_t)dst & 31)) {
+        *dst++ = *src++;
+        count--;
+    }
+
+    if (count >= BLIT_STREAM_MIN) {
+        for (; count >= 16; count -= 16, dst += 16, src += 16) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)src);
+            __m256i b = _mm256_loadu_si256((const __m256i*)src + 1);
+            _mm256_stream_si256((__m256i*)dst, a);
+            _mm256_stream_si256((__m256i*)dst + 1, b);
+        }
+        _mm_sfence();
+    }
+    for (; count >= 8; count -= 8, dst += 8, src += 8) {
+        _mm256_store_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+    }
+    while (count--) *dst++ = *src++;
+}
+
+__attribute__((target("avx2")))
+static void over_avx2(uint32_t* dst, const uint32_t* src, size_t count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+
+    for (; count >= 8; count -= 8, dst += 8, src += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)src);
+        __m256i alpha = _mm256_and_si256(s, opaque);
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, zero)) == -1) continue;
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, opaque)) == -1) {
+            _mm256_storeu_si256((__m256i*)dst, s);
+            continue;
+        }
+
+        // Unpack and pack work within 128-bit lanes, so pixel order survives
+        __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+        __m256i lo = over_half_avx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+        __m256i hi = over_half_avx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+        _mm256_storeu_si256((__m256i*)dst, _mm256_packus_epi16(lo, hi));
+    }
+    over_scalar(dst, src, count);
+}
+
+static const blit_ops_t blit_avx2 = { "AVX2", true, fill_avx2, copy_avx2, over_avx2 };
+
+// ============================================================================
+// PUBLIC API
+// ============================================================================
+
+static const blit_ops_t* blit_ops = &blit_scalar;
+
+void blit_init(void)
+{
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+
+    if (cpu_has_avx2()) {
+        blit_ops = &blit_avx2;
+    } else if (d & (1U << 26)) {  // SSE2
+        blit_ops = &blit_sse2;
+    }
+    KINFO("Blitters: %s", blit_ops->name);
+}
+
+// Rectangles, pitches in pixels. SIMD runs in bands so interrupts are
+// never off for a whole large blit.
+void blit_fill_rect(uint32_t* dst, size_t pitch, int width, int height, uint32_t color)
+{
+    if (width <= 0 || height <= 0) return;
+    const blit_ops_t* ops = (size_t)width * height >= BLIT_SIMD_MIN ? blit_ops : &blit_scalar;
+
+    for (int y = 0; y < height; y += BLIT_BAND_ROWS) {
+        int rows = height - y < BLIT_BAND_ROWS ? height - y : BLIT_BAND_ROWS;
+        uint64_t flags = ops->simd ? kernel_fpu_begin() : 0;
+        for (int i = 0; i < rows; i++) ops->fill(dst + (size_t)(y + i) * pitch, color, width);
+        if (ops->simd) kernel_fpu_end(flags);
+    }
+}
+
+void blit_copy_rect(uint32_t* dst, size_t dst_pitch, const uint32_t* src, size_t src_pitch,
+                    int width, int height)
+{
+    if (width <= 0 || height <= 0) return;
+    const blit_ops_t* ops = (size_t)width * height >= BLIT_SIMD_MIN ? blit_ops : &blit_scalar;
+
+    for (int y = 0; y < height; y += BLIT_BAND_ROWS) {
+        int rows = height - y < BLIT_BAND_ROWS ? height - y : BLIT_BAND_ROWS;
+        uint64_t flags = ops->simd ? kernel_fpu_begin() : 0;
+        for (int i = 0; i < rows; i++) {
+            ops->copy(dst + (size_t)(y + i) * dst_pitch, src + (size_t)(y + i) * src_pitch, width);
+        }
+        if (ops->simd) kernel_fpu_end(flags);
+    }
+}
+
+void blit_over_rect(uint32_t* dst, size_t dst_pitch, const uint32_t* src, size_t src_pitch,
+                    int width, int height)
+{
+    if (width <= 0 || height <= 0) return;
+    const blit_ops_t* ops = (size_t)width * height >= BLIT_SIMD_MIN ? blit_ops : &blit_scalar;
+
+    for (int y = 0; y < height; y += BLIT_BAND_ROWS) {
+        int rows = height - y < BLIT_BAND_ROWS ? height - y : BLIT_BAND_ROWS;
+        uint64_t flags = ops->simd ? kernel_fpu_begin() : 0;
+        for (int i = 0; i < rows; i++) {
+            ops->over(dst + (size_t)(y + i) * dst_pitch, src + (size_t)(y + i) * src_pitch, width);
+        }
+        if (ops->simd) kernel_fpu_end(flags);
+    }
+}
@@ -28,11 +28,33 @@ void init_cursor_bitmap(void) {
     }
 }
 
+// What the cursor covers, put back when it moves
+static uint32_t cursor_save[16 * 16];
+static int cursor_save_x, cursor_save_y;
+static int cursor_saved = 0;
+
+static void cursor_restore(void) {
+    if (!cursor_saved) return;
+    for (int cy = 0; cy < 16; cy++) {
+        for (int cx = 0; cx < 16; cx++) {
+            framebuffer_put_pixel(cursor_save_x + cx, cursor_save_y + cy, cursor_save[cy * 16 + cx]);
+        }
+    }
+    cursor_saved = 0;
+}
+
 void draw_cursor(int x, int y) {
-    // Simple software cursor
-    // Save background? For now, just draw over (flicker possible without double buffering)
-    // In a real compositor, cursor is a hardware sprite or composited last
-    
+    // Simple software cursor: save the pixels under it first, so moving it
+    // only touches its own 16x16 pixels
+    for (int cy = 0; cy < 16; cy++) {
+        for (int cx = 0; cx < 16; cx++) {
+            cursor_save[cy * 16 + cx] = framebuffer_get_pixel(x + cx, y + cy);
+        }
+    }
+    cursor_save_x = x;
+    cursor_save_y = y;
+    cursor_saved = 1;
+
     for (int cy = 0; cy < 16; cy++) {
         for (int cx = 0; cx < 16; cx++) {
             uint32_t color = cursor_bitmap[cy * 16 + cx];
@@ -59,33 +81,38 @@ void desktop_task(void* arg) {
     mouse_state_t mouse;
     mouse_state_t last_mouse = {0, 0, 0, 0, 0};
     
+    // 1. Draw Background (Wallpaper), once: after this only damaged
+    // regions are redrawn
+    framebuffer_fill_rect(0, 0, width, height - 40, bg_color);
+    
+    // 2. Draw Taskbar
+    framebuffer_fill_rect(0, height - 40, width, 40, taskbar_color);
+    
+    // Start Button
+    framebuffer_fill_rect(5, height - 35, 80, 30, 0xFF808080);
+    framebuffer_draw_text(15, height - 25, "START", 0xFFFFFFFF);
+    
     // Main loop
     while (1) {
-        // 1. Draw Background (Wallpaper)
-        // Optimization: Only redraw if needed (damaged regions)
-        // For simplicity, we redraw everything (slow but correct)
-        framebuffer_fill_rect(0, 0, width, height - 40, bg_color);
-        
-        // 2. Draw Taskbar
-        framebuffer_fill_rect(0, height - 40, width, 40, taskbar_color);
-        
-        // Start Button
-        framebuffer_fill_rect(5, height - 35, 80, 30, 0xFF808080);
-        framebuffer_draw_text(15, height - 25, "START", 0xFFFFFFFF);
-        
         // Clock (simulated)
         uint64_t ticks = sys_get_ticks();
         // char time_str[32];
         // sprintf(time_str, "%d", ticks);
         // framebuffer_draw_text(width - 100, height - 25, time_str, 0xFF000000);
         
-        // 3. Composite Windows
-        // (Iterate through windows and draw them)
-        // window_composite_all(); // Not exposed yet, need to add to framebuffer.c
-        
-        // 4. Draw Cursor
+        // 3. Composite Windows queued since the last frame, with the
+        // cursor lifted off so it stays on top
+        // 4. Draw Cursor, only when it moved or something went under it
         mouse_get_state(&mouse);
-        draw_cursor(mouse.x, mouse.y);
+        if (!cursor_saved || mouse.x != cursor_save_x || mouse.y != cursor_save_y ||
+            wm_composite_pending()) {
+            cursor_restore();
+            wm_composite_frame();
+            draw_cursor(mouse.x, mouse.y);
+        }
+        
+        // Changed pixels to the screen, at most once per refresh
+        framebuffer_present();
         
         // 5. Handle Input
         if (mouse.left_button && !last_mouse.left_button) {
@@ -100,11 +127,8 @@ void desktop_task(void* arg) {
         
         last_mouse = mouse;
         
-        // Yield
-        scheduler_yield();
-        
-        // Delay to limit FPS
-        for (volatile int i = 0; i < 1000000; i++);
+        // Sleep to the next frame
+        framebuffer_wait_frame();
     }
 }
 
@@ -16,11 +16,21 @@ void sys_yield(void);
 // Display server status
 static pid_t display_server_pid = 0;
 static int display_server_running = 0;
+static int display_channel = -1;         // Requests from clients, once the server is up
+
+#define DISPLAY_CHANNEL_NAME "display"
+#define IPC_DISPLAY_REQUEST  1           // ipc_msg_t.type: data holds a display_message_t
 
 // Window manager state
 // wm_window_t is defined in api.h
 
 wm_window_t wm_windows[MAX_WM_WINDOWS];
+static uint32_t wm_next_z = 1;
+static int wm_pending_count = 0;         // Windows queued for the next frame
+
+// Fragments a damaged rectangle may split into while occluded windows are
+// cut out; past this the windows above are repainted instead
+#define WM_MAX_FRAGMENTS 64
 
 // Display protocol message types
 typedef enum {
@@ -32,7 +42,8 @@ typedef enum {
     MSG_KEYBOARD_EVENT,
     MSG_MOUSE_EVENT,
     MSG_REQUEST_FOCUS,
-    MSG_CLOSE_WINDOW
+    MSG_CLOSE_WINDOW,
+    MSG_DRAW_RECT
 } display_msg_type_t;
 
 // Display protocol message
@@ -70,9 +81,19 @@ typedef struct display_message {
             uint32_t buttons;
             int32_t wheel;
         } mouse_event;
+
+        struct {
+            int window_id;
+            int x, y, width, height;
+            uint32_t color;
+        } draw_rect;
     } data;
 } display_message_t;
 
+_Static_assert(sizeof(display_message_t) <= IPC_MSG_INLINE, "display message must fit inline");
+
+static int display_handle_message(const display_message_t* msg);
+
 // ============================================================================
 // WINDOW MANAGER FUNCTIONS
 // ============================================================================
@@ -89,6 +110,10 @@ int wm_register_window(int window_id, int x, int y, int width, int height, pid_t
             wm_windows[i].height = height;
             wm_windows[i].visible = 1;
             wm_windows[i].owner_pid = owner_pid;
+            wm_windows[i].opaque = false;
+            wm_windows[i].z = wm_next_z++;
+            damage_clear(&wm_windows[i].damage);
+            damage_add(&wm_windows[i].damage, 0, 0, width, height);  // First composite draws it all
             if (title) {
                 strncpy(wm_windows[i].title, title, sizeof(wm_windows[i].title) - 1);
                 wm_windows[i].title[sizeof(wm_windows[i].title) - 1] = '\0';
@@ -109,6 +134,7 @@ int wm_unregister_window(int window_id)
     for (int i = 0; i < MAX_WM_WINDOWS; i++) {
         if (wm_windows[i].window_id == window_id) {
             KDEBUG("WM: Unregistered window %d", window_id);
+            if (wm_windows[i].pending) wm_pending_count--;
             memset(&wm_windows[i], 0, sizeof(wm_window_t));
             return 0;
         }
@@ -118,19 +144,189 @@ int wm_unregister_window(int window_id)
     return -1;
 }
 
-int wm_move_window(int window_id, int x, int y)
+static wm_window_t* wm_find_window(int window_id)
 {
     for (int i = 0; i < MAX_WM_WINDOWS; i++) {
         if (wm_windows[i].window_id == window_id) {
-            wm_windows[i].x = x;
-            wm_windows[i].y = y;
-            KDEBUG("WM: Moved window %d to (%d,%d)", window_id, x, y);
+            return &wm_windows[i];
+        }
+    }
+    return NULL;
+}
 
-            // Mark for redraw (would trigger composite in full implementation)
-            return 0;
+// Damage every visible window under 'above' (or all, if NULL) where it
+// overlaps the screen rectangle r
+static void wm_damage_below(const wm_window_t* above, const rect_t* r)
+{
+    for (int i = 0; i < MAX_WM_WINDOWS; i++) {
+        wm_window_t* w = &wm_windows[i];
+        if (w->window_id == 0 || !w->visible || w == above) continue;
+        if (above && w->z > above->z) continue;
+
+        rect_t bounds = { w->x, w->y, w->width, w->height };
+        rect_t hit;
+        if (rect_intersect(r, &bounds, &hit)) {
+            damage_add(&w->damage, hit.x - w->x, hit.y - w->y, hit.width, hit.height);
         }
     }
-    return -1;
+}
+
+int wm_queue_composite(int window_id)
+{
+    wm_window_t* window = wm_find_window(window_id);
+    if (!window) return -1;
+
+    if (!window->pending) {
+        window->pending = true;
+        wm_pending_count++;
+    }
+    return 0;
+}
+
+bool wm_composite_pending(void)
+{
+    return wm_pending_count > 0;
+}
+
+// Composite every queued window, bottom to top
+int wm_composite_frame(void)
+{
+    int count = 0;
+    uint32_t last_z = 0;
+    while (wm_pending_count > 0) {
+        wm_window_t* next = NULL;
+        for (int i = 0; i < MAX_WM_WINDOWS; i++) {
+            wm_window_t* w = &wm_windows[i];
+            if (w->window_id == 0 || !w->pending || w->z <= last_z) continue;
+            if (!next || w->z < next->z) next = w;
+        }
+        if (!next) break;
+        last_z = next->z;
+
+        next->pending = false;
+        wm_pending_count--;
+        wm_composite_window(next->window_id);
+        count++;
+    }
+    return count;
+}
+
+int wm_move_window(int window_id, int x, int y)
+{
+    wm_window_t* window = wm_find_window(window_id);
+    if (!window) return -1;
+
+    // Whatever was under the old position shows again. There is no
+    // background layer, so bare desktop there keeps the stale pixels.
+    rect_t old = { window->x, window->y, window->width, window->height };
+    window->x = x;
+    window->y = y;
+    wm_damage_below(window, &old);
+    damage_add(&window->damage, 0, 0, window->width, window->height);
+    for (int i = 0; i < MAX_WM_WINDOWS; i++) {
+        if (wm_windows[i].window_id != 0 && wm_windows[i].damage.count > 0) {
+            wm_queue_composite(wm_windows[i].window_id);
+        }
+    }
+    KDEBUG("WM: Moved window %d to (%d,%d)", window_id, x, y);
+    return 0;
+}
+
+int wm_damage_window(int window_id, int x, int y, int width, int height)
+{
+    wm_window_t* window = wm_find_window(window_id);
+    if (!window) return -1;
+
+    damage_add(&window->damage, x, y, width, height);
+    return 0;
+}
+
+int wm_set_window_opaque(int window_id, bool opaque)
+{
+    wm_window_t* window = wm_find_window(window_id);
+    if (!window) return -1;
+
+    window->opaque = opaque;
+    return 0;
+}
+
+// Redraw a window's damage: each damaged rectangle, less what opaque
+// windows above hide, is drawn from this window; translucent windows above
+// are then blended back over it. -1 if the window manager doesn't know the window.
+int wm_composite_window(int window_id)
+{
+    wm_window_t* window = wm_find_window(window_id);
+    if (!window) return -1;
+    if (!window->visible) {
+        damage_clear(&window->damage);
+        return 0;
+    }
+
+    rect_t bounds = { window->x, window->y, window->width, window->height };
+    for (int d = 0; d < window->damage.count; d++) {
+        const rect_t* dr = &window->damage.rects[d];
+        rect_t area = { window->x + dr->x, window->y + dr->y, dr->width, dr->height };
+        if (!rect_intersect(&area, &bounds, &area)) continue;
+
+        // Cut out the opaque windows above
+        rect_t frags[WM_MAX_FRAGMENTS];
+        int count = 1;
+        bool repaint_above = false;
+        frags[0] = area;
+        for (int i = 0; i < MAX_WM_WINDOWS && count > 0 && !repaint_above; i++) {
+            wm_window_t* w = &wm_windows[i];
+            if (w->window_id == 0 || !w->visible || !w->opaque || w->z <= window->z) continue;
+
+            rect_t occluder = { w->x, w->y, w->width, w->height };
+            rect_t next[WM_MAX_FRAGMENTS];
+            int next_count = 0;
+            for (int f = 0; f < count; f++) {
+                if (next_count + 4 > WM_MAX_FRAGMENTS) {
+                    repaint_above = true;
+                    break;
+                }
+                next_count += rect_subtract(&frags[f], &occluder, &next[next_count]);
+            }
+            if (repaint_above) break;
+            memcpy(frags, next, next_count * sizeof(rect_t));
+            count = next_count;
+        }
+        if (repaint_above) {
+            frags[0] = area;
+            count = 1;
+        }
+
+        for (int f = 0; f < count; f++) {
+            rect_t local = { frags[f].x - window->x, frags[f].y - window->y,
+                             frags[f].width, frags[f].height };
+            window_present_rect(window->window_id, window->x, window->y, &local, window->opaque);
+
+            // Windows above that show through (or cover it, if the cut-out was abandoned),
+            // bottom to top
+            uint32_t last_z = window->z;
+            for (;;) {
+                wm_window_t* next = NULL;
+                for (int i = 0; i < MAX_WM_WINDOWS; i++) {
+                    wm_window_t* w = &wm_windows[i];
+                    if (w->window_id == 0 || !w->visible || w->z <= last_z) continue;
+                    if (w->opaque && !repaint_above) continue;
+                    if (!next || w->z < next->z) next = w;
+                }
+                if (!next) break;
+                last_z = next->z;
+
+                rect_t above = { next->x, next->y, next->width, next->height };
+                rect_t hit;
+                if (!rect_intersect(&frags[f], &above, &hit)) continue;
+                hit.x -= next->x;
+                hit.y -= next->y;
+                window_present_rect(next->window_id, next->x, next->y, &hit, next->opaque);
+            }
+        }
+    }
+
+    damage_clear(&window->damage);
+    return 0;
 }
 
 int wm_resize_window(int window_id, int width, int height)
@@ -243,7 +439,7 @@ int display_server_main(void)
     KINFO("");
 
     KINFO("📡 Protocol Features:");
-    KINFO("  ├─ Client-server communication");
+    KINFO("  ├─ Client-server IPC channel (call/reply handoff)");
     KINFO("  ├─ Window lifecycle management");
     KINFO("  ├─ Event-driven input handling");
     KINFO("  ├─ Real-time compositing pipeline");
@@ -281,43 +477,63 @@ int display_server_main(void)
         graphics_end_frame(server_window);
     }
 
-    // Event loop
-    while (display_server_running) {
-        // Process any window management tasks
-        // In a full implementation, this would check for client messages
+    display_channel = ipc_channel_create(DISPLAY_CHANNEL_NAME);
+    if (display_channel < 0) {
+        KERROR("Display server: No channel for clients");
+        return -1;
+    }
 
-        // For demo, just yield CPU and let other processes run
-        sys_yield();
+    // Request loop: each reply goes out with the wait for the next request,
+    // so a client's call switches here and straight back
+    ipc_msg_t request, reply;
+    int got = ipc_recv(display_channel, &request, WAIT_FOREVER);
+    while (display_server_running && got >= 0) {
+        if (got == 0 || request.type != IPC_DISPLAY_REQUEST ||
+            request.len != sizeof(display_message_t)) {
+            got = ipc_recv(display_channel, &request, WAIT_FOREVER);
+            continue;
+        }
+
+        display_message_t msg;
+        memcpy(&msg, request.data, sizeof(msg));
+        msg.sender_pid = request.sender;  // Not what the client claims
+        int32_t result = display_handle_message(&msg);
 
-        // Emergency timeout (in real server, this would never exit)
-        static int timeout = 0;
-        if (++timeout > 1000) {  // About 10 seconds at current timing
-            KINFO("Display server: Demo timeout reached - exiting");
-            break;
+        if (request.call_id == 0) {
+            got = ipc_recv(display_channel, &request, WAIT_FOREVER);
+            continue;
         }
+        reply.type = IPC_DISPLAY_REQUEST;
+        reply.len = sizeof(result);
+        reply.call_id = request.call_id;
+        reply.buffer = NULL;
+        reply.buffer_len = 0;
+        memcpy(reply.data, &result, sizeof(result));
+        got = ipc_reply_recv(display_channel, &reply, &request, WAIT_FOREVER);
     }
 
     KINFO("🛑 Display server shutting down...");
+    int channel = display_channel;
+    display_channel = -1;
+    ipc_channel_destroy(channel);
     return 0;
 }
 
 // ============================================================================
-// CLIENT API FUNCTIONS (called by applications)
+// PROTOCOL HANDLING (display server side)
 // ============================================================================
 
-int client_create_window(int x, int y, int width, int height, const char* title)
+static int display_create_window(int x, int y, int width, int height, const char* title, pid_t owner)
 {
-    KDEBUG("Client: Creating window %dx%d at (%d,%d) title='%s'",
-           width, height, x, y, title ? title : "");
+    KDEBUG("Display: Creating window %dx%d at (%d,%d) title='%s' for process %d",
+           width, height, x, y, title ? title : "", owner);
 
     // Create the framebuffer window
-    extern int window_create(int x, int y, int width, int height, pid_t owner_pid);
-    int window_id = window_create(x, y, width, height, scheduler_get_current_task_id());
+    int window_id = window_create(x, y, width, height, owner);
 
     if (window_id > 0) {
         // Register with window manager
-        wm_register_window(window_id, x, y, width, height,
-                          scheduler_get_current_task_id(), title);
+        wm_register_window(window_id, x, y, width, height, owner, title);
 
         KINFO("✅ Window %d created successfully", window_id);
     } else {
@@ -327,19 +543,18 @@ int client_create_window(int x, int y, int width, int height, const char* title)
     return window_id;
 }
 
-int client_destroy_window(int window_id)
+static int display_destroy_window(int window_id)
 {
-    KDEBUG("Client: Destroying window %d", window_id);
+    KDEBUG("Display: Destroying window %d", window_id);
 
     // Unregister from window manager
     wm_unregister_window(window_id);
 
     // Destroy framebuffer window
-    extern int window_destroy(int window_id);
     return window_destroy(window_id);
 }
 
-int client_draw_to_window(int window_id, int x, int y, int width, int height, uint32_t color)
+static int display_draw_rect(int window_id, int x, int y, int width, int height, uint32_t color)
 {
     // Get window buffer
     extern volatile uint8_t* window_get_buffer(int window_id);
@@ -350,14 +565,7 @@ int client_draw_to_window(int window_id, int x, int y, int width, int height, ui
     }
 
     // Find window dimensions
-    wm_window_t* window = NULL;
-    for (int i = 0; i < MAX_WM_WINDOWS; i++) {
-        if (wm_windows[i].window_id == window_id) {
-            window = &wm_windows[i];
-            break;
-        }
-    }
-
+    wm_window_t* window = wm_find_window(window_id);
     if (!window) {
         return -1;
     }
@@ -371,21 +579,112 @@ int client_draw_to_window(int window_id, int x, int y, int width, int height, ui
     if (width <= 0 || height <= 0) return 0;
 
     // Draw to window back buffer (32-bit RGBA)
-    uint32_t* pixel_buffer = (uint32_t*)buffer;
-    for (int py = y; py < y + height; py++) {
-        for (int px = x; px < x + width; px++) {
-            pixel_buffer[py * window->width + px] = color;
+    uint32_t* pixel_buffer = (uint32_t*)buffer + (size_t)y * window->width + x;
+    blit_fill_rect(pixel_buffer, window->width, width, height, color);
+
+    // Only this much needs recompositing
+    damage_add(&window->damage, x, y, width, height);
+    return 0;
+}
+
+// Carry out one request; the result goes back to the caller
+static int display_handle_message(const display_message_t* msg)
+{
+    switch (msg->type) {
+    case MSG_CREATE_WINDOW: {
+        char title[sizeof(msg->data.create_window.title)];
+        memcpy(title, msg->data.create_window.title, sizeof(title));
+        title[sizeof(title) - 1] = '\0';
+        return display_create_window(msg->data.create_window.x, msg->data.create_window.y,
+                                     msg->data.create_window.width, msg->data.create_window.height,
+                                     title, msg->sender_pid);
+    }
+    case MSG_DESTROY_WINDOW:
+    case MSG_CLOSE_WINDOW:
+        return display_destroy_window(msg->data.window_id_only.window_id);
+    case MSG_MOVE_WINDOW:
+        return wm_move_window(msg->data.move_window.window_id,
+                              msg->data.move_window.x, msg->data.move_window.y);
+    case MSG_RESIZE_WINDOW:
+        return wm_resize_window(msg->data.resize_window.window_id,
+                                msg->data.resize_window.width, msg->data.resize_window.height);
+    case MSG_REDRAW_WINDOW:
+        window_composite(msg->data.window_id_only.window_id);
+        return 0;
+    case MSG_DRAW_RECT:
+        return display_draw_rect(msg->data.draw_rect.window_id, msg->data.draw_rect.x,
+                                 msg->data.draw_rect.y, msg->data.draw_rect.width,
+                                 msg->data.draw_rect.height, msg->data.draw_rect.color);
+    default:
+        return -1;  // Input and focus travel the other way, through event queues
+    }
+}
+
+// ============================================================================
+// CLIENT API FUNCTIONS (called by applications)
+// ============================================================================
+
+// Send a request to the display server and wait for its result. Without a
+// server (early boot, or the server itself) it is handled in place.
+static int display_request(display_message_t* msg)
+{
+    msg->sender_pid = scheduler_get_current_task_id();
+
+    int channel = display_channel;
+    if (channel >= 0 && msg->sender_pid != display_server_pid) {
+        ipc_msg_t request, reply;
+        request.type = IPC_DISPLAY_REQUEST;
+        request.len = sizeof(display_message_t);
+        request.buffer = NULL;
+        request.buffer_len = 0;
+        memcpy(request.data, msg, sizeof(display_message_t));
+
+        if (ipc_call(channel, &request, &reply, WAIT_FOREVER) == 0 && reply.len == sizeof(int32_t)) {
+            int32_t result;
+            memcpy(&result, reply.data, sizeof(result));
+            return result;
         }
     }
+    return display_handle_message(msg);
+}
+
+int client_create_window(int x, int y, int width, int height, const char* title)
+{
+    display_message_t msg = { .type = MSG_CREATE_WINDOW };
+    msg.data.create_window.x = x;
+    msg.data.create_window.y = y;
+    msg.data.create_window.width = width;
+    msg.data.create_window.height = height;
+    if (title) {
+        strncpy(msg.data.create_window.title, title, sizeof(msg.data.create_window.title) - 1);
+    }
+    return display_request(&msg);
+}
 
-    return 0;
+int client_destroy_window(int window_id)
+{
+    display_message_t msg = { .type = MSG_DESTROY_WINDOW };
+    msg.data.window_id_only.window_id = window_id;
+    return display_request(&msg);
+}
+
+int client_draw_to_window(int window_id, int x, int y, int width, int height, uint32_t color)
+{
+    display_message_t msg = { .type = MSG_DRAW_RECT };
+    msg.data.draw_rect.window_id = window_id;
+    msg.data.draw_rect.x = x;
+    msg.data.draw_rect.y = y;
+    msg.data.draw_rect.width = width;
+    msg.data.draw_rect.height = height;
+    msg.data.draw_rect.color = color;
+    return display_request(&msg);
 }
 
 int client_composite_window(int window_id)
 {
-    extern void window_composite(int window_id);
-    window_composite(window_id);
-    return 0;
+    display_message_t msg = { .type = MSG_REDRAW_WINDOW };
+    msg.data.window_id_only.window_id = window_id;
+    return display_request(&msg);
 }
 
 // ============================================================================
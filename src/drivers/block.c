@@ -1,15 +1,62 @@
 #include "drivers/block.h"
 #include "kernel.h"
 
+/*
+ * Block layer
+ * Filesystems submit bios; each device has a request queue that merges a
+ * bio into a waiting request for the adjacent sectors, keeps the rest
+ * sorted by LBA and dispatches in one-way elevator order (C-SCAN) up to
+ * the driver's queue depth. Drivers only ever see block_request_t.
+ */
+
 #define MAX_BLOCK_DEVICES 8
+#define BLOCK_PLUG_MAX    64     // Queued requests that end a plug early
+#define BLOCK_RETRY_US    1000   // Back-off after the driver said BLOCK_BUSY
+
+typedef struct block_queue {
+    block_device_t* dev;
+    spinlock_t lock;
+    block_request_t* sorted;       // Waiting, ascending sector
+    block_request_t* retry;        // Refused with BLOCK_BUSY, sent first
+    uint32_t queued;
+    uint32_t in_flight;
+    uint32_t depth;
+    uint32_t plugged;
+    uint64_t head;                 // Sector after the last dispatch
+    bool running;                  // Someone is in block_run_queue()
+    bool rerun;                    // ...and should look again
+    ktimer_t retry_timer;
+
+    size_t bios;
+    size_t back_merges;
+    size_t front_merges;
+    size_t splits;
+    size_t dispatched;
+    size_t flushes;
+} block_queue_t;
 
 static block_device_t* devices[MAX_BLOCK_DEVICES];
+static block_queue_t queues[MAX_BLOCK_DEVICES];
 static int device_count = 0;
 
+static void block_run_queue(block_queue_t* q);
+
+static void block_retry(void* arg) {
+    block_run_queue((block_queue_t*)arg);
+}
+
 int block_register_device(block_device_t* dev) {
     if (device_count >= MAX_BLOCK_DEVICES) return -1;
+
+    block_queue_t* q = &queues[device_count];
+    memset(q, 0, sizeof(*q));
+    q->dev = dev;
+    q->depth = dev->submit && dev->queue_depth ? dev->queue_depth : 1;
+    ktimer_init(&q->retry_timer, block_retry, q);
+    dev->queue = q;
+
     devices[device_count++] = dev;
-    KINFO("Registered block device: %s", dev->name);
+    KINFO("Registered block device: %s (queue depth %u)", dev->name, q->depth);
     return 0;
 }
 
@@ -21,3 +68,367 @@ block_device_t* block_get_device(const char* name) {
     }
     return NULL;
 }
+
+// ============================================================================
+// DRIVER SUBMISSION
+// ============================================================================
+
+// Without a submit hook: one read/write per segment, then done()
+static void block_sync_transfer(block_device_t* dev, block_request_t* req) {
+    int status = 0;
+    if (req->bios) {
+        for (bio_t* bio = req->bios; bio && status == 0; bio = bio->next) {
+            status = req->write ? dev->write(dev, bio->sector, bio->count, bio->buffer)
+                                : dev->read(dev, bio->sector, bio->count, bio->buffer);
+        }
+    } else {
+        status = req->write ? dev->write(dev, req->sector, req->count, req->buffer)
+                            : dev->read(dev, req->sector, req->count, req->buffer);
+    }
+    req->status = status == 0 ? 0 : -1;
+    if (req->done) req->done(req);
+}
+
+int block_submit(block_device_t* dev, block_request_t* req) {
+    if (dev->submit) {
+        return dev->submit(dev, req);
+    }
+    block_sync_transfer(dev, req);
+    return 0;
+}
+
+// ============================================================================
+// REQUEST QUEUE
+// ============================================================================
+
+static uint32_t bio_pages(const bio_t* bio) {
+    uintptr_t start = (uintptr_t)bio->buffer;
+    uintptr_t end = start + (uintptr_t)bio->count * 512;
+    return (uint32_t)(((end + PAGE_SIZE - 1) / PAGE_SIZE) - (start / PAGE_SIZE));
+}
+
+static bool block_fits(block_device_t* dev, uint32_t sectors, uint32_t pages) {
+    return (!dev->max_sectors || sectors <= dev->max_sectors) &&
+           (!dev->max_pages || pages <= dev->max_pages);
+}
+
+// Requests finish bio by bio; the next link is read before end_io frees it
+static void block_request_done(block_request_t* req) {
+    block_queue_t* q = (block_queue_t*)req->private_data;
+    for (bio_t* bio = req->bios; bio; ) {
+        bio_t* next = bio->next;
+        bio->status = req->status;
+        bio->end_io(bio);
+        bio = next;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    q->in_flight--;
+    spin_unlock_irqrestore(&q->lock, flags);
+    kfree(req);
+
+    block_run_queue(q);
+}
+
+// C-SCAN: the first request at or past the head, wrapping to the lowest
+static block_request_t* block_pick(block_queue_t* q) {
+    if (q->retry) {
+        block_request_t* req = q->retry;
+        q->retry = req->next;
+        return req;
+    }
+
+    block_request_t** link = &q->sorted;
+    while (*link && (*link)->sector < q->head) {
+        link = &(*link)->next;
+    }
+    if (!*link) link = &q->sorted;
+
+    block_request_t* req = *link;
+    *link = req->next;
+    q->queued--;
+    return req;
+}
+
+/*
+ * Feed the driver until it is at depth, out of work, or plugged. One
+ * context dispatches at a time; a completion arriving meanwhile (maybe
+ * from inside submit()) just asks it to go round again.
+ */
+static void block_run_queue(block_queue_t* q) {
+    block_device_t* dev = q->dev;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    if (q->running) {
+        q->rerun = true;
+        spin_unlock_irqrestore(&q->lock, flags);
+        return;
+    }
+    q->running = true;
+
+    do {
+        q->rerun = false;
+        while (q->in_flight < q->depth && (q->retry || q->sorted) &&
+               (!q->plugged || q->queued >= BLOCK_PLUG_MAX || q->retry)) {
+            block_request_t* req = block_pick(q);
+            q->head = req->sector + req->count;
+            q->in_flight++;
+            spin_unlock_irqrestore(&q->lock, flags);
+
+            req->next = NULL;
+            int result = block_submit(dev, req);
+
+            flags = spin_lock_irqsave(&q->lock);
+            if (result == BLOCK_BUSY) {
+                q->in_flight--;
+                req->next = q->retry;
+                q->retry = req;
+                if (!ktimer_pending(&q->retry_timer)) {
+                    ktimer_arm_in(&q->retry_timer, BLOCK_RETRY_US);
+                }
+                break;
+            }
+            if (result < 0) {
+                spin_unlock_irqrestore(&q->lock, flags);
+                req->status = -1;
+                block_request_done(req);  // Re-enters as a rerun
+                flags = spin_lock_irqsave(&q->lock);
+                continue;
+            }
+            q->dispatched++;
+        }
+    } while (q->rerun);
+
+    q->running = false;
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+// Merge into a waiting request or insert a new one in sector order
+static int block_queue_bio(block_queue_t* q, bio_t* bio) {
+    block_device_t* dev = q->dev;
+    uint32_t pages = bio_pages(bio);
+    bio->next = NULL;
+
+    // Allocated up front: kmalloc can't run under the queue lock
+    block_request_t* fresh = kmalloc(sizeof(block_request_t));
+    if (!fresh) return -1;
+
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    q->bios++;
+
+    block_request_t** link = &q->sorted;
+    block_request_t* merged = NULL;
+    for (block_request_t* req = q->sorted; req; req = req->next) {
+        if (req->write == bio->write && req->bios &&
+            block_fits(dev, req->count + bio->count, req->pages + pages)) {
+            if (req->sector + req->count == bio->sector) {
+                req->bios_tail->next = bio;
+                req->bios_tail = bio;
+                q->back_merges++;
+                merged = req;
+            } else if (bio->sector + bio->count == req->sector) {
+                bio->next = req->bios;
+                req->bios = bio;
+                req->sector = bio->sector;
+                q->front_merges++;
+                merged = req;
+            }
+            if (merged) {
+                req->count += bio->count;
+                req->pages += pages;
+                break;
+            }
+        }
+        if (req->sector < bio->sector) link = &req->next;
+    }
+
+    if (!merged) {
+        memset(fresh, 0, sizeof(*fresh));
+        fresh->sector = bio->sector;
+        fresh->count = bio->count;
+        fresh->bios = fresh->bios_tail = bio;
+        fresh->pages = pages;
+        fresh->write = bio->write;
+        fresh->done = block_request_done;
+        fresh->private_data = q;
+        fresh->next = *link;
+        *link = fresh;
+        q->queued++;
+        fresh = NULL;
+    }
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    kfree(fresh);
+    block_run_queue(q);
+    return 0;
+}
+
+// ============================================================================
+// BIO SUBMISSION
+// ============================================================================
+
+static void bio_split_end_io(bio_t* piece) {
+    bio_t* parent = piece->parent;
+    if (piece->status < 0) parent->status = -1;
+    kfree(piece);
+    if (__atomic_sub_fetch(&parent->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        parent->end_io(parent);
+    }
+}
+
+// Sectors of bio from offset that fit in one request
+static uint32_t bio_piece_sectors(block_device_t* dev, bio_t* bio, uint32_t offset) {
+    uint32_t sectors = bio->count - offset;
+    if (dev->max_sectors && sectors > dev->max_sectors) sectors = dev->max_sectors;
+    if (dev->max_pages) {
+        uintptr_t start = (uintptr_t)bio->buffer + (uintptr_t)offset * 512;
+        uint32_t room = (uint32_t)(dev->max_pages * PAGE_SIZE - (start & (PAGE_SIZE - 1))) / 512;
+        if (sectors > room) sectors = room;
+    }
+    return sectors;
+}
+
+// A bio over the device limits goes down as several pieces
+static int block_split_bio(block_queue_t* q, bio_t* bio) {
+    block_device_t* dev = q->dev;
+    uint32_t pieces = 0;
+    for (uint32_t off = 0; off < bio->count; off += bio_piece_sectors(dev, bio, off)) {
+        pieces++;
+    }
+
+    bio_t* list = NULL;
+    for (uint32_t i = 0; i < pieces; i++) {
+        bio_t* piece = kmalloc(sizeof(bio_t));
+        if (!piece) {
+            while (list) {
+                bio_t* next = list->next;
+                kfree(list);
+                list = next;
+            }
+            return -1;
+        }
+        piece->next = list;
+        list = piece;
+    }
+
+    bio->status = 0;
+    bio->remaining = pieces;
+    q->splits++;
+
+    uint32_t off = 0;
+    while (list) {
+        bio_t* piece = list;
+        list = list->next;
+        uint32_t sectors = bio_piece_sectors(dev, bio, off);
+        memset(piece, 0, sizeof(*piece));
+        piece->sector = bio->sector + off;
+        piece->count = sectors;
+        piece->buffer = (uint8_t*)bio->buffer + (uintptr_t)off * 512;
+        piece->write = bio->write;
+        piece->end_io = bio_split_end_io;
+        piece->parent = bio;
+        off += sectors;
+        if (block_queue_bio(q, piece) < 0) {
+            piece->status = -1;
+            bio_split_end_io(piece);
+        }
+    }
+    return 0;
+}
+
+int block_submit_bio(block_device_t* dev, bio_t* bio) {
+    block_queue_t* q = dev->queue;
+    if (!q || bio->count == 0 || !bio->end_io) return -1;
+    if (dev->total_sectors && bio->sector + bio->count > dev->total_sectors) return -1;
+
+    bio->status = 0;
+    if (!block_fits(dev, bio->count, bio_pages(bio))) {
+        return block_split_bio(q, bio);
+    }
+    return block_queue_bio(q, bio);
+}
+
+void block_plug(block_device_t* dev) {
+    block_queue_t* q = dev->queue;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    q->plugged++;
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+void block_unplug(block_device_t* dev) {
+    block_queue_t* q = dev->queue;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    q->plugged--;
+    spin_unlock_irqrestore(&q->lock, flags);
+    block_run_queue(q);
+}
+
+// ============================================================================
+// SYNCHRONOUS HELPERS
+// ============================================================================
+
+static void bio_batch_end_io(bio_t* bio) {
+    bio_batch_t* batch = (bio_batch_t*)bio->private_data;
+    if (bio->status < 0) batch->status = -1;
+    if (__atomic_sub_fetch(&batch->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        wake_up(&batch->waiters);
+    }
+}
+
+void bio_batch_init(bio_batch_t* batch) {
+    batch->pending = 0;
+    batch->status = 0;
+    wait_queue_init(&batch->waiters);
+}
+
+void bio_batch_add(bio_batch_t* batch, bio_t* bio) {
+    __atomic_add_fetch(&batch->pending, 1, __ATOMIC_RELAXED);
+    bio->end_io = bio_batch_end_io;
+    bio->private_data = batch;
+}
+
+int bio_batch_wait(bio_batch_t* batch) {
+    wait_entry_t wait;
+    for (;;) {
+        wait_prepare(&batch->waiters, &wait);
+        if (__atomic_load_n(&batch->pending, __ATOMIC_ACQUIRE) == 0) break;
+        wait_schedule(&wait, WAIT_FOREVER);
+    }
+    wait_finish(&wait);
+    return batch->status;
+}
+
+static int block_transfer(block_device_t* dev, uint64_t sector, uint32_t count, void* buffer,
+                          bool write) {
+    bio_batch_t batch;
+    bio_t bio = { .sector = sector, .count = count, .buffer = buffer, .write = write };
+    bio_batch_init(&batch);
+    bio_batch_add(&batch, &bio);
+    if (block_submit_bio(dev, &bio) < 0) return -1;
+    return bio_batch_wait(&batch);
+}
+
+int block_read(block_device_t* dev, uint64_t sector, uint32_t count, void* buffer) {
+    return block_transfer(dev, sector, count, buffer, false);
+}
+
+int block_write(block_device_t* dev, uint64_t sector, uint32_t count, const void* buffer) {
+    return block_transfer(dev, sector, count, (void*)buffer, true);
+}
+
+int block_flush(block_device_t* dev) {
+    if (!dev->flush) return 0;
+    __atomic_add_fetch(&dev->queue->flushes, 1, __ATOMIC_RELAXED);
+    return dev->flush(dev);
+}
+
+void block_get_stats(void) {
+    KINFO("=== Block Queue Statistics ===");
+    for (int i = 0; i < device_count; i++) {
+        block_queue_t* q = &queues[i];
+        KINFO("%s: %lu bios, %lu back / %lu front merges, %lu splits, %lu requests dispatched",
+              devices[i]->name, q->bios, q->back_merges, q->front_merges, q->splits,
+              q->dispatched);
+        KINFO("  queued %u, in flight %u/%u, %lu flushes", q->queued, q->in_flight, q->depth,
+              q->flushes);
+    }
+}
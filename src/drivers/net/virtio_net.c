@@ -0,0 +1,642 @@
+#include "kernel.h"
+#include "net.h"
+#include "smp.h"
+#include "drivers/pci.h"
+
+// virtio-net (virtio 1.0 PCI transport, split virtqueues)
+// One RX/TX queue pair per CPU, each with its own MSI-X vector aimed at
+// that CPU and a poll task bound to it. The interrupt only masks the
+// pair's queues and wakes the task, which reaps up to a budget of
+// received frames per pass and hands them to the stack as a batch;
+// interrupts come back on only once a pass finds the rings empty.
+// Without MSI-X the tasks poll on a timer instead.
+
+#define VIRTIO_VENDOR_ID          0x1AF4
+#define VIRTIO_NET_DEVICE_MODERN  0x1041
+#define VIRTIO_NET_DEVICE_LEGACY  0x1000  // Transitional; also has the modern caps
+
+// Vendor capability types (cfg_type)
+#define VIRTIO_PCI_CAP_COMMON     1
+#define VIRTIO_PCI_CAP_NOTIFY     2
+#define VIRTIO_PCI_CAP_ISR        3
+#define VIRTIO_PCI_CAP_DEVICE     4
+
+// Device status
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_FAILED      0x80
+
+// Feature bits
+#define VIRTIO_NET_F_CSUM         (1ULL << 0)   // Device completes partial TX checksums
+#define VIRTIO_NET_F_GUEST_CSUM   (1ULL << 1)   // Device checks (or vouches for) RX checksums
+#define VIRTIO_NET_F_MAC          (1ULL << 5)
+#define VIRTIO_NET_F_CTRL_VQ      (1ULL << 17)
+#define VIRTIO_NET_F_MQ           (1ULL << 22)
+#define VIRTIO_F_VERSION_1        (1ULL << 32)
+#define VIRTIO_NET_F_HOST_USO     (1ULL << 56)  // Device splits UDP GSO packets
+
+#define VIRTIO_MSI_NO_VECTOR      0xFFFF
+
+// virtio_net_hdr flags
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1     // Checksum from csum_start still to be done
+#define VIRTIO_NET_HDR_F_DATA_VALID 2     // Checksum already verified
+#define VIRTIO_NET_HDR_GSO_UDP_L4   5     // gso_type: UDP segmentation
+
+// Control queue: class/command, data, then an ack byte the device writes
+#define VIRTIO_NET_CTRL_MQ        4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_OK             0
+
+// Split virtqueue flags
+#define VIRTQ_DESC_F_NEXT         1
+#define VIRTQ_DESC_F_WRITE        2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY    1
+
+#define VNET_HDR_LEN              sizeof(virtio_net_hdr_t)  // num_buffers included (VERSION_1)
+#define VNET_QUEUE_SIZE           256     // Upper bound on ring entries we use
+#define VNET_POLL_BUDGET          64      // Frames per pass before yielding the CPU
+#define VNET_POLL_US              1000    // Poll interval without MSI-X
+#define VNET_CTRL_TIMEOUT_US      100000
+#define VNET_TASK_PRIORITY        10
+
+// ============================================================================
+// DEVICE LAYOUT
+// ============================================================================
+
+typedef struct {
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_driver_lo;
+    uint32_t queue_driver_hi;
+    uint32_t queue_device_lo;
+    uint32_t queue_device_hi;
+} __attribute__((packed)) virtio_common_cfg_t;
+
+typedef struct {
+    uint8_t mac[6];
+    uint16_t status;
+    uint16_t max_virtqueue_pairs;
+} __attribute__((packed)) virtio_net_config_t;
+
+// In front of every frame, both directions
+typedef struct {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;          // From the start of the frame
+    uint16_t csum_offset;         // From csum_start
+    uint16_t num_buffers;
+} __attribute__((packed)) virtio_net_hdr_t;
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} __attribute__((packed)) virtq_used_elem_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    virtq_used_elem_t ring[];
+} __attribute__((packed)) virtq_used_t;
+
+// ============================================================================
+// DRIVER STATE
+// ============================================================================
+
+typedef struct {
+    uint16_t index;               // Queue number on the device
+    uint16_t size;
+    virtq_desc_t* desc;
+    volatile virtq_avail_t* avail;
+    volatile virtq_used_t* used;
+    volatile uint16_t* notify;
+    uint16_t free_head;           // Chain of unused descriptors
+    uint16_t num_free;
+    uint16_t avail_idx;           // Shadow of avail->idx, published by vq_kick()
+    uint16_t last_used;           // Next used entry to reap
+    void** cookies;               // Owner of each chain, by head descriptor
+} virtq_t;
+
+typedef struct {
+    int cpu;
+    virtq_t rx;
+    virtq_t tx;
+    spinlock_t tx_lock;           // Senders on any CPU and the TX reclaim
+    wait_queue_t wait;            // Poll task, woken by the interrupt
+    uint16_t rx_posted;           // Buffers to keep on the RX ring
+} vnet_pair_t;
+
+// A buffer segment for vq_add()
+typedef struct {
+    void* buf;
+    uint32_t len;
+    bool write;                   // Device writes it
+} vq_seg_t;
+
+static volatile virtio_common_cfg_t* vnet_common;
+static volatile uint8_t* vnet_notify_base;
+static uint32_t vnet_notify_mult;
+static volatile virtio_net_config_t* vnet_config;
+
+static vnet_pair_t vnet_pairs[MAX_CPUS];
+static int vnet_pair_count;
+static virtq_t vnet_ctrl;
+static bool vnet_msix = false;
+static net_interface_t vnet_if;
+
+// ============================================================================
+// VIRTQUEUES
+// ============================================================================
+
+static int vq_setup(virtq_t* vq, uint16_t index, uint16_t msix_entry) {
+    vnet_common->queue_select = index;
+    uint16_t size = vnet_common->queue_size;
+    if (size == 0) return -1;
+    if (size > VNET_QUEUE_SIZE) size = VNET_QUEUE_SIZE;
+
+    // Descriptors, then the avail ring, then the used ring (4-byte aligned)
+    size_t desc_bytes = (size_t)size * sizeof(virtq_desc_t);
+    size_t avail_bytes = 6 + 2 * (size_t)size;
+    size_t used_off = (desc_bytes + avail_bytes + 3) & ~(size_t)3;
+    size_t total = used_off + 6 + (size_t)size * sizeof(virtq_used_elem_t);
+    size_t pages = (total + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uintptr_t mem = pmm_alloc_pages(pages);
+    if (!mem) return -1;
+    memset((void*)mem, 0, pages * PAGE_SIZE);
+
+    vq->cookies = kmalloc_tracked(size * sizeof(void*), "virtq_cookies");
+    if (!vq->cookies) {
+        pmm_free_pages(mem, pages);
+        return -1;
+    }
+    memset(vq->cookies, 0, size * sizeof(void*));
+
+    vq->index = index;
+    vq->size = size;
+    vq->desc = (virtq_desc_t*)mem;
+    vq->avail = (volatile virtq_avail_t*)(mem + desc_bytes);
+    vq->used = (volatile virtq_used_t*)(mem + used_off);
+    vq->free_head = 0;
+    vq->num_free = size;
+    vq->avail_idx = 0;
+    vq->last_used = 0;
+    for (uint16_t i = 0; i < size; i++) vq->desc[i].next = (uint16_t)(i + 1);
+
+    // Rings live in identity-mapped PMM pages
+    vnet_common->queue_size = size;
+    vnet_common->queue_desc_lo = (uint32_t)mem;
+    vnet_common->queue_desc_hi = (uint32_t)((uint64_t)mem >> 32);
+    vnet_common->queue_driver_lo = (uint32_t)(uintptr_t)vq->avail;
+    vnet_common->queue_driver_hi = (uint32_t)((uint64_t)(uintptr_t)vq->avail >> 32);
+    vnet_common->queue_device_lo = (uint32_t)(uintptr_t)vq->used;
+    vnet_common->queue_device_hi = (uint32_t)((uint64_t)(uintptr_t)vq->used >> 32);
+
+    vnet_common->queue_msix_vector = msix_entry;
+    if (msix_entry != VIRTIO_MSI_NO_VECTOR && vnet_common->queue_msix_vector != msix_entry) {
+        return -1;  // Device could not take the vector
+    }
+
+    vq->notify = (volatile uint16_t*)(vnet_notify_base +
+                                      (uint32_t)vnet_common->queue_notify_off * vnet_notify_mult);
+    vnet_common->queue_enable = 1;
+    return 0;
+}
+
+// Chain segments onto the ring, split at page boundaries; not visible to
+// the device until vq_kick(). -1 if the ring is too full.
+static int vq_add(virtq_t* vq, const vq_seg_t* segs, int nsegs, void* cookie) {
+    uint16_t needed = 0;
+    for (int i = 0; i < nsegs; i++) {
+        uintptr_t start = (uintptr_t)segs[i].buf;
+        uintptr_t last = start + segs[i].len - 1;
+        needed += (uint16_t)((last / PAGE_SIZE) - (start / PAGE_SIZE) + 1);
+    }
+    if (needed > vq->num_free) return -1;
+
+    uint16_t head = vq->free_head;
+    uint16_t id = head;
+    uint16_t prev = head;
+    for (int i = 0; i < nsegs; i++) {
+        uintptr_t addr = (uintptr_t)segs[i].buf;
+        uint32_t left = segs[i].len;
+        while (left > 0) {
+            uint32_t chunk = PAGE_SIZE - (uint32_t)(addr & (PAGE_SIZE - 1));
+            if (chunk > left) chunk = left;
+
+            virtq_desc_t* d = &vq->desc[id];
+            d->addr = vmm_get_physical(addr);
+            d->len = chunk;
+            d->flags = (uint16_t)((segs[i].write ? VIRTQ_DESC_F_WRITE : 0) | VIRTQ_DESC_F_NEXT);
+            prev = id;
+            id = d->next;
+            addr += chunk;
+            left -= chunk;
+        }
+    }
+    vq->desc[prev].flags &= (uint16_t)~VIRTQ_DESC_F_NEXT;
+    vq->free_head = id;
+    vq->num_free -= needed;
+
+    vq->cookies[head] = cookie;
+    vq->avail->ring[vq->avail_idx % vq->size] = head;
+    vq->avail_idx++;
+    return 0;
+}
+
+// Publish added chains and notify the device unless it asked not to be
+static void vq_kick(virtq_t* vq) {
+    __atomic_store_n(&vq->avail->idx, vq->avail_idx, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);  // idx store before the flags load
+    if (!(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY)) *vq->notify = vq->index;
+}
+
+static bool vq_has_used(virtq_t* vq) {
+    return __atomic_load_n(&vq->used->idx, __ATOMIC_ACQUIRE) != vq->last_used;
+}
+
+// Next completed chain: its descriptors go back on the free list; NULL if none
+static void* vq_get_used(virtq_t* vq, uint32_t* len) {
+    if (!vq_has_used(vq)) return NULL;
+
+    volatile virtq_used_elem_t* elem = &vq->used->ring[vq->last_used % vq->size];
+    uint16_t head = (uint16_t)elem->id;
+    if (len) *len = elem->len;
+    vq->last_used++;
+
+    uint16_t id = head;
+    uint16_t count = 1;
+    while (vq->desc[id].flags & VIRTQ_DESC_F_NEXT) {
+        id = vq->desc[id].next;
+        count++;
+    }
+    vq->desc[id].next = vq->free_head;
+    vq->free_head = head;
+    vq->num_free += count;
+
+    void* cookie = vq->cookies[head];
+    vq->cookies[head] = NULL;
+    return cookie;
+}
+
+static void vq_set_interrupts(virtq_t* vq, bool on) {
+    vq->avail->flags = on ? 0 : VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
+
+// ============================================================================
+// RECEIVE AND TRANSMIT
+// ============================================================================
+
+// Keep rx_posted buffers on the ring; the device writes the virtio header
+// just in front of pkt->data, so the frame lands where the stack wants it
+static void vnet_rx_refill(vnet_pair_t* qp) {
+    bool added = false;
+    while (qp->rx.size - qp->rx.num_free < qp->rx_posted) {
+        packet_t* pkt = net_alloc_packet(NET_MAX_PAYLOAD);
+        if (!pkt) break;
+
+        vq_seg_t seg = { pkt->data - VNET_HDR_LEN, (uint32_t)(pkt->end - pkt->data) + VNET_HDR_LEN, true };
+        if (vq_add(&qp->rx, &seg, 1, pkt) < 0) {
+            net_free_packet(pkt);
+            break;
+        }
+        added = true;
+    }
+    if (added) vq_kick(&qp->rx);
+}
+
+static void vnet_tx_reclaim_locked(vnet_pair_t* qp) {
+    packet_t* pkt;
+    while ((pkt = vq_get_used(&qp->tx, NULL)) != NULL) net_free_packet(pkt);
+}
+
+// Reap up to budget frames, refill the ring once, then pass the batch up
+static int vnet_poll(vnet_pair_t* qp, int budget) {
+    uint64_t flags = spin_lock_irqsave(&qp->tx_lock);
+    vnet_tx_reclaim_locked(qp);
+    spin_unlock_irqrestore(&qp->tx_lock, flags);
+
+    packet_t* batch[VNET_POLL_BUDGET];
+    int count = 0;
+    uint32_t len;
+    packet_t* pkt;
+    while (count < budget && (pkt = vq_get_used(&qp->rx, &len)) != NULL) {
+        if (len <= VNET_HDR_LEN) {
+            vnet_if.rx_dropped++;
+            net_free_packet(pkt);
+            continue;
+        }
+        virtio_net_hdr_t* hdr = (virtio_net_hdr_t*)(pkt->data - VNET_HDR_LEN);
+        if (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID)) {
+            pkt->flags |= PACKET_CSUM_VERIFIED;  // NEEDS_CSUM: never left the host
+        }
+        packet_put(pkt, len - VNET_HDR_LEN);
+        batch[count++] = pkt;
+    }
+    vnet_rx_refill(qp);
+
+    for (int i = 0; i < count; i++) net_rx_packet(&vnet_if, batch[i]);
+    return count;
+}
+
+static bool vnet_has_work(vnet_pair_t* qp) {
+    return vq_has_used(&qp->rx) || vq_has_used(&qp->tx);
+}
+
+static void vnet_set_interrupts(vnet_pair_t* qp, bool on) {
+    vq_set_interrupts(&qp->rx, on);
+    vq_set_interrupts(&qp->tx, on);
+}
+
+// MSI-X, on the pair's own CPU: mask the pair and hand over to its task
+static void vnet_msix_handler(void* arg) {
+    vnet_pair_t* qp = (vnet_pair_t*)arg;
+    vnet_set_interrupts(qp, false);
+    wake_up(&qp->wait);
+}
+
+static void vnet_poll_task(void* arg) {
+    vnet_pair_t* qp = (vnet_pair_t*)arg;
+    wait_entry_t wait;
+
+    for (;;) {
+        if (vnet_poll(qp, VNET_POLL_BUDGET) >= VNET_POLL_BUDGET) {
+            scheduler_yield();  // Still busy: stay masked, let others run
+            continue;
+        }
+
+        // Rings drained: unmask, then look again for anything that
+        // completed before the device could see the flags
+        wait_prepare(&qp->wait, &wait);
+        if (vnet_msix) {
+            uint64_t flags = irq_save();
+            vnet_set_interrupts(qp, true);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            bool pending = vnet_has_work(qp);
+            if (pending) vnet_set_interrupts(qp, false);
+            irq_restore(flags);
+            if (!pending) wait_schedule(&wait, WAIT_FOREVER);
+        } else if (!vnet_has_work(qp)) {
+            wait_schedule(&wait, time_monotonic_us() + VNET_POLL_US);
+        }
+        wait_finish(&wait);
+    }
+}
+
+// The sending CPU's pair; the header goes into the packet's headroom
+static int vnet_send_packet(net_interface_t* netif, packet_t* pkt) {
+    vnet_pair_t* qp = &vnet_pairs[smp_cpu_id() % vnet_pair_count];
+
+    uint16_t csum_start = (uint16_t)((uint8_t*)pkt->l4_header - pkt->data);
+    virtio_net_hdr_t* hdr = packet_push(pkt, VNET_HDR_LEN);
+    if (!hdr) {
+        netif->tx_dropped++;
+        net_free_packet(pkt);
+        return -1;
+    }
+    memset(hdr, 0, VNET_HDR_LEN);
+    if (pkt->flags & PACKET_CSUM_PARTIAL) {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = csum_start;
+        hdr->csum_offset = pkt->csum_offset;
+    }
+    if (pkt->gso_size) {
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_UDP_L4;
+        hdr->gso_size = pkt->gso_size;
+        hdr->hdr_len = (uint16_t)(csum_start + 8);  // Through the UDP header
+    }
+
+    // Headers, then any page fragments straight from the page cache
+    vq_seg_t segs[1 + PACKET_MAX_FRAGS];
+    int nsegs = 0;
+    segs[nsegs++] = (vq_seg_t){ pkt->data, pkt->len, false };
+    for (uint8_t i = 0; i < pkt->nr_frags; i++) {
+        segs[nsegs++] = (vq_seg_t){ pkt->frags[i].data, pkt->frags[i].len, false };
+    }
+
+    uint64_t flags = spin_lock_irqsave(&qp->tx_lock);
+    if (vq_add(&qp->tx, segs, nsegs, pkt) < 0) {
+        vnet_tx_reclaim_locked(qp);
+        if (vq_add(&qp->tx, segs, nsegs, pkt) < 0) {
+            spin_unlock_irqrestore(&qp->tx_lock, flags);
+            netif->tx_dropped++;
+            net_free_packet(pkt);
+            return -1;
+        }
+    }
+    vq_kick(&qp->tx);
+    spin_unlock_irqrestore(&qp->tx_lock, flags);
+    return 0;
+}
+
+// ============================================================================
+// INITIALIZATION
+// ============================================================================
+
+// Map a capability's window (uncached registers); NULL if it has none
+static volatile uint8_t* vnet_map_cap(const pci_device_t* pci, uint8_t cap) {
+    uint8_t bar = (uint8_t)pci_read32(pci, cap + 4);
+    uint32_t offset = pci_read32(pci, cap + 8);
+    uint32_t length = pci_read32(pci, cap + 12);
+    uint64_t base = pci_bar_address(pci, bar);
+    if (!base || bar > 5) return NULL;
+
+    uintptr_t start = (uintptr_t)(base + offset);
+    for (uintptr_t page = start & ~(uintptr_t)(PAGE_SIZE - 1); page < start + length; page += PAGE_SIZE) {
+        vmm_map_page(page, page, PAGE_PRESENT | PAGE_WRITABLE | PAGE_CACHE_DISABLE);
+    }
+    return (volatile uint8_t*)start;
+}
+
+static int vnet_find_caps(const pci_device_t* pci) {
+    for (uint8_t cap = pci_find_capability(pci, PCI_CAP_ID_VENDOR); cap;
+         cap = pci_next_capability(pci, cap, PCI_CAP_ID_VENDOR)) {
+        uint8_t type = (uint8_t)(pci_read32(pci, cap) >> 24);
+        if (type == VIRTIO_PCI_CAP_COMMON && !vnet_common) {
+            vnet_common = (volatile virtio_common_cfg_t*)vnet_map_cap(pci, cap);
+        } else if (type == VIRTIO_PCI_CAP_NOTIFY && !vnet_notify_base) {
+            vnet_notify_base = vnet_map_cap(pci, cap);
+            vnet_notify_mult = pci_read32(pci, cap + 16);
+        } else if (type == VIRTIO_PCI_CAP_DEVICE && !vnet_config) {
+            vnet_config = (volatile virtio_net_config_t*)vnet_map_cap(pci, cap);
+        }
+    }
+    return vnet_common && vnet_notify_base && vnet_config ? 0 : -1;
+}
+
+static uint64_t vnet_negotiate(uint64_t wanted) {
+    vnet_common->device_feature_select = 0;
+    uint64_t offered = vnet_common->device_feature;
+    vnet_common->device_feature_select = 1;
+    offered |= (uint64_t)vnet_common->device_feature << 32;
+
+    uint64_t features = offered & wanted;
+    vnet_common->driver_feature_select = 0;
+    vnet_common->driver_feature = (uint32_t)features;
+    vnet_common->driver_feature_select = 1;
+    vnet_common->driver_feature = (uint32_t)(features >> 32);
+    return features;
+}
+
+// Tell the device how many pairs to spread RX across (synchronous, boot only)
+static int vnet_set_pairs(uint16_t pairs) {
+    uint8_t* buf = (uint8_t*)pmm_alloc_zeroed_page();
+    if (!buf) return -1;
+    buf[0] = VIRTIO_NET_CTRL_MQ;
+    buf[1] = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+    memcpy(buf + 2, &pairs, sizeof(pairs));
+    buf[4] = 0xFF;
+
+    vq_seg_t segs[3] = { { buf, 2, false }, { buf + 2, 2, false }, { buf + 4, 1, true } };
+    int ret = -1;
+    if (vq_add(&vnet_ctrl, segs, 3, buf) == 0) {
+        vq_kick(&vnet_ctrl);
+        uint64_t deadline = time_monotonic_us() + VNET_CTRL_TIMEOUT_US;
+        while (!vq_get_used(&vnet_ctrl, NULL) && time_monotonic_us() < deadline) {
+            __asm__ volatile("pause");
+        }
+        ret = buf[4] == VIRTIO_NET_OK ? 0 : -1;
+    }
+    pmm_free_pages((uintptr_t)buf, 1);
+    return ret;
+}
+
+void virtio_net_init(void) {
+    pci_device_t pci;
+    if (pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_NET_DEVICE_MODERN, &pci) < 0 &&
+        pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_NET_DEVICE_LEGACY, &pci) < 0) {
+        return;  // Not on virtio
+    }
+    KINFO("Found virtio-net at %d:%d:%d", pci.bus, pci.slot, pci.func);
+
+    if (vnet_find_caps(&pci) < 0) {
+        KWARN("virtio-net: No modern (virtio 1.0) interface");
+        return;
+    }
+    pci_enable_bus_master(&pci);
+
+    // Reset, then the status handshake up to feature negotiation
+    vnet_common->device_status = 0;
+    while (vnet_common->device_status != 0) __asm__ volatile("pause");
+    vnet_common->device_status = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+
+    uint64_t features = vnet_negotiate(VIRTIO_F_VERSION_1 | VIRTIO_NET_F_MAC |
+                                       VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ |
+                                       VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |
+                                       VIRTIO_NET_F_HOST_USO);
+    vnet_common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    if (!(features & VIRTIO_F_VERSION_1) ||
+        !(vnet_common->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+        KWARN("virtio-net: Feature negotiation failed");
+        vnet_common->device_status |= VIRTIO_STATUS_FAILED;
+        return;
+    }
+    bool mq = (features & VIRTIO_NET_F_MQ) && (features & VIRTIO_NET_F_CTRL_VQ);
+    uint16_t max_pairs = mq ? vnet_config->max_virtqueue_pairs : 1;
+
+    // A pair per CPU as far as the device (and its MSI-X table) goes
+    int pairs = smp_cpu_count();
+    if (pairs > max_pairs) pairs = max_pairs;
+    if (pairs > MAX_CPUS) pairs = MAX_CPUS;
+    int msix_entries = pci_msix_count(&pci);
+    if (msix_entries > 0 && pairs > msix_entries) pairs = msix_entries;
+
+    uint64_t msix_address[MAX_CPUS];
+    uint16_t msix_data[MAX_CPUS];
+    int vectors = 0;
+    while (msix_entries > 0 && vectors < pairs) {
+        int vector = apic_alloc_msi_vector(vnet_msix_handler, &vnet_pairs[vectors]);
+        if (vector < 0) break;
+        msix_address[vectors] = apic_msi_address(smp_get_cpu(vectors)->apic_id);
+        msix_data[vectors] = (uint16_t)vector;
+        vectors++;
+    }
+    if (vectors > 0) {
+        pairs = vectors;
+        vnet_msix = pci_enable_msix(&pci, msix_address, msix_data, vectors) == 0;
+    }
+    vnet_common->msix_config = VIRTIO_MSI_NO_VECTOR;
+
+    uint16_t rx_posted = (uint16_t)(NET_PACKET_POOL_SIZE / 2 / pairs);
+    if (rx_posted < 32) rx_posted = 32;
+    for (int i = 0; i < pairs; i++) {
+        vnet_pair_t* qp = &vnet_pairs[i];
+        uint16_t entry = vnet_msix ? (uint16_t)i : VIRTIO_MSI_NO_VECTOR;
+        qp->cpu = i;
+        wait_queue_init(&qp->wait);
+        if (vq_setup(&qp->rx, (uint16_t)(2 * i), entry) < 0 ||
+            vq_setup(&qp->tx, (uint16_t)(2 * i + 1), entry) < 0) {
+            if (i == 0) {
+                KWARN("virtio-net: Queue setup failed");
+                vnet_common->device_status |= VIRTIO_STATUS_FAILED;
+                return;
+            }
+            pairs = i;
+            break;
+        }
+        qp->rx_posted = rx_posted < qp->rx.size ? rx_posted : qp->rx.size;
+        vnet_set_interrupts(qp, false);  // The poll task unmasks when idle
+    }
+    if (mq && vq_setup(&vnet_ctrl, (uint16_t)(2 * max_pairs), VIRTIO_MSI_NO_VECTOR) < 0) mq = false;
+    vnet_pair_count = pairs;
+
+    vnet_common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+    if (mq && pairs > 1 && vnet_set_pairs((uint16_t)pairs) < 0) {
+        KWARN("virtio-net: Device refused %d queue pairs, receiving on one", pairs);
+    }
+
+    for (int i = 0; i < pairs; i++) vnet_rx_refill(&vnet_pairs[i]);
+
+    memset(&vnet_if, 0, sizeof(vnet_if));
+    strcpy(vnet_if.name, "eth0");
+    for (int i = 0; i < 6; i++) vnet_if.mac_addr.addr[i] = vnet_config->mac[i];
+    vnet_if.ip_addr = 0x0A00020F;  // 10.0.2.15 (QEMU/KVM user networking)
+    vnet_if.netmask = 0xFFFFFF00;
+    vnet_if.gateway = 0x0A000202;
+    vnet_if.flags = 0x03;          // UP | RUNNING
+    vnet_if.features = NETIF_F_SG;
+    if (features & VIRTIO_NET_F_CSUM) vnet_if.features |= NETIF_F_IP_CSUM;
+    if (features & VIRTIO_NET_F_GUEST_CSUM) vnet_if.features |= NETIF_F_RXCSUM;
+    if ((features & VIRTIO_NET_F_HOST_USO) && (features & VIRTIO_NET_F_CSUM)) {
+        vnet_if.features |= NETIF_F_GSO_UDP;
+    }
+    vnet_if.send_packet = vnet_send_packet;
+    net_register_interface(&vnet_if);
+
+    for (int i = 0; i < pairs; i++) {
+        scheduler_create_task_ex(vnet_poll_task, &vnet_pairs[i], 16384, VNET_TASK_PRIORITY,
+                                 "virtio_net", SCHED_FLAG_CPU(i));
+    }
+    KINFO("virtio-net: %d queue pair%s, %s, checksum offload %s", pairs, pairs == 1 ? "" : "s",
+          vnet_msix ? "MSI-X per pair" : "polled", (vnet_if.features & NETIF_F_IP_CSUM) ? "on" : "off");
+}
@@ -0,0 +1,202 @@
+#include "kernel.h"
+#include "drivers/pci.h"
+#include "io.h"
+
+// PCI configuration space access
+// Mechanism #1 only: every bus is visible through ports 0xCF8/0xCFC
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// MSI capability layout
+#define MSI_CONTROL        0x02
+#define MSI_ADDRESS_LO     0x04
+#define MSI_ADDRESS_HI     0x08
+#define MSI_DATA_32        0x08
+#define MSI_DATA_64        0x0C
+#define MSI_CONTROL_ENABLE 0x0001
+#define MSI_CONTROL_MME    0x0070  // Multiple message enable (0 = one vector)
+#define MSI_CONTROL_64BIT  0x0080
+
+// MSI-X capability layout; the table lives in a memory BAR
+#define MSIX_CONTROL         0x02
+#define MSIX_TABLE           0x04  // BIR in bits 0-2, offset in the rest
+#define MSIX_CONTROL_SIZE    0x07FF
+#define MSIX_CONTROL_MASKALL 0x4000
+#define MSIX_CONTROL_ENABLE  0x8000
+#define MSIX_ENTRY_SIZE      16
+#define MSIX_VECTOR_MASKED   0x0001
+
+#define PCI_BAR_IO           0x01
+#define PCI_BAR_TYPE_64      0x04
+
+static spinlock_t pci_lock = SPINLOCK_INIT;  // Address/data port pair
+
+static inline uint32_t pci_address(const pci_device_t* dev, uint8_t offset) {
+    return 0x80000000 | ((uint32_t)dev->bus << 16) | ((uint32_t)dev->slot << 11) |
+           ((uint32_t)dev->func << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_read32(const pci_device_t* dev, uint8_t offset) {
+    uint64_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev, offset));
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    spin_unlock_irqrestore(&pci_lock, flags);
+    return value;
+}
+
+void pci_write32(const pci_device_t* dev, uint8_t offset, uint32_t value) {
+    uint64_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev, offset));
+    outl(PCI_CONFIG_DATA, value);
+    spin_unlock_irqrestore(&pci_lock, flags);
+}
+
+uint16_t pci_read16(const pci_device_t* dev, uint8_t offset) {
+    return (uint16_t)(pci_read32(dev, offset) >> ((offset & 2) * 8));
+}
+
+void pci_write16(const pci_device_t* dev, uint8_t offset, uint16_t value) {
+    uint32_t shift = (offset & 2) * 8;
+    uint32_t dword = pci_read32(dev, offset);
+    dword = (dword & ~(0xFFFFU << shift)) | ((uint32_t)value << shift);
+    pci_write32(dev, offset, dword);
+}
+
+// First function whose ID and class/revision dwords match under the masks
+static int pci_find_first(uint32_t id_match, uint32_t id_mask, uint32_t class_match,
+                          uint32_t class_mask, pci_device_t* out) {
+    for (int bus = 0; bus < 256; bus++) {
+        for (int slot = 0; slot < 32; slot++) {
+            for (int func = 0; func < 8; func++) {
+                pci_device_t dev = { (uint8_t)bus, (uint8_t)slot, (uint8_t)func, 0, 0, 0, 0, 0 };
+                uint32_t id = pci_read32(&dev, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF) {
+                    if (func == 0) break;  // No device in this slot
+                    continue;
+                }
+
+                uint32_t class_rev = pci_read32(&dev, PCI_CLASS_REVISION);
+                if ((id & id_mask) == id_match && (class_rev & class_mask) == class_match) {
+                    dev.vendor_id = (uint16_t)id;
+                    dev.device_id = (uint16_t)(id >> 16);
+                    dev.class_code = (uint8_t)(class_rev >> 24);
+                    dev.subclass = (uint8_t)(class_rev >> 16);
+                    dev.prog_if = (uint8_t)(class_rev >> 8);
+                    *out = dev;
+                    return 0;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+int pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t* out) {
+    uint32_t class_match = ((uint32_t)class_code << 24) | ((uint32_t)subclass << 16);
+    return pci_find_first(0, 0, class_match, 0xFFFF0000, out);
+}
+
+int pci_find_device(uint16_t vendor_id, uint16_t device_id, pci_device_t* out) {
+    return pci_find_first(vendor_id | ((uint32_t)device_id << 16), 0xFFFFFFFF, 0, 0, out);
+}
+
+uint32_t pci_read_bar(const pci_device_t* dev, int bar) {
+    return pci_read32(dev, (uint8_t)(PCI_BAR0 + bar * 4));
+}
+
+uint64_t pci_bar_address(const pci_device_t* dev, int bar) {
+    uint32_t low = pci_read_bar(dev, bar);
+    if (low & PCI_BAR_IO) return 0;
+
+    uint64_t address = low & 0xFFFFFFF0;
+    if ((low & 0x06) == PCI_BAR_TYPE_64 && bar < 5) {
+        address |= (uint64_t)pci_read_bar(dev, bar + 1) << 32;
+    }
+    return address;
+}
+
+void pci_enable_bus_master(const pci_device_t* dev) {
+    uint16_t cmd = pci_read16(dev, PCI_COMMAND);
+    pci_write16(dev, PCI_COMMAND, cmd | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+}
+
+uint8_t pci_find_capability(const pci_device_t* dev, uint8_t cap_id) {
+    return pci_next_capability(dev, 0, cap_id);
+}
+
+// Capability after the one at offset after (0: search from the start)
+uint8_t pci_next_capability(const pci_device_t* dev, uint8_t after, uint8_t cap_id) {
+    if (!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAP_LIST)) return 0;
+
+    uint8_t ptr = after ? (pci_read32(dev, after) >> 8) & 0xFC
+                        : pci_read32(dev, PCI_CAP_POINTER) & 0xFC;
+    for (int guard = 0; ptr && guard < 48; guard++) {
+        uint32_t header = pci_read32(dev, ptr);
+        if ((header & 0xFF) == cap_id) return ptr;
+        ptr = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+int pci_enable_msi(const pci_device_t* dev, uint64_t address, uint16_t data) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSI);
+    if (!cap) return -1;
+
+    uint16_t control = pci_read16(dev, cap + MSI_CONTROL);
+    pci_write32(dev, cap + MSI_ADDRESS_LO, (uint32_t)address);
+    if (control & MSI_CONTROL_64BIT) {
+        pci_write32(dev, cap + MSI_ADDRESS_HI, (uint32_t)(address >> 32));
+        pci_write16(dev, cap + MSI_DATA_64, data);
+    } else {
+        pci_write16(dev, cap + MSI_DATA_32, data);
+    }
+
+    control = (control & ~MSI_CONTROL_MME) | MSI_CONTROL_ENABLE;
+    pci_write16(dev, cap + MSI_CONTROL, control);
+
+    uint16_t cmd = pci_read16(dev, PCI_COMMAND);
+    pci_write16(dev, PCI_COMMAND, cmd | PCI_COMMAND_INTX_OFF);
+    return 0;
+}
+
+int pci_msix_count(const pci_device_t* dev) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    if (!cap) return 0;
+    return (pci_read16(dev, cap + MSIX_CONTROL) & MSIX_CONTROL_SIZE) + 1;
+}
+
+int pci_enable_msix(const pci_device_t* dev, const uint64_t* address, const uint16_t* data, int count) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    if (!cap || count <= 0 || count > pci_msix_count(dev)) return -1;
+
+    uint32_t table_reg = pci_read32(dev, cap + MSIX_TABLE);
+    uint64_t bar = pci_bar_address(dev, table_reg & 0x07);
+    if (!bar) return -1;
+    uintptr_t table = (uintptr_t)(bar + (table_reg & ~0x07U));
+
+    // The table is registers: uncached, and only the pages it covers
+    uintptr_t first = table & ~(uintptr_t)(PAGE_SIZE - 1);
+    uintptr_t last = (table + (uintptr_t)count * MSIX_ENTRY_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    for (uintptr_t page = first; page <= last; page += PAGE_SIZE) {
+        vmm_map_page(page, page, PAGE_PRESENT | PAGE_WRITABLE | PAGE_CACHE_DISABLE);
+    }
+
+    // Entries are written with the function masked, then unmasked together
+    uint16_t control = pci_read16(dev, cap + MSIX_CONTROL);
+    pci_write16(dev, cap + MSIX_CONTROL, control | MSIX_CONTROL_ENABLE | MSIX_CONTROL_MASKALL);
+
+    for (int i = 0; i < count; i++) {
+        volatile uint32_t* entry = (volatile uint32_t*)(table + (uintptr_t)i * MSIX_ENTRY_SIZE);
+        entry[0] = (uint32_t)address[i];
+        entry[1] = (uint32_t)(address[i] >> 32);
+        entry[2] = data[i];
+        entry[3] &= ~MSIX_VECTOR_MASKED;
+    }
+
+    pci_write16(dev, cap + MSIX_CONTROL, (control | MSIX_CONTROL_ENABLE) & ~MSIX_CONTROL_MASKALL);
+
+    uint16_t cmd = pci_read16(dev, PCI_COMMAND);
+    pci_write16(dev, PCI_COMMAND, cmd | PCI_COMMAND_INTX_OFF);
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "drivers/block.h"
+#include "kernel.h"
+
+// RAM disk
+// A block device in PMM pages, allocated on first write; sectors never
+// written read as zeroes, so a large disk costs only what is used
+
+#define RAMDISK_SECTORS_PER_PAGE (PAGE_SIZE / 512)
+
+typedef struct {
+    block_device_t dev;
+    spinlock_t lock;             // Page allocation
+    uint64_t page_count;
+    uint8_t** pages;
+} ramdisk_t;
+
+static uint8_t* ramdisk_page(ramdisk_t* rd, uint64_t index, bool create) {
+    uint8_t* page = rd->pages[index];
+    if (page || !create) return page;
+
+    uintptr_t fresh = pmm_alloc_zeroed_page();
+    if (!fresh) return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&rd->lock);
+    if (!rd->pages[index]) {
+        rd->pages[index] = (uint8_t*)fresh;
+        fresh = 0;
+    }
+    page = rd->pages[index];
+    spin_unlock_irqrestore(&rd->lock, flags);
+
+    if (fresh) pmm_free_pages(fresh, 1);  // Lost a race with another writer
+    return page;
+}
+
+static int ramdisk_transfer(ramdisk_t* rd, uint64_t sector, uint32_t count, uint8_t* buffer,
+                            bool write) {
+    if (sector >= rd->dev.total_sectors || count > rd->dev.total_sectors - sector) return -1;
+
+    while (count > 0) {
+        uint64_t index = sector / RAMDISK_SECTORS_PER_PAGE;
+        uint32_t in_page = (uint32_t)(sector % RAMDISK_SECTORS_PER_PAGE);
+        uint32_t n = RAMDISK_SECTORS_PER_PAGE - in_page;
+        if (n > count) n = count;
+
+        uint8_t* page = ramdisk_page(rd, index, write);
+        if (write) {
+            if (!page) return -1;
+            memcpy(page + in_page * 512, buffer, n * 512);
+        } else if (page) {
+            memcpy(buffer, page + in_page * 512, n * 512);
+        } else {
+            memset(buffer, 0, n * 512);
+        }
+        sector += n;
+        count -= n;
+        buffer += n * 512;
+    }
+    return 0;
+}
+
+static int ramdisk_read(block_device_t* dev, uint64_t sector, uint32_t count, void* buffer) {
+    return ramdisk_transfer((ramdisk_t*)dev->private_data, sector, count, buffer, false);
+}
+
+static int ramdisk_write(block_device_t* dev, uint64_t sector, uint32_t count, const void* buffer) {
+    return ramdisk_transfer((ramdisk_t*)dev->private_data, sector, count, (uint8_t*)buffer, true);
+}
+
+block_device_t* ramdisk_create(const char* name, uint64_t sectors) {
+    ramdisk_t* rd = kmalloc_tracked(sizeof(ramdisk_t), "ramdisk");
+    if (!rd) return NULL;
+
+    rd->page_count = (sectors + RAMDISK_SECTORS_PER_PAGE - 1) / RAMDISK_SECTORS_PER_PAGE;
+    rd->pages = kmalloc_tracked(rd->page_count * sizeof(uint8_t*), "ramdisk_pages");
+    if (!rd->pages) {
+        kfree_tracked(rd);
+        return NULL;
+    }
+
+    strncpy(rd->dev.name, name, sizeof(rd->dev.name) - 1);
+    rd->dev.type = BLOCK_DEVICE_TYPE_RAMDISK;
+    rd->dev.sector_size = 512;
+    rd->dev.total_sectors = sectors;
+    rd->dev.read = ramdisk_read;
+    rd->dev.write = ramdisk_write;
+    rd->dev.private_data = rd;
+
+    if (block_register_device(&rd->dev) < 0) {
+        kfree_tracked(rd->pages);
+        kfree_tracked(rd);
+        return NULL;
+    }
+    KINFO("RAM disk %s: %lu MB, allocated on write", name, sectors / 2048);
+    return &rd->dev;
+}
@@ -4,9 +4,39 @@
 /*
  * Basic Serial Port Driver for x86
  * Provides output to COM1 for debugging
+ *
+ * Once serial_start_async() runs, output goes into a ring that the UART's
+ * transmitter-empty interrupt drains 16 bytes (one FIFO) at a time, so a
+ * CPU logging a line no longer waits out 115200 baud. A message that
+ * doesn't fit is dropped whole and counted. Until then, and again after a
+ * panic, bytes are written synchronously.
  */
 
 #define COM1_PORT 0x3f8
+#define COM1_IRQ  4
+
+#define UART_IER  1            /* Interrupt enable */
+#define UART_IIR  2            /* Interrupt identification (read) */
+#define UART_MCR  4            /* Modem control */
+#define UART_LSR  5            /* Line status */
+
+#define IER_THRI  0x02         /* Interrupt when the transmit FIFO empties */
+#define MCR_OUT2  0x08         /* Gates the UART's IRQ line to the PIC */
+#define LSR_THRE  0x20         /* Transmit FIFO empty */
+
+#define UART_FIFO_SIZE 16
+#define SERIAL_TX_RING 16384   /* Power of two */
+#define SERIAL_TX_MASK (SERIAL_TX_RING - 1)
+
+static char tx_ring[SERIAL_TX_RING];
+static uint32_t tx_head = 0;           /* Next byte queued */
+static uint32_t tx_tail = 0;           /* Next byte to the UART */
+static uint8_t tx_ier = 0;             /* IER as last written */
+static spinlock_t tx_lock = SPINLOCK_INIT;
+static volatile bool tx_async = false;
+static uint64_t tx_bytes = 0;
+static uint64_t tx_dropped = 0;
+static uint64_t tx_dropped_msgs = 0;
 
 /* Initialize the serial port */
 void serial_init(void)
@@ -36,20 +66,120 @@ void serial_init(void)
 /* Check if serial port is ready to transmit */
 static int serial_is_transmit_empty(void)
 {
-    return inb(COM1_PORT + 5) & 0x20;
+    return inb(COM1_PORT + UART_LSR) & LSR_THRE;
 }
 
-/* Write a character to serial port */
-void serial_write(uint8_t byte)
+/* Synchronous byte: boot, panics */
+static void serial_write_sync(uint8_t byte)
 {
     while (!serial_is_transmit_empty());
     outb(COM1_PORT, byte);
 }
 
+/*
+ * Refill the FIFO if it is empty, and keep the transmit interrupt on while
+ * bytes remain so the next refill happens without us. Called with tx_lock.
+ */
+static void serial_tx_fill(void)
+{
+    if (tx_head != tx_tail && serial_is_transmit_empty()) {
+        for (int i = 0; i < UART_FIFO_SIZE && tx_tail != tx_head; i++) {
+            outb(COM1_PORT, tx_ring[tx_tail++ & SERIAL_TX_MASK]);
+        }
+    }
+
+    uint8_t ier = tx_head != tx_tail ? IER_THRI : 0;
+    if (ier != tx_ier) {
+        outb(COM1_PORT + UART_IER, ier);
+        tx_ier = ier;
+    }
+}
+
+/* Write bytes to the serial port: queued whole, or dropped whole */
+void serial_write_buffer(const char* buf, size_t len)
+{
+    if (!tx_async) {
+        for (size_t i = 0; i < len; i++) {
+            serial_write_sync((uint8_t)buf[i]);
+        }
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&tx_lock);
+    if (len > SERIAL_TX_RING - (tx_head - tx_tail)) {
+        tx_dropped += len;
+        tx_dropped_msgs++;
+    } else {
+        for (size_t i = 0; i < len; i++) {
+            tx_ring[tx_head++ & SERIAL_TX_MASK] = buf[i];
+        }
+        tx_bytes += len;
+        serial_tx_fill();
+    }
+    spin_unlock_irqrestore(&tx_lock, flags);
+}
+
+/* Write a character to serial port */
+void serial_write(uint8_t byte)
+{
+    serial_write_buffer((const char*)&byte, 1);
+}
+
 /* Write a string to serial port */
 void serial_write_string(const char* str)
 {
-    while (*str) {
-        serial_write(*str++);
+    serial_write_buffer(str, strlen(str));
+}
+
+/* COM1 interrupt: the FIFO ran dry */
+void serial_irq_handler(void)
+{
+    spin_lock(&tx_lock);
+    (void)inb(COM1_PORT + UART_IIR);  /* Acknowledges the THRE interrupt */
+    serial_tx_fill();
+    spin_unlock(&tx_lock);
+}
+
+/* Switch output to the interrupt-drained ring (handlers must be in place) */
+void serial_start_async(void)
+{
+    outb(COM1_PORT + UART_MCR, inb(COM1_PORT + UART_MCR) | MCR_OUT2);
+    pic_unmask(COM1_IRQ);
+    tx_async = true;
+}
+
+/*
+ * Panic: back to synchronous output. Whatever is still queued goes out
+ * first, unless the lock is held - possibly by the CPU that panicked.
+ */
+void serial_panic_flush(void)
+{
+    if (!tx_async) return;
+    tx_async = false;
+
+    if (spin_trylock(&tx_lock)) {
+        while (tx_tail != tx_head) {
+            serial_write_sync((uint8_t)tx_ring[tx_tail++ & SERIAL_TX_MASK]);
+        }
+        outb(COM1_PORT + UART_IER, 0);
+        tx_ier = 0;
+        spin_unlock(&tx_lock);
     }
 }
+
+/* Task context: sleep until everything queued has gone to the UART */
+void serial_drain(void)
+{
+    while (tx_async && __atomic_load_n(&tx_tail, __ATOMIC_RELAXED) !=
+                       __atomic_load_n(&tx_head, __ATOMIC_RELAXED)) {
+        schedule_delay(1);
+    }
+}
+
+void serial_get_stats(void)
+{
+    KINFO("=== Serial Statistics ===");
+    KINFO("Mode: %s, queued: %u bytes", tx_async ? "interrupt-driven" : "synchronous",
+          tx_head - tx_tail);
+    KINFO("Bytes written: %lu, dropped: %lu in %lu messages", tx_bytes, tx_dropped, tx_dropped_msgs);
+}
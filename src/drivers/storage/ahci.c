@@ -1,9 +1,15 @@
 #include "kernel.h"
 #include "drivers/block.h"
-#include "io.h"
+#include "drivers/pci.h"
+#include "smp.h"
+#include "vmm.h"
 
 // AHCI / SATA Driver
-// Implements basic read/write support for AHCI controllers
+// Every command slot the HBA offers is used: with NCQ the drive may keep all
+// of them in flight and finish them in any order. Completion is signalled by
+// MSI (polled from a timer without one) and reported through block_request_t
+// callbacks; the synchronous read/write entry points wait on those. Buffers
+// are translated page by page, so any mapped buffer can be a DMA target.
 
 // PCI Class/Subclass
 #define PCI_CLASS_STORAGE    0x01
@@ -20,6 +26,43 @@
 #define HBA_PxCMD_FR    0x4000
 #define HBA_PxCMD_CR    0x8000
 
+// Host capabilities / global control
+#define HBA_CAP_SNCQ    (1U << 30)           // Native command queuing
+#define HBA_CAP_NCS(c)  ((((c) >> 8) & 0x1F) + 1)  // Command slots per port
+#define HBA_GHC_IE      (1U << 1)
+#define HBA_GHC_AE      (1U << 31)
+
+// Port interrupt status / enable
+#define HBA_PxIS_DHRS   (1U << 0)   // D2H register FIS (non-queued completion)
+#define HBA_PxIS_PSS    (1U << 1)   // PIO setup FIS
+#define HBA_PxIS_DSS    (1U << 2)   // DMA setup FIS
+#define HBA_PxIS_SDBS   (1U << 3)   // Set device bits FIS (NCQ completion)
+#define HBA_PxIS_IFS    (1U << 27)  // Interface fatal error
+#define HBA_PxIS_HBDS   (1U << 28)  // Host bus data error
+#define HBA_PxIS_HBFS   (1U << 29)  // Host bus fatal error
+#define HBA_PxIS_TFES   (1U << 30)  // Task file error
+#define HBA_PxIS_ERROR  (HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
+
+// ATA commands and status
+#define ATA_CMD_READ_DMA_EXT        0x25
+#define ATA_CMD_WRITE_DMA_EXT       0x35
+#define ATA_CMD_READ_FPDMA_QUEUED   0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED  0x61
+#define ATA_CMD_FLUSH_CACHE_EXT     0xEA
+#define ATA_CMD_IDENTIFY            0xEC
+#define ATA_DEV_BUSY    0x80
+#define ATA_DEV_DRQ     0x08
+
+// Driver limits
+#define AHCI_MAX_SLOTS      32
+#define AHCI_PRDT_ENTRIES   56                   // Per command table
+#define AHCI_PRDT_MAX_BYTES (4 * 1024 * 1024)    // dbc is 22 bits
+#define AHCI_MAX_SECTORS    65535                // 16-bit count field
+#define AHCI_CMD_TABLE_SIZE 1024                 // 128-byte header + 56 PRDT entries
+#define AHCI_CMD_TABLES     64                   // Per port: in flight plus queued
+#define AHCI_POLL_US        1000                 // Poll interval without an interrupt
+#define AHCI_TIMEOUT_US     5000000              // Synchronous command deadline
+
 // HBA Memory Structure
 typedef volatile struct tagHBA_PORT {
     uint32_t clb;       // 0x00, command list base address, 1K-byte aligned
@@ -128,77 +171,157 @@ typedef struct tagHBA_CMD_TBL {
     uint8_t  cfis[64];  // Command FIS
     uint8_t  acmd[16];  // ATAPI command, 12 or 16 bytes
     uint8_t  rsv[48];   // Reserved
-    HBA_PRDT_ENTRY prdt_entry[1]; // Physical region descriptor table entries, 0 ~ 65535
+    HBA_PRDT_ENTRY prdt_entry[AHCI_PRDT_ENTRIES]; // Physical region descriptor table entries
 } HBA_CMD_TBL;
 
+// Per-port driver state
+typedef struct ahci_port {
+    HBA_PORT* regs;
+    int index;
+    HBA_CMD_HEADER* cmd_list;                    // 32 headers, 1K aligned
+    HBA_CMD_TBL* cmd_tables[AHCI_CMD_TABLES];    // Built at submit, follow the request
+    uint8_t table_prdtl[AHCI_CMD_TABLES];
+    uint32_t slot_mask;                          // Slots we may use
+    bool ncq;                                    // FPDMA QUEUED data commands
+
+    spinlock_t lock;                             // Everything below
+    uint64_t free_tables;
+    uint32_t issued;                             // Slots owned by the HBA
+    uint32_t exclusive;                          // ...with a non-queued command (NCQ port)
+    block_request_t* active[AHCI_MAX_SLOTS];
+    block_request_t* pending_head;               // Waiting for a free slot
+    block_request_t* pending_tail;
+    wait_queue_t waiters;                        // Synchronous callers
+
+    size_t completed;
+    size_t errors;
+    uint32_t max_inflight;
+
+    block_device_t dev;
+} ahci_port_t;
+
 // Global HBA memory pointer
 static HBA_MEM* ahci_hba_mem = NULL;
-static block_device_t ahci_devices[32];
-static int ahci_device_count = 0;
-
-// Forward declarations
-static int ahci_read_port(HBA_PORT* port, uint64_t sector, uint32_t count, void* buffer);
-static int ahci_write_port(HBA_PORT* port, uint64_t sector, uint32_t count, const void* buffer);
+static ahci_port_t ahci_ports[AHCI_MAX_SLOTS];
+static int ahci_port_count = 0;
+static bool ahci_msi = false;                    // Completions arrive by interrupt
+static ktimer_t ahci_poll_timer;
+
+static void ahci_port_complete(ahci_port_t* port);
+
+// ============================================================================
+// PORT START / STOP
+// ============================================================================
+
+static void ahci_stop_cmd(HBA_PORT* port) {
+    port->cmd &= ~HBA_PxCMD_ST;
+    port->cmd &= ~HBA_PxCMD_FRE;
+    for (int spin = 0; spin < 1000000; spin++) {
+        if (!(port->cmd & (HBA_PxCMD_FR | HBA_PxCMD_CR))) break;
+    }
+}
 
-// Block device wrappers
-static int ahci_block_read(block_device_t* dev, uint64_t sector, uint32_t count, void* buffer) {
-    HBA_PORT* port = (HBA_PORT*)dev->private_data;
-    return ahci_read_port(port, sector, count, buffer);
+static void ahci_start_cmd(HBA_PORT* port) {
+    while (port->cmd & HBA_PxCMD_CR);
+    port->cmd |= HBA_PxCMD_FRE;
+    port->cmd |= HBA_PxCMD_ST;
 }
 
-static int ahci_block_write(block_device_t* dev, uint64_t sector, uint32_t count, const void* buffer) {
-    HBA_PORT* port = (HBA_PORT*)dev->private_data;
-    return ahci_write_port(port, sector, count, buffer);
+// Command list, received FIS area and one command table per slot
+static int ahci_port_setup(ahci_port_t* port) {
+    HBA_PORT* regs = port->regs;
+    ahci_stop_cmd(regs);
+
+    // 1K command list followed by the 256-byte FIS area in one page
+    uintptr_t base = pmm_alloc_zeroed_page();
+    uintptr_t tables = pmm_alloc_pages(AHCI_CMD_TABLES * AHCI_CMD_TABLE_SIZE / PAGE_SIZE);
+    if (!base || !tables) {
+        KERROR("AHCI: No memory for port %d", port->index);
+        return -1;
+    }
+
+    port->cmd_list = (HBA_CMD_HEADER*)base;
+    regs->clb = (uint32_t)base;
+    regs->clbu = (uint32_t)((uint64_t)base >> 32);
+    regs->fb = (uint32_t)(base + 1024);
+    regs->fbu = (uint32_t)((uint64_t)(base + 1024) >> 32);
+
+    // Tables live in identity-mapped PMM pages, so ctba is the pointer
+    for (int i = 0; i < AHCI_CMD_TABLES; i++) {
+        port->cmd_tables[i] = (HBA_CMD_TBL*)(tables + i * AHCI_CMD_TABLE_SIZE);
+    }
+    port->free_tables = ~0ULL;
+
+    regs->serr = (uint32_t)-1;
+    regs->is = (uint32_t)-1;
+    ahci_start_cmd(regs);
+    return 0;
 }
 
-// Find a free command slot
-static int find_cmdslot(HBA_PORT* port) {
-    uint32_t slots = (port->sact | port->ci);
-    for (int i = 0; i < 32; i++) {
-        if ((slots & 1) == 0) return i;
-        slots >>= 1;
+// ============================================================================
+// COMMAND CONSTRUCTION
+// ============================================================================
+
+/*
+ * Append a buffer in the current address space to a PRDT: each page is
+ * translated (and faulted in or unshared if the device writes it), runs
+ * that are physically contiguous, also with the previous entry, merge up
+ * to the 4MB an entry can describe. Returns the bytes covered, short once
+ * the table is full, or 0 if the buffer cannot be mapped.
+ */
+static uint32_t ahci_prdt_add(HBA_CMD_TBL* cmdtbl, int* entries, uintptr_t buf, uint32_t bytes,
+                              bool dev_writes) {
+    if (buf & 1) return 0;  // dba must be word aligned
+
+    uint32_t covered = 0;
+    while (covered < bytes) {
+        uintptr_t va = buf + covered;
+        uint32_t chunk = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+        if (chunk > bytes - covered) chunk = bytes - covered;
+
+        uintptr_t phys = vmm_dma_address(va, dev_writes);
+        if (!phys) return 0;
+
+        HBA_PRDT_ENTRY* prd = *entries ? &cmdtbl->prdt_entry[*entries - 1] : NULL;
+        uintptr_t prd_end = prd ? ((uintptr_t)prd->dbau << 32 | prd->dba) + prd->dbc + 1 : 0;
+        if (prd && phys == prd_end && prd->dbc + 1 + chunk <= AHCI_PRDT_MAX_BYTES) {
+            prd->dbc += chunk;
+        } else {
+            if (*entries == AHCI_PRDT_ENTRIES) break;
+            prd = &cmdtbl->prdt_entry[(*entries)++];
+            prd->dba = (uint32_t)phys;
+            prd->dbau = (uint32_t)((uint64_t)phys >> 32);
+            prd->dbc = chunk - 1;
+            prd->i = 0;
+        }
+        covered += chunk;
     }
-    return -1;
+    return covered;
 }
 
-// Read from AHCI port
-static int ahci_read_port(HBA_PORT* port, uint64_t sector, uint32_t count, void* buffer) {
-    port->is = (uint32_t)-1; // Clear interrupt status
-    int spin = 0;
-    int slot = find_cmdslot(port);
-    if (slot == -1) return -1;
+// Cut a short PRDT back to whole sectors; returns the bytes left
+static uint32_t ahci_prdt_trim(HBA_CMD_TBL* cmdtbl, int* entries, uint32_t covered) {
+    uint32_t excess = covered & 511;
+    while (excess) {
+        HBA_PRDT_ENTRY* prd = &cmdtbl->prdt_entry[*entries - 1];
+        uint32_t len = prd->dbc + 1;
+        if (len > excess) {
+            prd->dbc -= excess;
+            break;
+        }
+        excess -= len;
+        (*entries)--;
+    }
+    return covered & ~511U;
+}
 
-    uint64_t addr = (uint64_t)port->clbu << 32 | port->clb;
-    HBA_CMD_HEADER* cmdheader = (HBA_CMD_HEADER*)(uintptr_t)addr;
-    cmdheader += slot;
-    cmdheader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
-    cmdheader->w = 0; // Read
-    cmdheader->prdtl = (uint16_t)((count - 1) >> 4) + 1; // PRDT entries count
-
-    uint64_t tbl_addr = (uint64_t)cmdheader->ctbau << 32 | cmdheader->ctba;
-    HBA_CMD_TBL* cmdtbl = (HBA_CMD_TBL*)(uintptr_t)tbl_addr;
-    memset(cmdtbl, 0, sizeof(HBA_CMD_TBL) + (cmdheader->prdtl - 1) * sizeof(HBA_PRDT_ENTRY));
-
-    // Setup PRDT entries (simplified for contiguous buffer)
-    // Note: In a real OS, we'd handle scatter-gather if buffer crosses page boundaries
-    // For now, assuming physically contiguous buffer or identity mapping
-    uintptr_t buf_phys = (uintptr_t)buffer; // Need physical address in real paging
-    
-    // 8K bytes (16 sectors) per PRDT entry
-    int i = 0;
-    uint32_t sectors_left = count;
-    
-    // Simplified: just one entry for now, assuming small reads
-    cmdtbl->prdt_entry[0].dba = (uint32_t)buf_phys;
-    cmdtbl->prdt_entry[0].dbau = (uint32_t)((uint64_t)buf_phys >> 32);
-    cmdtbl->prdt_entry[0].dbc = (count * 512) - 1; // 512 bytes per sector
-    cmdtbl->prdt_entry[0].i = 1;
-
-    // Setup Command FIS
+// Command FIS; queued commands get their tag when a slot is assigned
+static void ahci_build_fis(HBA_CMD_TBL* cmdtbl, uint8_t command, uint64_t sector, uint32_t count) {
     FIS_REG_H2D* cmdfis = (FIS_REG_H2D*)(&cmdtbl->cfis);
+    memset(cmdfis, 0, sizeof(FIS_REG_H2D));
     cmdfis->fis_type = FIS_TYPE_REG_H2D;
     cmdfis->c = 1; // Command
-    cmdfis->command = 0x25; // READ DMA EXT
+    cmdfis->command = command;
     cmdfis->lba0 = (uint8_t)sector;
     cmdfis->lba1 = (uint8_t)(sector >> 8);
     cmdfis->lba2 = (uint8_t)(sector >> 16);
@@ -206,187 +329,506 @@ static int ahci_read_port(HBA_PORT* port, uint64_t sector, uint32_t count, void*
     cmdfis->lba3 = (uint8_t)(sector >> 24);
     cmdfis->lba4 = (uint8_t)(sector >> 32);
     cmdfis->lba5 = (uint8_t)(sector >> 40);
-    cmdfis->countl = count & 0xFF;
-    cmdfis->counth = (count >> 8) & 0xFF;
 
-    // Wait for port to be idle
-    while ((port->tfd & (0x80 | 0x08)) && spin < 1000000) {
-        spin++;
+    if (command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED) {
+        // Queued: the count moves to the feature field, the tag into count
+        cmdfis->featurel = count & 0xFF;
+        cmdfis->featureh = (count >> 8) & 0xFF;
+    } else {
+        cmdfis->countl = count & 0xFF;
+        cmdfis->counth = (count >> 8) & 0xFF;
     }
-    if (spin == 1000000) {
-        KERROR("AHCI: Port hung");
-        return -1;
+}
+
+// Point slot's header at a built table
+static void ahci_set_header(ahci_port_t* port, int slot, int table, bool write) {
+    HBA_CMD_HEADER* cmdheader = &port->cmd_list[slot];
+    uintptr_t tbl = (uintptr_t)port->cmd_tables[table];
+    cmdheader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
+    cmdheader->w = write ? 1 : 0;
+    cmdheader->prdtl = port->table_prdtl[table];
+    cmdheader->prdbc = 0;
+    cmdheader->ctba = (uint32_t)tbl;
+    cmdheader->ctbau = (uint32_t)((uint64_t)tbl >> 32);
+}
+
+// Number of set bits in a slot mask (no libgcc popcount here)
+static uint32_t ahci_slot_count(uint32_t mask) {
+    uint32_t n = 0;
+    for (; mask; mask &= mask - 1) n++;
+    return n;
+}
+
+// First usable slot the HBA does not own (port lock held)
+static int ahci_free_slot(ahci_port_t* port) {
+    uint32_t free = port->slot_mask & ~port->issued;
+    return free ? __builtin_ctz(free) : -1;
+}
+
+static bool ahci_queued(ahci_port_t* port, block_request_t* req) {
+    uint8_t command = ((FIS_REG_H2D*)port->cmd_tables[(uintptr_t)req->driver_data]->cfis)->command;
+    return command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED;
+}
+
+// Queued and non-queued commands can't be mixed: a non-queued one (a
+// flush) waits for an idle port, then runs alone (port lock held)
+static bool ahci_can_issue(ahci_port_t* port, block_request_t* req) {
+    if (!port->ncq) return true;
+    if (port->exclusive) return false;
+    return !port->issued || ahci_queued(port, req);
+}
+
+// Hand req to the HBA in slot (port lock held)
+static void ahci_issue(ahci_port_t* port, int slot, block_request_t* req) {
+    int table = (int)(uintptr_t)req->driver_data;
+    bool queued = ahci_queued(port, req);
+    ahci_set_header(port, slot, table, req->write);
+    if (queued) {
+        ((FIS_REG_H2D*)port->cmd_tables[table]->cfis)->countl = (uint8_t)(slot << 3);
+    } else if (port->ncq) {
+        port->exclusive |= 1U << slot;
+    }
+
+    port->active[slot] = req;
+    port->issued |= 1U << slot;
+    uint32_t inflight = ahci_slot_count(port->issued);
+    if (inflight > port->max_inflight) port->max_inflight = inflight;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);  // Table contents before the doorbell
+    if (queued) {
+        port->regs->sact = 1U << slot;  // SActive before CI for queued commands
+    }
+    port->regs->ci = 1U << slot;
+}
+
+// Move queued requests into free slots (port lock held)
+static void ahci_issue_pending(ahci_port_t* port) {
+    int slot;
+    while (port->pending_head && ahci_can_issue(port, port->pending_head) &&
+           (slot = ahci_free_slot(port)) >= 0) {
+        block_request_t* req = port->pending_head;
+        port->pending_head = req->next;
+        if (!port->pending_head) port->pending_tail = NULL;
+        req->next = NULL;
+        ahci_issue(port, slot, req);
+    }
+}
+
+// ============================================================================
+// COMPLETION
+// ============================================================================
+
+/*
+ * A failed NCQ command aborts everything the drive had queued. Restart the
+ * port and fail every command still owned by the HBA; those that finished
+ * before the error were already reaped by the caller.
+ */
+static size_t ahci_port_recover(ahci_port_t* port, block_request_t** failed) {
+    size_t n = 0;
+    KERROR("AHCI: Port %d error (tfd 0x%x, serr 0x%x), failing %d command(s)",
+           port->index, port->regs->tfd, port->regs->serr, ahci_slot_count(port->issued));
+
+    ahci_stop_cmd(port->regs);
+    port->regs->sact = 0;
+    port->regs->serr = (uint32_t)-1;
+    port->regs->is = (uint32_t)-1;
+    ahci_start_cmd(port->regs);
+
+    for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (!(port->issued & (1U << slot))) continue;
+        block_request_t* req = port->active[slot];
+        port->active[slot] = NULL;
+        port->free_tables |= 1ULL << (uintptr_t)req->driver_data;
+        req->status = -1;
+        failed[n++] = req;
     }
+    port->errors += n;
+    port->issued = 0;
+    port->exclusive = 0;
+    return n;
+}
 
-    // Issue command
-    port->ci = 1 << slot;
+// Reap finished slots, refill them, then run the callbacks without the lock
+static void ahci_port_complete_ex(ahci_port_t* port, bool force_reset) {
+    block_request_t* done[AHCI_MAX_SLOTS * 2];
+    size_t n = 0;
+
+    uint64_t flags = spin_lock_irqsave(&port->lock);
+    uint32_t is = port->regs->is;
+    port->regs->is = is;  // Write-1-to-clear, before reading what finished
+
+    // NCQ commands leave SActive when done, non-queued ones leave CI
+    uint32_t finished = port->issued & ~(port->regs->sact | port->regs->ci);
+    for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (!(finished & (1U << slot))) continue;
+        block_request_t* req = port->active[slot];
+        port->active[slot] = NULL;
+        port->free_tables |= 1ULL << (uintptr_t)req->driver_data;
+        req->status = 0;
+        done[n++] = req;
+    }
+    port->issued &= ~finished;
+    port->exclusive &= ~finished;
+    port->completed += n;
 
-    // Wait for completion
-    while (1) {
-        if ((port->ci & (1 << slot)) == 0) break;
-        if (port->is & (1 << 30)) { // Task File Error
-            KERROR("AHCI: Read disk error");
-            return -1;
+    if (port->issued && ((is & HBA_PxIS_ERROR) || force_reset)) {
+        n += ahci_port_recover(port, &done[n]);
+    }
+    ahci_issue_pending(port);
+    spin_unlock_irqrestore(&port->lock, flags);
+
+    for (size_t i = 0; i < n; i++) {
+        if (done[i]->done) done[i]->done(done[i]);
+    }
+    if (n) wake_up(&port->waiters);  // Tables came back
+}
+
+static void ahci_port_complete(ahci_port_t* port) {
+    ahci_port_complete_ex(port, false);
+}
+
+// MSI: one vector for the controller, HBA IS says which ports to look at
+static void ahci_msi_handler(void* arg) {
+    (void)arg;
+    uint32_t is = ahci_hba_mem->is;
+    for (int i = 0; i < ahci_port_count; i++) {
+        if (is & (1U << ahci_ports[i].index)) {
+            ahci_port_complete(&ahci_ports[i]);
         }
     }
+    ahci_hba_mem->is = is;  // After the port bits, as the spec requires
+}
 
-    return 0;
+// Without an interrupt, a timer reaps completions while anything is in flight
+static void ahci_poll(void* arg) {
+    (void)arg;
+    bool busy = false;
+    for (int i = 0; i < ahci_port_count; i++) {
+        ahci_port_complete(&ahci_ports[i]);
+        busy |= __atomic_load_n(&ahci_ports[i].issued, __ATOMIC_RELAXED) != 0;
+    }
+    if (busy) {
+        ktimer_arm_in(&ahci_poll_timer, AHCI_POLL_US);
+    }
 }
 
-// Write to AHCI port
-static int ahci_write_port(HBA_PORT* port, uint64_t sector, uint32_t count, const void* buffer) {
-    // Similar to read, but set w=1 and command=0x35 (WRITE DMA EXT)
-    // Implementation omitted for brevity in this step, focusing on read first
-    // But we need it for "write" command
-    
-    port->is = (uint32_t)-1;
-    int spin = 0;
-    int slot = find_cmdslot(port);
-    if (slot == -1) return -1;
+// ============================================================================
+// BLOCK DEVICE INTERFACE
+// ============================================================================
 
-    uint64_t addr = (uint64_t)port->clbu << 32 | port->clb;
-    HBA_CMD_HEADER* cmdheader = (HBA_CMD_HEADER*)(uintptr_t)addr;
-    cmdheader += slot;
-    cmdheader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
-    cmdheader->w = 1; // Write
-    cmdheader->prdtl = 1; // Simplified
+static int ahci_try_table(ahci_port_t* port) {
+    uint64_t flags = spin_lock_irqsave(&port->lock);
+    int table = port->free_tables ? __builtin_ctzll(port->free_tables) : -1;
+    if (table >= 0) port->free_tables &= ~(1ULL << table);
+    spin_unlock_irqrestore(&port->lock, flags);
+    return table;
+}
+
+// A free command table, sleeping until a completion returns one
+static int ahci_alloc_table(ahci_port_t* port) {
+    wait_entry_t wait;
+    for (;;) {
+        wait_prepare(&port->waiters, &wait);
+        int table = ahci_try_table(port);
+        if (table >= 0) {
+            wait_finish(&wait);
+            return table;
+        }
+        wait_schedule(&wait, time_monotonic_us() + AHCI_POLL_US);
+        if (!ahci_msi) ahci_port_complete(port);
+    }
+}
 
-    uint64_t tbl_addr = (uint64_t)cmdheader->ctbau << 32 | cmdheader->ctba;
-    HBA_CMD_TBL* cmdtbl = (HBA_CMD_TBL*)(uintptr_t)tbl_addr;
-    memset(cmdtbl, 0, sizeof(HBA_CMD_TBL) + sizeof(HBA_PRDT_ENTRY));
+// Issue a built request now, or queue it behind the others (never sleeps)
+static void ahci_start(ahci_port_t* port, block_request_t* req) {
+    req->next = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&port->lock);
+    int slot = port->pending_head || !ahci_can_issue(port, req) ? -1 : ahci_free_slot(port);
+    if (slot >= 0) {
+        ahci_issue(port, slot, req);
+    } else if (port->pending_tail) {
+        port->pending_tail->next = req;
+        port->pending_tail = req;
+    } else {
+        port->pending_head = port->pending_tail = req;
+    }
+    spin_unlock_irqrestore(&port->lock, flags);
 
-    uintptr_t buf_phys = (uintptr_t)buffer;
-    cmdtbl->prdt_entry[0].dba = (uint32_t)buf_phys;
-    cmdtbl->prdt_entry[0].dbau = (uint32_t)((uint64_t)buf_phys >> 32);
-    cmdtbl->prdt_entry[0].dbc = (count * 512) - 1;
-    cmdtbl->prdt_entry[0].i = 1;
+    if (!ahci_msi && !ktimer_pending(&ahci_poll_timer)) {
+        ktimer_arm_in(&ahci_poll_timer, AHCI_POLL_US);
+    }
+}
 
-    FIS_REG_H2D* cmdfis = (FIS_REG_H2D*)(&cmdtbl->cfis);
-    cmdfis->fis_type = FIS_TYPE_REG_H2D;
-    cmdfis->c = 1;
-    cmdfis->command = 0x35; // WRITE DMA EXT
-    cmdfis->lba0 = (uint8_t)sector;
-    cmdfis->lba1 = (uint8_t)(sector >> 8);
-    cmdfis->lba2 = (uint8_t)(sector >> 16);
-    cmdfis->device = 1 << 6;
-    cmdfis->lba3 = (uint8_t)(sector >> 24);
-    cmdfis->lba4 = (uint8_t)(sector >> 32);
-    cmdfis->lba5 = (uint8_t)(sector >> 40);
-    cmdfis->countl = count & 0xFF;
-    cmdfis->counth = (count >> 8) & 0xFF;
+/*
+ * Build req's command table in the submitter's address space and hand it
+ * to the HBA, or queue it for the next free slot. With partial set a
+ * buffer too fragmented for one PRDT is trimmed (req->count shrinks);
+ * otherwise it is refused. Without can_sleep, running out of tables is
+ * BLOCK_BUSY.
+ */
+static int ahci_queue(ahci_port_t* port, block_request_t* req, bool partial, bool can_sleep) {
+    int table = can_sleep ? ahci_alloc_table(port) : ahci_try_table(port);
+    if (table < 0) return BLOCK_BUSY;
+    HBA_CMD_TBL* cmdtbl = port->cmd_tables[table];
+
+    int entries = 0;
+    uint32_t bytes = req->count * 512;
+    uint32_t covered = 0;
+    if (req->bios) {
+        for (bio_t* bio = req->bios; bio; bio = bio->next) {
+            uint32_t len = bio->count * 512;
+            uint32_t got = ahci_prdt_add(cmdtbl, &entries, (uintptr_t)bio->buffer, len, !req->write);
+            covered += got;
+            if (got < len) break;
+        }
+    } else {
+        covered = ahci_prdt_add(cmdtbl, &entries, (uintptr_t)req->buffer, bytes, !req->write);
+    }
+    if (covered && covered < bytes && partial) {
+        covered = ahci_prdt_trim(cmdtbl, &entries, covered);
+    }
+    if (covered == 0 || (covered < bytes && !partial)) {
+        uint64_t flags = spin_lock_irqsave(&port->lock);
+        port->free_tables |= 1ULL << table;
+        spin_unlock_irqrestore(&port->lock, flags);
+        return -1;
+    }
+    req->count = covered / 512;
+    port->table_prdtl[table] = (uint8_t)entries;
+
+    uint8_t command = port->ncq ? (req->write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED)
+                                : (req->write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    ahci_build_fis(cmdtbl, command, req->sector, req->count);
+    cmdtbl->prdt_entry[entries - 1].i = 1;
+    req->driver_data = (void*)(uintptr_t)table;
+    ahci_start(port, req);
+    return 0;
+}
 
-    while ((port->tfd & (0x80 | 0x08)) && spin < 1000000) spin++;
-    if (spin == 1000000) return -1;
+static bool ahci_request_valid(block_device_t* dev, uint64_t sector, uint32_t count) {
+    if (count == 0) return false;
+    return !dev->total_sectors || sector + count <= dev->total_sectors;
+}
+
+// Called by the block queue, maybe from a completion interrupt: never
+// sleeps. The segments must fit one PRDT, which dev->max_pages ensures.
+static int ahci_submit(block_device_t* dev, block_request_t* req) {
+    if (req->count > AHCI_MAX_SECTORS || !ahci_request_valid(dev, req->sector, req->count)) {
+        return -1;
+    }
+    return ahci_queue((ahci_port_t*)dev->private_data, req, false, false);
+}
 
-    port->ci = 1 << slot;
+static void ahci_sync_done(block_request_t* req) {
+    ahci_port_t* port = (ahci_port_t*)req->private_data;
+    wake_up(&port->waiters);
+}
 
-    while (1) {
-        if ((port->ci & (1 << slot)) == 0) break;
-        if (port->is & (1 << 30)) return -1;
+// Wait for a request queued with ahci_sync_done, resetting the port if it
+// takes too long
+static int ahci_wait(ahci_port_t* port, block_request_t* req) {
+    volatile int* status = &req->status;
+    uint64_t deadline = time_monotonic_us() + AHCI_TIMEOUT_US;
+    wait_entry_t wait;
+    for (;;) {
+        wait_prepare(&port->waiters, &wait);
+        if (__atomic_load_n(status, __ATOMIC_ACQUIRE) <= 0) break;
+        wait_schedule(&wait, time_monotonic_us() + AHCI_POLL_US);
+
+        ahci_port_complete_ex(port, time_monotonic_us() >= deadline);
     }
+    wait_finish(&wait);
+    return req->status;
+}
 
+// One command per PRDT's worth of buffer, each waited for in turn
+static int ahci_sync_io(block_device_t* dev, uint64_t sector, uint32_t count, void* buffer,
+                        bool write) {
+    ahci_port_t* port = (ahci_port_t*)dev->private_data;
+    if (!ahci_request_valid(dev, sector, count)) return -1;
+
+    uint8_t* buf = (uint8_t*)buffer;
+    while (count > 0) {
+        block_request_t req = {
+            .sector = sector, .buffer = buf, .write = write,
+            .count = count > AHCI_MAX_SECTORS ? AHCI_MAX_SECTORS : count,
+            .status = 1,  // Pending; the completion path stores 0 or -1
+            .done = ahci_sync_done, .private_data = port,
+        };
+        if (ahci_queue(port, &req, true, true) != 0) return -1;
+        if (ahci_wait(port, &req) < 0) return -1;
+
+        sector += req.count;
+        buf += req.count * 512;
+        count -= req.count;
+    }
     return 0;
 }
 
-// Initialize AHCI Controller
-void ahci_init(void) {
-    KINFO("Initializing AHCI Driver...");
+static int ahci_block_read(block_device_t* dev, uint64_t sector, uint32_t count, void* buffer) {
+    return ahci_sync_io(dev, sector, count, buffer, false);
+}
 
-    // 1. Scan PCI for AHCI controller
-    // Simplified: Assuming we found it at a specific address or passed via boot info
-    // In a real OS, we'd use the PCI driver to find Class 0x01, Subclass 0x06
-    // For QEMU/Bochs, it's often at a standard location or we can scan.
-    
-    // Since we don't have a full PCI driver exposed in headers yet, we'll assume
-    // a standard QEMU location or scan a few common buses.
-    // For this implementation, let's assume we found the BAR5 (ABAR)
-    
-    // Mocking PCI scan result for QEMU default AHCI
-    // In QEMU with -device ahci, the MMIO base is usually allocated by BIOS.
-    // We need to read PCI config space.
-    
-    // Since we lack PCI code in this snippet, I'll implement a minimal PCI config read.
-    // Ports: 0xCF8 (Address), 0xCFC (Data)
-    
-    uint32_t pci_address = 0x80000000; // Bus 0, Dev 0, Func 0
-    uint32_t abar = 0;
-    int found = 0;
-
-    for (int bus = 0; bus < 256; bus++) {
-        for (int slot = 0; slot < 32; slot++) {
-            for (int func = 0; func < 8; func++) {
-                uint32_t addr = 0x80000000 | (bus << 16) | (slot << 11) | (func << 8);
-                
-                // Read Vendor ID / Device ID
-                outl(0xCF8, addr);
-                uint32_t id = inl(0xCFC);
-                
-                if ((id & 0xFFFF) != 0xFFFF) {
-                    // Read Class/Subclass (Offset 0x08)
-                    outl(0xCF8, addr | 0x08);
-                    uint32_t class_code = inl(0xCFC);
-                    uint8_t base_class = (class_code >> 24) & 0xFF;
-                    uint8_t sub_class = (class_code >> 16) & 0xFF;
-                    
-                    if (base_class == 0x01 && sub_class == 0x06) {
-                        // Found AHCI
-                        KINFO("Found AHCI Controller at %d:%d:%d", bus, slot, func);
-                        
-                        // Read BAR5 (ABAR) - Offset 0x24
-                        outl(0xCF8, addr | 0x24);
-                        abar = inl(0xCFC);
-                        found = 1;
-                        goto found_ahci;
-                    }
-                }
-            }
+static int ahci_block_write(block_device_t* dev, uint64_t sector, uint32_t count, const void* buffer) {
+    return ahci_sync_io(dev, sector, count, (void*)buffer, true);
+}
+
+// FLUSH CACHE EXT: everything the drive has acknowledged reaches the media
+static int ahci_flush(block_device_t* dev) {
+    ahci_port_t* port = (ahci_port_t*)dev->private_data;
+    int table = ahci_alloc_table(port);
+    port->table_prdtl[table] = 0;
+    ahci_build_fis(port->cmd_tables[table], ATA_CMD_FLUSH_CACHE_EXT, 0, 0);
+
+    block_request_t req = {
+        .status = 1, .done = ahci_sync_done, .private_data = port,
+        .driver_data = (void*)(uintptr_t)table,
+    };
+    ahci_start(port, &req);
+    return ahci_wait(port, &req) < 0 ? -1 : 0;
+}
+
+// ============================================================================
+// DEVICE IDENTIFICATION
+// ============================================================================
+
+// IDENTIFY DEVICE through slot 0, polled (interrupts are not enabled yet)
+static int ahci_identify(ahci_port_t* port, uint16_t* id) {
+    HBA_PORT* regs = port->regs;
+    HBA_CMD_TBL* cmdtbl = port->cmd_tables[0];  // Table 0 is free this early
+    int entries = 0;
+    if (ahci_prdt_add(cmdtbl, &entries, (uintptr_t)id, 512, true) != 512) return -1;
+    port->table_prdtl[0] = (uint8_t)entries;
+    ahci_build_fis(cmdtbl, ATA_CMD_IDENTIFY, 0, 0);
+    ahci_set_header(port, 0, 0, false);
+
+    int spin = 0;
+    while ((regs->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < 1000000) spin++;
+    if (spin == 1000000) {
+        KERROR("AHCI: Port %d hung", port->index);
+        return -1;
+    }
+
+    regs->is = (uint32_t)-1;
+    regs->ci = 1;
+    for (spin = 0; spin < 10000000; spin++) {
+        if (!(regs->ci & 1)) break;
+        if (regs->is & HBA_PxIS_TFES) return -1;
+    }
+    regs->is = (uint32_t)-1;
+    return (regs->ci & 1) ? -1 : 0;
+}
+
+// Size and queue depth from IDENTIFY data
+static void ahci_port_configure(ahci_port_t* port, uint32_t hba_cap) {
+    uint32_t slots = HBA_CAP_NCS(hba_cap);
+    port->slot_mask = slots >= 32 ? 0xFFFFFFFF : (1U << slots) - 1;
+    port->ncq = false;
+
+    uint16_t* id = (uint16_t*)pmm_alloc_zeroed_page();
+    if (!id) return;
+    if (ahci_identify(port, id) == 0) {
+        uint64_t sectors = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                           ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+        if (!(id[83] & (1 << 10)) || sectors == 0) {
+            sectors = (uint64_t)id[60] | ((uint64_t)id[61] << 16);  // LBA28 only
         }
+        port->dev.total_sectors = sectors;
+
+        // Word 76 bit 8: NCQ; word 75: queue depth - 1
+        if ((hba_cap & HBA_CAP_SNCQ) && (id[76] & (1 << 8))) {
+            uint32_t depth = (id[75] & 0x1F) + 1;
+            if (depth < slots) port->slot_mask = (1U << depth) - 1;
+            port->ncq = true;
+        }
+    } else {
+        KWARN("AHCI: IDENTIFY failed on port %d", port->index);
     }
+    pmm_free_pages((uintptr_t)id, 1);
+}
+
+// ============================================================================
+// INITIALIZATION
+// ============================================================================
+
+void ahci_init(void) {
+    KINFO("Initializing AHCI Driver...");
 
-found_ahci:
-    if (!found || abar == 0) {
+    pci_device_t pci;
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, &pci) < 0) {
         KWARN("No AHCI Controller found");
         return;
     }
+    KINFO("Found AHCI Controller at %d:%d:%d", pci.bus, pci.slot, pci.func);
+
+    uint32_t abar = pci_read_bar(&pci, 5) & 0xFFFFFFF0;
+    if (abar == 0) {
+        KWARN("AHCI: BAR5 not assigned");
+        return;
+    }
+    pci_enable_bus_master(&pci);
+
+    // Registers are uncached; the HBA decodes 0x1100 bytes
+    for (uintptr_t off = 0; off < 0x2000; off += PAGE_SIZE) {
+        vmm_map_page(abar + off, abar + off, PAGE_PRESENT | PAGE_WRITABLE | PAGE_CACHE_DISABLE);
+    }
+    ahci_hba_mem = (HBA_MEM*)(uintptr_t)abar;
 
-    // Map ABAR (physical) to virtual memory
-    // In our kernel, we might need to map it. For now, assuming identity mapping or simple access.
-    // ABAR is usually physical.
-    ahci_hba_mem = (HBA_MEM*)(uintptr_t)(abar & 0xFFFFFFF0);
-    
     // Enable AHCI mode (GHC.AE)
-    ahci_hba_mem->ghc |= 0x80000000;
-    
+    ahci_hba_mem->ghc |= HBA_GHC_AE;
+    uint32_t cap = ahci_hba_mem->cap;
+    ktimer_init(&ahci_poll_timer, ahci_poll, NULL);
+
     // Scan ports
     uint32_t pi = ahci_hba_mem->pi;
-    for (int i = 0; i < 32; i++) {
-        if (pi & 1) {
-            int dt = ahci_hba_mem->ports[i].ssts & 0x0F;
-            int ipm = (ahci_hba_mem->ports[i].ssts >> 8) & 0x0F;
-            
-            if (dt == HBA_PORT_DET_PRESENT && ipm == HBA_PORT_IPM_ACTIVE) {
-                int type = ahci_hba_mem->ports[i].sig;
-                if (type == 0x0101) { // SATA
-                    KINFO("SATA Drive found at port %d", i);
-                    
-                    // Initialize port (allocate memory for CLB/FB)
-                    // Simplified: Assuming BIOS set it up or we allocate
-                    // We should allocate strictly speaking.
-                    
-                    // Register block device
-                    block_device_t* dev = &ahci_devices[ahci_device_count++];
-                    sprintf(dev->name, "sata%d", i);
-                    dev->type = BLOCK_DEVICE_TYPE_HARD_DISK;
-                    dev->sector_size = 512;
-                    dev->total_sectors = 0; // TODO: Identify drive to get size
-                    dev->read = ahci_block_read;
-                    dev->write = ahci_block_write;
-                    dev->private_data = (void*)&ahci_hba_mem->ports[i];
-                    
-                    block_register_device(dev);
-                }
-            }
-        }
-        pi >>= 1;
+    for (int i = 0; i < 32; i++, pi >>= 1) {
+        if (!(pi & 1)) continue;
+        HBA_PORT* regs = &ahci_hba_mem->ports[i];
+        int dt = regs->ssts & 0x0F;
+        int ipm = (regs->ssts >> 8) & 0x0F;
+        if (dt != HBA_PORT_DET_PRESENT || ipm != HBA_PORT_IPM_ACTIVE) continue;
+        if (regs->sig != 0x0101) continue; // SATA disks only
+
+        ahci_port_t* port = &ahci_ports[ahci_port_count];
+        memset(port, 0, sizeof(*port));
+        port->regs = regs;
+        port->index = i;
+        wait_queue_init(&port->waiters);
+        if (ahci_port_setup(port) < 0) continue;
+        ahci_port_configure(port, cap);
+
+        regs->ie = HBA_PxIS_DHRS | HBA_PxIS_PSS | HBA_PxIS_DSS | HBA_PxIS_SDBS | HBA_PxIS_ERROR;
+        ahci_port_count++;
+
+        // Register block device
+        block_device_t* dev = &port->dev;
+        sprintf(dev->name, "sata%d", i);
+        dev->type = BLOCK_DEVICE_TYPE_HARD_DISK;
+        dev->sector_size = 512;
+        dev->read = ahci_block_read;
+        dev->write = ahci_block_write;
+        dev->submit = ahci_submit;
+        dev->flush = ahci_flush;
+        dev->max_sectors = AHCI_MAX_SECTORS;
+        dev->max_pages = AHCI_PRDT_ENTRIES;  // One entry per page at worst
+        dev->queue_depth = ahci_slot_count(port->slot_mask);
+        dev->private_data = port;
+
+        KINFO("SATA Drive at port %d: %lu MB, %s, %d slots", i,
+              (unsigned long)(dev->total_sectors / 2048), port->ncq ? "NCQ" : "no NCQ",
+              ahci_slot_count(port->slot_mask));
+        block_register_device(dev);
+    }
+
+    // One MSI for the whole controller, aimed at the boot CPU
+    int vector = apic_alloc_msi_vector(ahci_msi_handler, NULL);
+    if (vector >= 0 && pci_enable_msi(&pci, apic_msi_address(lapic_id()), (uint16_t)vector) == 0) {
+        ahci_msi = true;
+        ahci_hba_mem->is = (uint32_t)-1;
+        ahci_hba_mem->ghc |= HBA_GHC_IE;
+        KINFO("AHCI: MSI on vector %d", vector);
+    } else {
+        KWARN("AHCI: No MSI, polling for completions every %d us", AHCI_POLL_US);
     }
 }
@@ -5,23 +5,29 @@
 
 #include "kernel.h"
 
+#include "io.h"
+
 // event_type_t and event_t are defined in kernel.h
 
-// Event queue structure
-#define EVENT_QUEUE_SIZE 256
+// Event queue structure: the ring lives in a shared memory segment so the
+// owner can map it and read events without a system call
 typedef struct {
-    event_t queue[EVENT_QUEUE_SIZE];
-    int head, tail;
-    int count;
+    event_ring_t* ring;
+    int shmid;
 
     // Process registration
     pid_t registered_process;  // Process that owns this queue
-} event_queue_t;
+    int8_t hash_next;          // Next queue in its pid bucket, or -1
+    spinlock_t producer_lock;  // Input handlers on different CPUs
+    wait_queue_t waiters;      // Owner blocked in sys_event_get_next()
+} __attribute__((aligned(64))) event_queue_t;
 
-// Global event queues (one per process)
+// Global event queues (one per process), found by pid through a hash
 #define MAX_EVENT_QUEUES 16
+#define EVENT_PID_HASH   32
 static event_queue_t event_queues[MAX_EVENT_QUEUES];
-static int next_queue_id = 1;
+static int8_t queue_by_pid[EVENT_PID_HASH];   // First queue in bucket, or -1
+static spinlock_t event_queues_lock = SPINLOCK_INIT;
 
 // Event system constants
 #define KEY_PRESS    1
@@ -30,6 +36,25 @@ static int next_queue_id = 1;
 #define MOUSE_RIGHT  2
 #define MOUSE_MIDDLE 4
 
+static inline int pid_bucket(pid_t pid)
+{
+    return (int)((uint32_t)pid % EVENT_PID_HASH);
+}
+
+// The queue a process registered, or -1
+static int event_find_queue(pid_t pid)
+{
+    for (int i = queue_by_pid[pid_bucket(pid)]; i >= 0; i = event_queues[i].hash_next) {
+        if (event_queues[i].registered_process == pid) return i;
+    }
+    return -1;
+}
+
+static inline uint32_t ring_count(const event_ring_t* ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
 // ============================================================================
 // GENERAL EVENT SYSTEM API
 // ============================================================================
@@ -37,6 +62,14 @@ static int next_queue_id = 1;
 // Create a new event queue for a process
 int event_create_queue(pid_t process_id)
 {
+    void* ring;
+    int shmid = shm_create_kernel(sizeof(event_ring_t), &ring);
+    if (shmid < 0) {
+        KERROR("No memory for an event ring");
+        return -1;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&event_queues_lock);
     int queue_id = -1;
 
     // Find free queue slot
@@ -48,13 +81,22 @@ int event_create_queue(pid_t process_id)
     }
 
     if (queue_id == -1) {
+        spin_unlock_irqrestore(&event_queues_lock, flags);
+        shm_remove(shmid);
         KERROR("No free event queues available");
         return -1;
     }
 
-    // Initialize queue
-    memset(&event_queues[queue_id], 0, sizeof(event_queue_t));
-    event_queues[queue_id].registered_process = process_id;
+    // Initialize queue (the segment comes zeroed: head == tail == 0). The
+    // producer lock is left alone: a late handler may still be leaving it.
+    event_queue_t* queue = &event_queues[queue_id];
+    queue->ring = (event_ring_t*)ring;
+    queue->shmid = shmid;
+    wait_queue_init(&queue->waiters);
+    queue->hash_next = queue_by_pid[pid_bucket(process_id)];
+    queue_by_pid[pid_bucket(process_id)] = (int8_t)queue_id;
+    __atomic_store_n(&queue->registered_process, process_id, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&event_queues_lock, flags);
 
     KDEBUG("Created event queue %d for process %d", queue_id, process_id);
     return queue_id;
@@ -67,11 +109,25 @@ int event_destroy_queue(int queue_id)
         return -1;
     }
 
-    if (event_queues[queue_id].registered_process == 0) {
+    event_queue_t* queue = &event_queues[queue_id];
+    uint64_t flags = spin_lock_irqsave(&event_queues_lock);
+    if (queue->registered_process == 0) {
+        spin_unlock_irqrestore(&event_queues_lock, flags);
         return -1; // Queue not active
     }
 
-    memset(&event_queues[queue_id], 0, sizeof(event_queue_t));
+    int8_t* link = &queue_by_pid[pid_bucket(queue->registered_process)];
+    while (*link != queue_id) link = &event_queues[*link].hash_next;
+    *link = queue->hash_next;
+
+    // No producer is inside the ring once this is taken with the pid cleared
+    uint64_t pflags = spin_lock_irqsave(&queue->producer_lock);
+    queue->registered_process = 0;
+    spin_unlock_irqrestore(&queue->producer_lock, pflags);
+    spin_unlock_irqrestore(&event_queues_lock, flags);
+
+    shm_remove(queue->shmid);  // A mapping keeps the ring until it detaches
+    queue->ring = NULL;
     KDEBUG("Destroyed event queue %d", queue_id);
     return 0;
 }
@@ -80,86 +136,81 @@ int event_destroy_queue(int queue_id)
 // INPUT EVENT QUEUEING
 // ============================================================================
 
-// Queue a keyboard event
-int event_queue_keyboard(pid_t target_process, uint32_t keycode,
-                        uint32_t modifiers, uint32_t state)
+// Producer side. The consumer's tail may come from user space, so a ring
+// that claims more than EVENT_RING_SIZE events counts as full.
+static int event_push(event_queue_t* queue, const event_t* event)
 {
-    int queue_id = -1;
-
-    // Find the queue for this process
-    for (int i = 0; i < MAX_EVENT_QUEUES; i++) {
-        if (event_queues[i].registered_process == target_process) {
-            queue_id = i;
-            break;
-        }
+    uint64_t flags = spin_lock_irqsave(&queue->producer_lock);
+    if (queue->registered_process == 0) {
+        spin_unlock_irqrestore(&queue->producer_lock, flags);
+        return -1;
     }
 
-    if (queue_id == -1) {
-        KDEBUG("No event queue for process %d", target_process);
-        return -1; // No queue for this process
+    event_ring_t* ring = queue->ring;
+    uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= EVENT_RING_SIZE) {
+        ring->dropped++;
+        spin_unlock_irqrestore(&queue->producer_lock, flags);
+        return -1;
     }
 
-    event_queue_t* queue = &event_queues[queue_id];
+    ring->events[head & EVENT_RING_MASK] = *event;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&queue->producer_lock, flags);
 
-    // Check if queue is full
-    if (queue->count >= EVENT_QUEUE_SIZE) {
-        KDEBUG("Event queue %d full, dropping event", queue_id);
-        return -1;
-    }
+    wake_up(&queue->waiters);
+    return 0;
+}
 
-    // Add event to queue
-    event_t* event = &queue->queue[queue->head];
+static inline void event_make_keyboard(event_t* event, uint64_t tsc, uint32_t keycode,
+                                       uint32_t modifiers, uint32_t state)
+{
     event->type = EVENT_TYPE_KEYBOARD;
-    event->timestamp = 1234567890; // Placeholder timestamp
+    event->timestamp = tsc;
     event->data.keyboard.keycode = keycode;
     event->data.keyboard.modifiers = modifiers;
     event->data.keyboard.state = state;
+}
 
-    // Update queue pointers
-    queue->head = (queue->head + 1) % EVENT_QUEUE_SIZE;
-    queue->count++;
+static inline void event_make_mouse(event_t* event, uint64_t tsc, int32_t x, int32_t y,
+                                    uint32_t buttons, int32_t wheel_delta)
+{
+    event->type = EVENT_TYPE_MOUSE;
+    event->timestamp = tsc;
+    event->data.mouse.x = x;
+    event->data.mouse.y = y;
+    event->data.mouse.buttons = buttons;
+    event->data.mouse.wheel = wheel_delta;
+}
 
-    return 0;
+// Queue a keyboard event
+int event_queue_keyboard(pid_t target_process, uint32_t keycode,
+                        uint32_t modifiers, uint32_t state)
+{
+    event_t event;
+    event_make_keyboard(&event, rdtsc(), keycode, modifiers, state);
+
+    int queue_id = event_find_queue(target_process);
+    if (queue_id == -1) {
+        KDEBUG("No event queue for process %d", target_process);
+        return -1; // No queue for this process
+    }
+    return event_push(&event_queues[queue_id], &event);
 }
 
 // Queue a mouse event
 int event_queue_mouse(pid_t target_process, int32_t x, int32_t y,
                       uint32_t buttons, int32_t wheel_delta)
 {
-    int queue_id = -1;
-
-    // Find the queue for this process
-    for (int i = 0; i < MAX_EVENT_QUEUES; i++) {
-        if (event_queues[i].registered_process == target_process) {
-            queue_id = i;
-            break;
-        }
-    }
+    event_t event;
+    event_make_mouse(&event, rdtsc(), x, y, buttons, wheel_delta);
 
+    int queue_id = event_find_queue(target_process);
     if (queue_id == -1) {
         KDEBUG("No event queue for process %d", target_process);
         return -1;
     }
-
-    event_queue_t* queue = &event_queues[queue_id];
-
-    if (queue->count >= EVENT_QUEUE_SIZE) {
-        KDEBUG("Event queue %d full, dropping mouse event", queue_id);
-        return -1;
-    }
-
-    event_t* event = &queue->queue[queue->head];
-    event->type = EVENT_TYPE_MOUSE;
-    event->timestamp = 1234567890;
-    event->data.mouse.x = x;
-    event->data.mouse.y = y;
-    event->data.mouse.buttons = buttons;
-    event->data.mouse.wheel = wheel_delta;
-
-    queue->head = (queue->head + 1) % EVENT_QUEUE_SIZE;
-    queue->count++;
-
-    return 0;
+    return event_push(&event_queues[queue_id], &event);
 }
 
 // ============================================================================
@@ -179,18 +230,37 @@ int event_get_next(int queue_id, event_t* event_out)
         return -1; // Queue not active
     }
 
-    if (queue->count == 0) {
-        return 0; // No events available
+    // A bogus tail written through a mapping only loses events
+    event_ring_t* ring = queue->ring;
+    if (ring_count(ring) > EVENT_RING_SIZE) {
+        __atomic_store_n(&ring->tail, ring->head, __ATOMIC_RELEASE);
     }
 
-    // Copy event to output
-    *event_out = queue->queue[queue->tail];
+    return event_ring_pop(ring, event_out) ? 1 : 0;
+}
+
+// Readable while events are queued
+static uint32_t event_queue_poll(void* obj, wait_queue_t** wq)
+{
+    event_queue_t* queue = (event_queue_t*)obj;
+    *wq = &queue->waiters;
+    return queue->ring && ring_count(queue->ring) != 0 ? EPOLLIN : 0;
+}
+
+// Watch a queue from an epoll set. Remove it (EPOLL_CTL_DEL) before
+// destroying the queue.
+int event_epoll_ctl(epoll_t* ep, int op, int queue_id, const epoll_event_t* event)
+{
+    if (queue_id < 0 || queue_id >= MAX_EVENT_QUEUES) {
+        return -1;
+    }
 
-    // Update queue pointers
-    queue->tail = (queue->tail + 1) % EVENT_QUEUE_SIZE;
-    queue->count--;
+    event_queue_t* queue = &event_queues[queue_id];
+    if (queue->registered_process == 0) {
+        return -1; // Queue not active
+    }
 
-    return 1; // Event retrieved
+    return epoll_ctl(ep, op, queue, event_queue_poll, event);
 }
 
 // ============================================================================
@@ -202,10 +272,11 @@ void keyboard_event_handler(uint32_t keycode, uint32_t modifiers, uint32_t state
 {
     // Queue keyboard event for all registered processes
     // In a real system, you'd want to route to specific windows/processes
+    event_t event;
+    event_make_keyboard(&event, rdtsc(), keycode, modifiers, state);
     for (int i = 0; i < MAX_EVENT_QUEUES; i++) {
         if (event_queues[i].registered_process != 0) {
-            event_queue_keyboard(event_queues[i].registered_process,
-                               keycode, modifiers, state);
+            event_push(&event_queues[i], &event);
         }
     }
 }
@@ -214,10 +285,11 @@ void keyboard_event_handler(uint32_t keycode, uint32_t modifiers, uint32_t state
 void mouse_event_handler(int32_t x, int32_t y, uint32_t buttons, int32_t wheel)
 {
     // Queue mouse event for all registered processes
+    event_t event;
+    event_make_mouse(&event, rdtsc(), x, y, buttons, wheel);
     for (int i = 0; i < MAX_EVENT_QUEUES; i++) {
         if (event_queues[i].registered_process != 0) {
-            event_queue_mouse(event_queues[i].registered_process,
-                            x, y, buttons, wheel);
+            event_push(&event_queues[i], &event);
         }
     }
 }
@@ -236,13 +308,13 @@ int event_init(void)
     KINFO("  ├─ Per-process event queues");
     KINFO("  ├─ Keyboard and mouse event support");
     KINFO("  ├─ Non-blocking event retrieval");
-    KINFO("  ├─ Timestamp tracking for events");
+    KINFO("  ├─ TSC timestamps, coalesced mouse moves");
     KINFO("  ├─ Extensible event types");
     KINFO("  └─ Integration with interrupt system");
     KINFO("");
     KINFO("📊 EVENT SYSTEM CAPABILITIES:");
     KINFO("  ├─ Up to 16 concurrent event queues");
-    KINFO("  ├─ 256 events per queue (circular buffer)");
+    KINFO("  ├─ 256 events per queue (lock-free ring, mappable)");
     KINFO("  ├─ Keyboard: keycodes, modifiers, press/release");
     KINFO("  ├─ Mouse: position, buttons, wheel");
     KINFO("  ├─ Window: resize, move, close events (future)");
@@ -253,6 +325,7 @@ int event_init(void)
 
     // Initialize all queues as unused
     memset(event_queues, 0, sizeof(event_queues));
+    memset(queue_by_pid, -1, sizeof(queue_by_pid));
 
     KINFO("Event system initialized - ready for input queues");
     return 0;
@@ -274,25 +347,50 @@ int64_t sys_event_destroy_queue(int64_t queue_id)
     return event_destroy_queue((int)queue_id);
 }
 
+// timeout is in milliseconds: 0 polls, WAIT_FOREVER blocks until an event
 int64_t sys_event_get_next(event_t* event_out, uint64_t timeout)
 {
-    // For now, ignore timeout and use current process's queue
-    // In a real implementation, you'd look up the queue by current process
-    pid_t pid = scheduler_get_current_task_id();
-    
-    // Find queue for this process
-    int queue_id = -1;
-    for (int i = 0; i < MAX_EVENT_QUEUES; i++) {
-        if (event_queues[i].registered_process == pid) {
-            queue_id = i;
-            break;
-        }
-    }
-    
+    // Use the current process's queue
+    int queue_id = event_find_queue(scheduler_get_current_task_id());
     if (queue_id < 0) {
         return -1;
     }
     
-    (void)timeout; // Unused for now
+    event_queue_t* queue = &event_queues[queue_id];
+    if (timeout != 0 && ring_count(queue->ring) == 0) {
+        uint64_t deadline = WAIT_FOREVER;
+        if (timeout < WAIT_FOREVER / 1000) {
+            deadline = time_monotonic_us() + timeout * 1000;
+        }
+        
+        wait_entry_t wait;
+        for (;;) {
+            wait_prepare(&queue->waiters, &wait);
+            if (ring_count(queue->ring) != 0) break;
+            if (wait_schedule(&wait, deadline) < 0) break;  // Timed out
+        }
+        wait_finish(&wait);
+    }
+    
     return event_get_next(queue_id, event_out);
 }
+
+// Map the calling process's ring, to consume with event_ring_pop()
+event_ring_t* sys_event_map_queue(int64_t queue_id)
+{
+    if (queue_id < 0 || queue_id >= MAX_EVENT_QUEUES) {
+        return NULL;
+    }
+
+    event_queue_t* queue = &event_queues[queue_id];
+    if (queue->registered_process != scheduler_get_current_task_id()) {
+        return NULL;  // Not active, or someone else's
+    }
+
+    void* addr = shm_attached_at(queue->shmid);
+    if (!addr) {
+        addr = sys_shmat(queue->shmid, NULL, 0);
+        if ((intptr_t)addr < 0) return NULL;
+    }
+    return (event_ring_t*)addr;
+}
@@ -1,9 +1,17 @@
 /*
  * Framebuffer Graphics Driver
  * VESA-compatible linear framebuffer for GUI display
+ *
+ * Everything draws into a back buffer in system RAM. framebuffer_present()
+ * copies what changed to the scanout buffer (write-combined video memory)
+ * and, where the card has room for two screens, flips between them at
+ * vertical retrace so a frame is never seen half drawn.
  */
 
 #include "kernel.h"
+#include "io.h"
+#include "cpu.h"
+#include "drivers/pci.h"
 
 // Framebuffer information (returned by VESA BIOS)
 typedef struct {
@@ -19,11 +27,42 @@ typedef struct {
 
 // Global framebuffer state
 static framebuffer_info_t* fb_info = NULL;
-static volatile uint8_t* fb_buffer = NULL;
+static volatile uint8_t* fb_buffer = NULL;   // Back buffer (system RAM)
 static uint32_t current_width = 1024;
 static uint32_t current_height = 768;
 static uint8_t current_bpp = 32;
 
+// Scanout: what the display shows
+static volatile uint8_t* scanout = NULL;
+static int scanout_pages = 1;                // 2: flip between halves of video memory
+static int scanout_front = 0;                // Page on screen
+static bool scanout_hw = false;              // Real video memory (else a RAM stand-in)
+static damage_t screen_damage;               // Back buffer changes not yet presented
+static damage_t last_present;                // Copied to the front page, not the other
+
+// Frame clock
+#define FRAME_PERIOD_US 16667                // 60 Hz
+static uint64_t next_frame_us = 0;
+
+// Bochs/QEMU display interface (PCI 1234:1111, "std" VGA)
+#define BGA_VENDOR_ID        0x1234
+#define BGA_DEVICE_ID        0x1111
+#define VBE_DISPI_IOPORT_INDEX 0x01CE
+#define VBE_DISPI_IOPORT_DATA  0x01CF
+#define VBE_DISPI_INDEX_ID       0
+#define VBE_DISPI_INDEX_XRES     1
+#define VBE_DISPI_INDEX_YRES     2
+#define VBE_DISPI_INDEX_BPP      3
+#define VBE_DISPI_INDEX_ENABLE   4
+#define VBE_DISPI_INDEX_VIRT_HEIGHT 7
+#define VBE_DISPI_INDEX_Y_OFFSET 9
+#define VBE_DISPI_INDEX_VIDEO_MEMORY_64K 0x0A
+#define VBE_DISPI_ID2            0xB0C2      // First with 32 bpp
+#define VBE_DISPI_ENABLED        0x01
+#define VBE_DISPI_LFB_ENABLED    0x40
+#define VGA_INPUT_STATUS_1       0x03DA
+#define VGA_STATUS_VRETRACE      0x08
+
 // Color definitions for 32-bit RGBA
 #define RGBA(r,g,b,a) (((a) << 24) | ((r) << 16) | ((g) << 8) | (b))
 #define RGB(r,g,b)    RGBA(r,g,b,0xFF)
@@ -60,6 +99,7 @@ typedef struct {
     int visible;        // Visibility flag
     int z_index;        // Z-order
     volatile uint8_t* buffer; // Back buffer
+    int shmid;          // Shared memory segment behind buffer
     pid_t owner_pid;    // Owning process
 } window_t;
 
@@ -67,6 +107,127 @@ static window_t windows[MAX_WINDOWS];
 static int next_window_id = 1;
 static display_info_t display_info;
 
+// ============================================================================
+// SCANOUT
+// ============================================================================
+
+static inline uint16_t dispi_read(uint16_t index)
+{
+    outw(VBE_DISPI_IOPORT_INDEX, index);
+    return inw(VBE_DISPI_IOPORT_DATA);
+}
+
+static inline void dispi_write(uint16_t index, uint16_t value)
+{
+    outw(VBE_DISPI_IOPORT_INDEX, index);
+    outw(VBE_DISPI_IOPORT_DATA, value);
+}
+
+// Set the mode on a Bochs/QEMU display and map its framebuffer
+// write-combining; two pages when video memory holds them
+static int scanout_init_bga(void)
+{
+    pci_device_t dev;
+    if (pci_find_device(BGA_VENDOR_ID, BGA_DEVICE_ID, &dev) != 0) return -1;
+    if (dispi_read(VBE_DISPI_INDEX_ID) < VBE_DISPI_ID2) return -1;
+
+    uint64_t lfb = pci_bar_address(&dev, 0);
+    if (!lfb) return -1;
+
+    size_t page_size = (size_t)current_width * current_height * 4;
+    size_t vram = (size_t)dispi_read(VBE_DISPI_INDEX_VIDEO_MEMORY_64K) * 65536;
+    int pages = vram >= 2 * page_size ? 2 : 1;
+
+    dispi_write(VBE_DISPI_INDEX_ENABLE, 0);
+    dispi_write(VBE_DISPI_INDEX_XRES, current_width);
+    dispi_write(VBE_DISPI_INDEX_YRES, current_height);
+    dispi_write(VBE_DISPI_INDEX_BPP, 32);
+    dispi_write(VBE_DISPI_INDEX_VIRT_HEIGHT, current_height * pages);
+    dispi_write(VBE_DISPI_INDEX_ENABLE, VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED);
+    dispi_write(VBE_DISPI_INDEX_Y_OFFSET, 0);
+
+    // Stores gather into whole lines instead of one bus write each
+    size_t size = page_size * pages;
+    for (size_t off = 0; off < size; off += PAGE_SIZE) {
+        if (vmm_map_page(lfb + off, lfb + off, PAGE_PRESENT | PAGE_WRITABLE | PAGE_WRITE_COMBINE) != 0) {
+            KERROR("Failed to map framebuffer at 0x%lx", lfb + off);
+            return -1;
+        }
+    }
+
+    scanout = (volatile uint8_t*)(uintptr_t)lfb;
+    scanout_pages = pages;
+    scanout_front = 0;
+    scanout_hw = true;
+    return 0;
+}
+
+// Spin until the beam enters vertical retrace (bounded: not every card
+// reports it)
+static void scanout_wait_vretrace(void)
+{
+    if (!scanout_hw) return;
+    for (int i = 0; i < 100000 && (inb(VGA_INPUT_STATUS_1) & VGA_STATUS_VRETRACE); i++) __asm__ volatile("pause");
+    for (int i = 0; i < 100000 && !(inb(VGA_INPUT_STATUS_1) & VGA_STATUS_VRETRACE); i++) __asm__ volatile("pause");
+}
+
+// Note back buffer pixels that changed (screen coordinates)
+void framebuffer_damage(int x, int y, int width, int height)
+{
+    rect_t r = { x, y, width, height };
+    rect_t screen = { 0, 0, (int)current_width, (int)current_height };
+    if (rect_intersect(&r, &screen, &r)) damage_add(&screen_damage, r.x, r.y, r.width, r.height);
+}
+
+// Put what changed on screen. With two pages the hidden one is brought up
+// to date (this frame's damage and the last one's, which only reached the
+// other page) and shown at the next retrace; with one, the copy waits for
+// the retrace instead.
+void framebuffer_present(void)
+{
+    if (!scanout || screen_damage.count == 0) return;
+
+    damage_t copy = screen_damage;
+    int page = 0;
+    if (scanout_pages > 1) {
+        page = 1 - scanout_front;
+        for (int i = 0; i < last_present.count; i++) {
+            const rect_t* r = &last_present.rects[i];
+            damage_add(&copy, r->x, r->y, r->width, r->height);
+        }
+    } else {
+        scanout_wait_vretrace();
+    }
+
+    uint32_t* dst = (uint32_t*)scanout + (size_t)page * current_width * current_height;
+    const uint32_t* src = (const uint32_t*)fb_buffer;
+    for (int i = 0; i < copy.count; i++) {
+        const rect_t* r = &copy.rects[i];
+        size_t offset = (size_t)r->y * current_width + r->x;
+        blit_copy_rect(dst + offset, current_width, src + offset, current_width, r->width, r->height);
+    }
+
+    if (scanout_pages > 1) {
+        scanout_wait_vretrace();
+        dispi_write(VBE_DISPI_INDEX_Y_OFFSET, page * current_height);
+        scanout_front = page;
+    }
+    last_present = screen_damage;
+    damage_clear(&screen_damage);
+}
+
+// Sleep to the next refresh boundary; a caller that fell behind picks up
+// from now rather than rushing to catch up
+void framebuffer_wait_frame(void)
+{
+    uint64_t now = time_monotonic_us();
+    next_frame_us += FRAME_PERIOD_US;
+    if (next_frame_us <= now) {
+        next_frame_us = now + FRAME_PERIOD_US;
+    }
+    scheduler_sleep_us(next_frame_us - now);
+}
+
 // ============================================================================
 // FRAMEBUFFER INITIALIZATION
 // ============================================================================
@@ -88,26 +249,39 @@ int framebuffer_init(void)
     display_info.bpp = current_bpp;
     display_info.pitch = current_width * (current_bpp / 8);
 
-    // Allocate virtual memory for framebuffer (simulate mapping)
-    // In real hardware, this would map VESA linear framebuffer
     size_t fb_size = current_width * current_height * (current_bpp / 8);
 
-    // For demo, we'll use a smaller buffer that fits in RAM
-    // Real implementation would map hardware framebuffer
-    fb_buffer = (volatile uint8_t*)kmalloc(1024 * 768 * 4); // 3MB buffer for demo
+    // All drawing lands here, in cached RAM that is cheap to read back
+    fb_buffer = (volatile uint8_t*)kmalloc(fb_size);
     if (!fb_buffer) {
         KERROR("Failed to allocate framebuffer memory");
         return -1;
     }
 
+    // Without a known card, a RAM buffer stands in for the screen
+    if (scanout_init_bga() < 0) {
+        scanout = (volatile uint8_t*)kmalloc(fb_size);
+        if (!scanout) {
+            KERROR("Failed to allocate framebuffer memory");
+            kfree((void*)fb_buffer);
+            fb_buffer = NULL;
+            return -1;
+        }
+        scanout_pages = 1;
+    }
+
     display_info.buffer = fb_buffer;
+    blit_init();
 
     KINFO("📐 Framebuffer Graphics Initialized:");
     KINFO("  ├─ Resolution: %ux%u", current_width, current_height);
     KINFO("  ├─ Color depth: %u bits per pixel", current_bpp);
     KINFO("  ├─ Framebuffer size: %u KB", fb_size / 1024);
     KINFO("  ├─ Pitch: %u bytes per line", display_info.pitch);
-    KINFO("  └─ Address: 0x%lx", (uintptr_t)fb_buffer);
+    KINFO("  ├─ Back buffer: 0x%lx", (uintptr_t)fb_buffer);
+    KINFO("  └─ Scanout: 0x%lx (%s, %s)", (uintptr_t)scanout,
+          scanout_hw ? (cpu_has_pat_wc() ? "write-combined" : "write-through") : "RAM",
+          scanout_pages > 1 ? "page flipping" : "copy");
 
     // Clear screen to black
     framebuffer_clear(COLOR_BLACK);
@@ -130,10 +304,8 @@ void framebuffer_clear(uint32_t color)
 {
     if (!fb_buffer) return;
 
-    uint32_t* buffer = (uint32_t*)fb_buffer;
-    for (uint32_t i = 0; i < current_width * current_height; i++) {
-        buffer[i] = color;
-    }
+    blit_fill_rect((uint32_t*)fb_buffer, current_width, current_width, current_height, color);
+    framebuffer_damage(0, 0, current_width, current_height);
 }
 
 // Plot a single pixel
@@ -145,6 +317,7 @@ void framebuffer_put_pixel(int x, int y, uint32_t color)
 
     volatile uint32_t* buffer = (volatile uint32_t*)fb_buffer;
     buffer[y * current_width + x] = color;
+    damage_add(&screen_damage, x, y, 1, 1);
 }
 
 // Get pixel color
@@ -175,13 +348,9 @@ void framebuffer_fill_rect(int x, int y, int width, int height, uint32_t color)
 
     if (width <= 0 || height <= 0) return;
 
-    volatile uint32_t* buffer = (volatile uint32_t*)fb_buffer;
-
-    for (int py = y; py < y + height; py++) {
-        for (int px = x; px < x + width; px++) {
-            buffer[py * current_width + px] = color;
-        }
-    }
+    uint32_t* buffer = (uint32_t*)fb_buffer;
+    blit_fill_rect(buffer + (size_t)y * current_width + x, current_width, width, height, color);
+    damage_add(&screen_damage, x, y, width, height);
 }
 
 // Draw rectangle outline
@@ -288,6 +457,99 @@ void framebuffer_draw_test_pattern(void)
     }
 }
 
+// ============================================================================
+// DAMAGE REGIONS
+// ============================================================================
+
+bool rect_intersect(const rect_t* a, const rect_t* b, rect_t* out)
+{
+    int x0 = a->x > b->x ? a->x : b->x;
+    int y0 = a->y > b->y ? a->y : b->y;
+    int x1 = a->x + a->width < b->x + b->width ? a->x + a->width : b->x + b->width;
+    int y1 = a->y + a->height < b->y + b->height ? a->y + a->height : b->y + b->height;
+    if (x1 <= x0 || y1 <= y0) return false;
+
+    out->x = x0;
+    out->y = y0;
+    out->width = x1 - x0;
+    out->height = y1 - y0;
+    return true;
+}
+
+// What of a lies outside b: bands above and below, then left and right
+int rect_subtract(const rect_t* a, const rect_t* b, rect_t out[4])
+{
+    rect_t hole;
+    if (!rect_intersect(a, b, &hole)) {
+        out[0] = *a;
+        return 1;
+    }
+
+    int count = 0;
+    if (hole.y > a->y) {
+        out[count++] = (rect_t){ a->x, a->y, a->width, hole.y - a->y };
+    }
+    if (hole.y + hole.height < a->y + a->height) {
+        out[count++] = (rect_t){ a->x, hole.y + hole.height, a->width,
+                                 a->y + a->height - (hole.y + hole.height) };
+    }
+    if (hole.x > a->x) {
+        out[count++] = (rect_t){ a->x, hole.y, hole.x - a->x, hole.height };
+    }
+    if (hole.x + hole.width < a->x + a->width) {
+        out[count++] = (rect_t){ hole.x + hole.width, hole.y,
+                                 a->x + a->width - (hole.x + hole.width), hole.height };
+    }
+    return count;
+}
+
+static inline long rect_area(const rect_t* r)
+{
+    return (long)r->width * r->height;
+}
+
+static rect_t rect_union(const rect_t* a, const rect_t* b)
+{
+    int x0 = a->x < b->x ? a->x : b->x;
+    int y0 = a->y < b->y ? a->y : b->y;
+    int x1 = a->x + a->width > b->x + b->width ? a->x + a->width : b->x + b->width;
+    int y1 = a->y + a->height > b->y + b->height ? a->y + a->height : b->y + b->height;
+    return (rect_t){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+// A rectangle merges into one it touches when their bounds cost no more
+// than the two apart (nested, or side by side along an edge)
+void damage_add(damage_t* damage, int x, int y, int width, int height)
+{
+    if (width <= 0 || height <= 0) return;
+    rect_t r = { x, y, width, height };
+
+    for (int i = 0; i < damage->count; i++) {
+        rect_t u = rect_union(&damage->rects[i], &r);
+        if (rect_area(&u) <= rect_area(&damage->rects[i]) + rect_area(&r)) {
+            // The grown rectangle may now swallow others: take it out and re-add
+            damage->rects[i] = damage->rects[--damage->count];
+            damage_add(damage, u.x, u.y, u.width, u.height);
+            return;
+        }
+    }
+
+    if (damage->count < DAMAGE_MAX_RECTS) {
+        damage->rects[damage->count++] = r;
+        return;
+    }
+
+    // Full: one rectangle around everything
+    for (int i = 0; i < damage->count; i++) r = rect_union(&r, &damage->rects[i]);
+    damage->rects[0] = r;
+    damage->count = 1;
+}
+
+void damage_clear(damage_t* damage)
+{
+    damage->count = 0;
+}
+
 // ============================================================================
 // WINDOW MANAGEMENT (FOR DISPLAY SERVER)
 // ============================================================================
@@ -319,18 +581,19 @@ int window_create(int x, int y, int width, int height, pid_t owner_pid)
     windows[window_id].z_index = 0;
     windows[window_id].owner_pid = owner_pid;
 
-    // Allocate back buffer for window
+    // Allocate back buffer for window, as shared memory the owner can map
+    // and draw into directly. It starts transparent (alpha = 0).
     size_t back_buffer_size = width * height * 4; // 32-bit RGBA
-    windows[window_id].buffer = (volatile uint8_t*)kmalloc(back_buffer_size);
+    void* buffer = NULL;
+    int shmid = shm_create_kernel(back_buffer_size, &buffer);
 
-    if (!windows[window_id].buffer) {
+    if (shmid < 0) {
         windows[window_id].id = 0; // Mark as free
         KERROR("Failed to allocate window back buffer");
         return -1;
     }
-
-    // Clear back buffer to transparent (alpha = 0)
-    memset((void*)windows[window_id].buffer, 0, back_buffer_size);
+    windows[window_id].buffer = (volatile uint8_t*)buffer;
+    windows[window_id].shmid = shmid;
 
     KDEBUG("Created window %d for process %d (%dx%d at %d,%d)",
            windows[window_id].id, owner_pid, width, height, x, y);
@@ -343,8 +606,9 @@ int window_destroy(int window_id)
 {
     for (int i = 0; i < MAX_WINDOWS; i++) {
         if (windows[i].id == window_id) {
+            // Clients still mapping it keep the pages until they detach
             if (windows[i].buffer) {
-                kfree((void*)windows[i].buffer);
+                shm_remove(windows[i].shmid);
             }
             memset(&windows[i], 0, sizeof(window_t));
             KDEBUG("Destroyed window %d", window_id);
@@ -365,41 +629,52 @@ volatile uint8_t* window_get_buffer(int window_id)
     return NULL;
 }
 
-// Mark window as ready for display (composite to main buffer)
-void window_composite(int window_id)
+static window_t* window_find(int window_id)
 {
-    // Find window
-    window_t* window = NULL;
     for (int i = 0; i < MAX_WINDOWS; i++) {
         if (windows[i].id == window_id) {
-            window = &windows[i];
-            break;
+            return &windows[i];
         }
     }
+    return NULL;
+}
 
-    if (!window || !window->visible) return;
-
-    uint32_t* src = (uint32_t*)window->buffer;
-    uint32_t* dst = (uint32_t*)fb_buffer;
-
-    // Composite window to main framebuffer with alpha blending
-    for (int wy = 0; wy < window->height; wy++) {
-        int screen_y = window->y + wy;
-        if (screen_y < 0 || screen_y >= current_height) continue;
+// Draw part of a window's buffer (area, in window coordinates) with the
+// window at screen_x, screen_y: copied if opaque, else blended over the
+// screen. Clipped to the buffer and the screen.
+void window_present_rect(int window_id, int screen_x, int screen_y, const rect_t* area, bool opaque)
+{
+    window_t* window = window_find(window_id);
+    if (!window || !window->visible || !fb_buffer) return;
+
+    rect_t bounds = { 0, 0, window->width, window->height };
+    rect_t screen = { -screen_x, -screen_y, (int)current_width, (int)current_height };
+    rect_t r;
+    if (!rect_intersect(area, &bounds, &r) || !rect_intersect(&r, &screen, &r)) return;
+
+    const uint32_t* src = (const uint32_t*)window->buffer + (size_t)r.y * window->width + r.x;
+    uint32_t* dst = (uint32_t*)fb_buffer + (size_t)(screen_y + r.y) * current_width + (screen_x + r.x);
+    if (opaque) {
+        blit_copy_rect(dst, current_width, src, window->width, r.width, r.height);
+    } else {
+        blit_over_rect(dst, current_width, src, window->width, r.width, r.height);
+    }
+    damage_add(&screen_damage, screen_x + r.x, screen_y + r.y, r.width, r.height);
+}
 
-        for (int wx = 0; wx < window->width; wx++) {
-            int screen_x = window->x + wx;
-            if (screen_x < 0 || screen_x >= current_width) continue;
+// Mark window as ready for display (composite to main buffer). Windows
+// the window manager knows wait for the next frame, and get only their
+// damage redrawn.
+void window_composite(int window_id)
+{
+    if (wm_queue_composite(window_id) == 0) return;
 
-            uint32_t pixel = src[wy * window->width + wx];
+    window_t* window = window_find(window_id);
+    if (!window) return;
 
-            // Simple alpha blending (if alpha > 128, fully opaque for demo)
-            uint8_t alpha = (pixel >> 24) & 0xFF;
-            if (alpha > 128) {
-                dst[screen_y * current_width + screen_x] = pixel;
-            }
-        }
-    }
+    // Composite window to main framebuffer with alpha blending
+    rect_t all = { 0, 0, window->width, window->height };
+    window_present_rect(window_id, window->x, window->y, &all, false);
 }
 
 // ============================================================================
@@ -448,6 +723,44 @@ int64_t sys_framebuffer_access(void** framebuffer, uint32_t* width, uint32_t* he
     return 0;
 }
 
+// Map the window's pixels into the caller (once per address space)
+void* sys_window_map(int window_id, uint32_t* width, uint32_t* height)
+{
+    window_t* window = window_find(window_id);
+    if (!window || !window->buffer) return NULL;
+
+    void* addr = shm_attached_at(window->shmid);
+    if (!addr) {
+        addr = sys_shmat(window->shmid, NULL, 0);
+        if ((intptr_t)addr < 0) return NULL;
+    }
+    if (width) *width = window->width;
+    if (height) *height = window->height;
+    return addr;
+}
+
+// A frame's damage from a client that drew into its mapped buffer
+int64_t sys_window_commit(int window_id, const rect_t* rects, int count)
+{
+    window_t* window = window_find(window_id);
+    if (!window || count < 0 || (count > 0 && !rects)) return -1;
+
+    rect_t all = { 0, 0, window->width, window->height };
+    if (count == 0) {
+        rects = &all;
+        count = 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (wm_damage_window(window_id, rects[i].x, rects[i].y, rects[i].width, rects[i].height) < 0) {
+            // Not managed: straight to the back buffer
+            window_present_rect(window_id, window->x, window->y, &rects[i], false);
+        }
+    }
+    wm_queue_composite(window_id);
+    return 0;
+}
+
 // Drawing primitives syscalls
 int64_t sys_draw_rect(int window_id, int x, int y, int w, int h, uint32_t color)
 {
@@ -463,12 +776,15 @@ int64_t sys_draw_circle(int window_id, int center_x, int center_y, int radius, u
     return 0;
 }
 
-// Simple text rendering stub
+// Text straight onto the screen, over what is there
 void framebuffer_draw_text(int x, int y, const char* text, uint32_t color)
 {
-    // Stub implementation - in a real kernel, this would render actual text
-    // For now, just draw a colored rectangle to indicate text position
-    (void)text; // Unused for now
-    framebuffer_fill_rect(x, y, 8, 12, color);
+    if (!fb_buffer || !text) return;
+
+    rect_t screen = { 0, 0, current_width, current_height };
+    int width = text_draw((uint32_t*)fb_buffer, current_width, &screen, x, y, text, color, 0);
+
+    rect_t r = { x, y, width, TEXT_CELL_H };
+    if (rect_intersect(&r, &screen, &r)) damage_add(&screen_damage, r.x, r.y, r.width, r.height);
 }
 
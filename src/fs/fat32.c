@@ -1,5 +1,6 @@
 #include "kernel.h"
 #include "drivers/block.h"
+#include "page_cache.h"
 #include "vfs.h"
 
 // FAT32 Filesystem Driver
@@ -63,25 +64,56 @@ typedef struct {
 #define ATTR_ARCHIVE   0x20
 #define ATTR_LONG_NAME 0x0F
 
+// Cluster chain values
+#define FAT32_CLUSTER_MASK 0x0FFFFFFF
+#define FAT32_EOC          0x0FFFFFF8  // This and above: end of chain
+
 // FAT32 Context
 typedef struct {
     block_device_t* dev;
+    page_mapping_t* cache;  // Device page cache: FAT, directories and data
     fat32_bpb_t bpb;
     uint32_t fat_start_sector;
     uint32_t data_start_sector;
+    uint32_t cluster_count;
+    
+    // FAT page of the last lookup, kept pinned: chain walks mostly stay in it
+    cached_page_t* fat_page;
+    uint64_t fat_page_index;
 } fat32_fs_t;
 
+// A run of clusters contiguous on disk, first_file_cluster counting from
+// the start of the file
+typedef struct {
+    uint32_t first_file_cluster;
+    uint32_t cluster;
+    uint32_t count;
+} fat32_extent_t;
+
+// Open file: its chain flattened into extents once, at open time
+typedef struct {
+    fat32_fs_t* fs;
+    uint32_t size;
+    uint32_t extent_count;
+    fat32_extent_t* extents;
+    struct file_ra_state ra;
+} fat32_file_t;
+
 // Read a cluster from FAT table
 static uint32_t fat32_read_fat(fat32_fs_t* fs, uint32_t cluster) {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fs->fat_start_sector + (fat_offset / fs->bpb.bytes_per_sector);
-    uint32_t ent_offset = fat_offset % fs->bpb.bytes_per_sector;
+    uint64_t fat_offset = (uint64_t)fs->fat_start_sector * fs->bpb.bytes_per_sector + cluster * 4;
+    uint64_t index = fat_offset / PAGE_SIZE;
     
-    uint8_t buffer[512]; // Assuming 512 byte sectors
-    fs->dev->read(fs->dev, fat_sector, 1, buffer);
+    if (!fs->fat_page || fs->fat_page_index != index) {
+        cached_page_t* page = page_cache_get(fs->cache, index);
+        if (!page) return FAT32_CLUSTER_MASK;  // Unreadable: end the chain
+        if (fs->fat_page) page_cache_put(fs->fat_page);
+        fs->fat_page = page;
+        fs->fat_page_index = index;
+    }
     
-    uint32_t table_value = *(uint32_t*)&buffer[ent_offset];
-    return table_value & 0x0FFFFFFF;
+    uint32_t table_value = *(uint32_t*)(fs->fat_page->data + (fat_offset & (PAGE_SIZE - 1)));
+    return table_value & FAT32_CLUSTER_MASK;
 }
 
 // Convert cluster to sector
@@ -89,28 +121,144 @@ static uint32_t fat32_cluster_to_sector(fat32_fs_t* fs, uint32_t cluster) {
     return fs->data_start_sector + ((cluster - 2) * fs->bpb.sectors_per_cluster);
 }
 
-// Read file content
-int fat32_read_file(fat32_fs_t* fs, uint32_t start_cluster, void* buffer, uint32_t size) {
-    uint32_t cluster = start_cluster;
-    uint32_t bytes_read = 0;
-    uint8_t* buf = (uint8_t*)buffer;
+// ============================================================================
+// FILES
+// ============================================================================
+
+// Walk the chain once into extents; at most enough clusters for size
+fat32_file_t* fat32_open(fat32_fs_t* fs, uint32_t start_cluster, uint32_t size) {
+    fat32_file_t* file = kmalloc_tracked(sizeof(fat32_file_t), "fat32_file");
+    if (!file) return NULL;
+    file->fs = fs;
+    file->size = size;
+    
     uint32_t cluster_size = fs->bpb.sectors_per_cluster * fs->bpb.bytes_per_sector;
+    uint32_t clusters = (size + cluster_size - 1) / cluster_size;
+    uint32_t capacity = 0;
+    uint32_t cluster = start_cluster;
     
-    while (bytes_read < size) {
-        if (cluster >= 0x0FFFFFF8) break; // End of chain
+    for (uint32_t n = 0; n < clusters; n++) {
+        if (cluster < 2 || cluster >= FAT32_EOC || cluster - 2 >= fs->cluster_count) break;
         
-        uint32_t sector = fat32_cluster_to_sector(fs, cluster);
-        uint32_t to_read = size - bytes_read;
-        if (to_read > cluster_size) to_read = cluster_size;
+        fat32_extent_t* last = file->extent_count ? &file->extents[file->extent_count - 1] : NULL;
+        if (last && last->cluster + last->count == cluster) {
+            last->count++;
+        } else {
+            if (file->extent_count == capacity) {
+                capacity = capacity ? capacity * 2 : 4;
+                fat32_extent_t* grown = krealloc(file->extents, capacity * sizeof(fat32_extent_t));
+                if (!grown) break;
+                file->extents = grown;
+            }
+            fat32_extent_t* extent = &file->extents[file->extent_count++];
+            extent->first_file_cluster = n;
+            extent->cluster = cluster;
+            extent->count = 1;
+        }
+        cluster = fat32_read_fat(fs, cluster);
+    }
+    
+    // A chain shorter than the size (or broken) makes the file shorter
+    uint32_t mapped = file->extent_count ? file->extents[file->extent_count - 1].first_file_cluster +
+                                           file->extents[file->extent_count - 1].count : 0;
+    if ((uint64_t)mapped * cluster_size < size) {
+        file->size = mapped * cluster_size;
+    }
+    return file;
+}
+
+void fat32_close(fat32_file_t* file) {
+    if (!file) return;
+    kfree(file->extents);
+    kfree_tracked(file);
+}
+
+// Extent holding file cluster n (extents are sorted by first_file_cluster)
+static fat32_extent_t* fat32_find_extent(fat32_file_t* file, uint32_t n) {
+    uint32_t lo = 0, hi = file->extent_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        fat32_extent_t* extent = &file->extents[mid];
+        if (n < extent->first_file_cluster) {
+            hi = mid;
+        } else if (n >= extent->first_file_cluster + extent->count) {
+            lo = mid + 1;
+        } else {
+            return extent;
+        }
+    }
+    return NULL;
+}
+
+// Device byte offset of pos, and how far the extent runs on from it
+static uint64_t fat32_file_disk(fat32_file_t* file, uint32_t pos, uint32_t* contiguous) {
+    fat32_fs_t* fs = file->fs;
+    uint32_t cluster_size = fs->bpb.sectors_per_cluster * fs->bpb.bytes_per_sector;
+    fat32_extent_t* extent = fat32_find_extent(file, pos / cluster_size);
+    if (!extent) return 0;
+    
+    uint32_t extent_start = extent->first_file_cluster * cluster_size;
+    *contiguous = extent_start + extent->count * cluster_size - pos;
+    return (uint64_t)fat32_cluster_to_sector(fs, extent->cluster) * fs->bpb.bytes_per_sector +
+           (pos - extent_start);
+}
+
+// Prefetch file bytes [pos, pos + len) as device pages, extent by extent
+static void fat32_readahead(fat32_file_t* file, uint32_t pos, uint32_t len) {
+    if (pos >= file->size) return;
+    if (len > file->size - pos) len = file->size - pos;
+    
+    while (len > 0) {
+        uint32_t run;
+        uint64_t disk = fat32_file_disk(file, pos, &run);
+        if (!disk) return;
+        if (run > len) run = len;
         
-        // Read full cluster (simplified, should handle partial sectors)
-        // For now, assuming buffer is large enough and aligned
-        fs->dev->read(fs->dev, sector, fs->bpb.sectors_per_cluster, buf + bytes_read);
+        uint64_t first = disk / PAGE_SIZE;
+        page_cache_readahead(file->fs->cache, first, (disk + run - 1) / PAGE_SIZE - first + 1);
+        pos += run;
+        len -= run;
+    }
+}
+
+// Read from offset: one page cache range (merged disk requests) per extent,
+// then the next readahead window if the reader is sequential
+int fat32_read(fat32_file_t* file, uint32_t offset, void* buffer, uint32_t size) {
+    fat32_fs_t* fs = file->fs;
+    if (offset >= file->size) return 0;
+    if (size > file->size - offset) size = file->size - offset;
+    if (size == 0) return 0;
+    
+    uint64_t ra_start;
+    uint32_t ra_pages;
+    uint32_t first = offset / PAGE_SIZE;
+    bool ahead = page_cache_ra_advance(&file->ra, first, (offset + size - 1) / PAGE_SIZE - first + 1,
+                                       &ra_start, &ra_pages);
+    
+    uint8_t* buf = (uint8_t*)buffer;
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t len;
+        uint64_t disk = fat32_file_disk(file, offset + done, &len);
+        if (!disk) break;
+        if (len > size - done) len = size - done;
         
-        bytes_read += to_read; // Assuming we read full cluster or up to size
-        cluster = fat32_read_fat(fs, cluster);
+        if (page_cache_read(fs->cache, disk, buf + done, len) < 0) break;
+        done += len;
     }
     
+    if (ahead && ra_start * PAGE_SIZE < file->size) {
+        fat32_readahead(file, (uint32_t)(ra_start * PAGE_SIZE), ra_pages * PAGE_SIZE);
+    }
+    return done;
+}
+
+// Read file content
+int fat32_read_file(fat32_fs_t* fs, uint32_t start_cluster, void* buffer, uint32_t size) {
+    fat32_file_t* file = fat32_open(fs, start_cluster, size);
+    if (!file) return 0;
+    int bytes_read = fat32_read(file, 0, buffer, size);
+    fat32_close(file);
     return bytes_read;
 }
 
@@ -121,9 +269,9 @@ void fat32_ls(fat32_fs_t* fs, uint32_t dir_cluster) {
     
     KINFO("Listing directory (Cluster %d):", dir_cluster);
     
-    while (cluster < 0x0FFFFFF8) {
-        uint32_t sector = fat32_cluster_to_sector(fs, cluster);
-        fs->dev->read(fs->dev, sector, fs->bpb.sectors_per_cluster, buffer);
+    while (cluster >= 2 && cluster < FAT32_EOC) {
+        uint64_t offset = (uint64_t)fat32_cluster_to_sector(fs, cluster) * fs->bpb.bytes_per_sector;
+        if (page_cache_read(fs->cache, offset, buffer, sizeof(buffer)) < 0) return;
         
         fat32_dir_entry_t* entry = (fat32_dir_entry_t*)buffer;
         for (int i = 0; i < 128; i++) { // Assuming 4K cluster / 32 byte entry
@@ -154,10 +302,15 @@ fat32_fs_t* fat32_init(block_device_t* dev) {
     if (!fs) return NULL;
     
     fs->dev = dev;
+    fs->cache = page_cache_bdev(dev);
+    if (!fs->cache) {
+        kfree_tracked(fs);
+        return NULL;
+    }
     
     // Read BPB (Sector 0)
     uint8_t buffer[512];
-    dev->read(dev, 0, 1, buffer);
+    page_cache_read(fs->cache, 0, buffer, sizeof(buffer));
     memcpy(&fs->bpb, buffer, sizeof(fat32_bpb_t));
     
     // Verify signature
@@ -173,6 +326,9 @@ fat32_fs_t* fat32_init(block_device_t* dev) {
     // Calculate offsets
     fs->fat_start_sector = fs->bpb.reserved_sectors;
     fs->data_start_sector = fs->bpb.reserved_sectors + (fs->bpb.fats * fs->bpb.sectors_per_fat_32);
+    uint32_t total_sectors = fs->bpb.total_sectors_32 ? fs->bpb.total_sectors_32 : fs->bpb.total_sectors_16;
+    fs->cluster_count = fs->bpb.sectors_per_cluster && total_sectors > fs->data_start_sector
+                        ? (total_sectors - fs->data_start_sector) / fs->bpb.sectors_per_cluster : 0;
     
     KINFO("FAT32 Initialized on %s", dev->name);
     KINFO("  Volume Label: %.11s", fs->bpb.vol_label);
@@ -0,0 +1,891 @@
+/*
+ * Page Cache
+ * Every read of disk data goes through whole cached pages. A mapping (a
+ * block device, or a file whose pages sit somewhere on one) indexes its
+ * pages in a radix tree; all pages share one clock ring for eviction,
+ * which runs against a size cap and from the PMM's out-of-memory path.
+ * Dirty pages are written back by a flusher task, or on page_cache_sync().
+ */
+
+#include "kernel.h"
+#include "page_cache.h"
+#include "sync.h"
+
+// ============================================================================
+// CONFIGURATION
+// ============================================================================
+
+#define PCACHE_RADIX_SHIFT    6
+#define PCACHE_RADIX_SLOTS    (1 << PCACHE_RADIX_SHIFT)
+#define PCACHE_RADIX_MASK     (PCACHE_RADIX_SLOTS - 1)
+#define PCACHE_MAX_HEIGHT     9                     // 54 bits of page index
+
+#define PCACHE_SECTORS        (PAGE_SIZE / 512)
+#define PCACHE_MAX_PERCENT    25                    // Of physical memory
+#define PCACHE_BATCH          32                    // Pages read per batch
+#define PCACHE_MAX_BDEVS      8
+
+#define PCACHE_WRITEBACK_US   5000000               // Flusher period
+#define PCACHE_FLUSH_PRIORITY 20
+
+typedef struct radix_node {
+    void* slots[PCACHE_RADIX_SLOTS];
+    uint32_t count;
+} radix_node_t;
+
+// ============================================================================
+// STATE
+// ============================================================================
+
+static spinlock_t lru_lock = SPINLOCK_INIT;   // Clock ring, dirty list, counters
+static cached_page_t* clock_hand = NULL;
+static cached_page_t* dirty_list = NULL;
+static size_t cached_pages = 0;
+static size_t dirty_pages = 0;
+static size_t max_cached_pages = 0;
+
+static wait_queue_t page_wq = WAIT_QUEUE_INIT; // PCACHE_LOCKED cleared
+
+static page_mapping_t bdev_mappings[PCACHE_MAX_BDEVS];
+static spinlock_t bdev_lock = SPINLOCK_INIT;
+
+static size_t cache_hits = 0;
+static size_t cache_misses = 0;
+static size_t cache_evictions = 0;
+static size_t cache_writebacks = 0;
+static size_t cache_io_errors = 0;
+static size_t ra_windows = 0;          // Readahead windows started
+static size_t ra_pages = 0;            // Pages read ahead of the reader
+static size_t ra_collapses = 0;        // Windows dropped on a random access
+
+// ============================================================================
+// RADIX TREE (mapping->lock held)
+// ============================================================================
+
+static uint64_t radix_capacity(uint32_t height)
+{
+    return height >= PCACHE_MAX_HEIGHT ? ~0ULL : 1ULL << (height * PCACHE_RADIX_SHIFT);
+}
+
+static cached_page_t* radix_lookup(page_mapping_t* m, uint64_t index)
+{
+    if (!m->root || index >= radix_capacity(m->height)) return NULL;
+
+    radix_node_t* node = m->root;
+    for (int shift = (m->height - 1) * PCACHE_RADIX_SHIFT; ; shift -= PCACHE_RADIX_SHIFT) {
+        void* next = node->slots[(index >> shift) & PCACHE_RADIX_MASK];
+        if (shift == 0) return (cached_page_t*)next;
+        if (!next) return NULL;
+        node = next;
+    }
+}
+
+static int radix_insert(page_mapping_t* m, uint64_t index, cached_page_t* page)
+{
+    // Grow until the index fits; the old root becomes slot 0
+    while (!m->root || index >= radix_capacity(m->height)) {
+        radix_node_t* node = kmalloc(sizeof(radix_node_t));
+        if (!node) return -1;
+        if (m->root) {
+            node->slots[0] = m->root;
+            node->count = 1;
+        }
+        m->root = node;
+        m->height++;
+    }
+
+    radix_node_t* node = m->root;
+    for (int shift = (m->height - 1) * PCACHE_RADIX_SHIFT; shift > 0; shift -= PCACHE_RADIX_SHIFT) {
+        void** slot = &node->slots[(index >> shift) & PCACHE_RADIX_MASK];
+        if (!*slot) {
+            *slot = kmalloc(sizeof(radix_node_t));
+            if (!*slot) return -1;
+            node->count++;
+        }
+        node = *slot;
+    }
+    node->slots[index & PCACHE_RADIX_MASK] = page;
+    node->count++;
+    m->nr_pages++;
+    return 0;
+}
+
+static void radix_node_free_rcu(rcu_head_t* head)
+{
+    kfree(head);  // At the start of the node's slots, so the node itself
+}
+
+// An empty node's slots are all NULL, so one can hold the rcu_head
+static void radix_node_free(radix_node_t* node, bool deferred)
+{
+    if (deferred) {
+        call_rcu((rcu_head_t*)node->slots, radix_node_free_rcu);
+    } else {
+        kfree(node);
+    }
+}
+
+// Clear index, freeing nodes that end up empty (deferred: from the rcu task)
+static void radix_delete(page_mapping_t* m, uint64_t index, bool deferred)
+{
+    radix_node_t* path[PCACHE_MAX_HEIGHT];
+    radix_node_t* node = m->root;
+    int depth = 0;
+    for (int shift = (m->height - 1) * PCACHE_RADIX_SHIFT; shift > 0; shift -= PCACHE_RADIX_SHIFT) {
+        path[depth++] = node;
+        node = node->slots[(index >> shift) & PCACHE_RADIX_MASK];
+    }
+    node->slots[index & PCACHE_RADIX_MASK] = NULL;
+    m->nr_pages--;
+
+    for (int shift = 0; --node->count == 0 && depth > 0; shift += PCACHE_RADIX_SHIFT) {
+        radix_node_free(node, deferred);
+        node = path[--depth];
+        node->slots[(index >> (shift + PCACHE_RADIX_SHIFT)) & PCACHE_RADIX_MASK] = NULL;
+    }
+    if (m->root && ((radix_node_t*)m->root)->count == 0) {
+        radix_node_free(m->root, deferred);
+        m->root = NULL;
+        m->height = 0;
+    }
+}
+
+// Collect up to max pages at or after *index; returns how many
+static size_t radix_gather(radix_node_t* node, int shift, uint64_t base, uint64_t* index,
+                           cached_page_t** out, size_t max)
+{
+    size_t n = 0;
+    uint64_t span = 1ULL << shift;
+    for (int i = 0; i < PCACHE_RADIX_SLOTS && n < max; i++) {
+        uint64_t start = base + i * span;
+        if (!node->slots[i] || start + span <= *index) continue;
+        if (shift == 0) {
+            out[n++] = node->slots[i];
+            *index = start + 1;
+        } else {
+            n += radix_gather(node->slots[i], shift - PCACHE_RADIX_SHIFT, start, index,
+                              out + n, max - n);
+        }
+    }
+    return n;
+}
+
+// ============================================================================
+// CLOCK RING AND EVICTION
+// ============================================================================
+
+static void lru_add(cached_page_t* page)
+{
+    uint64_t flags = spin_lock_irqsave(&lru_lock);
+    if (!clock_hand) {
+        page->lru_prev = page->lru_next = page;
+        clock_hand = page;
+    } else {
+        // Just behind the hand: the last page it will reach
+        page->lru_next = clock_hand;
+        page->lru_prev = clock_hand->lru_prev;
+        clock_hand->lru_prev->lru_next = page;
+        clock_hand->lru_prev = page;
+    }
+    cached_pages++;
+    spin_unlock_irqrestore(&lru_lock, flags);
+}
+
+// lru_lock held
+static void lru_remove(cached_page_t* page)
+{
+    if (page->lru_next == page) {
+        clock_hand = NULL;
+    } else {
+        page->lru_prev->lru_next = page->lru_next;
+        page->lru_next->lru_prev = page->lru_prev;
+        if (clock_hand == page) clock_hand = page->lru_next;
+    }
+    cached_pages--;
+}
+
+// A frame still mapped into a process (see vmm_file_fault) outlives the entry
+static void page_free(cached_page_t* page)
+{
+    pmm_page_unref((uintptr_t)page->data, 1);
+    kfree(page);
+}
+
+static void page_free_rcu(rcu_head_t* head)
+{
+    kfree((char*)head - __builtin_offsetof(cached_page_t, rcu));
+}
+
+/*
+ * Advance the clock over up to twice the ring, giving referenced pages a
+ * second chance and dropping clean, idle ones; dirty pages wait for the
+ * flusher. The PMM calls in from its out-of-memory path, which may hold
+ * any lock (the heap's included), so the cache locks are only tried. The
+ * frames go back to the PMM at once; the structures that tracked them are
+ * freed from the rcu task.
+ */
+static size_t pcache_evict(size_t want)
+{
+    cached_page_t* victims = NULL;
+    size_t freed = 0;
+
+    uint64_t flags = irq_save();
+    if (!spin_trylock(&lru_lock)) {
+        irq_restore(flags);
+        return 0;
+    }
+
+    size_t budget = cached_pages * 2;
+    while (clock_hand && freed < want && budget-- > 0) {
+        cached_page_t* page = clock_hand;
+        clock_hand = page->lru_next;
+
+        if (page->users || (page->flags & (PCACHE_DIRTY | PCACHE_LOCKED))) continue;
+        if (page->flags & PCACHE_REFERENCED) {
+            __atomic_and_fetch(&page->flags, ~PCACHE_REFERENCED, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Pins are taken under the mapping lock, so users stays 0 while held
+        page_mapping_t* m = page->mapping;
+        if (!spin_trylock(&m->lock)) continue;
+        if (page->users) {
+            spin_unlock(&m->lock);
+            continue;
+        }
+        radix_delete(m, page->index, true);
+        spin_unlock(&m->lock);
+
+        lru_remove(page);
+        page->lru_next = victims;
+        victims = page;
+        freed++;
+    }
+    cache_evictions += freed;
+    spin_unlock_irqrestore(&lru_lock, flags);
+
+    while (victims) {
+        cached_page_t* next = victims->lru_next;
+        pmm_page_unref((uintptr_t)victims->data, 1);
+        call_rcu(&victims->rcu, page_free_rcu);
+        victims = next;
+    }
+    return freed;
+}
+
+// Memory pressure hook for the PMM; returns pages released
+size_t page_cache_shrink(size_t pages)
+{
+    return pcache_evict(pages);
+}
+
+// ============================================================================
+// PAGE LOOKUP AND I/O
+// ============================================================================
+
+static void page_wait_unlocked(cached_page_t* page)
+{
+    wait_entry_t wait;
+    for (;;) {
+        wait_prepare(&page_wq, &wait);
+        if (!(page->flags & PCACHE_LOCKED)) break;
+        wait_schedule(&wait, WAIT_FOREVER);
+    }
+    wait_finish(&wait);
+}
+
+// Take PCACHE_LOCKED for ourselves, waiting out whoever holds it
+static void page_lock(cached_page_t* page)
+{
+    for (;;) {
+        page_wait_unlocked(page);
+        if (!(__atomic_fetch_or(&page->flags, PCACHE_LOCKED, __ATOMIC_ACQUIRE) & PCACHE_LOCKED)) {
+            return;
+        }
+    }
+}
+
+static void page_unlock(cached_page_t* page)
+{
+    __atomic_and_fetch(&page->flags, ~PCACHE_LOCKED, __ATOMIC_RELEASE);
+    wake_up(&page_wq);
+}
+
+// Pinned page at index; *created if the caller now owns its first read
+static cached_page_t* page_find_or_create(page_mapping_t* m, uint64_t index, bool* created)
+{
+    *created = false;
+
+    uint64_t flags = spin_lock_irqsave(&m->lock);
+    cached_page_t* page = radix_lookup(m, index);
+    if (page) {
+        __atomic_add_fetch(&page->users, 1, __ATOMIC_RELAXED);
+        __atomic_or_fetch(&page->flags, PCACHE_REFERENCED, __ATOMIC_RELAXED);
+        spin_unlock_irqrestore(&m->lock, flags);
+        cache_hits++;
+        return page;
+    }
+    spin_unlock_irqrestore(&m->lock, flags);
+
+    if (max_cached_pages && cached_pages >= max_cached_pages) {
+        pcache_evict(1);
+    }
+
+    cached_page_t* fresh = kmalloc(sizeof(cached_page_t));
+    uintptr_t data = fresh ? pmm_alloc_pages(1) : 0;
+    if (!data) {
+        kfree(fresh);
+        return NULL;
+    }
+    fresh->mapping = m;
+    fresh->index = index;
+    fresh->data = (uint8_t*)data;
+    fresh->flags = PCACHE_LOCKED;
+    fresh->users = 1;
+
+    flags = spin_lock_irqsave(&m->lock);
+    page = radix_lookup(m, index);
+    if (page) {
+        // Lost a race with another reader
+        __atomic_add_fetch(&page->users, 1, __ATOMIC_RELAXED);
+        spin_unlock_irqrestore(&m->lock, flags);
+        page_free(fresh);
+        cache_hits++;
+        return page;
+    }
+    if (radix_insert(m, index, fresh) < 0) {
+        spin_unlock_irqrestore(&m->lock, flags);
+        page_free(fresh);
+        return NULL;
+    }
+    spin_unlock_irqrestore(&m->lock, flags);
+
+    lru_add(fresh);
+    cache_misses++;
+    *created = true;
+    return fresh;
+}
+
+// Sectors backing the page: the device itself, or the file's map()
+static uint32_t page_backing(cached_page_t* page, uint64_t* sector, bool allocate)
+{
+    page_mapping_t* m = page->mapping;
+    if (m->map) return m->map(m, page->index, sector, allocate);
+
+    *sector = page->index * PCACHE_SECTORS;
+    uint64_t total = m->dev->total_sectors;
+    if (total && *sector >= total) return 0;
+    return total && total - *sector < PCACHE_SECTORS ? (uint32_t)(total - *sector) : PCACHE_SECTORS;
+}
+
+static void page_read_end_io(bio_t* bio)
+{
+    cached_page_t* page = (cached_page_t*)bio->private_data;
+    if (bio->status == 0) {
+        __atomic_or_fetch(&page->flags, PCACHE_UPTODATE, __ATOMIC_RELAXED);
+    } else {
+        __atomic_or_fetch(&page->flags, PCACHE_ERROR, __ATOMIC_RELAXED);
+        cache_io_errors++;
+    }
+    page_unlock(page);
+}
+
+// Prepare the read of a locked page: holes and the tail past the end of the
+// backing are zeroed here; returns false if no I/O is needed
+static bool page_prepare_read(cached_page_t* page)
+{
+    uint64_t sector;
+    uint32_t sectors = page_backing(page, &sector, false);
+    if (sectors < PCACHE_SECTORS) {
+        memset(page->data + sectors * 512, 0, (PCACHE_SECTORS - sectors) * 512);
+    }
+    if (sectors == 0) {
+        __atomic_or_fetch(&page->flags, PCACHE_UPTODATE, __ATOMIC_RELAXED);
+        page_unlock(page);
+        return false;
+    }
+
+    __atomic_and_fetch(&page->flags, ~PCACHE_ERROR, __ATOMIC_RELAXED);
+    memset(&page->bio, 0, sizeof(bio_t));
+    page->bio.sector = sector;
+    page->bio.count = sectors;
+    page->bio.buffer = page->data;
+    page->bio.end_io = page_read_end_io;
+    page->bio.private_data = page;
+    return true;
+}
+
+static void page_submit(cached_page_t* page)
+{
+    if (block_submit_bio(page->mapping->dev, &page->bio) < 0) {
+        page->bio.status = -1;
+        page->bio.end_io(&page->bio);
+    }
+}
+
+// A page that failed before gets another read once nobody else is on it
+static bool page_relock_for_read(cached_page_t* page)
+{
+    uint32_t old = __atomic_fetch_or(&page->flags, PCACHE_LOCKED, __ATOMIC_ACQUIRE);
+    if (old & PCACHE_LOCKED) return false;
+    if (old & PCACHE_UPTODATE) {
+        page_unlock(page);
+        return false;
+    }
+    return true;
+}
+
+cached_page_t* page_cache_get(page_mapping_t* mapping, uint64_t index)
+{
+    bool created;
+    cached_page_t* page = page_find_or_create(mapping, index, &created);
+    if (!page) return NULL;
+
+    if (!(page->flags & PCACHE_UPTODATE) && (created || page_relock_for_read(page))) {
+        if (page_prepare_read(page)) page_submit(page);
+    }
+    page_wait_unlocked(page);
+
+    if (!(page->flags & PCACHE_UPTODATE)) {
+        page_cache_put(page);
+        return NULL;
+    }
+    return page;
+}
+
+void page_cache_put(cached_page_t* page)
+{
+    __atomic_sub_fetch(&page->users, 1, __ATOMIC_RELEASE);
+}
+
+// Eviction only takes pages at zero users, so an existing pin makes this
+// safe without the mapping lock
+void page_cache_hold(cached_page_t* page)
+{
+    __atomic_add_fetch(&page->users, 1, __ATOMIC_RELAXED);
+}
+
+void page_cache_mark_dirty(cached_page_t* page)
+{
+    uint64_t flags = spin_lock_irqsave(&lru_lock);
+    if (!(page->flags & PCACHE_DIRTY)) {
+        __atomic_or_fetch(&page->flags, PCACHE_DIRTY, __ATOMIC_RELAXED);
+        page->dirty_next = dirty_list;
+        dirty_list = page;
+        dirty_pages++;
+        page->mapping->nr_dirty++;
+    }
+    spin_unlock_irqrestore(&lru_lock, flags);
+}
+
+// ============================================================================
+// RANGE COPIES
+// ============================================================================
+
+/*
+ * Pin a run of pages and read every missing one as a single plugged batch,
+ * so consecutive misses reach the disk as merged requests. map() may do
+ * I/O of its own, so backing is looked up before plugging.
+ */
+static int page_cache_pin_range(page_mapping_t* m, uint64_t first, size_t count,
+                                cached_page_t** pages)
+{
+    bool reading[PCACHE_BATCH];
+    size_t pinned = 0;
+    int status = 0;
+
+    for (; pinned < count; pinned++) {
+        bool created;
+        pages[pinned] = page_find_or_create(m, first + pinned, &created);
+        if (!pages[pinned]) {
+            status = -1;
+            break;
+        }
+        cached_page_t* page = pages[pinned];
+        reading[pinned] = false;
+        if (!(page->flags & PCACHE_UPTODATE) && (created || page_relock_for_read(page))) {
+            reading[pinned] = page_prepare_read(page);
+        }
+    }
+
+    block_plug(m->dev);
+    for (size_t i = 0; i < pinned; i++) {
+        if (reading[i]) page_submit(pages[i]);
+    }
+    block_unplug(m->dev);
+
+    for (size_t i = 0; i < pinned; i++) {
+        page_wait_unlocked(pages[i]);
+        if (!(pages[i]->flags & PCACHE_UPTODATE)) status = -1;
+    }
+    if (status < 0) {
+        for (size_t i = 0; i < pinned; i++) page_cache_put(pages[i]);
+    }
+    return status;
+}
+
+int page_cache_read(page_mapping_t* mapping, uint64_t offset, void* buffer, size_t size)
+{
+    uint8_t* out = (uint8_t*)buffer;
+    while (size > 0) {
+        uint64_t first = offset / PAGE_SIZE;
+        uint64_t last = (offset + size - 1) / PAGE_SIZE;
+        size_t count = last - first + 1;
+        if (count > PCACHE_BATCH) count = PCACHE_BATCH;
+
+        cached_page_t* pages[PCACHE_BATCH];
+        if (page_cache_pin_range(mapping, first, count, pages) < 0) return -1;
+
+        for (size_t i = 0; i < count; i++) {
+            size_t in_page = offset & (PAGE_SIZE - 1);
+            size_t len = PAGE_SIZE - in_page;
+            if (len > size) len = size;
+            memcpy(out, pages[i]->data + in_page, len);
+            page_cache_put(pages[i]);
+            out += len;
+            offset += len;
+            size -= len;
+        }
+    }
+    return 0;
+}
+
+int page_cache_write(page_mapping_t* mapping, uint64_t offset, const void* buffer, size_t size)
+{
+    const uint8_t* in = (const uint8_t*)buffer;
+    while (size > 0) {
+        size_t in_page = offset & (PAGE_SIZE - 1);
+        size_t len = PAGE_SIZE - in_page;
+        if (len > size) len = size;
+
+        cached_page_t* page;
+        if (len == PAGE_SIZE) {
+            // Whole page replaced: a new page needs no read first
+            bool created;
+            page = page_find_or_create(mapping, offset / PAGE_SIZE, &created);
+            if (!page) return -1;
+            if (created) {
+                memcpy(page->data, in, len);
+                __atomic_or_fetch(&page->flags, PCACHE_UPTODATE, __ATOMIC_RELAXED);
+                page_unlock(page);
+            } else {
+                page_wait_unlocked(page);
+                memcpy(page->data, in, len);
+                __atomic_or_fetch(&page->flags, PCACHE_UPTODATE, __ATOMIC_RELAXED);
+            }
+        } else {
+            page = page_cache_get(mapping, offset / PAGE_SIZE);
+            if (!page) return -1;
+            memcpy(page->data + in_page, in, len);
+        }
+        page_cache_mark_dirty(page);
+        page_cache_put(page);
+
+        in += len;
+        offset += len;
+        size -= len;
+    }
+    return 0;
+}
+
+// ============================================================================
+// READAHEAD
+// ============================================================================
+
+/*
+ * A read is sequential if it continues from the last page touched or lands
+ * inside the current window. The first sequential read opens a window of
+ * four times its size just past it; entering the window's async part opens
+ * the next one, twice as large up to the ceiling, so the disk keeps
+ * working ahead of the reader. A random read collapses the window.
+ */
+bool page_cache_ra_advance(struct file_ra_state* ra, uint64_t index, uint32_t count,
+                           uint64_t* start, uint32_t* pages)
+{
+    uint64_t last = index + (count ? count : 1) - 1;
+    uint32_t max = ra->max_pages ? ra->max_pages : RA_MAX_PAGES;
+    bool sequential = index == ra->prev_index || index == ra->prev_index + 1 ||
+                      (ra->size && index >= ra->start && index < ra->start + ra->size);
+    ra->prev_index = last;
+
+    if (!sequential) {
+        if (ra->size) ra_collapses++;
+        ra->size = 0;
+        ra->async_size = 0;
+        return false;
+    }
+
+    if (ra->size == 0) {
+        uint32_t size = count * 4;
+        ra->start = last + 1;
+        ra->size = size < RA_MIN_PAGES ? RA_MIN_PAGES : size > max ? max : size;
+        ra->async_size = ra->size / 2;
+    } else if (last >= ra->start + ra->size - ra->async_size) {
+        uint32_t size = ra->size * 2 > max ? max : ra->size * 2;
+        uint64_t next = ra->start + ra->size;
+        ra->start = next > last ? next : last + 1;  // A big read can outrun the window
+        ra->size = size;
+        ra->async_size = size;
+    } else {
+        return false;
+    }
+
+    ra_windows++;
+    *start = ra->start;
+    *pages = ra->size;
+    return true;
+}
+
+void page_cache_readahead(page_mapping_t* mapping, uint64_t index, size_t count)
+{
+    while (count > 0) {
+        size_t n = count > PCACHE_BATCH ? PCACHE_BATCH : count;
+        cached_page_t* pages[PCACHE_BATCH];
+        bool reading[PCACHE_BATCH];
+
+        // Stop early rather than evict what the reader is about to use
+        size_t pinned = 0;
+        for (; pinned < n; pinned++) {
+            if (max_cached_pages && cached_pages >= max_cached_pages) break;
+            bool created;
+            pages[pinned] = page_find_or_create(mapping, index + pinned, &created);
+            if (!pages[pinned]) break;
+            reading[pinned] = created && page_prepare_read(pages[pinned]);
+        }
+
+        block_plug(mapping->dev);
+        for (size_t i = 0; i < pinned; i++) {
+            if (reading[i]) {
+                page_submit(pages[i]);
+                ra_pages++;
+            }
+        }
+        block_unplug(mapping->dev);
+
+        // The lock bit keeps pages being read in place; no pin needed
+        for (size_t i = 0; i < pinned; i++) {
+            page_cache_put(pages[i]);
+        }
+        if (pinned < n) return;
+        index += n;
+        count -= n;
+    }
+}
+
+ssize_t page_cache_file_read(struct file* file, page_mapping_t* mapping, uint64_t i_size,
+                             char* buffer, size_t count, loff_t* pos)
+{
+    uint64_t offset = (uint64_t)*pos;
+    if (offset >= i_size) return 0;
+    if (count > i_size - offset) count = i_size - offset;
+    if (count == 0) return 0;
+
+    uint64_t first = offset / PAGE_SIZE;
+    uint32_t pages = (uint32_t)((offset + count - 1) / PAGE_SIZE - first + 1);
+    uint64_t ra_start;
+    uint32_t ra_count;
+    bool ahead = page_cache_ra_advance(&file->f_ra, first, pages, &ra_start, &ra_count);
+
+    if (page_cache_read(mapping, offset, buffer, count) < 0) return -1;
+
+    // After the demand read, so the window never delays the pages asked for
+    if (ahead) {
+        uint64_t end = (i_size + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (ra_start < end) {
+            page_cache_readahead(mapping, ra_start, ra_start + ra_count > end ? end - ra_start : ra_count);
+        }
+    }
+    *pos += count;
+    return (ssize_t)count;
+}
+
+// ============================================================================
+// WRITEBACK
+// ============================================================================
+
+static void page_write_end_io(bio_t* bio)
+{
+    cached_page_t* page = (cached_page_t*)bio->private_data;
+    if (bio->status < 0) {
+        cache_io_errors++;
+        __atomic_or_fetch(&page->flags, PCACHE_ERROR, __ATOMIC_RELAXED);
+        page_cache_mark_dirty(page);  // Keep it for the next pass
+    } else {
+        __atomic_and_fetch(&page->flags, ~PCACHE_ERROR, __ATOMIC_RELAXED);
+    }
+    page_unlock(page);
+}
+
+/*
+ * Write back dirty pages (of one mapping, or all), waiting for them. A page
+ * redirtied while its write is in flight goes back on the list for the
+ * next pass.
+ */
+int page_cache_sync(page_mapping_t* mapping)
+{
+    // Take the matching pages off the dirty list, pinned
+    cached_page_t* list = NULL;
+    uint64_t flags = spin_lock_irqsave(&lru_lock);
+    cached_page_t** link = &dirty_list;
+    while (*link) {
+        cached_page_t* page = *link;
+        if (mapping && page->mapping != mapping) {
+            link = &page->dirty_next;
+            continue;
+        }
+        *link = page->dirty_next;
+        __atomic_add_fetch(&page->users, 1, __ATOMIC_RELAXED);
+        page->dirty_next = list;
+        list = page;
+    }
+    spin_unlock_irqrestore(&lru_lock, flags);
+
+    int status = 0;
+    while (list) {
+        // Batches: backing first (may read, or allocate and dirty metadata
+        // pages of this very batch), then the locks and one plugged submit
+        cached_page_t* batch[PCACHE_BATCH];
+        uint64_t sector[PCACHE_BATCH];
+        uint32_t sectors[PCACHE_BATCH];
+        size_t n = 0;
+        for (; list && n < PCACHE_BATCH; list = list->dirty_next) {
+            batch[n++] = list;
+        }
+        for (size_t i = 0; i < n; i++) {
+            sectors[i] = page_backing(batch[i], &sector[i], true);
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            cached_page_t* page = batch[i];
+            page_lock(page);
+
+            flags = spin_lock_irqsave(&lru_lock);
+            __atomic_and_fetch(&page->flags, ~PCACHE_DIRTY, __ATOMIC_RELAXED);
+            dirty_pages--;
+            page->mapping->nr_dirty--;
+            spin_unlock_irqrestore(&lru_lock, flags);
+
+            memset(&page->bio, 0, sizeof(bio_t));
+            page->bio.sector = sector[i];
+            page->bio.count = sectors[i];
+            page->bio.buffer = page->data;
+            page->bio.write = true;
+            page->bio.end_io = page_write_end_io;
+            page->bio.private_data = page;
+        }
+
+        block_device_t* plugged = batch[0]->mapping->dev;
+        block_plug(plugged);
+        for (size_t i = 0; i < n; i++) {
+            if (batch[i]->bio.count == 0) {
+                page_unlock(batch[i]);  // Hole: nothing on disk to write
+                continue;
+            }
+            page_submit(batch[i]);
+            cache_writebacks++;
+        }
+        block_unplug(plugged);
+
+        for (size_t i = 0; i < n; i++) {
+            page_wait_unlocked(batch[i]);
+            if (batch[i]->flags & PCACHE_ERROR) status = -1;
+            page_cache_put(batch[i]);
+        }
+    }
+    return status;
+}
+
+static void page_cache_flusher(void* arg)
+{
+    (void)arg;
+    for (;;) {
+        scheduler_sleep_us(PCACHE_WRITEBACK_US);
+        if (dirty_pages) {
+            page_cache_sync(NULL);
+        }
+    }
+}
+
+// ============================================================================
+// MAPPINGS
+// ============================================================================
+
+void page_mapping_init(page_mapping_t* mapping, block_device_t* dev, pcache_map_fn map, void* host)
+{
+    memset(mapping, 0, sizeof(*mapping));
+    mapping->dev = dev;
+    mapping->map = map;
+    mapping->host = host;
+}
+
+page_mapping_t* page_cache_bdev(block_device_t* dev)
+{
+    page_mapping_t* found = NULL;
+    uint64_t flags = spin_lock_irqsave(&bdev_lock);
+    for (int i = 0; i < PCACHE_MAX_BDEVS && !found; i++) {
+        if (bdev_mappings[i].dev == dev) {
+            found = &bdev_mappings[i];
+        } else if (!bdev_mappings[i].dev) {
+            page_mapping_init(&bdev_mappings[i], dev, NULL, NULL);
+            found = &bdev_mappings[i];
+        }
+    }
+    spin_unlock_irqrestore(&bdev_lock, flags);
+    return found;
+}
+
+// Write back and drop every page; nobody may be using the mapping
+void page_cache_release_mapping(page_mapping_t* mapping)
+{
+    page_cache_sync(mapping);
+
+    cached_page_t* batch[PCACHE_BATCH];
+    size_t n;
+    do {
+        uint64_t index = 0;
+        uint64_t flags = spin_lock_irqsave(&mapping->lock);
+        n = mapping->root ? radix_gather(mapping->root, (mapping->height - 1) * PCACHE_RADIX_SHIFT,
+                                         0, &index, batch, PCACHE_BATCH) : 0;
+        for (size_t i = 0; i < n; i++) {
+            radix_delete(mapping, batch[i]->index, false);
+        }
+        spin_unlock_irqrestore(&mapping->lock, flags);
+
+        for (size_t i = 0; i < n; i++) {
+            page_wait_unlocked(batch[i]);
+            while (__atomic_load_n(&batch[i]->users, __ATOMIC_ACQUIRE) > 0) {
+                scheduler_yield();  // A writeback that raced us is finishing with it
+            }
+            flags = spin_lock_irqsave(&lru_lock);
+            lru_remove(batch[i]);
+            spin_unlock_irqrestore(&lru_lock, flags);
+            page_free(batch[i]);
+        }
+    } while (n > 0);
+}
+
+// ============================================================================
+// INITIALIZATION AND STATISTICS
+// ============================================================================
+
+void page_cache_init(void)
+{
+    max_cached_pages = pmm_get_total_pages() * PCACHE_MAX_PERCENT / 100;
+
+    if (scheduler_create_task(page_cache_flusher, NULL, 8192, PCACHE_FLUSH_PRIORITY,
+                              "pgflush") < 0) {
+        KWARN("Page cache: No writeback task, dirty pages wait for page_cache_sync()");
+    }
+    KINFO("Page cache: up to %lu pages, writeback every %d ms", max_cached_pages,
+          PCACHE_WRITEBACK_US / 1000);
+}
+
+void page_cache_get_stats(void)
+{
+    KINFO("=== Page Cache Statistics ===");
+    KINFO("Cached pages: %lu / %lu (%lu dirty)", cached_pages, max_cached_pages, dirty_pages);
+    KINFO("Hits: %lu, misses: %lu", cache_hits, cache_misses);
+    KINFO("Evictions: %lu, writebacks: %lu, I/O errors: %lu", cache_evictions,
+          cache_writebacks, cache_io_errors);
+    KINFO("Readahead: %lu windows, %lu pages, %lu collapsed", ra_windows, ra_pages, ra_collapses);
+}
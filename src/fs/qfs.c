@@ -1,9 +1,9 @@
 /*
  * Quantum Filesystem (QFS) - Adaptive Block Allocation
- * 
+ *
  * Innovation: Unlike traditional filesystems with fixed block sizes,
  * QFS adapts block allocation based on file access patterns and workload.
- * 
+ *
  * Features:
  * - Probabilistic caching based on access patterns
  * - Adaptive block sizes (1KB to 64KB)
@@ -15,22 +15,37 @@
  */
 
 #include "kernel.h"
+#include "drivers/block.h"
+#include "page_cache.h"
 
 // ============================================================================
 // CONFIGURATION
 // ============================================================================
 
 #define QFS_MAGIC 0x51465321  // "QFS!"
-#define QFS_VERSION 1
+#define QFS_VERSION 3
 
 // Block sizes (adaptive)
 #define MIN_BLOCK_SIZE 1024    // 1KB minimum
 #define MAX_BLOCK_SIZE 65536   // 64KB maximum
 #define DEFAULT_BLOCK_SIZE 4096 // 4KB default
 
+// On-disk unit: one page cache page, so block n is page n of the device
+#define QFS_BLOCK_SIZE 4096
+#define QFS_SECTORS_PER_BLOCK (QFS_BLOCK_SIZE / 512)
+#define QFS_MAX_BLOCKS 65536         // 256MB
+#define QFS_RAMDISK_BLOCKS 16384     // 64MB when there is no disk for QFS
+#define QFS_DEVICE "sata1"           // sata0 holds the FAT32 root
+#define QFS_METADATA_RESERVE 64      // Blocks writes can't reserve (tree nodes)
+#define QFS_MAX_FILE_SIZE (0xFFFFFFFFULL * QFS_BLOCK_SIZE)
+
 // Inode configuration
-#define INODES_PER_BLOCK 128
-#define MAX_EXTENT_COUNT 4      // Extents per inode
+#define QFS_INODE_SIZE 128
+#define INODES_PER_BLOCK (QFS_BLOCK_SIZE / QFS_INODE_SIZE)
+
+// Extent tree: the root lives in the inode, further nodes are blocks
+#define QFS_EXTENT_MAGIC 0xE7F5
+#define QFS_INLINE_EXTENTS 4    // Root capacity as a leaf
 
 // Access pattern thresholds
 #define SEQUENTIAL_THRESHOLD 80  // % sequential for large blocks
@@ -39,6 +54,14 @@
 
 // Journal configuration
 #define JOURNAL_BLOCKS 1024     // Journal size in blocks
+#define QFS_JOURNAL_MAGIC 0x4C4E4A51  // "QJNL"
+#define QFS_JOURNAL_SUPER 1     // Journal block 0: where replay starts
+#define QFS_JOURNAL_DESC 2      // Transaction start, home block of each logged block
+#define QFS_JOURNAL_COMMIT 3    // Transaction end, checksum of the above
+#define QFS_JOURNAL_TAGS ((QFS_BLOCK_SIZE - sizeof(qfs_journal_header_t)) / sizeof(uint32_t))
+#define QFS_TRANSACTION_SOFT 256      // Commit early past this many blocks
+#define QFS_COMMIT_INTERVAL_US 5000000
+#define QFS_JOURNAL_PRIORITY 20
 
 // ============================================================================
 // DATA STRUCTURES
@@ -63,15 +86,46 @@ typedef struct {
     uint16_t max_mount_count;    // Max mounts before fsck
     uint32_t state;              // Clean/dirty state
     char volume_name[32];        // Volume label
+    uint32_t block_bitmap_start; // Block number
+    uint32_t inode_bitmap_start; // Block number
 } qfs_superblock_t;
 
-// Extent - represents contiguous blocks
+// Extent - file blocks [file_block, +length) at contiguous disk blocks
 typedef struct {
+    uint32_t file_block;         // First block within the file
     uint32_t start_block;        // Starting block number
-    uint16_t length;             // Number of blocks
-    uint16_t reserved;
+    uint32_t length;             // Number of blocks
 } qfs_extent_t;
 
+// Extent tree node; entries follow the header, qfs_extent_t in leaves
+// (depth 0) and qfs_extent_index_t above, sorted by file_block
+typedef struct {
+    uint16_t magic;              // QFS_EXTENT_MAGIC
+    uint16_t entries;
+    uint16_t max;
+    uint16_t depth;
+} qfs_extent_header_t;
+
+typedef struct {
+    uint32_t file_block;         // Lowest file block under child
+    uint32_t child;              // Node block
+} qfs_extent_index_t;
+
+typedef struct {
+    qfs_extent_header_t header;
+    qfs_extent_t entries[QFS_INLINE_EXTENTS];
+} qfs_extent_root_t;
+
+#define QFS_NODE_LEAF_MAX  ((QFS_BLOCK_SIZE - sizeof(qfs_extent_header_t)) / sizeof(qfs_extent_t))
+#define QFS_NODE_INDEX_MAX ((QFS_BLOCK_SIZE - sizeof(qfs_extent_header_t)) / sizeof(qfs_extent_index_t))
+#define QFS_ROOT_INDEX_MAX (sizeof(((qfs_extent_root_t*)0)->entries) / (sizeof(qfs_extent_index_t)))
+
+// Blocks written but not allocated yet (delayed allocation)
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} qfs_range_t;
+
 // Access pattern tracking
 typedef struct {
     uint32_t sequential_reads;   // Sequential read count
@@ -79,10 +133,28 @@ typedef struct {
     uint32_t sequential_writes;  // Sequential write count
     uint32_t random_writes;      // Random write count
     uint64_t last_access;        // Last access time
+    uint64_t next_offset;        // Where a sequential access would continue
     uint32_t access_count;       // Total accesses
     uint32_t preferred_block_size; // Calculated optimal block size
 } access_pattern_t;
 
+// Inode as stored in the inode table
+typedef struct {
+    uint16_t mode;
+    uint16_t uid;
+    uint16_t gid;
+    uint16_t reserved;
+    uint32_t link_count;
+    uint32_t reserved2;
+    uint64_t size;
+    uint64_t blocks;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    qfs_extent_root_t extents;
+    uint8_t reserved3[16];
+} __attribute__((packed)) qfs_dinode_t;
+
 // Inode - file/directory metadata
 typedef struct {
     uint32_t ino;                // Inode number
@@ -91,24 +163,34 @@ typedef struct {
     uint16_t gid;                // Owner group ID
     uint16_t reserved;
     uint64_t size;               // File size in bytes
-    uint64_t blocks;             // Blocks allocated
+    uint64_t blocks;             // Blocks allocated (data and tree nodes)
     uint64_t atime;              // Access time
     uint64_t mtime;              // Modification time
     uint64_t ctime;              // Change time
-    
+
     // Extent-based allocation
-    qfs_extent_t extents[MAX_EXTENT_COUNT];
-    
+    qfs_extent_root_t extents;   // B+tree root
+    qfs_range_t* delalloc;       // Sorted, disjoint
+    uint32_t delalloc_count;
+    uint32_t delalloc_capacity;
+
     // Adaptive features
     access_pattern_t pattern;    // Access pattern tracking
     uint32_t coherence_window;   // Cache coherence time (ms)
     uint32_t quantum_state;      // Probabilistic state
-    
+
     // Links and references
     uint32_t link_count;         // Hard link count
     uint32_t reserved2[3];       // Reserved for future use
+
+    // Data path
+    page_mapping_t mapping;      // File blocks in the page cache
+    struct file_ra_state ra;
+    struct inode vfs_inode;      // Reference count, I_DIRTY: newer than the inode table
 } qfs_inode_t;
 
+#define QFS_I(inode) ((qfs_inode_t*)((char*)(inode) - __builtin_offsetof(qfs_inode_t, vfs_inode)))
+
 // Directory entry
 typedef struct {
     uint32_t inode;              // Inode number
@@ -118,14 +200,34 @@ typedef struct {
     char name[255];              // File name
 } __attribute__((packed)) qfs_dirent_t;
 
-// Journal transaction
+// Journal block header. A transaction is a descriptor (header, then the
+// home block number of each logged block), the logged blocks and a commit
+// block, at consecutive journal blocks.
 typedef struct {
-    uint32_t transaction_id;
-    uint32_t block_count;
+    uint32_t magic;              // QFS_JOURNAL_MAGIC
+    uint32_t type;               // QFS_JOURNAL_SUPER / DESC / COMMIT
+    uint32_t transaction_id;     // Super: first transaction to replay
+    uint32_t block_count;        // Logged blocks; super: journal block it starts at
     uint64_t timestamp;
-    uint32_t checksum;
+    uint32_t checksum;           // Commit: CRC32 of the descriptor and logged blocks
+    uint32_t reserved;
 } qfs_journal_header_t;
 
+// A metadata block in a transaction: pinned in the cache from the change
+// until a checkpoint has written it home, and the contents it committed
+typedef struct {
+    uint32_t block;
+    cached_page_t* page;
+    uint8_t* copy;               // One PMM page, taken at commit
+} qfs_jblock_t;
+
+typedef struct {
+    uint32_t tid;
+    qfs_jblock_t* blocks;
+    uint32_t count;
+    uint32_t capacity;
+} qfs_transaction_t;
+
 // ============================================================================
 // GLOBAL STATE
 // ============================================================================
@@ -133,15 +235,68 @@ typedef struct {
 static qfs_superblock_t* qfs_superblock = NULL;
 static uint8_t* block_bitmap = NULL;       // Free block bitmap
 static uint8_t* inode_bitmap = NULL;       // Free inode bitmap
-static qfs_inode_t* inode_cache[256];      // Hot inode cache
+static struct super_block qfs_sb;          // Inodes are cached by the VFS under it
 static uint32_t next_free_inode = 1;
-static uint32_t journal_transaction_id = 0;
+
+static block_device_t* qfs_dev = NULL;
+static page_mapping_t* qfs_cache = NULL;   // Metadata blocks
+static uint32_t reserved_blocks = 0;       // Promised to delayed writes
+
+// Everything above and the inodes; held across metadata I/O, so it sleeps
+static volatile uint32_t qfs_locked = 0;
+static wait_queue_t qfs_wq = WAIT_QUEUE_INIT;
+
+// Journal: metadata changed under the lock joins the running transaction;
+// committed blocks wait in the journal until a checkpoint writes them home.
+// The checkpoint list and journal_head belong to the committer.
+static qfs_transaction_t journal_running;
+static qfs_jblock_t* checkpoint_list = NULL;   // JOURNAL_BLOCKS entries
+static uint32_t checkpoint_count = 0;
+static uint32_t journal_head = 1;              // Next free journal block
+static uint32_t committed_tid = 0;             // Everything up to here is durable
+static volatile bool journal_committing = false;
+static int journal_error = 0;
+static wait_queue_t journal_wq = WAIT_QUEUE_INIT;
+static uint32_t crc32_table[256];
 
 // Statistics
 static uint64_t total_reads = 0;
 static uint64_t total_writes = 0;
 static uint64_t cache_hits = 0;
 static uint64_t block_adaptations = 0;
+static uint64_t delalloc_extents = 0;
+static uint64_t extent_merges = 0;
+static uint64_t tree_splits = 0;
+static uint64_t journal_commits = 0;
+static uint64_t journal_blocks = 0;
+static uint64_t journal_joined = 0;
+static uint64_t journal_checkpoints = 0;
+
+static void qfs_lock(void)
+{
+    wait_entry_t wait;
+    for (;;) {
+        wait_prepare(&qfs_wq, &wait);
+        if (!__atomic_exchange_n(&qfs_locked, 1, __ATOMIC_ACQUIRE)) break;
+        wait_schedule(&wait, WAIT_FOREVER);
+    }
+    wait_finish(&wait);
+}
+
+static void qfs_unlock(void)
+{
+    __atomic_store_n(&qfs_locked, 0, __ATOMIC_RELEASE);
+    wake_up(&qfs_wq);
+}
+
+static void qfs_journal_dirty(cached_page_t* page);
+static void qfs_journal_throttle(void);
+
+// Inode fields changed; lock held
+static inline void qfs_mark_dirty(qfs_inode_t* inode)
+{
+    mark_inode_dirty(&inode->vfs_inode);
+}
 
 // ============================================================================
 // BLOCK ALLOCATION
@@ -153,15 +308,15 @@ static uint32_t qfs_calculate_optimal_block_size(access_pattern_t* pattern)
     if (pattern->access_count == 0) {
         return DEFAULT_BLOCK_SIZE;
     }
-    
-    uint32_t total_accesses = pattern->sequential_reads + 
+
+    uint32_t total_accesses = pattern->sequential_reads +
                              pattern->random_reads +
-                             pattern->sequential_writes + 
+                             pattern->sequential_writes +
                              pattern->random_writes;
-    
+
     uint32_t sequential = pattern->sequential_reads + pattern->sequential_writes;
     uint32_t seq_percent = (sequential * 100) / total_accesses;
-    
+
     // Sequential: use larger blocks
     if (seq_percent > SEQUENTIAL_THRESHOLD) {
         block_adaptations++;
@@ -178,48 +333,51 @@ static uint32_t qfs_calculate_optimal_block_size(access_pattern_t* pattern)
     }
 }
 
-// Allocate contiguous blocks for an extent
-static uint32_t qfs_alloc_extent(uint32_t block_count, qfs_extent_t* extent)
+static inline bool qfs_block_used(uint32_t block)
 {
-    if (!block_bitmap || block_count == 0) return 0;
-    
-    // Find contiguous free blocks
-    uint32_t consecutive = 0;
-    uint32_t start_block = 0;
-    
-    for (uint32_t i = qfs_superblock->data_blocks_start; 
-         i < qfs_superblock->total_blocks; i++) {
-        
-        uint32_t byte = i / 8;
-        uint32_t bit = i % 8;
-        
-        if (!(block_bitmap[byte] & (1 << bit))) {
-            if (consecutive == 0) start_block = i;
-            consecutive++;
-            
-            if (consecutive == block_count) {
-                // Found enough blocks!
-                extent->start_block = start_block;
-                extent->length = block_count;
-                
-                // Mark as allocated
-                for (uint32_t j = start_block; j < start_block + block_count; j++) {
-                    block_bitmap[j / 8] |= (1 << (j % 8));
-                }
-                
-                qfs_superblock->free_blocks -= block_count;
-                
-                KDEBUG("QFS: Allocated extent: start=%u, length=%u", 
-                       start_block, block_count);
-                return start_block;
-            }
-        } else {
-            consecutive = 0;
+    return block_bitmap[block / 8] & (1 << (block % 8));
+}
+
+// Allocate up to want contiguous blocks: the first free run that long from
+// goal on (wrapping round), else the longest one. Returns the first block
+// (0 if the disk is full) and the run length in *got.
+static uint32_t qfs_alloc_blocks(uint32_t goal, uint32_t want, uint32_t* got)
+{
+    uint32_t first = qfs_superblock->data_blocks_start;
+    uint32_t end = qfs_superblock->journal_start;
+    if (goal < first || goal >= end) goal = first;
+
+    uint32_t best = 0, best_length = 0;
+    uint32_t run_start = 0, run = 0;
+    for (uint32_t n = 0; n < end - first && best_length < want; n++) {
+        uint32_t block = goal + n;
+        if (block >= end) block -= end - first;
+        if (block == first) run = 0;  // Runs don't wrap
+
+        if (qfs_block_used(block)) {
+            run = 0;
+            continue;
+        }
+        if (run == 0) run_start = block;
+        run++;
+        if (run > best_length) {
+            best = run_start;
+            best_length = run;
         }
     }
-    
-    KERROR("QFS: Failed to allocate %u contiguous blocks", block_count);
-    return 0;
+    if (best_length == 0) {
+        KERROR("QFS: Out of space");
+        return 0;
+    }
+
+    for (uint32_t j = best; j < best + best_length; j++) {
+        block_bitmap[j / 8] |= (1 << (j % 8));
+    }
+    qfs_superblock->free_blocks -= best_length;
+    *got = best_length;
+
+    KDEBUG("QFS: Allocated extent: start=%u, length=%u", best, best_length);
+    return best;
 }
 
 // Free an extent
@@ -229,10 +387,403 @@ static void qfs_free_extent(qfs_extent_t* extent)
         uint32_t block = extent->start_block + i;
         block_bitmap[block / 8] &= ~(1 << (block % 8));
     }
-    
+
     qfs_superblock->free_blocks += extent->length;
 }
 
+// ============================================================================
+// EXTENT TREE
+// ============================================================================
+
+static inline uint32_t qfs_entry_size(qfs_extent_header_t* node)
+{
+    return node->depth ? sizeof(qfs_extent_index_t) : sizeof(qfs_extent_t);
+}
+
+static inline void* qfs_entry(qfs_extent_header_t* node, uint32_t i)
+{
+    return (uint8_t*)(node + 1) + i * qfs_entry_size(node);
+}
+
+// Both entry kinds start with their file_block
+static inline uint32_t qfs_entry_key(qfs_extent_header_t* node, uint32_t i)
+{
+    return *(uint32_t*)qfs_entry(node, i);
+}
+
+static inline qfs_extent_index_t* qfs_index(qfs_extent_header_t* node, uint32_t i)
+{
+    return (qfs_extent_index_t*)qfs_entry(node, i);
+}
+
+// Last entry with a key <= file_block, -1 if there is none
+static int qfs_node_search(qfs_extent_header_t* node, uint32_t file_block)
+{
+    uint32_t lo = 0, hi = node->entries;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (qfs_entry_key(node, mid) <= file_block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (int)lo - 1;
+}
+
+static void qfs_node_init(qfs_extent_header_t* node, uint16_t depth, uint16_t max)
+{
+    node->magic = QFS_EXTENT_MAGIC;
+    node->entries = 0;
+    node->max = max;
+    node->depth = depth;
+}
+
+// Tree node block through the metadata cache, pinned
+static cached_page_t* qfs_get_node(uint32_t block)
+{
+    cached_page_t* page = page_cache_get(qfs_cache, block);
+    if (page && ((qfs_extent_header_t*)page->data)->magic != QFS_EXTENT_MAGIC) {
+        KERROR("QFS: Bad extent node at block %u", block);
+        page_cache_put(page);
+        return NULL;
+    }
+    return page;
+}
+
+// An empty node block near goal, pinned and dirty
+static cached_page_t* qfs_new_node(qfs_inode_t* inode, uint32_t goal, uint16_t depth,
+                                   uint32_t* block)
+{
+    uint32_t got;
+    *block = qfs_alloc_blocks(goal, 1, &got);
+    if (!*block) return NULL;
+
+    cached_page_t* page = page_cache_get(qfs_cache, *block);
+    if (!page) {
+        qfs_extent_t extent = { 0, *block, 1 };
+        qfs_free_extent(&extent);
+        return NULL;
+    }
+    memset(page->data, 0, QFS_BLOCK_SIZE);
+    qfs_node_init((qfs_extent_header_t*)page->data, depth,
+                  depth ? QFS_NODE_INDEX_MAX : QFS_NODE_LEAF_MAX);
+    qfs_journal_dirty(page);
+    inode->blocks++;
+    return page;
+}
+
+// A node was changed: its block, or the inode if it is the root
+static void qfs_node_dirty(qfs_inode_t* inode, cached_page_t* page)
+{
+    if (page) {
+        qfs_journal_dirty(page);
+    } else {
+        qfs_mark_dirty(inode);
+    }
+}
+
+// Physical block of file_block and how many follow it contiguously in *run;
+// 0 for a hole
+static uint32_t qfs_extent_lookup(qfs_inode_t* inode, uint32_t file_block, uint32_t* run)
+{
+    qfs_extent_header_t* node = &inode->extents.header;
+    cached_page_t* page = NULL;
+    uint32_t block = 0;
+
+    for (;;) {
+        int i = qfs_node_search(node, file_block);
+        if (i < 0) break;
+        if (node->depth == 0) {
+            qfs_extent_t* extent = (qfs_extent_t*)qfs_entry(node, i);
+            uint32_t into = file_block - extent->file_block;
+            if (into < extent->length) {
+                block = extent->start_block + into;
+                *run = extent->length - into;
+            }
+            break;
+        }
+
+        cached_page_t* child = qfs_get_node(qfs_index(node, i)->child);
+        if (page) page_cache_put(page);
+        page = child;
+        if (!page) break;
+        node = (qfs_extent_header_t*)page->data;
+    }
+    if (page) page_cache_put(page);
+    return block;
+}
+
+// The root is full: move it into a block and point the root at that
+static int qfs_tree_grow(qfs_inode_t* inode)
+{
+    qfs_extent_header_t* root = &inode->extents.header;
+    uint32_t block;
+    cached_page_t* page = qfs_new_node(inode, 0, root->depth, &block);
+    if (!page) return -1;
+
+    qfs_extent_header_t* node = (qfs_extent_header_t*)page->data;
+    memcpy(qfs_entry(node, 0), qfs_entry(root, 0), root->entries * qfs_entry_size(root));
+    node->entries = root->entries;
+    uint32_t key = root->entries ? qfs_entry_key(root, 0) : 0;
+    page_cache_put(page);
+
+    qfs_node_init(root, root->depth + 1, QFS_ROOT_INDEX_MAX);
+    qfs_index(root, 0)->file_block = key;
+    qfs_index(root, 0)->child = block;
+    root->entries = 1;
+    qfs_mark_dirty(inode);
+    return 0;
+}
+
+// Split the full child i of parent (which has room) in half
+static int qfs_tree_split(qfs_inode_t* inode, qfs_extent_header_t* parent, int i,
+                          cached_page_t* child_page)
+{
+    qfs_extent_header_t* child = (qfs_extent_header_t*)child_page->data;
+    uint32_t block;
+    cached_page_t* page = qfs_new_node(inode, qfs_index(parent, i)->child + 1, child->depth, &block);
+    if (!page) return -1;
+
+    qfs_extent_header_t* right = (qfs_extent_header_t*)page->data;
+    uint32_t keep = child->entries / 2;
+    right->entries = child->entries - keep;
+    memcpy(qfs_entry(right, 0), qfs_entry(child, keep), right->entries * qfs_entry_size(child));
+    child->entries = keep;
+    qfs_journal_dirty(child_page);
+
+    memmove(qfs_index(parent, i + 2), qfs_index(parent, i + 1),
+            (parent->entries - i - 1) * sizeof(qfs_extent_index_t));
+    qfs_index(parent, i + 1)->file_block = qfs_entry_key(right, 0);
+    qfs_index(parent, i + 1)->child = block;
+    parent->entries++;
+    page_cache_put(page);
+
+    tree_splits++;
+    return 0;
+}
+
+static inline bool qfs_extent_follows(const qfs_extent_t* a, const qfs_extent_t* b)
+{
+    return a->file_block + a->length == b->file_block &&
+           a->start_block + a->length == b->start_block;
+}
+
+// Into a leaf with room, merged with a neighbour it continues on disk
+static void qfs_leaf_insert(qfs_extent_header_t* leaf, const qfs_extent_t* extent)
+{
+    qfs_extent_t* e = (qfs_extent_t*)(leaf + 1);
+    int i = qfs_node_search(leaf, extent->file_block);
+    bool has_next = i + 1 < (int)leaf->entries;
+
+    if (i >= 0 && qfs_extent_follows(&e[i], extent)) {
+        e[i].length += extent->length;
+        if (has_next && qfs_extent_follows(&e[i], &e[i + 1])) {
+            e[i].length += e[i + 1].length;
+            memmove(&e[i + 1], &e[i + 2], (leaf->entries - i - 2) * sizeof(qfs_extent_t));
+            leaf->entries--;
+        }
+        extent_merges++;
+        return;
+    }
+    if (has_next && qfs_extent_follows(extent, &e[i + 1])) {
+        e[i + 1].file_block = extent->file_block;
+        e[i + 1].start_block = extent->start_block;
+        e[i + 1].length += extent->length;
+        extent_merges++;
+        return;
+    }
+
+    memmove(&e[i + 2], &e[i + 1], (leaf->entries - i - 1) * sizeof(qfs_extent_t));
+    e[i + 1] = *extent;
+    leaf->entries++;
+}
+
+/*
+ * Map a hole to disk blocks. Full nodes are split on the way down, so the
+ * leaf and every parent have room when they are reached, and an extent
+ * below every key lowers the first index key of each level it passes.
+ */
+static int qfs_extent_insert(qfs_inode_t* inode, const qfs_extent_t* extent)
+{
+    qfs_extent_header_t* node = &inode->extents.header;
+    if (node->entries == node->max && qfs_tree_grow(inode) < 0) return -1;
+
+    cached_page_t* page = NULL;  // Holding node, NULL for the root
+    while (node->depth > 0) {
+        int i = qfs_node_search(node, extent->file_block);
+        if (i < 0) {
+            i = 0;
+            qfs_index(node, 0)->file_block = extent->file_block;
+            qfs_node_dirty(inode, page);
+        }
+
+        cached_page_t* child = qfs_get_node(qfs_index(node, i)->child);
+        if (!child) goto fail;
+        qfs_extent_header_t* c = (qfs_extent_header_t*)child->data;
+        if (c->entries == c->max) {
+            if (qfs_tree_split(inode, node, i, child) < 0) {
+                page_cache_put(child);
+                goto fail;
+            }
+            qfs_node_dirty(inode, page);
+            if (extent->file_block >= qfs_index(node, i + 1)->file_block) {
+                page_cache_put(child);
+                child = qfs_get_node(qfs_index(node, i + 1)->child);
+                if (!child) goto fail;
+            }
+        }
+
+        if (page) page_cache_put(page);
+        page = child;
+        node = (qfs_extent_header_t*)page->data;
+    }
+
+    qfs_leaf_insert(node, extent);
+    qfs_node_dirty(inode, page);
+    if (page) page_cache_put(page);
+    return 0;
+
+fail:
+    if (page) page_cache_put(page);
+    return -1;
+}
+
+// ============================================================================
+// DELAYED ALLOCATION
+// ============================================================================
+
+// Range holding block (true), or where a new one for it would go
+static bool qfs_delalloc_find(qfs_inode_t* inode, uint32_t block, uint32_t* pos)
+{
+    uint32_t lo = 0, hi = inode->delalloc_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (inode->delalloc[mid].first <= block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0 && block < inode->delalloc[lo - 1].first + inode->delalloc[lo - 1].count) {
+        *pos = lo - 1;
+        return true;
+    }
+    *pos = lo;
+    return false;
+}
+
+// Add a block that no range holds; pos from qfs_delalloc_find()
+static int qfs_delalloc_add(qfs_inode_t* inode, uint32_t block, uint32_t pos)
+{
+    qfs_range_t* d = inode->delalloc;
+    bool after_prev = pos > 0 && d[pos - 1].first + d[pos - 1].count == block;
+    bool before_next = pos < inode->delalloc_count && d[pos].first == block + 1;
+
+    if (after_prev) {
+        d[pos - 1].count++;
+        if (before_next) {
+            d[pos - 1].count += d[pos].count;
+            memmove(&d[pos], &d[pos + 1], (inode->delalloc_count - pos - 1) * sizeof(qfs_range_t));
+            inode->delalloc_count--;
+        }
+        return 0;
+    }
+    if (before_next) {
+        d[pos].first--;
+        d[pos].count++;
+        return 0;
+    }
+
+    if (inode->delalloc_count == inode->delalloc_capacity) {
+        uint32_t capacity = inode->delalloc_capacity ? inode->delalloc_capacity * 2 : 4;
+        qfs_range_t* grown = krealloc(inode->delalloc, capacity * sizeof(qfs_range_t));
+        if (!grown) return -1;
+        inode->delalloc = grown;
+        inode->delalloc_capacity = capacity;
+        d = grown;
+    }
+    memmove(&d[pos + 1], &d[pos], (inode->delalloc_count - pos) * sizeof(qfs_range_t));
+    d[pos].first = block;
+    d[pos].count = 1;
+    inode->delalloc_count++;
+    return 0;
+}
+
+/*
+ * Writeback reached a block that only has a reservation. The whole delayed
+ * range around it is written back together (every block in it is a dirty
+ * page), so it gets its disk space now, in as few extents as the free
+ * space allows, placed right after the file's preceding block.
+ */
+static uint32_t qfs_delalloc_allocate(qfs_inode_t* inode, uint32_t file_block)
+{
+    uint32_t pos;
+    if (!qfs_delalloc_find(inode, file_block, &pos)) {
+        KERROR("QFS: Inode %u block %u written back without a reservation", inode->ino, file_block);
+        return 0;
+    }
+
+    qfs_range_t* range = &inode->delalloc[pos];
+    uint32_t run;
+    uint32_t goal = range->first ? qfs_extent_lookup(inode, range->first - 1, &run) : 0;
+    if (goal) goal++;
+
+    uint32_t found = 0;
+    while (range->count > 0) {
+        uint32_t got;
+        uint32_t start = qfs_alloc_blocks(goal, range->count, &got);
+        if (!start) break;
+
+        qfs_extent_t extent = { range->first, start, got };
+        if (qfs_extent_insert(inode, &extent) < 0) {
+            qfs_free_extent(&extent);
+            break;
+        }
+        if (file_block >= range->first && file_block < range->first + got) {
+            found = start + (file_block - range->first);
+        }
+
+        reserved_blocks -= got < reserved_blocks ? got : reserved_blocks;
+        inode->blocks += got;
+        qfs_mark_dirty(inode);
+        delalloc_extents++;
+        range->first += got;
+        range->count -= got;
+        goal = start + got;
+    }
+
+    if (range->count == 0) {
+        memmove(range, range + 1, (inode->delalloc_count - pos - 1) * sizeof(qfs_range_t));
+        inode->delalloc_count--;
+    }
+    if (!found) {
+        KERROR("QFS: No disk space for inode %u block %u", inode->ino, file_block);
+    }
+    return found;
+}
+
+// Page cache backing of a file: its extents, allocating delayed blocks at
+// writeback
+static uint32_t qfs_map_page(page_mapping_t* mapping, uint64_t index, uint64_t* sector,
+                             bool allocate)
+{
+    qfs_inode_t* inode = (qfs_inode_t*)mapping->host;
+    uint32_t run;
+
+    qfs_lock();
+    uint32_t block = qfs_extent_lookup(inode, (uint32_t)index, &run);
+    if (!block && allocate) {
+        block = qfs_delalloc_allocate(inode, (uint32_t)index);
+    }
+    qfs_unlock();
+    qfs_journal_throttle();
+
+    if (!block) return 0;
+    *sector = (uint64_t)block * QFS_SECTORS_PER_BLOCK;
+    return QFS_SECTORS_PER_BLOCK;
+}
+
 // ============================================================================
 // INODE MANAGEMENT
 // ============================================================================
@@ -244,22 +795,22 @@ static uint32_t qfs_alloc_inode(void)
         KERROR("QFS: Out of inodes");
         return 0;
     }
-    
+
     // Find free inode in bitmap
     for (uint32_t i = 1; i < qfs_superblock->total_inodes; i++) {
         uint32_t byte = i / 8;
         uint32_t bit = i % 8;
-        
+
         if (!(inode_bitmap[byte] & (1 << bit))) {
             // Mark as allocated
             inode_bitmap[byte] |= (1 << bit);
             qfs_superblock->free_inodes--;
-            
+
             KDEBUG("QFS: Allocated inode %u", i);
             return i;
         }
     }
-    
+
     return 0;
 }
 
@@ -267,43 +818,634 @@ static uint32_t qfs_alloc_inode(void)
 static void qfs_free_inode(uint32_t ino)
 {
     if (ino == 0 || ino >= qfs_superblock->total_inodes) return;
-    
+
     uint32_t byte = ino / 8;
     uint32_t bit = ino % 8;
-    
+
     inode_bitmap[byte] &= ~(1 << bit);
     qfs_superblock->free_inodes++;
 }
 
-// Load inode from disk (or cache)
-static qfs_inode_t* qfs_load_inode(uint32_t ino)
+// Inode table slot of ino, pinned
+static cached_page_t* qfs_inode_block(uint32_t ino, qfs_dinode_t** dinode)
+{
+    cached_page_t* page = page_cache_get(qfs_cache, qfs_superblock->inode_table_start +
+                                                    ino / INODES_PER_BLOCK);
+    if (page) *dinode = (qfs_dinode_t*)page->data + ino % INODES_PER_BLOCK;
+    return page;
+}
+
+// Copy an inode into the inode table (logged with the metadata); lock held
+static void qfs_write_inode(qfs_inode_t* inode)
+{
+    qfs_dinode_t* d;
+    cached_page_t* page = qfs_inode_block(inode->ino, &d);
+    if (!page) {
+        KERROR("QFS: Failed to write inode %u", inode->ino);
+        return;
+    }
+
+    __atomic_and_fetch(&inode->vfs_inode.i_state, ~I_DIRTY, __ATOMIC_RELAXED);
+    memset(d, 0, sizeof(qfs_dinode_t));
+    d->mode = inode->mode;
+    d->uid = inode->uid;
+    d->gid = inode->gid;
+    d->link_count = inode->link_count;
+    d->size = inode->size;
+    d->blocks = inode->blocks;
+    d->atime = inode->atime;
+    d->mtime = inode->mtime;
+    d->ctime = inode->ctime;
+    d->extents = inode->extents;
+    qfs_journal_dirty(page);
+    page_cache_put(page);
+}
+
+static inline bool qfs_inode_dirty(const qfs_inode_t* inode)
+{
+    return inode->vfs_inode.i_state & I_DIRTY;
+}
+
+// ============================================================================
+// INODE CACHE OPERATIONS
+// ============================================================================
+
+/*
+ * The VFS inode cache owns QFS inodes. qfs_iget() is called with the lock
+ * held and may wait there for an inode being evicted, so eviction must
+ * never take the lock: the cache only evicts inodes that are clean, pages
+ * included, and writes dirty ones back through qfs_vfs_write_inode() from
+ * icache_prune() first.
+ */
+static struct inode* qfs_vfs_alloc_inode(struct super_block* sb)
+{
+    (void)sb;
+    qfs_inode_t* inode = kmalloc_tracked(sizeof(qfs_inode_t), "qfs_inode");
+    return inode ? &inode->vfs_inode : NULL;
+}
+
+static void qfs_vfs_destroy_inode(struct inode* vfs_inode)
+{
+    kfree_tracked(QFS_I(vfs_inode));
+}
+
+// Data first (allocating delayed blocks dirties the inode), then the inode
+static int qfs_vfs_write_inode(struct inode* vfs_inode, struct writeback_control* wbc)
+{
+    (void)wbc;
+    qfs_inode_t* inode = QFS_I(vfs_inode);
+    int status = page_cache_sync(&inode->mapping);
+
+    qfs_lock();
+    if (qfs_inode_dirty(inode)) qfs_write_inode(inode);
+    qfs_unlock();
+    return status;
+}
+
+// Clean by now: the pages are only dropped, and there are no reservations
+static void qfs_vfs_evict_inode(struct inode* vfs_inode)
+{
+    qfs_inode_t* inode = QFS_I(vfs_inode);
+    if (inode->mapping.nr_pages > 0) page_cache_release_mapping(&inode->mapping);
+    kfree(inode->delalloc);
+}
+
+static const struct super_operations qfs_sops = {
+    .alloc_inode = qfs_vfs_alloc_inode,
+    .destroy_inode = qfs_vfs_destroy_inode,
+    .write_inode = qfs_vfs_write_inode,
+    .evict_inode = qfs_vfs_evict_inode,
+};
+
+// Inode ino, referenced (iput() when done) and read from the inode table
+// if it isn't cached; lock held
+static qfs_inode_t* qfs_iget(uint32_t ino)
 {
     if (ino == 0 || ino >= qfs_superblock->total_inodes) return NULL;
-    
-    // Check cache first
-    uint32_t cache_idx = ino % 256;
-    if (inode_cache[cache_idx] && inode_cache[cache_idx]->ino == ino) {
+
+    struct inode* vfs_inode = iget_locked(&qfs_sb, ino);
+    if (!vfs_inode) return NULL;
+    qfs_inode_t* inode = QFS_I(vfs_inode);
+    if (!(vfs_inode->i_state & I_NEW)) {
         cache_hits++;
-        return inode_cache[cache_idx];
+        return inode;
     }
-    
-    // Load from disk (simplified - would actually read from disk)
-    qfs_inode_t* inode = kmalloc_tracked(sizeof(qfs_inode_t), "qfs_inode");
-    if (!inode) return NULL;
-    
+
     // Initialize inode
-    memset(inode, 0, sizeof(qfs_inode_t));
+    memset(inode, 0, __builtin_offsetof(qfs_inode_t, vfs_inode));
     inode->ino = ino;
-    
-    // Cache it
-    if (inode_cache[cache_idx]) {
-        kfree_tracked(inode_cache[cache_idx]);
+
+    qfs_dinode_t* d;
+    cached_page_t* page = qfs_inode_block(ino, &d);
+    if (!page) {
+        iget_failed(vfs_inode);
+        return NULL;
     }
-    inode_cache[cache_idx] = inode;
-    
+    inode->mode = d->mode;
+    inode->uid = d->uid;
+    inode->gid = d->gid;
+    inode->link_count = d->link_count;
+    inode->size = d->size;
+    inode->blocks = d->blocks;
+    inode->atime = d->atime;
+    inode->mtime = d->mtime;
+    inode->ctime = d->ctime;
+    inode->extents = d->extents;
+    page_cache_put(page);
+
+    if (inode->extents.header.magic != QFS_EXTENT_MAGIC) {
+        qfs_node_init(&inode->extents.header, 0, QFS_INLINE_EXTENTS);
+    }
+    inode->pattern.preferred_block_size = DEFAULT_BLOCK_SIZE;
+    page_mapping_init(&inode->mapping, qfs_dev, qfs_map_page, inode);
+
+    vfs_inode->i_mapping = &inode->mapping;
+    vfs_inode->i_size = inode->size;
+    unlock_new_inode(vfs_inode);
     return inode;
 }
 
+static inline void qfs_iput(qfs_inode_t* inode)
+{
+    if (inode) iput(&inode->vfs_inode);
+}
+
+// ============================================================================
+// JOURNALING
+// ============================================================================
+
+/*
+ * Write-ahead log of whole metadata blocks. A block changed under the lock
+ * joins the running transaction and stays pinned, never dirty, in the
+ * cache; commit writes copies of the transaction's blocks to the journal,
+ * and only a checkpoint (when the journal fills) writes a committed copy
+ * home. The home blocks therefore always hold a committed state, and
+ * replay at mount brings them up to the last complete transaction.
+ */
+
+static void qfs_crc32_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        crc32_table[i] = c;
+    }
+}
+
+// CRC32 (IEEE), continuing from crc (0 to start)
+static uint32_t qfs_crc32(uint32_t crc, const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+    while (size--) {
+        crc = crc32_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Log a metadata block changed under the lock; the caller keeps its own pin
+static void qfs_journal_dirty(cached_page_t* page)
+{
+    qfs_transaction_t* t = &journal_running;
+    for (uint32_t i = 0; i < t->count; i++) {
+        if (t->blocks[i].page == page) return;
+    }
+
+    if (t->count == t->capacity) {
+        uint32_t capacity = t->capacity ? t->capacity * 2 : 64;
+        qfs_jblock_t* grown = krealloc(t->blocks, capacity * sizeof(qfs_jblock_t));
+        if (!grown) {
+            KERROR("QFS: No memory to log block %lu, writing it unlogged", page->index);
+            page_cache_mark_dirty(page);
+            return;
+        }
+        t->blocks = grown;
+        t->capacity = capacity;
+    }
+
+    // Cached and pinned by the caller, so this only takes another pin
+    t->blocks[t->count].block = (uint32_t)page->index;
+    t->blocks[t->count].page = page_cache_get(qfs_cache, page->index);
+    t->blocks[t->count].copy = NULL;
+    t->count++;
+}
+
+// Copy an in-memory structure into its metadata blocks, logging the ones
+// that change
+static int qfs_journal_stage(uint32_t block, const void* data, size_t size)
+{
+    const uint8_t* src = (const uint8_t*)data;
+    for (; size > 0; block++) {
+        size_t n = size < QFS_BLOCK_SIZE ? size : QFS_BLOCK_SIZE;
+        cached_page_t* page = page_cache_get(qfs_cache, block);
+        if (!page) return -1;
+        if (memcmp(page->data, src, n) != 0) {
+            memcpy(page->data, src, n);
+            qfs_journal_dirty(page);
+        }
+        page_cache_put(page);
+        src += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void qfs_journal_stage_inode(struct inode* vfs_inode, void* arg)
+{
+    (void)arg;
+    qfs_inode_t* inode = QFS_I(vfs_inode);
+    if (qfs_inode_dirty(inode)) qfs_write_inode(inode);
+}
+
+// Bring dirty inodes, the bitmaps and the superblock into the running
+// transaction; lock held
+static int qfs_journal_stage_all(void)
+{
+    iterate_sb_inodes(&qfs_sb, qfs_journal_stage_inode, NULL);
+
+    size_t bitmap_size = (qfs_superblock->total_blocks + 7) / 8;
+    size_t inode_bitmap_size = (qfs_superblock->total_inodes + 7) / 8;
+    if (qfs_journal_stage(qfs_superblock->block_bitmap_start, block_bitmap, bitmap_size) < 0 ||
+        qfs_journal_stage(qfs_superblock->inode_bitmap_start, inode_bitmap, inode_bitmap_size) < 0) {
+        return -1;
+    }
+
+    if (journal_running.count > 0) qfs_superblock->write_time = time_monotonic_ms();
+    return qfs_journal_stage(0, qfs_superblock, sizeof(qfs_superblock_t));
+}
+
+// Write each block's copy to its block number, as one plugged batch
+static int qfs_write_blocks(const qfs_jblock_t* blocks, uint32_t n)
+{
+    bio_t* bios = kmalloc(n * sizeof(bio_t));
+    if (!bios) return -1;
+
+    bio_batch_t batch;
+    bio_batch_init(&batch);
+    block_plug(qfs_dev);
+    for (uint32_t i = 0; i < n; i++) {
+        bios[i] = (bio_t){ .sector = (uint64_t)blocks[i].block * QFS_SECTORS_PER_BLOCK,
+                           .count = QFS_SECTORS_PER_BLOCK, .buffer = blocks[i].copy,
+                           .write = true };
+        bio_batch_add(&batch, &bios[i]);
+        if (block_submit_bio(qfs_dev, &bios[i]) < 0) {
+            bios[i].status = -1;
+            bios[i].end_io(&bios[i]);
+        }
+    }
+    block_unplug(qfs_dev);
+
+    int status = bio_batch_wait(&batch);
+    kfree(bios);
+    return status;
+}
+
+static int qfs_read_block(uint32_t block, void* buffer)
+{
+    return block_read(qfs_dev, (uint64_t)block * QFS_SECTORS_PER_BLOCK, QFS_SECTORS_PER_BLOCK,
+                      buffer);
+}
+
+// Drop the copies and pins of blocks that are home
+static void qfs_release_blocks(qfs_jblock_t* blocks, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        if (blocks[i].copy) pmm_free_pages((uintptr_t)blocks[i].copy, 1);
+        page_cache_put(blocks[i].page);
+    }
+}
+
+// Empty journal whose first transaction will be tid
+static int qfs_journal_reset(uint32_t tid)
+{
+    uint8_t* page = (uint8_t*)pmm_alloc_zeroed_page();
+    if (!page) return -1;
+
+    qfs_journal_header_t* super = (qfs_journal_header_t*)page;
+    super->magic = QFS_JOURNAL_MAGIC;
+    super->type = QFS_JOURNAL_SUPER;
+    super->transaction_id = tid;
+    super->block_count = 1;
+    super->timestamp = time_monotonic_ms();
+
+    qfs_jblock_t block = { qfs_superblock->journal_start, NULL, page };
+    int status = qfs_write_blocks(&block, 1);
+    if (status == 0) status = block_flush(qfs_dev);
+    pmm_free_pages((uintptr_t)page, 1);
+
+    journal_head = 1;
+    return status;
+}
+
+// Write every committed block home, then restart the journal at next_tid
+static int qfs_checkpoint(uint32_t next_tid)
+{
+    if (checkpoint_count > 0) {
+        if (qfs_write_blocks(checkpoint_list, checkpoint_count) < 0 ||
+            block_flush(qfs_dev) < 0) {
+            KERROR("QFS: Checkpoint failed, the journal still holds it");
+            return -1;
+        }
+        qfs_release_blocks(checkpoint_list, checkpoint_count);
+        checkpoint_count = 0;
+    }
+    journal_checkpoints++;
+    return qfs_journal_reset(next_tid);
+}
+
+// Committed blocks wait for the checkpoint; a newer copy of a block
+// already waiting replaces the old one (and its pin is dropped)
+static void qfs_checkpoint_add(qfs_transaction_t* t)
+{
+    for (uint32_t i = 0; i < t->count; i++) {
+        qfs_jblock_t* b = &t->blocks[i];
+        uint32_t j = 0;
+        while (j < checkpoint_count && checkpoint_list[j].block != b->block) j++;
+        if (j == checkpoint_count) {
+            checkpoint_list[checkpoint_count++] = *b;
+            continue;
+        }
+        pmm_free_pages((uintptr_t)checkpoint_list[j].copy, 1);
+        checkpoint_list[j].copy = b->copy;
+        page_cache_put(b->page);
+    }
+}
+
+/*
+ * Write a closed transaction: descriptor, copies and commit block as one
+ * batch, then a single cache flush. The commit block checksums the rest,
+ * so it doesn't need a flush of its own ahead of it: a transaction torn by
+ * a crash fails the checksum at replay and is dropped whole.
+ */
+static int qfs_journal_write(qfs_transaction_t* t)
+{
+    uint32_t n = t->count;
+    if (n > QFS_JOURNAL_TAGS || n + 3 > JOURNAL_BLOCKS) {
+        // Can't be logged in one piece: write it in place, without atomicity
+        KWARN("QFS: Transaction %u of %u blocks written unlogged", t->tid, n);
+        if (qfs_checkpoint(t->tid + 1) < 0 || qfs_write_blocks(t->blocks, n) < 0 ||
+            block_flush(qfs_dev) < 0) {
+            qfs_release_blocks(t->blocks, n);
+            return -1;
+        }
+        qfs_release_blocks(t->blocks, n);
+        return 0;
+    }
+    if (journal_head + n + 2 > JOURNAL_BLOCKS && qfs_checkpoint(t->tid) < 0) {
+        qfs_release_blocks(t->blocks, n);
+        return -1;
+    }
+
+    qfs_jblock_t* log = kmalloc((n + 2) * sizeof(qfs_jblock_t));
+    uint8_t* desc = (uint8_t*)pmm_alloc_zeroed_page();
+    uint8_t* commit = (uint8_t*)pmm_alloc_zeroed_page();
+    int status = -1;
+    if (!log || !desc || !commit) goto out;
+
+    uint64_t now = time_monotonic_ms();
+    qfs_journal_header_t* d = (qfs_journal_header_t*)desc;
+    d->magic = QFS_JOURNAL_MAGIC;
+    d->type = QFS_JOURNAL_DESC;
+    d->transaction_id = t->tid;
+    d->block_count = n;
+    d->timestamp = now;
+    uint32_t* tags = (uint32_t*)(d + 1);
+
+    uint32_t first = qfs_superblock->journal_start + journal_head;
+    log[0] = (qfs_jblock_t){ first, NULL, desc };
+    for (uint32_t i = 0; i < n; i++) {
+        tags[i] = t->blocks[i].block;
+        log[i + 1] = (qfs_jblock_t){ first + 1 + i, NULL, t->blocks[i].copy };
+    }
+    uint32_t crc = qfs_crc32(0, desc, QFS_BLOCK_SIZE);
+    for (uint32_t i = 0; i < n; i++) {
+        crc = qfs_crc32(crc, t->blocks[i].copy, QFS_BLOCK_SIZE);
+    }
+
+    qfs_journal_header_t* c = (qfs_journal_header_t*)commit;
+    *c = *d;
+    c->type = QFS_JOURNAL_COMMIT;
+    c->checksum = crc;
+    log[n + 1] = (qfs_jblock_t){ first + n + 1, NULL, commit };
+
+    status = qfs_write_blocks(log, n + 2);
+    if (status == 0) status = block_flush(qfs_dev);
+    if (status == 0) journal_head += n + 2;
+
+out:
+    if (status == 0) {
+        qfs_checkpoint_add(t);
+    } else {
+        // The journal may hold part of it: get it home and start over
+        KERROR("QFS: Journal write of transaction %u failed", t->tid);
+        qfs_checkpoint_add(t);
+        qfs_checkpoint(t->tid + 1);
+    }
+    if (commit) pmm_free_pages((uintptr_t)commit, 1);
+    if (desc) pmm_free_pages((uintptr_t)desc, 1);
+    kfree(log);
+    return status;
+}
+
+/*
+ * Make transaction tid (and everything before it) durable. Group commit:
+ * the caller that finds no commit in progress closes the running
+ * transaction and writes it, while changes made meanwhile collect in the
+ * next one; callers waiting on the same transaction share its I/O and its
+ * single flush instead of paying one each.
+ */
+static int qfs_journal_commit(uint32_t tid)
+{
+    bool waited = false;
+    qfs_lock();
+    for (;;) {
+        if (tid <= committed_tid) {
+            if (waited) journal_joined++;
+            qfs_unlock();
+            return journal_error;
+        }
+        if (!journal_committing) break;
+
+        wait_entry_t wait;
+        wait_prepare(&journal_wq, &wait);
+        qfs_unlock();
+        if (journal_committing) wait_schedule(&wait, WAIT_FOREVER);
+        wait_finish(&wait);
+        waited = true;
+        qfs_lock();
+    }
+
+    if (qfs_journal_stage_all() < 0) {
+        qfs_unlock();
+        return -1;
+    }
+    qfs_transaction_t t = journal_running;
+    if (t.count == 0) {
+        qfs_unlock();
+        return 0;
+    }
+
+    // Freeze the blocks as they are now; the pages stay open to new changes
+    for (uint32_t i = 0; i < t.count; i++) {
+        t.blocks[i].copy = (uint8_t*)pmm_alloc_pages(1);
+        if (!t.blocks[i].copy) {
+            while (i-- > 0) {
+                pmm_free_pages((uintptr_t)t.blocks[i].copy, 1);
+                t.blocks[i].copy = NULL;
+            }
+            qfs_unlock();
+            KERROR("QFS: No memory to commit transaction %u", t.tid);
+            return -1;
+        }
+        memcpy(t.blocks[i].copy, t.blocks[i].page->data, QFS_BLOCK_SIZE);
+    }
+    memset(&journal_running, 0, sizeof(journal_running));
+    journal_running.tid = t.tid + 1;
+    journal_committing = true;
+    qfs_unlock();
+
+    int status = qfs_journal_write(&t);
+    kfree(t.blocks);
+    journal_commits++;
+    journal_blocks += t.count;
+    KDEBUG("QFS: Journal transaction %u committed (%u blocks)", t.tid, t.count);
+
+    qfs_lock();
+    committed_tid = t.tid;
+    if (status < 0) journal_error = -1;
+    journal_committing = false;
+    qfs_unlock();
+    wake_up(&journal_wq);
+    return status;
+}
+
+// A large running transaction is committed early, between operations
+static void qfs_journal_throttle(void)
+{
+    if (journal_running.count >= QFS_TRANSACTION_SOFT && !journal_committing) {
+        qfs_journal_commit(journal_running.tid);
+    }
+}
+
+// Replay complete transactions from the journal superblock on; returns how
+// many, or -1 on a read error
+static int qfs_journal_replay(uint32_t* next_tid)
+{
+    uint8_t* desc = (uint8_t*)pmm_alloc_pages(1);
+    uint8_t* buffer = (uint8_t*)pmm_alloc_pages(1);
+    int replayed = -1;
+    if (!desc || !buffer) goto out;
+
+    uint32_t start = qfs_superblock->journal_start;
+    qfs_journal_header_t* d = (qfs_journal_header_t*)desc;
+    qfs_journal_header_t* c = (qfs_journal_header_t*)buffer;
+    if (qfs_read_block(start, desc) < 0) goto out;
+    if (d->magic != QFS_JOURNAL_MAGIC || d->type != QFS_JOURNAL_SUPER) {
+        KWARN("QFS: No journal superblock, starting a new journal");
+        *next_tid = 1;
+        replayed = 0;
+        goto out;
+    }
+
+    uint32_t tid = d->transaction_id;
+    uint32_t head = d->block_count;
+    replayed = 0;
+    while (head >= 1 && head + 2 <= JOURNAL_BLOCKS) {
+        if (qfs_read_block(start + head, desc) < 0) {
+            replayed = -1;
+            goto out;
+        }
+        uint32_t n = d->block_count;
+        if (d->magic != QFS_JOURNAL_MAGIC || d->type != QFS_JOURNAL_DESC ||
+            d->transaction_id != tid || n > QFS_JOURNAL_TAGS || head + n + 2 > JOURNAL_BLOCKS) {
+            break;
+        }
+
+        // Complete only if the commit block matches what was read
+        uint32_t* tags = (uint32_t*)(d + 1);
+        uint32_t crc = qfs_crc32(0, desc, QFS_BLOCK_SIZE);
+        bool valid = true;
+        for (uint32_t i = 0; i < n && valid; i++) {
+            if (tags[i] >= start || qfs_read_block(start + head + 1 + i, buffer) < 0) {
+                valid = false;
+                break;
+            }
+            crc = qfs_crc32(crc, buffer, QFS_BLOCK_SIZE);
+        }
+        if (!valid || qfs_read_block(start + head + n + 1, buffer) < 0 ||
+            c->magic != QFS_JOURNAL_MAGIC || c->type != QFS_JOURNAL_COMMIT ||
+            c->transaction_id != tid || c->block_count != n || c->checksum != crc) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (qfs_read_block(start + head + 1 + i, buffer) < 0 ||
+                page_cache_write(qfs_cache, (uint64_t)tags[i] * QFS_BLOCK_SIZE, buffer,
+                                 QFS_BLOCK_SIZE) < 0) {
+                replayed = -1;
+                goto out;
+            }
+        }
+        head += n + 2;
+        tid++;
+        replayed++;
+    }
+    *next_tid = tid;
+
+    if (replayed > 0 && (page_cache_sync(qfs_cache) < 0 || block_flush(qfs_dev) < 0)) {
+        replayed = -1;
+    }
+
+out:
+    if (buffer) pmm_free_pages((uintptr_t)buffer, 1);
+    if (desc) pmm_free_pages((uintptr_t)desc, 1);
+    return replayed;
+}
+
+// Replay a mounted volume's journal, or start a formatted one's; returns
+// the number of transactions replayed
+static int qfs_journal_init(bool mounted)
+{
+    qfs_crc32_init();
+    checkpoint_list = kmalloc_tracked(JOURNAL_BLOCKS * sizeof(qfs_jblock_t), "qfs_checkpoint");
+    if (!checkpoint_list) return -1;
+
+    uint32_t tid = 1;
+    int replayed = 0;
+    if (mounted) {
+        replayed = qfs_journal_replay(&tid);
+        if (replayed < 0) return -1;
+    } else {
+        // Transactions a previous volume left in the journal must not match
+        uint8_t* page = (uint8_t*)pmm_alloc_pages(1);
+        if (!page) return -1;
+        qfs_journal_header_t* super = (qfs_journal_header_t*)page;
+        if (qfs_read_block(qfs_superblock->journal_start, page) == 0 &&
+            super->magic == QFS_JOURNAL_MAGIC && super->type == QFS_JOURNAL_SUPER) {
+            tid = super->transaction_id + JOURNAL_BLOCKS;
+        }
+        pmm_free_pages((uintptr_t)page, 1);
+    }
+
+    if (qfs_journal_reset(tid) < 0) return -1;
+    journal_running.tid = tid;
+    committed_tid = tid - 1;
+    return replayed;
+}
+
+// Commits what collected in the running transaction every few seconds
+static void qfs_journal_task(void* arg)
+{
+    (void)arg;
+    for (;;) {
+        scheduler_sleep_us(QFS_COMMIT_INTERVAL_US);
+        qfs_journal_commit(journal_running.tid);
+        icache_prune();  // Writes back inodes it wants to drop: a later commit
+    }
+}
+
 // ============================================================================
 // FILE OPERATIONS
 // ============================================================================
@@ -311,30 +1453,43 @@ static qfs_inode_t* qfs_load_inode(uint32_t ino)
 // Create a new file
 uint32_t qfs_create_file(const char* name, uint16_t mode)
 {
+    if (!qfs_superblock) return 0;
+
+    qfs_lock();
     uint32_t ino = qfs_alloc_inode();
-    if (ino == 0) return 0;
-    
-    qfs_inode_t* inode = qfs_load_inode(ino);
+    if (ino == 0) {
+        qfs_unlock();
+        return 0;
+    }
+
+    qfs_inode_t* inode = qfs_iget(ino);
     if (!inode) {
         qfs_free_inode(ino);
+        qfs_unlock();
         return 0;
     }
-    
+
     // Initialize inode
     inode->mode = mode;
     inode->uid = 0;  // Root
     inode->gid = 0;
     inode->size = 0;
+    inode->vfs_inode.i_size = 0;
     inode->blocks = 0;
     inode->link_count = 1;
-    
+    qfs_node_init(&inode->extents.header, 0, QFS_INLINE_EXTENTS);
+
     uint64_t now = time_monotonic_ms();
     inode->atime = inode->mtime = inode->ctime = now;
-    
+
     // Initialize access pattern
     inode->pattern.preferred_block_size = DEFAULT_BLOCK_SIZE;
     inode->coherence_window = 100;  // 100ms default
-    
+    qfs_mark_dirty(inode);
+    qfs_iput(inode);
+    qfs_unlock();
+    qfs_journal_throttle();
+
     KINFO("QFS: Created file inode %u: %s", ino, name);
     return ino;
 }
@@ -343,133 +1498,309 @@ uint32_t qfs_create_file(const char* name, uint16_t mode)
 int64_t qfs_read(uint32_t ino, void* buffer, uint64_t offset, size_t count)
 {
     total_reads++;
-    
-    qfs_inode_t* inode = qfs_load_inode(ino);
-    if (!inode) return -1;
-    
+
+    qfs_lock();
+    qfs_inode_t* inode = qfs_iget(ino);
+    if (!inode) {
+        qfs_unlock();
+        return -1;
+    }
+
     // Update access pattern
     inode->pattern.access_count++;
-    inode->pattern.sequential_reads++;  // Simplified
+    if (offset == inode->pattern.next_offset) {
+        inode->pattern.sequential_reads++;
+    } else {
+        inode->pattern.random_reads++;
+    }
+    inode->pattern.next_offset = offset + count;
     inode->pattern.last_access = time_monotonic_ms();
     inode->atime = inode->pattern.last_access;
-    
+
     // Recalculate optimal block size
-    inode->pattern.preferred_block_size = 
+    inode->pattern.preferred_block_size =
         qfs_calculate_optimal_block_size(&inode->pattern);
-    
-    // Read from extents (simplified)
-    size_t bytes_read = 0;
-    
-    KDEBUG("QFS: Read %lu bytes from inode %u (optimal block: %u)", 
+
+    uint64_t size = inode->size;
+    qfs_unlock();
+
+    if (offset >= size || count == 0) {
+        qfs_iput(inode);
+        return 0;
+    }
+    if (count > size - offset) count = size - offset;
+
+    uint64_t first = offset / QFS_BLOCK_SIZE;
+    uint64_t ra_start;
+    uint32_t ra_pages;
+    bool ahead = page_cache_ra_advance(&inode->ra, first,
+                                       (uint32_t)((offset + count - 1) / QFS_BLOCK_SIZE - first + 1),
+                                       &ra_start, &ra_pages);
+
+    if (page_cache_read(&inode->mapping, offset, buffer, count) < 0) {
+        qfs_iput(inode);
+        return -1;
+    }
+
+    uint64_t end = (size + QFS_BLOCK_SIZE - 1) / QFS_BLOCK_SIZE;
+    if (ahead && ra_start < end) {
+        page_cache_readahead(&inode->mapping, ra_start,
+                             ra_start + ra_pages > end ? end - ra_start : ra_pages);
+    }
+
+    KDEBUG("QFS: Read %lu bytes from inode %u (optimal block: %u)",
            count, ino, inode->pattern.preferred_block_size);
-    
-    return bytes_read;
+
+    qfs_iput(inode);
+    return count;
 }
 
-// Write to file
+// Write to file. Delayed allocation: blocks are only reserved here and get
+// their place on disk at writeback, when whole runs of them are known.
 int64_t qfs_write(uint32_t ino, const void* buffer, uint64_t offset, size_t count)
 {
     total_writes++;
-    
-    qfs_inode_t* inode = qfs_load_inode(ino);
-    if (!inode) return -1;
-    
+    if (count == 0) return 0;
+    if (offset >= QFS_MAX_FILE_SIZE || count > QFS_MAX_FILE_SIZE - offset) return -1;
+
+    qfs_lock();
+    qfs_inode_t* inode = qfs_iget(ino);
+    if (!inode) {
+        qfs_unlock();
+        return -1;
+    }
+
     // Update access pattern
     inode->pattern.access_count++;
-    inode->pattern.sequential_writes++;  // Simplified
+    if (offset == inode->pattern.next_offset) {
+        inode->pattern.sequential_writes++;
+    } else {
+        inode->pattern.random_writes++;
+    }
+    inode->pattern.next_offset = offset + count;
     inode->pattern.last_access = time_monotonic_ms();
     inode->mtime = inode->ctime = inode->pattern.last_access;
-    
-    // Adaptive block allocation
+
     uint32_t optimal_block_size = qfs_calculate_optimal_block_size(&inode->pattern);
-    uint32_t blocks_needed = (count + optimal_block_size - 1) / optimal_block_size;
-    
-    // Allocate extents if needed
-    if (inode->size + count > inode->blocks * optimal_block_size) {
-        qfs_extent_t extent;
-        if (qfs_alloc_extent(blocks_needed, &extent)) {
-            // Add extent to inode
-            for (int i = 0; i < MAX_EXTENT_COUNT; i++) {
-                if (inode->extents[i].length == 0) {
-                    inode->extents[i] = extent;
-                    inode->blocks += extent.length;
-                    break;
-                }
+
+    // Reserve every block that has no disk space or reservation yet; a
+    // full disk shortens the write
+    uint32_t first = offset / QFS_BLOCK_SIZE;
+    uint32_t last = (offset + count - 1) / QFS_BLOCK_SIZE;
+    for (uint32_t block = first; block <= last; block++) {
+        uint32_t run, pos;
+        if (qfs_extent_lookup(inode, block, &run)) {
+            block += run - 1;
+            continue;
+        }
+        if (qfs_delalloc_find(inode, block, &pos)) {
+            block = inode->delalloc[pos].first + inode->delalloc[pos].count - 1;
+            continue;
+        }
+        if (qfs_superblock->free_blocks < reserved_blocks + QFS_METADATA_RESERVE + 1 ||
+            qfs_delalloc_add(inode, block, pos) < 0) {
+            if (block == first) {
+                qfs_iput(inode);
+                qfs_unlock();
+                KERROR("QFS: No space to write inode %u", ino);
+                return -1;
             }
+            count = (uint64_t)block * QFS_BLOCK_SIZE - offset;
+            break;
         }
+        reserved_blocks++;
+    }
+    qfs_unlock();
+
+    if (page_cache_write(&inode->mapping, offset, buffer, count) < 0) {
+        qfs_iput(inode);
+        return -1;
     }
-    
-    inode->size += count;
-    
-    KDEBUG("QFS: Wrote %lu bytes to inode %u (adaptive block: %u)", 
+
+    // Size last, once the data is there to be read
+    qfs_lock();
+    if (offset + count > inode->size) {
+        inode->size = offset + count;
+        inode->vfs_inode.i_size = inode->size;
+    }
+    qfs_mark_dirty(inode);
+    qfs_iput(inode);
+    qfs_unlock();
+    qfs_journal_throttle();
+
+    KDEBUG("QFS: Wrote %lu bytes to inode %u (adaptive block: %u)",
            count, ino, optimal_block_size);
-    
+
     return count;
 }
 
-// ============================================================================
-// JOURNALING
-// ============================================================================
+// VFS inode of a file, referenced (iput() when done), for page cache users
+// such as the ELF loader; NULL if there is no such inode
+struct inode* qfs_open_inode(uint32_t ino)
+{
+    if (!qfs_superblock) return NULL;
+
+    qfs_lock();
+    qfs_inode_t* inode = qfs_iget(ino);
+    qfs_unlock();
+    return inode ? &inode->vfs_inode : NULL;
+}
+
+static void qfs_sync_inode(struct inode* vfs_inode, void* arg)
+{
+    if (page_cache_sync(vfs_inode->i_mapping) < 0) *(int*)arg = -1;
+}
 
-static void qfs_journal_begin_transaction(void)
+// Write back file data (allocating delayed blocks, which logs extent
+// nodes and the bitmap), then commit the metadata
+int qfs_sync(void)
 {
-    journal_transaction_id++;
-    KDEBUG("QFS: Journal transaction %u started", journal_transaction_id);
+    if (!qfs_superblock) return -1;
+    int status = 0;
+
+    iterate_sb_inodes(&qfs_sb, qfs_sync_inode, &status);
+
+    if (qfs_journal_commit(journal_running.tid) < 0) status = -1;
+    return status;
 }
 
-static void qfs_journal_commit_transaction(void)
+// Data of one file, then a commit of the transaction holding its inode;
+// concurrent fsyncs end up in the same commit
+int qfs_fsync(uint32_t ino)
 {
-    // Write journal blocks to disk
-    KDEBUG("QFS: Journal transaction %u committed", journal_transaction_id);
+    if (!qfs_superblock) return -1;
+
+    qfs_lock();
+    qfs_inode_t* inode = qfs_iget(ino);
+    qfs_unlock();
+    if (!inode) return -1;
+
+    int status = page_cache_sync(&inode->mapping);
+    qfs_iput(inode);
+
+    qfs_lock();
+    uint32_t tid = journal_running.tid;
+    qfs_unlock();
+    if (qfs_journal_commit(tid) < 0) status = -1;
+    return status;
 }
 
 // ============================================================================
 // INITIALIZATION
 // ============================================================================
 
+// Fresh filesystem laid out on total_blocks
+static void qfs_format(uint32_t total_blocks)
+{
+    memset(qfs_superblock, 0, sizeof(qfs_superblock_t));
+    qfs_superblock->magic = QFS_MAGIC;
+    qfs_superblock->version = QFS_VERSION;
+    qfs_superblock->block_size = DEFAULT_BLOCK_SIZE;
+    qfs_superblock->total_blocks = total_blocks;
+    qfs_superblock->total_inodes = 16384;
+    qfs_superblock->free_inodes = 16384 - 2;   // 0 is never used, 1 is the root
+    qfs_superblock->block_bitmap_start = 1;
+    qfs_superblock->inode_bitmap_start = 3;
+    qfs_superblock->inode_table_start = 10;    // 512 blocks of inodes
+    qfs_superblock->data_blocks_start = 1024;
+    qfs_superblock->journal_start = total_blocks - JOURNAL_BLOCKS;
+    qfs_superblock->free_blocks = qfs_superblock->journal_start - qfs_superblock->data_blocks_start;
+    qfs_superblock->root_inode = 1;
+    strcpy(qfs_superblock->volume_name, "QFS Volume");
+}
+
 int qfs_init(void)
 {
     KINFO("==========================================");
     KINFO("Quantum Filesystem (QFS) - Adaptive Storage");
     KINFO("==========================================");
     KINFO("");
-    
+
+    qfs_dev = block_get_device(QFS_DEVICE);
+    if (!qfs_dev) {
+        qfs_dev = ramdisk_create("ram0", (uint64_t)QFS_RAMDISK_BLOCKS * QFS_SECTORS_PER_BLOCK);
+    }
+    if (!qfs_dev) {
+        KERROR("QFS: No block device");
+        return -1;
+    }
+    qfs_cache = page_cache_bdev(qfs_dev);
+
+    uint64_t device_blocks = qfs_dev->total_sectors / QFS_SECTORS_PER_BLOCK;
+    if (!qfs_cache || device_blocks < 1024 + 2 * JOURNAL_BLOCKS) {
+        KERROR("QFS: %s is too small", qfs_dev->name);
+        return -1;
+    }
+
     // Allocate superblock
     qfs_superblock = kmalloc_tracked(sizeof(qfs_superblock_t), "qfs_superblock");
     if (!qfs_superblock) {
         KERROR("Failed to allocate QFS superblock");
         return -1;
     }
-    
-    // Initialize superblock
-    qfs_superblock->magic = QFS_MAGIC;
-    qfs_superblock->version = QFS_VERSION;
-    qfs_superblock->block_size = DEFAULT_BLOCK_SIZE;
-    qfs_superblock->total_blocks = 65536;      // 256MB @ 4KB
-    qfs_superblock->free_blocks = 64000;
-    qfs_superblock->total_inodes = 16384;
-    qfs_superblock->free_inodes = 16383;
-    qfs_superblock->inode_table_start = 10;
-    qfs_superblock->data_blocks_start = 1024;
-    qfs_superblock->journal_start = 64512;
-    qfs_superblock->root_inode = 1;
-    strcpy(qfs_superblock->volume_name, "QFS Volume");
-    
+
+    bool mounted = page_cache_read(qfs_cache, 0, qfs_superblock, sizeof(qfs_superblock_t)) == 0 &&
+                   qfs_superblock->magic == QFS_MAGIC && qfs_superblock->version == QFS_VERSION &&
+                   qfs_superblock->total_blocks <= device_blocks;
+    if (!mounted) {
+        qfs_format(device_blocks < QFS_MAX_BLOCKS ? (uint32_t)device_blocks : QFS_MAX_BLOCKS);
+    }
+
+    // Replay brings the superblock and bitmaps up to date too
+    int replayed = qfs_journal_init(mounted);
+    if (replayed < 0 ||
+        (replayed > 0 && page_cache_read(qfs_cache, 0, qfs_superblock, sizeof(qfs_superblock_t)) < 0)) {
+        KERROR("QFS: Journal recovery on %s failed", qfs_dev->name);
+        return -1;
+    }
+
     // Allocate bitmaps
     size_t bitmap_size = (qfs_superblock->total_blocks + 7) / 8;
     block_bitmap = kmalloc_tracked(bitmap_size, "qfs_block_bitmap");
-    memset(block_bitmap, 0, bitmap_size);
-    
+
     size_t inode_bitmap_size = (qfs_superblock->total_inodes + 7) / 8;
     inode_bitmap = kmalloc_tracked(inode_bitmap_size, "qfs_inode_bitmap");
-    memset(inode_bitmap, 0, inode_bitmap_size);
-    
-    // Mark root inode as allocated
-    inode_bitmap[1 / 8] |= (1 << (1 % 8));
-    
-    // Clear inode cache
-    memset(inode_cache, 0, sizeof(inode_cache));
-    
+    if (!block_bitmap || !inode_bitmap) {
+        KERROR("Failed to allocate QFS bitmaps");
+        return -1;
+    }
+
+    if (mounted) {
+        if (page_cache_read(qfs_cache, (uint64_t)qfs_superblock->block_bitmap_start * QFS_BLOCK_SIZE,
+                            block_bitmap, bitmap_size) < 0 ||
+            page_cache_read(qfs_cache, (uint64_t)qfs_superblock->inode_bitmap_start * QFS_BLOCK_SIZE,
+                            inode_bitmap, inode_bitmap_size) < 0) {
+            KERROR("QFS: Failed to read bitmaps");
+            return -1;
+        }
+        qfs_superblock->mount_count++;
+    } else {
+        memset(block_bitmap, 0, bitmap_size);
+        memset(inode_bitmap, 0, inode_bitmap_size);
+
+        // Mark root inode as allocated
+        inode_bitmap[1 / 8] |= (1 << (1 % 8));
+    }
+    qfs_superblock->mount_time = time_monotonic_ms();
+
+    // Inodes are cached by the VFS from here on
+    qfs_sb.s_blocksize = QFS_BLOCK_SIZE;
+    qfs_sb.s_magic = QFS_MAGIC;
+    qfs_sb.s_maxbytes = QFS_MAX_FILE_SIZE;
+    qfs_sb.s_op = &qfs_sops;
+    qfs_sb.s_fs_info = qfs_superblock;
+    strncpy(qfs_sb.s_id, qfs_dev->name, sizeof(qfs_sb.s_id) - 1);
+    INIT_LIST_HEAD(&qfs_sb.s_inodes);
+
+    if (qfs_sync() < 0) {
+        KERROR("QFS: Failed to write superblock to %s", qfs_dev->name);
+        return -1;
+    }
+    if (scheduler_create_task(qfs_journal_task, NULL, 8192, QFS_JOURNAL_PRIORITY,
+                              "qfsjournal") < 0) {
+        KWARN("QFS: No commit task, metadata is committed by qfs_sync()");
+    }
+
     KINFO("🎯 QFS INNOVATIONS:");
     KINFO("  ├─ Adaptive block allocation (1KB - 64KB)");
     KINFO("  ├─ Access pattern learning");
@@ -477,18 +1808,20 @@ int qfs_init(void)
     KINFO("  └─ Temporal locality prediction");
     KINFO("");
     KINFO("📊 FILESYSTEM CONFIGURATION:");
-    KINFO("  ├─ Total blocks: %u (%u MB)", 
+    KINFO("  ├─ Device: %s (%s, mount %u)", qfs_dev->name,
+          mounted ? "existing volume" : "formatted", qfs_superblock->mount_count);
+    KINFO("  ├─ Total blocks: %u (%u MB)",
           qfs_superblock->total_blocks,
           (qfs_superblock->total_blocks * DEFAULT_BLOCK_SIZE) / (1024*1024));
     KINFO("  ├─ Default block size: %u KB", qfs_superblock->block_size / 1024);
-    KINFO("  ├─ Adaptive range: %u KB - %u KB", 
+    KINFO("  ├─ Adaptive range: %u KB - %u KB",
           MIN_BLOCK_SIZE / 1024, MAX_BLOCK_SIZE / 1024);
     KINFO("  ├─ Total inodes: %u", qfs_superblock->total_inodes);
-    KINFO("  └─ Journal blocks: %u", JOURNAL_BLOCKS);
+    KINFO("  └─ Journal blocks: %u (%d transactions replayed)", JOURNAL_BLOCKS, replayed);
     KINFO("");
     KINFO("✅ QFS READY - Next-Gen Adaptive Filesystem!");
     KINFO("==========================================");
-    
+
     return 0;
 }
 
@@ -507,8 +1840,13 @@ void qfs_get_stats(void)
     KINFO("Free blocks: %u / %u (%.1f%%)",
           qfs_superblock->free_blocks, qfs_superblock->total_blocks,
           (qfs_superblock->free_blocks * 100.0 / qfs_superblock->total_blocks));
+    KINFO("Reserved for delayed writes: %u blocks", reserved_blocks);
+    KINFO("Extents: %lu allocated at writeback, %lu merged, %lu tree splits",
+          delalloc_extents, extent_merges, tree_splits);
     KINFO("Free inodes: %u / %u",
           qfs_superblock->free_inodes, qfs_superblock->total_inodes);
+    KINFO("Journal: %lu commits of %lu blocks, %lu waiters joined a commit, %lu checkpoints",
+          journal_commits, journal_blocks, journal_joined, journal_checkpoints);
 }
 
 // Demonstration functions from original fluxfs
@@ -516,12 +1854,16 @@ void qfs_get_stats(void)
 void qfs_quantum_position_demo(uint64_t inode_num, uint64_t size)
 {
     KDEBUG("QFS: Quantum position demo for inode %llu, size %llu", inode_num, size);
-    qfs_inode_t* inode = qfs_load_inode(inode_num);
+    if (!qfs_superblock) return;
+    qfs_lock();
+    qfs_inode_t* inode = qfs_iget(inode_num);
     if (inode) {
-        KDEBUG("  Optimal block size: %u bytes", 
+        KDEBUG("  Optimal block size: %u bytes",
                inode->pattern.preferred_block_size);
         KDEBUG("  Access count: %u", inode->pattern.access_count);
+        qfs_iput(inode);
     }
+    qfs_unlock();
 }
 
 void qfs_temporal_demo(void)
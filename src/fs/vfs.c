@@ -1,5 +1,8 @@
 #include "vfs.h"
 #include "kernel.h"
+#include "smp.h"
+#include "page_cache.h"
+#include "sync.h"
 #include "errno.h"
 
 extern int fluxfs_init(void);
@@ -216,8 +219,521 @@ void vfs_free_file(struct file* file)
     }
 }
 
-// Create a new inode with operations
-struct inode* new_inode(struct super_block* sb)
+// ============================================================================
+// DENTRY CACHE
+// ============================================================================
+
+#define DCACHE_HASH_BITS   12
+#define DCACHE_HASH_SIZE   (1 << DCACHE_HASH_BITS)
+#define DCACHE_MAX_UNUSED  8192          // d_alloc() prunes beyond this
+#define DCACHE_PRUNE_BATCH 64
+#define DENTRY_DEAD        0x80000000u   // d_count of a reclaimed dentry
+
+/*
+ * Dentries hash by (parent, name hash). Path walks follow the chains with
+ * no locks and no references: a hashed dentry's name and parent never
+ * change, and a reclaimed one is unlinked but keeps its chain pointer and
+ * memory until every CPU has left the walk it may have been reading it in
+ * (RCU-style, dcache_synchronize()). Changes serialize on dcache_lock;
+ * nothing allocates while holding it.
+ */
+static struct dentry* dentry_hashtable[DCACHE_HASH_SIZE];
+static spinlock_t dcache_lock = SPINLOCK_INIT;
+static struct list_head dentry_unused = { &dentry_unused, &dentry_unused };
+static size_t nr_dentry = 0;
+static size_t nr_unused = 0;               // On the LRU (lazily: some are in use again)
+static struct dentry* vfs_root = NULL;
+
+// Lockless walk sections, one counter per CPU: odd while inside one
+static struct {
+    volatile uint64_t seq;
+    uint8_t pad[56];
+} __attribute__((aligned(64))) dcache_walkers[MAX_CPUS];
+
+// Statistics
+static uint64_t dcache_hits = 0;
+static uint64_t dcache_negative_hits = 0;
+static uint64_t dcache_misses = 0;
+static uint64_t dcache_pruned = 0;
+static uint64_t walk_restarts = 0;
+
+#define d_lru_entry(node) \
+    ((struct dentry*)((char*)(node) - __builtin_offsetof(struct dentry, d_lru)))
+
+static inline bool list_empty(const struct list_head* head)
+{
+    return head->next == head;
+}
+
+static inline void list_add_tail(struct list_head* node, struct list_head* head)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static inline void list_del_init(struct list_head* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    INIT_LIST_HEAD(node);
+}
+
+// Interrupts stay off for the walk, so it can't migrate or be preempted
+static uint64_t dcache_walk_begin(void)
+{
+    uint64_t flags = irq_save();
+    __atomic_add_fetch(&dcache_walkers[smp_cpu_id()].seq, 1, __ATOMIC_SEQ_CST);
+    return flags;
+}
+
+static void dcache_walk_end(uint64_t flags)
+{
+    __atomic_add_fetch(&dcache_walkers[smp_cpu_id()].seq, 1, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+// Wait out every walk that may still see dentries unlinked before the call
+static void dcache_synchronize(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int self = smp_cpu_id();
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu == self) continue;
+        uint64_t seq = __atomic_load_n(&dcache_walkers[cpu].seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) continue;
+        while (__atomic_load_n(&dcache_walkers[cpu].seq, __ATOMIC_ACQUIRE) == seq) {
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+// FNV-1a
+static uint32_t d_name_hash(const unsigned char* name, unsigned int len)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned int i = 0; i < len; i++) {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline struct dentry** d_bucket(const struct dentry* parent, uint32_t hash)
+{
+    uint32_t mix = hash ^ (uint32_t)((uintptr_t)parent >> 4);
+    return &dentry_hashtable[(mix * 0x9E3779B1u) >> (32 - DCACHE_HASH_BITS)];
+}
+
+// Chain walk, with dcache_lock or inside a walk section; no reference taken
+static struct dentry* __d_lookup(const struct dentry* parent, const struct qstr* name)
+{
+    struct dentry* d = __atomic_load_n(d_bucket(parent, name->hash), __ATOMIC_ACQUIRE);
+    for (; d; d = __atomic_load_n(&d->d_hash_next, __ATOMIC_ACQUIRE)) {
+        if (d->d_parent == parent && d->d_name_hash == name->hash &&
+            d->d_name_len == name->len && (d->d_flags & DCACHE_HASHED) &&
+            memcmp(d->d_name, name->name, name->len) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// A reference on a dentry nobody's reference keeps alive; fails once reclaimed
+static bool dget_unless_dead(struct dentry* dentry)
+{
+    uint32_t count = __atomic_load_n(&dentry->d_count, __ATOMIC_RELAXED);
+    do {
+        if (count & DENTRY_DEAD) return false;
+    } while (!__atomic_compare_exchange_n(&dentry->d_count, &count, count + 1, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+}
+
+struct dentry* dget(struct dentry* dentry)
+{
+    if (dentry) __atomic_add_fetch(&dentry->d_count, 1, __ATOMIC_RELAXED);
+    return dentry;
+}
+
+// Out of the hash; walkers already on it can still step past
+static void d_unhash_locked(struct dentry* dentry)
+{
+    if (!(dentry->d_flags & DCACHE_HASHED)) return;
+    struct dentry** link = d_bucket(dentry->d_parent, dentry->d_name_hash);
+    while (*link != dentry) link = &(*link)->d_hash_next;
+    __atomic_store_n(link, dentry->d_hash_next, __ATOMIC_RELEASE);
+    __atomic_and_fetch(&dentry->d_flags, ~DCACHE_HASHED, __ATOMIC_RELAXED);
+}
+
+// Unlink a dentry whose count went to DENTRY_DEAD; lock held
+static void d_kill_locked(struct dentry* dentry)
+{
+    d_unhash_locked(dentry);
+    if (dentry->d_flags & DCACHE_LRU) {
+        list_del_init(&dentry->d_lru);
+        __atomic_and_fetch(&dentry->d_flags, ~DCACHE_LRU, __ATOMIC_RELAXED);
+        nr_unused--;
+    }
+    list_del_init(&dentry->d_child);
+    nr_dentry--;
+}
+
+// Free a killed dentry no walk can still see, then drop the references
+// it held on its inode and parent
+static void d_release(struct dentry* dentry)
+{
+    struct dentry* parent = dentry->d_parent;
+    struct inode* inode = dentry->d_inode;
+    if (dentry->d_name) kfree(dentry->d_name);
+    kfree(dentry);
+    iput(inode);
+    dput(parent);
+}
+
+// Free killed dentries (chained on d_lru) after a grace period
+static void d_free_killed(struct list_head* killed)
+{
+    if (list_empty(killed)) return;
+    dcache_synchronize();
+    while (!list_empty(killed)) {
+        struct dentry* dentry = d_lru_entry(killed->next);
+        list_del_init(&dentry->d_lru);
+        d_release(dentry);
+    }
+}
+
+// Walks run with interrupts off, so an RCU grace period covers them too
+static void d_release_rcu(rcu_head_t* head)
+{
+    d_release((struct dentry*)((char*)head - __builtin_offsetof(struct dentry, d_rcu)));
+}
+
+void dput(struct dentry* dentry)
+{
+    if (!dentry || __atomic_sub_fetch(&dentry->d_count, 1, __ATOMIC_RELEASE) != 0) return;
+
+    struct list_head killed = { &killed, &killed };
+    uint64_t flags = spin_lock_irqsave(&dcache_lock);
+    if (dentry->d_flags & DCACHE_HASHED) {
+        // Stays cached: unused from now on
+        if (!(dentry->d_flags & DCACHE_LRU)) {
+            list_add_tail(&dentry->d_lru, &dentry_unused);
+            __atomic_or_fetch(&dentry->d_flags, DCACHE_LRU, __ATOMIC_RELAXED);
+            nr_unused++;
+        }
+    } else {
+        uint32_t unused = 0;
+        if (__atomic_compare_exchange_n(&dentry->d_count, &unused, DENTRY_DEAD, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            d_kill_locked(dentry);
+            list_add_tail(&dentry->d_lru, &killed);
+        }
+    }
+    spin_unlock_irqrestore(&dcache_lock, flags);
+    d_free_killed(&killed);
+}
+
+/*
+ * Reclaim up to count unused dentries, oldest first; looked-up ones get a
+ * second pass. Returns how many were unlinked. Called from the PMM's
+ * out-of-memory path, which may hold any lock (the heap's included): the
+ * cache lock is only tried, and the dentries are freed - and their inode
+ * and parent references dropped - later, from the rcu task.
+ */
+size_t dcache_shrink(size_t count)
+{
+    uint64_t flags = irq_save();
+    if (!spin_trylock(&dcache_lock)) {
+        irq_restore(flags);
+        return 0;
+    }
+
+    struct list_head killed = { &killed, &killed };
+    size_t freed = 0;
+    size_t budget = nr_unused;
+    while (freed < count && budget-- > 0 && !list_empty(&dentry_unused)) {
+        struct dentry* dentry = d_lru_entry(dentry_unused.next);
+        list_del_init(&dentry->d_lru);
+        __atomic_and_fetch(&dentry->d_flags, ~DCACHE_LRU, __ATOMIC_RELAXED);
+        nr_unused--;
+
+        if (dentry->d_count != 0) continue;  // In use again: back on at its next dput
+        if (dentry->d_flags & DCACHE_REFERENCED) {
+            __atomic_and_fetch(&dentry->d_flags, ~DCACHE_REFERENCED, __ATOMIC_RELAXED);
+            list_add_tail(&dentry->d_lru, &dentry_unused);
+            __atomic_or_fetch(&dentry->d_flags, DCACHE_LRU, __ATOMIC_RELAXED);
+            nr_unused++;
+            continue;
+        }
+
+        uint32_t unused = 0;
+        if (!__atomic_compare_exchange_n(&dentry->d_count, &unused, DENTRY_DEAD, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;  // A walker just pinned it
+        }
+        d_kill_locked(dentry);
+        list_add_tail(&dentry->d_lru, &killed);
+        freed++;
+    }
+    dcache_pruned += freed;
+    spin_unlock_irqrestore(&dcache_lock, flags);
+
+    while (!list_empty(&killed)) {
+        struct dentry* dentry = d_lru_entry(killed.next);
+        list_del_init(&dentry->d_lru);
+        call_rcu(&dentry->d_rcu, d_release_rcu);
+    }
+    return freed;
+}
+
+// Create a new dentry, referenced (and holding a reference on parent)
+struct dentry* d_alloc(struct dentry* parent, const struct qstr* name)
+{
+    if (nr_unused > DCACHE_MAX_UNUSED) {
+        dcache_shrink(DCACHE_PRUNE_BATCH);
+    }
+
+    struct dentry* dentry = kmalloc(sizeof(struct dentry));
+    if (!dentry) {
+        return NULL;
+    }
+
+    if (name) {
+        dentry->d_name = kmalloc_nozero(name->len + 1);
+        if (!dentry->d_name) {
+            kfree(dentry);
+            return NULL;
+        }
+        memcpy(dentry->d_name, name->name, name->len);
+        dentry->d_name[name->len] = '\0';
+        dentry->d_name_len = name->len;
+        dentry->d_name_hash = d_name_hash(name->name, name->len);
+    }
+
+    dentry->d_parent = dget(parent);
+    dentry->d_count = 1;
+
+    // Initialize list heads
+    INIT_LIST_HEAD(&dentry->d_child);
+    INIT_LIST_HEAD(&dentry->d_subdirs);
+    INIT_LIST_HEAD(&dentry->d_lru);
+
+    uint64_t flags = spin_lock_irqsave(&dcache_lock);
+    if (parent) list_add_tail(&dentry->d_child, &parent->d_subdirs);
+    nr_dentry++;
+    spin_unlock_irqrestore(&dcache_lock, flags);
+
+    return dentry;
+}
+
+// Free a dentry that never went into the cache
+void d_free(struct dentry* dentry)
+{
+    if (!dentry) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&dcache_lock);
+    list_del_init(&dentry->d_child);
+    nr_dentry--;
+    spin_unlock_irqrestore(&dcache_lock, flags);
+
+    iput(dentry->d_inode);
+    dput(dentry->d_parent);
+    if (dentry->d_name) {
+        kfree(dentry->d_name);
+    }
+    kfree(dentry);
+}
+
+// Root dentry of a filesystem; never hashed (it has no parent to hash by).
+// Takes over the reference on root, dropped here if out of memory.
+struct dentry* d_make_root(struct inode* root)
+{
+    static const struct qstr slash = { (const unsigned char*)"/", 1, 0 };
+    struct dentry* dentry = d_alloc(NULL, &slash);
+    if (dentry) {
+        d_instantiate(dentry, root);
+    } else {
+        iput(root);
+    }
+    return dentry;
+}
+
+// The dentry takes over the caller's reference on inode
+void d_instantiate(struct dentry* dentry, struct inode* inode)
+{
+    __atomic_store_n(&dentry->d_inode, inode, __ATOMIC_RELEASE);
+}
+
+// Fill in a looked-up dentry and make it findable; a name that was cached
+// meanwhile by another lookup keeps that entry, and this one stays private
+void d_add(struct dentry* dentry, struct inode* inode)
+{
+    struct qstr name = { (const unsigned char*)dentry->d_name, dentry->d_name_len,
+                         dentry->d_name_hash };
+    d_instantiate(dentry, inode);
+
+    uint64_t flags = spin_lock_irqsave(&dcache_lock);
+    if (dentry->d_parent && !(dentry->d_flags & DCACHE_HASHED) &&
+        !__d_lookup(dentry->d_parent, &name)) {
+        struct dentry** bucket = d_bucket(dentry->d_parent, dentry->d_name_hash);
+        dentry->d_hash_next = *bucket;
+        __atomic_or_fetch(&dentry->d_flags, DCACHE_HASHED, __ATOMIC_RELAXED);
+        __atomic_store_n(bucket, dentry, __ATOMIC_RELEASE);
+    }
+    spin_unlock_irqrestore(&dcache_lock, flags);
+}
+
+// Forget a cached name (it changed on disk); freed with its last reference
+void d_drop(struct dentry* dentry)
+{
+    uint64_t flags = spin_lock_irqsave(&dcache_lock);
+    d_unhash_locked(dentry);
+    spin_unlock_irqrestore(&dcache_lock, flags);
+}
+
+// Cached child of parent, referenced; NULL if not cached (negative
+// entries are returned: check d_inode)
+struct dentry* d_lookup(struct dentry* parent, const struct qstr* name)
+{
+    struct qstr q = *name;
+    q.hash = d_name_hash(name->name, name->len);
+
+    uint64_t flags = spin_lock_irqsave(&dcache_lock);
+    struct dentry* dentry = __d_lookup(parent, &q);
+    if (dentry && !dget_unless_dead(dentry)) dentry = NULL;
+    spin_unlock_irqrestore(&dcache_lock, flags);
+
+    if (dentry) __atomic_or_fetch(&dentry->d_flags, DCACHE_REFERENCED, __ATOMIC_RELAXED);
+    return dentry;
+}
+
+void dcache_get_stats(void)
+{
+    KINFO("=== Dentry Cache Statistics ===");
+    KINFO("Dentries: %lu (%lu unused)", nr_dentry, nr_unused);
+    KINFO("Lookups: %lu hits (%lu negative), %lu misses", dcache_hits + dcache_negative_hits,
+          dcache_negative_hits, dcache_misses);
+    KINFO("Pruned: %lu, lockless walks restarted: %lu", dcache_pruned, walk_restarts);
+}
+
+// ============================================================================
+// INODE CACHE
+// ============================================================================
+
+#define ICACHE_HASH_BITS   12
+#define ICACHE_HASH_SIZE   (1 << ICACHE_HASH_BITS)
+#define ICACHE_MAX_UNUSED  4096          // icache_prune() trims to this
+
+/*
+ * Inodes hash by (superblock, inode number) and are reference counted: a
+ * lookup that finds one everybody has dropped takes it off the LRU (lazily,
+ * the scan skips it) instead of reading it in again. inode_lock covers the
+ * hash, the LRU, the per-superblock lists, i_count and i_state (whose bits
+ * change atomically all the same: I_DIRTY is set without it); nothing
+ * allocates or sleeps while holding it. An inode being read in (I_NEW) or torn down
+ * (I_FREEING) makes lookups of its number wait on inode_wq.
+ */
+static struct inode* inode_hashtable[ICACHE_HASH_SIZE];
+static spinlock_t inode_lock = SPINLOCK_INIT;
+static struct list_head inode_unused = { &inode_unused, &inode_unused };
+static size_t nr_inodes = 0;               // Hashed
+static size_t nr_inodes_unused = 0;        // On the LRU (lazily: some are in use again)
+static wait_queue_t inode_wq = WAIT_QUEUE_INIT;
+
+// Statistics
+static uint64_t icache_hits = 0;
+static uint64_t icache_misses = 0;
+static uint64_t icache_evicted = 0;
+static uint64_t icache_written = 0;
+
+#define i_lru_entry(node) \
+    ((struct inode*)((char*)(node) - __builtin_offsetof(struct inode, i_lru)))
+#define i_sb_list_entry(node) \
+    ((struct inode*)((char*)(node) - __builtin_offsetof(struct inode, i_sb_list)))
+
+static inline struct inode** i_bucket(const struct super_block* sb, uint64_t ino)
+{
+    uint64_t mix = ino ^ ((uintptr_t)sb >> 4);
+    return &inode_hashtable[(mix * 0x9E3779B97F4A7C15ull) >> (64 - ICACHE_HASH_BITS)];
+}
+
+// Lock held
+static struct inode* __i_lookup(const struct super_block* sb, uint64_t ino)
+{
+    for (struct inode* inode = *i_bucket(sb, ino); inode; inode = inode->i_hash_next) {
+        if (inode->i_sb == sb && inode->i_ino == ino) return inode;
+    }
+    return NULL;
+}
+
+static void i_unhash_locked(struct inode* inode)
+{
+    if (!(inode->i_state & I_HASHED)) return;
+    struct inode** link = i_bucket(inode->i_sb, inode->i_ino);
+    while (*link != inode) link = &(*link)->i_hash_next;
+    *link = inode->i_hash_next;
+    inode->i_hash_next = NULL;
+    __atomic_and_fetch(&inode->i_state, ~I_HASHED, __ATOMIC_RELAXED);
+    nr_inodes--;
+}
+
+static void i_lru_add_locked(struct inode* inode)
+{
+    list_add_tail(&inode->i_lru, &inode_unused);
+    __atomic_or_fetch(&inode->i_state, I_LRU, __ATOMIC_RELAXED);
+    nr_inodes_unused++;
+}
+
+static void i_lru_del_locked(struct inode* inode)
+{
+    if (!(inode->i_state & I_LRU)) return;
+    list_del_init(&inode->i_lru);
+    __atomic_and_fetch(&inode->i_state, ~I_LRU, __ATOMIC_RELAXED);
+    nr_inodes_unused--;
+}
+
+// Tear down an inode marked I_FREEING; no locks held. The filesystem drops
+// its private state first, then waiters for the number look it up again.
+static void evict(struct inode* inode)
+{
+    const struct super_operations* op = inode->i_sb ? inode->i_sb->s_op : NULL;
+    if (op && op->evict_inode) op->evict_inode(inode);
+
+    uint64_t flags = spin_lock_irqsave(&inode_lock);
+    bool hashed = inode->i_state & I_HASHED;
+    i_unhash_locked(inode);
+    i_lru_del_locked(inode);
+    list_del_init(&inode->i_sb_list);
+    spin_unlock_irqrestore(&inode_lock, flags);
+
+    if (hashed) wake_up(&inode_wq);
+    vfs_destroy_inode(inode);
+}
+
+static void evict_rcu(rcu_head_t* head)
+{
+    evict((struct inode*)((char*)head - __builtin_offsetof(struct inode, i_rcu)));
+}
+
+// Evict the inodes chained on i_lru, now or (deferred) from the rcu task
+static void evict_list(struct list_head* dispose, bool deferred)
+{
+    while (!list_empty(dispose)) {
+        struct inode* inode = i_lru_entry(dispose->next);
+        list_del_init(&inode->i_lru);
+        if (deferred) {
+            call_rcu(&inode->i_rcu, evict_rcu);
+        } else {
+            evict(inode);
+        }
+    }
+}
+
+static struct inode* inode_alloc(struct super_block* sb)
 {
     struct inode* inode = vfs_alloc_inode(sb);
     if (!inode) {
@@ -243,60 +759,419 @@ struct inode* new_inode(struct super_block* sb)
     inode->i_fop = NULL;
     inode->i_private = NULL;
 
+    inode->i_hash_next = NULL;
+    inode->i_count = 1;
+    inode->i_state = 0;
+    inode->i_mapping = NULL;
+    INIT_LIST_HEAD(&inode->i_lru);
+    INIT_LIST_HEAD(&inode->i_sb_list);
     return inode;
 }
 
-// Create a new dentry
-struct dentry* d_alloc(struct dentry* parent, const struct qstr* name)
+// Create a new inode with operations, referenced and not hashed
+struct inode* new_inode(struct super_block* sb)
 {
-    struct dentry* dentry = kmalloc(sizeof(struct dentry));
-    if (!dentry) {
-        return NULL;
+    struct inode* inode = inode_alloc(sb);
+    if (inode && sb && sb->s_inodes.next) {
+        uint64_t flags = spin_lock_irqsave(&inode_lock);
+        list_add_tail(&inode->i_sb_list, &sb->s_inodes);
+        spin_unlock_irqrestore(&inode_lock, flags);
     }
+    return inode;
+}
 
-    memset(dentry, 0, sizeof(struct dentry));
+/*
+ * The cached inode ino of sb, referenced. A miss allocates one, hashed
+ * with I_NEW set: the caller reads it in and calls unlock_new_inode(), or
+ * iget_failed(). NULL only when out of memory.
+ */
+struct inode* iget_locked(struct super_block* sb, uint64_t ino)
+{
+    struct inode* fresh = NULL;
+    wait_entry_t wait;
 
-    if (name) {
-        dentry->d_name = kmalloc(name->len + 1);
-        if (dentry->d_name) {
-            memcpy(dentry->d_name, name->name, name->len);
-            dentry->d_name[name->len] = '\0';
-            dentry->d_name_len = name->len;
+    for (;;) {
+        wait_prepare(&inode_wq, &wait);
+        uint64_t flags = spin_lock_irqsave(&inode_lock);
+        struct inode* inode = __i_lookup(sb, ino);
+        if (inode && !(inode->i_state & (I_NEW | I_FREEING))) {
+            inode->i_count++;
+            __atomic_or_fetch(&inode->i_state, I_REFERENCED, __ATOMIC_RELAXED);
+            icache_hits++;
+            spin_unlock_irqrestore(&inode_lock, flags);
+            wait_finish(&wait);
+            if (fresh) vfs_destroy_inode(fresh);
+            return inode;
+        }
+        if (inode) {
+            // Being read in or evicted: wait for it to settle
+            spin_unlock_irqrestore(&inode_lock, flags);
+            wait_schedule(&wait, WAIT_FOREVER);
+            continue;
         }
+        if (fresh) {
+            struct inode** bucket = i_bucket(sb, ino);
+            fresh->i_ino = ino;
+            fresh->i_state = I_NEW | I_HASHED;
+            fresh->i_hash_next = *bucket;
+            *bucket = fresh;
+            if (sb->s_inodes.next) list_add_tail(&fresh->i_sb_list, &sb->s_inodes);
+            nr_inodes++;
+            icache_misses++;
+            spin_unlock_irqrestore(&inode_lock, flags);
+            wait_finish(&wait);
+            return fresh;
+        }
+        spin_unlock_irqrestore(&inode_lock, flags);
+        wait_finish(&wait);
+
+        // Allocate unlocked, then look again: it may have been added meanwhile
+        fresh = inode_alloc(sb);
+        if (!fresh) return NULL;
     }
+}
 
-    dentry->d_parent = parent;
+void unlock_new_inode(struct inode* inode)
+{
+    __atomic_and_fetch(&inode->i_state, ~I_NEW, __ATOMIC_RELEASE);
+    wake_up(&inode_wq);
+}
 
-    // Initialize list heads
-    INIT_LIST_HEAD(&dentry->d_child);
-    INIT_LIST_HEAD(&dentry->d_subdirs);
+// An I_NEW inode that couldn't be read in; its waiters look it up again
+void iget_failed(struct inode* inode)
+{
+    uint64_t flags = spin_lock_irqsave(&inode_lock);
+    i_unhash_locked(inode);
+    __atomic_or_fetch(&inode->i_state, I_FREEING, __ATOMIC_RELAXED);
+    __atomic_and_fetch(&inode->i_state, ~I_NEW, __ATOMIC_RELAXED);
+    spin_unlock_irqrestore(&inode_lock, flags);
+    wake_up(&inode_wq);
+    evict(inode);
+}
+
+// Another reference to an inode already held; NULL if it's being evicted
+struct inode* igrab(struct inode* inode)
+{
+    uint64_t flags = spin_lock_irqsave(&inode_lock);
+    if (inode->i_state & I_FREEING) {
+        inode = NULL;
+    } else {
+        inode->i_count++;
+    }
+    spin_unlock_irqrestore(&inode_lock, flags);
+    return inode;
+}
+
+// Drop a reference: a hashed inode stays cached on the LRU, any other is
+// evicted (so the last iput of an unhashed inode must be allowed to sleep)
+void iput(struct inode* inode)
+{
+    if (!inode) return;
+
+    bool dispose = false;
+    uint64_t flags = spin_lock_irqsave(&inode_lock);
+    if (--inode->i_count == 0) {
+        if (inode->i_state & I_HASHED) {
+            if (!(inode->i_state & I_LRU)) i_lru_add_locked(inode);
+        } else if (!(inode->i_state & I_FREEING)) {
+            __atomic_or_fetch(&inode->i_state, I_FREEING, __ATOMIC_RELAXED);
+            dispose = true;
+        }
+    }
+    spin_unlock_irqrestore(&inode_lock, flags);
+
+    if (dispose) evict(inode);
+}
+
+// The filesystem's copy is out of date; written back before eviction
+void mark_inode_dirty(struct inode* inode)
+{
+    __atomic_or_fetch(&inode->i_state, I_DIRTY, __ATOMIC_RELAXED);
+}
+
+/*
+ * Call fn on every live inode of sb, referenced and with no locks held, so
+ * fn may sleep. The reference keeps each inode on the list to continue
+ * from; inodes added meanwhile may or may not be visited.
+ */
+void iterate_sb_inodes(struct super_block* sb, void (*fn)(struct inode*, void*), void* arg)
+{
+    struct inode* prev = NULL;
+    uint64_t flags = spin_lock_irqsave(&inode_lock);
+    for (struct list_head* node = sb->s_inodes.next; node != &sb->s_inodes; node = node->next) {
+        struct inode* inode = i_sb_list_entry(node);
+        if (inode->i_state & (I_NEW | I_FREEING)) continue;
+        inode->i_count++;
+        spin_unlock_irqrestore(&inode_lock, flags);
+
+        iput(prev);
+        prev = inode;
+        fn(inode, arg);
+
+        flags = spin_lock_irqsave(&inode_lock);
+    }
+    spin_unlock_irqrestore(&inode_lock, flags);
+    iput(prev);
+}
 
+// Nothing newer than the filesystem has, and optionally no cached pages.
+// Dirty pages are checked first: writeback dirties the inode (allocating
+// blocks) before it counts the page clean.
+static bool inode_clean(const struct inode* inode, bool pageless)
+{
+    const struct page_mapping* mapping = inode->i_mapping;
+    if (mapping) {
+        if (__atomic_load_n(&mapping->nr_dirty, __ATOMIC_ACQUIRE) > 0) return false;
+        if (pageless && __atomic_load_n(&mapping->nr_pages, __ATOMIC_RELAXED) > 0) return false;
+    }
+    return !(__atomic_load_n(&inode->i_state, __ATOMIC_ACQUIRE) & I_DIRTY);
+}
+
+/*
+ * Reclaim up to count unused inodes, oldest first; looked-up ones get a
+ * second pass. Without can_block (the PMM's out-of-memory path, which may
+ * hold any lock) inode_lock is only tried, only inodes with no cached
+ * pages are taken, and their eviction - which frees memory and takes
+ * locks - is left to the rcu task. With it, dirty inodes are written back
+ * through s_op->write_inode (unlocked, pinned) and left for a later pass,
+ * and clean ones go with their pages.
+ */
+static size_t icache_scan(size_t count, bool can_block)
+{
+    uint64_t flags;
+    if (can_block) {
+        flags = spin_lock_irqsave(&inode_lock);
+    } else {
+        flags = irq_save();
+        if (!spin_trylock(&inode_lock)) {
+            irq_restore(flags);
+            return 0;
+        }
+    }
+
+    struct list_head dispose = { &dispose, &dispose };
+    size_t freed = 0;
+    size_t budget = nr_inodes_unused;
+    while (freed < count && budget-- > 0 && !list_empty(&inode_unused)) {
+        struct inode* inode = i_lru_entry(inode_unused.next);
+        i_lru_del_locked(inode);
+
+        if (inode->i_count != 0) continue;  // In use again: back on at its next iput
+        if (inode->i_state & I_REFERENCED) {
+            __atomic_and_fetch(&inode->i_state, ~I_REFERENCED, __ATOMIC_RELAXED);
+            i_lru_add_locked(inode);
+            continue;
+        }
+
+        if (!inode_clean(inode, !can_block)) {
+            const struct super_operations* op = inode->i_sb ? inode->i_sb->s_op : NULL;
+            if (!can_block || !op || !op->write_inode) {
+                i_lru_add_locked(inode);
+                continue;
+            }
+            inode->i_count++;
+            spin_unlock_irqrestore(&inode_lock, flags);
+            op->write_inode(inode, NULL);
+            icache_written++;
+            iput(inode);
+            flags = spin_lock_irqsave(&inode_lock);
+            continue;
+        }
+
+        // Lookups that find it wait for the eviction; one nobody can find
+        // any more needs no wakeup, which the PMM path can't risk
+        __atomic_or_fetch(&inode->i_state, I_FREEING, __ATOMIC_RELAXED);
+        if (!can_block) i_unhash_locked(inode);
+        list_add_tail(&inode->i_lru, &dispose);
+        freed++;
+    }
+    icache_evicted += freed;
+    spin_unlock_irqrestore(&inode_lock, flags);
+
+    evict_list(&dispose, !can_block);
+    return freed;
+}
+
+// Memory pressure hook: clean inodes without cached pages, evicted later
+size_t icache_shrink(size_t count)
+{
+    return icache_scan(count, false);
+}
+
+// Trim the LRU to ICACHE_MAX_UNUSED; may sleep
+void icache_prune(void)
+{
+    size_t unused = nr_inodes_unused;
+    if (unused > ICACHE_MAX_UNUSED) {
+        icache_scan(unused - ICACHE_MAX_UNUSED, true);
+    }
+}
+
+void icache_get_stats(void)
+{
+    KINFO("=== Inode Cache Statistics ===");
+    KINFO("Inodes: %lu (%lu unused)", nr_inodes, nr_inodes_unused);
+    KINFO("Lookups: %lu hits, %lu misses", icache_hits, icache_misses);
+    KINFO("Evicted: %lu, written back by the LRU: %lu", icache_evicted, icache_written);
+}
+
+// ============================================================================
+// PATH WALK
+// ============================================================================
+
+// Next component of *path, which is advanced past it; false at the end
+static bool path_next(const char** path, struct qstr* name)
+{
+    const char* p = *path;
+    while (*p == '/') p++;
+    if (!*p) {
+        *path = p;
+        return false;
+    }
+
+    const char* start = p;
+    while (*p && *p != '/') p++;
+    name->name = (const unsigned char*)start;
+    name->len = (unsigned int)(p - start);
+    name->hash = d_name_hash(name->name, name->len);
+    *path = p;
+    return true;
+}
+
+static inline bool name_is_dot(const struct qstr* name)
+{
+    return name->len == 1 && name->name[0] == '.';
+}
+
+static inline bool name_is_dotdot(const struct qstr* name)
+{
+    return name->len == 2 && name->name[0] == '.' && name->name[1] == '.';
+}
+
+/*
+ * Follow *path from dir (referenced) as far as the dcache goes, without
+ * locks or references: up to the first name it doesn't hold, or a negative
+ * entry. Returns the dentry reached, referenced in place of dir, with
+ * *path at what is left. If that dentry was reclaimed under the walk,
+ * nothing is consumed and dir comes back.
+ */
+static struct dentry* path_walk_rcu(struct dentry* dir, const char** path)
+{
+    const char* p = *path;
+    struct dentry* dentry = dir;
+    uint64_t hits = 0, negative = 0;
+
+    uint64_t flags = dcache_walk_begin();
+    for (;;) {
+        struct qstr name;
+        const char* rest = p;
+        if (!path_next(&rest, &name)) {
+            p = rest;
+            break;
+        }
+
+        struct dentry* next;
+        if (name_is_dot(&name)) {
+            next = dentry;
+        } else if (name_is_dotdot(&name)) {
+            next = dentry->d_parent ? dentry->d_parent : dentry;
+        } else {
+            next = __d_lookup(dentry, &name);
+            if (!next) break;  // The filesystem has to look
+            if (!(next->d_flags & DCACHE_REFERENCED)) {
+                __atomic_or_fetch(&next->d_flags, DCACHE_REFERENCED, __ATOMIC_RELAXED);
+            }
+        }
+        dentry = next;
+        p = rest;
+        if (!__atomic_load_n(&dentry->d_inode, __ATOMIC_ACQUIRE)) {
+            negative++;
+            break;
+        }
+        hits++;
+    }
+    bool pinned = dentry == dir || dget_unless_dead(dentry);
+    dcache_walk_end(flags);
+
+    if (!pinned) {
+        walk_restarts++;
+        return dir;
+    }
+    dcache_hits += hits;
+    dcache_negative_hits += negative;
+    *path = p;
+    if (dentry != dir) dput(dir);
     return dentry;
 }
 
-// Free a dentry
-void d_free(struct dentry* dentry)
+// Ask dir's filesystem for name and cache the answer, negative included;
+// returns the child referenced, NULL on error
+static struct dentry* lookup_slow(struct dentry* dir, const struct qstr* name)
 {
+    if (name_is_dot(name)) return dget(dir);
+    if (name_is_dotdot(name)) return dget(dir->d_parent ? dir->d_parent : dir);
+
+    struct dentry* dentry = d_lookup(dir, name);  // Someone else may have got there
+    if (dentry) return dentry;
+
+    struct inode* inode = dir->d_inode;
+    if (!inode || !inode->i_op || !inode->i_op->lookup) {
+        return NULL;
+    }
+
+    dentry = d_alloc(dir, name);
     if (!dentry) {
-        return;
+        return NULL;
     }
+    dcache_misses++;
 
-    if (dentry->d_name) {
-        kfree(dentry->d_name);
+    struct dentry* alias = inode->i_op->lookup(inode, dentry, 0);
+    if (alias) {
+        dput(dentry);
+        return alias;
     }
-    kfree(dentry);
+    if (!(dentry->d_flags & DCACHE_HASHED)) {
+        d_add(dentry, dentry->d_inode);  // Not found is remembered too
+    }
+    return dentry;
 }
 
-// Simple path walk (basic implementation)
+void vfs_set_root(struct dentry* root)
+{
+    struct dentry* old = vfs_root;
+    vfs_root = dget(root);
+    dput(old);
+}
+
+// Resolve an absolute path: lockless through the dcache, dropping to the
+// filesystem only for names it has never seen
 struct dentry* vfs_path_lookup(const char* pathname)
 {
-    // Simplified - for now, only handle absolute paths from root
-    if (pathname[0] != '/') {
+    if (!pathname || pathname[0] != '/' || !vfs_root) {
         return NULL;
     }
 
-    // For now, return NULL (needs filesystem implementation)
-    return NULL;
+    const char* p = pathname;
+    struct dentry* dentry = dget(vfs_root);
+    for (;;) {
+        dentry = path_walk_rcu(dentry, &p);
+        if (!dentry->d_inode) {
+            dput(dentry);  // Negative: no such file
+            return NULL;
+        }
+
+        struct qstr name;
+        if (!path_next(&p, &name)) {
+            return dentry;
+        }
+
+        struct dentry* child = lookup_slow(dentry, &name);
+        dput(dentry);
+        if (!child) {
+            return NULL;
+        }
+        dentry = child;
+    }
 }
 
 
@@ -132,6 +132,7 @@ typedef struct process_attr {
     const char* name;              // Process name for debugging
     size_t stack_size;             // Stack size (default: 8192)
     int priority;                  // Scheduling priority (0-255, default: 100)
+    uint32_t sched_flags;          // SCHED_FLAG_* (e.g. SCHED_FLAG_FAIR)
     bool inherit_env;              // Inherit environment variables
     bool auto_cleanup;             // Automatically clean up on exit
     cleanup_func_t cleanup_func;    // Custom cleanup function
@@ -142,6 +143,7 @@ typedef struct process_attr {
     .name = "unnamed", \
     .stack_size = 8192, \
     .priority = 100, \
+    .sched_flags = 0, \
     .inherit_env = true, \
     .auto_cleanup = true, \
     .cleanup_func = NULL \
@@ -232,6 +234,10 @@ typedef struct {
     int visible;
     pid_t owner_pid;
     char title[64];
+    damage_t damage;      // Window-relative areas to recompose
+    bool opaque;          // No see-through pixels: hides what is below
+    uint32_t z;           // Stacking order, higher on top
+    bool pending;         // Composite at the next frame
 } wm_window_t;
 
 // Graphics context for high-level drawing
@@ -240,6 +246,9 @@ typedef struct {
     uint32_t bg_color;
     uint32_t fg_color;
     int clip_x, clip_y, clip_w, clip_h;
+    uint32_t* buffer;     // The window's pixels, mapped by graphics_begin_frame
+    int pitch;            // Pixels per row
+    damage_t* damage;     // Drawn this frame (NULL: commit the whole window)
 } graphics_context_t;
 
 // Window management API
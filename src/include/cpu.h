@@ -0,0 +1,235 @@
+/*
+ * CPU Control and Feature Header
+ * Control registers, CPUID feature bits and FPU/SSE state helpers
+ */
+
+#ifndef CPU_H
+#define CPU_H
+
+#include "types.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+// CR0 bits
+#define CR0_MP        (1UL << 1)   // Monitor coprocessor (WAIT honours TS)
+#define CR0_EM        (1UL << 2)   // x87 emulation
+#define CR0_TS        (1UL << 3)   // Task switched: next FPU/SSE use traps (#NM)
+#define CR0_NE        (1UL << 5)   // Native FPU error reporting
+
+// CR4 bits
+#define CR4_OSFXSR     (1UL << 9)  // FXSAVE/FXRSTOR and SSE enabled
+#define CR4_OSXMMEXCPT (1UL << 10) // Unmasked SSE exceptions raise #XM
+#define CR4_PCIDE      (1UL << 17) // Process-context identifiers
+#define CR4_OSXSAVE    (1UL << 18) // XSAVE/XRSTOR and XSETBV enabled
+
+// CR3 layout with PCIDs enabled
+#define CR3_PCID_MASK    0xFFFUL
+#define CR3_NOFLUSH      (1UL << 63) // Keep TLB entries tagged with this PCID
+#define PCID_COUNT       4096
+
+// SYSCALL/SYSRET MSRs
+#define MSR_EFER         0xC0000080
+#define MSR_STAR         0xC0000081  // Segment bases for SYSCALL (47:32) and SYSRET (63:48)
+#define MSR_LSTAR        0xC0000082  // 64-bit SYSCALL entry point
+#define MSR_FMASK        0xC0000084  // RFLAGS bits cleared on SYSCALL
+#define EFER_SCE         (1UL << 0)
+#define EFER_NXE         (1UL << 11) // PTE bit 63 is no-execute, not reserved
+
+// Page attribute table: eight memory types picked by a PTE's PAT/PCD/PWT bits.
+// Entry 1 (PWT alone) is write-through at reset; cpu_init makes it
+// write-combining for framebuffers. The rest keep their reset types.
+#define MSR_PAT          0x277
+#define PAT_UC           0x00ULL
+#define PAT_WC           0x01ULL
+#define PAT_WT           0x04ULL
+#define PAT_WB           0x06ULL
+#define PAT_UC_MINUS     0x07ULL
+#define PAT_VALUE        (PAT_WB | PAT_WC << 8 | PAT_UC_MINUS << 16 | PAT_UC << 24 | \
+                          PAT_WB << 32 | PAT_WT << 40 | PAT_UC_MINUS << 48 | PAT_UC << 56)
+
+// CPUID.01H feature bits
+#define CPUID_ECX_PCID   (1U << 17)
+#define CPUID_ECX_XSAVE  (1U << 26)
+#define CPUID_ECX_AVX    (1U << 28)
+#define CPUID_EDX_PAT    (1U << 16)
+#define CPUID_EDX_FXSR   (1U << 24)
+
+// CPUID.80000001H feature bits
+#define CPUID_EXT_EDX_NX (1U << 20)
+
+// CPUID.07H.0 feature bits
+#define CPUID_7_EBX_AVX2 (1U << 5)
+#define CPUID_7_EBX_ERMS (1U << 9)   // Enhanced rep movsb/stosb
+#define CPUID_7_EDX_FSRM (1U << 4)   // Fast short rep mov
+
+// XCR0: state components XSAVE manages
+#define XCR0_X87         (1U << 0)
+#define XCR0_SSE         (1U << 1)
+#define XCR0_AVX         (1U << 2)   // Upper halves of the YMM registers
+
+// FXSAVE image: 512 bytes. XSAVE area: its size from CPUID leaf 0DH.
+// Both fit the 64-byte alignment XSAVE needs.
+#define FPU_STATE_SIZE   512
+#define FPU_STATE_ALIGN  64
+
+// ============================================================================
+// TYPES
+// ============================================================================
+
+// User registers saved by syscall_entry at the top of the kernel stack
+typedef struct syscall_frame {
+    uint64_t r15, r14, r13, r12, rbp, rbx;
+    uint64_t r9, r8, r10, rdx, rsi, rdi;
+    uint64_t rip;     // RCX at SYSCALL
+    uint64_t rflags;  // R11 at SYSCALL
+    uint64_t rsp;
+} syscall_frame_t;
+
+// ============================================================================
+// INLINE HELPERS
+// ============================================================================
+
+static inline uint64_t read_cr0(void)
+{
+    uint64_t v;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint64_t v)
+{
+    __asm__ volatile("mov %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline uint64_t read_cr3(void)
+{
+    uint64_t v;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr3(uint64_t v)
+{
+    __asm__ volatile("mov %0, %%cr3" : : "r"(v) : "memory");
+}
+
+static inline uint64_t read_cr4(void)
+{
+    uint64_t v;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint64_t v)
+{
+    __asm__ volatile("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b,
+                         uint32_t* c, uint32_t* d)
+{
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                     : "a"(leaf), "c"(0));
+}
+
+// Clear / set CR0.TS (lazy FPU switching)
+static inline void fpu_clts(void)
+{
+    __asm__ volatile("clts" ::: "memory");
+}
+
+static inline void fpu_stts(void)
+{
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+// Set by cpu_init() on the boot CPU: XSAVE with AVX enabled, and the
+// bytes of FPU state each task needs (FPU_STATE_SIZE without XSAVE)
+extern bool fpu_xsave;
+extern uint32_t fpu_state_size;
+
+static inline void fpu_save(void* state)
+{
+    if (fpu_xsave) {
+        __asm__ volatile("xsave64 (%0)" : : "r"(state), "a"(XCR0_X87 | XCR0_SSE | XCR0_AVX), "d"(0)
+                         : "memory");
+    } else {
+        __asm__ volatile("fxsave64 (%0)" : : "r"(state) : "memory");
+    }
+}
+
+static inline void fpu_restore(const void* state)
+{
+    if (fpu_xsave) {
+        __asm__ volatile("xrstor64 (%0)" : : "r"(state), "a"(XCR0_X87 | XCR0_SSE | XCR0_AVX), "d"(0)
+                         : "memory");
+    } else {
+        __asm__ volatile("fxrstor64 (%0)" : : "r"(state) : "memory");
+    }
+}
+
+static inline void xsetbv(uint32_t reg, uint64_t value)
+{
+    __asm__ volatile("xsetbv" : : "c"(reg), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void fpu_init_state(void)
+{
+    __asm__ volatile("fninit" ::: "memory");
+}
+
+// ============================================================================
+// FUNCTIONS
+// ============================================================================
+
+// Per-CPU control register setup (cpu.c); run on the BSP and every AP
+void cpu_init(void);
+bool cpu_has_pcid(void);
+bool cpu_has_avx2(void);  // Usable: the CPU has it and its state is switched
+bool cpu_has_pat_wc(void);  // PAGE_WRITE_COMBINE maps write-combining (else write-through)
+
+// Architectural performance counters (pmu.c). Every CPU counts
+// instructions, cycles and LLC misses for per-task accounting; sampling
+// adds a cycle counter whose overflow NMI records RIP and a kernel stack.
+typedef struct {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t llc_misses;
+} pmu_counts_t;
+
+void pmu_init_cpu(void);     // After lapic_init() on each CPU
+bool pmu_available(void);
+void pmu_account(pmu_counts_t* acc);  // Add this CPU's counts since the last call (IRQs off)
+void pmu_tick(void);         // LAPIC tick: pick up a changed sampling setup
+bool pmu_handle_nmi(uint64_t rip, uint64_t rbp, uint64_t rsp, bool user);  // false: not a PMI
+int pmu_profile_start(uint32_t period);  // Sample every period cycles
+void pmu_profile_stop(void);
+void pmu_profile_report(size_t top);     // Hottest kernel RIPs, for `make symbolize`
+void pmu_get_stats(void);
+void scheduler_get_task_counters(pmu_counts_t* out);  // Running task so far (scheduler.c)
+int64_t sys_prof_ctl(uint32_t period);   // 0: stop and log the report
+int64_t sys_task_counters(pmu_counts_t* out);
+
+// Per-CPU task state segments (gdt.c). Vectors that can arrive with a
+// broken kernel stack, or at any instruction, run on their own IST stacks.
+#define IST_DOUBLE_FAULT 1
+#define IST_NMI          2
+#define IST_MACHINE_CHECK 3
+#define IST_COUNT        3
+
+void tss_install(int cpu);                       // Descriptor, IST stacks, LTR
+void tss_set_percpu(int cpu, void* percpu);      // Where the IST stubs find GS
+void tss_set_rsp0(int cpu, uintptr_t rsp0);      // Stack for interrupts from ring 3
+
+// Context switch primitives (context.asm)
+void switch_context(uint64_t** prev_sp, uint64_t* next_sp);
+void task_entry_trampoline(void);
+void task_user_trampoline(void);
+
+// SYSCALL entry (syscall.asm)
+void syscall_entry(void);
+void task_fork_trampoline(void);  // Child's first return, through the SYSCALL exit
+
+#endif // CPU_H
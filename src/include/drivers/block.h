@@ -1,7 +1,7 @@
 #ifndef BLOCK_H
 #define BLOCK_H
 
-#include "types.h"
+#include "kernel.h"
 
 typedef enum {
     BLOCK_DEVICE_TYPE_HARD_DISK,
@@ -10,15 +10,64 @@ typedef enum {
     BLOCK_DEVICE_TYPE_RAMDISK
 } block_device_type_t;
 
+// Driver submit() results besides 0 / -1
+#define BLOCK_BUSY  1   // Out of driver resources, resubmit after a completion
+
+// One transfer as a filesystem sees it. end_io() runs once, possibly in
+// interrupt context, with status 0 or -1. The buffer must be kernel memory
+// (mapped in every address space): the queue may hand it to the driver
+// long after the submitter has been switched out.
+typedef struct bio {
+    uint64_t sector;
+    uint32_t count;
+    void* buffer;
+    bool write;
+    int status;
+    void (*end_io)(struct bio* bio);
+    void* private_data;           // Owner's cookie
+    struct bio* next;             // Segment chain, in sector order
+    struct bio* parent;           // Set on the pieces of a split bio
+    volatile uint32_t remaining;  // Parent: pieces still outstanding
+} bio_t;
+
+// What the queue hands a driver: one contiguous sector range, carried in
+// the bios chain (several buffers when merged) or, when bios is NULL, in
+// buffer. done() runs once, possibly in interrupt context, with status 0
+// or -1; the request and buffers belong to the driver until then.
+typedef struct block_request {
+    uint64_t sector;
+    uint32_t count;
+    void* buffer;                 // Single segment, mapped in the submitter's address space
+    bio_t* bios;                  // Segments
+    bio_t* bios_tail;
+    uint32_t pages;               // Pages the segments span
+    bool write;
+    int status;
+    void (*done)(struct block_request* req);
+    void* private_data;           // Owner's cookie
+    void* driver_data;            // Driver's, while the request is queued
+    struct block_request* next;   // Queue link (elevator, then driver)
+} block_request_t;
+
+struct block_queue;
+
 typedef struct block_device {
     char name[32];
     block_device_type_t type;
     uint64_t sector_size;
     uint64_t total_sectors;
-    
+
     int (*read)(struct block_device* dev, uint64_t sector, uint32_t count, void* buffer);
     int (*write)(struct block_device* dev, uint64_t sector, uint32_t count, const void* buffer);
-    
+    int (*submit)(struct block_device* dev, block_request_t* req);  // NULL: synchronous only
+    int (*flush)(struct block_device* dev);   // NULL: no volatile write cache
+
+    // Request limits for submit() (0: no limit) and the in-flight depth
+    uint32_t max_sectors;
+    uint32_t max_pages;
+    uint32_t queue_depth;
+
+    struct block_queue* queue;    // Owned by block.c
     void* private_data;
 } block_device_t;
 
@@ -26,4 +75,43 @@ typedef struct block_device {
 int block_register_device(block_device_t* dev);
 block_device_t* block_get_device(const char* name);
 
+// Queue req on dev directly, bypassing the elevator (falls back to
+// read/write plus done() for sync drivers)
+int block_submit(block_device_t* dev, block_request_t* req);
+
+// Request queue: bios are merged with neighbouring sectors, sorted by LBA
+// and dispatched up to the device's queue depth
+int block_submit_bio(block_device_t* dev, bio_t* bio);
+
+// Hold dispatch while a batch of bios is queued so they can merge; plugs
+// nest, and the last unplug dispatches. Don't wait on the device while
+// holding a plug.
+void block_plug(block_device_t* dev);
+void block_unplug(block_device_t* dev);
+
+// Synchronous I/O through the queue
+int block_read(block_device_t* dev, uint64_t sector, uint32_t count, void* buffer);
+int block_write(block_device_t* dev, uint64_t sector, uint32_t count, const void* buffer);
+
+// Make every completed write durable (drive write cache to media); may sleep
+int block_flush(block_device_t* dev);
+
+// A set of bios waited for together: bio_batch_add() before submitting
+// each (it takes over end_io and private_data), then bio_batch_wait()
+typedef struct bio_batch {
+    volatile uint32_t pending;
+    volatile int status;          // -1 if any bio failed
+    wait_queue_t waiters;
+} bio_batch_t;
+
+void bio_batch_init(bio_batch_t* batch);
+void bio_batch_add(bio_batch_t* batch, bio_t* bio);
+int bio_batch_wait(bio_batch_t* batch);
+
+// A RAM-backed device of the given size, registered under name
+block_device_t* ramdisk_create(const char* name, uint64_t sectors);
+
+// Queue statistics to the log
+void block_get_stats(void);
+
 #endif // BLOCK_H
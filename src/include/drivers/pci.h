@@ -0,0 +1,61 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include "types.h"
+
+// Configuration space offsets
+#define PCI_VENDOR_ID      0x00
+#define PCI_COMMAND        0x04
+#define PCI_STATUS         0x06
+#define PCI_CLASS_REVISION 0x08
+#define PCI_BAR0           0x10
+#define PCI_CAP_POINTER    0x34
+
+// Command register bits
+#define PCI_COMMAND_MEMORY     0x0002
+#define PCI_COMMAND_MASTER     0x0004
+#define PCI_COMMAND_INTX_OFF   0x0400
+
+#define PCI_STATUS_CAP_LIST    0x0010
+
+// Capability IDs
+#define PCI_CAP_ID_MSI         0x05
+#define PCI_CAP_ID_VENDOR      0x09
+#define PCI_CAP_ID_MSIX        0x11
+
+typedef struct pci_device {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+} pci_device_t;
+
+// Configuration space access (mechanism #1, ports 0xCF8/0xCFC)
+uint32_t pci_read32(const pci_device_t* dev, uint8_t offset);
+void pci_write32(const pci_device_t* dev, uint8_t offset, uint32_t value);
+uint16_t pci_read16(const pci_device_t* dev, uint8_t offset);
+void pci_write16(const pci_device_t* dev, uint8_t offset, uint16_t value);
+
+// First function with the given class/subclass (or vendor/device ID); 0 if found
+int pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t* out);
+int pci_find_device(uint16_t vendor_id, uint16_t device_id, pci_device_t* out);
+
+uint32_t pci_read_bar(const pci_device_t* dev, int bar);
+uint64_t pci_bar_address(const pci_device_t* dev, int bar);  // Memory BAR base, 64-bit aware
+void pci_enable_bus_master(const pci_device_t* dev);
+uint8_t pci_find_capability(const pci_device_t* dev, uint8_t cap_id);  // 0 if absent
+uint8_t pci_next_capability(const pci_device_t* dev, uint8_t after, uint8_t cap_id);
+
+// Single-message MSI to address/data; turns legacy INTx off. 0 on success.
+int pci_enable_msi(const pci_device_t* dev, uint64_t address, uint16_t data);
+
+// MSI-X: table entries available (0 without the capability), then entries
+// 0..count-1 programmed from address[]/data[] and enabled; turns INTx off
+int pci_msix_count(const pci_device_t* dev);
+int pci_enable_msix(const pci_device_t* dev, const uint64_t* address, const uint16_t* data, int count);
+
+#endif // PCI_H
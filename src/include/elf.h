@@ -111,9 +111,12 @@ typedef struct {
     uint64_t sh_entsize;   // Entry size if section holds table
 } __attribute__((packed)) elf64_shdr_t;
 
+struct vm_context;
+struct inode;
+
 // Function prototypes
 int elf_validate(const void* elf_data, size_t size);
-int elf_load(const void* elf_data, size_t size, uint64_t* entry_point);
+int elf_load(struct vm_context* ctx, struct inode* inode, uint64_t* entry_point);
 uint64_t elf_get_entry(const void* elf_data);
 
 #endif // ELF_H
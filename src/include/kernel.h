@@ -32,26 +32,130 @@ void kvprintf(const char* fmt, va_list args);
 #define KWARN(fmt, ...)  do { kprintf("[WARN]  " fmt "\n", ##__VA_ARGS__); } while(0)
 #define KERROR(fmt, ...) do { kprintf("[ERROR] " fmt "\n", ##__VA_ARGS__); } while(0)
 
+// ============================================================================
+// TRACING
+// ============================================================================
+
+// Static tracepoints (implemented in kernel/trace.c). TRACE() stores a
+// binary record in the executing CPU's ring; nothing is formatted, and a
+// disabled category costs one load and branch. Rings overwrite their
+// oldest records and are read with trace_read() or a read-only mapping.
+#define TRACE_RING_RECORDS 4096       // Per CPU, power of two
+
+// Categories, enabled by bit in trace_mask
+#define TRACE_CAT_SCHED    0
+#define TRACE_CAT_MM       1
+#define TRACE_CAT_SYSCALL  2
+#define TRACE_CAT_PROF     3          // Set by pmu_profile_start()
+#define TRACE_CAT_ALL      0xFFFFFFFFU
+
+// Event IDs: category in the high byte
+#define TRACE_ID(cat, n)   (((cat) << 8) | (n))
+#define TRACE_SCHED_SWITCH TRACE_ID(TRACE_CAT_SCHED, 1)    // prev pid, next pid
+#define TRACE_SCHED_STEAL  TRACE_ID(TRACE_CAT_SCHED, 2)    // pid, victim CPU
+#define TRACE_PMM_ALLOC    TRACE_ID(TRACE_CAT_MM, 1)       // phys, pages
+#define TRACE_PMM_FREE     TRACE_ID(TRACE_CAT_MM, 2)       // phys, pages
+#define TRACE_PAGE_FAULT   TRACE_ID(TRACE_CAT_MM, 3)       // address, error code
+#define TRACE_PAGE_MAPPED  TRACE_ID(TRACE_CAT_MM, 4)       // address, phys
+#define TRACE_COW_FAULT    TRACE_ID(TRACE_CAT_MM, 5)       // address, 1 if reused
+#define TRACE_SYSCALL      TRACE_ID(TRACE_CAT_SYSCALL, 1)  // number, cycles
+#define TRACE_PROF_SAMPLE  TRACE_ID(TRACE_CAT_PROF, 1)     // RIP, 1 if user mode
+#define TRACE_PROF_STACK   TRACE_ID(TRACE_CAT_PROF, 2)     // Two return addresses, callee first
+
+typedef struct {
+    uint64_t tsc;
+    uint16_t id;
+    uint16_t cpu;
+    uint32_t pid;
+    uint64_t arg[2];
+} trace_record_t;                     // 32 bytes
+
+// One per CPU, written only by that CPU. head counts records ever written;
+// a reader keeps the ones still within TRACE_RING_RECORDS of it afterwards.
+typedef struct {
+    volatile uint64_t head;
+    uint8_t pad[56];
+    trace_record_t records[TRACE_RING_RECORDS];
+} __attribute__((aligned(64))) trace_ring_t;
+
+// What sys_trace_map() maps: the header, then a ring per CPU
+typedef struct {
+    uint32_t cpus;
+    uint32_t ring_records;
+    uint64_t tsc_start;               // TSC when tracing was set up
+    uint8_t pad[48];
+    trace_ring_t rings[];
+} trace_buffer_t;
+
+extern volatile uint32_t trace_mask;
+
+void trace_init(void);
+void trace_record(uint16_t id, uint64_t a0, uint64_t a1);
+uint32_t trace_set_mask(uint32_t mask);  // Previous mask
+size_t trace_read(int cpu, uint64_t* cursor, trace_record_t* out, size_t max);
+void trace_dump(size_t per_cpu);         // Print the latest records of each CPU
+void trace_get_stats(void);
+
+#define TRACE(id, a0, a1) do { \
+    if (__builtin_expect(trace_mask & (1U << ((id) >> 8)), 0)) \
+        trace_record((id), (uint64_t)(a0), (uint64_t)(a1)); \
+} while (0)
+
+int64_t sys_trace_ctl(uint32_t mask);    // Previous mask
+trace_buffer_t* sys_trace_map(void);
+int64_t sys_trace_read(int cpu, uint64_t* cursor, trace_record_t* out, size_t max);
+
 // ============================================================================
 // MEMORY MANAGEMENT
 // ============================================================================
 
+// Allocation flags (gfp_t)
+#define GFP_KERNEL  0x0        // Normal kernel allocation
+#define GFP_ZERO    0x1        // Return zeroed memory
+#define GFP_NORECLAIM 0x2      // PMM: no shrinkers on failure (caller is inside the heap)
+
 // Core memory allocation (implemented in kheap.c)
 void* kmalloc(size_t size);
+void* kmalloc_flags(size_t size, gfp_t flags);
+void* kmalloc_nozero(size_t size);
 void* krealloc(void* ptr, size_t size);
 void kfree(void* ptr);
 void* kmalloc_tracked(size_t size, const char* tag);
+void* kmalloc_tracked_flags(size_t size, const char* tag, gfp_t flags);
 void kfree_tracked(void* ptr);
+void kheap_drain_magazines(void);
+void kheap_drain_ipi(void);  // APIC_DRAIN_VECTOR handler
+size_t kheap_shrink(void);
+size_t page_cache_shrink(size_t pages);  // Clean cached pages back to the PMM
+size_t dcache_shrink(size_t count);      // Unused dentries back to the heap (via call_rcu)
+size_t icache_shrink(size_t count);      // Clean unused inodes back to the heap (via call_rcu)
 
 // Physical memory management (implemented in pmm.c)
+typedef struct page {
+    volatile uint32_t refcount;  // Mappings holding the frame (0 = free or reserved)
+    volatile uint32_t flags;     // PMM state bits (pmm.c)
+} page_t;
+
 uintptr_t pmm_alloc_page(void);
 uintptr_t pmm_alloc_pages(size_t num_pages);
+uintptr_t pmm_alloc_pages_node(size_t num_pages, int node);  // NUMA_NO_NODE: the task's policy
+uintptr_t pmm_alloc_pages_gfp(size_t num_pages, int node, gfp_t gfp);
 void pmm_free_page(void* page);
 void pmm_free_pages(uintptr_t addr, size_t num_pages);
+page_t* pmm_page(uintptr_t addr);
+void pmm_page_ref(uintptr_t addr);
+uint32_t pmm_page_unref(uintptr_t addr, size_t num_pages);  // Frees on the last reference
+uint32_t pmm_page_refcount(uintptr_t addr);
+void pmm_split_pages(uintptr_t addr, size_t num_pages);      // One owner: count each frame alone
+void pmm_drain_cpu_caches(void);
 void pmm_init(void);
 uint64_t pmm_get_total_pages(void);
 uint64_t pmm_get_free_pages(void);
 void pmm_get_stats(uint64_t* req, uint64_t* fail, uint64_t* hit, uint64_t* frag);
+uintptr_t pmm_alloc_zeroed_page(void);  // From the pre-zeroed pool when it has one
+void pmm_zero_pool_init(void);          // Start the idle-time zeroing task
+void pmm_get_zero_pool_stats(size_t* pooled, size_t* hits, size_t* misses);
+bool pmm_get_node_stats(int node, size_t* free_pages, size_t* local, size_t* fallback);
 
 // Memory statistics
 typedef struct {
@@ -64,6 +168,8 @@ typedef struct {
 // Multiboot information (passed from bootloader)
 extern uint32_t multiboot_info;
 extern uint32_t multiboot_magic;
+const char* kernel_cmdline(void);             // GRUB's command line, "" if none
+bool kernel_cmdline_has(const char* option);  // option appears as a whole word
 
 #define PAGE_SIZE 4096
 #define PHYSICAL_MEMORY_LIMIT 0xFFFFFFFF // 4GB limit for now
@@ -74,6 +180,14 @@ extern uint32_t multiboot_magic;
 // SCHEDULER AND PROCESSES
 // ============================================================================
 
+// Maximum number of CPUs the scheduler and per-CPU caches are sized for
+#define MAX_CPUS 16
+
+// Task creation flags (scheduler_create_task_ex)
+#define SCHED_FLAG_FAIR     0x1    // Schedule by virtual runtime instead of fixed quanta
+#define SCHED_FLAG_BOUND    0x2    // Run only on the CPU given by SCHED_FLAG_CPU()
+#define SCHED_FLAG_CPU(cpu) (SCHED_FLAG_BOUND | ((uint32_t)(cpu) << 8))
+
 // Process states
 typedef enum {
     TASK_RUNNING,
@@ -91,6 +205,9 @@ typedef struct scheduler_task_info {
     int priority;
     uint64_t creation_time_ms;
     uint64_t cpu_time_ms;
+    uint64_t instructions;     // Performance counters (0 without a PMU)
+    uint64_t cycles;
+    uint64_t llc_misses;
 } scheduler_task_info_t;
 
 // Forward declaration for VMA
@@ -98,10 +215,18 @@ struct vma;
 
 // Virtual memory context
 typedef struct vm_context {
-    struct vma* vma_list;         // List of VMAs
+    struct vma* vma_list;         // VMAs in address order
+    struct vma* vma_tree;         // Same VMAs, balanced tree keyed by start
+    struct vma* vma_cache;        // Last VMA found by a lookup
+    uint32_t vma_count;
     uintptr_t brk;                // Current program break (heap end)
     uintptr_t mmap_base;          // Base for mmap allocations
     uint64_t* page_dir;           // Page directory pointer (PML4)
+    uint16_t pcid;                // TLB tag (0 = not yet assigned)
+    volatile uint32_t tlb_stale;  // CPUs whose tagged TLB entries are out of date
+    volatile uint32_t cpu_loaded; // CPUs with this context in CR3 right now
+    volatile uint32_t refcount;   // Tasks using it, and CPUs keeping it as active_mm
+    struct rcu_head rcu;          // Teardown after the last reference
 } vm_context_t;
 
 // Process entry point
@@ -113,17 +238,36 @@ void kernel_panic(const char* file, int line, const char* msg);
 
 // Scheduler functions (implemented in scheduler.c)
 pid_t scheduler_create_task(void (*entry)(void*), void* arg, size_t stack_size, int priority, const char* name);
+pid_t scheduler_create_task_ex(void (*entry)(void*), void* arg, size_t stack_size, int priority, const char* name, uint32_t flags);
 int scheduler_kill_task(pid_t pid);
 void scheduler_yield(void);
 void schedule_yield(void);  // Alias
 void scheduler_schedule(void); // Main scheduler function
 void scheduler_tick(void);  // Timer tick handler for scheduler
+void scheduler_finish_switch(void);  // First thing a task runs after switch_context
+void scheduler_fpu_trap(void);  // #NM: load the current task's FPU/SSE state
+
+// Borrow the FPU/SSE/AVX registers for kernel code (code built with SIMD
+// targets, like the blitters). Interrupts are off in between.
+uint64_t kernel_fpu_begin(void);
+void kernel_fpu_end(uint64_t flags);
 pid_t scheduler_get_current_task_id(void);
+vm_context_t* scheduler_get_current_vm(void);  // NULL for a kernel thread
+int scheduler_get_current_cpu(void);
+int scheduler_mem_node(void);          // Node for the running task's allocations
+int scheduler_set_mem_node(int node);  // NUMA_NO_NODE: allocate where it runs
+int scheduler_cpu_online(int cpu);  // AP joins the scheduler (smp.c)
 int scheduler_get_task_state(pid_t pid);
 int scheduler_get_task_info(pid_t pid, scheduler_task_info_t* info);
 void scheduler_terminate(void);  // Terminate current task
+void scheduler_exit(int code);   // ...with an exit status (task_exit_t)
 pid_t scheduler_create_task_fork(void);  // Fork current task
+int scheduler_exec(vm_context_t* vm, uint64_t entry, uint64_t user_stack);  // Replace the current program
+struct task_exit;
+pid_t scheduler_create_user_task(vm_context_t* vm, void* entry, void* user_stack,
+                                 struct task_exit* notify);  // Ring 3, in vm (NULL: the current one)
 void schedule_delay(uint32_t ms);  // Delay for milliseconds
+void schedule_delay_us(uint64_t us);  // Delay for microseconds
 
 // ============================================================================
 // STRING FUNCTIONS
@@ -145,15 +289,319 @@ int sprintf(char* str, const char* format, ...);
 void interrupt_init(void);
 // interrupt_register_handler is not currently implemented
 
+// Disable interrupts on this CPU, returning the previous RFLAGS
+static inline uint64_t irq_save(void)
+{
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+// Restore the interrupt flag saved by irq_save()
+static inline void irq_restore(uint64_t flags)
+{
+    if (flags & 0x200) {
+        __asm__ volatile("sti" ::: "memory");
+    }
+}
+
+// ============================================================================
+// SPINLOCKS
+// ============================================================================
+
+// Ticket lock: CPUs get the lock in the order they asked for it, so none
+// starves under contention. Free while owner == next.
+typedef union {
+    volatile uint32_t word;
+    struct {
+        volatile uint16_t owner;   // Ticket being served
+        volatile uint16_t next;    // Next ticket to hand out
+    };
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+// Waits for a ticket, counting the contention (sync.c)
+void spin_lock_contended(spinlock_t* lock, uint16_t ticket);
+
+static inline void spin_lock_init(spinlock_t* lock)
+{
+    lock->word = 0;
+}
+
+static inline void spin_lock(spinlock_t* lock)
+{
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        spin_lock_contended(lock, ticket);
+    }
+}
+
+static inline bool spin_trylock(spinlock_t* lock)
+{
+    uint32_t old = __atomic_load_n(&lock->word, __ATOMIC_RELAXED);
+    if ((uint16_t)old != (uint16_t)(old >> 16)) return false;
+    return __atomic_compare_exchange_n(&lock->word, &old, old + 0x10000, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void spin_unlock(spinlock_t* lock)
+{
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline bool spin_is_locked(spinlock_t* lock)
+{
+    uint32_t word = __atomic_load_n(&lock->word, __ATOMIC_RELAXED);
+    return (uint16_t)word != (uint16_t)(word >> 16);
+}
+
+// Lock and disable local interrupts; returns the flags for the unlock
+static inline uint64_t spin_lock_irqsave(spinlock_t* lock)
+{
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags)
+{
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
 // ============================================================================
 // TIMER MANAGEMENT
 // ============================================================================
 
+// One-shot kernel timer on a per-CPU timer wheel. Callbacks run in
+// interrupt context on the CPU that armed the timer and must not block.
+// ktimer_cancel() also waits for a callback running elsewhere to return.
+typedef void (*ktimer_fn_t)(void* arg);
+
+typedef struct ktimer {
+    uint64_t expires;          // Absolute monotonic time (us)
+    ktimer_fn_t fn;
+    void* arg;
+    struct ktimer* next;
+    struct ktimer** pprev;     // NULL when not queued
+    int cpu;                   // Wheel it was armed on
+} ktimer_t;
+
 // Timer functions (implemented in timer.c)
 void timer_init(void);
 void timer_tick(void);
 uint64_t timer_get_ticks(void);
+uint32_t timer_get_frequency(void);
 uint64_t time_monotonic_ms(void);
+uint64_t time_monotonic_us(void);
+uint64_t time_monotonic_ns(void);
+void timer_get_stats(void);
+
+void ktimer_init(ktimer_t* timer, ktimer_fn_t fn, void* arg);
+void ktimer_arm(ktimer_t* timer, uint64_t expires_us);
+void ktimer_arm_in(ktimer_t* timer, uint64_t delay_us);
+bool ktimer_cancel(ktimer_t* timer);
+bool ktimer_pending(ktimer_t* timer);
+
+// Clock event plumbing (LAPIC driver and scheduler)
+void timer_set_tick(bool enabled);     // Scheduler tick on this CPU
+void timer_cpu_start(void);            // LAPIC one-shot ready on this CPU
+void timer_lapic_interrupt(void);
+uint64_t timer_us_to_tsc(uint64_t us);
+bool timer_has_tsc(void);
+uint64_t timer_tsc_khz(void);  // Calibrated TSC rate, 0 without one
+void timer_get_clock(uint64_t* base, uint64_t* ns_mult);
+
+void timer_sleep(uint32_t milliseconds);
+void timer_sleep_ticks(uint32_t ticks);
+
+// ============================================================================
+// WAIT QUEUES
+// ============================================================================
+
+// A task blocks on a wait queue (optionally with a deadline parked on
+// its CPU's timer wheel) until wake_up() or the deadline. Usage:
+//
+//     wait_entry_t wait;
+//     for (;;) {
+//         wait_prepare(&wq, &wait);
+//         if (condition) break;
+//         if (wait_schedule(&wait, deadline_us) < 0) break;  // Timed out
+//     }
+//     wait_finish(&wait);
+//
+// A watcher (wait_add_watch()) stays on the queue instead: every
+// wake_up() calls its func, under the queue's lock and possibly in
+// interrupt context. epoll is built on these.
+struct wait_entry;
+typedef void (*wait_func_t)(struct wait_entry* entry);
+
+typedef struct wait_entry {
+    struct task* task;          // NULL if the caller can't block (idle/boot)
+    int cpu;                    // CPU that prepared the wait
+    struct wait_queue* wq;      // Queue prepared on (NULL for a plain sleep)
+    struct wait_entry* next;
+    bool queued;
+    volatile bool done;         // Woken or timed out
+    bool timed_out;
+    ktimer_t timer;
+    wait_func_t func;           // Watcher: called on wakeups, never dequeued by them
+    void* data;                 // For func
+} wait_entry_t;
+
+typedef struct wait_queue {
+    spinlock_t lock;
+    wait_entry_t* head;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, NULL }
+#define WAIT_FOREVER    (~0ULL)
+
+// Wait queue functions (implemented in scheduler.c)
+void wait_queue_init(wait_queue_t* wq);
+void wait_prepare(wait_queue_t* wq, wait_entry_t* entry);
+int wait_schedule(wait_entry_t* entry, uint64_t deadline_us);  // -1 on timeout
+void wait_finish(wait_entry_t* entry);
+void wake_up(wait_queue_t* wq);
+void wake_up_one(wait_queue_t* wq);
+bool wake_up_sync(wait_queue_t* wq);  // Blocking caller: run the woken task now
+void wait_add_watch(wait_queue_t* wq, wait_entry_t* entry, wait_func_t func, void* data);
+void wait_remove_watch(wait_entry_t* entry);
+void scheduler_sleep_us(uint64_t us);
+
+// Exit status of a user task, for whoever started it: it must outlive the
+// task, which fills it in and wakes wq on exit
+typedef struct task_exit {
+    wait_queue_t wq;
+    volatile bool exited;
+    int code;                   // exit() status
+} task_exit_t;
+
+#define TASK_EXIT_INIT { WAIT_QUEUE_INIT, false, 0 }
+
+int task_exit_wait(task_exit_t* notify, uint64_t deadline_us);  // -1 on timeout
+
+// ============================================================================
+// READINESS NOTIFICATION (epoll.c)
+// ============================================================================
+
+// Readiness bits (Linux values)
+#define EPOLLIN       0x001
+#define EPOLLPRI      0x002
+#define EPOLLOUT      0x004
+#define EPOLLERR      0x008
+#define EPOLLHUP      0x010
+#define EPOLLRDHUP    0x2000
+#define EPOLLONESHOT  (1u << 30)    // Disarm after one report, until EPOLL_CTL_MOD
+#define EPOLLET       (1u << 31)    // Report on changes only, not while ready
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+typedef struct epoll_event {
+    uint32_t events;
+    uint64_t data;
+} epoll_event_t;
+
+// How epoll watches an object: its current readiness (EPOLL* bits), and
+// in *wq the queue woken whenever that may change. It must not take a
+// lock the object holds while waking that queue.
+typedef uint32_t (*poll_fn_t)(void* obj, wait_queue_t** wq);
+
+typedef struct epoll epoll_t;
+
+// An interest set. epoll_wait() fills up to max events from the objects
+// that became ready, blocking until deadline_us (0: don't block,
+// WAIT_FOREVER: no deadline); it costs what is ready, not what is watched.
+epoll_t* epoll_create(void);
+void epoll_destroy(epoll_t* ep);
+int epoll_ctl(epoll_t* ep, int op, void* obj, poll_fn_t poll, const epoll_event_t* event);
+int epoll_wait(epoll_t* ep, epoll_event_t* events, int max, uint64_t deadline_us);
+
+// ============================================================================
+// ASYNCHRONOUS I/O RINGS (uring.c)
+// ============================================================================
+
+// A submission and a completion ring shared between a task and the kernel.
+// The task writes requests at sq_tail and reaps results from cq_head; one
+// uring_enter() submits a batch and may wait for completions. With
+// URING_SETUP_SQPOLL the ring's worker picks requests up by itself and
+// only needs a URING_ENTER_SQ_WAKEUP once it has set URING_SQ_NEED_WAKEUP.
+// Requests name files and sockets by their index in the ring's object
+// table. Only the kernel adds to it (uring_register_object(), and accept),
+// so a ring set up from user space can name nothing it wasn't handed.
+#define URING_SQ_ENTRIES  128         // Power of two
+#define URING_SQ_MASK     (URING_SQ_ENTRIES - 1)
+#define URING_CQ_ENTRIES  256         // Never fewer than requests in flight
+#define URING_CQ_MASK     (URING_CQ_ENTRIES - 1)
+#define URING_MAX_BUFFERS 8           // Registered buffers per ring
+#define URING_MAX_OBJECTS 32          // Registered files and sockets per ring
+
+// Object types
+#define URING_OBJ_FILE    1           // struct file*: read, write, fsync
+#define URING_OBJ_SOCKET  2           // tcp_pcb_t*: accept, send, recv
+
+// Operations
+#define URING_OP_NOP      0
+#define URING_OP_READ     1           // res: bytes read, 0 at end of file
+#define URING_OP_WRITE    2
+#define URING_OP_FSYNC    3           // Write back the file's dirty pages
+#define URING_OP_ACCEPT   4           // res: the new connection's object index
+#define URING_OP_SEND     5
+#define URING_OP_RECV     6           // res: 0 at end of stream
+
+#define URING_OFF_CURRENT (~0ULL)     // off: at (and advancing) the file position
+
+#define URING_SETUP_SQPOLL    0x1     // The worker polls the submission ring
+#define URING_ENTER_SQ_WAKEUP 0x1     // Wake a sleeping SQPOLL worker
+#define URING_SQ_NEED_WAKEUP  0x1     // sq_flags: SQPOLL worker is asleep
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t len;
+    uint64_t obj;                     // Object index
+    void* addr;                       // Buffer
+    uint64_t off;                     // File offset, or URING_OFF_CURRENT
+    uint64_t user_data;               // Copied to the completion
+    uint64_t pad[3];
+} uring_sqe_t;                        // 64 bytes
+
+typedef struct {
+    uint64_t user_data;
+    int64_t res;                      // Result, -1 on failure
+} uring_cqe_t;
+
+typedef struct {
+    volatile uint32_t sq_head;        // Kernel
+    volatile uint32_t sq_flags;
+    uint8_t pad0[56];
+    volatile uint32_t sq_tail;        // Task
+    uint8_t pad1[60];
+    volatile uint32_t cq_head;        // Task
+    uint8_t pad2[60];
+    volatile uint32_t cq_tail;        // Kernel
+    uint8_t pad3[60];
+    uring_sqe_t sqes[URING_SQ_ENTRIES];
+    uring_cqe_t cqes[URING_CQ_ENTRIES];
+} __attribute__((aligned(64))) uring_t;
+
+int uring_setup(uint32_t flags);     // Ring id, or -1
+int uring_enter(int ring, uint32_t to_submit, uint32_t min_complete, uint32_t flags);  // Submitted
+int uring_register_buffer(int ring, void* addr, size_t len);  // Pinned for the ring's lifetime
+int uring_register_object(int ring, int type, void* obj);     // Object index, or -1
+int uring_destroy(int ring);         // Requests still waiting complete with -1
+uring_t* uring_get(int ring);        // Kernel mapping, for kernel tasks
+void uring_get_stats(void);
+
+int64_t sys_uring_setup(uint32_t flags);
+int64_t sys_uring_enter(int ring, uint32_t to_submit, uint32_t min_complete, uint32_t flags);
+uring_t* sys_uring_map(int ring);
+int64_t sys_uring_register(int ring, void* addr, size_t len);
+int64_t sys_uring_destroy(int ring);
 
 // ============================================================================
 // KEYBOARD INPUT
@@ -171,6 +619,12 @@ void keyboard_handler(void);
 uint8_t serial_read(void);
 void serial_write(uint8_t byte);
 void serial_write_string(const char* str);
+void serial_write_buffer(const char* buf, size_t len);
+void serial_irq_handler(void);
+void serial_start_async(void);   // Interrupt-drained ring from here on
+void serial_panic_flush(void);   // Drain the ring and go synchronous
+void serial_drain(void);         // Wait for the ring to empty (may sleep)
+void serial_get_stats(void);
 
 // ============================================================================
 // PCI MANAGEMENT
@@ -179,6 +633,8 @@ void serial_write_string(const char* str);
 // PIC (Programmable Interrupt Controller) functions
 void pic_init(void);
 void pic_eoi(uint8_t irq);
+void pic_mask(uint8_t irq);
+void pic_unmask(uint8_t irq);
 
 // ============================================================================
 // FILE SYSTEM AND VIRTUAL FILE SYSTEM
@@ -215,17 +671,27 @@ int sys_close(uint64_t fd);
 #define PAGE_DIRTY     0x040
 #define PAGE_HUGE      0x080
 #define PAGE_GLOBAL    0x100
+#define PAGE_WRITE_COMBINE PAGE_WRITETHROUGH  // PAT entry 1, write-combining once cpu_init ran
+
+#define PAGE_SIZE_2M   0x200000ULL
+#define PAGE_SIZE_1G   0x40000000ULL
 
 // Virtual memory management
 int vmm_map_page(uint64_t virtual_addr, uintptr_t physical_addr, uint32_t flags);
+int vmm_map_huge_page(uint64_t virtual_addr, uintptr_t physical_addr, uint32_t flags,
+                      uint64_t size);
 int vmm_unmap_page(uint64_t virtual_addr);
+bool paging_has_1g_pages(void);
 uintptr_t vmm_get_physical(uint64_t virtual_addr);
+void vmm_switch_context(vm_context_t* ctx);  // Load ctx into CR3 on this CPU
+void vmm_tlb_ipi(void);                      // TLB shootdown IPI handler
 
 // ELF loader functions
 int elf_validate(const void* elf_data, size_t size);
-int elf_load(const void* elf_data, size_t size, uint64_t* entry_point);
+int elf_load(vm_context_t* ctx, struct inode* inode, uint64_t* entry_point);
 uint64_t elf_get_entry(const void* elf_data);
-int elf_exec(uint64_t entry_point);
+pid_t elf_spawn(struct inode* inode, struct task_exit* notify);  // New process
+int elf_exec(struct inode* inode);  // Replace the current process's program
 
 // ============================================================================
 // SHARED MEMORY
@@ -238,6 +704,73 @@ void* sys_shmat(int shmid, const void* shmaddr, int shmflg);
 int64_t sys_shmdt(const void* shmaddr);
 int64_t sys_shmctl(int shmid, int cmd, struct shmid_ds* buf);
 
+// Kernel-owned segments (window buffers): the kernel uses the memory at
+// *kaddr, clients attach the shmid. shm_remove() is IPC_RMID.
+#define SHM_RDONLY 010000  // shmat(): attach read-only
+int shm_create_kernel(size_t size, void** kaddr);  // shmid, or -errno
+void shm_remove(int shmid);
+void* shm_attached_at(int shmid);  // Running task's attachment, or NULL
+
+// ============================================================================
+// IPC CHANNELS
+// ============================================================================
+
+// Message channels (implemented in kernel/ipc.c). A server creates a named
+// channel and receives from it; clients send, or call and block for the
+// reply. Requests queue in a shared ring the server may map, and a payload
+// given as msg.buffer moves by remapping the sender's pages.
+#define IPC_MSG_INLINE  88
+#define IPC_RING_SIZE   64         // Power of two
+#define IPC_RING_MASK   (IPC_RING_SIZE - 1)
+#define IPC_NAME_MAX    32
+#define IPC_MAX_PAYLOAD (1024 * 1024)
+
+typedef struct {
+    uint32_t type;                 // Protocol defined
+    uint32_t len;                  // Bytes used in data
+    pid_t sender;                  // Filled in by the kernel
+    uint32_t call_id;              // Nonzero: reply with the same call_id
+    uint32_t grant;                // Payload not mapped yet (ipc_accept)
+    uint32_t reserved;
+    void* buffer;                  // Payload: the sender's on send, ours on receive
+    size_t buffer_len;
+    uint8_t data[IPC_MSG_INLINE];
+} ipc_msg_t;                       // 128 bytes
+
+// Senders (through the kernel) only move head and the receiver only tail.
+// A receiver sets doorbell before it sleeps; only then does a send wake it.
+typedef struct {
+    volatile uint32_t head;
+    uint8_t pad0[60];
+    volatile uint32_t tail;
+    volatile uint32_t doorbell;
+    uint8_t pad1[56];
+    ipc_msg_t msgs[IPC_RING_SIZE];
+} __attribute__((aligned(64))) ipc_ring_t;
+
+int ipc_channel_create(const char* name);   // Channel id, or -1
+int ipc_channel_open(const char* name);
+int ipc_channel_destroy(int channel);       // Owner only; pending calls fail
+int ipc_send(int channel, const ipc_msg_t* msg);
+int ipc_call(int channel, const ipc_msg_t* msg, ipc_msg_t* reply, uint64_t timeout_ms);
+int ipc_recv(int channel, ipc_msg_t* msg, uint64_t timeout_ms);  // 1, 0 on timeout, -1
+int ipc_reply(int channel, const ipc_msg_t* reply);
+int ipc_reply_recv(int channel, const ipc_msg_t* reply, ipc_msg_t* next, uint64_t timeout_ms);
+void* ipc_accept(int channel, uint32_t grant);  // Map a payload taken from a mapped ring
+void ipc_release_buffer(void* buffer, size_t len);  // Done with a received payload
+void ipc_get_stats(void);
+
+int64_t sys_ipc_create(const char* name);
+int64_t sys_ipc_open(const char* name);
+int64_t sys_ipc_destroy(int channel);
+int64_t sys_ipc_send(int channel, const ipc_msg_t* msg);
+int64_t sys_ipc_call(int channel, const ipc_msg_t* msg, ipc_msg_t* reply, uint64_t timeout_ms);
+int64_t sys_ipc_recv(int channel, ipc_msg_t* msg, uint64_t timeout_ms);
+int64_t sys_ipc_reply(int channel, const ipc_msg_t* reply);
+int64_t sys_ipc_reply_recv(int channel, const ipc_msg_t* reply, ipc_msg_t* next, uint64_t timeout_ms);
+ipc_ring_t* sys_ipc_map(int channel);
+void* sys_ipc_accept(int channel, uint32_t grant);
+
 // ============================================================================
 // EVENT SYSTEM
 // ============================================================================
@@ -253,7 +786,7 @@ typedef enum {
 // Basic event structure
 typedef struct {
     event_type_t type;
-    uint32_t timestamp;
+    uint64_t timestamp;           // TSC when the input arrived
     union {
         struct {
             uint32_t keycode;
@@ -268,10 +801,53 @@ typedef struct {
     } data;
 } event_t;
 
+// A process's input queue: a single-producer/single-consumer ring the
+// owner may map (sys_event_map_queue). The kernel only writes head and the
+// consumer only tail, each on its own cache line.
+#define EVENT_RING_SIZE 256       // Power of two
+#define EVENT_RING_MASK (EVENT_RING_SIZE - 1)
+
+typedef struct {
+    volatile uint32_t head;       // Next slot the kernel fills
+    uint32_t dropped;             // Events lost to a full ring
+    uint8_t pad0[56];
+    volatile uint32_t tail;       // Next slot the consumer reads
+    uint8_t pad1[60];
+    event_t events[EVENT_RING_SIZE];
+} __attribute__((aligned(64))) event_ring_t;
+
+// Mouse moves that can stand for each other: same buttons, no wheel
+static inline bool event_can_coalesce(const event_t* a, const event_t* b)
+{
+    return a->type == EVENT_TYPE_MOUSE && b->type == EVENT_TYPE_MOUSE &&
+           a->data.mouse.buttons == b->data.mouse.buttons &&
+           a->data.mouse.wheel == 0 && b->data.mouse.wheel == 0;
+}
+
+// Consumer side: take the next event, skipping mouse moves that a later
+// queued one supersedes. Returns false when the ring is empty.
+static inline bool event_ring_pop(event_ring_t* ring, event_t* out)
+{
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) return false;
+
+    *out = ring->events[tail & EVENT_RING_MASK];
+    tail++;
+    while (tail != head && event_can_coalesce(out, &ring->events[tail & EVENT_RING_MASK])) {
+        *out = ring->events[tail & EVENT_RING_MASK];
+        tail++;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return true;
+}
+
 // Event functions (implemented in events.c)
 int64_t sys_event_create_queue(void);
 int64_t sys_event_destroy_queue(int64_t queue_id);
 int64_t sys_event_get_next(event_t* event, uint64_t timeout);
+event_ring_t* sys_event_map_queue(int64_t queue_id);  // The ring in the caller's space
+int event_epoll_ctl(epoll_t* ep, int op, int queue_id, const epoll_event_t* event);
 
 // Event posting functions
 extern int event_queue_keyboard(pid_t target_process, uint32_t keycode, uint32_t modifiers, uint32_t state);
@@ -290,14 +866,72 @@ void framebuffer_draw_text(int x, int y, const char* text, uint32_t color);
 void framebuffer_draw_line(int x1, int y1, int x2, int y2, uint32_t color);
 void framebuffer_draw_circle(int sx, int sy, int radius, uint32_t color);
 
+// Drawing goes to a back buffer in RAM. framebuffer_present() shows what
+// changed since the last call; framebuffer_wait_frame() sleeps to the next
+// refresh, so a compositing loop runs once per frame.
+void framebuffer_damage(int x, int y, int width, int height);  // Screen pixels written directly
+void framebuffer_present(void);
+void framebuffer_wait_frame(void);
+
+// Pixel blitters (implemented in blit.c): 32-bit ARGB rectangles, pitches
+// in pixels. blit_over_rect() blends straight-alpha source pixels over
+// an opaque destination.
+void blit_init(void);
+void blit_fill_rect(uint32_t* dst, size_t pitch, int width, int height, uint32_t color);
+void blit_copy_rect(uint32_t* dst, size_t dst_pitch, const uint32_t* src, size_t src_pitch,
+                    int width, int height);
+void blit_over_rect(uint32_t* dst, size_t dst_pitch, const uint32_t* src, size_t src_pitch,
+                    int width, int height);
+
+// Damage regions (implemented in framebuffer.c). A region is a short list
+// of rectangles that may overlap; once full it collapses to their bounds.
+#define DAMAGE_MAX_RECTS 16
+
+typedef struct {
+    int x, y, width, height;
+} rect_t;
+
+typedef struct {
+    int count;
+    rect_t rects[DAMAGE_MAX_RECTS];
+} damage_t;
+
+bool rect_intersect(const rect_t* a, const rect_t* b, rect_t* out);
+int rect_subtract(const rect_t* a, const rect_t* b, rect_t out[4]);  // a - b, 0-4 pieces
+void damage_add(damage_t* damage, int x, int y, int width, int height);
+void damage_clear(damage_t* damage);
+
+// Text (implemented in text.c): a built-in font in fixed cells, drawn from
+// cached glyph atlases and rasterized lines. A bg with zero alpha draws
+// the strokes only.
+#define TEXT_CELL_W 6
+#define TEXT_CELL_H 8
+
+int text_draw(uint32_t* surface, size_t pitch, const rect_t* clip, int x, int y,
+              const char* text, uint32_t fg, uint32_t bg);  // Returns the width in pixels
+int text_width(const char* text);
+void text_get_stats(void);
+
 // Window management (implemented in framebuffer.c)
 int window_create(int x, int y, int width, int height, pid_t owner_pid);
 int window_destroy(int window_id);
 volatile uint8_t* window_get_buffer(int window_id);
 void window_composite(int window_id);
+void window_present_rect(int window_id, int screen_x, int screen_y, const rect_t* area, bool opaque);
 
-// Display server functions
+// Display server functions. Drawing adds to a window's damage;
+// wm_composite_window() redraws only that, less what opaque windows above
+// it cover, and clears it. window_composite() only queues a window;
+// wm_composite_frame() composites the queued ones, once per frame.
 void display_server_init(void);
+int wm_register_window(int window_id, int x, int y, int width, int height, pid_t owner_pid, const char* title);
+int wm_unregister_window(int window_id);
+int wm_damage_window(int window_id, int x, int y, int width, int height);
+int wm_set_window_opaque(int window_id, bool opaque);
+int wm_composite_window(int window_id);
+int wm_queue_composite(int window_id);
+bool wm_composite_pending(void);
+int wm_composite_frame(void);  // Windows composited
 
 // System calls for graphics
 int64_t sys_framebuffer_access(void** framebuffer, uint32_t* width, uint32_t* height, uint32_t* bpp);
@@ -305,6 +939,12 @@ int64_t sys_window_create(int x, int y, int w, int h);
 int64_t sys_window_destroy(int window_id);
 int64_t sys_window_composite(int window_id);
 int64_t sys_draw_rect(int window_id, int x, int y, int w, int h, uint32_t color);
+
+// Window buffers are shared memory: a client maps its window's pixels once
+// and draws locally, then one commit per frame says what changed (count 0:
+// the whole window) and queues it for compositing
+void* sys_window_map(int window_id, uint32_t* width, uint32_t* height);
+int64_t sys_window_commit(int window_id, const rect_t* rects, int count);
 int64_t sys_draw_circle(int window_id, int center_x, int center_y, int radius, uint32_t color);
 int64_t sys_get_display_info(uint32_t* width, uint32_t* height, uint32_t* bpp);
 
@@ -341,8 +981,11 @@ int strcmp(const char* s1, const char* s2);
 int strncmp(const char* s1, const char* s2, size_t n);
 void* memset(void* s, int c, size_t n);
 void* memcpy(void* dest, const void* src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
 int memcmp(const void* s1, const void* s2, size_t n);
 char* strcat(char* dest, const char* src);
+void memzero_nt(void* dest, size_t n);  // Bypasses the cache
+void mem_init(bool erms, bool fsrm);    // Pick copy/fill strategies (boot CPU)
 
 // ============================================================================
 // TIME UTILITIES
@@ -358,4 +1001,14 @@ uint64_t sys_get_ticks(void);
 // Main kernel entry point
 void kernel_main(void);
 
+// Boot-time microbenchmarks (bench.c), run when the command line says
+// "bench": TSC-timed loops over hot kernel paths, one "BENCH" line of
+// percentiles per path on serial, then QEMU's isa-debug-exit
+void bench_start(void);
+
+// Boot-time self-tests (selftest.c), run when the command line says
+// "selftest": user programs started the way real ones are, one
+// "SELFTEST <name> PASS/FAIL" line each on serial
+void selftest_start(void);
+
 #endif // KERNEL_H
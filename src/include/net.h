@@ -12,9 +12,28 @@
 // CONFIGURATION
 // ============================================================================
 
-#define NET_MAX_PACKET_SIZE    2048
+#define NET_MAX_PACKET_SIZE    2048    // Pooled packet buffer, headroom included
 #define NET_PACKET_POOL_SIZE   1024
 
+// Reserved in front of a new packet's data for the headers the layers
+// below prepend: Ethernet, IPv4 and TCP with options (14 + 60 + 60)
+#define NET_PACKET_HEADROOM    160
+#define NET_MAX_PAYLOAD        (NET_MAX_PACKET_SIZE - NET_PACKET_HEADROOM)
+
+// Page fragments a packet can carry after its linear data: 64KB, unaligned
+#define PACKET_MAX_FRAGS       17
+
+// Packet flags
+#define PACKET_POOLED          0x01    // Buffer belongs to the packet pool
+#define PACKET_CSUM_PARTIAL    0x02    // TX: transport checksum left to the NIC
+#define PACKET_CSUM_VERIFIED   0x04    // RX: the NIC already checked the checksums
+
+// Interface offloads (net_interface_t.features)
+#define NETIF_F_IP_CSUM        0x01    // Fills in TCP/UDP checksums over IPv4
+#define NETIF_F_RXCSUM         0x02    // Verifies received checksums
+#define NETIF_F_SG             0x04    // Sends fragments from where they are
+#define NETIF_F_GSO_UDP        0x08    // Splits UDP GSO packets into datagrams
+
 // Protocol constants
 #define ETH_P_IP   0x0800
 #define ETH_P_ARP  0x0806
@@ -61,6 +80,16 @@ typedef struct {
 // IP Address (IPv4)
 typedef uint32_t ip_addr_t;
 
+struct cached_page;
+
+// Packet data held by reference: part of a pinned page cache page. The
+// packet owns the pin and drops it when it is freed.
+typedef struct {
+    struct cached_page* page;
+    uint8_t* data;
+    uint32_t len;
+} packet_frag_t;
+
 // Network Packet Buffer (similar to sk_buff in Linux)
 typedef struct packet {
     struct packet* next;       // Linked list for queues
@@ -71,11 +100,20 @@ typedef struct packet {
     uint8_t* tail;             // End of data
     uint8_t* end;              // End of buffer
     
-    uint32_t len;              // Data length
+    uint32_t len;              // Data length (linear part)
     uint32_t total_len;        // Total buffer length
     
+    // TX: bytes after tail that stay where they are (sendfile)
+    uint32_t data_len;         // Sum of the fragments' lengths
+    uint8_t nr_frags;
+    packet_frag_t frags[PACKET_MAX_FRAGS];
+    
     struct net_interface* netif; // Receiving/Sending interface
     uint16_t protocol;         // Ethernet protocol type
+    uint16_t flags;            // PACKET_*
+    uint16_t csum_offset;      // PACKET_CSUM_PARTIAL: checksum field, from l4_header
+    uint16_t gso_size;         // TX: UDP payload split into datagrams this size; 0: one
+    struct net_flow* flow;     // TX: paced through the interface's fair queue
     
     // Layer headers (pointers into data)
     void* l2_header;           // Ethernet header
@@ -83,6 +121,69 @@ typedef struct packet {
     void* l4_header;           // TCP/UDP header
 } packet_t;
 
+// Prepend a header of len bytes into the headroom; NULL if there is no room
+static inline void* packet_push(packet_t* pkt, uint32_t len)
+{
+    if ((uint32_t)(pkt->data - pkt->head) < len) return NULL;
+    pkt->data -= len;
+    pkt->len += len;
+    return pkt->data;
+}
+
+// Strip a header of len bytes; NULL if the packet is shorter
+static inline void* packet_pull(packet_t* pkt, uint32_t len)
+{
+    if (pkt->len < len) return NULL;
+    void* header = pkt->data;
+    pkt->data += len;
+    pkt->len -= len;
+    return header;
+}
+
+// Append len bytes at the tail; NULL if the buffer is full
+static inline void* packet_put(packet_t* pkt, uint32_t len)
+{
+    if ((uint32_t)(pkt->end - pkt->tail) < len) return NULL;
+    void* data = pkt->tail;
+    pkt->tail += len;
+    pkt->len += len;
+    return data;
+}
+
+// Length on the wire: linear data and fragments
+static inline uint32_t packet_length(const packet_t* pkt)
+{
+    return pkt->len + pkt->data_len;
+}
+
+// A sender's queue in an interface's fair queue (fq.c). The owner sets
+// rate; the rest belongs to the scheduler.
+typedef struct net_flow {
+    struct net_flow* next;     // On the scheduler's new, old or throttled list
+    packet_t* head;
+    packet_t* tail;
+    uint32_t qlen;
+    uint8_t list;
+    int32_t credit;            // Bytes left this round (deficit round robin)
+    uint64_t time_next_us;     // Earliest departure of the next packet
+    volatile uint64_t rate;    // Pacing rate, bytes per second; 0: unpaced
+} net_flow_t;
+
+typedef struct net_fq {
+    spinlock_t lock;
+    net_flow_t* new_head;      // Flows that just became active
+    net_flow_t* new_tail;
+    net_flow_t* old_head;
+    net_flow_t* old_tail;
+    net_flow_t* throttled;     // By time_next_us
+    uint32_t packets;
+    bool running;              // A CPU is handing packets to the driver
+    bool again;                // More was queued while it was
+    ktimer_t timer;            // Wakes the earliest throttled flow
+    uint64_t throttled_count;
+    uint64_t drops;
+} net_fq_t;
+
 // Network Interface
 typedef struct net_interface {
     char name[16];
@@ -92,9 +193,11 @@ typedef struct net_interface {
     ip_addr_t gateway;
     
     uint32_t flags;            // UP, RUNNING, LOOPBACK, etc.
+    uint32_t features;         // NETIF_F_* offloads the driver handles
     
     // Driver callbacks
     int (*send_packet)(struct net_interface* netif, packet_t* pkt);
+    net_fq_t* fq;              // Pacing scheduler; NULL sends straight away
     
     // Stats
     uint64_t rx_packets;
@@ -118,13 +221,36 @@ typedef struct {
 // ============================================================================
 
 void net_init(void);
+
+// A packet with room for size bytes of data, behind NET_PACKET_HEADROOM
+// bytes of headroom; empty (data == tail). net_rx_packet() and the
+// interface's send_packet() take ownership of the packet they are given.
 packet_t* net_alloc_packet(uint32_t size);
 void net_free_packet(packet_t* pkt);
+void net_get_stats(void);
 int net_register_interface(net_interface_t* netif);
 net_interface_t* net_get_interface(const char* name);
 net_interface_t* net_get_default_interface(void);
 int net_rx_packet(net_interface_t* netif, packet_t* pkt);
-int net_tx_packet(net_interface_t* netif, packet_t* pkt);
+int net_tx_packet(net_interface_t* netif, packet_t* pkt);    // Through the fair queue
+int net_dev_xmit(net_interface_t* netif, packet_t* pkt);     // Straight to the driver
+
+// Fragments. packet_add_frag() takes over the caller's pin on page; -1 if
+// the packet is full. packet_linearize() copies them into the tailroom
+// (-1 if it is too small), packet_csum() sums from p (in the linear part)
+// through the last fragment.
+int packet_add_frag(packet_t* pkt, struct cached_page* page, uint8_t* data, uint32_t len);
+int packet_linearize(packet_t* pkt);
+uint32_t packet_csum(const packet_t* pkt, const void* p, uint32_t sum);
+
+// ============================================================================
+// FAIR QUEUE (fq.c)
+// ============================================================================
+
+void net_flow_init(net_flow_t* flow);
+int net_fq_attach(net_interface_t* netif);
+int net_fq_enqueue(net_interface_t* netif, packet_t* pkt);
+void net_fq_get_stats(net_interface_t* netif);
 
 // ============================================================================
 // ETHERNET (ethernet.c)
@@ -133,28 +259,133 @@ int net_tx_packet(net_interface_t* netif, packet_t* pkt);
 int ethernet_input(net_interface_t* netif, packet_t* pkt);
 int ethernet_output(net_interface_t* netif, packet_t* pkt, mac_addr_t dest_mac, uint16_t type);
 
+// Neighbor cache. arp_output() sends an IPv4 packet to next_hop, queueing
+// it while the address is resolved; it takes ownership of pkt.
+// arp_set_aging() sets how long a confirmed address is used before it is
+// asked again and how long an unconfirmed one is kept (0 leaves either).
+void arp_init(void);
+int arp_output(net_interface_t* netif, packet_t* pkt, ip_addr_t next_hop);
+int arp_lookup(ip_addr_t ip, mac_addr_t* mac);
+void arp_update_cache(ip_addr_t ip, uint8_t* mac);
+void arp_set_aging(uint32_t reachable_ms, uint32_t gc_ms);
+void arp_get_stats(void);
+
 // ============================================================================
 // IPv4 (ipv4.c)
 // ============================================================================
 
 int ipv4_input(net_interface_t* netif, packet_t* pkt);
 int ipv4_output(packet_t* pkt, ip_addr_t dest_ip, uint8_t protocol);
+
+// Internet checksum. csum_partial() adds data to a running 32-bit sum
+// (unfolded, in memory byte order); csum_fold() folds it to 16 bits and
+// complements it. checksum() is the two together.
+uint32_t csum_partial(const void* data, uint32_t len, uint32_t sum);
 uint16_t checksum(void* data, uint32_t len);
 
+static inline uint16_t csum_fold(uint32_t sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// TCP/UDP pseudo-header; addresses as they appear in the IP header
+static inline uint32_t csum_pseudo(ip_addr_t src, ip_addr_t dst, uint32_t len, uint8_t proto)
+{
+    uint64_t sum = (uint64_t)src + dst + __builtin_bswap16((uint16_t)len) +
+                   __builtin_bswap16((uint16_t)proto);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    return (uint32_t)sum + (uint32_t)(sum >> 32);
+}
+
+// RFC 1624 incremental update: the checksum after a 16-bit word it
+// covers changed from old to new (HC' = ~(~HC + ~m + m'))
+static inline uint16_t csum_replace2(uint16_t check, uint16_t old, uint16_t new)
+{
+    return csum_fold((uint16_t)~check + (uint32_t)(uint16_t)~old + new);
+}
+
+static inline uint16_t csum_replace4(uint16_t check, uint32_t old, uint32_t new)
+{
+    check = csum_replace2(check, (uint16_t)old, (uint16_t)new);
+    return csum_replace2(check, (uint16_t)(old >> 16), (uint16_t)(new >> 16));
+}
+
+// Forwarding: one less hop, header checksum patched rather than redone
+static inline void ipv4_decrease_ttl(ipv4_header_t* ip)
+{
+    uint16_t old = (uint16_t)(ip->ttl | (ip->protocol << 8));  // TTL and protocol share a word
+    ip->ttl--;
+    ip->checksum = csum_replace2(ip->checksum, old, (uint16_t)(ip->ttl | (ip->protocol << 8)));
+}
+
 // ============================================================================
 // UDP (udp.c)
 // ============================================================================
 
+typedef struct udp_pcb udp_pcb_t;
+
+// A datagram for udp_sendmmsg() / udp_recvmmsg(). Sending, a gso_size
+// below len sends buf as datagrams of gso_size bytes (the last may be
+// shorter) in one packet down the stack. Receiving, len is the room in
+// buf on the way in and the bytes stored on the way out; with GRO on, a
+// nonzero gso_size says buf holds a run of datagrams from addr of that size.
+typedef struct {
+    sockaddr_in_t addr;        // Send: destination. Receive: source
+    void* buf;
+    uint32_t len;
+    uint16_t gso_size;
+} udp_msg_t;
+
 int udp_input(net_interface_t* netif, packet_t* pkt);
 int udp_send(sockaddr_in_t* src, sockaddr_in_t* dest, void* data, uint32_t len);
+int udp_gso_segment(net_interface_t* netif, packet_t* pkt);
+
+// Sockets. Port 0 binds an ephemeral port, as does a first send unbound.
+// udp_sendmmsg() returns how many messages went out (-1 if none did);
+// udp_recvmmsg() waits until the deadline (0: not at all, WAIT_FOREVER)
+// for one and takes as many as are queued, up to count.
+udp_pcb_t* udp_new(void);
+int udp_bind(udp_pcb_t* pcb, ip_addr_t ip, uint16_t port);
+void udp_set_gro(udp_pcb_t* pcb, bool on);
+int udp_close(udp_pcb_t* pcb);
+int udp_sendmmsg(udp_pcb_t* pcb, udp_msg_t* msgs, int count);
+int udp_recvmmsg(udp_pcb_t* pcb, udp_msg_t* msgs, int count, uint64_t deadline_us);
+uint32_t udp_poll(void* obj, wait_queue_t** wq);
 
 // ============================================================================
 // TCP (tcp.c)
 // ============================================================================
 
+typedef struct tcp_pcb tcp_pcb_t;
+
 void tcp_init(void);
 int tcp_input(net_interface_t* netif, packet_t* pkt);
 
+// Connections. accept, connect, read and write block; read returns 0 at
+// end of stream and -1 once the connection is reset or times out.
+tcp_pcb_t* tcp_new(void);
+int tcp_bind(tcp_pcb_t* pcb, ip_addr_t ip, uint16_t port);
+int tcp_listen(tcp_pcb_t* pcb);
+tcp_pcb_t* tcp_accept(tcp_pcb_t* listener);
+int tcp_connect(tcp_pcb_t* pcb, ip_addr_t ip, uint16_t port);
+ssize_t tcp_write(tcp_pcb_t* pcb, const void* data, size_t len);
+ssize_t tcp_read(tcp_pcb_t* pcb, void* buffer, size_t len);
+int tcp_close(tcp_pcb_t* pcb);
+
+// poll_fn_t for epoll_ctl(): EPOLLIN on data, end of stream or a pending
+// accept, EPOLLOUT while the send ring has room
+uint32_t tcp_poll(void* obj, wait_queue_t** wq);
+
+// Zero-copy sends: page cache bytes go out by reference, pinned until the
+// peer acknowledges them. tcp_sendpage() takes its own pins; tcp_sendfile()
+// sends count bytes of a cached file from *pos (the file position if pos
+// is NULL) and advances it.
+struct file;
+ssize_t tcp_sendpage(tcp_pcb_t* pcb, struct cached_page* page, uint32_t offset, uint32_t len);
+ssize_t tcp_sendfile(tcp_pcb_t* pcb, struct file* file, loff_t* pos, size_t count);
+
 // ============================================================================
 // UTILS
 // ============================================================================
@@ -0,0 +1,38 @@
+/*
+ * NUMA Topology Header
+ * Memory and CPU placement by node, from the ACPI SRAT and SLIT
+ */
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include "types.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+#define NUMA_MAX_NODES     8
+#define NUMA_MAX_MEMBLKS   32    // SRAT memory ranges kept
+#define NUMA_NO_NODE       (-1)
+
+// SLIT convention: 10 for a node to itself, 20 when no SLIT says otherwise
+#define NUMA_LOCAL_DISTANCE   10
+#define NUMA_REMOTE_DISTANCE  20
+
+// ============================================================================
+// FUNCTIONS
+// ============================================================================
+
+// Parse SRAT/SLIT (before the PMM seeds its zones); one node without them
+void numa_init(void);
+
+int numa_node_count(void);
+int numa_node_of_pfn(size_t pfn, size_t* run_end);  // run_end: first PFN past the same range
+int numa_node_of_cpu(int cpu);
+int numa_current_node(void);                        // Node of the executing CPU
+void numa_cpu_online(int cpu, uint32_t apic_id);    // Place a CPU by its APIC ID
+uint8_t numa_distance(int from, int to);
+const uint8_t* numa_fallback_order(int node);       // All nodes, nearest first (node itself)
+
+#endif // NUMA_H
@@ -0,0 +1,109 @@
+/*
+ * Page Cache Header
+ * Disk data cached in whole pages, keyed by (mapping, page index)
+ */
+
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include "kernel.h"
+#include "drivers/block.h"
+#include "vfs.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+// Page flags
+#define PCACHE_UPTODATE   0x01    // Data matches (or is newer than) the disk
+#define PCACHE_DIRTY      0x02    // Must be written back before eviction
+#define PCACHE_REFERENCED 0x04    // Used since the clock hand last passed
+#define PCACHE_LOCKED     0x08    // I/O in progress, wait for it to clear
+#define PCACHE_ERROR      0x10    // Last read failed
+
+// Readahead window bounds, in pages
+#define RA_MIN_PAGES      4
+#define RA_MAX_PAGES      128     // 512KB in flight per stream
+
+// ============================================================================
+// TYPES
+// ============================================================================
+
+typedef struct page_mapping page_mapping_t;
+
+typedef struct cached_page {
+    page_mapping_t* mapping;
+    uint64_t index;               // Page number within the mapping
+    uint8_t* data;                // One PMM page (identity mapped)
+    volatile uint32_t flags;
+    volatile uint32_t users;      // Pins against eviction
+    struct cached_page* lru_prev; // Clock ring
+    struct cached_page* lru_next;
+    struct cached_page* dirty_next;
+    bio_t bio;                    // For the page's own reads and writeback
+    struct rcu_head rcu;          // Free deferred by the shrinker
+} cached_page_t;
+
+// How a mapping reaches its backing store: page index <-> sectors. The
+// block device mapping is built in; a file mapping (inode) supplies the
+// sector of each of its pages. Returns the first sector and how many
+// sectors of the page are backed (0 if none: a hole, read as zeroes).
+// allocate is set for writeback, where a hole must get disk space (delayed
+// allocation); map() is never called with page locks held.
+typedef uint32_t (*pcache_map_fn)(page_mapping_t* mapping, uint64_t index, uint64_t* sector,
+                                  bool allocate);
+
+struct page_mapping {
+    block_device_t* dev;
+    pcache_map_fn map;            // NULL: device offsets
+    void* host;                   // Inode or filesystem, for map()
+    spinlock_t lock;              // Radix tree
+    void* root;                   // Radix tree of cached_page_t, by index
+    uint32_t height;
+    size_t nr_pages;
+    size_t nr_dirty;              // Under the page cache's LRU lock
+};
+
+// ============================================================================
+// FUNCTIONS
+// ============================================================================
+
+// Writeback task and accounting (after the scheduler)
+void page_cache_init(void);
+
+// The cache of a whole block device, created on first use
+page_mapping_t* page_cache_bdev(block_device_t* dev);
+
+// A file cache on dev; drop it with page_cache_release_mapping()
+void page_mapping_init(page_mapping_t* mapping, block_device_t* dev, pcache_map_fn map, void* host);
+void page_cache_release_mapping(page_mapping_t* mapping);
+
+// Page at index, read in if needed and pinned; NULL on I/O error / no memory
+cached_page_t* page_cache_get(page_mapping_t* mapping, uint64_t index);
+void page_cache_put(cached_page_t* page);
+void page_cache_hold(cached_page_t* page);      // One more pin; the caller already has one
+void page_cache_mark_dirty(cached_page_t* page);
+
+// Byte-range copies through the cache; missing pages are read as one batch
+int page_cache_read(page_mapping_t* mapping, uint64_t offset, void* buffer, size_t size);
+int page_cache_write(page_mapping_t* mapping, uint64_t offset, const void* buffer, size_t size);
+
+// Readahead: feed a read of count pages at index to the window; true (and
+// the range to prefetch) when a new window should be read
+bool page_cache_ra_advance(struct file_ra_state* ra, uint64_t index, uint32_t count,
+                           uint64_t* start, uint32_t* pages);
+
+// Start reading pages that are not cached yet, without waiting for them
+void page_cache_readahead(page_mapping_t* mapping, uint64_t index, size_t count);
+
+// Read through a file mapping with the file's readahead window
+ssize_t page_cache_file_read(struct file* file, page_mapping_t* mapping, uint64_t i_size,
+                             char* buffer, size_t count, loff_t* pos);
+
+// Write back dirty pages of one mapping (NULL: all), waiting for the I/O
+int page_cache_sync(page_mapping_t* mapping);
+
+// Statistics
+void page_cache_get_stats(void);
+
+#endif /* PAGE_CACHE_H */
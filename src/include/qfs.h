@@ -34,6 +34,16 @@ uint32_t qfs_create_file(const char* name, uint16_t mode);
 int64_t qfs_read(uint32_t ino, void* buffer, uint64_t offset, size_t count);
 int64_t qfs_write(uint32_t ino, const void* buffer, uint64_t offset, size_t count);
 
+// The file's VFS inode, referenced, with its page cache (iput() when done)
+struct inode;
+struct inode* qfs_open_inode(uint32_t ino);
+
+// Write back file data and metadata
+int qfs_sync(void);
+
+// Make one file durable; concurrent callers share a journal commit
+int qfs_fsync(uint32_t ino);
+
 // Statistics
 void qfs_get_stats(void);
 
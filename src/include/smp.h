@@ -0,0 +1,112 @@
+/*
+ * SMP, Local APIC and Per-CPU Data
+ * Public API for multi-core bring-up
+ */
+
+#ifndef SMP_H
+#define SMP_H
+
+#include "types.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+// Interrupt vectors owned by the local APIC (above the remapped PIC range)
+#define APIC_TIMER_VECTOR     48
+#define APIC_RESCHED_VECTOR   49
+#define APIC_TLB_VECTOR       50
+#define APIC_DRAIN_VECTOR     51   // Flush this CPU's heap magazines
+#define APIC_SPURIOUS_VECTOR  255
+
+// Vectors handed out to devices for MSI (apic_alloc_msi_vector)
+#define APIC_MSI_VECTOR_BASE  64
+#define APIC_MSI_VECTOR_COUNT 24   // isrs.asm stamps out this many stubs
+
+// MSRs
+#define MSR_APIC_BASE         0x1B
+#define MSR_GS_BASE           0xC0000101
+#define MSR_KERNEL_GS_BASE    0xC0000102
+
+// ============================================================================
+// ACPI
+// ============================================================================
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+// ============================================================================
+// PER-CPU DATA (reached through the GS base)
+// ============================================================================
+
+typedef struct percpu {
+    struct percpu* self;       // Must stay first: this_cpu() reads %gs:0
+    uintptr_t kernel_rsp;      // Kernel stack of the running task (syscall.asm: gs:8)
+    uintptr_t user_rsp;        // User RSP across SYSCALL entry (syscall.asm: gs:16)
+    uint32_t cpu_id;           // Logical index (cpu_runqueues[], pcp lists)
+    uint32_t apic_id;          // Local APIC ID
+    uintptr_t stack_top;       // Boot/idle stack for this CPU
+    uint64_t lapic_ticks;      // LAPIC timer interrupts taken
+    volatile bool online;      // Set by the CPU once it is scheduling
+} percpu_t;
+
+extern bool percpu_ready;
+
+static inline percpu_t* this_cpu(void)
+{
+    percpu_t* cpu;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Logical ID of the executing CPU (0 until the BSP's GS base is installed)
+static inline int smp_cpu_id(void)
+{
+    if (!percpu_ready) return 0;
+    uint32_t id;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(id)
+                     : "i"(__builtin_offsetof(percpu_t, cpu_id)));
+    return (int)id;
+}
+
+// ============================================================================
+// FUNCTIONS
+// ============================================================================
+
+// SMP (smp.c)
+void smp_init(void);
+int smp_cpu_count(void);
+percpu_t* smp_get_cpu(int cpu);
+acpi_sdt_header_t* acpi_get_table(const char* signature);
+
+// Local APIC (apic.c)
+bool lapic_init(void);
+void lapic_eoi(void);
+uint32_t lapic_id(void);
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr_low);
+void lapic_send_init(uint32_t apic_id);
+void lapic_send_startup(uint32_t apic_id, uint8_t vector_page);
+void lapic_timer_start(void);
+void lapic_timer_arm(uint64_t deadline_us);
+void lapic_timer_disarm(void);
+bool lapic_timer_active(void);
+void lapic_delay_us(uint32_t us);
+void lapic_perf_nmi(bool enable);  // Unmask the performance counter LVT (NMI delivery)
+void apic_handle_interrupt(uint8_t vector);
+
+// Device MSI: a vector with its handler (run in interrupt context, EOI done
+// by the dispatcher), and the message address that targets a LAPIC
+typedef void (*msi_handler_t)(void* arg);
+int apic_alloc_msi_vector(msi_handler_t handler, void* arg);  // -1 if none left
+uint64_t apic_msi_address(uint32_t apic_id);
+
+#endif // SMP_H
@@ -0,0 +1,194 @@
+/*
+ * Synchronization Primitives Header
+ * Queued (MCS) spinlocks, sequence counters, per-CPU reader-writer locks
+ * and quiescent-state RCU. Ticket spinlocks are in kernel.h.
+ */
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "kernel.h"
+
+// ============================================================================
+// MCS LOCKS
+// ============================================================================
+
+// Each waiter spins on its own node (on its stack) rather than the lock
+// word, so a handoff touches one other CPU's cache line instead of all of
+// them. For locks held for long stretches under heavy contention.
+typedef struct mcs_node {
+    struct mcs_node* volatile next;
+    volatile uint32_t locked;      // Set by the predecessor on handoff
+} mcs_node_t;
+
+typedef struct {
+    mcs_node_t* volatile tail;     // Last waiter, NULL while free
+    uint64_t contended;            // Acquisitions that had to queue
+    uint64_t wait_cycles;          // TSC cycles spent queued
+} mcs_lock_t;
+
+#define MCS_LOCK_INIT { NULL, 0, 0 }
+
+void mcs_lock(mcs_lock_t* lock, mcs_node_t* node);
+bool mcs_trylock(mcs_lock_t* lock, mcs_node_t* node);
+void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node);   // The node the lock was taken with
+
+static inline bool mcs_is_locked(mcs_lock_t* lock)
+{
+    return __atomic_load_n(&lock->tail, __ATOMIC_RELAXED) != NULL;
+}
+
+static inline uint64_t mcs_lock_irqsave(mcs_lock_t* lock, mcs_node_t* node)
+{
+    uint64_t flags = irq_save();
+    mcs_lock(lock, node);
+    return flags;
+}
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t* lock, mcs_node_t* node, uint64_t flags)
+{
+    mcs_unlock(lock, node);
+    irq_restore(flags);
+}
+
+// ============================================================================
+// SEQUENCE COUNTERS
+// ============================================================================
+
+// Odd while a writer is inside. Readers take no lock: they read, then retry
+// if the count moved. Writers must already be serialized (seqcount_t) or
+// take the lock that comes with it (seqlock_t). x86 keeps loads and stores
+// in order, so only the compiler needs fencing.
+typedef struct {
+    volatile uint32_t sequence;
+} seqcount_t;
+
+typedef struct {
+    seqcount_t seqcount;
+    spinlock_t lock;
+} seqlock_t;
+
+#define SEQCOUNT_INIT { 0 }
+#define SEQLOCK_INIT  { SEQCOUNT_INIT, SPINLOCK_INIT }
+
+void seqcount_note_retry(void);    // Statistics (sync.c)
+
+static inline uint32_t read_seqcount_begin(const seqcount_t* s)
+{
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        __asm__ volatile("pause");
+    }
+    return seq;
+}
+
+static inline bool read_seqcount_retry(const seqcount_t* s, uint32_t start)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->sequence, __ATOMIC_RELAXED) == start) return false;
+    seqcount_note_retry();
+    return true;
+}
+
+static inline void write_seqcount_begin(seqcount_t* s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_t* s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static inline void seqlock_init(seqlock_t* sl)
+{
+    sl->seqcount.sequence = 0;
+    spin_lock_init(&sl->lock);
+}
+
+static inline uint32_t read_seqbegin(const seqlock_t* sl)
+{
+    return read_seqcount_begin(&sl->seqcount);
+}
+
+static inline bool read_seqretry(const seqlock_t* sl, uint32_t start)
+{
+    return read_seqcount_retry(&sl->seqcount, start);
+}
+
+static inline uint64_t write_seqlock_irqsave(seqlock_t* sl)
+{
+    uint64_t flags = spin_lock_irqsave(&sl->lock);
+    write_seqcount_begin(&sl->seqcount);
+    return flags;
+}
+
+static inline void write_sequnlock_irqrestore(seqlock_t* sl, uint64_t flags)
+{
+    write_seqcount_end(&sl->seqcount);
+    spin_unlock_irqrestore(&sl->lock, flags);
+}
+
+// ============================================================================
+// PER-CPU READER-WRITER LOCKS
+// ============================================================================
+
+// Readers only touch their own CPU's counter, so read-mostly data costs no
+// shared cache line; a writer sets the flag and waits for every counter to
+// drain. Read sections run with interrupts off and may nest; a writer must
+// not hold the read side.
+typedef struct {
+    struct {
+        volatile uint32_t readers;
+    } __attribute__((aligned(64))) cpu[MAX_CPUS];
+    volatile uint32_t writer;      // Set while a writer holds or waits for the lock
+    spinlock_t writer_lock;        // Serializes writers
+    uint64_t reader_waits;         // Readers that found a writer and backed off
+    uint64_t writes;
+} percpu_rwlock_t;
+
+#define PERCPU_RWLOCK_INIT { .writer = 0 }
+
+uint64_t percpu_read_lock(percpu_rwlock_t* lock);
+void percpu_read_unlock(percpu_rwlock_t* lock, uint64_t flags);
+uint64_t percpu_write_lock(percpu_rwlock_t* lock);
+void percpu_write_unlock(percpu_rwlock_t* lock, uint64_t flags);
+
+// ============================================================================
+// RCU
+// ============================================================================
+
+// Readers disable interrupts and nothing more: a CPU that context switches
+// or takes a timer tick with interrupts on is outside every read section.
+// An object unlinked from a structure can be freed once each CPU has done
+// so (a grace period).
+typedef struct rcu_head rcu_head_t;  // types.h, so any structure can embed one
+
+static inline uint64_t rcu_read_lock(void)
+{
+    return irq_save();
+}
+
+static inline void rcu_read_unlock(uint64_t flags)
+{
+    irq_restore(flags);
+}
+
+// Load a pointer published with rcu_assign_pointer(), and what it points to
+#define rcu_dereference(p)        __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+// Publish a pointer only after the object it points to is initialized
+#define rcu_assign_pointer(p, v)  __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void rcu_note_qs(void);            // Scheduler: this CPU holds no read section
+void synchronize_rcu(void);        // Block until a grace period has passed
+void call_rcu(rcu_head_t* head, void (*func)(rcu_head_t* head));  // Run func after one
+
+// ============================================================================
+// INITIALIZATION AND STATISTICS
+// ============================================================================
+
+void rcu_init(void);               // After smp_init(): the grace period task
+void sync_get_stats(void);
+
+#endif // SYNC_H
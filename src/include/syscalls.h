@@ -124,16 +124,45 @@
 #define SYS_getrlimit              112
 #define SYS_getrusage              113
 #define SYS_sysinfo                114
+#define SYS_window_map             115
+#define SYS_window_commit          116
+#define SYS_event_map_queue        117
+#define SYS_ipc_create             118
+#define SYS_ipc_open               119
+#define SYS_ipc_destroy            120
+#define SYS_ipc_send               121
+#define SYS_ipc_call               122
+#define SYS_ipc_recv               123
+#define SYS_ipc_reply              124
+#define SYS_ipc_reply_recv         125
+#define SYS_ipc_map                126
+#define SYS_ipc_accept             127
+#define SYS_trace_ctl              128
+#define SYS_trace_map              129
+#define SYS_trace_read             130
+#define SYS_uring_setup            131
+#define SYS_uring_enter            132
+#define SYS_uring_map              133
+#define SYS_uring_register         134
+#define SYS_uring_destroy          135
+#define SYS_prof_ctl               136
+#define SYS_task_counters          137
+#define SYS_set_mempolicy          138
+
+#define NR_SYSCALLS                (SYS_set_mempolicy + 1)
 
 // System call handler prototype
 typedef int64_t (*syscall_handler_t)(uint64_t arg1, uint64_t arg2, uint64_t arg3,
                                     uint64_t arg4, uint64_t arg5, uint64_t arg6);
 
 // System call table
-extern syscall_handler_t sys_call_table[];
+extern const syscall_handler_t sys_call_table[NR_SYSCALLS];
 
-// System call dispatcher
+// System call dispatcher (SYSCALL fast path and int 0x80)
 int64_t syscall_dispatch(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t arg3,
                         uint64_t arg4, uint64_t arg5, uint64_t arg6);
 
+// Per-syscall call and cycle counts
+void syscall_get_stats(void);
+
 #endif /* _SYSCALLS_H */
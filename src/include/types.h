@@ -36,6 +36,12 @@ struct hlist_node {
     struct hlist_node *next, **pprev;
 };
 
+// Callback queued with call_rcu() (sync.h)
+struct rcu_head {
+    struct rcu_head* next;
+    void (*func)(struct rcu_head* head);
+};
+
 // Lock debugging (dummy for now)
 struct lock_class_key { };
 
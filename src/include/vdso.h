@@ -0,0 +1,68 @@
+/*
+ * vDSO Header
+ * Read-only clock page shared with userspace, read without a syscall
+ */
+
+#ifndef VDSO_H
+#define VDSO_H
+
+#include "types.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+// Fixed user addresses, below the user stack (elf_loader.c)
+#define VDSO_DATA_ADDR   0x7FFFFF000000ULL  // One page of vdso_data_t
+#define VDSO_TEXT_ADDR   0x7FFFFF001000ULL  // User-callable routines
+
+// Clock ids accepted by the time routine
+#define VDSO_CLOCK_MONOTONIC  0
+#define VDSO_CLOCK_REALTIME   1
+
+// ============================================================================
+// TYPES
+// ============================================================================
+
+typedef uint64_t (*vdso_time_ns_fn)(uint32_t clock);
+typedef uint64_t (*vdso_ticks_fn)(void);
+
+/*
+ * Layout of the data page. The kernel is the only writer and brackets each
+ * update with seq (odd while writing); readers retry until they see the
+ * same even value before and after copying the fields.
+ */
+typedef struct vdso_data {
+    volatile uint32_t seq;
+    uint32_t tsc_ok;              // 0: TSC unusable, use coarse_ns
+    uint64_t tsc_base;            // TSC value at monotonic time zero
+    uint64_t tsc_ns_mult;         // ns = (cycles * tsc_ns_mult) >> 32
+    uint64_t coarse_ns;           // Monotonic ns at the last PIT tick
+    uint64_t tick_us;             // Length of one sys_get_ticks() tick
+    uint64_t realtime_offset_ns;  // Added to monotonic for CLOCK_REALTIME
+
+    // Entry points (user addresses inside VDSO_TEXT_ADDR)
+    vdso_time_ns_fn time_ns;      // Either clock, in nanoseconds
+    vdso_ticks_fn get_ticks;      // Same value as sys_get_ticks()
+    vdso_ticks_fn realtime_ms;    // Same value as time_realtime_ms()
+} vdso_data_t;
+
+// ============================================================================
+// FUNCTIONS
+// ============================================================================
+
+// Map the page into user space and publish the clock (after timer_init)
+void vdso_init(void);
+
+// Map the same pages into a new address space (elf_loader.c)
+struct vm_context;
+int vdso_map(struct vm_context* ctx);
+
+// Seqlock writers: a new TSC calibration, or a PIT tick without a TSC
+void vdso_update_clock(uint64_t tsc_base, uint64_t tsc_ns_mult, uint64_t tick_us);
+void vdso_update_coarse(uint64_t now_ns);
+
+// Kernel-side realtime clock, same source as the user routines
+uint64_t vdso_realtime_offset_ns(void);
+
+#endif // VDSO_H
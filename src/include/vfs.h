@@ -21,6 +21,7 @@ struct module;
 struct hlist_head;
 struct hlist_head;
 struct lock_class_key;
+struct page_mapping;
 
 struct qstr {
     const unsigned char * name;
@@ -39,6 +40,14 @@ typedef enum {
     VFS_TYPE_SYMLINK
 } vfs_file_type_t;
 
+// Inode state
+#define I_NEW        0x01              // Being read in; wait for unlock_new_inode()
+#define I_DIRTY      0x02              // Newer than the filesystem's copy
+#define I_FREEING    0x04              // Being evicted; lookups wait for it
+#define I_REFERENCED 0x08              // Used since the LRU last passed
+#define I_LRU        0x10              // On the unused list
+#define I_HASHED     0x20              // Findable by (i_sb, i_ino)
+
 // VFS inode structure (Linux-style)
 struct inode {
     uint64_t i_ino;                    // Inode number
@@ -59,11 +68,26 @@ struct inode {
     const struct file_operations* i_fop;
 
     void* i_private;                   // Private data
+
+    // Inode cache
+    struct inode* i_hash_next;         // Hash chain
+    struct list_head i_lru;            // Unused list, oldest first
+    struct list_head i_sb_list;        // Cached inodes of i_sb
+    volatile uint32_t i_count;         // References
+    volatile uint32_t i_state;         // I_*
+    struct page_mapping* i_mapping;    // Cached data, NULL if none
+    struct rcu_head i_rcu;             // Eviction deferred by icache_shrink()
 };
 
-// VFS dentry structure (directory entry)
+// Dentry flags
+#define DCACHE_HASHED     0x01         // Findable by (parent, name)
+#define DCACHE_REFERENCED 0x02         // Looked up since the LRU last passed
+#define DCACHE_LRU        0x04         // On the unused list
+
+// VFS dentry structure (directory entry). A hashed dentry with no inode
+// is negative: it caches that the name doesn't exist.
 struct dentry {
-    uint32_t d_flags;                  // Dentry flags
+    volatile uint32_t d_flags;         // Dentry flags
     struct inode* d_inode;             // Associated inode
     struct dentry* d_parent;           // Parent directory
     struct list_head d_child;          // Child list (for directory cache)
@@ -78,6 +102,13 @@ struct dentry {
     const struct dentry_operations* d_op;
 
     void* d_private;                   // Private data
+
+    // Dentry cache
+    uint32_t d_name_hash;
+    struct dentry* d_hash_next;        // Hash chain, walked without locks
+    struct list_head d_lru;            // Unused list, oldest first
+    volatile uint32_t d_count;         // References; children hold their parent's
+    struct rcu_head d_rcu;             // Free deferred by dcache_shrink()
 };
 
 // VFS superblock structure
@@ -95,6 +126,18 @@ struct super_block {
 
     void* s_fs_info;                   // Filesystem private info
     char s_id[32];                     // Identifier
+
+    struct list_head s_inodes;         // Cached inodes (INIT_LIST_HEAD before use)
+};
+
+// Readahead window of an open file, in pages; advanced by
+// page_cache_ra_advance() on every read
+struct file_ra_state {
+    uint64_t start;                    // First page of the current window
+    uint32_t size;                     // Pages in it (0: no readahead, random)
+    uint32_t async_size;               // Reading into the last async_size pages opens the next
+    uint64_t prev_index;               // Last page the reader touched
+    uint32_t max_pages;                // Ceiling (0: default)
 };
 
 // VFS file structure
@@ -107,6 +150,7 @@ struct file {
     struct dentry* f_dentry;           // Associated dentry
 
     const struct file_operations* f_op;
+    struct file_ra_state f_ra;         // Page cache readahead
 
     void* private_data;                // Private data
 };
@@ -232,6 +276,43 @@ extern struct file_system_type* file_systems;
 // Filesystem registration functions
 int register_filesystem(struct file_system_type* fs);
 int unregister_filesystem(struct file_system_type* fs);
+void INIT_LIST_HEAD(struct list_head* list);
+
+// Dentry cache. d_alloc() returns a referenced dentry that the filesystem's
+// lookup() completes with d_add() (inode NULL caches a negative entry);
+// dput() moves unused dentries to the LRU, pruned by dcache_shrink(). A
+// dentry owns the inode reference handed to d_instantiate() / d_add().
+struct dentry* d_alloc(struct dentry* parent, const struct qstr* name);
+void d_free(struct dentry* dentry);    // Never added to the cache
+struct dentry* d_make_root(struct inode* root);
+void d_instantiate(struct dentry* dentry, struct inode* inode);
+void d_add(struct dentry* dentry, struct inode* inode);
+void d_drop(struct dentry* dentry);
+struct dentry* d_lookup(struct dentry* parent, const struct qstr* name);
+struct dentry* dget(struct dentry* dentry);
+void dput(struct dentry* dentry);
+void dcache_get_stats(void);
+
+// Inode cache, global and keyed by (sb, ino). iget_locked() returns the
+// inode referenced; if it has I_NEW the caller fills it in and calls
+// unlock_new_inode() (or iget_failed()). Unused inodes wait on an LRU:
+// icache_prune() trims it and may sleep, writing dirty inodes back through
+// s_op->write_inode first; icache_shrink() is the memory pressure hook and
+// only drops clean inodes without cached pages.
+struct inode* new_inode(struct super_block* sb);
+struct inode* iget_locked(struct super_block* sb, uint64_t ino);
+void unlock_new_inode(struct inode* inode);
+void iget_failed(struct inode* inode);
+struct inode* igrab(struct inode* inode);
+void iput(struct inode* inode);
+void mark_inode_dirty(struct inode* inode);
+void iterate_sb_inodes(struct super_block* sb, void (*fn)(struct inode*, void*), void* arg);
+void icache_prune(void);
+void icache_get_stats(void);
+
+// Absolute path to a referenced, positive dentry (NULL if it doesn't exist)
+void vfs_set_root(struct dentry* root);
+struct dentry* vfs_path_lookup(const char* pathname);
 
 // Path resolution
 struct path {
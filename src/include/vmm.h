@@ -24,12 +24,25 @@
 #define MAP_ANONYMOUS 0x20
 #define MAP_FIXED     0x10
 
+// User addresses. PML4[0] holds the kernel image and the identity-mapped
+// physical memory (paging.c), tables every context shares, so user
+// mappings start at the next 512GB slot.
+#define USER_SPACE_START 0x0000008000000000ULL
+#define USER_SPACE_END   0x0000800000000000ULL
+
+// madvise() advice
+#define MADV_NORMAL     0   // Default fault-around window
+#define MADV_RANDOM     1   // No fault-around
+#define MADV_SEQUENTIAL 2   // Widest fault-around window
+#define MADV_WILLNEED   3   // Fault the range in now
+
 // ============================================================================
 // TYPES
 // ============================================================================
 
 typedef struct vm_context vm_context_t;
 typedef struct vma vma_t;
+struct inode;
 
 // ============================================================================
 // FUNCTIONS
@@ -38,16 +51,36 @@ typedef struct vma vma_t;
 // Initialization
 void vmm_init(void);
 
-// Memory mapping
+// Memory mapping (file: an inode with a page cache, referenced while mapped)
 void* vmm_mmap(vm_context_t* ctx, void* addr, size_t length, 
-               int prot, int flags, void* file, uint64_t offset);
+               int prot, int flags, struct inode* file, uint64_t offset);
 int vmm_munmap(vm_context_t* ctx, void* addr, size_t length);
+void* vmm_map_frames(vm_context_t* ctx, void* addr, uintptr_t phys, size_t pages, int prot);
+void* vmm_map_frame_list(vm_context_t* ctx, void* addr, const uintptr_t* frames, size_t pages, int prot);
+int vmm_map_kernel_frames(vm_context_t* ctx, uintptr_t vaddr, uintptr_t phys, size_t pages, int prot);
+int vmm_pin_frames(uintptr_t vaddr, size_t pages, uintptr_t* frames);  // Referenced 4K frames, or -1
+void* vmm_map_file(vm_context_t* ctx, void* addr, size_t length, int prot,
+                   struct inode* inode, uint64_t offset, uint64_t file_size);
+void* vmm_map_stack(vm_context_t* ctx, uintptr_t top, size_t initial, size_t max);  // Grows down on faults
+int vmm_madvise(vm_context_t* ctx, void* addr, size_t length, int advice);
+vm_context_t* vmm_current_context(void);
+
+// Address spaces: an empty one or a copy-on-write clone of parent (one
+// reference each), and teardown of one nobody uses or has loaded
+vm_context_t* vmm_create_context(void);
+vm_context_t* vmm_fork_context(vm_context_t* parent);
+void vmm_destroy_context(vm_context_t* ctx);
+void vmm_context_get(vm_context_t* ctx);
+void vmm_context_put(vm_context_t* ctx);  // The last one destroys it after a grace period
+
+// Physical address for device DMA, faulting in / unsharing user pages; 0 if unbacked
+uintptr_t vmm_dma_address(uintptr_t vaddr, bool dev_writes);
 
 // Heap management (brk)
 void* vmm_brk(vm_context_t* ctx, void* addr);
 
-// Page fault handling
-void vmm_page_fault_handler(uintptr_t fault_addr, uint32_t error_code);
+// Page fault handling: 0 once the faulting access can be retried
+int vmm_page_fault_handler(uintptr_t fault_addr, uint32_t error_code);
 
 // Statistics
 void vmm_get_stats(void);
@@ -0,0 +1,291 @@
+/*
+ * Boot-Time Microbenchmarks
+ *
+ * Booting with "bench" on the command line (the second GRUB entry, which
+ * `make bench` selects) starts a task that times hot kernel paths - heap
+ * and page allocation, a yield round trip, the Internet checksum, window
+ * compositing and a disk read - and prints one line per path:
+ *
+ *   BENCH name=<path> samples=<n> min=<c> p50=<c> p90=<c> p99=<c> max=<c> mean=<c>
+ *
+ * in TSC cycles, less the cost of timing an empty call. The header line
+ * gives tsc_khz for converting to time. Each sample is one operation, so
+ * the percentiles keep the tail (an interrupt, a refill of a per-CPU
+ * cache) that an average over a loop would hide.
+ */
+
+#include "kernel.h"
+#include "smp.h"
+#include "io.h"
+#include "net.h"
+#include "drivers/block.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+#define BENCH_SAMPLES      2048      // Timed operations per path
+#define BENCH_DISK_SAMPLES 256       // ... for the disk, each one a real transfer
+#define BENCH_WARMUP       64        // Untimed operations first
+#define BENCH_WINDOW_SIZE  256       // Square window composited per sample
+#define BENCH_DISK_SPAN    32768     // Sectors the disk reads walk through (16 MB)
+#define BENCH_EXIT_PORT    0xF4      // QEMU isa-debug-exit (make bench)
+
+// ============================================================================
+// STATE
+// ============================================================================
+
+static uint64_t bench_samples[BENCH_SAMPLES];
+static uint64_t bench_overhead = 0;  // Cycles to time an empty operation
+static volatile bool bench_yielding = false;
+static volatile uint32_t bench_sink;
+static uint8_t bench_data[1536];
+
+// Serialized TSC read: earlier instructions finish before the timestamp
+static inline uint64_t bench_tsc(void)
+{
+    __asm__ volatile("lfence" ::: "memory");
+    return rdtsc();
+}
+
+// ============================================================================
+// STATISTICS
+// ============================================================================
+
+static void bench_sort(uint64_t* v, size_t n)
+{
+    for (size_t gap = n / 2; gap > 0; gap /= 2) {
+        for (size_t i = gap; i < n; i++) {
+            uint64_t x = v[i];
+            size_t j = i;
+            while (j >= gap && v[j - gap] > x) {
+                v[j] = v[j - gap];
+                j -= gap;
+            }
+            v[j] = x;
+        }
+    }
+}
+
+static uint64_t bench_percentile(const uint64_t* sorted, size_t n, unsigned pct)
+{
+    return sorted[(n - 1) * pct / 100];
+}
+
+// Time samples calls of op(arg), one at a time, and print the line
+static void bench_run(const char* name, void (*op)(void*), void* arg, size_t samples)
+{
+    for (int i = 0; i < BENCH_WARMUP; i++) {
+        op(arg);
+    }
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < samples; i++) {
+        uint64_t start = bench_tsc();
+        op(arg);
+        uint64_t cycles = bench_tsc() - start;
+        cycles = cycles > bench_overhead ? cycles - bench_overhead : 0;
+        bench_samples[i] = cycles;
+        sum += cycles;
+    }
+
+    bench_sort(bench_samples, samples);
+    kprintf("BENCH name=%s samples=%lu min=%lu p50=%lu p90=%lu p99=%lu max=%lu mean=%lu\n",
+            name, samples, bench_samples[0], bench_percentile(bench_samples, samples, 50),
+            bench_percentile(bench_samples, samples, 90),
+            bench_percentile(bench_samples, samples, 99), bench_samples[samples - 1],
+            sum / samples);
+
+    // The transmit ring drops what does not fit: let each line out first
+    serial_drain();
+}
+
+static void bench_skip(const char* name, const char* reason)
+{
+    kprintf("BENCH name=%s skipped reason=%s\n", name, reason);
+    serial_drain();
+}
+
+// ============================================================================
+// OPERATIONS
+// ============================================================================
+
+static void op_empty(void* arg)
+{
+    (void)arg;
+    __asm__ volatile("" ::: "memory");
+}
+
+static void op_kmalloc(void* arg)
+{
+    kfree(kmalloc((size_t)(uintptr_t)arg));
+}
+
+static void op_pmm(void* arg)
+{
+    size_t pages = (size_t)(uintptr_t)arg;
+    uintptr_t phys = pmm_alloc_pages(pages);
+    if (phys) {
+        pmm_free_pages(phys, pages);
+    }
+}
+
+// With the partner below on the same CPU: two context switches
+static void op_yield(void* arg)
+{
+    (void)arg;
+    scheduler_yield();
+}
+
+static void bench_yield_partner(void* arg)
+{
+    (void)arg;
+    while (bench_yielding) {
+        scheduler_yield();
+    }
+}
+
+static void op_checksum(void* arg)
+{
+    bench_sink = checksum(bench_data, (uint32_t)(uintptr_t)arg);
+}
+
+static void op_composite(void* arg)
+{
+    int window_id = (int)(intptr_t)arg;
+    wm_damage_window(window_id, 0, 0, BENCH_WINDOW_SIZE, BENCH_WINDOW_SIZE);
+    wm_composite_window(window_id);
+}
+
+typedef struct {
+    block_device_t* dev;
+    void* buf;
+    uint32_t count;            // Sectors per 4K read
+    uint64_t sector;
+    uint64_t span;
+    uint32_t errors;
+} bench_disk_t;
+
+// Straight to the driver, past the request queue and the page cache
+static void op_disk_read(void* arg)
+{
+    bench_disk_t* d = (bench_disk_t*)arg;
+    if (d->dev->read(d->dev, d->sector, d->count, d->buf) < 0) {
+        d->errors++;
+    }
+    // A stride that is not sequential, so no read-ahead serves the next one
+    d->sector = (d->sector + 61 * d->count) % d->span;
+}
+
+// ============================================================================
+// BENCHMARKS
+// ============================================================================
+
+static void bench_scheduler(int cpu)
+{
+    bench_yielding = true;
+    if (scheduler_create_task_ex(bench_yield_partner, NULL, 8192, 10, "bench_yield",
+                                 SCHED_FLAG_CPU(cpu)) < 0) {
+        bench_yielding = false;
+        bench_skip("sched_yield_pair", "no_task");
+        return;
+    }
+    bench_run("sched_yield_pair", op_yield, NULL, BENCH_SAMPLES);
+    bench_yielding = false;
+}
+
+static void bench_composite(void)
+{
+    int window_id = window_create(0, 0, BENCH_WINDOW_SIZE, BENCH_WINDOW_SIZE, 0);
+    if (window_id <= 0) {
+        bench_skip("window_composite_256", "no_window");
+        return;
+    }
+    wm_register_window(window_id, 0, 0, BENCH_WINDOW_SIZE, BENCH_WINDOW_SIZE, 0, "bench");
+
+    // Half-transparent pixels take the blending path
+    uint32_t* pixels = (uint32_t*)window_get_buffer(window_id);
+    for (int i = 0; i < BENCH_WINDOW_SIZE * BENCH_WINDOW_SIZE; i++) {
+        pixels[i] = 0x80336699;
+    }
+
+    bench_run("window_composite_256", op_composite, (void*)(intptr_t)window_id, BENCH_SAMPLES);
+    wm_unregister_window(window_id);
+    window_destroy(window_id);
+}
+
+static void bench_disk(void)
+{
+    block_device_t* dev = block_get_device("sata0");
+    if (!dev || !dev->sector_size || dev->sector_size > PAGE_SIZE ||
+        (dev->total_sectors && dev->total_sectors < PAGE_SIZE / dev->sector_size)) {
+        bench_skip("ahci_read_4k", "no_disk");
+        return;
+    }
+
+    bench_disk_t d = { dev, (void*)pmm_alloc_page(), (uint32_t)(PAGE_SIZE / dev->sector_size), 0,
+                       BENCH_DISK_SPAN, 0 };
+    if (!d.buf) {
+        bench_skip("ahci_read_4k", "no_memory");
+        return;
+    }
+    if (dev->total_sectors && dev->total_sectors < d.span) {
+        d.span = dev->total_sectors - dev->total_sectors % d.count;
+    }
+
+    bench_run("ahci_read_4k", op_disk_read, &d, BENCH_DISK_SAMPLES);
+    if (d.errors) {
+        kprintf("BENCH name=ahci_read_4k errors=%u\n", d.errors);
+    }
+    pmm_free_page((void*)d.buf);
+}
+
+static void bench_task(void* arg)
+{
+    (void)arg;
+    int cpu = smp_cpu_id();
+
+    kprintf("BENCH-BEGIN tsc_khz=%lu cpus=%d cpu=%d\n", timer_tsc_khz(),
+            smp_cpu_count(), cpu);
+
+    // Timing itself costs something; the minimum of many is what is subtracted
+    bench_overhead = 0;
+    bench_run("overhead", op_empty, NULL, BENCH_SAMPLES);
+    bench_overhead = bench_samples[0];
+
+    bench_run("kmalloc_free_64", op_kmalloc, (void*)64, BENCH_SAMPLES);
+    bench_run("kmalloc_free_1k", op_kmalloc, (void*)1024, BENCH_SAMPLES);
+    bench_run("kmalloc_free_16k", op_kmalloc, (void*)16384, BENCH_SAMPLES);
+    bench_run("pmm_alloc_free_1", op_pmm, (void*)1, BENCH_SAMPLES);
+    bench_run("pmm_alloc_free_8", op_pmm, (void*)8, BENCH_SAMPLES);
+    bench_scheduler(cpu);
+
+    for (size_t i = 0; i < sizeof(bench_data); i++) {
+        bench_data[i] = (uint8_t)(i * 7 + 3);
+    }
+    bench_run("checksum_64", op_checksum, (void*)64, BENCH_SAMPLES);
+    bench_run("checksum_1500", op_checksum, (void*)1500, BENCH_SAMPLES);
+
+    bench_composite();
+    bench_disk();
+
+    kprintf("BENCH-END\n");
+    serial_drain();
+
+    // Under `make bench` this ends QEMU; elsewhere the write goes nowhere
+    outb(BENCH_EXIT_PORT, 0);
+}
+
+// ============================================================================
+// INITIALIZATION
+// ============================================================================
+
+// Run on the last CPU, away from the BSP's device interrupts
+void bench_start(void)
+{
+    int cpu = smp_cpu_count() - 1;
+    KINFO("Benchmark mode: running on CPU %d", cpu);
+    if (scheduler_create_task_ex(bench_task, NULL, 16384, 10, "bench", SCHED_FLAG_CPU(cpu)) < 0) {
+        KERROR("Benchmark mode: could not start the benchmark task");
+    }
+}
@@ -1,15 +1,24 @@
 /*
  * ELF64 Loader
- * Loads and executes ELF64 userspace programs
+ * Maps ELF64 userspace programs for demand paging and executes them
  */
 
 #include "kernel.h"
 #include "elf.h"
+#include "vmm.h"
+#include "page_cache.h"
+#include "vdso.h"
 
 // User space memory layout
-#define USER_STACK_TOP   0x7FFFFFFFE000ULL  // Top of user stack
-#define USER_STACK_SIZE  (2 * 1024 * 1024)  // 2MB stack
-#define USER_CODE_BASE   0x400000ULL        // Base address for code
+#define USER_STACK_TOP     0x7FFFFFFFE000ULL  // Top of user stack
+#define USER_STACK_SIZE    (2 * 1024 * 1024)  // 2MB stack, at most
+#define USER_STACK_INITIAL (16 * 1024)        // Mapped up front; the rest on faults
+
+// Where _start finds its stack: the zero-filled words there read as argc 0,
+// an empty argv and envp and an empty auxiliary vector (16-byte aligned)
+#define USER_STACK_ENTRY   (USER_STACK_TOP - 64)
+
+#define ELF_MAX_PHDRS      64                 // Program headers read per binary
 
 // Validate ELF header
 int elf_validate(const void* elf_data, size_t size) {
@@ -69,23 +78,48 @@ uint64_t elf_get_entry(const void* elf_data) {
     return ehdr->e_entry;
 }
 
-// Load ELF program into memory
-int elf_load(const void* elf_data, size_t size, uint64_t* entry_point) {
-    // Validate first
-    if (elf_validate(elf_data, size) != 0) {
+/*
+ * Set up a program's address space in ctx from inode. Nothing is read but
+ * the headers: each PT_LOAD segment becomes a file-backed VMA faulted in
+ * from the page cache, so processes running the same binary share its
+ * read-only pages, and the stack starts small and grows on faults. On
+ * failure the caller discards ctx, with whatever was mapped so far.
+ */
+int elf_load(vm_context_t* ctx, struct inode* inode, uint64_t* entry_point) {
+    if (!ctx || !inode || !inode->i_mapping) {
+        KERROR("ELF: No page cache behind the file");
         return -1;
     }
 
-    const elf64_ehdr_t* ehdr = (const elf64_ehdr_t*)elf_data;
-    
-    // Get program headers
-    const elf64_phdr_t* phdr = (const elf64_phdr_t*)((uintptr_t)elf_data + ehdr->e_phoff);
-    
-    KINFO("ELF: Loading program with %d segments", ehdr->e_phnum);
-    KINFO("ELF: Entry point at 0x%lx", ehdr->e_entry);
-
-    // Load each PT_LOAD segment
-    for (int i = 0; i < ehdr->e_phnum; i++) {
+    elf64_ehdr_t ehdr;
+    if (inode->i_size < sizeof(ehdr) ||
+        page_cache_read(inode->i_mapping, 0, &ehdr, sizeof(ehdr)) < 0 ||
+        elf_validate(&ehdr, sizeof(ehdr)) != 0) {
+        return -1;
+    }
+
+    size_t phdr_size = (size_t)ehdr.e_phnum * sizeof(elf64_phdr_t);
+    if (ehdr.e_phnum == 0 || ehdr.e_phnum > ELF_MAX_PHDRS ||
+        ehdr.e_phentsize != sizeof(elf64_phdr_t) || ehdr.e_phoff + phdr_size > inode->i_size) {
+        KERROR("ELF: Bad program header table");
+        return -1;
+    }
+
+    elf64_phdr_t* phdr = kmalloc(phdr_size);
+    if (!phdr) {
+        return -1;
+    }
+    if (page_cache_read(inode->i_mapping, ehdr.e_phoff, phdr, phdr_size) < 0) {
+        kfree(phdr);
+        return -1;
+    }
+
+    KINFO("ELF: Loading program with %d segments", ehdr.e_phnum);
+    KINFO("ELF: Entry point at 0x%lx", ehdr.e_entry);
+
+    int ret = 0;
+    uint64_t prev_end = 0;
+    for (int i = 0; i < ehdr.e_phnum; i++) {
         if (phdr[i].p_type != PT_LOAD) {
             continue;
         }
@@ -105,95 +139,105 @@ int elf_load(const void* elf_data, size_t size, uint64_t* entry_point) {
                (flags & PF_W) ? 'W' : '-',
                (flags & PF_X) ? 'X' : '-');
 
-        // Allocate memory for this segment
-        // Calculate number of pages needed
+        // Pages are mapped from the file as they are: the segment has to
+        // sit at the same offset within the page in memory and in the file
         uint64_t start_page = vaddr & ~0xFFFULL;
         uint64_t end_page = (vaddr + memsz + 0xFFF) & ~0xFFFULL;
-        size_t num_pages = (end_page - start_page) / PAGE_SIZE;
-
-        KDEBUG("  Allocating %lu pages from 0x%lx to 0x%lx", 
-               num_pages, start_page, end_page);
-
-        // Allocate physical pages
-        for (size_t pg = 0; pg < num_pages; pg++) {
-            uintptr_t phys_page = pmm_alloc_page();
-            if (!phys_page) {
-                KERROR("ELF: Failed to allocate physical page");
-                return -1;
-            }
-
-            uint64_t virt_page = start_page + (pg * PAGE_SIZE);
-            
-            // Map page with appropriate permissions
-            uint32_t page_flags = PAGE_PRESENT | PAGE_USER;
-            if (flags & PF_W) {
-                page_flags |= PAGE_WRITABLE;
-            }
-            // Note: Execute permission is implicit (no NX bit set)
-
-            if (vmm_map_page(virt_page, phys_page, page_flags) != 0) {
-                KERROR("ELF: Failed to map page at 0x%lx", virt_page);
-                return -1;
-            }
+        if (((vaddr ^ offset) & 0xFFF) || filesz > memsz || offset + filesz > inode->i_size ||
+            end_page <= start_page || end_page > USER_STACK_TOP - USER_STACK_SIZE) {
+            KERROR("ELF: Segment %d cannot be mapped", i);
+            ret = -1;
+            break;
         }
-
-        // Copy data from file to memory
-        if (filesz > 0) {
-            const uint8_t* src = (const uint8_t*)elf_data + offset;
-            uint8_t* dst = (uint8_t*)vaddr;
-            memcpy(dst, src, filesz);
+        if (start_page < USER_SPACE_START) {
+            // The kernel's direct map lives there, in tables every process shares
+            KERROR("ELF: Segment %d at 0x%lx is below user space (0x%llx)", i, vaddr,
+                   USER_SPACE_START);
+            ret = -1;
+            break;
         }
-
-        // Zero out BSS (if memsz > filesz)
-        if (memsz > filesz) {
-            uint8_t* bss = (uint8_t*)(vaddr + filesz);
-            memset(bss, 0, memsz - filesz);
+        if (start_page < prev_end) {
+            KERROR("ELF: Segment %d shares a page with the one before", i);
+            ret = -1;
+            break;
+        }
+        prev_end = end_page;
+
+        // x86 pages are always readable
+        int prot = PROT_READ;
+        if (flags & PF_W) prot |= PROT_WRITE;
+        if (flags & PF_X) prot |= PROT_EXEC;
+
+        // The file data ends at filesz; the rest of memsz (.bss) is zero-fill
+        if (!vmm_map_file(ctx, (void*)start_page, end_page - start_page, prot, inode,
+                          offset & ~0xFFFULL, filesz + (vaddr & 0xFFF))) {
+            KERROR("ELF: Failed to map segment %d", i);
+            ret = -1;
+            break;
         }
+    }
+    kfree(phdr);
+    if (ret < 0) {
+        return -1;
+    }
 
-        KDEBUG("  Segment loaded successfully");
+    // SYSRET would fault in ring 0 on a non-canonical RIP
+    if (ehdr.e_entry < USER_SPACE_START || ehdr.e_entry >= USER_STACK_TOP - USER_STACK_SIZE) {
+        KERROR("ELF: Entry point 0x%lx is outside user space", ehdr.e_entry);
+        return -1;
     }
 
     // Set up user stack
-    KDEBUG("ELF: Setting up user stack");
-    uint64_t stack_bottom = USER_STACK_TOP - USER_STACK_SIZE;
-    size_t stack_pages = USER_STACK_SIZE / PAGE_SIZE;
-
-    for (size_t pg = 0; pg < stack_pages; pg++) {
-        uintptr_t phys_page = pmm_alloc_page();
-        if (!phys_page) {
-            KERROR("ELF: Failed to allocate stack page");
-            return -1;
-        }
-
-        uint64_t virt_page = stack_bottom + (pg * PAGE_SIZE);
-        if (vmm_map_page(virt_page, phys_page, 
-                        PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE) != 0) {
-            KERROR("ELF: Failed to map stack page");
-            return -1;
-        }
+    if (!vmm_map_stack(ctx, USER_STACK_TOP, USER_STACK_INITIAL, USER_STACK_SIZE)) {
+        KERROR("ELF: Failed to set up the stack");
+        return -1;
+    }
+    if (vdso_map(ctx) < 0) {
+        return -1;
     }
 
-    // Zero out stack
-    memset((void*)stack_bottom, 0, USER_STACK_SIZE);
-
-    KINFO("ELF: Program loaded successfully");
-    KINFO("ELF: Code base: 0x%lx", USER_CODE_BASE);
-    KINFO("ELF: Stack: 0x%lx - 0x%lx", stack_bottom, USER_STACK_TOP);
+    KINFO("ELF: Program mapped, stack 0x%lx - 0x%lx (grows to %lu KB)",
+          USER_STACK_TOP - USER_STACK_INITIAL, USER_STACK_TOP, USER_STACK_SIZE / 1024);
 
     if (entry_point) {
-        *entry_point = ehdr->e_entry;
+        *entry_point = ehdr.e_entry;
     }
 
     return 0;
 }
 
-// Execute loaded ELF program (transition to userspace)
-int elf_exec(uint64_t entry_point) {
-    KINFO("ELF: Executing program at 0x%lx", entry_point);
-    
-    // This will be implemented when we add user mode transition
-    // For now, return success
-    KWARN("ELF: User mode execution not yet implemented");
-    
+// Start the program in inode as a new process, which tells notify (if
+// any) its exit status. Returns its pid, or -1.
+pid_t elf_spawn(struct inode* inode, task_exit_t* notify)
+{
+    vm_context_t* ctx = vmm_create_context();
+    if (!ctx) {
+        return -1;
+    }
+
+    uint64_t entry;
+    if (elf_load(ctx, inode, &entry) < 0) {
+        vmm_destroy_context(ctx);
+        return -1;
+    }
+    return scheduler_create_user_task(ctx, (void*)entry, (void*)USER_STACK_ENTRY, notify);
+}
+
+// execve(): replace the calling process's program with the one in inode.
+// On failure the caller still runs the old one.
+int elf_exec(struct inode* inode)
+{
+    vm_context_t* ctx = vmm_create_context();
+    if (!ctx) {
+        return -1;
+    }
+
+    uint64_t entry;
+    if (elf_load(ctx, inode, &entry) < 0 || scheduler_exec(ctx, entry, USER_STACK_ENTRY) < 0) {
+        vmm_destroy_context(ctx);
+        return -1;
+    }
+
+    KINFO("ELF: Executing program at 0x%lx", entry);
     return 0;
 }
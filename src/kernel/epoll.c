@@ -0,0 +1,338 @@
+/*
+ * Readiness Notification (epoll)
+ *
+ * An interest set hooks a watcher onto each object's wait queue. A wakeup
+ * moves the object's item onto the set's ready list, so epoll_wait() only
+ * looks at objects that may be ready, however many are watched.
+ *
+ * Level-triggered items go back on the ready list after each report and
+ * drop off the first time they poll not ready; edge-triggered ones wait
+ * for the next wakeup.
+ */
+
+#include "kernel.h"
+
+// ============================================================================
+// CONFIGURATION
+// ============================================================================
+
+#define EP_MIN_BUCKETS   64      // Interest hash, doubled as it fills
+#define EP_MAX_LOAD      2       // Items per bucket before growing
+
+// ============================================================================
+// DATA STRUCTURES
+// ============================================================================
+
+typedef struct epitem {
+    struct epitem* hash_next;
+    struct epitem* ready_next;
+    epoll_t* ep;
+    void* obj;
+    poll_fn_t poll;
+    uint32_t events;             // Interest, with EPOLLET / EPOLLONESHOT
+    uint64_t data;
+    bool ready;                  // On the ready list
+    bool disarmed;               // EPOLLONESHOT fired
+    wait_entry_t wait;           // Watcher on the object's queue
+} epitem_t;
+
+struct epoll {
+    spinlock_t lock;             // Hash, ready list and item flags
+    spinlock_t ctl_lock;         // One epoll_ctl() at a time
+    epitem_t** buckets;
+    uint32_t mask;
+    uint32_t count;
+    epitem_t* ready_head;
+    epitem_t* ready_tail;
+    wait_queue_t wait;           // epoll_wait() callers
+};
+
+// ============================================================================
+// INTEREST HASH (ep->lock held)
+// ============================================================================
+
+static inline uint32_t ep_hashfn(void* obj, uint32_t mask)
+{
+    uint64_t h = (uint64_t)(uintptr_t)obj * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32) & mask;
+}
+
+static epitem_t* ep_find(epoll_t* ep, void* obj)
+{
+    for (epitem_t* item = ep->buckets[ep_hashfn(obj, ep->mask)]; item; item = item->hash_next) {
+        if (item->obj == obj) return item;
+    }
+    return NULL;
+}
+
+// Double the table; on no memory the chains just get longer
+static void ep_grow(epoll_t* ep)
+{
+    uint32_t size = (ep->mask + 1) * 2;
+    epitem_t** buckets = kmalloc_tracked(size * sizeof(epitem_t*), "epoll_hash");
+    if (!buckets) return;
+    memset(buckets, 0, size * sizeof(epitem_t*));
+
+    for (uint32_t i = 0; i <= ep->mask; i++) {
+        while (ep->buckets[i]) {
+            epitem_t* item = ep->buckets[i];
+            ep->buckets[i] = item->hash_next;
+            uint32_t h = ep_hashfn(item->obj, size - 1);
+            item->hash_next = buckets[h];
+            buckets[h] = item;
+        }
+    }
+    kfree_tracked(ep->buckets);
+    ep->buckets = buckets;
+    ep->mask = size - 1;
+}
+
+static void ep_unhash(epoll_t* ep, epitem_t* item)
+{
+    epitem_t** link = &ep->buckets[ep_hashfn(item->obj, ep->mask)];
+    while (*link != item) link = &(*link)->hash_next;
+    *link = item->hash_next;
+    ep->count--;
+}
+
+// ============================================================================
+// READY LIST (ep->lock held)
+// ============================================================================
+
+static void ep_make_ready(epoll_t* ep, epitem_t* item)
+{
+    if (item->ready || item->disarmed) return;
+    item->ready = true;
+    item->ready_next = NULL;
+    if (ep->ready_tail) {
+        ep->ready_tail->ready_next = item;
+    } else {
+        ep->ready_head = item;
+    }
+    ep->ready_tail = item;
+}
+
+static void ep_unready(epoll_t* ep, epitem_t* item)
+{
+    if (!item->ready) return;
+    epitem_t** link = &ep->ready_head;
+    epitem_t* prev = NULL;
+    while (*link != item) {
+        prev = *link;
+        link = &(*link)->ready_next;
+    }
+    *link = item->ready_next;
+    if (ep->ready_tail == item) ep->ready_tail = prev;
+    item->ready = false;
+}
+
+// Watcher on the object's wait queue: its lock held, maybe in an interrupt
+static void ep_wakeup(wait_entry_t* entry)
+{
+    epitem_t* item = (epitem_t*)entry->data;
+    epoll_t* ep = item->ep;
+
+    uint64_t flags = spin_lock_irqsave(&ep->lock);
+    bool wake = !item->ready && !item->disarmed;
+    ep_make_ready(ep, item);
+    spin_unlock_irqrestore(&ep->lock, flags);
+
+    if (wake) wake_up(&ep->wait);
+}
+
+// ============================================================================
+// PUBLIC API
+// ============================================================================
+
+epoll_t* epoll_create(void)
+{
+    epoll_t* ep = kmalloc_tracked(sizeof(epoll_t), "epoll");
+    if (!ep) return NULL;
+    memset(ep, 0, sizeof(epoll_t));
+
+    ep->buckets = kmalloc_tracked(EP_MIN_BUCKETS * sizeof(epitem_t*), "epoll_hash");
+    if (!ep->buckets) {
+        kfree_tracked(ep);
+        return NULL;
+    }
+    memset(ep->buckets, 0, EP_MIN_BUCKETS * sizeof(epitem_t*));
+    ep->mask = EP_MIN_BUCKETS - 1;
+    ep->lock = (spinlock_t)SPINLOCK_INIT;
+    ep->ctl_lock = (spinlock_t)SPINLOCK_INIT;
+    wait_queue_init(&ep->wait);
+    return ep;
+}
+
+void epoll_destroy(epoll_t* ep)
+{
+    if (!ep) return;
+
+    for (uint32_t i = 0; i <= ep->mask; i++) {
+        while (ep->buckets[i]) {
+            epitem_t* item = ep->buckets[i];
+            ep->buckets[i] = item->hash_next;
+            wait_remove_watch(&item->wait);
+            kfree_tracked(item);
+        }
+    }
+    kfree_tracked(ep->buckets);
+    kfree_tracked(ep);
+}
+
+int epoll_ctl(epoll_t* ep, int op, void* obj, poll_fn_t poll, const epoll_event_t* event)
+{
+    if (!ep || !obj) return -1;
+    if (op != EPOLL_CTL_DEL && (!event || (op == EPOLL_CTL_ADD && !poll))) return -1;
+
+    uint64_t ctl = spin_lock_irqsave(&ep->ctl_lock);
+    uint64_t flags = spin_lock_irqsave(&ep->lock);
+    epitem_t* item = ep_find(ep, obj);
+    int ret = 0;
+
+    if (op == EPOLL_CTL_ADD) {
+        spin_unlock_irqrestore(&ep->lock, flags);
+        if (item) {
+            ret = -1;  // Already watched
+            goto out;
+        }
+
+        item = kmalloc_tracked(sizeof(epitem_t), "epoll_item");
+        if (!item) {
+            ret = -1;
+            goto out;
+        }
+        memset(item, 0, sizeof(epitem_t));
+        item->ep = ep;
+        item->obj = obj;
+        item->poll = poll;
+        item->events = event->events;
+        item->data = event->data;
+
+        wait_queue_t* wq = NULL;
+        uint32_t revents = poll(obj, &wq);
+        if (!wq) {
+            kfree_tracked(item);
+            ret = -1;  // Nothing to watch it by
+            goto out;
+        }
+
+        flags = spin_lock_irqsave(&ep->lock);
+        if (ep->count >= (ep->mask + 1) * EP_MAX_LOAD) ep_grow(ep);
+        uint32_t h = ep_hashfn(obj, ep->mask);
+        item->hash_next = ep->buckets[h];
+        ep->buckets[h] = item;
+        ep->count++;
+        spin_unlock_irqrestore(&ep->lock, flags);
+
+        // Hooked before the readiness check: a wakeup in between is kept
+        wait_add_watch(wq, &item->wait, ep_wakeup, item);
+        revents = poll(obj, &wq);
+        if (revents & (item->events | EPOLLERR | EPOLLHUP)) ep_wakeup(&item->wait);
+        goto out;
+    }
+
+    if (!item) {
+        spin_unlock_irqrestore(&ep->lock, flags);
+        ret = -1;
+        goto out;
+    }
+
+    if (op == EPOLL_CTL_DEL) {
+        spin_unlock_irqrestore(&ep->lock, flags);
+        wait_remove_watch(&item->wait);  // No ep_wakeup() after this
+        flags = spin_lock_irqsave(&ep->lock);
+        ep_unready(ep, item);
+        ep_unhash(ep, item);
+        spin_unlock_irqrestore(&ep->lock, flags);
+        kfree_tracked(item);
+        goto out;
+    }
+
+    if (op == EPOLL_CTL_MOD) {
+        item->events = event->events;
+        item->data = event->data;
+        item->disarmed = false;
+        spin_unlock_irqrestore(&ep->lock, flags);
+
+        wait_queue_t* wq;
+        if (item->poll(obj, &wq) & (item->events | EPOLLERR | EPOLLHUP)) ep_wakeup(&item->wait);
+        goto out;
+    }
+
+    spin_unlock_irqrestore(&ep->lock, flags);
+    ret = -1;
+out:
+    spin_unlock_irqrestore(&ep->ctl_lock, ctl);
+    return ret;
+}
+
+// Report what is ready on the list; ep->lock held. Items are polled under
+// the lock (poll functions don't take the objects' locks), so none can be
+// freed under us.
+static int ep_collect(epoll_t* ep, epoll_event_t* events, int max)
+{
+    int count = 0;
+    epitem_t* requeue = NULL;      // Level-triggered items reported
+    epitem_t* requeue_tail = NULL;
+
+    while (count < max && ep->ready_head) {
+        epitem_t* item = ep->ready_head;
+        ep->ready_head = item->ready_next;
+        if (!ep->ready_head) ep->ready_tail = NULL;
+        item->ready = false;
+
+        wait_queue_t* wq;
+        uint32_t revents = item->poll(item->obj, &wq) & (item->events | EPOLLERR | EPOLLHUP);
+        if (!revents || item->disarmed) continue;
+
+        events[count].events = revents;
+        events[count].data = item->data;
+        count++;
+
+        if (item->events & EPOLLONESHOT) {
+            item->disarmed = true;
+        } else if (!(item->events & EPOLLET)) {
+            // Still ready next time unless a poll then says otherwise
+            item->ready = true;
+            item->ready_next = NULL;
+            if (requeue_tail) {
+                requeue_tail->ready_next = item;
+            } else {
+                requeue = item;
+            }
+            requeue_tail = item;
+        }
+    }
+
+    // Behind anything still waiting, so busy objects can't starve the rest
+    if (requeue) {
+        if (ep->ready_tail) {
+            ep->ready_tail->ready_next = requeue;
+        } else {
+            ep->ready_head = requeue;
+        }
+        ep->ready_tail = requeue_tail;
+    }
+    return count;
+}
+
+int epoll_wait(epoll_t* ep, epoll_event_t* events, int max, uint64_t deadline_us)
+{
+    if (!ep || !events || max <= 0) return -1;
+
+    wait_entry_t wait;
+    for (;;) {
+        wait_prepare(&ep->wait, &wait);
+        uint64_t flags = spin_lock_irqsave(&ep->lock);
+        int count = ep_collect(ep, events, max);
+        spin_unlock_irqrestore(&ep->lock, flags);
+
+        if (count > 0 || deadline_us == 0) {
+            wait_finish(&wait);
+            return count;
+        }
+        int timed_out = wait_schedule(&wait, deadline_us);
+        wait_finish(&wait);
+        if (timed_out < 0) return 0;
+    }
+}
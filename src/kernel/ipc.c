@@ -0,0 +1,686 @@
+/*
+ * Message-Passing IPC Channels
+ *
+ * A channel is a ring of fixed-size messages in a shared memory segment,
+ * filled by senders through the kernel and drained by the task that
+ * created it, through ipc_recv() or from its own mapping of the ring. A
+ * receiver about to sleep rings for the doorbell; only then does a send
+ * cost a wakeup.
+ *
+ * Payloads past the inline bytes travel as page grants: the sender's
+ * frames are referenced and mapped into the receiver, so nothing is copied
+ * between two user spaces. ipc_call() blocks for the reply and, when the
+ * receiver waits on this CPU, switches straight to it (wake_up_sync);
+ * ipc_reply_recv() hands the CPU back to the caller the same way.
+ */
+
+#include "kernel.h"
+#include "vmm.h"
+#include "sync.h"
+
+// ============================================================================
+// CONFIGURATION
+// ============================================================================
+
+#define IPC_MAX_CHANNELS 16
+#define IPC_MAX_CALLS    32      // Calls awaiting a reply, per channel
+
+// ============================================================================
+// DATA STRUCTURES
+// ============================================================================
+
+// Pages in flight between two spaces, each frame referenced
+typedef struct ipc_grant {
+    struct ipc_grant* next;
+    uint32_t id;
+    size_t len;
+    size_t pages;
+    uintptr_t frames[];
+} ipc_grant_t;
+
+// A caller waiting for its reply. Slots outlive their calls, so a reply
+// racing with a timeout at worst wakes the slot's next user for nothing.
+typedef struct {
+    uint32_t id;                 // 0: free
+    volatile bool done;
+    bool failed;                 // The channel went away
+    ipc_msg_t reply;
+    ipc_grant_t* grant;          // Reply payload, mapped by the caller
+    wait_queue_t waiters;
+} ipc_call_t;
+
+typedef struct {
+    bool live;
+    char name[IPC_NAME_MAX];
+    pid_t owner;
+    int shmid;
+    ipc_ring_t* ring;
+    spinlock_t lock;             // Senders, calls and grants
+    wait_queue_t receivers;      // The owner, once it rang for the doorbell
+    ipc_grant_t* grants;         // Payloads of queued messages
+    uint32_t next_grant;
+    uint32_t call_gen;
+    ipc_call_t calls[IPC_MAX_CALLS];
+} ipc_channel_t;
+
+static ipc_channel_t channels[IPC_MAX_CHANNELS];
+static percpu_rwlock_t channels_lock = PERCPU_RWLOCK_INIT;  // Names and slots
+
+// Statistics
+static uint64_t ipc_messages = 0;
+static uint64_t ipc_calls = 0;
+static uint64_t ipc_handoffs = 0;        // Calls and replies that switched directly
+static uint64_t ipc_doorbells = 0;
+static uint64_t ipc_pages_remapped = 0;
+static uint64_t ipc_bytes_copied = 0;    // Payloads that had to be copied instead
+
+// ============================================================================
+// HELPERS
+// ============================================================================
+
+static ipc_channel_t* ipc_get(int channel)
+{
+    if (channel < 0 || channel >= IPC_MAX_CHANNELS || !channels[channel].live) {
+        return NULL;
+    }
+    return &channels[channel];
+}
+
+// The running task's own channel
+static ipc_channel_t* ipc_owned(int channel)
+{
+    ipc_channel_t* chan = ipc_get(channel);
+    if (!chan || chan->owner != scheduler_get_current_task_id()) {
+        return NULL;
+    }
+    return chan;
+}
+
+static uint64_t ipc_deadline(uint64_t timeout_ms)
+{
+    if (timeout_ms >= WAIT_FOREVER / 1000) {
+        return WAIT_FOREVER;
+    }
+    return time_monotonic_us() + timeout_ms * 1000;
+}
+
+static inline bool ipc_ring_empty(const ipc_ring_t* ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+// Fresh frames, each with its own reference like any mapped page
+static uintptr_t ipc_alloc_frames(size_t pages)
+{
+    uintptr_t phys = pmm_alloc_pages(pages);
+    if (!phys) return 0;
+    for (size_t i = 1; i < pages; i++) {
+        pmm_page(phys + i * PAGE_SIZE)->refcount = 1;
+    }
+    return phys;
+}
+
+// ============================================================================
+// PAGE GRANTS
+// ============================================================================
+
+// The payload's own pages when they are whole user pages, else a copy
+static ipc_grant_t* grant_create(const void* buffer, size_t len)
+{
+    size_t pages = ALIGN_UP(len, PAGE_SIZE) / PAGE_SIZE;
+    ipc_grant_t* grant = kmalloc_tracked(sizeof(ipc_grant_t) + pages * sizeof(uintptr_t), "ipc_grant");
+    if (!grant) return NULL;
+    grant->next = NULL;
+    grant->id = 0;
+    grant->len = len;
+    grant->pages = pages;
+
+    if (vmm_pin_frames((uintptr_t)buffer, pages, grant->frames) == 0) {
+        __atomic_fetch_add(&ipc_pages_remapped, pages, __ATOMIC_RELAXED);
+        return grant;
+    }
+
+    // Kernel memory, a huge page or an unaligned buffer: copy it once
+    uintptr_t phys = ipc_alloc_frames(pages);
+    if (!phys) {
+        kfree_tracked(grant);
+        return NULL;
+    }
+    memcpy((void*)phys, buffer, len);
+    memset((uint8_t*)phys + len, 0, pages * PAGE_SIZE - len);
+    for (size_t i = 0; i < pages; i++) {
+        grant->frames[i] = phys + i * PAGE_SIZE;
+    }
+    __atomic_fetch_add(&ipc_bytes_copied, len, __ATOMIC_RELAXED);
+    return grant;
+}
+
+static void grant_free(ipc_grant_t* grant)
+{
+    for (size_t i = 0; i < grant->pages; i++) {
+        pmm_page_unref(grant->frames[i], 1);
+    }
+    kfree_tracked(grant);
+}
+
+// Map a grant into the running task, consuming it. Kernel threads take
+// frames in place when they are contiguous and gather them otherwise.
+static void* grant_map(ipc_grant_t* grant)
+{
+    vm_context_t* ctx = scheduler_get_current_vm();
+    if (ctx) {
+        void* addr = vmm_map_frame_list(ctx, NULL, grant->frames, grant->pages,
+                                        PROT_READ | PROT_WRITE);
+        grant_free(grant);  // The mapping holds its own references
+        return addr;
+    }
+
+    bool contiguous = true;
+    for (size_t i = 1; i < grant->pages; i++) {
+        if (grant->frames[i] != grant->frames[0] + i * PAGE_SIZE) {
+            contiguous = false;
+            break;
+        }
+    }
+    if (contiguous) {
+        void* addr = (void*)grant->frames[0];
+        kfree_tracked(grant);  // References pass to the receiver
+        return addr;
+    }
+
+    uintptr_t phys = ipc_alloc_frames(grant->pages);
+    if (phys) {
+        for (size_t i = 0; i < grant->pages; i++) {
+            memcpy((void*)(phys + i * PAGE_SIZE), (void*)grant->frames[i], PAGE_SIZE);
+        }
+        __atomic_fetch_add(&ipc_bytes_copied, grant->len, __ATOMIC_RELAXED);
+    }
+    grant_free(grant);
+    return (void*)phys;
+}
+
+// Unlink a queued message's grant (chan->lock held)
+static ipc_grant_t* grant_take(ipc_channel_t* chan, uint32_t id)
+{
+    for (ipc_grant_t** link = &chan->grants; *link; link = &(*link)->next) {
+        if ((*link)->id == id) {
+            ipc_grant_t* grant = *link;
+            *link = grant->next;
+            return grant;
+        }
+    }
+    return NULL;
+}
+
+// ============================================================================
+// RING
+// ============================================================================
+
+// Queue msg from the running task (call_id 0: no reply wanted). 0, or -1
+// with nothing queued.
+static int ipc_enqueue(ipc_channel_t* chan, const ipc_msg_t* msg, uint32_t call_id)
+{
+    if (msg->len > IPC_MSG_INLINE || msg->buffer_len > IPC_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    ipc_grant_t* grant = NULL;
+    if (msg->buffer && msg->buffer_len) {
+        grant = grant_create(msg->buffer, msg->buffer_len);
+        if (!grant) return -1;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&chan->lock);
+    ipc_ring_t* ring = chan->ring;
+    uint32_t head = ring->head;
+    if (!chan->live || head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= IPC_RING_SIZE) {
+        spin_unlock_irqrestore(&chan->lock, flags);
+        if (grant) grant_free(grant);
+        return -1;
+    }
+
+    ipc_msg_t* slot = &ring->msgs[head & IPC_RING_MASK];
+    slot->type = msg->type;
+    slot->len = msg->len;
+    slot->sender = scheduler_get_current_task_id();
+    slot->call_id = call_id;
+    slot->grant = 0;
+    slot->reserved = 0;
+    slot->buffer = NULL;
+    slot->buffer_len = 0;
+    if (grant) {
+        if (++chan->next_grant == 0) chan->next_grant = 1;
+        grant->id = chan->next_grant;
+        grant->next = chan->grants;
+        chan->grants = grant;
+        slot->grant = grant->id;
+        slot->buffer_len = grant->len;
+    }
+    memcpy(slot->data, msg->data, msg->len);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&chan->lock, flags);
+
+    __atomic_fetch_add(&ipc_messages, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// After queueing: true if the receiver rang for a wakeup. The exchange
+// orders the head store before the doorbell load.
+static inline bool ipc_doorbell(ipc_channel_t* chan)
+{
+    if (!__atomic_exchange_n(&chan->ring->doorbell, 0, __ATOMIC_SEQ_CST)) {
+        return false;
+    }
+    __atomic_fetch_add(&ipc_doorbells, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Next message off the ring, payload mapped; the receiver owns tail
+static int ipc_pop(ipc_channel_t* chan, ipc_msg_t* msg)
+{
+    ipc_ring_t* ring = chan->ring;
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) return 0;
+    if (head - tail > IPC_RING_SIZE) {
+        // Tail scribbled on through a mapping: what was queued is lost
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    *msg = ring->msgs[tail & IPC_RING_MASK];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (msg->grant) {
+        msg->buffer = ipc_accept((int)(chan - channels), msg->grant);
+        if (!msg->buffer) msg->buffer_len = 0;
+        msg->grant = 0;
+    }
+    return 1;
+}
+
+// Receive with the wait already prepared on chan->receivers
+static int ipc_recv_prepared(ipc_channel_t* chan, ipc_msg_t* msg, uint64_t timeout_ms,
+                             wait_entry_t* wait)
+{
+    uint64_t deadline = ipc_deadline(timeout_ms);
+    for (;;) {
+        __atomic_store_n(&chan->ring->doorbell, 1, __ATOMIC_SEQ_CST);
+        if (!ipc_ring_empty(chan->ring) || !chan->live || timeout_ms == 0) break;
+        if (wait_schedule(wait, deadline) < 0) break;  // Timed out
+        wait_prepare(&chan->receivers, wait);
+    }
+    wait_finish(wait);
+    __atomic_store_n(&chan->ring->doorbell, 0, __ATOMIC_RELAXED);
+
+    return chan->live ? ipc_pop(chan, msg) : -1;
+}
+
+// Give a reply to its caller; *caller is the queue to wake afterwards
+static int ipc_deliver(ipc_channel_t* chan, const ipc_msg_t* reply, wait_queue_t** caller)
+{
+    uint32_t index = (reply->call_id & 0xFF) - 1;
+    if (!reply->call_id || index >= IPC_MAX_CALLS || reply->len > IPC_MSG_INLINE ||
+        reply->buffer_len > IPC_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    ipc_grant_t* grant = NULL;
+    if (reply->buffer && reply->buffer_len) {
+        grant = grant_create(reply->buffer, reply->buffer_len);
+        if (!grant) return -1;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&chan->lock);
+    ipc_call_t* call = &chan->calls[index];
+    if (call->id != reply->call_id || call->done) {
+        spin_unlock_irqrestore(&chan->lock, flags);
+        if (grant) grant_free(grant);
+        return -1;  // The caller gave up
+    }
+    call->reply.type = reply->type;
+    call->reply.len = reply->len;
+    call->reply.sender = scheduler_get_current_task_id();
+    call->reply.call_id = reply->call_id;
+    memcpy(call->reply.data, reply->data, reply->len);
+    call->grant = grant;
+    __atomic_store_n(&call->done, true, __ATOMIC_RELEASE);
+    *caller = &call->waiters;
+    spin_unlock_irqrestore(&chan->lock, flags);
+    return 0;
+}
+
+// ============================================================================
+// PUBLIC API
+// ============================================================================
+
+int ipc_channel_create(const char* name)
+{
+    if (!name || !name[0] || strlen(name) >= IPC_NAME_MAX) {
+        return -1;
+    }
+
+    void* ring;
+    int shmid = shm_create_kernel(sizeof(ipc_ring_t), &ring);
+    if (shmid < 0) {
+        KERROR("IPC: No memory for a channel ring");
+        return -1;
+    }
+
+    uint64_t flags = percpu_write_lock(&channels_lock);
+    int id = -1;
+    for (int i = 0; i < IPC_MAX_CHANNELS; i++) {
+        if (channels[i].live && strcmp(channels[i].name, name) == 0) {
+            id = -1;
+            break;
+        }
+        if (!channels[i].live && id < 0) {
+            id = i;
+        }
+    }
+    if (id < 0) {
+        percpu_write_unlock(&channels_lock, flags);
+        shm_remove(shmid);
+        KERROR("IPC: Cannot create channel '%s'", name);
+        return -1;
+    }
+
+    // Call slots keep their wait queues: a caller of the previous channel
+    // here may still be on its way out
+    ipc_channel_t* chan = &channels[id];
+    strncpy(chan->name, name, IPC_NAME_MAX - 1);
+    chan->name[IPC_NAME_MAX - 1] = '\0';
+    chan->owner = scheduler_get_current_task_id();
+    chan->shmid = shmid;
+    chan->ring = (ipc_ring_t*)ring;
+    chan->grants = NULL;
+    __atomic_store_n(&chan->live, true, __ATOMIC_RELEASE);
+    percpu_write_unlock(&channels_lock, flags);
+
+    KDEBUG("IPC: Channel %d '%s' created by process %d", id, name, chan->owner);
+    return id;
+}
+
+int ipc_channel_open(const char* name)
+{
+    if (!name) return -1;
+
+    uint64_t flags = percpu_read_lock(&channels_lock);
+    int id = -1;
+    for (int i = 0; i < IPC_MAX_CHANNELS; i++) {
+        if (channels[i].live && strcmp(channels[i].name, name) == 0) {
+            id = i;
+            break;
+        }
+    }
+    percpu_read_unlock(&channels_lock, flags);
+    return id;
+}
+
+int ipc_channel_destroy(int channel)
+{
+    ipc_channel_t* chan = ipc_owned(channel);
+    if (!chan) return -1;
+
+    uint64_t flags = percpu_write_lock(&channels_lock);
+    spin_lock(&chan->lock);
+    chan->live = false;
+    for (int i = 0; i < IPC_MAX_CALLS; i++) {
+        ipc_call_t* call = &chan->calls[i];
+        if (call->id && !call->done) {
+            call->failed = true;
+            call->done = true;
+        }
+    }
+    ipc_grant_t* grants = chan->grants;
+    chan->grants = NULL;
+    spin_unlock(&chan->lock);
+    percpu_write_unlock(&channels_lock, flags);
+
+    for (int i = 0; i < IPC_MAX_CALLS; i++) {
+        wake_up(&chan->calls[i].waiters);
+    }
+    wake_up(&chan->receivers);
+    while (grants) {
+        ipc_grant_t* next = grants->next;
+        grant_free(grants);
+        grants = next;
+    }
+    shm_remove(chan->shmid);  // A mapping keeps the ring until it detaches
+
+    KDEBUG("IPC: Channel %d '%s' destroyed", channel, chan->name);
+    return 0;
+}
+
+// Queue a message without waiting for anything
+int ipc_send(int channel, const ipc_msg_t* msg)
+{
+    ipc_channel_t* chan = ipc_get(channel);
+    if (!chan || !msg || ipc_enqueue(chan, msg, 0) < 0) {
+        return -1;
+    }
+    if (ipc_doorbell(chan)) {
+        wake_up_one(&chan->receivers);
+    }
+    return 0;
+}
+
+// Send and block for the reply. 0 with *reply filled, -1 on failure or
+// timeout (timeout_ms as for ipc_recv).
+int ipc_call(int channel, const ipc_msg_t* msg, ipc_msg_t* reply, uint64_t timeout_ms)
+{
+    ipc_channel_t* chan = ipc_get(channel);
+    if (!chan || !msg || !reply) return -1;
+
+    uint64_t flags = spin_lock_irqsave(&chan->lock);
+    ipc_call_t* call = NULL;
+    for (int i = 0; i < IPC_MAX_CALLS; i++) {
+        if (chan->calls[i].id == 0) {
+            call = &chan->calls[i];
+            call->id = ((++chan->call_gen & 0xFFFFFF) << 8) | (uint32_t)(i + 1);
+            call->done = false;
+            call->failed = false;
+            call->grant = NULL;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&chan->lock, flags);
+    if (!call) {
+        KDEBUG("IPC: Too many calls pending on channel %d", channel);
+        return -1;
+    }
+
+    // Block before the request is visible, so the receiver's reply can
+    // hand the CPU straight back
+    wait_entry_t wait;
+    wait_prepare(&call->waiters, &wait);
+    bool sent = ipc_enqueue(chan, msg, call->id) == 0;
+    if (sent) {
+        __atomic_fetch_add(&ipc_calls, 1, __ATOMIC_RELAXED);
+        if (ipc_doorbell(chan)) {
+            // A handoff runs the receiver before our deadline is armed
+            if (timeout_ms == WAIT_FOREVER && wake_up_sync(&chan->receivers)) {
+                __atomic_fetch_add(&ipc_handoffs, 1, __ATOMIC_RELAXED);
+            } else {
+                wake_up_one(&chan->receivers);
+            }
+        }
+
+        uint64_t deadline = ipc_deadline(timeout_ms);
+        while (!__atomic_load_n(&call->done, __ATOMIC_ACQUIRE)) {
+            if (wait_schedule(&wait, deadline) < 0) break;  // Timed out
+            if (__atomic_load_n(&call->done, __ATOMIC_ACQUIRE)) break;
+            wait_prepare(&call->waiters, &wait);
+        }
+    }
+    wait_finish(&wait);
+
+    flags = spin_lock_irqsave(&chan->lock);
+    bool ok = call->done && !call->failed;
+    ipc_grant_t* grant = NULL;
+    if (ok) {
+        *reply = call->reply;
+        grant = call->grant;
+    }
+    call->grant = NULL;
+    call->id = 0;
+    spin_unlock_irqrestore(&chan->lock, flags);
+
+    if (!ok) return -1;
+    reply->grant = 0;
+    reply->buffer = NULL;
+    reply->buffer_len = 0;
+    if (grant) {
+        size_t len = grant->len;
+        reply->buffer = grant_map(grant);
+        reply->buffer_len = reply->buffer ? len : 0;
+    }
+    return 0;
+}
+
+// Next message on our channel. timeout_ms: 0 polls, WAIT_FOREVER blocks.
+int ipc_recv(int channel, ipc_msg_t* msg, uint64_t timeout_ms)
+{
+    ipc_channel_t* chan = ipc_owned(channel);
+    if (!chan || !msg) return -1;
+
+    int got = ipc_pop(chan, msg);
+    if (got || timeout_ms == 0) return got;
+
+    wait_entry_t wait;
+    wait_prepare(&chan->receivers, &wait);
+    return ipc_recv_prepared(chan, msg, timeout_ms, &wait);
+}
+
+int ipc_reply(int channel, const ipc_msg_t* reply)
+{
+    ipc_channel_t* chan = ipc_owned(channel);
+    wait_queue_t* caller;
+    if (!chan || !reply || ipc_deliver(chan, reply, &caller) < 0) {
+        return -1;
+    }
+    wake_up(caller);
+    return 0;
+}
+
+// Reply, then wait for the next message. With nothing else queued and no
+// deadline the caller gets this CPU directly.
+int ipc_reply_recv(int channel, const ipc_msg_t* reply, ipc_msg_t* next, uint64_t timeout_ms)
+{
+    ipc_channel_t* chan = ipc_owned(channel);
+    if (!chan || !reply || !next) return -1;
+
+    // Asleep with the doorbell rung before the caller can run and call again
+    wait_entry_t wait;
+    wait_prepare(&chan->receivers, &wait);
+    __atomic_store_n(&chan->ring->doorbell, 1, __ATOMIC_SEQ_CST);
+
+    wait_queue_t* caller;
+    if (ipc_deliver(chan, reply, &caller) == 0) {
+        if (ipc_ring_empty(chan->ring) && timeout_ms == WAIT_FOREVER && wake_up_sync(caller)) {
+            __atomic_fetch_add(&ipc_handoffs, 1, __ATOMIC_RELAXED);
+        } else {
+            wake_up(caller);
+        }
+    }
+    return ipc_recv_prepared(chan, next, timeout_ms, &wait);
+}
+
+// Map the payload of a message read from a mapped ring
+void* ipc_accept(int channel, uint32_t grant_id)
+{
+    ipc_channel_t* chan = ipc_owned(channel);
+    if (!chan || !grant_id) return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&chan->lock);
+    ipc_grant_t* grant = grant_take(chan, grant_id);
+    spin_unlock_irqrestore(&chan->lock, flags);
+    return grant ? grant_map(grant) : NULL;
+}
+
+// Drop a received payload: unmap it, or release a kernel thread's frames
+void ipc_release_buffer(void* buffer, size_t len)
+{
+    if (!buffer || !len) return;
+    size_t pages = ALIGN_UP(len, PAGE_SIZE) / PAGE_SIZE;
+
+    vm_context_t* ctx = scheduler_get_current_vm();
+    if (ctx) {
+        vmm_munmap(ctx, buffer, pages * PAGE_SIZE);
+        return;
+    }
+    for (size_t i = 0; i < pages; i++) {
+        pmm_page_unref((uintptr_t)buffer + i * PAGE_SIZE, 1);
+    }
+}
+
+void ipc_get_stats(void)
+{
+    KINFO("=== IPC Statistics ===");
+    KINFO("Messages: %lu (%lu calls, %lu direct handoffs)", ipc_messages, ipc_calls, ipc_handoffs);
+    KINFO("Doorbell wakeups: %lu", ipc_doorbells);
+    KINFO("Payload pages remapped: %lu, bytes copied: %lu", ipc_pages_remapped, ipc_bytes_copied);
+}
+
+// ============================================================================
+// SYSCALL INTERFACE
+// ============================================================================
+
+int64_t sys_ipc_create(const char* name)
+{
+    return ipc_channel_create(name);
+}
+
+int64_t sys_ipc_open(const char* name)
+{
+    return ipc_channel_open(name);
+}
+
+int64_t sys_ipc_destroy(int channel)
+{
+    return ipc_channel_destroy(channel);
+}
+
+int64_t sys_ipc_send(int channel, const ipc_msg_t* msg)
+{
+    return ipc_send(channel, msg);
+}
+
+int64_t sys_ipc_call(int channel, const ipc_msg_t* msg, ipc_msg_t* reply, uint64_t timeout_ms)
+{
+    return ipc_call(channel, msg, reply, timeout_ms);
+}
+
+int64_t sys_ipc_recv(int channel, ipc_msg_t* msg, uint64_t timeout_ms)
+{
+    return ipc_recv(channel, msg, timeout_ms);
+}
+
+int64_t sys_ipc_reply(int channel, const ipc_msg_t* reply)
+{
+    return ipc_reply(channel, reply);
+}
+
+int64_t sys_ipc_reply_recv(int channel, const ipc_msg_t* reply, ipc_msg_t* next, uint64_t timeout_ms)
+{
+    return ipc_reply_recv(channel, reply, next, timeout_ms);
+}
+
+// Map our channel's ring, to drain it without system calls
+ipc_ring_t* sys_ipc_map(int channel)
+{
+    ipc_channel_t* chan = ipc_owned(channel);
+    if (!chan) return NULL;
+
+    void* addr = shm_attached_at(chan->shmid);
+    if (!addr) {
+        addr = sys_shmat(chan->shmid, NULL, 0);
+        if ((intptr_t)addr < 0) return NULL;
+    }
+    return (ipc_ring_t*)addr;
+}
+
+void* sys_ipc_accept(int channel, uint32_t grant)
+{
+    return ipc_accept(channel, grant);
+}
@@ -2,6 +2,8 @@
 #include "net.h"
 #include "drivers/keyboard/keyboard.h"
 #include "drivers/mouse.h"
+#include "page_cache.h"
+#include "sync.h"
 
 extern void desktop_init(void);
 
@@ -26,9 +28,13 @@ void vga_putc_at(int pos, char c);
 int framebuffer_init(void);
 void display_server_init(void);
 
+// Network drivers
+void virtio_net_init(void);
+
 // Storage subsystem
 void ahci_init(void);
 void fat32_mount_root(void);
+int qfs_init(void);
 void cmd_ls(const char* args);
 void cmd_cat(const char* args);
 // void cmd_write(const char* args); // TODO: Implement write in fat32.c
@@ -39,6 +45,9 @@ void gdt_init(void);
 void idt_init(void);
 void paging_init(void);
 void scheduler_init(void);
+void smp_init(void);
+void cpu_init(void);
+void vdso_init(void);
 void interrupt_init(void);
 
 // Main command processing function
@@ -93,6 +102,34 @@ void vga_putc_at(int pos, char c) {
 extern uint32_t multiboot_magic;
 extern uint32_t multiboot_info;
 
+// Multiboot 1 info: flags, then the command line at offset 16 if bit 2 is set
+#define MULTIBOOT_INFO_CMDLINE  (1U << 2)
+
+const char* kernel_cmdline(void)
+{
+    if (multiboot_magic != 0x2BADB002 || !multiboot_info) return "";
+
+    const uint32_t* info = (const uint32_t*)(uintptr_t)multiboot_info;
+    if (!(info[0] & MULTIBOOT_INFO_CMDLINE) || !info[4]) return "";
+    return (const char*)(uintptr_t)info[4];
+}
+
+// GRUB passes the kernel path first; options are the space-separated words
+bool kernel_cmdline_has(const char* option)
+{
+    size_t len = strlen(option);
+    const char* p = kernel_cmdline();
+    while (*p) {
+        while (*p == ' ') p++;
+        const char* word = p;
+        while (*p && *p != ' ') p++;
+        if ((size_t)(p - word) == len && strncmp(word, option, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 // Simple in-memory filesystem implementation
 #define MAX_FILES 64
 #define MAX_DIRS 32
@@ -222,10 +259,13 @@ void kernel_init(void)
 {
     KINFO("Base Kernel Main Initialization");
 
-    /* Memory management - identity mapping required from bootloader */
+    /* Direct map of physical memory (static tables, before the PMM touches RAM) */
+    paging_init();
+
+    /* Memory management - needs the direct map for its free-list headers */
     pmm_init();
 
-    /* Kernel heap allocation (depends on PMM) */
+    /* Kernel heap allocation (depends on PMM and paging) */
     kheap_init();
 
     /* CPU state setup - GDT initialization after memory allocators */
@@ -234,19 +274,37 @@ void kernel_init(void)
     /* Interrupt handling - IDT must precede interrupt enabling */
     idt_init();          /* Interrupt Descriptor Table */
 
+    /* FPU/SSE control bits and PCID (before any task can switch) */
+    cpu_init();
+
     /* Programmable interrupt controller configuration */
     pic_init();
 
-    /* Virtual memory paging (extends bootloader identity mapping) */
-    paging_init();
-
     /* Device driver initialization */
     timer_init();
     keyboard_init();
 
+    /* User clock page (needs the calibrated TSC and paging) */
+    vdso_init();
+
     /* Task scheduling framework */
     scheduler_init();
 
+    /* Idle-time page zeroing (needs the scheduler) */
+    pmm_zero_pool_init();
+
+    /* Disk page cache and its writeback task (needs the scheduler) */
+    page_cache_init();
+
+    /* Secondary CPUs and per-core LAPIC ticks (needs the scheduler and PIT) */
+    smp_init();
+
+    /* Per-CPU trace rings (one for each CPU smp_init brought up) */
+    trace_init();
+
+    /* RCU grace periods and deferred frees (needs every CPU online) */
+    rcu_init();
+
     /* Virtual filesystem setup */
     vfs_init();
 
@@ -260,6 +318,7 @@ void kernel_init(void)
 
     /* Network Subsystem */
     net_init();
+    virtio_net_init();
 
     /* Input Drivers */
     mouse_init();
@@ -270,12 +329,26 @@ void kernel_init(void)
     /* Storage Subsystem */
     ahci_init();
     fat32_mount_root();
+    qfs_init();
 
     KINFO("Kernel initialization complete, enabling interrupts");
 
+    /* Serial logging through the transmit interrupt from now on */
+    serial_start_async();
+
     /* Enable interrupts with all handlers in place */
     __asm__ volatile("sti");
 
+    /* Benchmark boot entry (scripts/grub.cfg, make bench) */
+    if (kernel_cmdline_has("bench")) {
+        bench_start();
+    }
+
+    /* Self-test boot entry (scripts/grub.cfg) */
+    if (kernel_cmdline_has("selftest")) {
+        selftest_start();
+    }
+
     /* Enter main kernel loop */
     kernel_main();
 }
@@ -600,6 +673,21 @@ void process_command(char* cmd)
         sprintf(buf, "%lu%%", cache_hit_rate);
         vga_puts(buf);
         vga_puts("\n");
+
+        size_t zero_pooled, zero_hits, zero_misses;
+        pmm_get_zero_pool_stats(&zero_pooled, &zero_hits, &zero_misses);
+        vga_puts("Zeroed pool: ");
+        sprintf(buf, "%lu pages (%lu hits, %lu misses)", zero_pooled, zero_hits, zero_misses);
+        vga_puts(buf);
+        vga_puts("\n");
+
+        size_t node_free, node_local, node_fallback;
+        for (int node = 0; pmm_get_node_stats(node, &node_free, &node_local, &node_fallback); node++) {
+            char line[96];
+            sprintf(line, "Node %d: %lu MB free (%lu local, %lu fallback allocs)\n", node,
+                    (node_free * PAGE_SIZE) / (1024*1024), node_local, node_fallback);
+            vga_puts(line);
+        }
     } else if (strcmp(cmd_name, "netstat") == 0) {
         vga_puts("==== Network Stack Status ====\n");
 
@@ -687,9 +775,7 @@ void process_command(char* cmd)
                 packet_t* pkt = net_alloc_packet(64);
                 if (pkt) {
                     // Construct ICMP Echo Request
-                    pkt->data += sizeof(eth_header_t) + sizeof(ipv4_header_t);
-                    
-                    icmp_header_t* icmp = (icmp_header_t*)pkt->data;
+                    icmp_header_t* icmp = packet_put(pkt, sizeof(icmp_header_t) + 12);
                     icmp->type = 8; // Echo Request
                     icmp->code = 0;
                     icmp->id = htons(1);
@@ -698,7 +784,6 @@ void process_command(char* cmd)
                     
                     // Payload
                     strcpy((char*)(pkt->data + sizeof(icmp_header_t)), "PingPayload");
-                    pkt->len = sizeof(icmp_header_t) + 12;
                     
                     icmp->checksum = checksum(icmp, pkt->len);
                     
@@ -3,22 +3,31 @@
  * 
  * Features:
  * - Size classes for common allocation sizes
- * - Free list per size class for O(1) allocation
- * - Per-CPU caches for lock-free fast path
+ * - Slab pages with in-band headers for O(1) kfree/krealloc
+ * - Growable heap: a large virtual window mapped page by page from the PMM
+ * - Empty slabs recycled through a shared slab pool, unmapped under pressure
+ * - Per-CPU magazines with a per-class depot (Bonwick) for the fast path
+ * - NUMA: slabs and depots kept per node, allocations served from the
+ *   executing CPU's node first and then from the nearest other nodes
+ * - Optional zeroing via GFP flags
  * - Large allocation support via buddy allocator
- * - Memory tracking and leak detection
- * - Fragmentation reduction through best-fit
+ * - Lock-free hashed allocation tracking with per-tag counters
  */
 
 #include "kernel.h"
+#include "numa.h"
+#include "sync.h"
+#include "smp.h"
 
 // ============================================================================
 // CONFIGURATION
 // ============================================================================
 
-#define HEAP_START       0x300000   // Start at 3MB mark (safe after kernel)
-#define HEAP_SIZE        0x400000   // 4MB heap (expandable)
+// Virtual window reserved for slabs; backing pages are mapped on demand
+#define HEAP_START       0xFFFFFF0000000000ULL  // PML4 slot 510, below the kernel half
+#define HEAP_SIZE        0x1000000000ULL        // 64GB of address space
 #define HEAP_END         (HEAP_START + HEAP_SIZE)
+#define HEAP_PAGE_FLAGS  (PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL)
 
 // Size classes (powers of 2 for efficient allocation)
 #define NUM_SIZE_CLASSES 9
@@ -26,11 +35,29 @@ static const size_t size_classes[NUM_SIZE_CLASSES] = {
     16, 32, 64, 128, 256, 512, 1024, 2048, 4096
 };
 
+// Slab geometry: every slab is SLAB_SIZE bytes, aligned to SLAB_SIZE,
+// so the owning slab of any object is found by masking its address
+#define SLAB_SIZE        0x8000     // 32KB
+#define SLAB_MAGIC       0x534C4142 // "SLAB"
+#define SLAB_EMPTY_KEEP  1          // Empty slabs a class keeps before releasing
+#define SLAB_POOL_MAX    16         // Backed slabs kept pooled before unmapping
+#define UNBACKED_MAX     256        // Unmapped slab addresses remembered for reuse
+#define SLAB_PAGES       (SLAB_SIZE / PAGE_SIZE)
+
 // Per-CPU cache configuration
-#define PERCPU_CACHE_SIZE 16  // Objects per CPU cache
+#define PERCPU_CACHE_SIZE 16  // Rounds per magazine
+#define DEPOT_MAX_FULL    8   // Full magazines a depot holds before spilling to slabs
 
 // Large allocation threshold (use buddy allocator above this)
 #define LARGE_ALLOC_THRESHOLD 4096
+#define LARGE_HASH_BUCKETS    256
+
+// Allocation tracking: open-addressed table keyed by pointer, plus a
+// per-tag aggregate table keyed by tag string address. Both power of two.
+#define TRACK_TABLE_SIZE      8192
+#define TRACK_MAX_PROBE       64
+#define TAG_TABLE_SIZE        128
+#define TRACK_TOMBSTONE       ((void*)1)
 
 // ============================================================================
 // DATA STRUCTURES
@@ -42,40 +69,105 @@ typedef struct free_node {
     size_t size;  // For debugging and validation
 } free_node_t;
 
+// Slab header, stored at the start of each slab
+typedef struct slab {
+    uint32_t magic;              // SLAB_MAGIC while the slab is live
+    uint16_t class_idx;          // Owning size class
+    uint16_t node;               // NUMA node of the slab's pages
+    uint32_t obj_size;           // Object size for this slab
+    uint32_t total_objects;      // Objects carved from this slab
+    uint32_t free_objects;       // Objects currently free
+    uint32_t padding;
+    free_node_t* free_list;      // Free objects within this slab
+    struct slab* next;           // Partial/empty list linkage
+    struct slab* prev;
+} slab_t;
+
+#define SLAB_HEADER_SIZE ALIGN_UP(sizeof(slab_t), 16)
+
 // Size class cache structure
 typedef struct {
-    free_node_t* free_list;      // Main free list
+    slab_t* partial[NUMA_MAX_NODES];  // Per node: slabs with at least one free object
+    size_t slab_count;           // Slabs owned by this class
+    size_t empty_slabs;          // Fully free slabs on the partial list
     size_t total_objects;        // Total objects in this class
     size_t free_objects;         // Currently free objects
     size_t alloc_count;          // Allocation counter
     size_t free_count;           // Free counter
 } size_class_t;
 
-// Per-CPU cache (future enhancement)
-typedef struct {
+// Magazine: a fixed-size stack of free objects of one size class
+typedef struct magazine {
     void* objects[PERCPU_CACHE_SIZE];
     size_t count;
+    struct magazine* next;       // Depot list linkage
+} magazine_t;
+
+// Per-CPU cache for one size class: a loaded and a previous magazine.
+// Only the owning CPU touches it, with interrupts disabled.
+typedef struct {
+    magazine_t* loaded;
+    magazine_t* previous;
+    size_t hits;                 // Requests satisfied without the slab layer
 } percpu_cache_t;
 
-// Memory tracking for leak detection
-typedef struct alloc_record {
+// Per-class depot of full and empty magazines shared by a node's CPUs
+typedef struct {
+    magazine_t* full;
+    magazine_t* empty;
+    size_t full_count;
+    size_t empty_count;
+} magazine_depot_t;
+
+// Large (PMM-backed) allocation record, hashed by address
+typedef struct large_alloc {
+    uintptr_t addr;
+    size_t pages;
+    struct large_alloc* next;
+} large_alloc_t;
+
+// Tracked allocation slot; ptr is NULL (never used), TRACK_TOMBSTONE
+// (freed) or the live pointer, and is only ever changed with CAS
+typedef struct {
     void* ptr;
     size_t size;
+    uint32_t tag_idx;
+    uint32_t reserved;
+} track_slot_t;
+
+// Aggregated counters for one allocation tag
+typedef struct {
     const char* tag;
-    uint64_t timestamp;
-    struct alloc_record* next;
-} alloc_record_t;
+    size_t live_count;
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t total_allocs;
+} tag_stats_t;
 
 // ============================================================================
 // GLOBAL STATE
 // ============================================================================
 
 static size_class_t size_class_allocators[NUM_SIZE_CLASSES];
-static uintptr_t heap_next_free = HEAP_START;  // Bump pointer for initial slab allocation
+static percpu_cache_t percpu_caches[MAX_CPUS][NUM_SIZE_CLASSES];
+static magazine_depot_t magazine_depots[NUMA_MAX_NODES][NUM_SIZE_CLASSES];
+static int magazine_class;                     // Size class magazines live in
+static uintptr_t heap_next_free = HEAP_START;  // Bump pointer for fresh slabs
+static slab_t* slab_pool = NULL;               // Released slabs, reusable by any class
+static size_t slab_pool_count = 0;
+static uintptr_t unbacked_slabs[UNBACKED_MAX]; // Slab addresses with no backing pages
+static size_t unbacked_count = 0;
+static size_t heap_mapped_pages = 0;
 static bool heap_initialized = false;
+static mcs_lock_t heap_lock = MCS_LOCK_INIT;   // Slabs, pool, depots, large hash
+
+static large_alloc_t* large_allocs[LARGE_HASH_BUCKETS];
 
 // Memory tracking
-static alloc_record_t* alloc_records = NULL;
+static track_slot_t track_table[TRACK_TABLE_SIZE];
+static tag_stats_t tag_table[TAG_TABLE_SIZE];
+static size_t track_live = 0;
+static size_t track_dropped = 0;               // Table full, allocation not tracked
 static size_t total_allocated = 0;
 static size_t peak_usage = 0;
 static size_t allocation_count = 0;
@@ -96,130 +188,675 @@ static inline int get_size_class_index(size_t size)
     return -1;  // Too large for size classes
 }
 
-// Allocate a slab of memory for a size class
-static void* allocate_slab(size_t obj_size, size_t count)
+static inline slab_t* slab_of(void* ptr)
+{
+    return (slab_t*)ALIGN_DOWN((uintptr_t)ptr, SLAB_SIZE);
+}
+
+static inline bool heap_contains(void* ptr)
+{
+    uintptr_t addr = (uintptr_t)ptr;
+    return addr >= HEAP_START && addr < heap_next_free;
+}
+
+// Give back the pages behind a slab address; the address stays reserved
+static void unmap_slab(uintptr_t base, size_t pages)
+{
+    for (size_t i = 0; i < pages; i++) {
+        uintptr_t va = base + i * PAGE_SIZE;
+        uintptr_t pa = vmm_get_physical(va);
+        vmm_unmap_page(va);
+        if (pa) {
+            pmm_free_pages(pa, 1);
+        }
+    }
+    heap_mapped_pages -= pages;
+}
+
+// Back a slab address range with fresh physical pages, from node if it has
+// them. heap_lock is held, so the PMM must not call back into the heap.
+static bool map_slab(uintptr_t base, int node)
+{
+    for (size_t i = 0; i < SLAB_PAGES; i++) {
+        uintptr_t pa = pmm_alloc_pages_gfp(1, node, GFP_NORECLAIM);
+        if (!pa || vmm_map_page(base + i * PAGE_SIZE, pa, HEAP_PAGE_FLAGS) != 0) {
+            if (pa) pmm_free_pages(pa, 1);
+            heap_mapped_pages += i;
+            unmap_slab(base, i);
+            return false;
+        }
+    }
+    heap_mapped_pages += SLAB_PAGES;
+    return true;
+}
+
+// Take a pooled slab, one whose pages are on node unless any will do
+static slab_t* pool_take(int node, bool any)
 {
-    size_t slab_size = obj_size * count;
-    slab_size = ALIGN_UP(slab_size, 16);  // 16-byte alignment
+    for (slab_t** link = &slab_pool; *link; link = &(*link)->next) {
+        slab_t* slab = *link;
+        if (any || slab->node == node) {
+            *link = slab->next;
+            slab_pool_count--;
+            return slab;
+        }
+    }
+    return NULL;
+}
+
+// Get a slab-sized, slab-aligned chunk of heap memory, preferably on node.
+// Its node field tells where the pages actually came from.
+static slab_t* allocate_slab(int node)
+{
+    slab_t* slab = pool_take(node, false);
+    if (slab) {
+        return slab;
+    }
     
-    if (heap_next_free + slab_size > HEAP_END) {
-        KERROR("Heap exhausted - cannot allocate slab");
-        return NULL;
+    // Reuse address space released under pressure before growing
+    uintptr_t base;
+    bool fresh = unbacked_count == 0;
+    if (!fresh) {
+        base = unbacked_slabs[--unbacked_count];
+    } else {
+        if (heap_next_free + SLAB_SIZE > HEAP_END) {
+            KERROR("Heap exhausted - cannot allocate slab");
+            return NULL;
+        }
+        base = heap_next_free;
     }
     
-    void* slab = (void*)heap_next_free;
-    heap_next_free += slab_size;
+    if (!map_slab(base, node)) {
+        if (!fresh) unbacked_slabs[unbacked_count++] = base;
+        
+        // A pooled slab on another node still beats failing
+        slab = pool_take(node, true);
+        if (slab) {
+            return slab;
+        }
+        KERROR("Heap: out of physical memory for slab");
+        return NULL;
+    }
     
+    if (fresh) heap_next_free += SLAB_SIZE;
+    slab = (slab_t*)base;
+    slab->node = (uint16_t)numa_node_of_pfn(vmm_get_physical(base) / PAGE_SIZE, NULL);
     return slab;
 }
 
-// Initialize a size class with a slab of free objects
-static bool init_size_class(int class_idx)
+// Unmap a pooled slab and return its pages to the PMM
+static void reclaim_slab(slab_t* slab)
+{
+    if (unbacked_count >= UNBACKED_MAX) {
+        // Nowhere to remember the address; keep it pooled instead
+        slab->next = slab_pool;
+        slab_pool = slab;
+        slab_pool_count++;
+        return;
+    }
+    unbacked_slabs[unbacked_count++] = (uintptr_t)slab;
+    unmap_slab((uintptr_t)slab, SLAB_PAGES);
+}
+
+// Return a slab's memory to the shared pool, or to the PMM when the pool
+// is already large or physical memory is getting tight
+static void release_slab(slab_t* slab)
+{
+    slab->magic = 0;
+    
+    if (slab_pool_count >= SLAB_POOL_MAX ||
+        pmm_get_free_pages() < (pmm_get_total_pages() / 16)) {
+        reclaim_slab(slab);
+        return;
+    }
+    
+    slab->next = slab_pool;
+    slab_pool = slab;
+    slab_pool_count++;
+}
+
+static void slab_list_add(size_class_t* sc, slab_t* slab)
+{
+    slab_t** head = &sc->partial[slab->node];
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) (*head)->prev = slab;
+    *head = slab;
+}
+
+static void slab_list_remove(size_class_t* sc, slab_t* slab)
+{
+    if (slab->prev) slab->prev->next = slab->next;
+    else sc->partial[slab->node] = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+// Carve a new slab for a size class and put it on its node's partial list
+static slab_t* expand_size_class(int class_idx, int node)
 {
     size_t obj_size = size_classes[class_idx];
     size_class_t* sc = &size_class_allocators[class_idx];
     
-    // Initially allocate 32 objects per size class
-    const size_t initial_objects = 32;
-    void* slab = allocate_slab(obj_size, initial_objects);
+    slab_t* slab = allocate_slab(node);
     if (!slab) {
-        return false;
+        return NULL;
     }
     
-    // Build free list
-    sc->free_list = NULL;
-    sc->total_objects = initial_objects;
-    sc->free_objects = initial_objects;
-    sc->alloc_count = 0;
-    sc->free_count = 0;
+    slab->magic = SLAB_MAGIC;
+    slab->class_idx = class_idx;
+    slab->obj_size = obj_size;
+    slab->total_objects = (SLAB_SIZE - SLAB_HEADER_SIZE) / obj_size;
+    slab->free_objects = slab->total_objects;
+    slab->free_list = NULL;
     
-    // Link all objects in the slab into free list
-    for (size_t i = 0; i < initial_objects; i++) {
-        free_node_t* node = (free_node_t*)((uintptr_t)slab + i * obj_size);
-        node->next = sc->free_list;
+    // Link objects so the lowest address is handed out first
+    uintptr_t base = (uintptr_t)slab + SLAB_HEADER_SIZE;
+    for (size_t i = slab->total_objects; i > 0; i--) {
+        free_node_t* node = (free_node_t*)(base + (i - 1) * obj_size);
+        node->next = slab->free_list;
         node->size = obj_size;
-        sc->free_list = node;
+        slab->free_list = node;
     }
     
-    KDEBUG("Initialized size class %lu bytes with %lu objects", 
-           obj_size, initial_objects);
+    slab_list_add(sc, slab);
+    sc->slab_count++;
+    sc->empty_slabs++;
+    sc->total_objects += slab->total_objects;
+    sc->free_objects += slab->total_objects;
     
-    return true;
+    KDEBUG("Expanded size class %lu bytes: +%u objects on node %u (total: %lu)", 
+           obj_size, slab->total_objects, slab->node, sc->total_objects);
+    
+    return slab;
 }
 
-// Expand a size class when it runs out of free objects
-static bool expand_size_class(int class_idx)
+// Initialize a size class with its first slab
+static bool init_size_class(int class_idx)
 {
-    size_t obj_size = size_classes[class_idx];
     size_class_t* sc = &size_class_allocators[class_idx];
     
-    // Allocate more objects (double current capacity)
-    size_t new_objects = sc->total_objects;
-    if (new_objects < 16) new_objects = 16;
+    memset(sc->partial, 0, sizeof(sc->partial));
+    sc->slab_count = 0;
+    sc->empty_slabs = 0;
+    sc->total_objects = 0;
+    sc->free_objects = 0;
+    sc->alloc_count = 0;
+    sc->free_count = 0;
+    
+    return expand_size_class(class_idx, numa_current_node()) != NULL;
+}
+
+// Pop one object from a size class: a slab on this CPU's node, a new one
+// (which may itself have landed elsewhere), then the nearest other node's
+static void* slab_alloc(int class_idx)
+{
+    size_class_t* sc = &size_class_allocators[class_idx];
+    int local = numa_current_node();
     
-    void* slab = allocate_slab(obj_size, new_objects);
+    slab_t* slab = sc->partial[local];
     if (!slab) {
-        return false;
+        slab = expand_size_class(class_idx, local);
+    }
+    if (!slab) {
+        const uint8_t* order = numa_fallback_order(local);
+        for (int i = 1; i < numa_node_count() && !slab; i++) {
+            slab = sc->partial[order[i]];
+        }
+        if (!slab) {
+            return NULL;
+        }
     }
     
-    // Add new objects to free list
-    for (size_t i = 0; i < new_objects; i++) {
-        free_node_t* node = (free_node_t*)((uintptr_t)slab + i * obj_size);
-        node->next = sc->free_list;
-        node->size = obj_size;
-        sc->free_list = node;
+    free_node_t* node = slab->free_list;
+    
+    if (slab->free_objects == slab->total_objects) {
+        sc->empty_slabs--;
+    }
+    
+    slab->free_list = node->next;
+    slab->free_objects--;
+    if (slab->free_objects == 0) {
+        slab_list_remove(sc, slab);  // Full slabs are found again via kfree
+    }
+    
+    sc->free_objects--;
+    sc->alloc_count++;
+    
+    return node;
+}
+
+// Push an object back onto its slab; release surplus empty slabs
+static void slab_free(slab_t* slab, void* ptr)
+{
+    size_class_t* sc = &size_class_allocators[slab->class_idx];
+    
+    free_node_t* node = (free_node_t*)ptr;
+    node->next = slab->free_list;
+    node->size = slab->obj_size;
+    slab->free_list = node;
+    
+    if (slab->free_objects++ == 0) {
+        slab_list_add(sc, slab);
+    }
+    sc->free_objects++;
+    sc->free_count++;
+    
+    if (slab->free_objects == slab->total_objects) {
+        if (sc->empty_slabs >= SLAB_EMPTY_KEEP) {
+            slab_list_remove(sc, slab);
+            sc->slab_count--;
+            sc->total_objects -= slab->total_objects;
+            sc->free_objects -= slab->total_objects;
+            release_slab(slab);
+        } else {
+            sc->empty_slabs++;
+        }
     }
+}
+
+// ============================================================================
+// MAGAZINE LAYER
+// ============================================================================
+
+static magazine_t* magazine_new(void)
+{
+    magazine_t* mag = slab_alloc(magazine_class);
+    if (mag) {
+        mag->count = 0;
+        mag->next = NULL;
+    }
+    return mag;
+}
+
+// Hand every round in a magazine back to its slabs
+static void magazine_flush(magazine_t* mag)
+{
+    while (mag->count > 0) {
+        void* obj = mag->objects[--mag->count];
+        slab_free(slab_of(obj), obj);
+    }
+}
+
+// Fast-path allocation from the current CPU's magazines, then the depot
+static void* magazine_alloc(int class_idx)
+{
+    percpu_cache_t* pc = &percpu_caches[scheduler_get_current_cpu()][class_idx];
+    magazine_depot_t* depot = &magazine_depots[numa_current_node()][class_idx];
     
-    sc->total_objects += new_objects;
-    sc->free_objects += new_objects;
+    if (pc->loaded && pc->loaded->count > 0) {
+        pc->hits++;
+        return pc->loaded->objects[--pc->loaded->count];
+    }
     
-    KDEBUG("Expanded size class %lu bytes: +%lu objects (total: %lu)", 
-           obj_size, new_objects, sc->total_objects);
+    if (pc->previous && pc->previous->count > 0) {
+        magazine_t* tmp = pc->loaded;
+        pc->loaded = pc->previous;
+        pc->previous = tmp;
+        pc->hits++;
+        return pc->loaded->objects[--pc->loaded->count];
+    }
     
+    // Trade the empty loaded magazine for a full one from the depot
+    mcs_node_t qn;
+    mcs_lock(&heap_lock, &qn);
+    if (depot->full) {
+        magazine_t* full = depot->full;
+        depot->full = full->next;
+        depot->full_count--;
+        
+        if (pc->previous) {
+            pc->previous->next = depot->empty;
+            depot->empty = pc->previous;
+            depot->empty_count++;
+        }
+        pc->previous = pc->loaded;
+        pc->loaded = full;
+        pc->hits++;
+        mcs_unlock(&heap_lock, &qn);
+        return pc->loaded->objects[--pc->loaded->count];
+    }
+    mcs_unlock(&heap_lock, &qn);
+    
+    return NULL;
+}
+
+// Fast-path free into the current CPU's magazines; false means use the slab
+static bool magazine_free(int class_idx, void* ptr)
+{
+    percpu_cache_t* pc = &percpu_caches[scheduler_get_current_cpu()][class_idx];
+    magazine_depot_t* depot = &magazine_depots[numa_current_node()][class_idx];
+    
+    if (pc->loaded && pc->loaded->count < PERCPU_CACHE_SIZE) {
+        pc->loaded->objects[pc->loaded->count++] = ptr;
+        return true;
+    }
+    
+    if (pc->previous && pc->previous->count < PERCPU_CACHE_SIZE) {
+        magazine_t* tmp = pc->loaded;
+        pc->loaded = pc->previous;
+        pc->previous = tmp;
+        pc->loaded->objects[pc->loaded->count++] = ptr;
+        return true;
+    }
+    
+    // Both magazines are full (or missing): park one full in the depot
+    // and load an empty one
+    mcs_node_t qn;
+    mcs_lock(&heap_lock, &qn);
+    if (depot->full_count >= DEPOT_MAX_FULL) {
+        mcs_unlock(&heap_lock, &qn);
+        return false;
+    }
+    
+    magazine_t* empty = depot->empty;
+    if (empty) {
+        depot->empty = empty->next;
+        depot->empty_count--;
+    } else {
+        empty = magazine_new();
+        if (!empty) {
+            mcs_unlock(&heap_lock, &qn);
+            return false;
+        }
+    }
+    
+    if (pc->previous) {
+        pc->previous->next = depot->full;
+        depot->full = pc->previous;
+        depot->full_count++;
+    }
+    mcs_unlock(&heap_lock, &qn);
+    pc->previous = pc->loaded;
+    pc->loaded = empty;
+    pc->loaded->objects[pc->loaded->count++] = ptr;
     return true;
 }
 
+// Flush this CPU's magazines; caller holds heap_lock
+static void drain_local_magazines_locked(void)
+{
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        percpu_cache_t* pc = &percpu_caches[scheduler_get_current_cpu()][i];
+        if (pc->loaded) magazine_flush(pc->loaded);
+        if (pc->previous) magazine_flush(pc->previous);
+    }
+}
+
+// Drain IPI: another CPU wants the heap drained. Magazine operations run
+// with interrupts off, so this never lands in the middle of one.
+void kheap_drain_ipi(void)
+{
+    mcs_node_t qn;
+    mcs_lock(&heap_lock, &qn);
+    drain_local_magazines_locked();
+    mcs_unlock(&heap_lock, &qn);
+}
+
+// Flush depots and every CPU's magazines; caller holds heap_lock. Only the
+// owner touches its magazines, so the other CPUs get an IPI and flush
+// their own as soon as the lock is free again.
+static void drain_magazines_locked(void)
+{
+    int self = scheduler_get_current_cpu();
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        percpu_t* pc = smp_get_cpu(cpu);
+        if (cpu != self && pc && pc->online) {
+            lapic_send_ipi(pc->apic_id, APIC_DRAIN_VECTOR);
+        }
+    }
+    drain_local_magazines_locked();
+    
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        for (int node = 0; node < numa_node_count(); node++) {
+            magazine_depot_t* depot = &magazine_depots[node][i];
+            while (depot->full) {
+                magazine_t* mag = depot->full;
+                depot->full = mag->next;
+                depot->full_count--;
+                magazine_flush(mag);
+                mag->next = depot->empty;
+                depot->empty = mag;
+                depot->empty_count++;
+            }
+        }
+    }
+}
+
+// Return objects cached in depots and magazines to the slabs, so empty
+// slabs can be released (other CPUs' magazines follow shortly)
+void kheap_drain_magazines(void)
+{
+    mcs_node_t qn;
+    uint64_t flags = mcs_lock_irqsave(&heap_lock, &qn);
+    drain_magazines_locked();
+    mcs_unlock_irqrestore(&heap_lock, &qn, flags);
+}
+
+// Memory pressure hook: flush cached objects and give every pooled slab's
+// pages back to the PMM. Returns the number of pages released.
+size_t kheap_shrink(void)
+{
+    if (!heap_initialized) return 0;
+    
+    // Reached from the PMM's out-of-memory path, possibly while this CPU
+    // is already inside the heap: back off rather than deadlock
+    mcs_node_t qn;
+    uint64_t flags = irq_save();
+    if (!mcs_trylock(&heap_lock, &qn)) {
+        irq_restore(flags);
+        return 0;
+    }
+    
+    size_t before = heap_mapped_pages;
+    drain_magazines_locked();
+    
+    while (slab_pool && unbacked_count < UNBACKED_MAX) {
+        slab_t* slab = slab_pool;
+        slab_pool = slab->next;
+        slab_pool_count--;
+        reclaim_slab(slab);
+    }
+    size_t released = before - heap_mapped_pages;
+    mcs_unlock_irqrestore(&heap_lock, &qn, flags);
+    
+    if (released) {
+        KDEBUG("Heap shrink released %lu pages", released);
+    }
+    return released;
+}
+
+// Raise a running byte counter and its high-water mark without locks
+static inline void counter_add_peak(size_t* counter, size_t* peak, size_t bytes)
+{
+    size_t now = __atomic_add_fetch(counter, bytes, __ATOMIC_RELAXED);
+    size_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (now > old &&
+           !__atomic_compare_exchange_n(peak, &old, now, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static inline void account_bytes(size_t bytes)
+{
+    counter_add_peak(&total_allocated, &peak_usage, bytes);
+}
+
 // ============================================================================
-// MEMORY TRACKING
+// LARGE ALLOCATIONS
 // ============================================================================
 
-static void track_allocation(void* ptr, size_t size, const char* tag)
+static inline size_t large_hash(uintptr_t addr)
 {
-    if (!ptr) return;
+    return ((addr >> 12) * 0x9E3779B97F4A7C15ULL) >> 56;  // Top 8 bits
+}
+
+static void* large_alloc(size_t size)
+{
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uintptr_t addr = pmm_alloc_pages(pages);
+    if (!addr) return NULL;
     
-    alloc_record_t* record = (alloc_record_t*)heap_next_free;
-    if (heap_next_free + sizeof(alloc_record_t) > HEAP_END) {
-        // Out of space for tracking, skip
-        return;
+    mcs_node_t qn;
+    uint64_t flags = mcs_lock_irqsave(&heap_lock, &qn);
+    large_alloc_t* rec = slab_alloc(get_size_class_index(sizeof(large_alloc_t)));
+    if (!rec) {
+        mcs_unlock_irqrestore(&heap_lock, &qn, flags);
+        pmm_free_pages(addr, pages);
+        return NULL;
     }
-    heap_next_free += ALIGN_UP(sizeof(alloc_record_t), 16);
     
-    record->ptr = ptr;
-    record->size = size;
-    record->tag = tag ? tag : "untagged";
-    record->timestamp = 0;  // Would use timer if available
-    record->next = alloc_records;
-    alloc_records = record;
+    size_t bucket = large_hash(addr);
+    rec->addr = addr;
+    rec->pages = pages;
+    rec->next = large_allocs[bucket];
+    large_allocs[bucket] = rec;
+    mcs_unlock_irqrestore(&heap_lock, &qn, flags);
+    
+    account_bytes(pages * PAGE_SIZE);
     
-    total_allocated += size;
-    if (total_allocated > peak_usage) {
-        peak_usage = total_allocated;
+    return (void*)addr;
+}
+
+static large_alloc_t* large_lookup(void* ptr)
+{
+    for (large_alloc_t* rec = large_allocs[large_hash((uintptr_t)ptr)]; rec; rec = rec->next) {
+        if (rec->addr == (uintptr_t)ptr) return rec;
     }
+    return NULL;
 }
 
-static void untrack_allocation(void* ptr)
+static bool large_free(void* ptr)
+{
+    mcs_node_t qn;
+    uint64_t flags = mcs_lock_irqsave(&heap_lock, &qn);
+    large_alloc_t** link = &large_allocs[large_hash((uintptr_t)ptr)];
+    while (*link) {
+        large_alloc_t* rec = *link;
+        if (rec->addr == (uintptr_t)ptr) {
+            uintptr_t addr = rec->addr;
+            size_t pages = rec->pages;
+            *link = rec->next;
+            slab_free(slab_of(rec), rec);
+            mcs_unlock_irqrestore(&heap_lock, &qn, flags);
+            
+            pmm_free_pages(addr, pages);
+            __atomic_fetch_sub(&total_allocated, pages * PAGE_SIZE, __ATOMIC_RELAXED);
+            return true;
+        }
+        link = &rec->next;
+    }
+    mcs_unlock_irqrestore(&heap_lock, &qn, flags);
+    return false;
+}
+
+// Usable size of an allocation, or 0 if the pointer is not ours
+static size_t kmalloc_usable_size(void* ptr)
+{
+    if (heap_contains(ptr)) {
+        slab_t* slab = slab_of(ptr);
+        return slab->magic == SLAB_MAGIC ? slab->obj_size : 0;
+    }
+    
+    mcs_node_t qn;
+    uint64_t flags = mcs_lock_irqsave(&heap_lock, &qn);
+    large_alloc_t* rec = large_lookup(ptr);
+    size_t size = rec ? rec->pages * PAGE_SIZE : 0;
+    mcs_unlock_irqrestore(&heap_lock, &qn, flags);
+    return size;
+}
+
+// ============================================================================
+// MEMORY TRACKING
+// ============================================================================
+
+static inline size_t track_hash(const void* ptr, size_t table_size)
+{
+    return ((((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL) >> 32) & (table_size - 1);
+}
+
+// Find or claim the aggregate slot for a tag; tags are compared by address
+static uint32_t tag_lookup(const char* tag)
+{
+    size_t idx = track_hash(tag, TAG_TABLE_SIZE);
+    for (size_t probe = 0; probe < TAG_TABLE_SIZE; probe++) {
+        tag_stats_t* ts = &tag_table[idx];
+        const char* cur = __atomic_load_n(&ts->tag, __ATOMIC_ACQUIRE);
+        if (cur == tag) return idx;
+        if (!cur) {
+            const char* expected = NULL;
+            if (__atomic_compare_exchange_n(&ts->tag, &expected, tag, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+                expected == tag) {
+                return idx;
+            }
+        }
+        idx = (idx + 1) & (TAG_TABLE_SIZE - 1);
+    }
+    return 0;  // Table full: fold into whatever lives in slot 0
+}
+
+static void track_allocation(void* ptr, size_t size, const char* tag)
 {
     if (!ptr) return;
     
-    alloc_record_t** current = &alloc_records;
-    while (*current) {
-        if ((*current)->ptr == ptr) {
-            total_allocated -= (*current)->size;
-            *current = (*current)->next;  // Remove from list
+    uint32_t tag_idx = tag_lookup(tag ? tag : "untagged");
+    size_t idx = track_hash(ptr, TRACK_TABLE_SIZE);
+    
+    for (size_t probe = 0; probe < TRACK_MAX_PROBE; probe++) {
+        track_slot_t* slot = &track_table[idx];
+        void* cur = __atomic_load_n(&slot->ptr, __ATOMIC_RELAXED);
+        
+        if ((cur == NULL || cur == TRACK_TOMBSTONE) &&
+            __atomic_compare_exchange_n(&slot->ptr, &cur, ptr, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            // The pointer can't be untracked before kmalloc_tracked returns,
+            // so nobody reads these fields until we are done writing them
+            slot->size = size;
+            slot->tag_idx = tag_idx;
+            
+            tag_stats_t* ts = &tag_table[tag_idx];
+            __atomic_fetch_add(&ts->live_count, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&ts->total_allocs, 1, __ATOMIC_RELAXED);
+            counter_add_peak(&ts->live_bytes, &ts->peak_bytes, size);
+            __atomic_fetch_add(&track_live, 1, __ATOMIC_RELAXED);
+            account_bytes(size);
             return;
         }
-        current = &(*current)->next;
+        idx = (idx + 1) & (TRACK_TABLE_SIZE - 1);
+    }
+    
+    // Neighbourhood full: skip tracking rather than slow down the caller
+    __atomic_fetch_add(&track_dropped, 1, __ATOMIC_RELAXED);
+}
+
+// Returns the tracked size, or 0 if the pointer was not tracked
+static size_t untrack_allocation(void* ptr)
+{
+    if (!ptr) return 0;
+    
+    size_t idx = track_hash(ptr, TRACK_TABLE_SIZE);
+    for (size_t probe = 0; probe < TRACK_MAX_PROBE; probe++) {
+        track_slot_t* slot = &track_table[idx];
+        void* cur = __atomic_load_n(&slot->ptr, __ATOMIC_ACQUIRE);
+        
+        if (cur == NULL) break;  // End of probe chain
+        if (cur == ptr) {
+            size_t size = slot->size;
+            tag_stats_t* ts = &tag_table[slot->tag_idx];
+            if (!__atomic_compare_exchange_n(&slot->ptr, &cur, TRACK_TOMBSTONE, false,
+                                             __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                return 0;  // Lost a race with a concurrent double free
+            }
+            __atomic_fetch_sub(&ts->live_count, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&ts->live_bytes, size, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&track_live, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&total_allocated, size, __ATOMIC_RELAXED);
+            return size;
+        }
+        idx = (idx + 1) & (TRACK_TABLE_SIZE - 1);
     }
+    return 0;
 }
 
 // ============================================================================
@@ -230,9 +867,6 @@ void kheap_init(void)
 {
     KINFO("Initializing SLUB-inspired kernel heap...");
     
-    // Clear heap area
-    memset((void*)HEAP_START, 0, 4096);  // Clear first page
-    
     // Initialize all size classes
     for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
         if (!init_size_class(i)) {
@@ -241,17 +875,22 @@ void kheap_init(void)
         }
     }
     
+    // Magazines are carved straight from their own size class
+    magazine_class = get_size_class_index(sizeof(magazine_t));
+    
     heap_initialized = true;
     
     KINFO("Kernel heap initialized:");
-    KINFO("  ├─ Heap range: 0x%lx - 0x%lx (%lu MB)", 
-          HEAP_START, HEAP_END, HEAP_SIZE / (1024*1024));
+    KINFO("  ├─ Heap window: 0x%lx - 0x%lx (%lu GB, mapped on demand)", 
+          HEAP_START, HEAP_END, HEAP_SIZE / (1024*1024*1024));
+    KINFO("  ├─ Slab size: %lu KB", SLAB_SIZE / 1024);
+    KINFO("  ├─ Magazine rounds: %d per CPU per class", PERCPU_CACHE_SIZE);
     KINFO("  ├─ Size classes: %d", NUM_SIZE_CLASSES);
     KINFO("  ├─ Smallest: %lu bytes", size_classes[0]);
     KINFO("  └─ Largest: %lu bytes", size_classes[NUM_SIZE_CLASSES-1]);
 }
 
-void* kmalloc(size_t size)
+void* kmalloc_flags(size_t size, gfp_t flags)
 {
     if (size == 0) return NULL;
     if (!heap_initialized) {
@@ -265,54 +904,45 @@ void* kmalloc(size_t size)
     if (size < 16) size = 16;
     size = ALIGN_UP(size, 16);
     
-    // Find appropriate size class
+    // Large allocation - use PMM directly
     int class_idx = get_size_class_index(size);
-    
     if (class_idx < 0) {
-        // Large allocation - use PMM directly
-        if (size > LARGE_ALLOC_THRESHOLD) {
-            size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-            void* ptr = (void*)pmm_alloc_pages(pages);
-            if (ptr) {
-                total_allocated += pages * PAGE_SIZE;
-                if (total_allocated > peak_usage) peak_usage = total_allocated;
-            }
-            return ptr;
-        }
-        
-        // Fall back to largest size class
-        class_idx = NUM_SIZE_CLASSES - 1;
+        return large_alloc(size);
     }
     
-    size_class_t* sc = &size_class_allocators[class_idx];
-    
-    // Check if we need to expand
-    if (sc->free_objects == 0) {
-        if (!expand_size_class(class_idx)) {
-            KERROR("kmalloc failed: out of memory (size %lu)", size);
-            return NULL;
-        }
+    uint64_t irq = irq_save();
+    void* ptr = magazine_alloc(class_idx);
+    if (!ptr) {
+        mcs_node_t qn;
+        mcs_lock(&heap_lock, &qn);
+        ptr = slab_alloc(class_idx);
+        mcs_unlock(&heap_lock, &qn);
     }
+    irq_restore(irq);
     
-    // Fast path: pop from free list
-    free_node_t* node = sc->free_list;
-    if (!node) {
-        KERROR("kmalloc: free list empty after expansion!");
+    if (!ptr) {
+        KERROR("kmalloc failed: out of memory (size %lu)", size);
         return NULL;
     }
     
-    sc->free_list = node->next;
-    sc->free_objects--;
-    sc->alloc_count++;
-    
-    void* ptr = (void*)node;
-    
-    // Clear allocated memory
-    memset(ptr, 0, size_classes[class_idx]);
+    // Only the requested bytes need clearing, not the whole object
+    if (flags & GFP_ZERO) {
+        memset(ptr, 0, size);
+    }
     
     return ptr;
 }
 
+void* kmalloc(size_t size)
+{
+    return kmalloc_flags(size, GFP_KERNEL | GFP_ZERO);
+}
+
+void* kmalloc_nozero(size_t size)
+{
+    return kmalloc_flags(size, GFP_KERNEL);
+}
+
 void* krealloc(void* ptr, size_t size)
 {
     if (!ptr) return kmalloc(size);
@@ -321,26 +951,22 @@ void* krealloc(void* ptr, size_t size)
         return NULL;
     }
     
+    size_t old_size = kmalloc_usable_size(ptr);
+    if (old_size == 0) {
+        KWARN("krealloc: unknown pointer %p", ptr);
+        return NULL;
+    }
+    
+    // Still fits in the existing object
+    if (size <= old_size) {
+        return ptr;
+    }
+    
     // Allocate new block
     void* new_ptr = kmalloc(size);
     if (!new_ptr) return NULL;
     
-    // Find old size (search tracking records)
-    size_t old_size = 0;
-    alloc_record_t* record = alloc_records;
-    while (record) {
-        if (record->ptr == ptr) {
-            old_size = record->size;
-            break;
-        }
-        record = record->next;
-    }
-    
-    // Copy data (up to smaller of old/new size)
-    size_t copy_size = old_size < size ? old_size : size;
-    if (copy_size > 0) {
-        memcpy(new_ptr, ptr, copy_size);
-    }
+    memcpy(new_ptr, ptr, old_size);
     
     // Free old block
     kfree(ptr);
@@ -355,53 +981,49 @@ void kfree(void* ptr)
     
     free_count++;
     
-    // Check if this is a large allocation (outside heap range)
-    uintptr_t addr = (uintptr_t)ptr;
-    if (addr < HEAP_START || addr >= HEAP_END) {
-        // Assume it's from PMM - would need better tracking
-        KWARN("kfree: potential large allocation free (not implemented)");
+    if (heap_contains(ptr)) {
+        slab_t* slab = slab_of(ptr);
+        if (slab->magic != SLAB_MAGIC ||
+            ((uintptr_t)ptr - (uintptr_t)slab - SLAB_HEADER_SIZE) % slab->obj_size != 0) {
+            KWARN("kfree: invalid slab pointer %p", ptr);
+            return;
+        }
+        // A remote object goes home rather than into this node's magazines
+        uint64_t irq = irq_save();
+        if ((numa_node_count() > 1 && slab->node != numa_current_node()) ||
+            !magazine_free(slab->class_idx, ptr)) {
+            mcs_node_t qn;
+            mcs_lock(&heap_lock, &qn);
+            slab_free(slab, ptr);
+            mcs_unlock(&heap_lock, &qn);
+        }
+        irq_restore(irq);
         return;
     }
     
-    // Determine size class by checking which range it falls into
-    // This is simplified - real implementation would store metadata
-    int class_idx = -1;
-    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
-        // size_class_t* sc = &size_class_allocators[i];
-        // Heuristic: assume object size matches allocated size
-        class_idx = i;  // Simplified - would need better tracking
-        break;
+    if (!large_free(ptr)) {
+        KWARN("kfree: pointer %p was not allocated by kmalloc", ptr);
     }
-    
-    if (class_idx < 0) {
-        KWARN("kfree: cannot determine size class for %p", ptr);
-        return;
-    }
-    
-    size_class_t* sc = &size_class_allocators[class_idx];
-    
-    // Add back to free list
-    free_node_t* node = (free_node_t*)ptr;
-    node->next = sc->free_list;
-    node->size = size_classes[class_idx];
-    sc->free_list = node;
-    sc->free_objects++;
-    sc->free_count++;
 }
 
 // ============================================================================
 // TRACKED ALLOCATION API (Modern API)
 // ============================================================================
 
-void* kmalloc_tracked(size_t size, const char* tag)
+void* kmalloc_tracked_flags(size_t size, const char* tag, gfp_t flags)
 {
-    void* ptr = kmalloc(size);
+    void* ptr = kmalloc_flags(size, flags);
     if (ptr) {
         track_allocation(ptr, size, tag);
     }
     return ptr;
 }
 
+void* kmalloc_tracked(size_t size, const char* tag)
+{
+    return kmalloc_tracked_flags(size, tag, GFP_KERNEL | GFP_ZERO);
+}
+
 void* krealloc_tracked(void* ptr, size_t size, const char* tag)
 {
     if (ptr) {
@@ -446,33 +1068,44 @@ void memory_dump_leaks(void)
     KINFO("Outstanding: %ld", (long)(allocation_count - free_count));
     KINFO("Current usage: %lu bytes", total_allocated);
     KINFO("Peak usage: %lu bytes", peak_usage);
+    KINFO("Tracked live: %lu (untracked, table full: %lu)", track_live, track_dropped);
     
-    if (alloc_records) {
-        KINFO("Outstanding allocations:");
-        alloc_record_t* record = alloc_records;
-        int count = 0;
-        while (record && count < 10) {  // Show first 10
-            KINFO("  %p: %lu bytes [%s]", 
-                  record->ptr, record->size, record->tag);
-            record = record->next;
-            count++;
-        }
-        if (record) {
-            KINFO("  ... and more");
-        }
+    // Per-tag aggregates are bounded by TAG_TABLE_SIZE, no table walk needed
+    KINFO("Outstanding allocations by tag:");
+    for (int i = 0; i < TAG_TABLE_SIZE; i++) {
+        tag_stats_t* ts = &tag_table[i];
+        if (!ts->tag || ts->live_count == 0) continue;
+        KINFO("  %s: %lu live, %lu bytes (peak %lu, %lu total)",
+              ts->tag, ts->live_count, ts->live_bytes, ts->peak_bytes, ts->total_allocs);
     }
 }
 
 void kheap_debug(void)
 {
     KINFO("=== Kernel Heap Debug Info ===");
+    KINFO("Heap span: %lu KB, mapped: %lu KB, pooled slabs: %lu, unbacked slabs: %lu",
+          (heap_next_free - HEAP_START) / 1024, heap_mapped_pages * PAGE_SIZE / 1024,
+          slab_pool_count, unbacked_count);
+    KINFO("Heap lock: %lu contended acquisitions, %lu cycles average wait",
+          heap_lock.contended, heap_lock.contended ? heap_lock.wait_cycles / heap_lock.contended : 0);
     for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
         size_class_t* sc = &size_class_allocators[i];
         KINFO("Size class %lu bytes:", size_classes[i]);
+        KINFO("  Slabs: %lu (%lu empty)", sc->slab_count, sc->empty_slabs);
         KINFO("  Total objects: %lu", sc->total_objects);
         KINFO("  Free objects: %lu", sc->free_objects);
         KINFO("  Allocations: %lu", sc->alloc_count);
         KINFO("  Frees: %lu", sc->free_count);
+        size_t hits = 0;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            hits += percpu_caches[cpu][i].hits;
+        }
+        size_t full = 0, empty = 0;
+        for (int node = 0; node < numa_node_count(); node++) {
+            full += magazine_depots[node][i].full_count;
+            empty += magazine_depots[node][i].empty_count;
+        }
+        KINFO("  Magazine hits: %lu (depot: %lu full, %lu empty)", hits, full, empty);
         KINFO("  Utilization: %lu%%", 
               sc->total_objects > 0 ? 
               ((sc->total_objects - sc->free_objects) * 100 / sc->total_objects) : 0);
@@ -0,0 +1,315 @@
+/*
+ * NUMA Topology
+ *
+ * The ACPI SRAT assigns memory ranges and local APICs to proximity
+ * domains; the SLIT gives the relative distance between domains. Domains
+ * are numbered into nodes 0..n-1 in the order the SRAT first names them,
+ * and each node gets a fallback list of every node sorted by distance,
+ * which the PMM walks when the preferred node has nothing left.
+ *
+ * Without an SRAT (or with one naming a single domain) everything is
+ * node 0 and every lookup below returns at once.
+ */
+
+#include "kernel.h"
+#include "smp.h"
+#include "numa.h"
+
+// ============================================================================
+// ACPI TABLE LAYOUTS
+// ============================================================================
+
+typedef struct {
+    acpi_sdt_header_t header;
+    uint32_t table_revision;
+    uint8_t reserved[8];
+    uint8_t entries[];
+} __attribute__((packed)) acpi_srat_t;
+
+typedef struct {
+    acpi_sdt_header_t header;
+    uint64_t localities;
+    uint8_t matrix[];          // localities x localities, row = from
+} __attribute__((packed)) acpi_slit_t;
+
+#define SRAT_TYPE_APIC         0
+#define SRAT_TYPE_MEMORY       1
+#define SRAT_TYPE_X2APIC       2
+#define SRAT_ENABLED           0x1
+
+#define SRAT_MAX_CPUS          256  // APIC affinity entries kept
+
+// ============================================================================
+// STATE
+// ============================================================================
+
+typedef struct {
+    size_t start_pfn;
+    size_t end_pfn;
+    int node;
+} numa_memblk_t;
+
+static int node_count = 1;
+static uint32_t node_pxm[NUMA_MAX_NODES];      // Proximity domain of each node
+static uint8_t node_distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static uint8_t node_fallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+static numa_memblk_t memblks[NUMA_MAX_MEMBLKS];  // Sorted by start_pfn
+static int memblk_count = 0;
+
+static struct {
+    uint32_t apic_id;
+    uint8_t node;
+} srat_cpus[SRAT_MAX_CPUS];
+static int srat_cpu_count = 0;
+
+static uint8_t cpu_node[MAX_CPUS];             // 0 until the CPU is placed
+
+// ============================================================================
+// LOOKUP
+// ============================================================================
+
+int numa_node_count(void)
+{
+    return node_count;
+}
+
+/*
+ * Node of a frame, and where the range it lies in ends. Frames outside
+ * every SRAT range (holes, or no SRAT at all) belong to node 0.
+ */
+int numa_node_of_pfn(size_t pfn, size_t* run_end)
+{
+    if (memblk_count == 0) {
+        if (run_end) *run_end = (size_t)-1;
+        return 0;
+    }
+
+    for (int i = 0; i < memblk_count; i++) {
+        if (pfn < memblks[i].start_pfn) {
+            if (run_end) *run_end = memblks[i].start_pfn;
+            return 0;
+        }
+        if (pfn < memblks[i].end_pfn) {
+            if (run_end) *run_end = memblks[i].end_pfn;
+            return memblks[i].node;
+        }
+    }
+    if (run_end) *run_end = (size_t)-1;
+    return 0;
+}
+
+int numa_node_of_cpu(int cpu)
+{
+    return (cpu >= 0 && cpu < MAX_CPUS) ? cpu_node[cpu] : 0;
+}
+
+int numa_current_node(void)
+{
+    return node_count > 1 ? cpu_node[smp_cpu_id()] : 0;
+}
+
+void numa_cpu_online(int cpu, uint32_t apic_id)
+{
+    if (cpu < 0 || cpu >= MAX_CPUS) return;
+    for (int i = 0; i < srat_cpu_count; i++) {
+        if (srat_cpus[i].apic_id == apic_id) {
+            cpu_node[cpu] = srat_cpus[i].node;
+            return;
+        }
+    }
+    cpu_node[cpu] = 0;
+}
+
+uint8_t numa_distance(int from, int to)
+{
+    if (from < 0 || to < 0 || from >= node_count || to >= node_count) {
+        return NUMA_REMOTE_DISTANCE;
+    }
+    return node_distance[from][to];
+}
+
+const uint8_t* numa_fallback_order(int node)
+{
+    if (node < 0 || node >= node_count) node = 0;
+    return node_fallback[node];
+}
+
+// ============================================================================
+// SRAT / SLIT PARSING
+// ============================================================================
+
+// Node for a proximity domain, numbering new domains as they appear
+static int numa_node_for_pxm(uint32_t pxm)
+{
+    for (int n = 0; n < node_count; n++) {
+        if (node_pxm[n] == pxm) return n;
+    }
+    if (node_count >= NUMA_MAX_NODES) {
+        return -1;
+    }
+    node_pxm[node_count] = pxm;
+    return node_count++;
+}
+
+static void numa_add_memblk(uint64_t base, uint64_t length, int node)
+{
+    size_t start = ALIGN_UP(base, PAGE_SIZE) / PAGE_SIZE;
+    size_t end = ALIGN_DOWN(base + length, PAGE_SIZE) / PAGE_SIZE;
+    if (start >= end) return;
+    if (memblk_count >= NUMA_MAX_MEMBLKS) {
+        KWARN("NUMA: more than %d SRAT memory ranges, extra ones go to node 0",
+              NUMA_MAX_MEMBLKS);
+        return;
+    }
+
+    // Insertion sort: the table is small and parsed once
+    int i = memblk_count++;
+    while (i > 0 && memblks[i - 1].start_pfn > start) {
+        memblks[i] = memblks[i - 1];
+        i--;
+    }
+    memblks[i].start_pfn = start;
+    memblks[i].end_pfn = end;
+    memblks[i].node = node;
+}
+
+static void numa_add_cpu(uint32_t apic_id, uint32_t pxm)
+{
+    int node = numa_node_for_pxm(pxm);
+    if (node < 0 || srat_cpu_count >= SRAT_MAX_CPUS) return;
+    srat_cpus[srat_cpu_count].apic_id = apic_id;
+    srat_cpus[srat_cpu_count].node = (uint8_t)node;
+    srat_cpu_count++;
+}
+
+static bool numa_parse_srat(void)
+{
+    acpi_srat_t* srat = (acpi_srat_t*)acpi_get_table("SRAT");
+    if (!srat) {
+        return false;
+    }
+
+    node_count = 0;
+    uint8_t* entry = srat->entries;
+    uint8_t* end = (uint8_t*)srat + srat->header.length;
+
+    while (entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end) {
+        switch (entry[0]) {
+        case SRAT_TYPE_APIC:
+            // Type, length, domain[7:0], APIC ID, flags, SAPIC EID, domain[31:8]
+            if (entry[1] >= 16 && (*(uint32_t*)(entry + 4) & SRAT_ENABLED)) {
+                uint32_t pxm = entry[2] | ((uint32_t)entry[9] << 8) |
+                               ((uint32_t)entry[10] << 16) | ((uint32_t)entry[11] << 24);
+                numa_add_cpu(entry[3], pxm);
+            }
+            break;
+        case SRAT_TYPE_MEMORY:
+            // Type, length, domain, reserved, base, length, reserved, flags
+            if (entry[1] >= 40 && (*(uint32_t*)(entry + 28) & SRAT_ENABLED)) {
+                int node = numa_node_for_pxm(*(uint32_t*)(entry + 2));
+                if (node >= 0) {
+                    numa_add_memblk(*(uint64_t*)(entry + 8), *(uint64_t*)(entry + 16), node);
+                }
+            }
+            break;
+        case SRAT_TYPE_X2APIC:
+            // Type, length, reserved, domain, x2APIC ID, flags
+            if (entry[1] >= 24 && (*(uint32_t*)(entry + 12) & SRAT_ENABLED)) {
+                numa_add_cpu(*(uint32_t*)(entry + 8), *(uint32_t*)(entry + 4));
+            }
+            break;
+        }
+        entry += entry[1];
+    }
+
+    if (node_count == 0) {
+        node_count = 1;
+        node_pxm[0] = 0;
+    }
+    return true;
+}
+
+// Distances from the SLIT, where it covers both domains
+static void numa_parse_slit(void)
+{
+    for (int a = 0; a < node_count; a++) {
+        for (int b = 0; b < node_count; b++) {
+            node_distance[a][b] = a == b ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    acpi_slit_t* slit = (acpi_slit_t*)acpi_get_table("SLIT");
+    if (!slit) return;
+
+    uint64_t n = slit->localities;
+    if (sizeof(acpi_slit_t) + n * n > slit->header.length) {
+        KWARN("NUMA: SLIT shorter than its %lu localities", n);
+        return;
+    }
+    for (int a = 0; a < node_count; a++) {
+        for (int b = 0; b < node_count; b++) {
+            if (node_pxm[a] < n && node_pxm[b] < n) {
+                node_distance[a][b] = slit->matrix[node_pxm[a] * n + node_pxm[b]];
+            }
+        }
+    }
+}
+
+// Every node's fallback list: itself first, then by distance (lowest node on ties)
+static void numa_build_fallback(void)
+{
+    for (int node = 0; node < node_count; node++) {
+        uint8_t* order = node_fallback[node];
+        for (int i = 0; i < node_count; i++) {
+            order[i] = (uint8_t)i;
+        }
+        order[0] = (uint8_t)node;
+        order[node] = 0;
+
+        for (int i = 2; i < node_count; i++) {
+            for (int j = i; j > 1; j--) {
+                uint8_t a = order[j - 1], b = order[j];
+                uint8_t da = node_distance[node][a], db = node_distance[node][b];
+                if (da < db || (da == db && a < b)) break;
+                order[j - 1] = b;
+                order[j] = a;
+            }
+        }
+    }
+}
+
+// ============================================================================
+// INITIALIZATION
+// ============================================================================
+
+void numa_init(void)
+{
+    if (!numa_parse_srat()) {
+        node_count = 1;
+        node_pxm[0] = 0;
+    }
+    numa_parse_slit();
+    numa_build_fallback();
+
+    // One node is the flat case: no ranges to look up on every free
+    if (node_count == 1) {
+        memblk_count = 0;
+        KINFO("NUMA: 1 node");
+        return;
+    }
+
+    KINFO("NUMA: %d nodes, %d memory ranges, %d CPUs placed", node_count, memblk_count,
+          srat_cpu_count);
+    for (int i = 0; i < memblk_count; i++) {
+        KINFO("  Node %d: 0x%lx - 0x%lx", memblks[i].node, memblks[i].start_pfn * PAGE_SIZE,
+              memblks[i].end_pfn * PAGE_SIZE);
+    }
+    for (int a = 0; a < node_count; a++) {
+        char line[NUMA_MAX_NODES * 4 + 1];
+        for (int b = 0; b < node_count; b++) {
+            sprintf(line + b * 4, "%4u", node_distance[a][b]);
+        }
+        KINFO("  Distance from node %d:%s", a, line);
+    }
+}
@@ -1,8 +1,27 @@
 #include "kernel.h"
+#include "numa.h"
 
 /*
  * Physical Memory Manager (PMM)
  * Manages allocation of physical memory pages
+ *
+ * Free memory is kept in binary buddy free lists (order 0..BUDDY_MAX_ORDER),
+ * one set per NUMA node (a zone), fronted by per-CPU page lists that absorb
+ * single-page traffic. Allocations go to the node the current task's memory
+ * policy names - by default the node of the CPU it runs on - and fall back
+ * to the other nodes nearest first.
+ * The page bitmap is retained as the authoritative allocated/free map and is
+ * used both for double-free detection and for buddy coalescing decisions:
+ * a page's bit is clear only while it belongs to a block on a free list.
+ *
+ * Next to the bitmap sits one page_t per frame holding its reference count,
+ * so a frame mapped into several address spaces (copy-on-write after fork)
+ * is only freed when the last mapping goes away, and after that one
+ * buddy_block_t per frame with the free list links. Free frames themselves
+ * are never written, so they need not be mapped.
+ *
+ * A pool of pages zeroed ahead of time by a lowest-priority kernel task
+ * keeps the memset off the page fault path (pmm_alloc_zeroed_page).
  */
 
 // Multiboot 2 information structures
@@ -25,24 +44,69 @@ typedef struct {
     uint32_t reserved;
 } __PACKED multiboot_memory_map_entry_t;
 
+// Free block header, kept in buddy_array at the PFN of the block's first page
+#define BUDDY_NONE  0xFFFFFFFFU  // End of a free list
+
+typedef struct {
+    uint32_t next;               // PFN of the next block on the list, or BUDDY_NONE
+    uint32_t prev;
+    uint8_t order;
+    uint8_t free_head;           // Set while the block is on a free list
+    uint16_t node;               // Zone whose list holds the block
+} buddy_block_t;
+
 // Enhanced PMM with page frame caching and optimized allocation
 static uint8_t* memory_bitmap;
 static size_t memory_bitmap_size;
 static uintptr_t memory_start;
 static size_t total_memory_pages;
 static size_t used_memory_pages;
+static page_t* page_array;  // Indexed by PFN, right after the bitmap
+static buddy_block_t* buddy_array;  // Indexed by PFN, right after page_array
+
+// Per-CPU page frame lists (Linux pcp-style) for single-page allocations,
+// holding pages of the CPU's own node only.
+// Each list is a ring: the hot end holds recently freed, cache-warm pages,
+// the cold end holds pages refilled from the buddy allocator.
+#define PCP_CAPACITY   256  // Ring size per CPU
+#define PCP_HIGH       192  // Drain once a list grows past this
+#define PCP_BATCH      32   // Pages moved per refill/drain
 
-// Page frame cache for common allocation sizes (per CPU)
-// Each cache entry holds a list of free pages
-#define PF_CACHE_SIZE 32
-static uint64_t* pf_cache_hot[PF_CACHE_SIZE];  // Hot cache - recently freed pages
-static uint64_t* pf_cache_cold[PF_CACHE_SIZE]; // Cold cache - for page reclamation
-static size_t pf_cache_hot_count[PF_CACHE_SIZE];
-static size_t pf_cache_cold_count[PF_CACHE_SIZE];
+typedef struct {
+    uintptr_t pages[PCP_CAPACITY];
+    size_t bottom;              // Index of the coldest page
+    size_t count;               // Pages currently cached
+    size_t hits;                // Allocations served from this list
+    size_t refills;             // Batches pulled from the buddy allocator
+    size_t drains;              // Batches returned to the buddy allocator
+    spinlock_t lock;            // Owner CPU, or a remote drain
+} pcp_list_t;
+
+static pcp_list_t pcp_lists[MAX_CPUS];
+
+// page_t.flags
+#define PAGE_PCP       0x1  // On a per-CPU list: free, though the bitmap says used
+
+// Pre-zeroed pages, allocated (refcount 1) and waiting for a taker, one
+// pool per node
+#define ZERO_POOL_CAPACITY  512  // 2MB of zeroed pages at most
+#define ZERO_POOL_LOW       128  // Wake the zeroing task below this
+#define ZERO_WORKER_PRIORITY 254 // Just above the idle tasks (255): only idle time
+
+static struct {
+    uintptr_t pages[ZERO_POOL_CAPACITY];
+    size_t count;
+    spinlock_t lock;
+    size_t hits;                 // Zeroed allocations served from the pool
+    size_t misses;               // Pool empty: zeroed on the spot
+} zero_pools[NUMA_MAX_NODES];
+static wait_queue_t zero_pool_wq = WAIT_QUEUE_INIT;
+static bool zero_worker_running = false;
 
 // Allocation statistics for optimization
 static size_t alloc_requests = 0;
 static size_t alloc_failures = 0;
+static size_t single_page_allocs = 0;
 static size_t total_pages_allocated = 0;
 static size_t total_pages_freed = 0;
 
@@ -56,50 +120,440 @@ extern char _kernel_end[];
 #define MEMORY_MAP_TYPE_AVAILABLE 1
 #define MEMORY_MAP_TYPE_RESERVED  2
 #define LOW_MEMORY_THRESHOLD      (128 * 1024 * 1024 / PAGE_SIZE)  // 128MB low memory
-#define PAGE_CACHE_SIZE          8    // Maximum pages per cache entry
-#define BUDDY_MAX_ORDER          11   // 2^11 = 2048KB buddy allocation max
+#define BUDDY_MAX_ORDER          11   // 2^11 pages = 8MB largest buddy block
+
+// One buddy allocator per NUMA node. A block never spans two nodes:
+// coalescing stops where the node's memory ends.
+typedef struct {
+    uint32_t free_lists[BUDDY_MAX_ORDER + 1];  // Head PFN by order, or BUDDY_NONE
+    size_t free_blocks[BUDDY_MAX_ORDER + 1];
+    size_t present_pages;        // Pages seeded into the zone
+    size_t local_allocs;         // Buddy allocations that wanted this node
+    size_t fallback_allocs;      // ... served here for another node
+    spinlock_t lock;             // Free lists, and the bitmap bits of free pages
+    uint32_t node;
+} pmm_zone_t;
+
+static pmm_zone_t zones[NUMA_MAX_NODES];
+static int zone_count = 1;
 
 // Forward declarations
 static void pmm_parse_memory_map(void);
+static size_t pmm_drain_zero_pool(void);
+
+// ============================================================================
+// BITMAP HELPERS
+// ============================================================================
+
+static inline bool pmm_page_used(size_t pfn)
+{
+    return memory_bitmap[pfn / 8] & (1 << (pfn % 8));
+}
+
+// Mark a run of pages used or free, byte at a time where possible. The
+// partial bytes at either end may hold another zone's pages, whose lock
+// the caller does not hold: those are updated atomically.
+static void pmm_mark_range(size_t pfn, size_t count, bool used)
+{
+    size_t end = pfn + count;
+
+    while (pfn < end && (pfn % 8) != 0) {
+        if (used) __atomic_fetch_or(&memory_bitmap[pfn / 8], 1 << (pfn % 8), __ATOMIC_RELAXED);
+        else      __atomic_fetch_and(&memory_bitmap[pfn / 8], ~(1 << (pfn % 8)), __ATOMIC_RELAXED);
+        pfn++;
+    }
+    if (end - pfn >= 8) {
+        size_t bytes = (end - pfn) / 8;
+        memset(&memory_bitmap[pfn / 8], used ? 0xFF : 0x00, bytes);
+        pfn += bytes * 8;
+    }
+    while (pfn < end) {
+        if (used) __atomic_fetch_or(&memory_bitmap[pfn / 8], 1 << (pfn % 8), __ATOMIC_RELAXED);
+        else      __atomic_fetch_and(&memory_bitmap[pfn / 8], ~(1 << (pfn % 8)), __ATOMIC_RELAXED);
+        pfn++;
+    }
+}
+
+// ============================================================================
+// ZONES
+// ============================================================================
+
+static inline pmm_zone_t* pmm_zone_of(size_t pfn)
+{
+    return &zones[zone_count > 1 ? numa_node_of_pfn(pfn, NULL) : 0];
+}
+
+// Free pages in a zone, from its per-order block counts
+static size_t pmm_zone_free_pages(pmm_zone_t* z)
+{
+    size_t pages = 0;
+    for (int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        pages += z->free_blocks[order] << order;
+    }
+    return pages;
+}
+
+// ============================================================================
+// BUDDY ALLOCATOR
+// ============================================================================
+
+static inline buddy_block_t* buddy_pfn_to_block(size_t pfn)
+{
+    return &buddy_array[pfn];
+}
+
+// Smallest order whose block holds at least num_pages pages
+static inline uint32_t buddy_order_for(size_t num_pages)
+{
+    uint32_t order = 0;
+    while (((size_t)1 << order) < num_pages) {
+        order++;
+    }
+    return order;
+}
+
+static void buddy_list_add(pmm_zone_t* z, size_t pfn, uint32_t order)
+{
+    buddy_block_t* block = buddy_pfn_to_block(pfn);
+    block->order = (uint8_t)order;
+    block->free_head = 1;
+    block->node = (uint16_t)z->node;
+    block->prev = BUDDY_NONE;
+    block->next = z->free_lists[order];
+    if (block->next != BUDDY_NONE) {
+        buddy_array[block->next].prev = (uint32_t)pfn;
+    }
+    z->free_lists[order] = (uint32_t)pfn;
+    z->free_blocks[order]++;
+}
+
+static void buddy_list_remove(pmm_zone_t* z, buddy_block_t* block)
+{
+    if (block->prev != BUDDY_NONE) {
+        buddy_array[block->prev].next = block->next;
+    } else {
+        z->free_lists[block->order] = block->next;
+    }
+    if (block->next != BUDDY_NONE) {
+        buddy_array[block->next].prev = block->prev;
+    }
+    z->free_blocks[block->order]--;
+    block->free_head = 0;
+}
+
+// Is pfn the head of a free block of exactly this order in this zone?
+static inline bool buddy_is_free_head(pmm_zone_t* z, size_t pfn, uint32_t order)
+{
+    if (pfn + ((size_t)1 << order) > total_memory_pages) return false;
+    if (pmm_page_used(pfn)) return false;
+
+    buddy_block_t* block = buddy_pfn_to_block(pfn);
+    return block->free_head && block->order == order && block->node == z->node;
+}
+
+// Return an aligned block to the free lists, merging with free buddies
+static void buddy_free_block(pmm_zone_t* z, size_t pfn, uint32_t order)
+{
+    pmm_mark_range(pfn, (size_t)1 << order, false);
+
+    while (order < BUDDY_MAX_ORDER) {
+        size_t buddy = pfn ^ ((size_t)1 << order);
+        if (!buddy_is_free_head(z, buddy, order)) {
+            break;
+        }
+        buddy_list_remove(z, buddy_pfn_to_block(buddy));
+        pfn &= ~((size_t)1 << order);
+        order++;
+    }
+
+    buddy_list_add(z, pfn, order);
+}
+
+// Free an arbitrary page range by splitting it into maximal aligned blocks
+static void buddy_free_range(pmm_zone_t* z, size_t pfn, size_t count)
+{
+    while (count > 0) {
+        uint32_t order = BUDDY_MAX_ORDER;
+        while (order > 0 &&
+               ((pfn & (((size_t)1 << order) - 1)) != 0 || ((size_t)1 << order) > count)) {
+            order--;
+        }
+        buddy_free_block(z, pfn, order);
+        pfn += (size_t)1 << order;
+        count -= (size_t)1 << order;
+    }
+}
+
+// Find a physically contiguous run of max-order blocks for very large requests
+static bool buddy_alloc_huge(pmm_zone_t* z, size_t num_pages, size_t* out_pfn)
+{
+    size_t max_block = (size_t)1 << BUDDY_MAX_ORDER;
+    size_t blocks_needed = (num_pages + max_block - 1) / max_block;
+
+    for (uint32_t head = z->free_lists[BUDDY_MAX_ORDER]; head != BUDDY_NONE;
+         head = buddy_array[head].next) {
+        size_t start = head;
+        size_t n = 1;
+        while (n < blocks_needed && buddy_is_free_head(z, start + n * max_block, BUDDY_MAX_ORDER)) {
+            n++;
+        }
+        if (n < blocks_needed) continue;
+
+        for (size_t i = 0; i < blocks_needed; i++) {
+            buddy_list_remove(z, buddy_pfn_to_block(start + i * max_block));
+        }
+        pmm_mark_range(start, blocks_needed * max_block, true);
+        if (blocks_needed * max_block > num_pages) {
+            buddy_free_range(z, start + num_pages, blocks_needed * max_block - num_pages);
+        }
+        *out_pfn = start;
+        return true;
+    }
+    return false;
+}
+
+// Allocate num_pages contiguous pages; O(BUDDY_MAX_ORDER) for normal sizes
+static bool buddy_alloc(pmm_zone_t* z, size_t num_pages, size_t* out_pfn)
+{
+    uint32_t order = buddy_order_for(num_pages);
+    if (order > BUDDY_MAX_ORDER) {
+        return buddy_alloc_huge(z, num_pages, out_pfn);
+    }
+
+    uint32_t o = order;
+    while (o <= BUDDY_MAX_ORDER && z->free_lists[o] == BUDDY_NONE) {
+        o++;
+    }
+    if (o > BUDDY_MAX_ORDER) {
+        return false;
+    }
+
+    size_t pfn = z->free_lists[o];
+    buddy_list_remove(z, buddy_pfn_to_block(pfn));
+
+    // Split down to the requested order, returning upper halves
+    while (o > order) {
+        o--;
+        buddy_list_add(z, pfn + ((size_t)1 << o), o);
+    }
+
+    // Claim the whole block, then give back the unused tail of
+    // non-power-of-two requests instead of wasting it
+    size_t block_pages = (size_t)1 << order;
+    pmm_mark_range(pfn, block_pages, true);
+    if (block_pages > num_pages) {
+        buddy_free_range(z, pfn + num_pages, block_pages - num_pages);
+    }
+
+    *out_pfn = pfn;
+    return true;
+}
+
+// Buddy allocation on node, then on every other node nearest first
+static bool pmm_zone_alloc(size_t num_pages, int node, size_t* out_pfn)
+{
+    const uint8_t* order = numa_fallback_order(node);
+    for (int i = 0; i < zone_count; i++) {
+        pmm_zone_t* z = &zones[order[i]];
+        uint64_t flags = spin_lock_irqsave(&z->lock);
+        bool ok = buddy_alloc(z, num_pages, out_pfn);
+        if (ok) {
+            if (i == 0) z->local_allocs++;
+            else z->fallback_allocs++;
+        }
+        spin_unlock_irqrestore(&z->lock, flags);
+        if (ok) return true;
+    }
+    return false;
+}
+
+// Hand [start_pfn, end_pfn) to the zones of the nodes it lies on
+static size_t pmm_seed_pages(size_t start_pfn, size_t end_pfn)
+{
+    size_t seeded = 0;
+    while (start_pfn < end_pfn) {
+        size_t run_end;
+        pmm_zone_t* z = &zones[numa_node_of_pfn(start_pfn, &run_end)];
+        if (run_end > end_pfn) run_end = end_pfn;
+        buddy_free_range(z, start_pfn, run_end - start_pfn);
+        z->present_pages += run_end - start_pfn;
+        seeded += run_end - start_pfn;
+        start_pfn = run_end;
+    }
+    return seeded;
+}
+
+// Seed the free lists with [start_pfn, end_pfn), skipping the reserved window
+static size_t pmm_seed_range(size_t start_pfn, size_t end_pfn,
+                             size_t reserved_start, size_t reserved_end)
+{
+    size_t seeded = 0;
+
+    if (end_pfn > total_memory_pages) end_pfn = total_memory_pages;
+    if (start_pfn >= end_pfn) return 0;
+
+    if (start_pfn < reserved_start) {
+        size_t stop = end_pfn < reserved_start ? end_pfn : reserved_start;
+        seeded += pmm_seed_pages(start_pfn, stop);
+    }
+    if (end_pfn > reserved_end) {
+        size_t begin = start_pfn > reserved_end ? start_pfn : reserved_end;
+        seeded += pmm_seed_pages(begin, end_pfn);
+    }
+
+    return seeded;
+}
+
+// ============================================================================
+// INITIALIZATION
+// ============================================================================
 
 // Initialize the physical memory manager
 void pmm_init(void)
 {
     KINFO("Initializing physical memory manager...");
 
+    // Node ranges first: seeding splits free memory between the zones
+    numa_init();
+    zone_count = numa_node_count();
+    for (int node = 0; node < zone_count; node++) {
+        zones[node].node = (uint32_t)node;
+    }
+
     // Parse multiboot memory map
     pmm_parse_memory_map();
 
     KINFO("PMM initialized: %llu MB total, %llu MB available",
           (total_memory_pages * PAGE_SIZE) / (1024 * 1024),
           ((total_memory_pages - used_memory_pages) * PAGE_SIZE) / (1024 * 1024));
+    if (zone_count > 1) {
+        for (int node = 0; node < zone_count; node++) {
+            KINFO("  Node %d: %lu MB", node, zones[node].present_pages * PAGE_SIZE / (1024 * 1024));
+        }
+    }
 }
 
-// Initialize page frame caches for performance optimization
-static void pmm_init_caches(void)
+// ============================================================================
+// PER-CPU PAGE LISTS
+// ============================================================================
+
+// Pages on a list carry PAGE_PCP, so pmm_free_pages() can tell a second
+// free from a page the bitmap still counts as used
+static inline void pcp_push_hot(pcp_list_t* pcp, uintptr_t page)
 {
-    // Allocate memory for page frame caches
-    for (int i = 0; i < PAGE_CACHE_SIZE; i++) {
-        // Allocate hot cache arrays - small fixed size for now
-        if (i == 0) {  // Only initialize single-page cache for simplicity
-            pf_cache_hot[0] = kmalloc(PAGE_CACHE_SIZE * sizeof(uint64_t));
-            pf_cache_cold[0] = kmalloc(PAGE_CACHE_SIZE * sizeof(uint64_t));
+    page_array[page / PAGE_SIZE].flags |= PAGE_PCP;
+    pcp->pages[(pcp->bottom + pcp->count) % PCP_CAPACITY] = page;
+    pcp->count++;
+}
 
-            if (pf_cache_hot[0]) {
-                memset(pf_cache_hot[0], 0, PAGE_CACHE_SIZE * sizeof(uint64_t));
-            }
-            if (pf_cache_cold[0]) {
-                memset(pf_cache_cold[0], 0, PAGE_CACHE_SIZE * sizeof(uint64_t));
-            }
+static inline void pcp_push_cold(pcp_list_t* pcp, uintptr_t page)
+{
+    page_array[page / PAGE_SIZE].flags |= PAGE_PCP;
+    pcp->bottom = (pcp->bottom + PCP_CAPACITY - 1) % PCP_CAPACITY;
+    pcp->pages[pcp->bottom] = page;
+    pcp->count++;
+}
+
+static inline uintptr_t pcp_pop_hot(pcp_list_t* pcp)
+{
+    pcp->count--;
+    uintptr_t page = pcp->pages[(pcp->bottom + pcp->count) % PCP_CAPACITY];
+    page_array[page / PAGE_SIZE].flags &= ~PAGE_PCP;
+    return page;
+}
+
+static inline uintptr_t pcp_pop_cold(pcp_list_t* pcp)
+{
+    uintptr_t page = pcp->pages[pcp->bottom];
+    pcp->bottom = (pcp->bottom + 1) % PCP_CAPACITY;
+    pcp->count--;
+    page_array[page / PAGE_SIZE].flags &= ~PAGE_PCP;
+    return page;
+}
+
+// Pull a batch of pages from the node's buddy allocator onto the cold end.
+// One order-log2(PCP_BATCH) block is tried first so a refill costs a
+// single buddy operation; fragmented memory falls back to single pages.
+// An exhausted node leaves the list empty, for the caller to fall back.
+static size_t pcp_refill(pcp_list_t* pcp, int node)
+{
+    pmm_zone_t* z = &zones[node];
+    size_t added = 0;
+    size_t pfn;
+
+    spin_lock(&z->lock);
+    if (buddy_alloc(z, PCP_BATCH, &pfn)) {
+        for (size_t i = PCP_BATCH; i > 0; i--) {
+            pcp_push_cold(pcp, (pfn + i - 1) * PAGE_SIZE);
         }
+        added = PCP_BATCH;
+    } else {
+        while (added < PCP_BATCH && buddy_alloc(z, 1, &pfn)) {
+            pcp_push_cold(pcp, pfn * PAGE_SIZE);
+            added++;
+        }
+    }
+    if (added) z->local_allocs++;
 
-        pf_cache_hot_count[i] = 0;
-        pf_cache_cold_count[i] = 0;
+    spin_unlock(&z->lock);
+
+    // Cached pages count as free until they are handed out
+    __atomic_fetch_sub(&used_memory_pages, added, __ATOMIC_RELAXED);
+    if (added) pcp->refills++;
+    return added;
+}
+
+// Return up to batch pages from the cold end to the buddy allocator. The
+// pages are the list owner's node, but a remote drain may run elsewhere:
+// each goes to its own zone, holding one zone lock at a time.
+static void pcp_drain(pcp_list_t* pcp, size_t batch)
+{
+    if (batch > pcp->count) batch = pcp->count;
+
+    pmm_zone_t* locked = NULL;
+    for (size_t i = 0; i < batch; i++) {
+        size_t pfn = pcp_pop_cold(pcp) / PAGE_SIZE;
+        pmm_zone_t* z = pmm_zone_of(pfn);
+        if (z != locked) {
+            if (locked) spin_unlock(&locked->lock);
+            spin_lock(&z->lock);
+            locked = z;
+        }
+        buddy_free_range(z, pfn, 1);
     }
-    KINFO("Page frame caches initialized");
+    if (locked) spin_unlock(&locked->lock);
+    if (batch) pcp->drains++;
 }
 
-// Parse multiboot memory map and initialize bitmap
+// Flush every CPU's page list back to the buddy allocator (memory pressure,
+// or before retrying a failed multi-page allocation)
+void pmm_drain_cpu_caches(void)
+{
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pcp_list_t* pcp = &pcp_lists[cpu];
+        uint64_t flags = spin_lock_irqsave(&pcp->lock);
+        pcp_drain(pcp, pcp->count);
+        spin_unlock_irqrestore(&pcp->lock, flags);
+    }
+}
+
+// Initialize page frame caches for performance optimization
+static void pmm_init_caches(void)
+{
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pcp_list_t* pcp = &pcp_lists[cpu];
+        pcp->bottom = 0;
+        pcp->count = 0;
+        pcp->hits = 0;
+        pcp->refills = 0;
+        pcp->drains = 0;
+        spin_lock_init(&pcp->lock);
+    }
+    KINFO("Per-CPU page lists initialized (%d CPUs, batch %d, high %d)",
+          MAX_CPUS, PCP_BATCH, PCP_HIGH);
+}
+
+// Parse multiboot memory map and initialize bitmap and buddy free lists
 static void pmm_parse_memory_map(void)
 {
     // Get multiboot info pointer (32-bit initially)
@@ -115,64 +569,89 @@ static void pmm_parse_memory_map(void)
     while ((uintptr_t)tag < mb_info_addr + 1024) { // Reasonable limit
         if (tag->type == 6) { // Memory map tag
             multiboot_memory_map_t* mmap_tag = (multiboot_memory_map_t*)tag;
-            multiboot_memory_map_entry_t* entry = (multiboot_memory_map_entry_t*)(mmap_tag + 1);
+            multiboot_memory_map_entry_t* entries = (multiboot_memory_map_entry_t*)(mmap_tag + 1);
 
             size_t num_entries = (mmap_tag->size - sizeof(multiboot_memory_map_t)) /
                                 mmap_tag->entry_size;
 
-            // Find the largest available memory region for bitmap
+            // Find the largest available region and the top of usable memory
             uintptr_t bitmap_addr = 0;
             size_t largest_region_size = 0;
+            uint64_t highest_addr = 0;
 
-            for (size_t i = 0; i < num_entries; i++, entry++) {
-                uint64_t base = entry->base_addr;
-                uint64_t len = entry->length;
-                uint32_t type = entry->type;
+            for (size_t i = 0; i < num_entries; i++) {
+                multiboot_memory_map_entry_t* entry = &entries[i];
+                if (entry->type != MEMORY_MAP_TYPE_AVAILABLE) continue;
 
-                if (type == MEMORY_MAP_TYPE_AVAILABLE && len > largest_region_size) {
-                    // Available memory, suitable for bitmap
-                    largest_region_size = len;
-                    bitmap_addr = base;
+                if (entry->length > largest_region_size) {
+                    largest_region_size = entry->length;
+                    bitmap_addr = entry->base_addr;
+                }
+                if (entry->base_addr + entry->length > highest_addr) {
+                    highest_addr = entry->base_addr + entry->length;
                 }
             }
 
-            // Use part of the largest region for bitmap
             if (bitmap_addr == 0) {
                 PANIC("No suitable memory region for bitmap");
             }
 
             // Calculate memory bitmap size (1 bit per page)
             memory_start = bitmap_addr;
-            total_memory_pages = (uint32_t)(PHYSICAL_MEMORY_LIMIT / PAGE_SIZE);
-            memory_bitmap_size = ALIGN_UP(total_memory_pages / 8, PAGE_SIZE);
+            total_memory_pages = highest_addr / PAGE_SIZE;
+            if (total_memory_pages > (size_t)(PHYSICAL_MEMORY_LIMIT / PAGE_SIZE)) {
+                total_memory_pages = (uint32_t)(PHYSICAL_MEMORY_LIMIT / PAGE_SIZE);
+            }
+            memory_bitmap_size = ALIGN_UP((total_memory_pages + 7) / 8, PAGE_SIZE);
 
-            // Place bitmap at the end of the kernel or start of this region
+            // Place bitmap at the end of the kernel; everything starts out used
+            // and only available regions are handed to the buddy allocator
             memory_bitmap = (uint8_t*)ALIGN_UP((uintptr_t)&_kernel_end, PAGE_SIZE);
-            memset(memory_bitmap, 0, memory_bitmap_size);
+            memset(memory_bitmap, 0xFF, memory_bitmap_size);
+
+            // Frame descriptors follow the bitmap; reserved frames keep count 0
+            page_array = (page_t*)((uintptr_t)memory_bitmap + memory_bitmap_size);
+            size_t page_array_size = ALIGN_UP(total_memory_pages * sizeof(page_t), PAGE_SIZE);
+            memset(page_array, 0, page_array_size);
+
+            // Free list links after that, so a free frame is never written
+            buddy_array = (buddy_block_t*)((uintptr_t)page_array + page_array_size);
+            size_t buddy_array_size = ALIGN_UP(total_memory_pages * sizeof(buddy_block_t), PAGE_SIZE);
+            memset(buddy_array, 0, buddy_array_size);
+
+            for (int node = 0; node < zone_count; node++) {
+                for (int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+                    zones[node].free_lists[order] = BUDDY_NONE;
+                    zones[node].free_blocks[order] = 0;
+                }
+            }
 
-            // Mark memory as used up to memory_bitmap + size
-            uintptr_t used_end = (uintptr_t)memory_bitmap + memory_bitmap_size;
-            size_t used_pages = (used_end + PAGE_SIZE - 1) / PAGE_SIZE;
-            used_memory_pages = used_pages;
+            // Low memory, the kernel image and the frame metadata stay reserved
+            size_t reserved_end = ((uintptr_t)buddy_array + buddy_array_size) / PAGE_SIZE;
 
-            // Mark kernel memory as used (from kernel start 0x100000 to end)
-            uintptr_t kernel_start_page = KERNEL_START_ADDR / PAGE_SIZE;
-            uintptr_t kernel_end_page = ALIGN_UP((uintptr_t)&_kernel_end, PAGE_SIZE) / PAGE_SIZE;
+            // Multiboot info is reserved as well
+            size_t mb_start = mb_info_addr / PAGE_SIZE;
+            size_t mb_end = ALIGN_UP(mb_info_addr + 1024, PAGE_SIZE) / PAGE_SIZE;
 
-            for (size_t i = kernel_start_page; i < kernel_end_page; i++) {
-                memory_bitmap[i / 8] |= (1 << (i % 8));
-                used_memory_pages++;
-            }
+            size_t free_pages = 0;
+            for (size_t i = 0; i < num_entries; i++) {
+                multiboot_memory_map_entry_t* entry = &entries[i];
+                if (entry->type != MEMORY_MAP_TYPE_AVAILABLE) continue;
 
-            // Mark multiboot info as used
-            uintptr_t mb_start = mb_info_addr / PAGE_SIZE;
-            uintptr_t mb_end = ALIGN_UP(mb_info_addr + 1024, PAGE_SIZE) / PAGE_SIZE;
+                size_t start_pfn = ALIGN_UP(entry->base_addr, PAGE_SIZE) / PAGE_SIZE;
+                size_t end_pfn = ALIGN_DOWN(entry->base_addr + entry->length, PAGE_SIZE) / PAGE_SIZE;
+                if (start_pfn < reserved_end) start_pfn = reserved_end;
 
-            for (size_t i = mb_start; i < mb_end; i++) {
-                memory_bitmap[i / 8] |= (1 << (i % 8));
-                used_memory_pages++;
+                // Seed around the multiboot info pages
+                if (start_pfn < mb_end && end_pfn > mb_start) {
+                    free_pages += pmm_seed_range(start_pfn, end_pfn, mb_start, mb_end);
+                } else {
+                    free_pages += pmm_seed_range(start_pfn, end_pfn, end_pfn, end_pfn);
+                }
             }
 
+            used_memory_pages = total_memory_pages - free_pages;
+
             KINFO("Memory bitmap at 0x%lx, size %lu KB", memory_bitmap, memory_bitmap_size / 1024);
 
             // Initialize page frame caches after bitmap setup
@@ -190,108 +669,124 @@ static void pmm_parse_memory_map(void)
     PANIC("No memory map found in multiboot information");
 }
 
+// ============================================================================
+// ALLOCATION API
+// ============================================================================
+
 /*
- * Enhanced page allocation with caching and optimization
- * Implements Linux-style page frame caching for better performance
+ * Page allocation on node (NUMA_NO_NODE: wherever the current task's
+ * memory policy says): single pages for the local node come from the CPU's
+ * page list and only touch the buddy allocator on batch refill; everything
+ * else is served by the buddy allocators in O(log n), the nearest node
+ * with memory first. Out of memory, the shrinkers are asked for pages
+ * unless gfp has GFP_NORECLAIM.
  */
-uintptr_t pmm_alloc_pages(size_t num_pages)
+uintptr_t pmm_alloc_pages_gfp(size_t num_pages, int node, gfp_t gfp)
 {
     alloc_requests++;
 
     // Input validation
     if (num_pages == 0) return 0;
-    if (num_pages > 1024) {  // Reasonable upper limit
+    if (num_pages > total_memory_pages) {
         KERROR("PMM: Allocation request too large (%lu pages)", num_pages);
         alloc_failures++;
         return 0;
     }
 
-    // Check memory pressure - if low on memory, avoid caching
-    size_t free_pages = pmm_get_free_pages();
-    bool low_memory = free_pages < LOW_MEMORY_THRESHOLD;
+    if (node < 0 || node >= zone_count) {
+        node = zone_count > 1 ? scheduler_mem_node() : 0;
+    }
 
-    // Try page frame cache first for single page allocations
-    if (num_pages == 1 && !low_memory && pf_cache_hot_count[0] > 0) {
-        // Use cached page if available
-        uint64_t page_addr = pf_cache_hot[0][--pf_cache_hot_count[0]];
-        pf_cache_hot[0][pf_cache_hot_count[0]] = 0;  // Clear used entry
+    if (num_pages == 1) {
+        single_page_allocs++;
+    }
+    uint64_t flags = irq_save();
+    int cpu = scheduler_get_current_cpu();
+    if (num_pages == 1 && numa_node_of_cpu(cpu) == node) {
+        pcp_list_t* pcp = &pcp_lists[cpu];
+        spin_lock(&pcp->lock);
+        bool hit = pcp->count > 0;
+
+        if (pcp->count > 0 || pcp_refill(pcp, node) > 0) {
+            // Cached pages are still marked used in the bitmap
+            uintptr_t page_addr = pcp_pop_hot(pcp);
+            page_array[page_addr / PAGE_SIZE].refcount = 1;
+            if (hit) pcp->hits++;
+            __atomic_fetch_add(&used_memory_pages, 1, __ATOMIC_RELAXED);
+            total_pages_allocated++;
+            spin_unlock_irqrestore(&pcp->lock, flags);
+
+            TRACE(TRACE_PMM_ALLOC, page_addr, num_pages);
+            return page_addr;
+        }
+        spin_unlock(&pcp->lock);
+    }
+    irq_restore(flags);
 
-        // Mark page as used in bitmap
-        size_t page_idx = page_addr / PAGE_SIZE;
-        memory_bitmap[page_idx / 8] |= (1 << (page_idx % 8));
-        used_memory_pages++;
-        total_pages_allocated++;
+    size_t pfn;
+    bool ok = pmm_zone_alloc(num_pages, node, &pfn);
 
-        KDEBUG("PMM: Allocated %lu page(s) from cache (hot): 0x%lx", num_pages, page_addr);
-        return page_addr;
-    }
+    if (!ok) {
+        // Pages parked on per-CPU lists or pre-zeroed may be what blocks coalescing
+        pmm_drain_cpu_caches();
+        pmm_drain_zero_pool();
+        ok = pmm_zone_alloc(num_pages, node, &pfn);
 
-    // Standard bitmap-based allocation using first-fit strategy
-    size_t consecutive_free = 0;
-    size_t start_page = 0;
-    size_t best_start = 0;
-    size_t best_size = (size_t)-1;  // Best size is smallest block that fits
+        // The heap allocates its slabs with heap_lock held: everything below
+        // either frees heap memory or needs the heap
+        bool reclaim = !(gfp & GFP_NORECLAIM);
 
-    // Find the best-fit block
-    for (size_t i = 0; i < total_memory_pages; i++) {
-        if (!(memory_bitmap[i / 8] & (1 << (i % 8)))) {
-            // Page is free
-            consecutive_free++;
-            if (consecutive_free == 1) {
-                start_page = i;
-            }
-            if (consecutive_free == num_pages) {
-                // Found adequate block - check if better than current best
-                if (best_size > consecutive_free || best_start == 0) {
-                    best_start = start_page;
-                    best_size = consecutive_free;
-                }
-                // Continue searching for better fits
-                consecutive_free = 0;  // Reset for next search
-            }
-        } else {
-            consecutive_free = 0;
+        // Still short: ask the kernel heap to give back pooled slabs
+        if (!ok && reclaim && kheap_shrink() > 0) {
+            pmm_drain_cpu_caches();
+            ok = pmm_zone_alloc(num_pages, node, &pfn);
         }
-    }
 
-    if (best_start == 0) {
-        KERROR("PMM: Out of memory, requested %lu pages", num_pages);
-        alloc_failures++;
-        return 0; // Out of memory
-    }
+        // Unused dentries and inodes pin heap slabs. The shrinkers only
+        // unlink them here; the rcu task frees them, so the slabs come
+        // back for later allocations rather than this one.
+        if (!ok && reclaim) {
+            dcache_shrink(num_pages * 64);
+            icache_shrink(num_pages * 16);
+        }
+
+        // Clean page cache frames are released at once, enough for the
+        // request to coalesce
+        if (!ok && reclaim && page_cache_shrink(num_pages * 2) > 0) {
+            pmm_drain_cpu_caches();
+            ok = pmm_zone_alloc(num_pages, node, &pfn);
+        }
 
-    // Mark pages as used in bitmap
-    for (size_t j = 0; j < num_pages; j++) {
-        size_t page = best_start + j;
-        memory_bitmap[page / 8] |= (1 << (page % 8));
+        if (!ok) {
+            KERROR("PMM: Out of memory, requested %lu pages", num_pages);
+            alloc_failures++;
+            return 0; // Out of memory
+        }
     }
 
-    used_memory_pages += num_pages;
+    __atomic_fetch_add(&used_memory_pages, num_pages, __ATOMIC_RELAXED);
     total_pages_allocated += num_pages;
 
-    uintptr_t allocated_addr = best_start * PAGE_SIZE;
-
-    // Add neighboring free pages to hot cache (buddy-style)
-    if (!low_memory && num_pages == 1) {
-        // Look for highest-indexed free page after allocation for LIFO behavior
-        for (size_t i = total_memory_pages - 1; i > best_start + num_pages; i--) {
-            if (!(memory_bitmap[i / 8] & (1 << (i % 8)))) {
-                // Cache in hot list if room
-                if (pf_cache_hot_count[0] < PAGE_CACHE_SIZE) {
-                    pf_cache_hot[0][pf_cache_hot_count[0]++] = i * PAGE_SIZE;
-                }
-                break;  // Just cache one for now
-            }
-        }
-    }
+    uintptr_t allocated_addr = pfn * PAGE_SIZE;
+    page_array[pfn].refcount = 1;  // A multi-page block is counted on its head
 
-    KDEBUG("PMM: Allocated %lu page(s) from bitmap: 0x%lx", num_pages, allocated_addr);
+    TRACE(TRACE_PMM_ALLOC, allocated_addr, num_pages);
     return allocated_addr;
 }
 
+uintptr_t pmm_alloc_pages_node(size_t num_pages, int node)
+{
+    return pmm_alloc_pages_gfp(num_pages, node, GFP_KERNEL);
+}
+
+uintptr_t pmm_alloc_pages(size_t num_pages)
+{
+    return pmm_alloc_pages_node(num_pages, NUMA_NO_NODE);
+}
+
 /*
- * Enhanced page deallocation with intelligent caching
- * Implements page frame caching similar to Linux
+ * Page deallocation with hot caching for single pages and buddy
+ * coalescing for everything else
  */
 void pmm_free_pages(uintptr_t addr, size_t num_pages)
 {
@@ -299,50 +794,258 @@ void pmm_free_pages(uintptr_t addr, size_t num_pages)
 
     // Input validation
     size_t start_page = addr / PAGE_SIZE;
-    if (start_page >= total_memory_pages) {
+    if (start_page >= total_memory_pages || num_pages > total_memory_pages - start_page) {
         KWARN("PMM: Free request for invalid address: 0x%lx", addr);
         return;
     }
 
-    // Check if pages are actually allocated
-    bool all_allocated = true;
-    for (size_t i = 0; i < num_pages && all_allocated; i++) {
-        size_t page = start_page + i;
-        if (!(memory_bitmap[page / 8] & (1 << (page % 8)))) {
-            all_allocated = false;
+    // Check if pages are actually allocated: pages on a per-CPU list are
+    // free although their bitmap bits stay set
+    for (size_t i = 0; i < num_pages; i++) {
+        if (!pmm_page_used(start_page + i)) {
+            KERROR("PMM: Double-free detected at 0x%lx - pages not marked as allocated", addr);
+            return;
+        }
+        if (page_array[start_page + i].flags & PAGE_PCP) {
+            KERROR("PMM: Double-free detected at 0x%lx - page already on a per-CPU list",
+                   (start_page + i) * PAGE_SIZE);
+            return;
         }
     }
 
-    if (!all_allocated) {
-        KWARN("PMM: Double-free detected at 0x%lx - pages not marked as allocated", addr);
-        return;
-    }
+    page_array[start_page].refcount = 0;
 
-    // Single page allocation - consider caching
+    // Single pages go to the hot end of the local CPU's list, if they are
+    // of its node; others go home to their zone
     if (num_pages == 1) {
-        // Check memory pressure for caching decisions
-        size_t free_pages = pmm_get_free_pages();
-        bool should_cache = free_pages > (LOW_MEMORY_THRESHOLD * 2);
-
-        if (should_cache && pf_cache_hot_count[0] < PAGE_CACHE_SIZE) {
-            // Add to hot cache for quick reuse (LIFO)
-            pf_cache_hot[0][pf_cache_hot_count[0]++] = addr;
+        // Under memory pressure, give pages straight back so they can coalesce
+        bool should_cache = pmm_get_free_pages() > LOW_MEMORY_THRESHOLD;
+
+        uint64_t flags = irq_save();
+        int cpu = scheduler_get_current_cpu();
+        if (should_cache && (zone_count == 1 ||
+                             pmm_zone_of(start_page)->node == (uint32_t)numa_node_of_cpu(cpu))) {
+            pcp_list_t* pcp = &pcp_lists[cpu];
+            spin_lock(&pcp->lock);
+
+            // Bitmap bit stays set while the page sits on the list
+            pcp_push_hot(pcp, addr);
+            if (pcp->count > PCP_HIGH) {
+                pcp_drain(pcp, PCP_BATCH);
+            }
+            __atomic_fetch_sub(&used_memory_pages, 1, __ATOMIC_RELAXED);
             total_pages_freed++;
-            KDEBUG("PMM: Cached %lu page(s) in hot cache: 0x%lx", num_pages, addr);
+            spin_unlock_irqrestore(&pcp->lock, flags);
+
+            TRACE(TRACE_PMM_FREE, addr, num_pages);
             return;
         }
+        irq_restore(flags);
     }
 
-    // Standard bitmap deallocation
-    for (size_t i = 0; i < num_pages; i++) {
-        size_t page = start_page + i;
-        memory_bitmap[page / 8] &= ~(1 << (page % 8));
+    // A range freed piecemeal may cross nodes: each run goes to its zone
+    for (size_t pfn = start_page, end = start_page + num_pages; pfn < end; ) {
+        size_t run_end;
+        pmm_zone_t* z = &zones[numa_node_of_pfn(pfn, &run_end)];
+        if (run_end > end) run_end = end;
+        uint64_t flags = spin_lock_irqsave(&z->lock);
+        buddy_free_range(z, pfn, run_end - pfn);
+        spin_unlock_irqrestore(&z->lock, flags);
+        pfn = run_end;
     }
 
-    used_memory_pages -= num_pages;
+    __atomic_fetch_sub(&used_memory_pages, num_pages, __ATOMIC_RELAXED);
     total_pages_freed += num_pages;
 
-    KDEBUG("PMM: Freed %lu page(s) at 0x%lx", num_pages, addr);
+    TRACE(TRACE_PMM_FREE, addr, num_pages);
+}
+
+// ============================================================================
+// PRE-ZEROED PAGE POOL
+// ============================================================================
+
+// Non-temporal stores: a page zeroed ahead of time would only evict useful
+// lines if it went through the cache
+static void pmm_zero_page_nt(uintptr_t page)
+{
+    memzero_nt((void*)page, PAGE_SIZE);  // Fenced: visible before the page is handed out
+}
+
+// Give every pooled page back to the allocator (memory pressure)
+static size_t pmm_drain_zero_pool(void)
+{
+    size_t drained = 0;
+    for (int node = 0; node < zone_count; node++) {
+        for (;;) {
+            uint64_t flags = spin_lock_irqsave(&zero_pools[node].lock);
+            uintptr_t page = zero_pools[node].count ?
+                             zero_pools[node].pages[--zero_pools[node].count] : 0;
+            spin_unlock_irqrestore(&zero_pools[node].lock, flags);
+            if (!page) break;
+            pmm_free_pages(page, 1);
+            drained++;
+        }
+    }
+    return drained;
+}
+
+// Zeroed single page on the policy node: from its pool if it has one, else
+// zeroed here
+uintptr_t pmm_alloc_zeroed_page(void)
+{
+    int node = zone_count > 1 ? scheduler_mem_node() : 0;
+    uint64_t flags = spin_lock_irqsave(&zero_pools[node].lock);
+    uintptr_t page = zero_pools[node].count ? zero_pools[node].pages[--zero_pools[node].count] : 0;
+    bool refill = zero_worker_running && zero_pools[node].count < ZERO_POOL_LOW;
+    if (page) zero_pools[node].hits++;
+    else zero_pools[node].misses++;
+    spin_unlock_irqrestore(&zero_pools[node].lock, flags);
+    
+    if (refill) {
+        wake_up(&zero_pool_wq);
+    }
+    if (page) {
+        return page;
+    }
+    
+    page = pmm_alloc_pages_node(1, node);
+    if (page) {
+        memset((void*)page, 0, PAGE_SIZE);
+    }
+    return page;
+}
+
+// First node whose pool is running low, or -1
+static int pmm_zero_pool_low(void)
+{
+    for (int node = 0; node < zone_count; node++) {
+        if (__atomic_load_n(&zero_pools[node].count, __ATOMIC_RELAXED) < ZERO_POOL_LOW) {
+            return node;
+        }
+    }
+    return -1;
+}
+
+// Refills the pools whenever one runs low, leaving memory alone when it is short
+static void pmm_zero_worker(void* arg)
+{
+    (void)arg;
+    
+    for (;;) {
+        wait_entry_t wait;
+        for (;;) {
+            wait_prepare(&zero_pool_wq, &wait);
+            if (pmm_zero_pool_low() >= 0) break;
+            wait_schedule(&wait, WAIT_FOREVER);
+        }
+        wait_finish(&wait);
+        
+        for (int node = 0; node < zone_count; node++) {
+            while (__atomic_load_n(&zero_pools[node].count, __ATOMIC_RELAXED) < ZERO_POOL_CAPACITY) {
+                if (pmm_get_free_pages() <= LOW_MEMORY_THRESHOLD) {
+                    scheduler_sleep_us(100000);  // Don't hold pages others need
+                    break;
+                }
+                uintptr_t page = pmm_alloc_pages_node(1, node);
+                if (!page) break;
+                if (pmm_zone_of(page / PAGE_SIZE)->node != (uint32_t)node) {
+                    // The node is out of memory: wait before trying it again
+                    pmm_free_pages(page, 1);
+                    scheduler_sleep_us(100000);
+                    break;
+                }
+                pmm_zero_page_nt(page);
+                
+                uint64_t flags = spin_lock_irqsave(&zero_pools[node].lock);
+                bool kept = zero_pools[node].count < ZERO_POOL_CAPACITY;
+                if (kept) zero_pools[node].pages[zero_pools[node].count++] = page;
+                spin_unlock_irqrestore(&zero_pools[node].lock, flags);
+                if (!kept) {
+                    pmm_free_pages(page, 1);
+                }
+            }
+        }
+    }
+}
+
+void pmm_get_zero_pool_stats(size_t* pooled, size_t* hits, size_t* misses)
+{
+    *pooled = *hits = *misses = 0;
+    for (int node = 0; node < zone_count; node++) {
+        *pooled += zero_pools[node].count;
+        *hits += zero_pools[node].hits;
+        *misses += zero_pools[node].misses;
+    }
+}
+
+// Start the zeroing task (needs the scheduler)
+void pmm_zero_pool_init(void)
+{
+    if (scheduler_create_task(pmm_zero_worker, NULL, 8192, ZERO_WORKER_PRIORITY,
+                              "pagezero") < 0) {
+        KWARN("PMM: No page zeroing task, zeroed pages are cleared on demand");
+        return;
+    }
+    zero_worker_running = true;
+    KINFO("PMM: Pre-zeroed page pool of %d pages", ZERO_POOL_CAPACITY);
+}
+
+// ============================================================================
+// PAGE REFERENCE COUNTS
+// ============================================================================
+
+// Descriptor of the frame at addr, or NULL outside managed memory
+page_t* pmm_page(uintptr_t addr)
+{
+    size_t pfn = addr / PAGE_SIZE;
+    if (!page_array || pfn >= total_memory_pages) return NULL;
+    return &page_array[pfn];
+}
+
+// Take another reference on an allocated block (addr is its first frame)
+void pmm_page_ref(uintptr_t addr)
+{
+    page_t* page = pmm_page(addr);
+    if (page) {
+        __atomic_fetch_add(&page->refcount, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Drop a reference; the block is freed with the last one. Returns the count left.
+uint32_t pmm_page_unref(uintptr_t addr, size_t num_pages)
+{
+    page_t* page = pmm_page(addr);
+    if (!page || page->refcount == 0) {
+        KWARN("PMM: Reference drop on unowned frame 0x%lx", addr);
+        return 0;
+    }
+
+    uint32_t left = __atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL);
+    if (left == 0) {
+        pmm_free_pages(addr, num_pages);
+    }
+    return left;
+}
+
+uint32_t pmm_page_refcount(uintptr_t addr)
+{
+    page_t* page = pmm_page(addr);
+    return page ? __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) : 0;
+}
+
+// Turn a block with a single owner into num_pages frames counted (and
+// later freed) one by one, as when a 2MB mapping is split into 4KB pages
+void pmm_split_pages(uintptr_t addr, size_t num_pages)
+{
+    page_t* page = pmm_page(addr);
+    if (!page || page->refcount != 1) {
+        KWARN("PMM: Split of a shared or unowned block at 0x%lx", addr);
+        return;
+    }
+
+    for (size_t i = 1; i < num_pages; i++) {
+        page[i].refcount = 1;
+    }
 }
 
 /*
@@ -354,28 +1057,45 @@ void pmm_get_stats(size_t* requests, size_t* failures, size_t* cache_hit_rate,
     *requests = alloc_requests;
     *failures = alloc_failures;
 
-    // Calculate cache hit ratio (simplified)
-    size_t total_single_allocs = 0;  // Would need per-size tracking
-    *cache_hit_rate = total_single_allocs > 0 ?
-                     (pf_cache_hot_count[0] * 100) / total_single_allocs : 0;
-
-    // Simple fragmentation calculation - ratio of free pages to largest free block
-    size_t max_consecutive_free = 0;
-    size_t current_free = 0;
-    for (size_t i = 0; i < total_memory_pages; i++) {
-        if (!(memory_bitmap[i / 8] & (1 << (i % 8)))) {
-            current_free++;
-            if (current_free > max_consecutive_free) {
-                max_consecutive_free = current_free;
+    // Per-CPU list hit ratio for single-page allocations
+    size_t pcp_hits = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pcp_hits += pcp_lists[cpu].hits;
+    }
+    *cache_hit_rate = single_page_allocs > 0 ?
+                     (pcp_hits * 100) / single_page_allocs : 0;
+
+    // Fragmentation - share of free memory outside the largest free block
+    size_t max_block_free = 0;
+    for (int node = 0; node < zone_count; node++) {
+        for (int order = BUDDY_MAX_ORDER; order >= 0; order--) {
+            if (zones[node].free_blocks[order] > 0) {
+                if (((size_t)1 << order) > max_block_free) {
+                    max_block_free = (size_t)1 << order;
+                }
+                break;
             }
-        } else {
-            current_free = 0;
         }
     }
 
     size_t total_free = pmm_get_free_pages();
-    *fragmentation_ratio = total_free > 0 ?
-                          ((total_free - max_consecutive_free) * 100) / total_free : 0;
+    *fragmentation_ratio = total_free > max_block_free ?
+                          ((total_free - max_block_free) * 100) / total_free : 0;
+}
+
+// One node's zone: free pages (buddy lists only), and its buddy allocations
+// made for the node itself and as another node's fallback. False past the
+// last node.
+bool pmm_get_node_stats(int node, size_t* free_pages, size_t* local, size_t* fallback)
+{
+    if (node < 0 || node >= zone_count) return false;
+    pmm_zone_t* z = &zones[node];
+    uint64_t flags = spin_lock_irqsave(&z->lock);
+    *free_pages = pmm_zone_free_pages(z);
+    spin_unlock_irqrestore(&z->lock, flags);
+    *local = z->local_allocs;
+    *fallback = z->fallback_allocs;
+    return true;
 }
 
 // Get total memory in pages
@@ -396,3 +1116,8 @@ uintptr_t pmm_alloc_page(void)
     return pmm_alloc_pages(1);
 }
 
+// Free a single page (wrapper for pmm_free_pages)
+void pmm_free_page(void* page)
+{
+    pmm_free_pages((uintptr_t)page, 1);
+}
@@ -8,15 +8,22 @@
  * - CLOCK page replacement algorithm
  * - Anonymous memory mappings
  * - Shared memory regions
+ * - Transparent 2MB pages for large anonymous mappings
+ * - Fault-around (tunable per VMA with madvise) and batched TLB shootdown
+ * - File pages mapped straight from the page cache, stacks grown on demand
  */
 
 #include "kernel.h"
+#include "cpu.h"
+#include "smp.h"
+#include "vmm.h"
+#include "page_cache.h"
+#include "sync.h"
 
 // ============================================================================
 // CONFIGURATION
 // ============================================================================
 
-#define MAX_VMA_PER_PROCESS 256   // Max virtual memory areas per process
 #define PAGE_TABLE_LEVELS 4        // x86-64 has 4-level paging
 
 // Page fault error codes
@@ -38,6 +45,31 @@
 #define MAP_ANONYMOUS 0x20    // Not backed by file
 #define MAP_FIXED     0x10    // Fixed address
 
+// Internal VMA flags (above the MAP_* bits)
+#define VMA_HUGEPAGE  0x10000 // Anonymous and 2MB aligned: fault in 2MB pages
+#define VMA_GROWSDOWN 0x20000 // Stack: a fault just below extends it
+
+#define HUGE_PAGE_PAGES (PAGE_SIZE_2M / PAGE_SIZE)
+
+// Fault-around: pages mapped after the faulting one on a minor fault
+#define FAULT_AROUND_DEFAULT  8
+#define FAULT_AROUND_MAX      32
+
+// TLB gather
+#define TLB_GATHER_FREE_MAX   32  // Freed frames held back until the flush
+#define TLB_FLUSH_CEILING     32  // Beyond this many pages, flush the whole PCID
+
+// Raw page table entry bits, for walks that copy whole tables
+#define PTE_PRESENT   0x001ULL
+#define PTE_WRITE     0x002ULL
+#define PTE_USER      0x004ULL
+#define PTE_HUGE      0x080ULL
+#define PTE_COW       0x200ULL    // pte_t.cow
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+#define USER_PML4_ENTRIES 256     // Lower half; the upper half is shared by all contexts
+                                  // (as are kernel tables below it: no user bit)
+
 // ============================================================================
 // DATA STRUCTURES
 // ============================================================================
@@ -50,13 +82,24 @@ typedef struct vma {
     uint32_t flags;               // Mapping flags (MAP_*)
     
     // File backing (for file-backed mappings)
-    void* file;                   // File pointer (NULL for anonymous)
-    uint64_t offset;              // Offset in file
+    struct inode* file;           // Referenced inode (NULL for anonymous)
+    uint64_t offset;              // Offset in file (page aligned)
+    uint64_t file_size;           // File bytes mapped from offset; zeroes past them
+    
+    uintptr_t grow_limit;         // Lowest start a VMA_GROWSDOWN stack may reach
     
     // COW support
     uint32_t ref_count;           // Reference count for shared pages
     
-    struct vma* next;             // Linked list
+    uint32_t fault_around;        // Extra pages mapped per minor fault
+    
+    // AVL tree keyed by start (VMAs never overlap), for O(log n) lookup
+    struct vma* left;
+    struct vma* right;
+    int height;
+    
+    struct vma* prev;             // Address-ordered list, for range walks
+    struct vma* next;
 } vma_t;
 
 // Process virtual memory context (defined in kernel.h)
@@ -73,12 +116,30 @@ typedef struct {
     uint64_t dirty      : 1;   // Dirty flag
     uint64_t huge       : 1;   // Huge page (2MB/1GB)
     uint64_t global     : 1;   // Global page
-    uint64_t available  : 3;   // Available for OS use
+    uint64_t cow        : 1;   // Write-protected by fork, copy on write
+    uint64_t available  : 2;   // Available for OS use
     uint64_t address    : 40;  // Physical page frame number
     uint64_t available2 : 11;  // Available for OS use
     uint64_t no_execute : 1;   // No execute
 } __attribute__((packed)) pte_t;
 
+/*
+ * Pending invalidations for one address space. Unmapped frames are only
+ * freed after every CPU that may still cache them has flushed, and the
+ * whole range costs one local flush plus one IPI per remote CPU.
+ */
+typedef struct tlb_gather {
+    vm_context_t* ctx;
+    uintptr_t start;              // Invalidated range [start, end)
+    uintptr_t end;
+    size_t pages;
+    struct {
+        uintptr_t phys;
+        size_t pages;
+    } freed[TLB_GATHER_FREE_MAX];
+    size_t freed_count;
+} tlb_gather_t;
+
 // Page replacement - CLOCK algorithm state
 typedef struct {
     uintptr_t* page_list;      // Circular list of pages
@@ -93,25 +154,48 @@ typedef struct {
 
 static clock_state_t page_clock;
 static vm_context_t kernel_vm_context;  // Kernel's own VM context
+static uint32_t next_pcid = 1;          // PCID 0 is the boot / untagged CR3
 
 // Statistics
 static size_t page_faults_total = 0;
 static size_t page_faults_major = 0;  // Required disk I/O
 static size_t page_faults_minor = 0;  // Already in memory
 static size_t cow_faults = 0;
+static size_t cow_reuses = 0;         // COW faults on a sole owner, no copy
+static size_t forks = 0;
+static size_t fork_shared_pages = 0;  // Pages write-protected by fork
+static size_t huge_faults = 0;        // Faults served with a 2MB page
+static size_t huge_fallbacks = 0;     // Huge-eligible faults that got 4KB
+static size_t fault_around_pages = 0; // Pages mapped ahead of a fault
+static size_t file_faults = 0;        // Faults served from the page cache
+static size_t file_shared_pages = 0;  // ... by mapping the cache's own frame
+static size_t stack_grows = 0;        // Faults that extended a stack VMA
+static size_t tlb_shootdowns = 0;     // Gathered flushes
+static size_t tlb_ipis = 0;           // Shootdown IPIs sent
+static size_t tlb_full_flushes = 0;   // Range too large, whole PCID flushed
+
+// Shootdown request, owned by whoever holds tlb_shootdown_lock
+static spinlock_t tlb_shootdown_lock;
+static struct {
+    uint64_t* page_dir;
+    uintptr_t start;
+    uintptr_t end;
+    bool full;
+} tlb_request;
+static volatile uint32_t tlb_pending;       // CPUs yet to run tlb_request
+static vm_context_t* loaded_ctx[MAX_CPUS];  // Context each CPU last loaded
 
 // ============================================================================
 // PAGE TABLE MANAGEMENT
 // ============================================================================
 
-// Get page table entry for virtual address
-static pte_t* vmm_get_pte(uint64_t* page_dir, uintptr_t vaddr, bool create)
+// Get the page directory entry (2MB level) for a virtual address
+static uint64_t* vmm_get_pde(uint64_t* page_dir, uintptr_t vaddr, bool create)
 {
     // Extract indices for 4-level paging
     uint64_t pml4_idx = (vaddr >> 39) & 0x1FF;
     uint64_t pdp_idx  = (vaddr >> 30) & 0x1FF;
     uint64_t pd_idx   = (vaddr >> 21) & 0x1FF;
-    uint64_t pt_idx   = (vaddr >> 12) & 0x1FF;
     
     // Navigate through page tables, creating if needed
     uint64_t* pml4 = page_dir;
@@ -119,36 +203,57 @@ static pte_t* vmm_get_pte(uint64_t* page_dir, uintptr_t vaddr, bool create)
     // PML4 -> PDP
     if (!(pml4[pml4_idx] & 0x1)) {
         if (!create) return NULL;
-        uintptr_t pdp = pmm_alloc_pages(1);
+        uintptr_t pdp = pmm_alloc_zeroed_page();
         if (!pdp) return NULL;
-        memset((void*)pdp, 0, PAGE_SIZE);
-        pml4[pml4_idx] = pdp | 0x3;  // Present + Writable
+        pml4[pml4_idx] = pdp | 0x7;  // Present + Writable + User; leaves decide
     }
     uint64_t* pdp = (uint64_t*)(pml4[pml4_idx] & ~0xFFF);
     
     // PDP -> PD
     if (!(pdp[pdp_idx] & 0x1)) {
         if (!create) return NULL;
-        uintptr_t pd = pmm_alloc_pages(1);
+        uintptr_t pd = pmm_alloc_zeroed_page();
         if (!pd) return NULL;
-        memset((void*)pd, 0, PAGE_SIZE);
-        pdp[pdp_idx] = pd | 0x3;
+        pdp[pdp_idx] = pd | 0x7;
     }
+    if (pdp[pdp_idx] & 0x80) return NULL;  // 1GB page of the kernel direct map
     uint64_t* pd = (uint64_t*)(pdp[pdp_idx] & ~0xFFF);
     
+    return &pd[pd_idx];
+}
+
+// Get page table entry for virtual address; for a 2MB page this is the
+// PD entry itself (pte->huge set)
+static pte_t* vmm_get_pte(uint64_t* page_dir, uintptr_t vaddr, bool create)
+{
+    uint64_t pt_idx = (vaddr >> 12) & 0x1FF;
+    
+    uint64_t* pd_entry = vmm_get_pde(page_dir, vaddr, create);
+    if (!pd_entry) return NULL;
+    if ((*pd_entry & 0x1) && (*pd_entry & 0x80)) return (pte_t*)pd_entry;
+    
     // PD -> PT
-    if (!(pd[pd_idx] & 0x1)) {
+    if (!(*pd_entry & 0x1)) {
         if (!create) return NULL;
-        uintptr_t pt = pmm_alloc_pages(1);
+        uintptr_t pt = pmm_alloc_zeroed_page();
         if (!pt) return NULL;
-        memset((void*)pt, 0, PAGE_SIZE);
-        pd[pd_idx] = pt | 0x3;
+        *pd_entry = pt | 0x7;
     }
-    uint64_t* pt = (uint64_t*)(pd[pd_idx] & ~0xFFF);
+    uint64_t* pt = (uint64_t*)(*pd_entry & ~0xFFF);
     
     return (pte_t*)&pt[pt_idx];
 }
 
+// Fill a not-present PTE (no flush: the TLB never caches not-present entries)
+static inline void vmm_set_pte(pte_t* pte, uintptr_t paddr, uint32_t prot)
+{
+    pte->writable = (prot & PROT_WRITE) ? 1 : 0;
+    pte->user = 1;  // Assuming user pages
+    pte->no_execute = (prot & PROT_EXEC) ? 0 : 1;
+    pte->address = paddr >> 12;  // Physical page frame number
+    pte->present = 1;
+}
+
 // Map a virtual page to a physical page
 static int vmm_map_page_ctx(uint64_t* page_dir, uintptr_t vaddr, uintptr_t paddr, uint32_t prot)
 {
@@ -157,30 +262,222 @@ static int vmm_map_page_ctx(uint64_t* page_dir, uintptr_t vaddr, uintptr_t paddr
         return -1;
     }
     
-    // Set page table entry
-    pte->present = 1;
-    pte->writable = (prot & PROT_WRITE) ? 1 : 0;
-    pte->user = 1;  // Assuming user pages
-    pte->no_execute = (prot & PROT_EXEC) ? 0 : 1;
-    pte->address = paddr >> 12;  // Physical page frame number
+    vmm_set_pte(pte, paddr, prot);
+    return 0;
+}
+
+// Map a 2MB page at a 2MB-aligned address with no page table below it yet
+static int vmm_map_huge_ctx(uint64_t* page_dir, uintptr_t vaddr, uintptr_t paddr, uint32_t prot)
+{
+    pte_t* pde = (pte_t*)vmm_get_pde(page_dir, vaddr, true);
+    if (!pde || pde->present) {
+        return -1;
+    }
     
-    // Flush TLB for this address
-    __asm__ volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
+    pde->writable = (prot & PROT_WRITE) ? 1 : 0;
+    pde->user = 1;
+    pde->no_execute = (prot & PROT_EXEC) ? 0 : 1;
+    pde->huge = 1;
+    pde->address = paddr >> 12;
+    pde->present = 1;
     
     return 0;
 }
 
-// Unmap a virtual page
-static void vmm_unmap_page_ctx(uint64_t* page_dir, uintptr_t vaddr)
+static void tlb_gather_add(tlb_gather_t* tlb, uintptr_t vaddr, size_t size);
+static void tlb_gather_free(tlb_gather_t* tlb, uintptr_t phys, size_t pages);
+
+// Unmap a virtual page into tlb; returns the bytes covered (PAGE_SIZE_2M for a huge page)
+static size_t vmm_unmap_page_ctx(uint64_t* page_dir, uintptr_t vaddr, tlb_gather_t* tlb)
 {
     pte_t* pte = vmm_get_pte(page_dir, vaddr, false);
     if (pte && pte->present) {
+        size_t pages = pte->huge ? HUGE_PAGE_PAGES : 1;
         uintptr_t paddr = (uintptr_t)pte->address << 12;
-        pmm_free_pages(paddr, 1);
         
         memset(pte, 0, sizeof(pte_t));
-        __asm__ volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
+        tlb_gather_add(tlb, vaddr, pages * PAGE_SIZE);
+        tlb_gather_free(tlb, paddr, pages);
+        return pages * PAGE_SIZE;
     }
+    return PAGE_SIZE;
+}
+
+// ============================================================================
+// ADDRESS SPACE SWITCHING (PCID)
+// ============================================================================
+
+static inline bool vmm_context_is_loaded(vm_context_t* ctx)
+{
+    return (read_cr3() & ~(CR3_NOFLUSH | CR3_PCID_MASK)) == (uintptr_t)ctx->page_dir;
+}
+
+// invlpg only reaches the executing CPU, and only the PCID it has loaded.
+// Every other CPU must drop its tagged entries for ctx on its next switch.
+static void vmm_tlb_invalidate_others(vm_context_t* ctx)
+{
+    uint32_t stale = 0xFFFFFFFF;
+    if (vmm_context_is_loaded(ctx)) {
+        stale &= ~(1U << smp_cpu_id());
+    }
+    __atomic_fetch_or(&ctx->tlb_stale, stale, __ATOMIC_RELEASE);
+}
+
+void vmm_switch_context(vm_context_t* ctx)
+{
+    uint64_t cr3 = (uintptr_t)ctx->page_dir;
+    int cpu = smp_cpu_id();
+    
+    // Shootdowns for ctx must reach this CPU from now on
+    if (loaded_ctx[cpu] != ctx) {
+        if (loaded_ctx[cpu]) {
+            __atomic_fetch_and(&loaded_ctx[cpu]->cpu_loaded, ~(1U << cpu), __ATOMIC_RELEASE);
+        }
+        __atomic_fetch_or(&ctx->cpu_loaded, 1U << cpu, __ATOMIC_ACQ_REL);
+        loaded_ctx[cpu] = ctx;
+    }
+    
+    if (cpu_has_pcid()) {
+        if (ctx->pcid == 0) {
+            // Tags are never recycled; once they run out, contexts go untagged
+            uint32_t pcid = __atomic_fetch_add(&next_pcid, 1, __ATOMIC_RELAXED);
+            ctx->pcid = (pcid < PCID_COUNT) ? pcid : PCID_COUNT;
+        }
+        
+        if (ctx->pcid < PCID_COUNT) {
+            uint32_t me = 1U << cpu;
+            cr3 |= ctx->pcid;
+            
+            // Keep this CPU's cached translations unless they went stale
+            if (!(__atomic_fetch_and(&ctx->tlb_stale, ~me, __ATOMIC_ACQUIRE) & me)) {
+                cr3 |= CR3_NOFLUSH;
+            }
+        }
+    }
+    
+    write_cr3(cr3);
+}
+
+// ============================================================================
+// TLB GATHER AND SHOOTDOWN
+// ============================================================================
+
+static void tlb_gather_init(tlb_gather_t* tlb, vm_context_t* ctx)
+{
+    tlb->ctx = ctx;
+    tlb->start = UINTPTR_MAX;
+    tlb->end = 0;
+    tlb->pages = 0;
+    tlb->freed_count = 0;
+}
+
+// Drop [start, end) from this CPU's TLB if page_dir is the loaded one
+static void tlb_flush_local(uint64_t* page_dir, uintptr_t start, uintptr_t end, bool full)
+{
+    uint64_t cr3 = read_cr3();
+    if ((cr3 & ~(CR3_NOFLUSH | CR3_PCID_MASK)) != (uintptr_t)page_dir) {
+        return;  // Not loaded: the tlb_stale mark covers the next switch-in
+    }
+    
+    if (full) {
+        write_cr3(cr3);  // Same PCID without NOFLUSH drops all its entries
+        return;
+    }
+    for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE) {
+        __asm__ volatile("invlpg (%0)" :: "r"(addr) : "memory");
+    }
+}
+
+// Run the current request if this CPU is one of its targets
+static void tlb_service_pending(void)
+{
+    uint32_t me = 1U << smp_cpu_id();
+    if (__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE) & me) {
+        tlb_flush_local(tlb_request.page_dir, tlb_request.start, tlb_request.end,
+                        tlb_request.full);
+        __atomic_fetch_and(&tlb_pending, ~me, __ATOMIC_RELEASE);
+    }
+}
+
+void vmm_tlb_ipi(void)
+{
+    tlb_service_pending();
+}
+
+// Invalidate everything gathered so far on every CPU, then free the frames
+static void tlb_gather_flush(tlb_gather_t* tlb)
+{
+    if (tlb->pages) {
+        vm_context_t* ctx = tlb->ctx;
+        bool full = tlb->pages > TLB_FLUSH_CEILING;
+        uint64_t flags = irq_save();
+        int cpu = smp_cpu_id();
+        
+        // CPUs that load ctx later drop their tagged entries on the switch
+        vmm_tlb_invalidate_others(ctx);
+        tlb_flush_local(ctx->page_dir, tlb->start, tlb->end, full);
+        
+        uint32_t targets = __atomic_load_n(&ctx->cpu_loaded, __ATOMIC_ACQUIRE) & ~(1U << cpu);
+        if (targets) {
+            // Keep answering other CPUs' requests while waiting for the lock
+            while (!spin_trylock(&tlb_shootdown_lock)) {
+                tlb_service_pending();
+                __asm__ volatile("pause");
+            }
+            
+            tlb_request.page_dir = ctx->page_dir;
+            tlb_request.start = tlb->start;
+            tlb_request.end = tlb->end;
+            tlb_request.full = full;
+            __atomic_store_n(&tlb_pending, targets, __ATOMIC_RELEASE);
+            
+            for (int i = 0; i < MAX_CPUS; i++) {
+                if (!(targets & (1U << i))) continue;
+                percpu_t* pc = smp_get_cpu(i);
+                if (pc && pc->online) {
+                    lapic_send_ipi(pc->apic_id, APIC_TLB_VECTOR);
+                    tlb_ipis++;
+                } else {
+                    __atomic_fetch_and(&tlb_pending, ~(1U << i), __ATOMIC_RELEASE);
+                }
+            }
+            while (__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE)) {
+                __asm__ volatile("pause");
+            }
+            spin_unlock(&tlb_shootdown_lock);
+        }
+        irq_restore(flags);
+        
+        tlb_shootdowns++;
+        if (full) tlb_full_flushes++;
+        tlb->start = UINTPTR_MAX;
+        tlb->end = 0;
+        tlb->pages = 0;
+    }
+    
+    // Frames shared with a forked context stay until its mapping goes too
+    for (size_t i = 0; i < tlb->freed_count; i++) {
+        pmm_page_unref(tlb->freed[i].phys, tlb->freed[i].pages);
+    }
+    tlb->freed_count = 0;
+}
+
+static void tlb_gather_add(tlb_gather_t* tlb, uintptr_t vaddr, size_t size)
+{
+    if (vaddr < tlb->start) tlb->start = vaddr;
+    if (vaddr + size > tlb->end) tlb->end = vaddr + size;
+    tlb->pages += size / PAGE_SIZE;
+}
+
+// Drop frames once no TLB can reach them (flushes early when the batch fills)
+static void tlb_gather_free(tlb_gather_t* tlb, uintptr_t phys, size_t pages)
+{
+    if (tlb->freed_count == TLB_GATHER_FREE_MAX) {
+        tlb_gather_flush(tlb);
+    }
+    tlb->freed[tlb->freed_count].phys = phys;
+    tlb->freed[tlb->freed_count].pages = pages;
+    tlb->freed_count++;
 }
 
 // ============================================================================
@@ -199,72 +496,345 @@ static vma_t* vmm_create_vma(uintptr_t start, uintptr_t end, uint32_t prot, uint
     vma->flags = flags;
     vma->file = NULL;
     vma->offset = 0;
+    vma->file_size = 0;
+    vma->grow_limit = start;
     vma->ref_count = 1;
+    vma->fault_around = FAULT_AROUND_DEFAULT;
+    vma->left = NULL;
+    vma->right = NULL;
+    vma->height = 1;
+    vma->prev = NULL;
     vma->next = NULL;
     
     return vma;
 }
 
-// Find VMA containing address
-static vma_t* vmm_find_vma(vm_context_t* ctx, uintptr_t addr)
+// Free an unlinked VMA and the inode reference it holds
+static void vma_free(vma_t* vma)
 {
-    vma_t* vma = ctx->vma_list;
-    while (vma) {
-        if (addr >= vma->start && addr < vma->end) {
-            return vma;
+    if (vma->file) {
+        iput(vma->file);
+    }
+    kfree_tracked(vma);
+}
+
+static inline int vma_height(vma_t* vma)
+{
+    return vma ? vma->height : 0;
+}
+
+static inline void vma_update_height(vma_t* vma)
+{
+    int l = vma_height(vma->left);
+    int r = vma_height(vma->right);
+    vma->height = 1 + (l > r ? l : r);
+}
+
+static vma_t* vma_rotate_right(vma_t* y)
+{
+    vma_t* x = y->left;
+    y->left = x->right;
+    x->right = y;
+    vma_update_height(y);
+    vma_update_height(x);
+    return x;
+}
+
+static vma_t* vma_rotate_left(vma_t* x)
+{
+    vma_t* y = x->right;
+    x->right = y->left;
+    y->left = x;
+    vma_update_height(x);
+    vma_update_height(y);
+    return y;
+}
+
+// Restore the AVL invariant at node after one of its subtrees changed
+static vma_t* vma_rebalance(vma_t* node)
+{
+    vma_update_height(node);
+    int balance = vma_height(node->left) - vma_height(node->right);
+    
+    if (balance > 1) {
+        if (vma_height(node->left->left) < vma_height(node->left->right)) {
+            node->left = vma_rotate_left(node->left);
+        }
+        return vma_rotate_right(node);
+    }
+    if (balance < -1) {
+        if (vma_height(node->right->right) < vma_height(node->right->left)) {
+            node->right = vma_rotate_right(node->right);
+        }
+        return vma_rotate_left(node);
+    }
+    return node;
+}
+
+static vma_t* vma_tree_insert(vma_t* root, vma_t* vma)
+{
+    if (!root) return vma;
+    
+    if (vma->start < root->start) {
+        root->left = vma_tree_insert(root->left, vma);
+    } else {
+        root->right = vma_tree_insert(root->right, vma);
+    }
+    return vma_rebalance(root);
+}
+
+static vma_t* vma_tree_remove_min(vma_t* root, vma_t** min)
+{
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = vma_tree_remove_min(root->left, min);
+    return vma_rebalance(root);
+}
+
+static vma_t* vma_tree_remove(vma_t* root, vma_t* vma)
+{
+    if (!root) return NULL;
+    
+    if (vma->start < root->start) {
+        root->left = vma_tree_remove(root->left, vma);
+    } else if (vma->start > root->start) {
+        root->right = vma_tree_remove(root->right, vma);
+    } else {
+        // Replace the node with its in-order successor
+        vma_t* left = root->left;
+        vma_t* right = root->right;
+        if (!right) return left;
+        
+        vma_t* successor;
+        right = vma_tree_remove_min(right, &successor);
+        successor->left = left;
+        successor->right = right;
+        return vma_rebalance(successor);
+    }
+    return vma_rebalance(root);
+}
+
+// Last VMA starting at or below addr
+static vma_t* vmm_vma_floor(vm_context_t* ctx, uintptr_t addr)
+{
+    vma_t* node = ctx->vma_tree;
+    vma_t* best = NULL;
+    while (node) {
+        if (addr < node->start) {
+            node = node->left;
+        } else {
+            best = node;
+            node = node->right;
         }
-        vma = vma->next;
+    }
+    return best;
+}
+
+// Find VMA containing address (last hit first: faults cluster in one region)
+static vma_t* vmm_find_vma(vm_context_t* ctx, uintptr_t addr)
+{
+    vma_t* vma = ctx->vma_cache;
+    if (vma && addr >= vma->start && addr < vma->end) {
+        return vma;
+    }
+    
+    vma = vmm_vma_floor(ctx, addr);
+    if (vma && addr < vma->end) {
+        ctx->vma_cache = vma;
+        return vma;
     }
     return NULL;
 }
 
-// Insert VMA into context (sorted by address)
+// First VMA that ends above addr (the one containing it, or the next one)
+static vma_t* vmm_first_vma_from(vm_context_t* ctx, uintptr_t addr)
+{
+    vma_t* vma = vmm_vma_floor(ctx, addr);
+    if (!vma) return ctx->vma_list;
+    return addr < vma->end ? vma : vma->next;
+}
+
+// Insert VMA into context (tree, plus the sorted list through its neighbour)
 static void vmm_insert_vma(vm_context_t* ctx, vma_t* new_vma)
 {
-    if (!ctx->vma_list || new_vma->start < ctx->vma_list->start) {
-        new_vma->next = ctx->vma_list;
+    vma_t* prev = vmm_vma_floor(ctx, new_vma->start);
+    
+    new_vma->prev = prev;
+    new_vma->next = prev ? prev->next : ctx->vma_list;
+    if (new_vma->next) new_vma->next->prev = new_vma;
+    if (prev) {
+        prev->next = new_vma;
+    } else {
         ctx->vma_list = new_vma;
-        return;
     }
     
-    vma_t* current = ctx->vma_list;
-    while (current->next && current->next->start < new_vma->start) {
-        current = current->next;
+    ctx->vma_tree = vma_tree_insert(ctx->vma_tree, new_vma);
+    ctx->vma_count++;
+}
+
+// Unlink VMA from the tree and list (caller frees it)
+static void vmm_remove_vma(vm_context_t* ctx, vma_t* vma)
+{
+    ctx->vma_tree = vma_tree_remove(ctx->vma_tree, vma);
+    
+    if (vma->prev) {
+        vma->prev->next = vma->next;
+    } else {
+        ctx->vma_list = vma->next;
+    }
+    if (vma->next) vma->next->prev = vma->prev;
+    
+    if (ctx->vma_cache == vma) {
+        ctx->vma_cache = NULL;
     }
+    ctx->vma_count--;
+}
+
+// Cut vma at addr (page aligned, strictly inside it): vma keeps
+// [start, addr) and a new VMA takes [addr, end). NULL when out of memory.
+static vma_t* vma_split(vm_context_t* ctx, vma_t* vma, uintptr_t addr)
+{
+    // A stack grows at its low end, so only the lower part keeps growing
+    vma_t* upper = vmm_create_vma(addr, vma->end, vma->prot, vma->flags & ~VMA_GROWSDOWN);
+    if (!upper) return NULL;
+    
+    uint64_t delta = addr - vma->start;
+    if (vma->file) {
+        upper->file = igrab(vma->file);
+        upper->offset = vma->offset + delta;
+        upper->file_size = vma->file_size > delta ? vma->file_size - delta : 0;
+    }
+    upper->fault_around = vma->fault_around;
     
-    new_vma->next = current->next;
-    current->next = new_vma;
+    vma->end = addr;
+    vmm_insert_vma(ctx, upper);
+    return upper;
 }
 
 // ============================================================================
 // MMAP IMPLEMENTATION
 // ============================================================================
 
+int vmm_munmap(vm_context_t* ctx, void* addr, size_t length);
+static void vmm_fault_around(vm_context_t* ctx, vma_t* vma, uintptr_t page_addr);
+vm_context_t* vmm_current_context(void);
+
+/*
+ * Make addr a 4KB boundary in vma's page tables: a 2MB page across it is
+ * remapped as 512 small ones. A sole owner keeps the same frames; a frame
+ * fork still shares is copied, as the first write would have. -1 when out
+ * of memory, with nothing changed.
+ */
+static int vmm_split_huge(vm_context_t* ctx, vma_t* vma, uintptr_t addr, tlb_gather_t* tlb)
+{
+    uintptr_t huge_addr = addr & ~(PAGE_SIZE_2M - 1);
+    if (huge_addr == addr) return 0;
+    
+    pte_t* pde = (pte_t*)vmm_get_pde(ctx->page_dir, huge_addr, false);
+    if (!pde || !pde->present || !pde->huge) return 0;
+    
+    uintptr_t pt_phys = pmm_alloc_zeroed_page();
+    if (!pt_phys) return -1;
+    
+    pte_t* pt = (pte_t*)pt_phys;
+    uintptr_t frame = (uintptr_t)pde->address << 12;
+    bool shared = pmm_page_refcount(frame) > 1;
+    
+    for (size_t i = 0; i < HUGE_PAGE_PAGES; i++) {
+        uintptr_t phys = frame + i * PAGE_SIZE;
+        pt[i] = *pde;
+        pt[i].huge = 0;
+        if (shared) {
+            phys = pmm_alloc_page();
+            if (!phys) {
+                while (i--) pmm_free_pages((uintptr_t)pt[i].address << 12, 1);
+                pmm_free_pages(pt_phys, 1);
+                return -1;
+            }
+            memcpy((void*)phys, (void*)(frame + i * PAGE_SIZE), PAGE_SIZE);
+            pt[i].cow = 0;
+            pt[i].writable = (vma->prot & PROT_WRITE) ? 1 : 0;
+        }
+        pt[i].address = phys >> 12;
+    }
+    
+    if (shared) {
+        tlb_gather_free(tlb, frame, HUGE_PAGE_PAGES);  // This context's reference
+    } else {
+        pmm_split_pages(frame, HUGE_PAGE_PAGES);
+    }
+    *(uint64_t*)pde = pt_phys | 0x7;
+    tlb_gather_add(tlb, huge_addr, PAGE_SIZE_2M);
+    return 0;
+}
+
+// Split the VMAs (and 2MB pages) across start or end, so every VMA that
+// overlaps [start, end) lies inside it. -1 when out of memory; any split
+// already made leaves the address space as it was, just in more pieces.
+static int vmm_split_range(vm_context_t* ctx, uintptr_t start, uintptr_t end, tlb_gather_t* tlb)
+{
+    vma_t* vma = vmm_find_vma(ctx, start);
+    if (vma && vma->start < start) {
+        if (vmm_split_huge(ctx, vma, start, tlb) < 0 || !vma_split(ctx, vma, start)) {
+            return -1;
+        }
+    }
+    
+    vma = vmm_find_vma(ctx, end - 1);
+    if (vma && vma->end > end) {
+        if (vmm_split_huge(ctx, vma, end, tlb) < 0 || !vma_split(ctx, vma, end)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 void* vmm_mmap(vm_context_t* ctx, void* addr, size_t length, 
-               int prot, int flags, void* file, uint64_t offset)
+               int prot, int flags, struct inode* file, uint64_t offset)
 {
     if (length == 0) return NULL;
     
+    // File pages come from the page cache, a whole cached page per user page
+    if (file && (!file->i_mapping || (offset & (PAGE_SIZE - 1)))) {
+        return NULL;
+    }
+    
     // Align length to page size
     length = ALIGN_UP(length, PAGE_SIZE);
     
+    // Large anonymous regions start on a 2MB boundary so they can use huge pages
+    bool huge = (flags & MAP_ANONYMOUS) && length >= PAGE_SIZE_2M;
+    size_t align = huge ? PAGE_SIZE_2M : PAGE_SIZE;
+    
     // Determine address if not specified
     uintptr_t vaddr;
     if (flags & MAP_FIXED) {
         vaddr = (uintptr_t)addr;
+        if ((vaddr & (PAGE_SIZE - 1)) || vaddr < USER_SPACE_START ||
+            vaddr + length > USER_SPACE_END || vaddr + length < vaddr) {
+            return NULL;
+        }
+        
+        // A fixed mapping replaces whatever was in its range (keeps VMAs disjoint)
+        if (vmm_munmap(ctx, addr, length) < 0) return NULL;
     } else {
         // Find free space starting from mmap_base
-        vaddr = ctx->mmap_base;
+        vaddr = ALIGN_UP(ctx->mmap_base, align);
         
-        // Simple linear search for free space
-        vma_t* vma = ctx->vma_list;
+        // First-fit over the gaps after mmap_base
+        vma_t* vma = vmm_first_vma_from(ctx, vaddr);
         while (vma) {
             if (vaddr + length <= vma->start) {
                 break;  // Found space
             }
-            vaddr = ALIGN_UP(vma->end, PAGE_SIZE);
+            if (vma->end > vaddr) {
+                vaddr = ALIGN_UP(vma->end, align);
+            }
             vma = vma->next;
         }
+        if (vaddr + length > USER_SPACE_END) return NULL;
     }
     
     // Create VMA
@@ -273,48 +843,147 @@ void* vmm_mmap(vm_context_t* ctx, void* addr, size_t length,
         return NULL;
     }
     
-    new_vma->file = file;
-    new_vma->offset = offset;
+    // A MAP_FIXED region only qualifies if it holds at least one aligned 2MB span
+    if (huge && ALIGN_UP(vaddr, PAGE_SIZE_2M) + PAGE_SIZE_2M <= vaddr + length) {
+        new_vma->flags |= VMA_HUGEPAGE;
+    }
+    
+    if (file) {
+        new_vma->file = igrab(file);
+        new_vma->offset = offset;
+        new_vma->file_size = ~0ULL;
+    }
     
     vmm_insert_vma(ctx, new_vma);
     
-    // For anonymous mappings, don't allocate pages yet (demand paging)
-    if (flags & MAP_ANONYMOUS) {
-        // Pages will be allocated on first access
-        KDEBUG("mmap: anonymous mapping at 0x%lx, size %lu", vaddr, length);
-    } else {
-        // For file-backed mappings, would load pages here
+    // Nothing is allocated or read yet: every page comes in on its first fault
+    if (file) {
         KDEBUG("mmap: file-backed mapping at 0x%lx, size %lu", vaddr, length);
+    } else {
+        KDEBUG("mmap: anonymous mapping at 0x%lx, size %lu", vaddr, length);
     }
     
     return (void*)vaddr;
 }
 
+/*
+ * Private, fixed mapping of file_size bytes of inode from offset; the rest
+ * of the range reads as zeroes (an ELF segment's .bss). NULL on failure.
+ */
+void* vmm_map_file(vm_context_t* ctx, void* addr, size_t length, int prot,
+                   struct inode* inode, uint64_t offset, uint64_t file_size)
+{
+    void* vaddr = vmm_mmap(ctx, addr, length, prot, MAP_PRIVATE | MAP_FIXED, inode, offset);
+    if (!vaddr) return NULL;
+    
+    vma_t* vma = vmm_find_vma(ctx, (uintptr_t)vaddr);
+    vma->file_size = file_size;
+    return vaddr;
+}
+
+// Stack ending at top: initial bytes mapped, growing on faults to at most max
+void* vmm_map_stack(vm_context_t* ctx, uintptr_t top, size_t initial, size_t max)
+{
+    initial = ALIGN_UP(initial, PAGE_SIZE);
+    if (initial == 0 || initial > max || (top & (PAGE_SIZE - 1))) return NULL;
+    
+    void* vaddr = vmm_mmap(ctx, (void*)(top - initial), initial, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, NULL, 0);
+    if (!vaddr) return NULL;
+    
+    vma_t* vma = vmm_find_vma(ctx, (uintptr_t)vaddr);
+    vma->flags = (vma->flags & ~VMA_HUGEPAGE) | VMA_GROWSDOWN;
+    vma->grow_limit = top - ALIGN_UP(max, PAGE_SIZE);
+    return vaddr;
+}
+
+// Unmap [addr, addr + length); VMAs partly inside keep the rest
 int vmm_munmap(vm_context_t* ctx, void* addr, size_t length)
 {
     uintptr_t start = (uintptr_t)addr;
     uintptr_t end = start + ALIGN_UP(length, PAGE_SIZE);
+    if ((start & (PAGE_SIZE - 1)) || end <= start) {
+        return -1;
+    }
+    
+    tlb_gather_t tlb;
+    tlb_gather_init(&tlb, ctx);
+    
+    if (vmm_split_range(ctx, start, end, &tlb) < 0) {
+        tlb_gather_flush(&tlb);
+        return -1;
+    }
     
-    vma_t** vma_ptr = &ctx->vma_list;
-    while (*vma_ptr) {
-        vma_t* vma = *vma_ptr;
+    // Every VMA left in the range lies wholly inside it
+    vma_t* vma = vmm_first_vma_from(ctx, start);
+    while (vma && vma->start < end) {
+        vma_t* next = vma->next;
         
-        if (vma->start >= end) break;
+        // Unmap pages in this VMA
+        for (uintptr_t page = vma->start; page < vma->end; ) {
+            page += vmm_unmap_page_ctx(ctx->page_dir, page, &tlb);
+        }
         
-        if (vma->end > start && vma->start < end) {
-            // Unmap pages in this VMA
-            for (uintptr_t page = vma->start; page < vma->end; page += PAGE_SIZE) {
-                vmm_unmap_page_ctx(ctx->page_dir, page);
-            }
-            
-            // Remove VMA
-            *vma_ptr = vma->next;
-            kfree_tracked(vma);
-        } else {
-            vma_ptr = &vma->next;
+        // Remove VMA
+        vmm_remove_vma(ctx, vma);
+        vma_free(vma);
+        vma = next;
+    }
+    
+    // One flush (and at most one IPI per CPU) for the whole range
+    tlb_gather_flush(&tlb);
+    
+    return 0;
+}
+
+// Map frames someone else owns (each counted on its own, like pmm_alloc_page
+// pages) as a shared region: every page mapped takes a frame reference,
+// which munmap drops again. NULL on failure.
+void* vmm_map_frames(vm_context_t* ctx, void* addr, uintptr_t phys, size_t pages, int prot)
+{
+    int flags = MAP_SHARED | (addr ? MAP_FIXED : 0);
+    void* vaddr = vmm_mmap(ctx, addr, pages * PAGE_SIZE, prot, flags, NULL, 0);
+    if (!vaddr) return NULL;
+    
+    for (size_t i = 0; i < pages; i++) {
+        uintptr_t va = (uintptr_t)vaddr + i * PAGE_SIZE;
+        uintptr_t pa = phys + i * PAGE_SIZE;
+        if (vmm_map_page_ctx(ctx->page_dir, va, pa, prot) < 0) {
+            vmm_munmap(ctx, vaddr, pages * PAGE_SIZE);  // Drops the pages mapped so far
+            return NULL;
         }
+        pmm_page_ref(pa);
     }
+    return vaddr;
+}
+
+// The same for frames scattered in physical memory, mapped in list order
+void* vmm_map_frame_list(vm_context_t* ctx, void* addr, const uintptr_t* frames, size_t pages, int prot)
+{
+    int flags = MAP_SHARED | (addr ? MAP_FIXED : 0);
+    void* vaddr = vmm_mmap(ctx, addr, pages * PAGE_SIZE, prot, flags, NULL, 0);
+    if (!vaddr) return NULL;
     
+    for (size_t i = 0; i < pages; i++) {
+        uintptr_t va = (uintptr_t)vaddr + i * PAGE_SIZE;
+        if (vmm_map_page_ctx(ctx->page_dir, va, frames[i], prot) < 0) {
+            vmm_munmap(ctx, vaddr, pages * PAGE_SIZE);
+            return NULL;
+        }
+        pmm_page_ref(frames[i]);
+    }
+    return vaddr;
+}
+
+// Frames of the kernel image (the vDSO), which the PMM doesn't count: they
+// are mapped outside any VMA and left alone by unmapping and teardown
+int vmm_map_kernel_frames(vm_context_t* ctx, uintptr_t vaddr, uintptr_t phys, size_t pages, int prot)
+{
+    for (size_t i = 0; i < pages; i++) {
+        if (vmm_map_page_ctx(ctx->page_dir, vaddr + i * PAGE_SIZE, phys + i * PAGE_SIZE, prot) < 0) {
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -322,75 +991,639 @@ int vmm_munmap(vm_context_t* ctx, void* addr, size_t length)
 // PAGE FAULT HANDLER
 // ============================================================================
 
-void vmm_page_fault_handler(uintptr_t fault_addr, uint32_t error_code)
+/*
+ * Write fault on a page fork left shared. The last holder gets the frame
+ * back writable as it is; anyone else takes a private copy and drops its
+ * reference to the shared frame.
+ */
+static int vmm_cow_fault(vm_context_t* ctx, pte_t* pte, uintptr_t fault_addr)
+{
+    cow_faults++;
+    
+    size_t pages = pte->huge ? HUGE_PAGE_PAGES : 1;
+    uintptr_t page_addr = fault_addr & ~(pages * PAGE_SIZE - 1);
+    uintptr_t old_page = (uintptr_t)pte->address << 12;
+    
+    if (pmm_page_refcount(old_page) == 1) {
+        // Upgrading write access needs no shootdown: a CPU still caching
+        // the read-only entry faults once more and finds it writable
+        pte->cow = 0;
+        pte->writable = 1;
+        __asm__ volatile("invlpg (%0)" :: "r"(page_addr) : "memory");
+        cow_reuses++;
+        TRACE(TRACE_COW_FAULT, fault_addr, 1);
+        return 0;
+    }
+    
+    // Copy page for COW (a huge page is copied whole)
+    uintptr_t new_page = pmm_alloc_pages(pages);
+    if (!new_page) {
+        KERROR("Out of memory during COW");
+        return -1;
+    }
+    memcpy((void*)new_page, (void*)old_page, pages * PAGE_SIZE);
+    
+    // Update PTE to new page; other CPUs may still cache the old one
+    pte->address = new_page >> 12;
+    pte->cow = 0;
+    pte->writable = 1;
+    
+    tlb_gather_t tlb;
+    tlb_gather_init(&tlb, ctx);
+    tlb_gather_add(&tlb, page_addr, pages * PAGE_SIZE);
+    tlb_gather_free(&tlb, old_page, pages);
+    tlb_gather_flush(&tlb);
+    
+    TRACE(TRACE_COW_FAULT, fault_addr, 0);
+    return 0;
+}
+
+/*
+ * Fault on file data, served from the page cache. Reading a whole page maps
+ * the cache's own frame, so every process running one binary shares a
+ * single copy of its text; a private writable mapping gets it COW, and the
+ * first write copies it. A private write, or the page where the file data
+ * ends and zeroes begin, takes a private copy instead. The pages after the
+ * fault are read ahead without waiting, for the faults that follow.
+ */
+static int vmm_file_fault(vm_context_t* ctx, vma_t* vma, uintptr_t page_addr, bool write)
+{
+    struct inode* inode = vma->file;
+    uint64_t rel = page_addr - vma->start;
+    uint64_t pos = vma->offset + rel;
+    uint64_t valid = vma->file_size - rel < PAGE_SIZE ? vma->file_size - rel : PAGE_SIZE;
+    if (pos + valid > inode->i_size) {
+        valid = pos < inode->i_size ? inode->i_size - pos : 0;
+    }
+    
+    cached_page_t* page = page_cache_get(inode->i_mapping, pos / PAGE_SIZE);
+    if (!page) {
+        KERROR("I/O error reading file page for 0x%lx", page_addr);
+        return -1;
+    }
+    file_faults++;
+    
+    bool shared = (vma->flags & MAP_SHARED) != 0;
+    uintptr_t frame = (uintptr_t)page->data;
+    int ret;
+    if (shared || (valid == PAGE_SIZE && !write)) {
+        bool cow = !shared && (vma->prot & PROT_WRITE);
+        ret = vmm_map_page_ctx(ctx->page_dir, page_addr, frame,
+                               cow ? vma->prot & ~PROT_WRITE : vma->prot);
+        if (ret == 0) {
+            pmm_page_ref(frame);
+            if (cow) {
+                vmm_get_pte(ctx->page_dir, page_addr, false)->cow = 1;
+            }
+            // No dirty tracking through the PTE: a writable shared page is
+            // written back as soon as it is mapped
+            if (shared && (vma->prot & PROT_WRITE)) {
+                page_cache_mark_dirty(page);
+            }
+            file_shared_pages++;
+        }
+    } else {
+        uintptr_t copy = pmm_alloc_page();
+        if (!copy) {
+            page_cache_put(page);
+            KERROR("Out of memory during page fault");
+            return -1;
+        }
+        memcpy((void*)copy, page->data, valid);
+        memset((uint8_t*)copy + valid, 0, PAGE_SIZE - valid);
+        ret = vmm_map_page_ctx(ctx->page_dir, page_addr, copy, vma->prot);
+        if (ret < 0) {
+            pmm_free_pages(copy, 1);
+        }
+        frame = copy;
+    }
+    page_cache_put(page);
+    
+    if (ret < 0) {
+        KERROR("Out of memory mapping page at 0x%lx", page_addr);
+        return -1;
+    }
+    TRACE(TRACE_PAGE_MAPPED, page_addr, frame);
+    
+    // Read ahead as far as the fault-around window, within the file data
+    uint64_t data = vma->file_size - rel;
+    if (pos + data > inode->i_size || pos + data < pos) {
+        data = pos < inode->i_size ? inode->i_size - pos : 0;
+    }
+    uint64_t left = data ? (data - 1) / PAGE_SIZE : 0;
+    uint64_t in_vma = (vma->end - page_addr) / PAGE_SIZE - 1;
+    if (left > in_vma) left = in_vma;
+    size_t ahead = vma->fault_around < left ? vma->fault_around : left;
+    if (ahead > 0) {
+        page_cache_readahead(inode->i_mapping, pos / PAGE_SIZE + 1, ahead);
+    }
+    return 0;
+}
+
+// Fault in the gap just below a stack: extend it down to the faulting
+// page, as long as that stays within its limit
+static vma_t* vmm_grow_stack(vm_context_t* ctx, uintptr_t fault_addr)
+{
+    uintptr_t page_addr = fault_addr & ~(PAGE_SIZE - 1);
+    vma_t* vma = vmm_first_vma_from(ctx, fault_addr);
+    if (!vma || !(vma->flags & VMA_GROWSDOWN) || page_addr < vma->grow_limit) {
+        return NULL;
+    }
+    if (vma->prev && vma->prev->end > page_addr) {
+        return NULL;
+    }
+    
+    // The VMAs around keep their order, so the tree stays valid as it is
+    vma->start = page_addr;
+    stack_grows++;
+    return vma;
+}
+
+int vmm_page_fault_handler(uintptr_t fault_addr, uint32_t error_code)
 {
     page_faults_total++;
     
-    // Get current process VM context (simplified - would get from scheduler)
-    vm_context_t* ctx = &kernel_vm_context;
+    vm_context_t* ctx = vmm_current_context();
+    if (!ctx->page_dir) {
+        return -1;  // Before vmm_init
+    }
     
-    KDEBUG("Page fault at 0x%lx, error=0x%x", fault_addr, error_code);
+    TRACE(TRACE_PAGE_FAULT, fault_addr, error_code);
+    
+    // Shared by fork (or a file page mapped COW): also covers pages mapped
+    // outside any VMA
+    pte_t* pte = vmm_get_pte(ctx->page_dir, fault_addr, false);
+    if (pte && pte->present && (error_code & PF_WRITE)) {
+        if (pte->writable && (error_code & PF_PRESENT) && pte->user) {
+            return 0;  // Stale read-only TLB entry from before a COW reuse
+        }
+        if (pte->cow) {
+            return vmm_cow_fault(ctx, pte, fault_addr);
+        }
+    }
     
     // Find VMA for this address
     vma_t* vma = vmm_find_vma(ctx, fault_addr);
+    if (!vma) {
+        vma = vmm_grow_stack(ctx, fault_addr);
+    }
     if (!vma) {
         KERROR("Segmentation fault: no VMA for address 0x%lx", fault_addr);
-        return;
+        return -1;
     }
     
     // Check permissions
     if ((error_code & PF_WRITE) && !(vma->prot & PROT_WRITE)) {
         KERROR("Permission denied: write to read-only page at 0x%lx", fault_addr);
-        return;
+        return -1;
     }
     
-    // Handle copy-on-write
-    pte_t* pte = vmm_get_pte(ctx->page_dir, fault_addr, false);
-    if (pte && pte->present && (error_code & PF_WRITE) && 
-        (vma->flags & MAP_PRIVATE)) {
+    if (pte && pte->present) {
+        if ((error_code & PF_WRITE) && (vma->flags & MAP_PRIVATE)) {
+            return vmm_cow_fault(ctx, pte, fault_addr);
+        }
+        KERROR("Protection fault at 0x%lx, error=0x%x", fault_addr, error_code);
+        return -1;
+    }
+    
+    // File data (anything past it is anonymous, like .bss)
+    if (vma->file && (fault_addr & ~(PAGE_SIZE - 1)) - vma->start < vma->file_size) {
+        return vmm_file_fault(ctx, vma, fault_addr & ~(PAGE_SIZE - 1), error_code & PF_WRITE);
+    }
+    
+    // Regular page fault - allocate page
+    page_faults_minor++;
+    
+    // Whole aligned 2MB span inside a huge-eligible VMA: back it with one
+    // buddy block (naturally 2MB aligned), else fall back to 4KB
+    uintptr_t huge_addr = fault_addr & ~(PAGE_SIZE_2M - 1);
+    if ((vma->flags & VMA_HUGEPAGE) && huge_addr >= vma->start &&
+        huge_addr + PAGE_SIZE_2M <= vma->end) {
+        uint64_t* pde = vmm_get_pde(ctx->page_dir, huge_addr, false);
+        if (!pde || !(*pde & 0x1)) {
+            uintptr_t huge_page = pmm_alloc_pages(HUGE_PAGE_PAGES);
+            if (huge_page && !(huge_page & (PAGE_SIZE_2M - 1))) {
+                memzero_nt((void*)huge_page, PAGE_SIZE_2M);  // Larger than the caches anyway
+                if (vmm_map_huge_ctx(ctx->page_dir, huge_addr, huge_page, vma->prot) == 0) {
+                    huge_faults++;
+                    TRACE(TRACE_PAGE_MAPPED, huge_addr, huge_page);
+                    return 0;
+                }
+            }
+            if (huge_page) {
+                pmm_free_pages(huge_page, HUGE_PAGE_PAGES);
+            }
+        }
+        huge_fallbacks++;
+    }
+    
+    uintptr_t page_addr = fault_addr & ~(PAGE_SIZE - 1);
+    uintptr_t phys_page = pmm_alloc_zeroed_page();  // Zeroed for security
+    
+    if (!phys_page) {
+        KERROR("Out of memory during page fault");
+        return -1;
+    }
+    
+    // Map the page
+    if (vmm_map_page_ctx(ctx->page_dir, page_addr, phys_page, vma->prot) < 0) {
+        pmm_free_pages(phys_page, 1);
+        KERROR("Out of memory mapping page at 0x%lx", page_addr);
+        return -1;
+    }
+    
+    TRACE(TRACE_PAGE_MAPPED, page_addr, phys_page);
+    
+    vmm_fault_around(ctx, vma, page_addr);
+    return 0;
+}
+
+/*
+ * Map the pages after a minor fault while we are here: sequential access
+ * then takes one fault per window instead of one per page. Stays inside
+ * the faulting page table, skips pages already present and stops quietly
+ * when memory runs short.
+ */
+static void vmm_fault_around(vm_context_t* ctx, vma_t* vma, uintptr_t page_addr)
+{
+    if (vma->fault_around == 0 || vma->file) {
+        return;  // File pages would need I/O: only the faulting page is read
+    }
+    
+    pte_t* pte = vmm_get_pte(ctx->page_dir, page_addr, false);
+    if (!pte || pte->huge) return;
+    
+    size_t index = (page_addr >> 12) & 0x1FF;
+    for (size_t i = 1; i <= vma->fault_around; i++) {
+        uintptr_t addr = page_addr + i * PAGE_SIZE;
+        if (addr >= vma->end || index + i >= 512) break;
+        if (pte[i].present) continue;
+        
+        uintptr_t phys = pmm_alloc_zeroed_page();
+        if (!phys) break;
+        vmm_set_pte(&pte[i], phys, vma->prot);
+        fault_around_pages++;
+    }
+}
+
+// ============================================================================
+// MADVISE
+// ============================================================================
+
+// Tune fault-around for [addr, addr + length), splitting VMAs partly inside
+int vmm_madvise(vm_context_t* ctx, void* addr, size_t length, int advice)
+{
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + ALIGN_UP(length, PAGE_SIZE);
+    if ((start & (PAGE_SIZE - 1)) || end <= start) {
+        return -1;
+    }
+    
+    uint32_t fault_around;
+    switch (advice) {
+        case MADV_NORMAL:
+            fault_around = FAULT_AROUND_DEFAULT;
+            break;
+        case MADV_RANDOM:
+            fault_around = 0;
+            break;
+        case MADV_SEQUENTIAL:
+            fault_around = FAULT_AROUND_MAX;
+            break;
+        case MADV_WILLNEED:
+            // Populate now, one fault-around window at a time
+            for (vma_t* vma = vmm_first_vma_from(ctx, start); vma && vma->start < end; vma = vma->next) {
+                uintptr_t from = start > vma->start ? start : vma->start;
+                uintptr_t to = end < vma->end ? end : vma->end;
+                for (uintptr_t page = from; page < to; page += PAGE_SIZE) {
+                    pte_t* pte = vmm_get_pte(ctx->page_dir, page, false);
+                    if (!pte || !pte->present) {
+                        vmm_page_fault_handler(page, 0);
+                    }
+                }
+            }
+            return 0;
+        default:
+            return -1;
+    }
+    
+    tlb_gather_t tlb;
+    tlb_gather_init(&tlb, ctx);
+    int ret = vmm_split_range(ctx, start, end, &tlb);
+    tlb_gather_flush(&tlb);
+    if (ret < 0) return -1;
+    
+    for (vma_t* vma = vmm_first_vma_from(ctx, start); vma && vma->start < end; vma = vma->next) {
+        vma->fault_around = fault_around;
+    }
+    return 0;
+}
+
+// Address space in this CPU's CR3 (kernel threads borrow the last one loaded)
+vm_context_t* vmm_current_context(void)
+{
+    vm_context_t* ctx = loaded_ctx[smp_cpu_id()];
+    return ctx ? ctx : &kernel_vm_context;
+}
+
+// ============================================================================
+// DMA TRANSLATION
+// ============================================================================
+
+/*
+ * Physical address behind vaddr in the current address space, for handing
+ * to a device. User pages not yet present are faulted in, and when the
+ * device will write the page (dev_writes) a COW share is broken first so
+ * the transfer never lands in a frame another address space still maps.
+ * Returns 0 if the address cannot be backed.
+ */
+uintptr_t vmm_dma_address(uintptr_t vaddr, bool dev_writes)
+{
+    vm_context_t* ctx = vmm_current_context();
+    if (!ctx->page_dir) {
+        return vmm_get_physical(vaddr);
+    }
+    
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint64_t pml4e = ctx->page_dir[(vaddr >> 39) & 0x1FF];
+        if (pml4e & PTE_PRESENT) {
+            uint64_t pdpe = ((uint64_t*)(pml4e & PTE_ADDR_MASK))[(vaddr >> 30) & 0x1FF];
+            if ((pdpe & PTE_PRESENT) && (pdpe & PTE_HUGE)) {
+                // 1GB leaf: only the kernel direct map uses these
+                return (pdpe & PTE_ADDR_MASK & ~(PAGE_SIZE_1G - 1)) + (vaddr & (PAGE_SIZE_1G - 1));
+            }
+        }
         
-        cow_faults++;
+        pte_t* pte = vmm_get_pte(ctx->page_dir, vaddr, false);
+        bool present = pte && pte->present;
+        if (present && (!dev_writes || !pte->user || (pte->writable && !pte->cow))) {
+            size_t span = pte->huge ? PAGE_SIZE_2M : PAGE_SIZE;
+            return (((uintptr_t)pte->address << 12) & ~(span - 1)) + (vaddr & (span - 1));
+        }
         
-        // Copy page for COW
-        uintptr_t old_page = (uintptr_t)pte->address << 12;
-        uintptr_t new_page = pmm_alloc_pages(1);
+        // Fault it in as the user access the transfer stands for would
+        uint32_t error_code = PF_USER | (present ? PF_PRESENT : 0) | (dev_writes ? PF_WRITE : 0);
+        if (vmm_page_fault_handler(vaddr, error_code) < 0) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Take a reference on each 4K frame behind pages of the current user space,
+ * unsharing copy-on-write ones first, so they can be mapped into another
+ * space. -1, holding nothing, if a page is unbacked, huge or not user
+ * memory; the caller copies instead.
+ */
+int vmm_pin_frames(uintptr_t vaddr, size_t pages, uintptr_t* frames)
+{
+    vm_context_t* ctx = vmm_current_context();
+    if (!ctx->page_dir || (vaddr & (PAGE_SIZE - 1))) return -1;
+    
+    for (size_t i = 0; i < pages; i++) {
+        uintptr_t va = vaddr + i * PAGE_SIZE;
+        pte_t* pte = vmm_dma_address(va, true) ? vmm_get_pte(ctx->page_dir, va, false) : NULL;
+        if (!pte || !pte->present || pte->huge || !pte->user) {
+            while (i--) pmm_page_unref(frames[i], 1);
+            return -1;
+        }
+        frames[i] = (uintptr_t)pte->address << 12;
+        pmm_page_ref(frames[i]);
+    }
+    return 0;
+}
+
+// ============================================================================
+// FORK
+// ============================================================================
+
+/*
+ * Copy one level of the parent's lower half into dst. Frames the PMM hands
+ * out and ring 3 can reach are shared with an extra reference, and private
+ * writable ones lose write access on both sides until a COW fault. Kernel
+ * leaves (direct map, vDSO) are copied as they are.
+ */
+static int vmm_fork_level(vm_context_t* parent, uint64_t* src, uint64_t* dst,
+                          int level, uintptr_t base, tlb_gather_t* tlb)
+{
+    size_t count = (level == 4) ? USER_PML4_ENTRIES : 512;
+    uint64_t entry_size = 1ULL << (12 + 9 * (level - 1));
+    
+    for (size_t i = 0; i < count; i++) {
+        uint64_t entry = src[i];
+        if (!(entry & PTE_PRESENT)) continue;
+        uintptr_t addr = base + i * entry_size;
         
-        if (!new_page) {
-            KERROR("Out of memory during COW");
-            return;
+        // The kernel image and direct map sit in the lower half too (PML4
+        // slot 0), in tables without the user bit: share those as they are
+        if (!(entry & PTE_USER)) {
+            dst[i] = entry;
+            continue;
         }
         
-        memcpy((void*)new_page, (void*)old_page, PAGE_SIZE);
+        if (level > 1 && (level == 4 || !(entry & PTE_HUGE))) {
+            uintptr_t table = pmm_alloc_zeroed_page();
+            if (!table) return -1;
+            dst[i] = table | (entry & ~PTE_ADDR_MASK);
+            if (vmm_fork_level(parent, (uint64_t*)(entry & PTE_ADDR_MASK), (uint64_t*)table,
+                               level - 1, addr, tlb) < 0) {
+                return -1;
+            }
+            continue;
+        }
         
-        // Update PTE to new page
-        pte->address = new_page >> 12;
-        pte->writable = 1;
+        uintptr_t frame = entry & PTE_ADDR_MASK & ~(entry_size - 1);
+        if (pmm_page_refcount(frame) > 0) {
+            pmm_page_ref(frame);
+            vma_t* vma = vmm_find_vma(parent, addr);
+            if ((entry & PTE_WRITE) && !(vma && (vma->flags & MAP_SHARED))) {
+                entry = (entry & ~PTE_WRITE) | PTE_COW;
+                src[i] = entry;
+                tlb_gather_add(tlb, addr, entry_size);
+            }
+            fork_shared_pages += entry_size / PAGE_SIZE;
+        }
+        dst[i] = entry;
+    }
+    return 0;
+}
+
+// Free the lower-half tables below entry, dropping the frames they share
+// (kernel tables, shared by every context, stay)
+static void vmm_release_level(uint64_t* table, int level)
+{
+    size_t count = (level == 4) ? USER_PML4_ENTRIES : 512;
+    uint64_t entry_size = 1ULL << (12 + 9 * (level - 1));
+    
+    for (size_t i = 0; i < count; i++) {
+        uint64_t entry = table[i];
+        if (!(entry & PTE_PRESENT) || !(entry & PTE_USER)) continue;
         
-        __asm__ volatile("invlpg (%0)" :: "r"(fault_addr) : "memory");
+        if (level > 1 && (level == 4 || !(entry & PTE_HUGE))) {
+            uint64_t* next = (uint64_t*)(entry & PTE_ADDR_MASK);
+            vmm_release_level(next, level - 1);
+            pmm_free_pages((uintptr_t)next, 1);
+            continue;
+        }
         
-        KDEBUG("COW fault resolved at 0x%lx", fault_addr);
-        return;
+        uintptr_t frame = entry & PTE_ADDR_MASK & ~(entry_size - 1);
+        if (pmm_page_refcount(frame) > 0) {
+            pmm_page_unref(frame, entry_size / PAGE_SIZE);
+        }
     }
+}
+
+/*
+ * Tear down a context that no CPU has loaded (a forked child that exited
+ * or never ran). The kernel's tables, the upper half and those in the
+ * lower half without the user bit, are left alone.
+ */
+void vmm_destroy_context(vm_context_t* ctx)
+{
+    if (!ctx || ctx == &kernel_vm_context) return;
     
-    // Regular page fault - allocate page
-    page_faults_minor++;
+    vma_t* vma = ctx->vma_list;
+    while (vma) {
+        vma_t* next = vma->next;
+        vma_free(vma);
+        vma = next;
+    }
     
-    uintptr_t page_addr = fault_addr & ~(PAGE_SIZE - 1);
-    uintptr_t phys_page = pmm_alloc_pages(1);
+    vmm_release_level(ctx->page_dir, 4);
+    pmm_free_pages((uintptr_t)ctx->page_dir, 1);
+    kfree_tracked(ctx);
+}
+
+static void vmm_destroy_rcu(rcu_head_t* head)
+{
+    vm_context_t* ctx = (vm_context_t*)((uintptr_t)head - __builtin_offsetof(vm_context_t, rcu));
+    if (__atomic_load_n(&ctx->cpu_loaded, __ATOMIC_ACQUIRE)) {
+        KERROR("VMM: context %p freed while loaded (CPUs 0x%x)", ctx, ctx->cpu_loaded);
+        return;  // Leak it rather than free page tables a CPU walks
+    }
+    vmm_destroy_context(ctx);
+}
+
+// The kernel's own context is never counted or freed
+void vmm_context_get(vm_context_t* ctx)
+{
+    if (ctx && ctx != &kernel_vm_context) {
+        __atomic_add_fetch(&ctx->refcount, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Any context without a run queue lock held (call_rcu may wake the rcu
+// task); the teardown itself runs in that task
+void vmm_context_put(vm_context_t* ctx)
+{
+    if (!ctx || ctx == &kernel_vm_context) return;
+    if (__atomic_sub_fetch(&ctx->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        call_rcu(&ctx->rcu, vmm_destroy_rcu);
+    }
+}
+
+/*
+ * Empty address space for a new program (one reference): only the kernel's
+ * tables, which every context shares, are in it. The heap and mmap areas
+ * start where the kernel context's do.
+ */
+vm_context_t* vmm_create_context(void)
+{
+    vm_context_t* ctx = kmalloc_tracked(sizeof(vm_context_t), "vm_context");
+    if (!ctx) return NULL;
     
-    if (!phys_page) {
-        KERROR("Out of memory during page fault");
-        return;
+    ctx->vma_list = NULL;
+    ctx->vma_tree = NULL;
+    ctx->vma_cache = NULL;
+    ctx->vma_count = 0;
+    ctx->brk = 0x10000000000;       // 1TB mark for heap
+    ctx->mmap_base = 0x20000000000; // 2TB mark for mmap
+    ctx->pcid = 0;
+    ctx->tlb_stale = 0;
+    ctx->cpu_loaded = 0;
+    ctx->refcount = 1;
+    
+    ctx->page_dir = (uint64_t*)pmm_alloc_zeroed_page();
+    if (!ctx->page_dir) {
+        kfree_tracked(ctx);
+        return NULL;
+    }
+    
+    // The kernel image and direct map below, the kernel half above
+    uint64_t* kernel_dir = kernel_vm_context.page_dir;
+    for (size_t i = 0; i < USER_PML4_ENTRIES; i++) {
+        if ((kernel_dir[i] & PTE_PRESENT) && !(kernel_dir[i] & PTE_USER)) {
+            ctx->page_dir[i] = kernel_dir[i];
+        }
+    }
+    for (size_t i = USER_PML4_ENTRIES; i < 512; i++) {
+        ctx->page_dir[i] = kernel_dir[i];
+    }
+    return ctx;
+}
+
+/*
+ * New address space for a forked child. Nothing is copied up front: every
+ * user frame is shared with the parent and only copied by the first write
+ * from either side that still shares it.
+ */
+vm_context_t* vmm_fork_context(vm_context_t* parent)
+{
+    vm_context_t* child = kmalloc_tracked(sizeof(vm_context_t), "vm_context");
+    if (!child) return NULL;
+    
+    child->vma_list = NULL;
+    child->vma_tree = NULL;
+    child->vma_cache = NULL;
+    child->vma_count = 0;
+    child->brk = parent->brk;
+    child->mmap_base = parent->mmap_base;
+    child->pcid = 0;
+    child->tlb_stale = 0;
+    child->cpu_loaded = 0;
+    child->refcount = 1;
+    
+    child->page_dir = (uint64_t*)pmm_alloc_pages(1);
+    if (!child->page_dir) {
+        kfree_tracked(child);
+        return NULL;
     }
+    memset(child->page_dir, 0, PAGE_SIZE);
     
-    // Zero the page for security
-    memset((void*)phys_page, 0, PAGE_SIZE);
+    for (vma_t* vma = parent->vma_list; vma; vma = vma->next) {
+        vma_t* copy = vmm_create_vma(vma->start, vma->end, vma->prot, vma->flags);
+        if (!copy) {
+            vmm_destroy_context(child);
+            return NULL;
+        }
+        copy->file = vma->file ? igrab(vma->file) : NULL;
+        copy->offset = vma->offset;
+        copy->file_size = vma->file_size;
+        copy->grow_limit = vma->grow_limit;
+        copy->fault_around = vma->fault_around;
+        vmm_insert_vma(child, copy);
+    }
     
-    // Map the page
-    vmm_map_page_ctx(ctx->page_dir, page_addr, phys_page, vma->prot);
+    // Kernel half: the same tables in every context
+    for (size_t i = USER_PML4_ENTRIES; i < 512; i++) {
+        child->page_dir[i] = parent->page_dir[i];
+    }
+    
+    // The parent keeps running on its own CPUs: its write access goes now
+    tlb_gather_t tlb;
+    tlb_gather_init(&tlb, parent);
+    int ret = vmm_fork_level(parent, parent->page_dir, child->page_dir, 4, 0, &tlb);
+    tlb_gather_flush(&tlb);
     
-    KDEBUG("Demand-paged: allocated page at 0x%lx -> 0x%lx", 
-           page_addr, phys_page);
+    if (ret < 0) {
+        KERROR("fork: out of memory copying page tables");
+        vmm_destroy_context(child);
+        return NULL;
+    }
+    
+    forks++;
+    return child;
 }
 
 // ============================================================================
@@ -406,12 +1639,18 @@ void* vmm_brk(vm_context_t* ctx, void* addr)
     
     uintptr_t new_brk = (uintptr_t)addr;
     uintptr_t old_brk = ctx->brk;
+    if (new_brk < USER_SPACE_START || new_brk > USER_SPACE_END) {
+        return (void*)old_brk;
+    }
     
     if (new_brk < old_brk) {
         // Shrink heap - unmap pages
-        for (uintptr_t page = new_brk; page < old_brk; page += PAGE_SIZE) {
-            vmm_unmap_page_ctx(ctx->page_dir, page);
+        tlb_gather_t tlb;
+        tlb_gather_init(&tlb, ctx);
+        for (uintptr_t page = new_brk; page < old_brk; ) {
+            page += vmm_unmap_page_ctx(ctx->page_dir, page, &tlb);
         }
+        tlb_gather_flush(&tlb);
     } else {
         // Expand heap - create VMA (pages allocated on demand)
         vma_t* heap_vma = vmm_create_vma(old_brk, new_brk, 
@@ -436,15 +1675,19 @@ void vmm_init(void)
     
     // Initialize kernel VM context
     kernel_vm_context.vma_list = NULL;
-    kernel_vm_context.brk = 0x40000000;       // 1GB mark for heap
-    kernel_vm_context.mmap_base = 0x60000000; // 1.5GB mark for mmap
+    kernel_vm_context.vma_tree = NULL;
+    kernel_vm_context.vma_cache = NULL;
+    kernel_vm_context.vma_count = 0;
+    // Above the 64GB direct map, whose 1GB pages leave no room for user tables
+    kernel_vm_context.brk = 0x10000000000;       // 1TB mark for heap
+    kernel_vm_context.mmap_base = 0x20000000000; // 2TB mark for mmap
+    kernel_vm_context.pcid = 0;
+    kernel_vm_context.tlb_stale = 0;
+    kernel_vm_context.cpu_loaded = 0;
+    kernel_vm_context.refcount = 1;
     
-    // Allocate page directory for kernel
-    kernel_vm_context.page_dir = (uint64_t*)pmm_alloc_pages(1);
-    if (!kernel_vm_context.page_dir) {
-        PANIC("Failed to allocate kernel page directory");
-    }
-    memset(kernel_vm_context.page_dir, 0, PAGE_SIZE);
+    // The boot tables are the address space everything runs in until fork
+    kernel_vm_context.page_dir = (uint64_t*)(read_cr3() & PTE_ADDR_MASK);
     
     // Initialize CLOCK algorithm
     page_clock.capacity = 1024;  // Track up to 1024 pages
@@ -469,5 +1712,13 @@ void vmm_get_stats(void)
     KINFO("Total page faults: %lu", page_faults_total);
     KINFO("  Minor faults: %lu", page_faults_minor);
     KINFO("  Major faults: %lu", page_faults_major);
-    KINFO("  COW faults: %lu", cow_faults);
+    KINFO("  COW faults: %lu (%lu reused the frame)", cow_faults, cow_reuses);
+    KINFO("Forks: %lu (%lu pages shared)", forks, fork_shared_pages);
+    KINFO("  Huge page faults: %lu (%lu fell back to 4KB)", huge_faults, huge_fallbacks);
+    KINFO("  Fault-around pages: %lu", fault_around_pages);
+    KINFO("  File faults: %lu (%lu mapped the cached frame)", file_faults, file_shared_pages);
+    KINFO("  Stack growth faults: %lu", stack_grows);
+    KINFO("TLB shootdowns: %lu (%lu IPIs, %lu full flushes)", tlb_shootdowns, tlb_ipis,
+          tlb_full_flushes);
+    KINFO("Kernel context VMAs: %u", kernel_vm_context.vma_count);
 }
@@ -5,16 +5,10 @@
  * Basic printing functions for kernel debugging
  */
 
-static void print_char(char c)
-{
-    serial_write(c);
-}
-
+// One serial_write_string() per message: queued (or dropped) as a whole
 static void print_string(const char* str)
 {
-    while (*str) {
-        print_char(*str++);
-    }
+    serial_write_string(str);
 }
 
 // Helper for number conversion
@@ -266,6 +260,7 @@ void kernel_error(const char* fmt, ...)
 /* Panic function */
 __NORETURN void kernel_panic(const char* file, int line, const char* msg)
 {
+    serial_panic_flush();  // Buffered output first, then this synchronously
     kprintf("KERNEL PANIC at %s:%d: %s\n", file, line, msg);
 
     /* Halt the system - in real kernel, this would cli and hlt */
@@ -4,19 +4,25 @@
  * Enhancements over basic round-robin:
  * - Automatic workload detection (Interactive, Compute, I/O, Realtime)
  * - Dynamic time slice adjustment based on workload
- * - Per-CPU run queues for multi-core
- * - Work-stealing for load balancing
- * - NUMA-aware scheduling hints
+ * - Optional virtual-runtime fair class (SCHED_FLAG_FAIR)
+ * - Per-CPU run queues for multi-core, each driven by its own LAPIC timer
+ * - Work-stealing for load balancing (Chase-Lev deques)
+ * - NUMA-aware placement: a task's memory node steers where it runs and
+ *   which CPUs steal it
  * - O(1) scheduling complexity
  */
 
 #include "kernel.h"
+#include "smp.h"
+#include "cpu.h"
+#include "vmm.h"
+#include "numa.h"
+#include "sync.h"
 
 // ============================================================================
 // CONFIGURATION
 // ============================================================================
 
-#define MAX_CPUS 16
 #define MAX_TASKS_PER_CPU 256
 
 // Time quantum configuration (in milliseconds)
@@ -33,7 +39,23 @@
 #define PRIORITY_RT_MIN       0    // Realtime (highest)
 #define PRIORITY_RT_MAX      99
 #define PRIORITY_NORMAL     100
-#define PRIORITY_BATCH      120    // Background tasks (lowest)
+#define PRIORITY_BATCH      120    // Background tasks
+
+// Run queue priority levels (process API accepts 0-255)
+#define MAX_PRIO            256
+#define PRIO_BITMAP_WORDS   (MAX_PRIO / 64)
+#define PRIORITY_IDLE       (MAX_PRIO - 1)  // Idle tasks: below every real task
+
+// Fair class configuration (vruntime is in 1/1024 tick units)
+#define FAIR_LEVEL          PRIORITY_NORMAL  // Fair tasks outrank levels >= this
+#define FAIR_NICE0_WEIGHT   1024
+#define FAIR_LATENCY          20    // Ticks in which every fair task should run once
+#define FAIR_MIN_GRANULARITY   2    // Minimum fair slice in ticks
+#define FAIR_WAKEUP_GRAN    (FAIR_MIN_GRANULARITY * 1024)
+
+// Work stealing
+#define WS_DEQUE_SIZE       256    // Power of two
+#define SPILL_THRESHOLD       4    // Locally queued tasks before spilling to the deque
 
 // ============================================================================
 // DATA STRUCTURES
@@ -47,12 +69,19 @@ typedef enum {
     WORKLOAD_REALTIME        // Hard real-time
 } workload_type_t;
 
+// Scheduling class
+typedef enum {
+    SCHED_CLASS_ADAPTIVE,    // Priority levels + workload-based quanta
+    SCHED_CLASS_FAIR         // Virtual runtime ordering
+} sched_class_t;
+
 // Enhanced task structure
 typedef struct task {
     uint64_t id;               // Unique task identifier
     task_state_t state;        // Current task state
     uint64_t* stack_top;       // Stack pointer
     uint64_t* stack_bottom;    // Stack base
+    uintptr_t kstack_top;      // Empty kernel stack, loaded by SYSCALL entry
     
     // Scheduling metadata
     int priority;              // Static priority
@@ -60,6 +89,12 @@ typedef struct task {
     uint64_t time_slice;       // Current time slice
     uint64_t ticks_remaining;  // Remaining ticks
     
+    // Fair class (pairing heap keyed by vruntime)
+    sched_class_t sched_class;
+    uint64_t vruntime;         // Weighted CPU time in 1/1024 ticks
+    struct task* heap_child;
+    struct task* heap_sibling;
+    
     // Workload detection
     workload_type_t workload;  // Detected workload type
     uint64_t cpu_time;         // Total CPU time used
@@ -70,24 +105,69 @@ typedef struct task {
     // CPU affinity
     uint32_t cpu_affinity;     // Bitmask of allowed CPUs
     int last_cpu;              // Last CPU this ran on
+    int mem_node;              // Preferred memory node, NUMA_NO_NODE = where it runs
     
     // Memory management
-    vm_context_t* vm_context;  // Virtual memory context
+    vm_context_t* vm_context;  // Virtual memory context (NULL = kernel thread)
+    task_exit_t* exit_notify;  // Told the exit status, if someone waits for it
+    
+    // Context switch
+    volatile bool on_cpu;      // Registers live on a CPU (running or mid-switch)
+    uint8_t* fpu_state;        // FXSAVE image, allocated on first FPU/SSE use
+    void* fpu_alloc;           // Unaligned allocation behind fpu_state
+    int fpu_cpu;               // CPU whose registers hold the newest FPU state
+    pmu_counts_t pmu;          // Hardware counts while this task ran
+    rcu_head_t rcu;            // Freed through call_rcu() once terminated
     
     struct task* next;         // Next in queue
 } task_t;
 
-// Per-CPU run queue
+// FIFO of ready tasks at one priority level
+typedef struct {
+    task_t* head;
+    task_t* tail;
+} prio_queue_t;
+
+// Chase-Lev work-stealing deque. The owning run queue pushes and pops at
+// the bottom (under its lock); idle CPUs steal from the top without
+// taking any lock.
+typedef struct {
+    volatile int64_t top;
+    volatile int64_t bottom;
+    task_t* tasks[WS_DEQUE_SIZE];
+} ws_deque_t;
+
+// Per-CPU run queue: one FIFO per priority level plus a bitmap of
+// non-empty levels, so picking the next task is a find-first-set
 typedef struct {
-    task_t* ready_queue_head;
-    task_t* ready_queue_tail;
+    spinlock_t lock;           // Queues and running_task of this CPU
+    prio_queue_t queues[MAX_PRIO];
+    uint64_t bitmap[PRIO_BITMAP_WORDS];
     task_t* running_task;
-    uint64_t total_tasks;
+    task_t* idle_task;
+    bool tick_stopped;         // Tickless idle: no scheduler tick on this CPU
+    task_t* prev_task;         // Task being switched away from (lock held across)
+    task_t* fpu_owner;         // Task whose FPU state is in this CPU's registers
+    vm_context_t* active_mm;   // Address space loaded in CR3 (referenced)
+    vm_context_t* mm_drop;     // Previous active_mm, released after the switch
+    bool need_resched;         // Higher-priority task became ready
+    uint32_t nr_local;         // Tasks in queues[] and the fair heap
+    
+    // Overflow of migratable tasks that other CPUs may steal
+    ws_deque_t deque;
+    uint64_t steals;           // Tasks this CPU stole
+    uint64_t migrations;       // Tasks that ran here after running elsewhere
+    
+    // Fair class
+    task_t* fair_heap;         // Pairing heap root (smallest vruntime)
+    uint32_t fair_count;       // Fair tasks queued
+    uint64_t min_vruntime;     // Monotonic floor for queued/waking tasks
+    uint64_t total_tasks;      // Live tasks homed here (atomic: thieves move them)
     uint64_t idle_time;
     uint64_t busy_time;
     
     // Load balancing
-    uint32_t load;             // Current load (number of tasks)
+    uint32_t load;             // Queued tasks, local + deque (atomic)
 } cpu_runqueue_t;
 
 // ============================================================================
@@ -95,13 +175,17 @@ typedef struct {
 // ============================================================================
 
 static cpu_runqueue_t cpu_runqueues[MAX_CPUS];
-static int num_cpus = 1;  // Start with 1 CPU
+static int num_cpus = 1;  // CPUs with a live run queue (APs join via scheduler_cpu_online)
 static uint64_t next_task_id = 0;
-static uint64_t global_ticks = 0;
 
 // Statistics
 static uint64_t context_switches = 0;
-static uint64_t load_balances = 0;
+static uint64_t cr3_switches = 0;
+static uint64_t fpu_restores = 0;  // #NM traps that had to load FPU state
+static uint64_t direct_switches = 0;  // wake_up_sync() handoffs past the run queue
+static uint64_t* discarded_sp;     // Save slot when switching away from no task
+static uint64_t steal_attempts = 0;
+static uint64_t steal_races = 0;   // Lost the top CAS to another thief or the owner
 
 // ============================================================================
 // WORKLOAD DETECTION
@@ -144,101 +228,616 @@ static uint64_t get_time_quantum(workload_type_t workload)
     }
 }
 
+// ============================================================================
+// FAIR CLASS (VRUNTIME PAIRING HEAP)
+// ============================================================================
+
+// Weight per priority step around PRIORITY_NORMAL (~1.25x per step)
+static const uint32_t fair_prio_weight[40] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,   335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+static inline bool vruntime_before(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b) < 0;
+}
+
+// Share weight from the static priority, boosted for tasks that give the
+// CPU back often (more than one voluntary yield per 4 ticks of CPU)
+static uint32_t fair_weight(task_t* task)
+{
+    int step = task->priority - PRIORITY_NORMAL;
+    if (step < -20) step = -20;
+    if (step > 19) step = 19;
+    
+    uint32_t weight = fair_prio_weight[step + 20];
+    if (task->voluntary_yields * 4 > task->cpu_time) {
+        weight += weight / 2;
+    }
+    return weight;
+}
+
+static task_t* fair_heap_meld(task_t* a, task_t* b)
+{
+    if (!a) return b;
+    if (!b) return a;
+    
+    if (vruntime_before(b->vruntime, a->vruntime)) {
+        task_t* t = a;
+        a = b;
+        b = t;
+    }
+    
+    b->heap_sibling = a->heap_child;
+    a->heap_child = b;
+    return a;
+}
+
+static void fair_heap_insert(cpu_runqueue_t* rq, task_t* task)
+{
+    task->heap_child = NULL;
+    task->heap_sibling = NULL;
+    rq->fair_heap = fair_heap_meld(rq->fair_heap, task);
+    rq->fair_count++;
+}
+
+// Remove the smallest-vruntime task (two-pass pairing)
+static task_t* fair_heap_pop(cpu_runqueue_t* rq)
+{
+    task_t* root = rq->fair_heap;
+    if (!root) return NULL;
+    
+    // Pass 1: meld children pairwise, left to right, into a reversed list
+    task_t* pairs = NULL;
+    task_t* c = root->heap_child;
+    while (c) {
+        task_t* a = c;
+        task_t* b = c->heap_sibling;
+        if (!b) {
+            a->heap_sibling = pairs;
+            pairs = a;
+            break;
+        }
+        c = b->heap_sibling;
+        a->heap_sibling = NULL;
+        b->heap_sibling = NULL;
+        task_t* m = fair_heap_meld(a, b);
+        m->heap_sibling = pairs;
+        pairs = m;
+    }
+    
+    // Pass 2: meld the pairs right to left
+    task_t* heap = NULL;
+    while (pairs) {
+        task_t* next = pairs->heap_sibling;
+        pairs->heap_sibling = NULL;
+        heap = fair_heap_meld(heap, pairs);
+        pairs = next;
+    }
+    
+    rq->fair_heap = heap;
+    rq->fair_count--;
+    root->heap_child = NULL;
+    return root;
+}
+
+static void fair_update_min_vruntime(cpu_runqueue_t* rq)
+{
+    uint64_t floor = rq->min_vruntime;
+    bool have = false;
+    
+    task_t* current = rq->running_task;
+    if (current && current->sched_class == SCHED_CLASS_FAIR) {
+        floor = current->vruntime;
+        have = true;
+    }
+    if (rq->fair_heap &&
+        (!have || vruntime_before(rq->fair_heap->vruntime, floor))) {
+        floor = rq->fair_heap->vruntime;
+        have = true;
+    }
+    
+    if (have && vruntime_before(rq->min_vruntime, floor)) {
+        rq->min_vruntime = floor;
+    }
+}
+
+// Slice so that every queued fair task runs once per FAIR_LATENCY
+static uint64_t fair_time_slice(cpu_runqueue_t* rq)
+{
+    uint64_t slice = FAIR_LATENCY / (rq->fair_count + 1);
+    return slice < FAIR_MIN_GRANULARITY ? FAIR_MIN_GRANULARITY : slice;
+}
+
+// Charge one tick of CPU; returns true if a queued task is now owed the CPU
+static bool fair_tick(cpu_runqueue_t* rq, task_t* current)
+{
+    current->vruntime += ((uint64_t)FAIR_NICE0_WEIGHT * 1024) / fair_weight(current);
+    fair_update_min_vruntime(rq);
+    
+    return rq->fair_heap &&
+           vruntime_before(rq->fair_heap->vruntime + FAIR_WAKEUP_GRAN,
+                           current->vruntime);
+}
+
+// ============================================================================
+// WORK-STEALING DEQUE
+// ============================================================================
+
+static inline int64_t ws_size(ws_deque_t* d)
+{
+    int64_t size = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) -
+                   __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    return size > 0 ? size : 0;
+}
+
+// Owner only: push at the bottom; false if the deque is full
+static bool ws_push(ws_deque_t* d, task_t* task)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    
+    if (b - t >= WS_DEQUE_SIZE) return false;
+    
+    __atomic_store_n(&d->tasks[b & (WS_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Owner only: pop the most recently pushed (cache-warm) task
+static task_t* ws_pop(ws_deque_t* d)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    
+    if (t > b) {
+        // Empty
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    
+    task_t* task = __atomic_load_n(&d->tasks[b & (WS_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (t == b) {
+        // Last element: race any thief for it
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = NULL;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// Node whose memory a task mostly uses: its policy's, else where it ran
+static inline int task_home_node(task_t* task)
+{
+    return task->mem_node >= 0 ? task->mem_node : numa_node_of_cpu(task->last_cpu);
+}
+
+// Any CPU: take the oldest task. With warm_only, only tasks that last ran
+// on the thief are taken; with a node, only tasks whose memory is there.
+// Those filters (and a first affinity check) read a task not yet claimed,
+// so they only decide whether to try: the caller checks the claimed task
+// against the thief's CPU again.
+static task_t* ws_steal(ws_deque_t* d, int thief, bool warm_only, int node)
+{
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    
+    if (t >= b) return NULL;
+    
+    task_t* task = __atomic_load_n(&d->tasks[t & (WS_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!(task->cpu_affinity & (1U << thief))) return NULL;
+    if (warm_only && task->last_cpu != thief) return NULL;
+    if (node != NUMA_NO_NODE && task_home_node(task) != node) return NULL;
+    
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&steal_races, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return task;
+}
+
 // ============================================================================
 // PER-CPU QUEUE MANAGEMENT
 // ============================================================================
 
-static void scheduler_enqueue(int cpu, task_t* task)
+// Priority level a task is queued at (lower value = higher priority)
+static inline int task_prio(task_t* task)
 {
-    cpu_runqueue_t* rq = &cpu_runqueues[cpu];
+    if (task->sched_class == SCHED_CLASS_FAIR) return FAIR_LEVEL;
+    
+    int prio = task->dynamic_priority;
+    if (prio < 0) prio = 0;
+    if (prio >= MAX_PRIO) prio = MAX_PRIO - 1;
+    return prio;
+}
+
+// Highest-priority non-empty level, or -1 if nothing is ready
+static inline int rq_highest_prio(cpu_runqueue_t* rq)
+{
+    for (int w = 0; w < PRIO_BITMAP_WORDS; w++) {
+        if (rq->bitmap[w]) {
+            return w * 64 + __builtin_ctzll(rq->bitmap[w]);
+        }
+    }
+    return -1;
+}
+
+// Best level across both classes; fair tasks win ties at FAIR_LEVEL
+static inline int rq_best_level(cpu_runqueue_t* rq)
+{
+    int prio = rq_highest_prio(rq);
+    if (rq->fair_heap && (prio < 0 || FAIR_LEVEL <= prio)) {
+        return FAIR_LEVEL;
+    }
+    return prio;
+}
+
+// Insert into the priority queues / fair heap; caller holds rq->lock
+static void rq_enqueue_local(cpu_runqueue_t* rq, task_t* task)
+{
+    task_t* current = rq->running_task;
+    int prio = task_prio(task);
     
     task->next = NULL;
     
-    if (!rq->ready_queue_head) {
-        rq->ready_queue_head = rq->ready_queue_tail = task;
+    if (task->sched_class == SCHED_CLASS_FAIR) {
+        // Don't let a long sleeper bank unbounded credit
+        uint64_t floor = rq->min_vruntime - (uint64_t)FAIR_LATENCY * 1024;
+        if (vruntime_before(task->vruntime, floor)) {
+            task->vruntime = floor;
+        }
+        fair_heap_insert(rq, task);
+        
+        if (current && current != task &&
+            current->sched_class == SCHED_CLASS_FAIR &&
+            vruntime_before(task->vruntime + FAIR_WAKEUP_GRAN, current->vruntime)) {
+            rq->need_resched = true;
+        }
     } else {
-        rq->ready_queue_tail->next = task;
-        rq->ready_queue_tail = task;
+        prio_queue_t* q = &rq->queues[prio];
+        if (!q->head) {
+            q->head = q->tail = task;
+            rq->bitmap[prio / 64] |= 1ULL << (prio % 64);
+        } else {
+            q->tail->next = task;
+            q->tail = task;
+        }
     }
     
-    rq->total_tasks++;
-    rq->load++;
+    rq->nr_local++;
+    
+    // Preempt the running task at the next tick if this one outranks it
+    if (current && (prio < task_prio(current) || current == rq->idle_task)) {
+        rq->need_resched = true;
+    }
 }
 
-static task_t* scheduler_dequeue(int cpu)
+// Non-realtime adaptive tasks that may run elsewhere can be spilled to the
+// steal deque (fair tasks stay in the heap so vruntime ordering holds)
+static inline bool task_can_spill(task_t* task, int cpu)
+{
+    return task->sched_class == SCHED_CLASS_ADAPTIVE &&
+           task->priority > PRIORITY_RT_MAX &&
+           (task->cpu_affinity & ~(1U << cpu)) != 0;
+}
+
+static void kick_idle_cpu(int from, task_t* task);
+
+// Caller holds cpu_runqueues[cpu].lock
+static void scheduler_enqueue(int cpu, task_t* task)
 {
     cpu_runqueue_t* rq = &cpu_runqueues[cpu];
     
-    if (!rq->ready_queue_head) return NULL;
+    __atomic_fetch_add(&rq->load, 1, __ATOMIC_RELAXED);
     
-    task_t* task = rq->ready_queue_head;
-    rq->ready_queue_head = task->next;
+    // Enough work queued locally: make the surplus stealable
+    if (rq->nr_local >= SPILL_THRESHOLD && task_can_spill(task, cpu) &&
+        ws_push(&rq->deque, task)) {
+        task->next = NULL;
+        kick_idle_cpu(cpu, task);
+        return;
+    }
     
-    if (!rq->ready_queue_head) {
-        rq->ready_queue_tail = NULL;
+    rq_enqueue_local(rq, task);
+}
+
+// Caller holds cpu_runqueues[cpu].lock
+static task_t* scheduler_dequeue(int cpu)
+{
+    cpu_runqueue_t* rq = &cpu_runqueues[cpu];
+    task_t* task;
+    
+    int prio = rq_highest_prio(rq);
+    if (rq->fair_heap && (prio < 0 || FAIR_LEVEL <= prio)) {
+        task = fair_heap_pop(rq);
+    } else if (prio >= 0) {
+        prio_queue_t* q = &rq->queues[prio];
+        task = q->head;
+        q->head = task->next;
+        
+        if (!q->head) {
+            q->tail = NULL;
+            rq->bitmap[prio / 64] &= ~(1ULL << (prio % 64));
+        }
+        task->next = NULL;
+    } else {
+        return NULL;
     }
     
-    task->next = NULL;
-    rq->load--;
+    rq->nr_local--;
+    __atomic_fetch_sub(&rq->load, 1, __ATOMIC_RELAXED);
     
     return task;
 }
 
+// Pull spilled tasks back from our own deque while the local queues run low
+static void rq_refill_from_deque(cpu_runqueue_t* rq)
+{
+    while (rq->nr_local < SPILL_THRESHOLD) {
+        task_t* task = ws_pop(&rq->deque);
+        if (!task) break;
+        rq_enqueue_local(rq, task);
+    }
+}
+
+// Tickless idle: only CPUs with something to run take scheduler ticks.
+// Caller holds rq->lock.
+static void rq_set_tick(cpu_runqueue_t* rq, bool enabled)
+{
+    if (rq->tick_stopped == !enabled) return;
+    rq->tick_stopped = !enabled;
+    timer_set_tick(enabled);
+}
+
+// New work was queued on cpu (caller holds its lock): true if it needs an
+// IPI to notice. The local CPU can't IPI itself from here, so a restarted
+// tick picks the work up instead.
+static bool rq_needs_kick(int cpu)
+{
+    cpu_runqueue_t* rq = &cpu_runqueues[cpu];
+    
+    if (!rq->need_resched && !rq->tick_stopped) return false;
+    if (cpu == scheduler_get_current_cpu()) {
+        rq_set_tick(rq, true);
+        return false;
+    }
+    return true;
+}
+
 // ============================================================================
 // LOAD BALANCING (Work Stealing)
 // ============================================================================
 
-static void balance_load(int cpu)
+// Kick another CPU so it reschedules now instead of at its next tick
+static void scheduler_kick_cpu(int cpu)
 {
-    cpu_runqueue_t* my_rq = &cpu_runqueues[cpu];
+    if (cpu == scheduler_get_current_cpu()) return;
     
-    // Only balance if we're idle
-    if (my_rq->load > 0) return;
-    
-    // Find busiest CPU
-    int busiest_cpu = -1;
-    uint32_t max_load = 0;
+    percpu_t* pc = smp_get_cpu(cpu);
+    if (pc && pc->online) {
+        lapic_send_ipi(pc->apic_id, APIC_RESCHED_VECTOR);
+    }
+}
+
+// Tickless CPUs only steal when woken: nudge one when work is spilled
+static void kick_idle_cpu(int from, task_t* task)
+{
+    for (int i = 1; i < num_cpus; i++) {
+        int cpu = (from + i) % num_cpus;
+        if ((task->cpu_affinity & (1U << cpu)) &&
+            __atomic_load_n(&cpu_runqueues[cpu].tick_stopped, __ATOMIC_RELAXED)) {
+            scheduler_kick_cpu(cpu);
+            return;
+        }
+    }
+}
+
+// Least-loaded online CPU the task is allowed on. A task with a memory
+// node counts CPUs off that node as one task busier, so it stays near its
+// memory unless the node is clearly more loaded.
+static int select_cpu(task_t* task)
+{
+    int best = -1;
+    uint32_t best_load = 0;
     
     for (int i = 0; i < num_cpus; i++) {
-        if (i == cpu) continue;
+        if (!(task->cpu_affinity & (1U << i))) continue;
         
-        if (cpu_runqueues[i].load > max_load + 1) {  // Worth stealing
-            max_load = cpu_runqueues[i].load;
-            busiest_cpu = i;
+        uint32_t load = __atomic_load_n(&cpu_runqueues[i].load, __ATOMIC_RELAXED);
+        if (task->mem_node >= 0 && numa_node_of_cpu(i) != task->mem_node) {
+            load++;
+        }
+        if (best < 0 || load < best_load) {
+            best = i;
+            best_load = load;
         }
     }
     
-    // Steal a task
-    if (busiest_cpu >= 0 && max_load > 2) {
-        task_t* stolen = scheduler_dequeue(busiest_cpu);
-        if (stolen) {
-            stolen->last_cpu = cpu;
-            scheduler_enqueue(cpu, stolen);
-            load_balances++;
+    return best < 0 ? 0 : best;
+}
+
+// Queue a task on a CPU, taking that CPU's run queue lock
+static void scheduler_enqueue_remote(int cpu, task_t* task)
+{
+    cpu_runqueue_t* rq = &cpu_runqueues[cpu];
+    
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    scheduler_enqueue(cpu, task);
+    bool kick = rq_needs_kick(cpu);
+    spin_unlock_irqrestore(&rq->lock, flags);
+    
+    if (kick) {
+        scheduler_kick_cpu(cpu);
+    }
+}
+
+// A task changes home CPU; the total across CPUs stays the same
+static inline void rq_move_task_count(int from, int to)
+{
+    __atomic_fetch_sub(&cpu_runqueues[from].total_tasks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cpu_runqueues[to].total_tasks, 1, __ATOMIC_RELAXED);
+}
+
+// First queueing of a new task: it is counted on that CPU from now on
+static void scheduler_enqueue_new(int cpu, task_t* task)
+{
+    task->last_cpu = cpu;
+    __atomic_fetch_add(&cpu_runqueues[cpu].total_tasks, 1, __ATOMIC_RELAXED);
+    scheduler_enqueue_remote(cpu, task);
+}
+
+// Make a blocked task runnable again on the CPU it slept on
+static void scheduler_wake_task(task_t* task)
+{
+    int cpu = task->last_cpu;
+    cpu_runqueue_t* rq = &cpu_runqueues[cpu];
+    bool kick = false;
+    
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    if (task->state == TASK_BLOCKED) {
+        if (rq->running_task == task) {
+            // Still on its way into scheduler_schedule(): just don't block
+            task->state = TASK_RUNNING;
+        } else {
+            task->state = TASK_READY;
+            scheduler_enqueue(cpu, task);
+            kick = rq_needs_kick(cpu);
+        }
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+    
+    if (kick) {
+        scheduler_kick_cpu(cpu);
+    }
+}
+
+// Idle CPU: take the oldest spilled task from another CPU's deque.
+// The first pass only accepts tasks that last ran here (still cache-warm),
+// the second (with more than one node) tasks whose memory is on this node.
+// A claimed task this CPU may not run is handed back through *bounced, to
+// be queued elsewhere once the caller has dropped its run queue lock.
+static task_t* steal_work(int cpu, task_t** bounced)
+{
+    int node = numa_node_of_cpu(cpu);
+    
+    for (int pass = 0; pass < 3; pass++) {
+        if (pass == 1 && numa_node_count() == 1) continue;
+        
+        for (int i = 1; i < num_cpus; i++) {
+            int victim = (cpu + i) % num_cpus;
+            cpu_runqueue_t* vrq = &cpu_runqueues[victim];
+            
+            if (ws_size(&vrq->deque) == 0) continue;
+            
+            __atomic_fetch_add(&steal_attempts, 1, __ATOMIC_RELAXED);
+            task_t* task = ws_steal(&vrq->deque, cpu, pass == 0,
+                                    pass == 1 ? node : NUMA_NO_NODE);
+            if (!task) continue;
             
-            KDEBUG("CPU %d stole task %lu from CPU %d", 
-                   cpu, stolen->id, busiest_cpu);
+            __atomic_fetch_sub(&vrq->load, 1, __ATOMIC_RELAXED);
+            if (!(task->cpu_affinity & (1U << cpu))) {
+                __atomic_fetch_sub(&vrq->total_tasks, 1, __ATOMIC_RELAXED);
+                *bounced = task;
+                return NULL;
+            }
+            rq_move_task_count(victim, cpu);
+            cpu_runqueues[cpu].steals++;
+            TRACE(TRACE_SCHED_STEAL, task->id, victim);
+            return task;
         }
     }
+    return NULL;
 }
 
 // ============================================================================
 // ENHANCED SCHEDULER INITIALIZATION
 // ============================================================================
 
+// Idle task that stands in as running_task while a CPU has nothing to do
+static task_t* create_idle_task(int cpu)
+{
+    task_t* idle_task = kmalloc_tracked(sizeof(task_t), "idle_task");
+    if (!idle_task) {
+        return NULL;
+    }
+    
+    idle_task->id = __atomic_fetch_add(&next_task_id, 1, __ATOMIC_RELAXED);
+    idle_task->state = TASK_RUNNING;
+    idle_task->stack_top = NULL;     // Runs on the CPU's boot stack
+    idle_task->stack_bottom = NULL;
+    idle_task->kstack_top = 0;
+    idle_task->priority = PRIORITY_IDLE;
+    idle_task->dynamic_priority = PRIORITY_IDLE;
+    idle_task->sched_class = SCHED_CLASS_ADAPTIVE;
+    idle_task->vruntime = 0;
+    idle_task->heap_child = NULL;
+    idle_task->heap_sibling = NULL;
+    idle_task->workload = WORKLOAD_INTERACTIVE;
+    idle_task->time_slice = QUANTUM_INTERACTIVE;
+    idle_task->ticks_remaining = idle_task->time_slice;
+    idle_task->cpu_time = 0;
+    idle_task->io_wait_time = 0;
+    idle_task->last_run = 0;
+    idle_task->voluntary_yields = 0;
+    idle_task->cpu_affinity = 1U << cpu;  // Never migrates
+    idle_task->last_cpu = cpu;
+    idle_task->mem_node = NUMA_NO_NODE;
+    idle_task->vm_context = NULL;
+    idle_task->exit_notify = NULL;
+    idle_task->on_cpu = true;  // Already executing on this CPU's boot stack
+    idle_task->fpu_state = NULL;
+    idle_task->fpu_alloc = NULL;
+    idle_task->fpu_cpu = -1;
+    memset(&idle_task->pmu, 0, sizeof(idle_task->pmu));
+    idle_task->next = NULL;
+    
+    return idle_task;
+}
+
 void scheduler_init(void)
 {
     KINFO("Initializing Adaptive Quantum Scheduler...");
     
-    // Detect number of CPUs (simplified - would use ACPI/MP tables)
-    num_cpus = 1;  // Start with 1, will add SMP support later
+    // Only the BSP runs until smp_init() brings APs online
+    num_cpus = 1;
     
     // Initialize all CPU run queues
-    for (int i = 0; i < num_cpus; i++) {
+    for (int i = 0; i < MAX_CPUS; i++) {
         cpu_runqueue_t* rq = &cpu_runqueues[i];
-        rq->ready_queue_head = NULL;
-        rq->ready_queue_tail = NULL;
+        spin_lock_init(&rq->lock);
+        for (int p = 0; p < MAX_PRIO; p++) {
+            rq->queues[p].head = NULL;
+            rq->queues[p].tail = NULL;
+        }
+        for (int w = 0; w < PRIO_BITMAP_WORDS; w++) {
+            rq->bitmap[w] = 0;
+        }
         rq->running_task = NULL;
+        rq->idle_task = NULL;
+        rq->tick_stopped = false;
+        rq->prev_task = NULL;
+        rq->fpu_owner = NULL;
+        rq->active_mm = NULL;
+        rq->mm_drop = NULL;
+        rq->need_resched = false;
+        rq->nr_local = 0;
+        rq->deque.top = 0;
+        rq->deque.bottom = 0;
+        rq->steals = 0;
+        rq->migrations = 0;
+        rq->fair_heap = NULL;
+        rq->fair_count = 0;
+        rq->min_vruntime = 0;
         rq->total_tasks = 0;
         rq->idle_time = 0;
         rq->busy_time = 0;
@@ -246,44 +845,90 @@ void scheduler_init(void)
     }
     
     // Create idle task for CPU 0
-    task_t* idle_task = kmalloc_tracked(sizeof(task_t), "idle_task");
+    task_t* idle_task = create_idle_task(0);
     if (!idle_task) {
         PANIC("Failed to allocate idle task");
     }
     
-    idle_task->id = next_task_id++;
-    idle_task->state = TASK_RUNNING;
-    idle_task->priority = PRIORITY_BATCH;  // Lowest priority
-    idle_task->dynamic_priority = PRIORITY_BATCH;
-    idle_task->workload = WORKLOAD_INTERACTIVE;
-    idle_task->time_slice = QUANTUM_INTERACTIVE;
-    idle_task->ticks_remaining = idle_task->time_slice;
-    idle_task->cpu_affinity = 0x1;  // CPU 0 only
-    idle_task->last_cpu = 0;
-    
     cpu_runqueues[0].running_task = idle_task;
+    cpu_runqueues[0].idle_task = idle_task;
     
     KINFO("Scheduler initialized:");
     KINFO("  ├─ CPUs: %d", num_cpus);
+    KINFO("  ├─ Run queues: %d priority levels (bitmap pick)", MAX_PRIO);
     KINFO("  ├─ Workload detection: Enabled");
     KINFO("  ├─ Time quanta:");
     KINFO("  │  ├─ Interactive: %lu ms", QUANTUM_INTERACTIVE);
     KINFO("  │  ├─ Compute: %lu ms", QUANTUM_COMPUTE);
     KINFO("  │  ├─ I/O: %lu ms", QUANTUM_IO);
     KINFO("  │  └─ Realtime: %lu ms", QUANTUM_REALTIME);
-    KINFO("  └─ Load balancing: Work stealing");
+    KINFO("  ├─ Fair class: vruntime, %d tick latency", FAIR_LATENCY);
+    KINFO("  └─ Load balancing: Work stealing (spill after %d queued)", SPILL_THRESHOLD);
+}
+
+// Called by each AP once its LAPIC is up; the CPU starts taking work on
+// its next timer tick
+int scheduler_cpu_online(int cpu)
+{
+    if (cpu <= 0 || cpu >= MAX_CPUS) return -1;
+    
+    task_t* idle_task = create_idle_task(cpu);
+    if (!idle_task) {
+        KERROR("No memory for CPU %d idle task", cpu);
+        return -1;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&cpu_runqueues[cpu].lock);
+    cpu_runqueues[cpu].running_task = idle_task;
+    cpu_runqueues[cpu].idle_task = idle_task;
+    spin_unlock_irqrestore(&cpu_runqueues[cpu].lock, flags);
+    
+    // APs come up one at a time, in order
+    __atomic_store_n(&num_cpus, cpu + 1, __ATOMIC_RELEASE);
+    
+    KINFO("CPU %d joined the scheduler", cpu);
+    return 0;
 }
 
 // ============================================================================
 // ENHANCED TASK CREATION
 // ============================================================================
 
+// Frame that switch_context() pops on a task's first run: r15..rbx, then a
+// return into the trampoline, which finds its arguments in rbx and r12
+static uint64_t* build_switch_frame(uint64_t* top, void (*trampoline)(void),
+                                    uint64_t rbx, uint64_t r12)
+{
+    uint64_t* sp = top;
+    
+    *(--sp) = 0;                      // Alignment pad
+    *(--sp) = (uint64_t)trampoline;   // Return address
+    *(--sp) = rbx;
+    *(--sp) = 0;                      // rbp
+    *(--sp) = r12;
+    *(--sp) = 0;                      // r13
+    *(--sp) = 0;                      // r14
+    *(--sp) = 0;                      // r15
+    
+    return sp;
+}
+
 pid_t scheduler_create_task(process_entry_t entry, void* arg, 
                             size_t stack_size, int priority, const char* name)
+{
+    return scheduler_create_task_ex(entry, arg, stack_size, priority, name, 0);
+}
+
+pid_t scheduler_create_task_ex(process_entry_t entry, void* arg,
+                               size_t stack_size, int priority, const char* name,
+                               uint32_t flags)
 {
     if (!entry || stack_size < PAGE_SIZE) {
         return -1;
     }
+    if (priority >= PRIORITY_IDLE) {
+        priority = PRIORITY_IDLE - 1;  // The idle level is the idle tasks' alone
+    }
     
     // Allocate task structure
     task_t* task = kmalloc_tracked(sizeof(task_t), "task");
@@ -299,67 +944,88 @@ pid_t scheduler_create_task(process_entry_t entry, void* arg,
     }
     
     // Initialize task
-    task->id = next_task_id++;
+    task->id = __atomic_fetch_add(&next_task_id, 1, __ATOMIC_RELAXED);
     task->state = TASK_READY;
     task->stack_bottom = stack;
     task->stack_top = (uint64_t*)((uintptr_t)stack + stack_size);
+    task->kstack_top = (uintptr_t)task->stack_top;
     task->priority = priority;
     task->dynamic_priority = priority;
     task->workload = WORKLOAD_INTERACTIVE;  // Default
-    task->time_slice = get_time_quantum(task->workload);
+    task->sched_class = (flags & SCHED_FLAG_FAIR) ? SCHED_CLASS_FAIR
+                                                  : SCHED_CLASS_ADAPTIVE;
+    task->vruntime = cpu_runqueues[0].min_vruntime;  // Start level with peers
+    task->heap_child = NULL;
+    task->heap_sibling = NULL;
+    task->time_slice = (task->sched_class == SCHED_CLASS_FAIR)
+                       ? fair_time_slice(&cpu_runqueues[0])
+                       : get_time_quantum(task->workload);
     task->ticks_remaining = task->time_slice;
     task->cpu_time = 0;
     task->io_wait_time = 0;
     task->voluntary_yields = 0;
-    task->cpu_affinity = 0xFFFFFFFF;  // Can run on any CPU
+    task->cpu_affinity = (flags & SCHED_FLAG_BOUND) ? 1U << ((flags >> 8) & 0x1F)
+                                                    : 0xFFFFFFFF;  // Can run on any CPU
     task->last_cpu = 0;
+    task->mem_node = NUMA_NO_NODE;
     task->vm_context = NULL;  // Would allocate VM context
+    task->exit_notify = NULL;
+    task->on_cpu = false;
+    task->fpu_state = NULL;
+    task->fpu_alloc = NULL;
+    task->fpu_cpu = -1;
+    memset(&task->pmu, 0, sizeof(task->pmu));
     task->next = NULL;
     
-    // Set up initial stack frame
-    uint64_t* sp = task->stack_top - 16;  // Reserve space
-    
-    // Push entry point
-    *(--sp) = (uint64_t)entry;
-    *(--sp) = 0x08;  // CS
-    *(--sp) = 0x202; // RFLAGS (interrupts enabled)
-    *(--sp) = (uint64_t)sp + 8;  // RSP
-    *(--sp) = 0x10;  // SS
-    
-    task->stack_top = sp;
+    // First switch_context() into this task lands in entry(arg)
+    task->stack_top = build_switch_frame(task->stack_top, task_entry_trampoline,
+                                         (uint64_t)entry, (uint64_t)arg);
     
-    // Add to appropriate CPU run queue
-    int target_cpu = 0;  // Simple: always CPU 0 for now
-    scheduler_enqueue(target_cpu, task);
+    // Add to the least-loaded allowed CPU
+    int target_cpu = select_cpu(task);
+    scheduler_enqueue_new(target_cpu, task);
     
-    KINFO("Created task %lu: %s (priority %d, cpu %d)", 
-          task->id, name ? name : "unnamed", priority, target_cpu);
+    KINFO("Created task %lu: %s (priority %d, cpu %d%s)", 
+          task->id, name ? name : "unnamed", priority, target_cpu,
+          task->sched_class == SCHED_CLASS_FAIR ? ", fair" : "");
     
     return (pid_t)task->id;
 }
 
-// Create a user task (Ring 3)
-pid_t scheduler_create_user_task(void* entry, void* user_stack)
+// Create a user task (Ring 3) in vm, whose reference it takes over even on
+// failure; with no vm it runs in whatever address space is loaded
+pid_t scheduler_create_user_task(vm_context_t* vm, void* entry, void* user_stack,
+                                 task_exit_t* notify)
 {
     // Allocate task structure
     task_t* task = kmalloc_tracked(sizeof(task_t), "user_task");
-    if (!task) return -1;
+    if (!task) {
+        vmm_context_put(vm);
+        return -1;
+    }
     
-    // Allocate kernel stack for this task (used during interrupts/syscalls)
-    size_t kstack_size = 4096; // 4KB kernel stack
+    // Kernel stack for interrupts and syscalls: execve() runs the ELF
+    // loader and its disk reads on it
+    size_t kstack_size = 16384;
     void* kstack = kmalloc_tracked(kstack_size, "kernel_stack");
     if (!kstack) {
         kfree_tracked(task);
+        vmm_context_put(vm);
         return -1;
     }
     
     // Initialize task
-    task->id = next_task_id++;
+    task->id = __atomic_fetch_add(&next_task_id, 1, __ATOMIC_RELAXED);
     task->state = TASK_READY;
     task->stack_bottom = kstack;
     task->stack_top = (uint64_t*)((uintptr_t)kstack + kstack_size);
+    task->kstack_top = (uintptr_t)task->stack_top;
     task->priority = PRIORITY_NORMAL;
     task->dynamic_priority = PRIORITY_NORMAL;
+    task->sched_class = SCHED_CLASS_ADAPTIVE;
+    task->vruntime = 0;
+    task->heap_child = NULL;
+    task->heap_sibling = NULL;
     task->workload = WORKLOAD_INTERACTIVE;
     task->time_slice = QUANTUM_INTERACTIVE;
     task->ticks_remaining = task->time_slice;
@@ -368,29 +1034,22 @@ pid_t scheduler_create_user_task(void* entry, void* user_stack)
     task->voluntary_yields = 0;
     task->cpu_affinity = 0xFFFFFFFF;
     task->last_cpu = 0;
-    task->vm_context = NULL; // Should share current VM context for now (threads) or new one
+    task->mem_node = NUMA_NO_NODE;
+    task->vm_context = vm;
+    task->exit_notify = notify;
+    task->on_cpu = false;
+    task->fpu_state = NULL;
+    task->fpu_alloc = NULL;
+    task->fpu_cpu = -1;
+    memset(&task->pmu, 0, sizeof(task->pmu));
     task->next = NULL;
     
-    // Set up initial kernel stack frame for iretq to user mode
-    // When the scheduler switches to this task, it will pop registers and 'iretq'
-    // But wait, our context switch (switch_to_user_mode) is manual for now.
-    // For a proper scheduler integration, we need the kernel stack to look like
-    // it was interrupted from user mode.
-    
-    // However, for this first step (usertest), we are manually switching.
-    // But if we want the scheduler to pick it up, we need to set it up right.
-    
-    // For now, let's just register it so it shows up in stats, 
-    // but the actual switch happens via switch_to_user_mode called manually.
-    // If we want to schedule it, we'd need a proper context switch routine that handles Ring 3.
-    
-    // Let's just add it to the queue so it's tracked.
-    // Note: This task won't actually run correctly via standard scheduler_schedule 
-    // unless we update the context switch logic to handle Ring 3 return.
-    // But for 'usertest', we manually switch.
+    // First switch_context() into this task irets to entry in ring 3
+    task->stack_top = build_switch_frame(task->stack_top, task_user_trampoline,
+                                         (uint64_t)entry, (uint64_t)user_stack);
     
     // Add to CPU 0 queue
-    scheduler_enqueue(0, task);
+    scheduler_enqueue_new(0, task);
     
     KINFO("Created user task %lu", task->id);
     return (pid_t)task->id;
@@ -400,15 +1059,20 @@ pid_t scheduler_create_user_task(void* entry, void* user_stack)
 // TIMER TICK HANDLER
 // ============================================================================
 
+// Runs on every CPU from its own LAPIC timer (or the PIT before SMP)
 void scheduler_tick(void)
 {
-    global_ticks++;
-    
-    int cpu = 0;  // Current CPU (would get from APIC)
+    int cpu = scheduler_get_current_cpu();
     cpu_runqueue_t* rq = &cpu_runqueues[cpu];
+    
+    rcu_note_qs();  // Ticks only arrive with interrupts on: no read section
+    spin_lock(&rq->lock);  // Interrupt context: IF already clear
     task_t* current = rq->running_task;
     
-    if (!current) return;
+    if (!current) {
+        spin_unlock(&rq->lock);
+        return;
+    }
     
     // Update statistics
     current->cpu_time++;
@@ -419,23 +1083,164 @@ void scheduler_tick(void)
         current->ticks_remaining--;
     }
     
+    // Fair tasks are preempted once a queued task falls behind in vruntime
+    if (current->sched_class == SCHED_CLASS_FAIR && fair_tick(rq, current)) {
+        rq->need_resched = true;
+    }
+    
     // Time slice expired?
     if (current->ticks_remaining == 0) {
         // Re-detect workload
         current->workload = detect_workload(current);
         
         // Assign new time slice
-        current->time_slice = get_time_quantum(current->workload);
+        current->time_slice = (current->sched_class == SCHED_CLASS_FAIR)
+                              ? fair_time_slice(rq)
+                              : get_time_quantum(current->workload);
         current->ticks_remaining = current->time_slice;
         
         // Trigger reschedule
+        rq->need_resched = true;
+    }
+    
+    // Slice expired, or a higher-priority task became ready: preempt now.
+    // An idle CPU also reschedules, to steal work or go tickless.
+    bool resched = rq->need_resched || current == rq->idle_task;
+    spin_unlock(&rq->lock);
+    
+    if (resched) {
         scheduler_schedule();
     }
+}
+
+// ============================================================================
+// CONTEXT SWITCH
+// ============================================================================
+
+// Called with cpu_runqueues[cpu].lock held and interrupts off. The lock
+// stays held across the stack switch and is dropped by whichever task
+// runs next, in scheduler_finish_switch().
+static void context_switch(int cpu, task_t* prev, task_t* next)
+{
+    cpu_runqueue_t* rq = &cpu_runqueues[cpu];
+    
+    // A task stolen or woken from another CPU may still be saving its
+    // registers there
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE)) {
+        __asm__ volatile("pause");
+    }
+    next->on_cpu = true;
+    
+    // Charge prev what the counters moved since it was switched in
+    pmu_account(prev ? &prev->pmu : NULL);
+    
+    // Kernel threads run on whatever address space is already loaded
+    if (next->vm_context && next->vm_context != rq->active_mm) {
+        vmm_switch_context(next->vm_context);
+        vmm_context_get(next->vm_context);
+        rq->mm_drop = rq->active_mm;
+        rq->active_mm = next->vm_context;
+        __atomic_fetch_add(&cr3_switches, 1, __ATOMIC_RELAXED);
+    }
+    
+    // Lazy FPU: TS is clear only if prev touched the FPU this slice, so
+    // only then is there anything to save. Next traps on its first use,
+    // unless its state never left this CPU's registers.
+    if (!(read_cr0() & CR0_TS) && prev && prev->fpu_state) {
+        fpu_save(prev->fpu_state);
+    }
+    if (rq->fpu_owner == next && next->fpu_cpu == cpu) {
+        fpu_clts();
+    } else {
+        fpu_stts();
+    }
+    
+    // Stack SYSCALL and ring 3 interrupts switch to (the idle task never
+    // enters ring 3)
+    if (next->kstack_top && percpu_ready) {
+        this_cpu()->kernel_rsp = next->kstack_top;
+        tss_set_rsp0(cpu, next->kstack_top);
+    }
+    
+    rq->prev_task = prev;
+    switch_context(prev ? &prev->stack_top : &discarded_sp, next->stack_top);
+    
+    scheduler_finish_switch();
+}
+
+// Runs on the incoming task's stack right after switch_context()
+void scheduler_finish_switch(void)
+{
+    cpu_runqueue_t* rq = &cpu_runqueues[scheduler_get_current_cpu()];
+    task_t* prev = rq->prev_task;
+    vm_context_t* drop = rq->mm_drop;
+    
+    rq->prev_task = NULL;
+    rq->mm_drop = NULL;
+    if (prev) {
+        // Its stack pointer is saved: other CPUs may now run it
+        __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+    }
+    spin_unlock(&rq->lock);
+    
+    // Out of CR3 here: the last reference may queue its teardown
+    vmm_context_put(drop);
+}
+
+// Device-not-available (#NM): first FPU/SSE instruction since CR0.TS was set
+void scheduler_fpu_trap(void)
+{
+    int cpu = scheduler_get_current_cpu();
+    cpu_runqueue_t* rq = &cpu_runqueues[cpu];
+    task_t* current = rq->running_task;
+    
+    fpu_clts();
+    if (!current || (rq->fpu_owner == current && current->fpu_cpu == cpu)) {
+        return;
+    }
+    
+    // The previous owner's state was saved when it was switched out
+    if (!current->fpu_state) {
+        current->fpu_alloc = kmalloc_tracked(fpu_state_size + FPU_STATE_ALIGN,
+                                             "fpu_state");
+        if (!current->fpu_alloc) {
+            PANIC("No memory for FPU state");
+        }
+        current->fpu_state = (uint8_t*)ALIGN_UP((uintptr_t)current->fpu_alloc,
+                                                FPU_STATE_ALIGN);
+        memset(current->fpu_state, 0, fpu_state_size);  // XRSTOR faults on a dirty XSAVE header
+        fpu_init_state();
+    } else {
+        fpu_restore(current->fpu_state);
+    }
+    
+    rq->fpu_owner = current;
+    current->fpu_cpu = cpu;
+    __atomic_fetch_add(&fpu_restores, 1, __ATOMIC_RELAXED);
+}
+
+// Kernel SIMD. The running task's live state is saved and ownership
+// dropped, so whoever next uses the FPU here reloads theirs through #NM.
+// Interrupts stay off until kernel_fpu_end(): keep the section short.
+uint64_t kernel_fpu_begin(void)
+{
+    uint64_t flags = irq_save();
+    cpu_runqueue_t* rq = &cpu_runqueues[scheduler_get_current_cpu()];
+    task_t* current = rq->running_task;
     
-    // Periodic load balancing (every 100 ticks)
-    if (global_ticks % 100 == 0) {
-        balance_load(cpu);
+    if (!(read_cr0() & CR0_TS)) {
+        if (current && current->fpu_state) fpu_save(current->fpu_state);
+    } else {
+        fpu_clts();
     }
+    rq->fpu_owner = NULL;
+    return flags;
+}
+
+void kernel_fpu_end(uint64_t flags)
+{
+    fpu_stts();
+    irq_restore(flags);
 }
 
 // ============================================================================
@@ -444,18 +1249,58 @@ void scheduler_tick(void)
 
 void scheduler_schedule(void)
 {
-    int cpu = 0;  // Current CPU
+    uint64_t flags = irq_save();
+    int cpu = scheduler_get_current_cpu();
     cpu_runqueue_t* rq = &cpu_runqueues[cpu];
+    rcu_note_qs();  // Read sections never block or yield
+    spin_lock(&rq->lock);
     task_t* current = rq->running_task;
     
-    // Get next task
-    task_t* next = scheduler_dequeue(cpu);
+    bool preempt = rq->need_resched;
+    rq->need_resched = false;
+    
+    rq_refill_from_deque(rq);
+    
+    int best = rq_best_level(rq);
+    if (best < 0) {
+        // Nothing queued here: steal, or keep running current (or idle)
+        task_t* bounced = NULL;
+        task_t* stolen = steal_work(cpu, &bounced);
+        if (!stolen) {
+            if (current == rq->idle_task) {
+                rq_set_tick(rq, false);
+            }
+            spin_unlock_irqrestore(&rq->lock, flags);
+            if (bounced) {
+                // Claimed but not allowed here: queue it where it may run
+                scheduler_enqueue_new(select_cpu(bounced), bounced);
+            }
+            return;
+        }
+        scheduler_enqueue(cpu, stolen);
+        best = rq_best_level(rq);
+    }
+    
+    // A running task with slice left keeps the CPU unless something
+    // strictly higher priority is waiting; equal priorities round-robin
+    if (current && current->state == TASK_RUNNING &&
+        current->ticks_remaining > 0 && task_prio(current) < best) {
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
+    }
     
-    if (!next) {
-        // No tasks ready, run idle
+    // Between fair tasks only a vruntime-based preemption cuts a slice short
+    if (current && current->state == TASK_RUNNING &&
+        current->ticks_remaining > 0 && !preempt &&
+        current->sched_class == SCHED_CLASS_FAIR && best == FAIR_LEVEL &&
+        rq->fair_heap) {
+        spin_unlock_irqrestore(&rq->lock, flags);
         return;
     }
     
+    // Get next task
+    task_t* next = scheduler_dequeue(cpu);
+    
     // Save current task if still runnable
     if (current && current->state == TASK_RUNNING) {
         current->state = TASK_READY;
@@ -463,18 +1308,23 @@ void scheduler_schedule(void)
     }
     
     // Switch to next task
+    if (next->last_cpu != cpu) {
+        rq->migrations++;
+    }
     next->state = TASK_RUNNING;
-    next->last_run = global_ticks;
+    next->last_run = timer_get_ticks();
     next->last_cpu = cpu;
     rq->running_task = next;
+    rq_set_tick(rq, next != rq->idle_task);
     
-    context_switches++;
+    __atomic_fetch_add(&context_switches, 1, __ATOMIC_RELAXED);
     
-    KDEBUG("Context switch: %lu -> %lu (workload: %d)", 
-           current ? current->id : 0, next->id, next->workload);
+    TRACE(TRACE_SCHED_SWITCH, current ? current->id : 0, next->id);
     
-    // Would perform actual context switch here
-    // __asm__ switch_context(current, next);
+    // Returns once something switches back to current; the run queue lock
+    // was released on the other side, possibly on a different CPU
+    context_switch(cpu, current, next);
+    irq_restore(flags);
 }
 
 // ============================================================================
@@ -483,7 +1333,7 @@ void scheduler_schedule(void)
 
 void scheduler_yield(void)
 {
-    int cpu = 0;
+    int cpu = scheduler_get_current_cpu();
     cpu_runqueue_t* rq = &cpu_runqueues[cpu];
     task_t* current = rq->running_task;
     
@@ -497,10 +1347,295 @@ void scheduler_yield(void)
 
 void schedule_delay(uint32_t ms)
 {
-    uint64_t target = global_ticks + ms;
-    while (global_ticks < target) {
-        scheduler_yield();
+    scheduler_sleep_us((uint64_t)ms * 1000);
+}
+
+void schedule_delay_us(uint64_t us)
+{
+    scheduler_sleep_us(us);
+}
+
+// ============================================================================
+// WAIT QUEUES
+// ============================================================================
+
+void wait_queue_init(wait_queue_t* wq)
+{
+    spin_lock_init(&wq->lock);
+    wq->head = NULL;
+}
+
+// Caller holds entry->wq->lock (if any)
+static void wait_complete(wait_entry_t* entry, bool timed_out)
+{
+    if (entry->queued) {
+        wait_entry_t** link = &entry->wq->head;
+        while (*link && *link != entry) {
+            link = &(*link)->next;
+        }
+        if (*link) {
+            *link = entry->next;
+        }
+        entry->queued = false;
     }
+    
+    entry->timed_out = timed_out;
+    entry->done = true;
+    if (entry->task) {
+        scheduler_wake_task(entry->task);
+    } else {
+        scheduler_kick_cpu(entry->cpu);  // Out of its hlt
+    }
+}
+
+// Timer wheel callback for a waiter's deadline (interrupt context)
+static void wait_timeout(void* arg)
+{
+    wait_entry_t* entry = arg;
+    wait_queue_t* wq = entry->wq;
+    
+    if (!wq) {
+        wait_complete(entry, true);
+        return;
+    }
+    
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    if (!entry->done) {
+        wait_complete(entry, true);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Queue the current task on wq (FIFO) and mark it blocked; the caller
+// re-checks its condition before wait_schedule(), so a wakeup that races
+// with the check only turns the block into a no-op
+void wait_prepare(wait_queue_t* wq, wait_entry_t* entry)
+{
+    cpu_runqueue_t* rq = &cpu_runqueues[scheduler_get_current_cpu()];
+    task_t* current = rq->running_task;
+    
+    // The idle task (and early boot) have nothing to switch to
+    entry->task = (current && current != rq->idle_task) ? current : NULL;
+    entry->cpu = scheduler_get_current_cpu();
+    entry->wq = wq;
+    entry->next = NULL;
+    entry->queued = false;
+    entry->done = false;
+    entry->timed_out = false;
+    entry->func = NULL;
+    
+    uint64_t flags = wq ? spin_lock_irqsave(&wq->lock) : irq_save();
+    if (wq) {
+        wait_entry_t** link = &wq->head;
+        while (*link) {
+            link = &(*link)->next;
+        }
+        *link = entry;
+        entry->queued = true;
+    }
+    if (entry->task) {
+        entry->task->state = TASK_BLOCKED;
+    }
+    if (wq) {
+        spin_unlock_irqrestore(&wq->lock, flags);
+    } else {
+        irq_restore(flags);
+    }
+}
+
+// Sleep until woken or deadline_us (WAIT_FOREVER for none).
+// Returns 0 if woken, -1 on timeout.
+int wait_schedule(wait_entry_t* entry, uint64_t deadline_us)
+{
+    if (deadline_us != WAIT_FOREVER) {
+        ktimer_init(&entry->timer, wait_timeout, entry);
+        ktimer_arm(&entry->timer, deadline_us);
+    }
+    
+    if (entry->task) {
+        while (entry->task->state == TASK_BLOCKED) {
+            scheduler_schedule();
+        }
+    } else {
+        // Can't block: halt between interrupts until woken or timed out
+        while (!entry->done) {
+            uint64_t flags = irq_save();
+            irq_restore(flags);
+            if (flags & 0x200) {
+                __asm__ volatile("hlt");
+            } else {
+                __asm__ volatile("pause");
+                if (deadline_us != WAIT_FOREVER && time_monotonic_us() >= deadline_us) {
+                    break;
+                }
+            }
+        }
+    }
+    
+    if (deadline_us != WAIT_FOREVER) {
+        ktimer_cancel(&entry->timer);
+    }
+    return entry->timed_out || !entry->done ? -1 : 0;
+}
+
+// Leave the queue if no wakeup did it for us, and run normally again
+void wait_finish(wait_entry_t* entry)
+{
+    wait_queue_t* wq = entry->wq;
+    uint64_t flags = wq ? spin_lock_irqsave(&wq->lock) : irq_save();
+    
+    if (entry->queued) {
+        entry->done = true;  // Keep a late timeout from waking us
+        wait_entry_t** link = &wq->head;
+        while (*link && *link != entry) {
+            link = &(*link)->next;
+        }
+        if (*link) {
+            *link = entry->next;
+        }
+        entry->queued = false;
+    }
+    if (entry->task) {
+        entry->task->state = TASK_RUNNING;
+    }
+    
+    if (wq) {
+        spin_unlock_irqrestore(&wq->lock, flags);
+    } else {
+        irq_restore(flags);
+    }
+}
+
+// Wake up to nr sleepers (-1: all); every watcher hears about it
+static void wake_up_nr(wait_queue_t* wq, int nr)
+{
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    wait_entry_t** link = &wq->head;
+    while (*link) {
+        wait_entry_t* entry = *link;
+        if (entry->func || nr == 0) {
+            if (entry->func) entry->func(entry);
+            link = &entry->next;
+            continue;
+        }
+        nr--;
+        wait_complete(entry, false);  // Unlinks it: *link is the next one
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void wake_up(wait_queue_t* wq)
+{
+    wake_up_nr(wq, -1);
+}
+
+void wake_up_one(wait_queue_t* wq)
+{
+    wake_up_nr(wq, 1);
+}
+
+/*
+ * Wake the first sleeper on wq and, when the caller is itself about to
+ * block (wait_prepare() done) and the sleeper last ran on this CPU, switch
+ * straight to it without a trip through the run queue. A synchronous call
+ * or reply then costs one context switch. True if the CPU was handed over;
+ * the caller runs again once its own wait is woken.
+ */
+bool wake_up_sync(wait_queue_t* wq)
+{
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    wait_entry_t* entry = wq->head;
+    while (entry && entry->func) {
+        entry = entry->next;
+    }
+    if (!entry || !entry->task) {
+        spin_unlock_irqrestore(&wq->lock, flags);
+        if (entry) wake_up_one(wq);  // A sleeper that can't block: kick its CPU
+        return false;
+    }
+    
+    // Complete it here, minus the enqueue: a late timeout sees done
+    task_t* next = entry->task;
+    wait_entry_t** link = &wq->head;
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    entry->queued = false;
+    entry->timed_out = false;
+    entry->done = true;
+    spin_unlock(&wq->lock);
+    
+    int cpu = scheduler_get_current_cpu();
+    cpu_runqueue_t* rq = &cpu_runqueues[cpu];
+    spin_lock(&rq->lock);
+    task_t* current = rq->running_task;
+    
+    if (!current || current == rq->idle_task || current->state != TASK_BLOCKED ||
+        next->state != TASK_BLOCKED || next->last_cpu != cpu || next->on_cpu) {
+        spin_unlock_irqrestore(&rq->lock, flags);
+        scheduler_wake_task(next);
+        return false;
+    }
+    
+    next->state = TASK_RUNNING;
+    next->last_run = timer_get_ticks();
+    rq->running_task = next;
+    rq_set_tick(rq, true);
+    
+    __atomic_fetch_add(&context_switches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&direct_switches, 1, __ATOMIC_RELAXED);
+    
+    context_switch(cpu, current, next);
+    irq_restore(flags);
+    return true;
+}
+
+// Watchers go in front, so sleepers further back don't slow their wakeups
+void wait_add_watch(wait_queue_t* wq, wait_entry_t* entry, wait_func_t func, void* data)
+{
+    entry->task = NULL;
+    entry->wq = wq;
+    entry->func = func;
+    entry->data = data;
+    entry->done = false;
+    entry->timed_out = false;
+
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    entry->next = wq->head;
+    wq->head = entry;
+    entry->queued = true;
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Once this returns, func is not running and won't be called again
+void wait_remove_watch(wait_entry_t* entry)
+{
+    wait_queue_t* wq = entry->wq;
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    if (entry->queued) {
+        wait_entry_t** link = &wq->head;
+        while (*link && *link != entry) {
+            link = &(*link)->next;
+        }
+        if (*link) {
+            *link = entry->next;
+        }
+        entry->queued = false;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void scheduler_sleep_us(uint64_t us)
+{
+    uint64_t deadline = time_monotonic_us() + us;
+    wait_entry_t wait;
+    
+    do {
+        wait_prepare(NULL, &wait);
+        wait_schedule(&wait, deadline);
+        wait_finish(&wait);
+    } while (time_monotonic_us() < deadline);
 }
 
 // ============================================================================
@@ -510,17 +1645,35 @@ void schedule_delay(uint32_t ms)
 void scheduler_get_stats(void)
 {
     KINFO("=== Scheduler Statistics ===");
-    KINFO("Global ticks: %lu", global_ticks);
+    KINFO("CPUs online: %d", num_cpus);
+    KINFO("Global ticks: %lu", timer_get_ticks());
     KINFO("Context switches: %lu", context_switches);
-    KINFO("Load balances: %lu", load_balances);
+    KINFO("  CR3 reloads: %lu%s", cr3_switches, cpu_has_pcid() ? " (PCID)" : "");
+    KINFO("  Lazy FPU loads: %lu", fpu_restores);
+    KINFO("  Direct handoffs: %lu", direct_switches);
+    uint64_t steals = 0, migrations = 0;
+    for (int i = 0; i < num_cpus; i++) {
+        steals += cpu_runqueues[i].steals;
+        migrations += cpu_runqueues[i].migrations;
+    }
+    KINFO("Steals: %lu (%lu attempts, %lu lost races)", steals, steal_attempts, steal_races);
+    KINFO("Migrations: %lu", migrations);
     
     for (int i = 0; i < num_cpus; i++) {
         cpu_runqueue_t* rq = &cpu_runqueues[i];
         KINFO("CPU %d:", i);
-        KINFO("  Tasks: %lu", rq->total_tasks);
-        KINFO("  Load: %u", rq->load);
+        KINFO("  Tasks: %lu%s", rq->total_tasks, rq->tick_stopped ? " (tickless)" : "");
+        KINFO("  Load: %u (%u local, %ld stealable)",
+              rq->load, rq->nr_local, ws_size(&rq->deque));
+        KINFO("  Steals: %lu, migrations in: %lu", rq->steals, rq->migrations);
+        KINFO("  Fair: %u queued (min vruntime %lu)",
+              rq->fair_count, rq->min_vruntime >> 10);
         KINFO("  Busy: %lu ticks", rq->busy_time);
         KINFO("  Idle: %lu ticks", rq->idle_time);
+        percpu_t* pc = smp_get_cpu(i);
+        if (pc) {
+            KINFO("  APIC ID: %u, LAPIC ticks: %lu", pc->apic_id, pc->lapic_ticks);
+        }
         if (rq->running_task) {
             KINFO("  Running: task %lu (workload: %d)", 
                   rq->running_task->id, rq->running_task->workload);
@@ -532,11 +1685,51 @@ void scheduler_get_stats(void)
 // Compatibility with existing API
 pid_t scheduler_get_current_task_id(void)
 {
-    int cpu = 0;
+    int cpu = scheduler_get_current_cpu();
     task_t* current = cpu_runqueues[cpu].running_task;
     return (pid_t)(current ? current->id : 0);
 }
 
+// Address space of the running task; NULL for a kernel thread
+vm_context_t* scheduler_get_current_vm(void)
+{
+    int cpu = scheduler_get_current_cpu();
+    task_t* current = cpu_runqueues[cpu].running_task;
+    return current ? current->vm_context : NULL;
+}
+
+int scheduler_get_current_cpu(void)
+{
+    return smp_cpu_id();
+}
+
+// Node the running task's allocations should come from. Also answers
+// before the scheduler runs anything: the executing CPU's node.
+int scheduler_mem_node(void)
+{
+    int cpu = scheduler_get_current_cpu();
+    task_t* current = cpu_runqueues[cpu].running_task;
+    if (current && current->mem_node >= 0) {
+        return current->mem_node;
+    }
+    return numa_node_of_cpu(cpu);
+}
+
+// Prefer a node for the running task's memory (NUMA_NO_NODE: the node it
+// runs on). The PMM falls back to nearer nodes when it is exhausted.
+int scheduler_set_mem_node(int node)
+{
+    if (node != NUMA_NO_NODE && (node < 0 || node >= numa_node_count())) {
+        return -1;
+    }
+    
+    int cpu = scheduler_get_current_cpu();
+    task_t* current = cpu_runqueues[cpu].running_task;
+    if (!current) return -1;
+    current->mem_node = node;
+    return 0;
+}
+
 uint64_t scheduler_get_task_count(void)
 {
     uint64_t total = 0;
@@ -546,22 +1739,218 @@ uint64_t scheduler_get_task_count(void)
     return total;
 }
 
+// A thief may have read the task from a deque, or a waker from a wait
+// entry, just before it terminated: after a grace period none still can.
+// Its stack is in use until the switch away from it has finished.
+static void task_free_rcu(rcu_head_t* head)
+{
+    task_t* task = (task_t*)((uintptr_t)head - __builtin_offsetof(task_t, rcu));
+    if (__atomic_load_n(&task->on_cpu, __ATOMIC_ACQUIRE)) {
+        call_rcu(head, task_free_rcu);
+        return;
+    }
+    
+    // A CPU that still has the address space loaded holds its own reference
+    vmm_context_put(task->vm_context);
+    if (task->fpu_alloc) kfree_tracked(task->fpu_alloc);
+    if (task->stack_bottom) kfree_tracked(task->stack_bottom);
+    kfree_tracked(task);
+}
+
 void scheduler_terminate(void)
 {
-    int cpu = 0;
-    task_t* current = cpu_runqueues[cpu].running_task;
-    if (current) {
-        current->state = TASK_TERMINATED;
+    scheduler_exit(0);
+}
+
+// Terminate the current task with an exit status for whoever waits on it
+void scheduler_exit(int code)
+{
+    uint64_t flags = irq_save();
+    task_t* current = cpu_runqueues[scheduler_get_current_cpu()].running_task;
+    irq_restore(flags);
+    if (!current) return;
+    
+    task_exit_t* notify = current->exit_notify;
+    if (notify) {
+        current->exit_notify = NULL;
+        notify->code = code;
+        __atomic_store_n(&notify->exited, true, __ATOMIC_RELEASE);
+        wake_up(&notify->wq);
+    }
+    
+    if (pmu_available()) {
+        flags = irq_save();
+        pmu_account(&current->pmu);
+        irq_restore(flags);
+        KINFO("Task %lu terminated: %lu instructions, %lu cycles, %lu LLC misses",
+              current->id, current->pmu.instructions, current->pmu.cycles,
+              current->pmu.llc_misses);
+    } else {
         KINFO("Task %lu terminated", current->id);
-        scheduler_schedule();
     }
+    
+    // Interrupts off from here, so a tick can't switch away before the
+    // free is queued and leave the task with neither
+    flags = irq_save();
+    int cpu = scheduler_get_current_cpu();
+    current->state = TASK_TERMINATED;
+    __atomic_fetch_sub(&cpu_runqueues[cpu].total_tasks, 1, __ATOMIC_RELAXED);
+    if (cpu_runqueues[cpu].fpu_owner == current) {
+        cpu_runqueues[cpu].fpu_owner = NULL;
+    }
+    call_rcu(&current->rcu, task_free_rcu);
+    scheduler_schedule();
+    irq_restore(flags);  // Back only if nothing else was ready: wait for a tick
 }
 
+/*
+ * fork(): the child gets a copy-on-write clone of the parent's address
+ * space and resumes from the same SYSCALL, returning 0. Only reachable from
+ * ring 3 through syscall_entry, whose frame sits at the top of the parent's
+ * kernel stack.
+ */
 pid_t scheduler_create_task_fork(void)
 {
-    // Simplified fork: just create a new task with same entry point (not real fork)
-    // In a real kernel, this would copy the address space and stack
-    return scheduler_create_task(NULL, NULL, 4096, PRIORITY_NORMAL, "forked_child");
+    uint64_t flags = irq_save();
+    task_t* parent = cpu_runqueues[scheduler_get_current_cpu()].running_task;
+    irq_restore(flags);
+    if (!parent || !parent->kstack_top) {
+        return -1;
+    }
+    
+    const syscall_frame_t* frame =
+        (const syscall_frame_t*)(parent->kstack_top - sizeof(syscall_frame_t));
+    if (frame->rip >= 0x800000000000ULL) {
+        return -1;  // Kernel thread: there is no user state to duplicate
+    }
+    
+    // From now on the parent must get its own CR3 back after the child ran
+    if (!parent->vm_context) {
+        parent->vm_context = vmm_current_context();
+        vmm_context_get(parent->vm_context);
+    }
+    vm_context_t* vm = vmm_fork_context(parent->vm_context);
+    if (!vm) {
+        return -1;
+    }
+    
+    task_t* task = kmalloc_tracked(sizeof(task_t), "user_task");
+    size_t kstack_size = (size_t)(parent->kstack_top - (uintptr_t)parent->stack_bottom);
+    void* kstack = task ? kmalloc_tracked(kstack_size, "kernel_stack") : NULL;
+    if (!kstack) {
+        if (task) kfree_tracked(task);
+        vmm_destroy_context(vm);
+        return -1;
+    }
+    
+    *task = *parent;
+    task->id = __atomic_fetch_add(&next_task_id, 1, __ATOMIC_RELAXED);
+    task->state = TASK_READY;
+    task->stack_bottom = kstack;
+    task->kstack_top = (uintptr_t)kstack + kstack_size;
+    task->ticks_remaining = task->time_slice;
+    task->cpu_time = 0;
+    task->io_wait_time = 0;
+    task->voluntary_yields = 0;
+    task->heap_child = NULL;
+    task->heap_sibling = NULL;
+    task->vm_context = vm;
+    task->exit_notify = NULL;
+    task->on_cpu = false;
+    task->fpu_state = NULL;
+    task->fpu_alloc = NULL;
+    task->fpu_cpu = -1;
+    memset(&task->pmu, 0, sizeof(task->pmu));
+    task->next = NULL;
+    
+    // Inherit the FPU/SSE state; the newest copy may still be in registers
+    if (parent->fpu_state) {
+        task->fpu_alloc = kmalloc_tracked(fpu_state_size + FPU_STATE_ALIGN, "fpu_state");
+        if (task->fpu_alloc) {
+            task->fpu_state = (uint8_t*)ALIGN_UP((uintptr_t)task->fpu_alloc, FPU_STATE_ALIGN);
+            flags = irq_save();
+            if (!(read_cr0() & CR0_TS)) {
+                fpu_save(parent->fpu_state);
+            }
+            memcpy(task->fpu_state, parent->fpu_state, fpu_state_size);
+            irq_restore(flags);
+        }
+    }
+    
+    // Same user registers as the parent; first switch_context() lands in
+    // task_fork_trampoline, which leaves through the SYSCALL exit path
+    syscall_frame_t* child_frame =
+        (syscall_frame_t*)(task->kstack_top - sizeof(syscall_frame_t));
+    *child_frame = *frame;
+    task->stack_top = build_switch_frame((uint64_t*)child_frame, task_fork_trampoline, 0, 0);
+    
+    int target_cpu = select_cpu(task);
+    scheduler_enqueue_new(target_cpu, task);
+    
+    KINFO("Forked task %lu from %lu (cpu %d)", task->id, parent->id, target_cpu);
+    return (pid_t)task->id;
+}
+
+/*
+ * execve(): the current task trades its address space for vm (taking over
+ * the caller's reference) and its SYSCALL returns into the new program at
+ * entry on user_stack, every other register cleared. Like fork, only
+ * reachable through syscall_entry.
+ */
+int scheduler_exec(vm_context_t* vm, uint64_t entry, uint64_t user_stack)
+{
+    uint64_t flags = irq_save();
+    cpu_runqueue_t* rq = &cpu_runqueues[scheduler_get_current_cpu()];
+    task_t* current = rq->running_task;
+    if (!current || !current->kstack_top) {
+        irq_restore(flags);
+        return -1;
+    }
+    
+    syscall_frame_t* frame = (syscall_frame_t*)(current->kstack_top - sizeof(syscall_frame_t));
+    if (frame->rip >= 0x800000000000ULL) {
+        irq_restore(flags);
+        return -1;  // Kernel thread: there is no user state to replace
+    }
+    
+    // Loaded here and now, as context_switch() would: the run queue takes
+    // its own reference to what is in CR3
+    vm_context_t* old = current->vm_context;
+    vm_context_t* old_active = rq->active_mm;
+    current->vm_context = vm;
+    vmm_switch_context(vm);
+    vmm_context_get(vm);
+    rq->active_mm = vm;
+    irq_restore(flags);
+    
+    vmm_context_put(old_active);
+    vmm_context_put(old);
+    
+    memset(frame, 0, sizeof(*frame));
+    frame->rip = entry;
+    frame->rsp = user_stack;
+    frame->rflags = 0x202;  // IF
+    return 0;
+}
+
+/*
+ * Wait for a task started with notify to exit, or until deadline_us
+ * (WAIT_FOREVER: no deadline). On a timeout notify stays the task's.
+ */
+int task_exit_wait(task_exit_t* notify, uint64_t deadline_us)
+{
+    wait_entry_t wait;
+    int ret = 0;
+    for (;;) {
+        wait_prepare(&notify->wq, &wait);
+        if (__atomic_load_n(&notify->exited, __ATOMIC_ACQUIRE)) break;
+        if (wait_schedule(&wait, deadline_us) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    wait_finish(&wait);
+    return ret;
 }
 
 int scheduler_kill_task(pid_t pid)
@@ -584,5 +1973,28 @@ int scheduler_get_task_info(pid_t pid, scheduler_task_info_t* info)
     info->pid = pid;
     info->state = TASK_RUNNING;
     info->priority = PRIORITY_NORMAL;
+    
+    // Counters are only read on the CPU a task runs on
+    pmu_counts_t counts = {0};
+    if (pid == scheduler_get_current_task_id()) {
+        scheduler_get_task_counters(&counts);
+    }
+    info->instructions = counts.instructions;
+    info->cycles = counts.cycles;
+    info->llc_misses = counts.llc_misses;
     return 0;
 }
+
+// The running task's counts, including the slice in progress
+void scheduler_get_task_counters(pmu_counts_t* out)
+{
+    uint64_t flags = irq_save();
+    task_t* current = cpu_runqueues[scheduler_get_current_cpu()].running_task;
+    if (current) {
+        pmu_account(&current->pmu);
+        *out = current->pmu;
+    } else {
+        memset(out, 0, sizeof(*out));
+    }
+    irq_restore(flags);
+}
@@ -0,0 +1,187 @@
+/*
+ * Boot-Time Self-Tests
+ *
+ * Booting with "selftest" on the command line (the third GRUB entry)
+ * starts a task that runs user programs through the paths a real process
+ * takes and prints one line per test:
+ *
+ *   SELFTEST <name> PASS
+ *   SELFTEST <name> FAIL (<reason>)
+ *
+ * ring3: a page of code in a scratch address space, which exercises the
+ * TSS RSP0 stack, swapgs, both syscall gates and the user fault path.
+ *
+ * elf: a hand-built ELF64 binary written to a QFS file, loaded by
+ * elf_spawn() from the page cache into a fresh address space, that exits
+ * with its own pid.
+ */
+
+#include "kernel.h"
+#include "elf.h"
+#include "vmm.h"
+#include "qfs.h"
+#include "syscalls.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+#define SELFTEST_TIMEOUT_US  2000000                     // Per program, to exit
+#define ELF_PROBE_VADDR      (USER_SPACE_START + 0x400000)
+#define ELF_PROBE_CODE       21                          // Bytes of code
+#define ELF_PROBE_SIZE       (sizeof(elf64_ehdr_t) + sizeof(elf64_phdr_t) + ELF_PROBE_CODE)
+
+// ============================================================================
+// PROGRAMS
+// ============================================================================
+
+// getpid over syscall, a push that faults its stack in, getpid again
+// through the int 0x80 gate, then exit(0) if the two pids agree
+static const uint8_t ring3_probe[] = {
+    0xB8, SYS_getpid, 0, 0, 0,      // mov eax, SYS_getpid
+    0x0F, 0x05,                     // syscall
+    0x89, 0xC3,                     // mov ebx, eax
+    0x53,                           // push rbx
+    0x5B,                           // pop rbx
+    0xB8, SYS_getpid, 0, 0, 0,      // mov eax, SYS_getpid
+    0xCD, 0x80,                     // int 0x80
+    0x31, 0xFF,                     // xor edi, edi
+    0x39, 0xD8,                     // cmp eax, ebx
+    0x40, 0x0F, 0x95, 0xC7,         // setne dil
+    0xB8, SYS_exit, 0, 0, 0,        // mov eax, SYS_exit
+    0x0F, 0x05,                     // syscall
+    0xEB, 0xFE                      // jmp $
+};
+
+/*
+ * Smallest binary the loader takes: one read-only, executable PT_LOAD of
+ * the whole file. The code reads argc off the entry stack (0, from the
+ * zero-filled stack) and exits with getpid() + argc.
+ */
+static const struct {
+    elf64_ehdr_t ehdr;
+    elf64_phdr_t phdr;
+    uint8_t code[ELF_PROBE_CODE];
+} __attribute__((packed)) elf_probe = {
+    .ehdr = {
+        .e_ident = { 0x7F, 'E', 'L', 'F', ELFCLASS64, ELFDATA2LSB, EV_CURRENT },
+        .e_type = ET_EXEC,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_entry = ELF_PROBE_VADDR + sizeof(elf64_ehdr_t) + sizeof(elf64_phdr_t),
+        .e_phoff = sizeof(elf64_ehdr_t),
+        .e_ehsize = sizeof(elf64_ehdr_t),
+        .e_phentsize = sizeof(elf64_phdr_t),
+        .e_phnum = 1,
+    },
+    .phdr = {
+        .p_type = PT_LOAD,
+        .p_flags = PF_R | PF_X,
+        .p_offset = 0,
+        .p_vaddr = ELF_PROBE_VADDR,
+        .p_paddr = ELF_PROBE_VADDR,
+        .p_filesz = ELF_PROBE_SIZE,
+        .p_memsz = ELF_PROBE_SIZE,
+        .p_align = PAGE_SIZE,
+    },
+    .code = {
+        0xB8, SYS_getpid, 0, 0, 0,  // mov eax, SYS_getpid
+        0x0F, 0x05,                 // syscall
+        0x89, 0xC7,                 // mov edi, eax
+        0x03, 0x3C, 0x24,           // add edi, [rsp]
+        0xB8, SYS_exit, 0, 0, 0,    // mov eax, SYS_exit
+        0x0F, 0x05,                 // syscall
+        0xEB, 0xFE,                 // jmp $
+    },
+};
+
+// Static: a program that never exits keeps writing to it
+static task_exit_t ring3_probe_exit = TASK_EXIT_INIT;
+static task_exit_t elf_probe_exit = TASK_EXIT_INIT;
+
+// ============================================================================
+// TESTS
+// ============================================================================
+
+// Wait for a program started with notify; 0 if it exited with code
+static int selftest_wait(const char* name, task_exit_t* notify, int code)
+{
+    if (task_exit_wait(notify, time_monotonic_us() + SELFTEST_TIMEOUT_US) < 0) {
+        KERROR("SELFTEST %s FAIL (no exit within %d ms)", name, SELFTEST_TIMEOUT_US / 1000);
+        return -1;
+    }
+    if (notify->code != code) {
+        KERROR("SELFTEST %s FAIL (exit code %d, expected %d)", name, notify->code, code);
+        return -1;
+    }
+    KINFO("SELFTEST %s PASS", name);
+    return 0;
+}
+
+// The task holds the only reference to its address space: the code and
+// stack go with it when it exits
+static void selftest_ring3(void)
+{
+    vm_context_t* ctx = vmm_create_context();
+    uintptr_t code = ctx ? pmm_alloc_zeroed_page() : 0;
+    if (!code) {
+        vmm_destroy_context(ctx);
+        KERROR("SELFTEST ring3 FAIL (out of memory)");
+        return;
+    }
+    memcpy((void*)code, ring3_probe, sizeof(ring3_probe));
+
+    void* text = vmm_map_frames(ctx, NULL, code, 1, PROT_READ | PROT_EXEC);
+    pmm_page_unref(code, 1);  // The mapping holds its own reference
+    void* stack = vmm_mmap(ctx, NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0);
+    if (!text || !stack) {
+        vmm_destroy_context(ctx);
+        KERROR("SELFTEST ring3 FAIL (cannot map the probe)");
+        return;
+    }
+
+    if (scheduler_create_user_task(ctx, text, (uint8_t*)stack + PAGE_SIZE, &ring3_probe_exit) < 0) {
+        KERROR("SELFTEST ring3 FAIL (cannot create the task)");
+        return;
+    }
+    selftest_wait("ring3", &ring3_probe_exit, 0);
+}
+
+// QFS has no unlink yet, so every run leaves its file behind
+static void selftest_elf(void)
+{
+    uint32_t ino = qfs_create_file("selftest_elf", 0755);
+    if (ino == 0 || qfs_write(ino, &elf_probe, 0, sizeof(elf_probe)) != (int64_t)sizeof(elf_probe)) {
+        KERROR("SELFTEST elf FAIL (cannot write the binary to QFS)");
+        return;
+    }
+
+    struct inode* inode = qfs_open_inode(ino);
+    pid_t pid = inode ? elf_spawn(inode, &elf_probe_exit) : -1;
+    if (inode) iput(inode);  // The mappings hold their own
+    if (pid < 0) {
+        KERROR("SELFTEST elf FAIL (cannot load the binary)");
+        return;
+    }
+    selftest_wait("elf", &elf_probe_exit, (int)pid);
+}
+
+static void selftest_task(void* arg)
+{
+    (void)arg;
+    selftest_ring3();
+    selftest_elf();
+    KINFO("SELFTEST-END");
+}
+
+// ============================================================================
+// INITIALIZATION
+// ============================================================================
+
+void selftest_start(void)
+{
+    if (scheduler_create_task(selftest_task, NULL, 16384, 10, "selftest") < 0) {
+        KERROR("Self-tests: could not start the test task");
+    }
+}
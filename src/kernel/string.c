@@ -5,13 +5,111 @@
  * These are freestanding implementations (no standard library dependencies)
  */
 
-/* Memory operations */
+/*
+ * Memory operations, by size class: up to 16 bytes in two overlapping
+ * moves, then an unrolled 8-byte loop, and from mem_init()'s threshold the
+ * string instructions - rep movsb / rep stosb when ERMS makes them the
+ * fastest (and with FSRM already for short copies), rep movsq / rep stosq
+ * otherwise. Until mem_init() runs the loops handle every size.
+ */
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) u64_unaligned;
+typedef uint32_t __attribute__((may_alias, aligned(1))) u32_unaligned;
+typedef uint16_t __attribute__((may_alias, aligned(1))) u16_unaligned;
+
+#define MEM_REP_QWORD 1024   // rep movsq / stosq pays off from here
+#define MEM_REP_ERMS  256    // rep movsb / stosb with ERMS
+#define MEM_REP_FSRM  32     // rep movsb with fast short rep mov
+
+static size_t mem_copy_rep = ~(size_t)0;   // Sizes that go to rep movs
+static size_t mem_set_rep = ~(size_t)0;
+static bool mem_erms = false;            // Byte-granular rep forms are fast
+
+void mem_init(bool erms, bool fsrm)
+{
+    mem_erms = erms;
+    mem_copy_rep = fsrm ? MEM_REP_FSRM : erms ? MEM_REP_ERMS : MEM_REP_QWORD;
+    mem_set_rep = erms ? MEM_REP_ERMS : MEM_REP_QWORD;
+}
+
+#define LOAD64(p)     (*(const u64_unaligned*)(p))
+#define STORE64(p, v) (*(u64_unaligned*)(p) = (v))
+
+// The loops below must not be turned back into calls to these functions
+#pragma GCC push_options
+#pragma GCC optimize("no-tree-loop-distribute-patterns")
+
+// 0-16 bytes: a head and a tail move that may overlap
+static inline void copy_small(uint8_t* d, const uint8_t* s, size_t len)
+{
+    if (len >= 8) {
+        uint64_t head = LOAD64(s), tail = LOAD64(s + len - 8);
+        STORE64(d, head);
+        STORE64(d + len - 8, tail);
+    } else if (len >= 4) {
+        uint32_t head = *(const u32_unaligned*)s, tail = *(const u32_unaligned*)(s + len - 4);
+        *(u32_unaligned*)d = head;
+        *(u32_unaligned*)(d + len - 4) = tail;
+    } else if (len >= 2) {
+        uint16_t head = *(const u16_unaligned*)s, tail = *(const u16_unaligned*)(s + len - 2);
+        *(u16_unaligned*)d = head;
+        *(u16_unaligned*)(d + len - 2) = tail;
+    } else if (len) {
+        *d = *s;
+    }
+}
+
 void* memset(void* dest, int val, size_t len)
 {
-    uint8_t* ptr = (uint8_t*)dest;
-    for (size_t i = 0; i < len; i++) {
-        ptr[i] = (uint8_t)val;
+    uint8_t* d = (uint8_t*)dest;
+    uint64_t v = 0x0101010101010101ULL * (uint8_t)val;
+
+    if (len <= 16) {
+        if (len >= 8) {
+            STORE64(d, v);
+            STORE64(d + len - 8, v);
+        } else if (len >= 4) {
+            *(u32_unaligned*)d = (uint32_t)v;
+            *(u32_unaligned*)(d + len - 4) = (uint32_t)v;
+        } else if (len >= 2) {
+            *(u16_unaligned*)d = (uint16_t)v;
+            *(u16_unaligned*)(d + len - 2) = (uint16_t)v;
+        } else if (len) {
+            *d = (uint8_t)v;
+        }
+        return dest;
     }
+
+    if (len >= mem_set_rep) {
+        if (mem_erms) {
+            __asm__ volatile("rep stosb" : "+D"(d), "+c"(len) : "a"(v) : "memory");
+        } else {
+            STORE64(d + len - 8, v);  // The tail rep stosq leaves
+            size_t words = len / 8;
+            __asm__ volatile("rep stosq" : "+D"(d), "+c"(words) : "a"(v) : "memory");
+        }
+        return dest;
+    }
+
+    // 17 bytes up: 32 a round, then the last 32 again, overlapping
+    uint8_t* end = d + len;
+    if (len <= 32) {
+        STORE64(d, v);
+        STORE64(d + 8, v);
+        STORE64(end - 16, v);
+        STORE64(end - 8, v);
+        return dest;
+    }
+    for (; d + 32 < end; d += 32) {
+        STORE64(d, v);
+        STORE64(d + 8, v);
+        STORE64(d + 16, v);
+        STORE64(d + 24, v);
+    }
+    STORE64(end - 32, v);
+    STORE64(end - 24, v);
+    STORE64(end - 16, v);
+    STORE64(end - 8, v);
     return dest;
 }
 
@@ -19,8 +117,84 @@ void* memcpy(void* dest, const void* src, size_t len)
 {
     uint8_t* d = (uint8_t*)dest;
     const uint8_t* s = (const uint8_t*)src;
-    for (size_t i = 0; i < len; i++) {
-        d[i] = s[i];
+
+    if (len <= 16) {
+        copy_small(d, s, len);
+        return dest;
+    }
+
+    if (len >= mem_copy_rep) {
+        if (mem_erms) {
+            __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(len) :: "memory");
+        } else {
+            STORE64(d + len - 8, LOAD64(s + len - 8));  // The tail rep movsq leaves
+            size_t words = len / 8;
+            __asm__ volatile("rep movsq" : "+D"(d), "+S"(s), "+c"(words) :: "memory");
+        }
+        return dest;
+    }
+
+    uint8_t* end = d + len;
+    const uint8_t* send = s + len;
+    if (len <= 32) {
+        uint64_t a = LOAD64(s), b = LOAD64(s + 8), c = LOAD64(send - 16), e = LOAD64(send - 8);
+        STORE64(d, a);
+        STORE64(d + 8, b);
+        STORE64(end - 16, c);
+        STORE64(end - 8, e);
+        return dest;
+    }
+    for (; d + 32 < end; d += 32, s += 32) {
+        uint64_t a = LOAD64(s), b = LOAD64(s + 8), c = LOAD64(s + 16), e = LOAD64(s + 24);
+        STORE64(d, a);
+        STORE64(d + 8, b);
+        STORE64(d + 16, c);
+        STORE64(d + 24, e);
+    }
+    uint64_t a = LOAD64(send - 32), b = LOAD64(send - 24), c = LOAD64(send - 16), e = LOAD64(send - 8);
+    STORE64(end - 32, a);
+    STORE64(end - 24, b);
+    STORE64(end - 16, c);
+    STORE64(end - 8, e);
+    return dest;
+}
+
+// Overlapping copies: backwards when dest is above src. Each word is loaded
+// before the store that could overwrite it.
+void* memmove(void* dest, const void* src, size_t len)
+{
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    if (d + len <= s || d >= s + len) {
+        return memcpy(dest, src, len);
+    }
+    if (d == s) {
+        return dest;
+    }
+
+    if (d < s) {
+        if (len >= mem_copy_rep && mem_erms) {
+            __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(len) :: "memory");
+            return dest;
+        }
+        for (; len >= 8; d += 8, s += 8, len -= 8) {
+            STORE64(d, LOAD64(s));
+        }
+        while (len--) {
+            *d++ = *s++;
+        }
+        return dest;
+    }
+
+    d += len;
+    s += len;
+    for (; len >= 8; len -= 8) {
+        d -= 8;
+        s -= 8;
+        STORE64(d, LOAD64(s));
+    }
+    while (len--) {
+        *--d = *--s;
     }
     return dest;
 }
@@ -29,6 +203,14 @@ int memcmp(const void* a, const void* b, size_t len)
 {
     const uint8_t* pa = (const uint8_t*)a;
     const uint8_t* pb = (const uint8_t*)b;
+
+    // Eight bytes at a time; byte-swapped, the first difference decides
+    for (; len >= 8; pa += 8, pb += 8, len -= 8) {
+        uint64_t x = LOAD64(pa), y = LOAD64(pb);
+        if (x != y) {
+            return __builtin_bswap64(x) < __builtin_bswap64(y) ? -1 : 1;
+        }
+    }
     for (size_t i = 0; i < len; i++) {
         if (pa[i] != pb[i]) {
             return pa[i] < pb[i] ? -1 : 1;
@@ -37,6 +219,35 @@ int memcmp(const void* a, const void* b, size_t len)
     return 0;
 }
 
+// Zero memory that won't be read soon (pages cleared ahead of use) with
+// non-temporal stores, so it doesn't evict what the cache holds
+void memzero_nt(void* dest, size_t len)
+{
+    uint8_t* d = (uint8_t*)dest;
+    size_t head = -(uintptr_t)d & 63;
+    if (head > len) head = len;
+    memset(d, 0, head);
+    d += head;
+    len -= head;
+
+    for (; len >= 64; d += 64, len -= 64) {
+        __asm__ volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)\n\t"
+            "movnti %1, 32(%0)\n\t"
+            "movnti %1, 40(%0)\n\t"
+            "movnti %1, 48(%0)\n\t"
+            "movnti %1, 56(%0)"
+            :: "r"(d), "r"(0ULL) : "memory");
+    }
+    __asm__ volatile("sfence" ::: "memory");  // Ordered before whatever publishes the memory
+    memset(d, 0, len);
+}
+
+#pragma GCC pop_options
+
 /* String operations */
 size_t strlen(const char* str)
 {
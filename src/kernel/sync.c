@@ -0,0 +1,335 @@
+/*
+ * Synchronization Primitives
+ *
+ * Slow paths and statistics for the ticket spinlocks in kernel.h, queued
+ * MCS locks, per-CPU reader-writer locks and RCU.
+ *
+ * RCU here is quiescent-state based. A read section is nothing but
+ * interrupts off, so a CPU that reaches scheduler_schedule() or takes a
+ * scheduler tick (which only happens with interrupts on) cannot be inside
+ * one; both bump that CPU's quiescent-state counter. A grace period is over
+ * once every other online CPU's counter has moved since it began. CPUs that
+ * sit in one task without ticking (tickless idle, or a long stretch with
+ * interrupts off) are sent a reschedule IPI, which lands in
+ * scheduler_schedule() as soon as they can take it.
+ *
+ * Callbacks queued with call_rcu() are run in batches by the "rcu" task,
+ * one grace period per batch, so freeing an object never blocks the code
+ * that unlinked it.
+ */
+
+#include "kernel.h"
+#include "smp.h"
+#include "io.h"
+#include "sync.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+#define RCU_POLL_US        1000      // Grace period check interval
+#define RCU_KICK_AFTER_US  10000     // IPI CPUs that have not passed one by then
+#define RCU_TASK_PRIORITY  20
+
+// ============================================================================
+// STATE
+// ============================================================================
+
+// Counters each CPU updates alone, a line apart so they do not bounce
+static struct {
+    volatile uint64_t qs;          // Quiescent states passed
+    uint64_t spin_contended;
+    uint64_t spin_wait_cycles;
+    uint64_t seq_retries;
+} __attribute__((aligned(64))) cpu_sync[MAX_CPUS];
+
+static spinlock_t rcu_lock = SPINLOCK_INIT;     // Callback queue
+static rcu_head_t* rcu_queue = NULL;
+static rcu_head_t** rcu_queue_tail = &rcu_queue;
+static size_t rcu_queued = 0;
+static wait_queue_t rcu_wq = WAIT_QUEUE_INIT;
+static bool rcu_running = false;
+
+static uint64_t rcu_grace_periods = 0;
+static uint64_t rcu_callbacks_run = 0;
+static uint64_t rcu_ipis = 0;
+static uint64_t mcs_contended_total = 0;
+
+// ============================================================================
+// TICKET SPINLOCKS
+// ============================================================================
+
+void spin_lock_contended(spinlock_t* lock, uint16_t ticket)
+{
+    uint64_t start = rdtsc();
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        __asm__ volatile("pause");
+    }
+
+    // Relaxed adds: the caller may have interrupts on and move CPUs
+    int cpu = smp_cpu_id();
+    __atomic_fetch_add(&cpu_sync[cpu].spin_contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cpu_sync[cpu].spin_wait_cycles, rdtsc() - start, __ATOMIC_RELAXED);
+}
+
+void seqcount_note_retry(void)
+{
+    __atomic_fetch_add(&cpu_sync[smp_cpu_id()].seq_retries, 1, __ATOMIC_RELAXED);
+}
+
+// ============================================================================
+// MCS LOCKS
+// ============================================================================
+
+void mcs_lock(mcs_lock_t* lock, mcs_node_t* node)
+{
+    node->next = NULL;
+    node->locked = 0;
+
+    mcs_node_t* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    if (!prev) return;
+
+    // Queue behind prev and spin on our own node until it hands over
+    uint64_t start = rdtsc();
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+        __asm__ volatile("pause");
+    }
+
+    // Held now: the lock's own counters need no atomics
+    lock->contended++;
+    lock->wait_cycles += rdtsc() - start;
+    __atomic_fetch_add(&mcs_contended_total, 1, __ATOMIC_RELAXED);
+}
+
+bool mcs_trylock(mcs_lock_t* lock, mcs_node_t* node)
+{
+    node->next = NULL;
+    node->locked = 0;
+
+    mcs_node_t* expected = NULL;
+    return __atomic_compare_exchange_n(&lock->tail, &expected, node, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node)
+{
+    mcs_node_t* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (!next) {
+        // No one queued: free the lock, unless a waiter swapped in meanwhile
+        mcs_node_t* expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        // It has the tail but has not linked itself behind us yet
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+            __asm__ volatile("pause");
+        }
+    }
+    __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+}
+
+// ============================================================================
+// PER-CPU READER-WRITER LOCKS
+// ============================================================================
+
+uint64_t percpu_read_lock(percpu_rwlock_t* lock)
+{
+    uint64_t flags = irq_save();
+    volatile uint32_t* readers = &lock->cpu[smp_cpu_id()].readers;
+
+    // Nested: a writer that came since is already waiting for this CPU
+    if (*readers) {
+        (*readers)++;
+        return flags;
+    }
+
+    for (;;) {
+        __atomic_store_n(readers, 1, __ATOMIC_RELAXED);
+        // The count must be visible before the writer flag is read, or a
+        // writer could see no readers while we see no writer
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&lock->writer, __ATOMIC_ACQUIRE)) {
+            return flags;
+        }
+
+        __atomic_store_n(readers, 0, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&lock->reader_waits, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&lock->writer, __ATOMIC_RELAXED)) {
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+void percpu_read_unlock(percpu_rwlock_t* lock, uint64_t flags)
+{
+    volatile uint32_t* readers = &lock->cpu[smp_cpu_id()].readers;
+    __atomic_store_n(readers, *readers - 1, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+uint64_t percpu_write_lock(percpu_rwlock_t* lock)
+{
+    uint64_t flags = spin_lock_irqsave(&lock->writer_lock);
+    __atomic_store_n(&lock->writer, 1, __ATOMIC_SEQ_CST);
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        while (__atomic_load_n(&lock->cpu[cpu].readers, __ATOMIC_ACQUIRE)) {
+            __asm__ volatile("pause");
+        }
+    }
+    lock->writes++;
+    return flags;
+}
+
+void percpu_write_unlock(percpu_rwlock_t* lock, uint64_t flags)
+{
+    __atomic_store_n(&lock->writer, 0, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&lock->writer_lock, flags);
+}
+
+// ============================================================================
+// RCU
+// ============================================================================
+
+// Called with interrupts off, from the scheduler
+void rcu_note_qs(void)
+{
+    int cpu = smp_cpu_id();
+    __atomic_store_n(&cpu_sync[cpu].qs, cpu_sync[cpu].qs + 1, __ATOMIC_RELEASE);
+}
+
+// CPUs in snap, other than skip, whose counter has not moved past it
+static uint32_t rcu_pending_cpus(const uint64_t* snap, int ncpus, int skip)
+{
+    uint32_t pending = 0;
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        if (cpu == skip || snap[cpu] == (uint64_t)-1) continue;
+        if (__atomic_load_n(&cpu_sync[cpu].qs, __ATOMIC_ACQUIRE) == snap[cpu]) {
+            pending |= 1U << cpu;
+        }
+    }
+    return pending;
+}
+
+// Task context only: no locks held, not inside a read section
+void synchronize_rcu(void)
+{
+    uint64_t snap[MAX_CPUS];
+    int ncpus = smp_cpu_count();
+
+    // This CPU is quiescent right now; CPUs not yet online hold no readers
+    uint64_t flags = irq_save();
+    int self = smp_cpu_id();
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        percpu_t* pc = smp_get_cpu(cpu);
+        snap[cpu] = pc && pc->online ? __atomic_load_n(&cpu_sync[cpu].qs, __ATOMIC_ACQUIRE)
+                                     : (uint64_t)-1;
+    }
+    irq_restore(flags);
+
+    uint64_t waited = 0;
+    bool kicked = false;
+    uint32_t pending;
+    while ((pending = rcu_pending_cpus(snap, ncpus, self)) != 0) {
+        if (!kicked && waited >= RCU_KICK_AFTER_US) {
+            for (int cpu = 0; cpu < ncpus; cpu++) {
+                percpu_t* pc = smp_get_cpu(cpu);
+                if ((pending & (1U << cpu)) && pc && pc->online) {
+                    lapic_send_ipi(pc->apic_id, APIC_RESCHED_VECTOR);
+                    __atomic_fetch_add(&rcu_ipis, 1, __ATOMIC_RELAXED);
+                }
+            }
+            kicked = true;
+        }
+        scheduler_sleep_us(RCU_POLL_US);
+        waited += RCU_POLL_US;
+    }
+
+    __atomic_fetch_add(&rcu_grace_periods, 1, __ATOMIC_RELAXED);
+}
+
+// Any context: func(head) runs in the rcu task after a grace period
+void call_rcu(rcu_head_t* head, void (*func)(rcu_head_t* head))
+{
+    head->next = NULL;
+    head->func = func;
+
+    uint64_t flags = spin_lock_irqsave(&rcu_lock);
+    *rcu_queue_tail = head;
+    rcu_queue_tail = &head->next;
+    bool first = rcu_queued++ == 0;
+    spin_unlock_irqrestore(&rcu_lock, flags);
+
+    if (first) {
+        wake_up(&rcu_wq);
+    }
+}
+
+static void rcu_task(void* arg)
+{
+    (void)arg;
+
+    for (;;) {
+        wait_entry_t wait;
+        for (;;) {
+            wait_prepare(&rcu_wq, &wait);
+            if (__atomic_load_n(&rcu_queued, __ATOMIC_RELAXED)) break;
+            wait_schedule(&wait, WAIT_FOREVER);
+        }
+        wait_finish(&wait);
+
+        // Everything queued so far was unlinked before this grace period
+        uint64_t flags = spin_lock_irqsave(&rcu_lock);
+        rcu_head_t* batch = rcu_queue;
+        rcu_queue = NULL;
+        rcu_queue_tail = &rcu_queue;
+        rcu_queued = 0;
+        spin_unlock_irqrestore(&rcu_lock, flags);
+
+        synchronize_rcu();
+
+        uint64_t count = 0;
+        while (batch) {
+            rcu_head_t* next = batch->next;
+            batch->func(batch);
+            batch = next;
+            count++;
+        }
+        __atomic_fetch_add(&rcu_callbacks_run, count, __ATOMIC_RELAXED);
+    }
+}
+
+// ============================================================================
+// INITIALIZATION AND STATISTICS
+// ============================================================================
+
+void rcu_init(void)
+{
+    if (scheduler_create_task(rcu_task, NULL, 8192, RCU_TASK_PRIORITY, "rcu") < 0) {
+        KWARN("RCU: No callback task, deferred frees will not run");
+        return;
+    }
+    rcu_running = true;
+    KINFO("RCU: Quiescent-state grace periods across %d CPUs", smp_cpu_count());
+}
+
+void sync_get_stats(void)
+{
+    uint64_t contended = 0, wait_cycles = 0, retries = 0;
+    for (int cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        contended += cpu_sync[cpu].spin_contended;
+        wait_cycles += cpu_sync[cpu].spin_wait_cycles;
+        retries += cpu_sync[cpu].seq_retries;
+    }
+
+    KINFO("=== Synchronization Statistics ===");
+    KINFO("Spinlocks: %lu contended acquisitions, %lu cycles average wait", contended,
+          contended ? wait_cycles / contended : 0);
+    KINFO("MCS locks: %lu contended acquisitions", mcs_contended_total);
+    KINFO("Seqcount read retries: %lu", retries);
+    KINFO("RCU: %s, %lu grace periods, %lu callbacks run, %lu queued, %lu IPIs",
+          rcu_running ? "running" : "not started", rcu_grace_periods, rcu_callbacks_run,
+          rcu_queued, rcu_ipis);
+}
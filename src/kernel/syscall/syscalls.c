@@ -1,5 +1,9 @@
 #include "kernel.h"
 #include "syscalls.h"
+#include "vmm.h"
+#include "smp.h"
+#include "io.h"
+#include "cpu.h"
 
 /*
  * System Call Implementation
@@ -13,135 +17,290 @@
 #define EACCES          13      // Permission denied
 #define EIO             5       // I/O error
 #define ENOENT          2       // No such file or directory
+#define ENOEXEC         8       // Exec format error
+#define EFAULT          14      // Bad address
+#define ENAMETOOLONG    36      // File name too long
 
 // Commonly used return values
 #define SUCCESS         0
 
 // Shared memory constants
 #define IPC_PRIVATE ((key_t)0)    // Private key for new segments
+#define IPC_CREAT   01000         // Create the key's segment if missing
+#define IPC_EXCL    02000         // ...and fail if it exists
 #define IPC_RMID    0             // Remove segment
 #define EMFILE      24            // Too many open files
-#define SHM_DEST    01000         // Destroy after last detach
+#define EEXIST      17            // Key already has a segment
 
 /*
  * Shared Memory Implementation
  * POSIX-compliant shared memory segments
+ *
+ * A segment is a run of physical frames, each counted on its own: the
+ * segment holds one reference and every page mapped into an address space
+ * another, so whichever goes last frees the frame. The kernel reaches the
+ * frames directly (they are identity mapped), which is how window buffers
+ * are shared with the compositor without copies.
  */
 
-// Shared memory segment structure
-typedef struct {
-    int shmid;          // Shared memory ID
-    void* addr;         // Attached address in kernel space
-    size_t size;        // Size of segment
-    int key;            // Key for IPC
-    pid_t creator;      // PID of creator
-    int ref_count;      // Number of processes attached
-    int flags;          // Permissions and flags
+#define SHM_HASH_SIZE 64
+
+typedef struct shm_segment {
+    struct shm_segment* id_next;   // Chain by shmid
+    struct shm_segment* key_next;  // Chain by key (keyed and not removed)
+    int shmid;                     // Shared memory ID
+    key_t key;                     // Key for IPC
+    uintptr_t phys;                // First frame (frames are contiguous)
+    size_t size;                   // Size of segment
+    size_t pages;
+    pid_t creator;                 // PID of creator
+    int ref_count;                 // Attachments
+    int flags;                     // Permissions and flags
+    bool removed;                  // IPC_RMID: freed at the last detach
 } shm_segment_t;
 
-// Shared memory table (simple array for demo)
-#define MAX_SHM_SEGMENTS 16
-static shm_segment_t shm_segments[MAX_SHM_SEGMENTS];
-static int next_shmid = 1;
-
-// Process attachment tracking
-typedef struct {
-    int shmid;
+// Where a segment is attached, so shmdt can find it from the address
+typedef struct shm_attachment {
+    struct shm_attachment* next;
+    vm_context_t* ctx;
     void* addr;
-    size_t size;
+    shm_segment_t* segment;
 } shm_attachment_t;
 
-#define MAX_SHM_ATTACHMENTS 8
-static shm_attachment_t shm_attachments[MAX_SHM_ATTACHMENTS];
+static spinlock_t shm_lock = SPINLOCK_INIT;
+static shm_segment_t* shm_by_id[SHM_HASH_SIZE];
+static shm_segment_t* shm_by_key[SHM_HASH_SIZE];
+static shm_attachment_t* shm_attachments = NULL;
+static int next_shmid = 1;
 
 // These functions are declared in kernel.h with correct signatures
 
-// System call implementations
+// ---- Segment table (shm_lock held) ----
 
-// Shared memory get (shmget)
-int64_t sys_shmget(key_t key, size_t size, int shmflg)
+static inline uint32_t shm_hash(uint32_t value)
 {
-    // IPC_PRIVATE creates new segment, key values are ignored for now
-    if (key != IPC_PRIVATE) {
-        // For demo, key-based lookup not implemented
-        return -ENOSYS;
+    return (value * 0x9E3779B1U) >> 26;  // Top 6 bits: SHM_HASH_SIZE buckets
+}
+
+static shm_segment_t* shm_find_id(int shmid)
+{
+    for (shm_segment_t* seg = shm_by_id[shm_hash((uint32_t)shmid)]; seg; seg = seg->id_next) {
+        if (seg->shmid == shmid) return seg;
     }
+    return NULL;
+}
 
-    // Find free slot
-    int slot = -1;
-    for (int i = 0; i < MAX_SHM_SEGMENTS; i++) {
-        if (shm_segments[i].shmid == 0) {
-            slot = i;
-            break;
-        }
+static shm_segment_t* shm_find_key(key_t key)
+{
+    for (shm_segment_t* seg = shm_by_key[shm_hash(key)]; seg; seg = seg->key_next) {
+        if (seg->key == key) return seg;
     }
+    return NULL;
+}
+
+static void shm_unhash_key(shm_segment_t* seg)
+{
+    if (seg->key == IPC_PRIVATE) return;
+    shm_segment_t** link = &shm_by_key[shm_hash(seg->key)];
+    while (*link && *link != seg) link = &(*link)->key_next;
+    if (*link) *link = seg->key_next;
+    seg->key = IPC_PRIVATE;  // A later shmget of the key makes a new segment
+}
 
-    if (slot == -1) {
-        return -ENOMEM; // No free slots
+static void shm_unhash_id(shm_segment_t* seg)
+{
+    shm_segment_t** link = &shm_by_id[shm_hash((uint32_t)seg->shmid)];
+    while (*link != seg) link = &(*link)->id_next;
+    *link = seg->id_next;
+}
+
+// Drop the segment's frame references (mappings still hold theirs)
+static void shm_free(shm_segment_t* seg)
+{
+    for (size_t i = 0; i < seg->pages; i++) {
+        pmm_page_unref(seg->phys + i * PAGE_SIZE, 1);
     }
+    KDEBUG("Destroyed shared memory segment %d", seg->shmid);
+    kfree_tracked(seg);
+}
 
-    // Allocate kernel memory for the segment
-    void* addr = kmalloc(size);
-    if (!addr) {
-        return -ENOMEM;
+static shm_segment_t* shm_create(key_t key, size_t size, int shmflg)
+{
+    size_t pages = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    shm_segment_t* seg = kmalloc_tracked(sizeof(shm_segment_t), "shm_segment");
+    if (!seg) return NULL;
+
+    uintptr_t phys = pmm_alloc_pages(pages);
+    if (!phys) {
+        kfree_tracked(seg);
+        return NULL;
+    }
+    // The block is counted on its head: give every frame its own count, so
+    // mappings can take and drop single pages
+    for (size_t i = 1; i < pages; i++) {
+        pmm_page(phys + i * PAGE_SIZE)->refcount = 1;
     }
+    memset((void*)phys, 0, pages * PAGE_SIZE);
+
+    memset(seg, 0, sizeof(shm_segment_t));
+    seg->key = key;
+    seg->phys = phys;
+    seg->size = size;
+    seg->pages = pages;
+    seg->creator = scheduler_get_current_task_id();
+    seg->flags = shmflg & 0777;
+    return seg;
+}
 
-    // Initialize segment
-    shm_segments[slot].shmid = next_shmid++;
-    shm_segments[slot].addr = addr;
-    shm_segments[slot].size = size;
-    shm_segments[slot].key = key;
-    shm_segments[slot].creator = 0; // Kernel process
-    shm_segments[slot].ref_count = 0;
-    shm_segments[slot].flags = shmflg;
+// ---- Kernel interface ----
 
-    KDEBUG("Created shared memory segment %d, size %lu bytes",
-           shm_segments[slot].shmid, size);
+// New private segment whose frames the kernel uses at *kaddr; the caller
+// owns it until shm_remove
+int shm_create_kernel(size_t size, void** kaddr)
+{
+    if (size == 0 || !kaddr) return -EINVAL;
+    shm_segment_t* seg = shm_create(IPC_PRIVATE, size, 0600);
+    if (!seg) return -ENOMEM;
+
+    uint64_t flags = spin_lock_irqsave(&shm_lock);
+    seg->shmid = next_shmid++;
+    uint32_t h = shm_hash((uint32_t)seg->shmid);
+    seg->id_next = shm_by_id[h];
+    shm_by_id[h] = seg;
+    spin_unlock_irqrestore(&shm_lock, flags);
+
+    *kaddr = (void*)seg->phys;
+    return seg->shmid;
+}
 
-    return shm_segments[slot].shmid;
+void shm_remove(int shmid)
+{
+    sys_shmctl(shmid, IPC_RMID, NULL);
 }
 
-// Shared memory attach (shmat)
-void* sys_shmat(int shmid, const void* shmaddr, int shmflg)
+// Where the running task has shmid attached, or NULL
+void* shm_attached_at(int shmid)
 {
-    // Find the segment
-    shm_segment_t* segment = NULL;
-    for (int i = 0; i < MAX_SHM_SEGMENTS; i++) {
-        if (shm_segments[i].shmid == shmid) {
-            segment = &shm_segments[i];
+    vm_context_t* ctx = scheduler_get_current_vm();
+    void* addr = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&shm_lock);
+    for (shm_attachment_t* a = shm_attachments; a; a = a->next) {
+        if (a->ctx == ctx && a->segment->shmid == shmid) {
+            addr = a->addr;
             break;
         }
     }
+    spin_unlock_irqrestore(&shm_lock, flags);
+    return addr;
+}
 
-    if (!segment) {
-        return (void*)-EINVAL; // Invalid shmid
-    }
+// System call implementations
 
-    // For demo, we'll map to a fixed virtual address range
-    // In real implementation, this would involve page table modifications
+// Shared memory get (shmget)
+int64_t sys_shmget(key_t key, size_t size, int shmflg)
+{
+    if (size == 0 && key == IPC_PRIVATE) {
+        return -EINVAL;
+    }
 
-    // Find free attachment slot
-    int attach_slot = -1;
-    for (int i = 0; i < MAX_SHM_ATTACHMENTS; i++) {
-        if (shm_attachments[i].shmid == 0) {
-            attach_slot = i;
-            break;
+    uint64_t flags = spin_lock_irqsave(&shm_lock);
+    if (key != IPC_PRIVATE) {
+        shm_segment_t* seg = shm_find_key(key);
+        if (seg) {
+            int64_t ret = seg->shmid;
+            if ((shmflg & IPC_CREAT) && (shmflg & IPC_EXCL)) {
+                ret = -EEXIST;
+            } else if (size > seg->size) {
+                ret = -EINVAL;
+            }
+            spin_unlock_irqrestore(&shm_lock, flags);
+            return ret;
+        }
+        if (!(shmflg & IPC_CREAT)) {
+            spin_unlock_irqrestore(&shm_lock, flags);
+            return -ENOENT;
         }
     }
+    spin_unlock_irqrestore(&shm_lock, flags);
 
-    if (attach_slot == -1) {
-        return (void*)-EMFILE; // Too many attachments
+    if (size == 0) {
+        return -EINVAL;
+    }
+    shm_segment_t* seg = shm_create(key, size, shmflg);
+    if (!seg) {
+        return -ENOMEM;
     }
 
-    // Create virtual mapping (simplified - just return kernel address for now)
-    // Real implementation would map pages into process address space
-    void* virtual_addr = segment->addr; // Use kernel address as virtual for demo
+    flags = spin_lock_irqsave(&shm_lock);
+    if (key != IPC_PRIVATE) {
+        // Someone may have created the key while we allocated
+        shm_segment_t* other = shm_find_key(key);
+        if (other) {
+            int64_t ret = (shmflg & IPC_EXCL) ? -EEXIST :
+                          size > other->size ? -EINVAL : other->shmid;
+            spin_unlock_irqrestore(&shm_lock, flags);
+            shm_free(seg);
+            return ret;
+        }
+        uint32_t h = shm_hash(key);
+        seg->key_next = shm_by_key[h];
+        shm_by_key[h] = seg;
+    }
+    seg->shmid = next_shmid++;
+    uint32_t h = shm_hash((uint32_t)seg->shmid);
+    seg->id_next = shm_by_id[h];
+    shm_by_id[h] = seg;
+    spin_unlock_irqrestore(&shm_lock, flags);
+
+    KDEBUG("Created shared memory segment %d, size %lu bytes", seg->shmid, size);
+    return seg->shmid;
+}
 
-    shm_attachments[attach_slot].shmid = shmid;
-    shm_attachments[attach_slot].addr = virtual_addr;
-    shm_attachments[attach_slot].size = segment->size;
+// Shared memory attach (shmat)
+void* sys_shmat(int shmid, const void* shmaddr, int shmflg)
+{
+    shm_attachment_t* attach = kmalloc_tracked(sizeof(shm_attachment_t), "shm_attach");
+    if (!attach) {
+        return (void*)-ENOMEM;
+    }
 
+    // Pin the segment before mapping outside the lock
+    uint64_t flags = spin_lock_irqsave(&shm_lock);
+    shm_segment_t* segment = shm_find_id(shmid);
+    if (!segment) {
+        spin_unlock_irqrestore(&shm_lock, flags);
+        kfree_tracked(attach);
+        return (void*)-EINVAL; // Invalid shmid
+    }
     segment->ref_count++;
+    spin_unlock_irqrestore(&shm_lock, flags);
+
+    // Kernel threads have no address space of their own: they use the
+    // frames where they are
+    vm_context_t* ctx = scheduler_get_current_vm();
+    void* virtual_addr = (void*)segment->phys;
+    if (ctx) {
+        int prot = PROT_READ | ((shmflg & SHM_RDONLY) ? 0 : PROT_WRITE);
+        virtual_addr = vmm_map_frames(ctx, (void*)shmaddr, segment->phys, segment->pages, prot);
+    }
+    if (!virtual_addr) {
+        kfree_tracked(attach);
+        flags = spin_lock_irqsave(&shm_lock);
+        bool last = --segment->ref_count == 0 && segment->removed;
+        if (last) shm_unhash_id(segment);
+        spin_unlock_irqrestore(&shm_lock, flags);
+        if (last) shm_free(segment);
+        return (void*)-ENOMEM;
+    }
+
+    attach->ctx = ctx;
+    attach->addr = virtual_addr;
+    attach->segment = segment;
+    flags = spin_lock_irqsave(&shm_lock);
+    attach->next = shm_attachments;
+    shm_attachments = attach;
+    spin_unlock_irqrestore(&shm_lock, flags);
 
     KDEBUG("Attached to shared memory segment %d at address 0x%lx",
            shmid, (uintptr_t)virtual_addr);
@@ -152,17 +311,27 @@ void* sys_shmat(int shmid, const void* shmaddr, int shmflg)
 // Shared memory control (shmctl)
 int64_t sys_shmctl(int shmid, int cmd, struct shmid_ds* buf)
 {
-    // Simplified implementation - only support IPC_RMID for demo
+    (void)buf;
+
+    // Simplified implementation - only support IPC_RMID
     if (cmd == IPC_RMID) {
-        for (int i = 0; i < MAX_SHM_SEGMENTS; i++) {
-            if (shm_segments[i].shmid == shmid) {
-                // Mark for destruction when refcount reaches 0
-                shm_segments[i].flags |= SHM_DEST; // Would need to define this
-                KDEBUG("Marked shared memory segment %d for destruction", shmid);
-                return 0;
-            }
+        uint64_t flags = spin_lock_irqsave(&shm_lock);
+        shm_segment_t* seg = shm_find_id(shmid);
+        if (!seg) {
+            spin_unlock_irqrestore(&shm_lock, flags);
+            return -EINVAL; // Invalid shmid
         }
-        return -EINVAL; // Invalid shmid
+
+        // The key is free at once; the memory goes with the last detach
+        shm_unhash_key(seg);
+        seg->removed = true;
+        bool idle = seg->ref_count == 0;
+        if (idle) shm_unhash_id(seg);
+        spin_unlock_irqrestore(&shm_lock, flags);
+
+        if (idle) shm_free(seg);
+        KDEBUG("Marked shared memory segment %d for destruction", shmid);
+        return 0;
     }
 
     // Other commands not implemented
@@ -172,36 +341,36 @@ int64_t sys_shmctl(int shmid, int cmd, struct shmid_ds* buf)
 // Shared memory detach (shmdt)
 int64_t sys_shmdt(const void* shmaddr)
 {
-    // Find attachment and detach
-    for (int i = 0; i < MAX_SHM_ATTACHMENTS; i++) {
-        if (shm_attachments[i].addr == shmaddr) {
-            int shmid = shm_attachments[i].shmid;
-
-            // Clear attachment
-            shm_attachments[i].shmid = 0;
-            shm_attachments[i].addr = NULL;
-
-            // Decrease refcount
-            for (int j = 0; j < MAX_SHM_SEGMENTS; j++) {
-                if (shm_segments[j].shmid == shmid) {
-                    shm_segments[j].ref_count--;
-                    if (shm_segments[j].ref_count == 0 &&
-                        (shm_segments[j].flags & SHM_DEST)) {
-                        // Free segment
-                        kfree(shm_segments[j].addr);
-                        memset(&shm_segments[j], 0, sizeof(shm_segment_t));
-                        KDEBUG("Destroyed shared memory segment %d", shmid);
-                    }
-                    break;
-                }
-            }
+    if (!shmaddr) return -EINVAL;
+    vm_context_t* ctx = scheduler_get_current_vm();
 
-            KDEBUG("Detached from shared memory at address 0x%lx", (uintptr_t)shmaddr);
-            return 0;
-        }
+    uint64_t flags = spin_lock_irqsave(&shm_lock);
+    shm_attachment_t** link = &shm_attachments;
+    while (*link && ((*link)->ctx != ctx || (*link)->addr != shmaddr)) {
+        link = &(*link)->next;
     }
+    shm_attachment_t* attach = *link;
+    if (!attach) {
+        spin_unlock_irqrestore(&shm_lock, flags);
+        return -EINVAL; // Address not attached
+    }
+    *link = attach->next;
+    spin_unlock_irqrestore(&shm_lock, flags);
+
+    shm_segment_t* seg = attach->segment;
+    if (ctx) {
+        vmm_munmap(ctx, attach->addr, seg->pages * PAGE_SIZE);
+    }
+    kfree_tracked(attach);
 
-    return -EINVAL; // Address not attached
+    flags = spin_lock_irqsave(&shm_lock);
+    bool last = --seg->ref_count == 0 && seg->removed;
+    if (last) shm_unhash_id(seg);
+    spin_unlock_irqrestore(&shm_lock, flags);
+    if (last) shm_free(seg);
+
+    KDEBUG("Detached from shared memory at address 0x%lx", (uintptr_t)shmaddr);
+    return 0;
 }
 
 // File operations (will be implemented with VFS later)
@@ -271,6 +440,19 @@ int64_t sys_munmap(unsigned long addr, size_t len)
     return -ENOSYS;
 }
 
+// Declared with the table's signature, so its entry needs no cast
+int64_t sys_madvise(uint64_t addr, uint64_t len, uint64_t advice, uint64_t arg4,
+                    uint64_t arg5, uint64_t arg6)
+{
+    (void)arg4;
+    (void)arg5;
+    (void)arg6;
+    if (vmm_madvise(vmm_current_context(), (void*)addr, len, (int)advice) < 0) {
+        return -EINVAL;
+    }
+    return SUCCESS;
+}
+
 // Process management
 int64_t sys_getpid(void)
 {
@@ -280,14 +462,39 @@ int64_t sys_getpid(void)
 int64_t sys_exit(int error_code)
 {
     KINFO("Process exiting with code %d", error_code);
-    scheduler_terminate();
+    scheduler_exit(error_code);
     return 0;  // Should not return
 }
 
+#define EXEC_PATH_MAX   256     // Longest path execve() takes
+
+// argv and envp aren't passed on yet: the program starts with empty ones
 int64_t sys_execve(const char* filename, const char* const argv[],
                 const char* const envp[])
 {
-    return -ENOSYS;
+    (void)argv;
+    (void)envp;
+    if ((uintptr_t)filename < USER_SPACE_START || (uintptr_t)filename >= USER_SPACE_END) {
+        return -EFAULT;
+    }
+
+    // A copy, so the path can't change under the lookup
+    char path[EXEC_PATH_MAX];
+    size_t len = 0;
+    while (len < sizeof(path) && (path[len] = filename[len]) != '\0') {
+        len++;
+    }
+    if (len == sizeof(path)) {
+        return -ENAMETOOLONG;
+    }
+
+    struct dentry* dentry = vfs_path_lookup(path);
+    if (!dentry) {
+        return -ENOENT;
+    }
+    int ret = elf_exec(dentry->d_inode);  // The mappings hold the inode
+    dput(dentry);
+    return ret < 0 ? -ENOEXEC : SUCCESS;
 }
 
 int64_t sys_fork(void)
@@ -317,6 +524,15 @@ int64_t sys_yield(void)
     return 0;
 }
 
+// Preferred NUMA node for the caller's memory; -1 for the node it runs on
+int64_t sys_set_mempolicy(int node)
+{
+    if (scheduler_set_mem_node(node) < 0) {
+        return -EINVAL;
+    }
+    return SUCCESS;
+}
+
 int64_t sys_gettimeofday(struct timeval* tv, struct timezone* tz)
 {
     return -ENOSYS;
@@ -329,7 +545,7 @@ int64_t sys_sysinfo(struct sysinfo* info)
 }
 
 // System call table (indexed by syscall number)
-syscall_handler_t sys_call_table[] = {
+const syscall_handler_t sys_call_table[NR_SYSCALLS] = {
     [SYS_read]         = (syscall_handler_t)sys_read,
     [SYS_write]        = (syscall_handler_t)sys_write,
     [SYS_open]         = (syscall_handler_t)sys_open,
@@ -338,6 +554,7 @@ syscall_handler_t sys_call_table[] = {
     [SYS_brk]          = (syscall_handler_t)sys_brk,
     [SYS_mmap]         = (syscall_handler_t)sys_mmap,
     [SYS_munmap]       = (syscall_handler_t)sys_munmap,
+    [SYS_madvise]      = sys_madvise,
     [SYS_shmget]       = (syscall_handler_t)sys_shmget,
     [SYS_shmat]        = (syscall_handler_t)sys_shmat,
     [SYS_shmctl]       = (syscall_handler_t)sys_shmctl,
@@ -349,6 +566,28 @@ syscall_handler_t sys_call_table[] = {
     [SYS_event_create_queue]  = (syscall_handler_t)sys_event_create_queue,
     [SYS_event_destroy_queue] = (syscall_handler_t)sys_event_destroy_queue,
     [SYS_event_get_next]      = (syscall_handler_t)sys_event_get_next,
+    [SYS_event_map_queue]     = (syscall_handler_t)sys_event_map_queue,
+    [SYS_ipc_create]          = (syscall_handler_t)sys_ipc_create,
+    [SYS_ipc_open]            = (syscall_handler_t)sys_ipc_open,
+    [SYS_ipc_destroy]         = (syscall_handler_t)sys_ipc_destroy,
+    [SYS_ipc_send]            = (syscall_handler_t)sys_ipc_send,
+    [SYS_ipc_call]            = (syscall_handler_t)sys_ipc_call,
+    [SYS_ipc_recv]            = (syscall_handler_t)sys_ipc_recv,
+    [SYS_ipc_reply]           = (syscall_handler_t)sys_ipc_reply,
+    [SYS_ipc_reply_recv]      = (syscall_handler_t)sys_ipc_reply_recv,
+    [SYS_ipc_map]             = (syscall_handler_t)sys_ipc_map,
+    [SYS_ipc_accept]          = (syscall_handler_t)sys_ipc_accept,
+    [SYS_trace_ctl]           = (syscall_handler_t)sys_trace_ctl,
+    [SYS_trace_map]           = (syscall_handler_t)sys_trace_map,
+    [SYS_trace_read]          = (syscall_handler_t)sys_trace_read,
+    [SYS_uring_setup]         = (syscall_handler_t)sys_uring_setup,
+    [SYS_uring_enter]         = (syscall_handler_t)sys_uring_enter,
+    [SYS_uring_map]           = (syscall_handler_t)sys_uring_map,
+    [SYS_uring_register]      = (syscall_handler_t)sys_uring_register,
+    [SYS_uring_destroy]       = (syscall_handler_t)sys_uring_destroy,
+    [SYS_prof_ctl]            = (syscall_handler_t)sys_prof_ctl,
+    [SYS_task_counters]       = (syscall_handler_t)sys_task_counters,
+    [SYS_set_mempolicy]       = (syscall_handler_t)sys_set_mempolicy,
     [SYS_get_display_info]    = (syscall_handler_t)sys_get_display_info,
     [SYS_window_create]       = (syscall_handler_t)sys_window_create,
     [SYS_window_destroy]      = (syscall_handler_t)sys_window_destroy,
@@ -356,6 +595,8 @@ syscall_handler_t sys_call_table[] = {
     [SYS_framebuffer_access]  = (syscall_handler_t)sys_framebuffer_access,
     [SYS_draw_rect]           = (syscall_handler_t)sys_draw_rect,
     [SYS_draw_circle]         = (syscall_handler_t)sys_draw_circle,
+    [SYS_window_map]          = (syscall_handler_t)sys_window_map,
+    [SYS_window_commit]       = (syscall_handler_t)sys_window_commit,
     [SYS_wait4]        = (syscall_handler_t)sys_wait4,
     [SYS_kill]         = (syscall_handler_t)sys_kill,
     [SYS_uname]        = (syscall_handler_t)sys_uname,
@@ -365,18 +606,58 @@ syscall_handler_t sys_call_table[] = {
     // Add more system calls as implemented...
 };
 
+// Per-CPU counters, so hot syscalls don't bounce a shared cache line
+typedef struct syscall_counter {
+    uint64_t calls;
+    uint64_t cycles;
+} syscall_counter_t;
+
+static syscall_counter_t syscall_counters[MAX_CPUS][NR_SYSCALLS];
+static uint64_t syscall_unknown[MAX_CPUS];
+
 // System call dispatcher
 int64_t syscall_dispatch(uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t arg3,
                         uint64_t arg4, uint64_t arg5, uint64_t arg6)
 {
-    if (num >= sizeof(sys_call_table) / sizeof(sys_call_table[0])) {
+    if (num >= NR_SYSCALLS || !sys_call_table[num]) {
+        uint64_t flags = irq_save();
+        syscall_unknown[smp_cpu_id()]++;
+        irq_restore(flags);
         return -ENOSYS;
     }
 
-    syscall_handler_t handler = sys_call_table[num];
-    if (!handler) {
-        return -ENOSYS;
+    uint64_t start = rdtsc();
+    int64_t ret = sys_call_table[num](arg1, arg2, arg3, arg4, arg5, arg6);
+
+    // The handler may have blocked and resumed elsewhere: charge that CPU,
+    // with interrupts off so a preemption can't move us off its counters
+    uint64_t cycles = rdtsc() - start;
+    uint64_t flags = irq_save();
+    syscall_counter_t* c = &syscall_counters[smp_cpu_id()][num];
+    c->calls++;
+    c->cycles += cycles;
+    irq_restore(flags);
+    TRACE(TRACE_SYSCALL, num, cycles);
+    return ret;
+}
+
+void syscall_get_stats(void)
+{
+    KINFO("=== System Call Statistics ===");
+    uint64_t unknown = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        unknown += syscall_unknown[cpu];
     }
 
-    return handler(arg1, arg2, arg3, arg4, arg5, arg6);
+    for (int num = 0; num < NR_SYSCALLS; num++) {
+        uint64_t calls = 0, cycles = 0;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            calls += syscall_counters[cpu][num].calls;
+            cycles += syscall_counters[cpu][num].cycles;
+        }
+        if (calls) {
+            KINFO("syscall %3d: %lu calls, %lu cycles avg", num, calls, cycles / calls);
+        }
+    }
+    KINFO("Unknown syscalls: %lu", unknown);
 }
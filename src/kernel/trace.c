@@ -0,0 +1,233 @@
+/*
+ * Static Tracepoints
+ *
+ * TRACE() sites across the kernel record fixed-size binary events - TSC,
+ * CPU, pid, event ID and two arguments - into a ring owned by the
+ * executing CPU. A record is claimed and written with interrupts off on
+ * that CPU alone, so no lock or atomic read-modify-write is involved, and
+ * the ring overwrites its oldest records rather than ever making a
+ * tracepoint wait.
+ *
+ * Readers never stop the writers. They copy what lies between their cursor
+ * and head, then look at head again: anything the writer may have reached
+ * in the meantime is discarded as lost. The rings live in one shared
+ * memory segment, so a tracing tool can map them read-only and do the same
+ * from user space.
+ */
+
+#include "kernel.h"
+#include "smp.h"
+#include "io.h"
+
+// ============================================================================
+// STATE
+// ============================================================================
+
+#define TRACE_RING_MASK (TRACE_RING_RECORDS - 1)
+
+volatile uint32_t trace_mask = 0;    // Categories being recorded
+static trace_buffer_t* trace_buf = NULL;
+static int trace_shmid = -1;
+static uint64_t trace_lost = 0;      // Records overwritten before a reader got them
+static uint64_t trace_nested = 0;    // Records dropped by an NMI inside trace_record()
+static bool trace_busy[MAX_CPUS];
+
+// ============================================================================
+// RECORDING
+// ============================================================================
+
+void trace_record(uint16_t id, uint64_t a0, uint64_t a1)
+{
+    trace_buffer_t* buf = trace_buf;
+    if (!buf) return;
+
+    // An interrupt's tracepoint would otherwise claim the same slot. An NMI
+    // (profiler sample) gets through anyway, and drops its record instead.
+    uint64_t flags = irq_save();
+    uint32_t cpu = (uint32_t)smp_cpu_id();
+    if (cpu < buf->cpus && trace_busy[cpu]) {
+        __atomic_fetch_add(&trace_nested, 1, __ATOMIC_RELAXED);
+    } else if (cpu < buf->cpus) {
+        trace_busy[cpu] = true;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        trace_ring_t* ring = &buf->rings[cpu];
+        uint64_t head = ring->head;
+        trace_record_t* r = &ring->records[head & TRACE_RING_MASK];
+        r->tsc = rdtsc();
+        r->id = id;
+        r->cpu = (uint16_t)cpu;
+        r->pid = (uint32_t)scheduler_get_current_task_id();
+        r->arg[0] = a0;
+        r->arg[1] = a1;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        trace_busy[cpu] = false;
+    }
+    irq_restore(flags);
+}
+
+uint32_t trace_set_mask(uint32_t mask)
+{
+    if (!trace_buf) return 0;
+    return __atomic_exchange_n(&trace_mask, mask, __ATOMIC_RELAXED);
+}
+
+// ============================================================================
+// READING
+// ============================================================================
+
+// Copy up to max records of one CPU, oldest first, from *cursor on (0 for
+// the oldest still held) and advance it. Returns the number copied.
+size_t trace_read(int cpu, uint64_t* cursor, trace_record_t* out, size_t max)
+{
+    if (!trace_buf || cpu < 0 || (uint32_t)cpu >= trace_buf->cpus || !cursor || !out) {
+        return 0;
+    }
+
+    trace_ring_t* ring = &trace_buf->rings[cpu];
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t start = *cursor;
+    if (start > head) {
+        start = head;
+    }
+    if (head - start > TRACE_RING_RECORDS) {
+        if (start) {
+            __atomic_fetch_add(&trace_lost, head - TRACE_RING_RECORDS - start, __ATOMIC_RELAXED);
+        }
+        start = head - TRACE_RING_RECORDS;
+    }
+
+    size_t n = head - start;
+    if (n > max) n = max;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = ring->records[(start + i) & TRACE_RING_MASK];
+    }
+
+    // The writer is on to index now, in the slot of now - TRACE_RING_RECORDS:
+    // copies from there back may be torn or newer
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first_valid = now >= TRACE_RING_RECORDS ? now - TRACE_RING_RECORDS + 1 : 0;
+    if (start < first_valid) {
+        size_t skip = first_valid - start;
+        if (skip > n) skip = n;
+        memmove(out, out + skip, (n - skip) * sizeof(trace_record_t));
+        __atomic_fetch_add(&trace_lost, skip, __ATOMIC_RELAXED);
+        n -= skip;
+        start += skip;
+    }
+
+    *cursor = start + n;
+    return n;
+}
+
+static const char* trace_event_name(uint16_t id)
+{
+    switch (id) {
+    case TRACE_SCHED_SWITCH: return "sched_switch";
+    case TRACE_SCHED_STEAL:  return "sched_steal";
+    case TRACE_PMM_ALLOC:    return "pmm_alloc";
+    case TRACE_PMM_FREE:     return "pmm_free";
+    case TRACE_PAGE_FAULT:   return "page_fault";
+    case TRACE_PAGE_MAPPED:  return "page_mapped";
+    case TRACE_COW_FAULT:    return "cow_fault";
+    case TRACE_SYSCALL:      return "syscall";
+    case TRACE_PROF_SAMPLE:  return "prof_sample";
+    case TRACE_PROF_STACK:   return "prof_stack";
+    default:                 return "unknown";
+    }
+}
+
+// Formatting happens here, long after the events, never at the tracepoint
+void trace_dump(size_t per_cpu)
+{
+    if (!trace_buf) return;
+
+    trace_record_t batch[16];
+    for (uint32_t cpu = 0; cpu < trace_buf->cpus; cpu++) {
+        uint64_t head = __atomic_load_n(&trace_buf->rings[cpu].head, __ATOMIC_ACQUIRE);
+        uint64_t cursor = head > per_cpu ? head - per_cpu : 0;
+        KINFO("=== Trace: CPU %u, records %lu-%lu ===", cpu, cursor, head);
+
+        size_t n;
+        while (cursor < head &&
+               (n = trace_read((int)cpu, &cursor, batch, sizeof(batch) / sizeof(batch[0]))) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                trace_record_t* r = &batch[i];
+                KINFO("%lu %s pid %u: 0x%lx 0x%lx", r->tsc - trace_buf->tsc_start,
+                      trace_event_name(r->id), r->pid, r->arg[0], r->arg[1]);
+            }
+        }
+    }
+}
+
+void trace_get_stats(void)
+{
+    KINFO("=== Trace Statistics ===");
+    if (!trace_buf) {
+        KINFO("Tracing not initialized");
+        return;
+    }
+
+    uint64_t total = 0;
+    for (uint32_t cpu = 0; cpu < trace_buf->cpus; cpu++) {
+        total += trace_buf->rings[cpu].head;
+    }
+    KINFO("Category mask: 0x%x, records: %lu, lost by readers: %lu, dropped in NMI: %lu",
+          trace_mask, total, trace_lost, trace_nested);
+}
+
+// ============================================================================
+// INITIALIZATION
+// ============================================================================
+
+// After smp_init(): one ring for every CPU that came up
+void trace_init(void)
+{
+    uint32_t cpus = (uint32_t)smp_cpu_count();
+    void* kaddr;
+    int shmid = shm_create_kernel(sizeof(trace_buffer_t) + cpus * sizeof(trace_ring_t), &kaddr);
+    if (shmid < 0) {
+        KWARN("Trace: no memory for %u rings, tracepoints disabled", cpus);
+        return;
+    }
+
+    // The segment comes zeroed: every head starts at 0
+    trace_buffer_t* buf = (trace_buffer_t*)kaddr;
+    buf->cpus = cpus;
+    buf->ring_records = TRACE_RING_RECORDS;
+    buf->tsc_start = rdtsc();
+    trace_shmid = shmid;
+    __atomic_store_n(&trace_buf, buf, __ATOMIC_RELEASE);
+
+    KINFO("Trace: %u rings of %d records (%lu KB)", cpus, TRACE_RING_RECORDS,
+          (sizeof(trace_buffer_t) + cpus * sizeof(trace_ring_t)) / 1024);
+}
+
+// ============================================================================
+// SYSCALL INTERFACE
+// ============================================================================
+
+int64_t sys_trace_ctl(uint32_t mask)
+{
+    if (!trace_buf) return -1;
+    return trace_set_mask(mask);
+}
+
+// The buffer, mapped read-only into the caller
+trace_buffer_t* sys_trace_map(void)
+{
+    if (trace_shmid < 0) return NULL;
+
+    void* addr = shm_attached_at(trace_shmid);
+    if (!addr) {
+        addr = sys_shmat(trace_shmid, NULL, SHM_RDONLY);
+        if ((intptr_t)addr < 0) return NULL;
+    }
+    return (trace_buffer_t*)addr;
+}
+
+int64_t sys_trace_read(int cpu, uint64_t* cursor, trace_record_t* out, size_t max)
+{
+    return (int64_t)trace_read(cpu, cursor, out, max);
+}
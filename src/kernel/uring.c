@@ -0,0 +1,807 @@
+/*
+ * Asynchronous I/O Rings
+ *
+ * A task queues requests - file read, write and fsync, socket accept, send
+ * and recv - in a submission ring it shares with the kernel and reaps the
+ * results from a completion ring beside it. One uring_enter() hands over a
+ * whole batch and can wait for completions in the same call; with
+ * URING_SETUP_SQPOLL the ring's worker watches the submission ring itself,
+ * so a busy task makes no calls at all.
+ *
+ * Every ring has a worker task that carries the operations out. File reads
+ * start their block I/O through readahead as they are submitted, so a batch
+ * of reads is at the disk together rather than one after another. Socket
+ * operations hang on the connection's wait queue as watchers and reach the
+ * worker only once they can make progress. Buffers in a user address space
+ * are pinned at submission, or registered once up front, and the worker
+ * reaches them through the kernel's identity map.
+ *
+ * Files and sockets are named by index into the ring's object table,
+ * checked for range and type at submission; a submitter never hands the
+ * kernel a pointer.
+ */
+
+#include "kernel.h"
+#include "vmm.h"
+#include "vfs.h"
+#include "net.h"
+#include "page_cache.h"
+
+// ============================================================================
+// CONFIGURATION
+// ============================================================================
+
+#define URING_MAX_RINGS       16
+#define URING_MAX_IO          (1024 * 1024)   // Bytes per request
+#define URING_SQPOLL_IDLE_US  2000            // SQPOLL worker polls this long before sleeping
+#define URING_WORKER_PRIORITY 10
+
+// ============================================================================
+// DATA STRUCTURES
+// ============================================================================
+
+// A buffer pinned by uring_register_buffer() until the ring goes away
+typedef struct {
+    uintptr_t base;               // Page aligned; 0 if the slot is free
+    size_t pages;
+    uintptr_t* frames;
+} uring_buffer_t;
+
+// A file or socket requests can name, registered until the ring goes away
+typedef struct {
+    uint8_t type;                 // URING_OBJ_*, 0 if the slot is free
+    bool owned;                   // Accepted by the ring: closed with it
+    void* ptr;                    // NULL while an accept holds the slot
+} uring_object_t;
+
+typedef struct uring_ctx uring_ctx_t;
+
+typedef struct uring_req {
+    struct uring_req* next;       // Work list
+    struct uring_req* wait_prev;  // Waiting for a socket (ctx->lock)
+    struct uring_req* wait_next;
+    uring_ctx_t* ctx;
+    uring_sqe_t sqe;              // Copied: the slot is the task's again
+    void* obj;                    // What sqe.obj names
+    uint32_t want;                // EPOLLIN / EPOLLOUT a socket request waits for
+    bool armed;                   // Watching; the first wakeup queues it (ctx->lock)
+    wait_entry_t wait;
+    const uintptr_t* frames;      // Buffer pages, NULL if addr is reachable as it is
+    size_t page_off;              // Where the buffer starts in frames[0]
+    size_t pinned;                // own_frames referenced by this request
+    uintptr_t own_frames[];
+} uring_req_t;
+
+struct uring_ctx {
+    bool used;
+    volatile bool dying;
+    pid_t owner;
+    uint32_t flags;               // URING_SETUP_*
+    int shmid;
+    uring_t* ring;                // Kernel address of the shared rings
+    vm_context_t* vm;             // Owner's address space, NULL for a kernel task
+    spinlock_t lock;              // Work and waiting lists, armed flags, CQ tail, objects
+    uring_req_t* work_head;
+    uring_req_t* work_tail;
+    uring_req_t* waiting;
+    volatile uint32_t inflight;   // Consumed, not yet completed
+    wait_queue_t work_wq;         // The worker, when idle
+    wait_queue_t cq_wq;           // uring_enter() waiting for completions
+    uring_buffer_t buffers[URING_MAX_BUFFERS];
+    uring_object_t objects[URING_MAX_OBJECTS];
+};
+
+static uring_ctx_t urings[URING_MAX_RINGS];
+static spinlock_t urings_lock = SPINLOCK_INIT;
+
+// Statistics
+static uint64_t uring_submitted = 0;
+static uint64_t uring_completed = 0;
+static uint64_t uring_enters = 0;
+static uint64_t uring_socket_waits = 0;   // Requests that had to watch a socket
+static uint64_t uring_sqpoll_wakeups = 0;
+
+// ============================================================================
+// COMPLETIONS
+// ============================================================================
+
+static void uring_complete(uring_ctx_t* ctx, uint64_t user_data, int64_t res)
+{
+    uint64_t flags = spin_lock_irqsave(&ctx->lock);
+    uring_t* ring = ctx->ring;
+    uint32_t tail = ring->cq_tail;
+    ring->cqes[tail & URING_CQ_MASK].user_data = user_data;
+    ring->cqes[tail & URING_CQ_MASK].res = res;
+    __atomic_store_n(&ring->cq_tail, tail + 1, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&ctx->lock, flags);
+
+    __atomic_fetch_sub(&ctx->inflight, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&uring_completed, 1, __ATOMIC_RELAXED);
+    wake_up(&ctx->cq_wq);
+}
+
+// Completions the task hasn't reaped; a bogus cq_head counts as a full ring
+static uint32_t uring_cq_used(uring_ctx_t* ctx)
+{
+    uint32_t used = ctx->ring->cq_tail - __atomic_load_n(&ctx->ring->cq_head, __ATOMIC_ACQUIRE);
+    return used > URING_CQ_ENTRIES ? URING_CQ_ENTRIES : used;
+}
+
+static void uring_req_free(uring_req_t* req)
+{
+    for (size_t i = 0; i < req->pinned; i++) {
+        pmm_page_unref(req->own_frames[i], 1);
+    }
+    kfree_tracked(req);
+}
+
+static void uring_finish(uring_req_t* req, int64_t res)
+{
+    uring_complete(req->ctx, req->sqe.user_data, res);
+    uring_req_free(req);
+}
+
+// ============================================================================
+// WORK LIST AND SOCKET WATCHERS
+// ============================================================================
+
+// Hand a request to the worker (ctx->lock held)
+static void uring_queue_locked(uring_ctx_t* ctx, uring_req_t* req)
+{
+    req->next = NULL;
+    if (ctx->work_tail) {
+        ctx->work_tail->next = req;
+    } else {
+        ctx->work_head = req;
+    }
+    ctx->work_tail = req;
+}
+
+static void uring_queue(uring_ctx_t* ctx, uring_req_t* req)
+{
+    uint64_t flags = spin_lock_irqsave(&ctx->lock);
+    uring_queue_locked(ctx, req);
+    spin_unlock_irqrestore(&ctx->lock, flags);
+    wake_up(&ctx->work_wq);
+}
+
+static void uring_unwait_locked(uring_ctx_t* ctx, uring_req_t* req)
+{
+    if (req->wait_prev) {
+        req->wait_prev->wait_next = req->wait_next;
+    } else {
+        ctx->waiting = req->wait_next;
+    }
+    if (req->wait_next) req->wait_next->wait_prev = req->wait_prev;
+    req->wait_prev = req->wait_next = NULL;
+}
+
+// Watcher on the socket's queue: under that queue's lock, maybe in
+// interrupt context. The first wakeup moves the request to the worker.
+static void uring_socket_wakeup(wait_entry_t* entry)
+{
+    uring_req_t* req = (uring_req_t*)entry->data;
+    uring_ctx_t* ctx = req->ctx;
+
+    uint64_t flags = spin_lock_irqsave(&ctx->lock);
+    bool fire = req->armed;
+    if (fire) {
+        req->armed = false;
+        uring_unwait_locked(ctx, req);
+        uring_queue_locked(ctx, req);
+    }
+    spin_unlock_irqrestore(&ctx->lock, flags);
+
+    if (fire) wake_up(&ctx->work_wq);
+}
+
+// Wait for the socket to become ready, or queue the request if it is
+static void uring_arm(uring_ctx_t* ctx, uring_req_t* req)
+{
+    wait_queue_t* wq = NULL;
+    tcp_poll(req->obj, &wq);
+
+    uint64_t flags = spin_lock_irqsave(&ctx->lock);
+    req->armed = true;
+    req->wait_prev = NULL;
+    req->wait_next = ctx->waiting;
+    if (ctx->waiting) ctx->waiting->wait_prev = req;
+    ctx->waiting = req;
+    spin_unlock_irqrestore(&ctx->lock, flags);
+
+    wait_add_watch(wq, &req->wait, uring_socket_wakeup, req);
+    if (tcp_poll(req->obj, &wq) & (req->want | EPOLLERR | EPOLLHUP)) {
+        uring_socket_wakeup(&req->wait);  // Ready before the watch went on
+    } else {
+        __atomic_fetch_add(&uring_socket_waits, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// ============================================================================
+// SUBMISSION
+// ============================================================================
+
+// Make the buffer reachable from the worker: as it is for a kernel task,
+// else through a registered buffer or pages pinned now
+static int uring_attach_buffer(uring_ctx_t* ctx, uring_req_t* req, size_t pages)
+{
+    uintptr_t addr = (uintptr_t)req->sqe.addr;
+    uintptr_t base = addr & ~(uintptr_t)(PAGE_SIZE - 1);
+    if (!ctx->vm || req->sqe.len == 0) return 0;
+
+    req->page_off = addr - base;
+    for (int i = 0; i < URING_MAX_BUFFERS; i++) {
+        uring_buffer_t* buf = &ctx->buffers[i];
+        if (buf->base && base >= buf->base &&
+            addr + req->sqe.len <= buf->base + buf->pages * PAGE_SIZE) {
+            req->frames = buf->frames + (base - buf->base) / PAGE_SIZE;
+            return 0;
+        }
+    }
+
+    // The SQPOLL worker runs in no address space of its own: it can only
+    // use what was registered
+    if (ctx->flags & URING_SETUP_SQPOLL) return -1;
+    if (vmm_pin_frames(base, pages, req->own_frames) < 0) return -1;
+    req->frames = req->own_frames;
+    req->pinned = pages;
+    return 0;
+}
+
+// Start the block reads behind a file read now; the worker's read then
+// finds them in flight or done
+static void uring_readahead(uring_req_t* req)
+{
+    struct file* file = (struct file*)req->obj;
+    struct inode* inode = file->f_inode;
+    if (!inode || !inode->i_mapping) return;
+
+    uint64_t off = req->sqe.off == URING_OFF_CURRENT ? file->f_pos : req->sqe.off;
+    if (off >= inode->i_size) return;
+    uint64_t end = off + req->sqe.len;
+    if (end > inode->i_size) end = inode->i_size;
+    uint64_t first = off / PAGE_SIZE;
+    page_cache_readahead(inode->i_mapping, first, (end + PAGE_SIZE - 1) / PAGE_SIZE - first);
+}
+
+// ctx->lock held
+static int uring_object_alloc_locked(uring_ctx_t* ctx, int type, void* obj)
+{
+    for (int i = 0; i < URING_MAX_OBJECTS; i++) {
+        if (!ctx->objects[i].type) {
+            ctx->objects[i].type = (uint8_t)type;
+            ctx->objects[i].owned = false;
+            ctx->objects[i].ptr = obj;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The object index names, if it is registered and of the type op works on
+static void* uring_object_get(uring_ctx_t* ctx, uint64_t index, uint8_t op)
+{
+    int type = op == URING_OP_ACCEPT || op == URING_OP_SEND || op == URING_OP_RECV ?
+               URING_OBJ_SOCKET : URING_OBJ_FILE;
+    if (index >= URING_MAX_OBJECTS) return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&ctx->lock);
+    void* obj = ctx->objects[index].type == type ? ctx->objects[index].ptr : NULL;
+    spin_unlock_irqrestore(&ctx->lock, flags);
+    return obj;
+}
+
+static void uring_start(uring_ctx_t* ctx, const uring_sqe_t* sqe)
+{
+    uint8_t op = sqe->opcode;
+    if (op == URING_OP_NOP) {
+        uring_complete(ctx, sqe->user_data, 0);
+        return;
+    }
+
+    bool buffered = op == URING_OP_READ || op == URING_OP_WRITE ||
+                    op == URING_OP_SEND || op == URING_OP_RECV;
+    void* obj = op <= URING_OP_RECV ? uring_object_get(ctx, sqe->obj, op) : NULL;
+    if (!obj || (buffered && (sqe->len > URING_MAX_IO || (sqe->len && !sqe->addr)))) {
+        uring_complete(ctx, sqe->user_data, -1);
+        return;
+    }
+
+    size_t pages = 0;
+    if (buffered && ctx->vm && sqe->len) {
+        uintptr_t addr = (uintptr_t)sqe->addr;
+        pages = (ALIGN_UP(addr + sqe->len, PAGE_SIZE) - (addr & ~(uintptr_t)(PAGE_SIZE - 1))) / PAGE_SIZE;
+    }
+    uring_req_t* req = kmalloc_tracked(sizeof(uring_req_t) + pages * sizeof(uintptr_t), "uring_req");
+    if (!req) {
+        uring_complete(ctx, sqe->user_data, -1);
+        return;
+    }
+    memset(req, 0, sizeof(uring_req_t));
+    req->ctx = ctx;
+    req->sqe = *sqe;
+    req->obj = obj;
+
+    if (buffered && uring_attach_buffer(ctx, req, pages) < 0) {
+        uring_finish(req, -1);
+        return;
+    }
+
+    switch (op) {
+    case URING_OP_READ:
+        uring_readahead(req);
+        uring_queue(ctx, req);
+        break;
+    case URING_OP_ACCEPT:
+    case URING_OP_RECV:
+        req->want = EPOLLIN;
+        uring_arm(ctx, req);
+        break;
+    case URING_OP_SEND:
+        req->want = EPOLLOUT;
+        uring_arm(ctx, req);
+        break;
+    default:
+        uring_queue(ctx, req);
+        break;
+    }
+}
+
+// Consume up to max submissions, as long as their completions are sure to
+// have room. Returns how many were taken.
+static uint32_t uring_submit(uring_ctx_t* ctx, uint32_t max)
+{
+    uring_t* ring = ctx->ring;
+    uint32_t head = ring->sq_head;
+    uint32_t tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+    uint32_t taken = 0;
+
+    while (head != tail && taken < max &&
+           ctx->inflight + uring_cq_used(ctx) < URING_CQ_ENTRIES) {
+        uring_sqe_t sqe = ring->sqes[head & URING_SQ_MASK];
+        __atomic_store_n(&ring->sq_head, ++head, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&ctx->inflight, 1, __ATOMIC_RELAXED);
+        uring_start(ctx, &sqe);
+        taken++;
+    }
+
+    __atomic_fetch_add(&uring_submitted, taken, __ATOMIC_RELAXED);
+    return taken;
+}
+
+static bool uring_sq_ready(uring_ctx_t* ctx)
+{
+    return ctx->ring->sq_head != __atomic_load_n(&ctx->ring->sq_tail, __ATOMIC_ACQUIRE) &&
+           ctx->inflight + uring_cq_used(ctx) < URING_CQ_ENTRIES;
+}
+
+// ============================================================================
+// WORKER
+// ============================================================================
+
+typedef ssize_t (*uring_io_fn)(uring_req_t* req, void* buf, size_t len, loff_t* pos);
+
+static ssize_t uring_file_read(uring_req_t* req, void* buf, size_t len, loff_t* pos)
+{
+    struct file* file = (struct file*)req->obj;
+    return file->f_op->read(file, (char*)buf, len, pos);
+}
+
+static ssize_t uring_file_write(uring_req_t* req, void* buf, size_t len, loff_t* pos)
+{
+    struct file* file = (struct file*)req->obj;
+    return file->f_op->write(file, (const char*)buf, len, pos);
+}
+
+static ssize_t uring_socket_recv(uring_req_t* req, void* buf, size_t len, loff_t* pos)
+{
+    (void)pos;
+    return tcp_read((tcp_pcb_t*)req->obj, buf, len);
+}
+
+static ssize_t uring_socket_send(uring_req_t* req, void* buf, size_t len, loff_t* pos)
+{
+    (void)pos;
+    return tcp_write((tcp_pcb_t*)req->obj, buf, len);
+}
+
+// Run fn over the buffer, a physically contiguous run of pages at a time.
+// Stops at a short transfer, or when a socket has nothing more right now.
+static int64_t uring_transfer(uring_req_t* req, uring_io_fn fn, loff_t* pos)
+{
+    size_t len = req->sqe.len;
+    if (!req->frames) {
+        return fn(req, req->sqe.addr, len, pos);
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        wait_queue_t* wq;
+        if (done && req->want && !(tcp_poll(req->obj, &wq) & req->want)) break;
+
+        size_t at = req->page_off + done;
+        size_t first = at / PAGE_SIZE, last = first;
+        while ((last + 1) * PAGE_SIZE < req->page_off + len &&
+               req->frames[last + 1] == req->frames[last] + PAGE_SIZE) {
+            last++;
+        }
+        size_t chunk = (last + 1) * PAGE_SIZE - at;
+        if (chunk > len - done) chunk = len - done;
+
+        ssize_t n = fn(req, (uint8_t*)req->frames[first] + at % PAGE_SIZE, chunk, pos);
+        if (n < 0) return done ? (int64_t)done : -1;
+        done += n;
+        if ((size_t)n < chunk) break;
+    }
+    return (int64_t)done;
+}
+
+// The new connection goes in a slot taken first, so it is never accepted
+// with nowhere to put it
+static int64_t uring_accept(uring_req_t* req)
+{
+    uring_ctx_t* ctx = req->ctx;
+    uint64_t flags = spin_lock_irqsave(&ctx->lock);
+    int slot = uring_object_alloc_locked(ctx, URING_OBJ_SOCKET, NULL);
+    spin_unlock_irqrestore(&ctx->lock, flags);
+    if (slot < 0) return -1;
+
+    tcp_pcb_t* conn = tcp_accept((tcp_pcb_t*)req->obj);
+    flags = spin_lock_irqsave(&ctx->lock);
+    if (conn) {
+        ctx->objects[slot].ptr = conn;
+        ctx->objects[slot].owned = true;
+    } else {
+        ctx->objects[slot].type = 0;
+    }
+    spin_unlock_irqrestore(&ctx->lock, flags);
+    return conn ? slot : -1;
+}
+
+static int64_t uring_execute(uring_req_t* req)
+{
+    uring_sqe_t* sqe = &req->sqe;
+    struct file* file = (struct file*)req->obj;
+
+    switch (sqe->opcode) {
+    case URING_OP_READ:
+    case URING_OP_WRITE: {
+        bool read = sqe->opcode == URING_OP_READ;
+        if (!file->f_op || !(read ? (void*)file->f_op->read : (void*)file->f_op->write)) {
+            return -1;
+        }
+        loff_t pos = sqe->off == URING_OFF_CURRENT ? (loff_t)file->f_pos : (loff_t)sqe->off;
+        int64_t res = uring_transfer(req, read ? uring_file_read : uring_file_write, &pos);
+        if (sqe->off == URING_OFF_CURRENT && res > 0) file->f_pos = pos;
+        return res;
+    }
+    case URING_OP_FSYNC:
+        if (!file->f_inode || !file->f_inode->i_mapping) return 0;
+        return page_cache_sync(file->f_inode->i_mapping) < 0 ? -1 : 0;
+    case URING_OP_ACCEPT:
+        return uring_accept(req);
+    case URING_OP_SEND:
+        return uring_transfer(req, uring_socket_send, NULL);
+    case URING_OP_RECV:
+        return uring_transfer(req, uring_socket_recv, NULL);
+    }
+    return -1;
+}
+
+static void uring_run(uring_ctx_t* ctx, uring_req_t* req)
+{
+    if (req->want) {
+        wait_remove_watch(&req->wait);  // No more wakeups for this request
+
+        // Woken for some other change: wait again
+        wait_queue_t* wq;
+        if (!(tcp_poll(req->obj, &wq) & (req->want | EPOLLERR | EPOLLHUP))) {
+            uring_arm(ctx, req);
+            return;
+        }
+    }
+    uring_finish(req, uring_execute(req));
+}
+
+static uring_req_t* uring_pop_work(uring_ctx_t* ctx)
+{
+    uint64_t flags = spin_lock_irqsave(&ctx->lock);
+    uring_req_t* req = ctx->work_head;
+    if (req) {
+        ctx->work_head = req->next;
+        if (!ctx->work_head) ctx->work_tail = NULL;
+    }
+    spin_unlock_irqrestore(&ctx->lock, flags);
+    return req;
+}
+
+// Teardown: fail what still waits on sockets, unpin, close the connections
+// it accepted, free the slot
+static void uring_release(uring_ctx_t* ctx)
+{
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&ctx->lock);
+        uring_req_t* req = ctx->waiting;
+        if (req) {
+            req->armed = false;
+            uring_unwait_locked(ctx, req);
+        }
+        spin_unlock_irqrestore(&ctx->lock, flags);
+        if (!req) break;
+        wait_remove_watch(&req->wait);
+        uring_finish(req, -1);
+    }
+
+    for (int i = 0; i < URING_MAX_BUFFERS; i++) {
+        uring_buffer_t* buf = &ctx->buffers[i];
+        if (!buf->base) continue;
+        for (size_t p = 0; p < buf->pages; p++) {
+            pmm_page_unref(buf->frames[p], 1);
+        }
+        kfree_tracked(buf->frames);
+        buf->base = 0;
+    }
+    for (int i = 0; i < URING_MAX_OBJECTS; i++) {
+        uring_object_t* obj = &ctx->objects[i];
+        if (obj->owned && obj->ptr) tcp_close((tcp_pcb_t*)obj->ptr);
+        obj->type = 0;
+    }
+    shm_remove(ctx->shmid);  // A mapping keeps the rings until it detaches
+
+    uint64_t flags = spin_lock_irqsave(&urings_lock);
+    ctx->used = false;
+    spin_unlock_irqrestore(&urings_lock, flags);
+}
+
+static void uring_worker(void* arg)
+{
+    uring_ctx_t* ctx = (uring_ctx_t*)arg;
+    bool sqpoll = (ctx->flags & URING_SETUP_SQPOLL) != 0;
+    uint64_t busy_at = time_monotonic_us();
+
+    for (;;) {
+        if (sqpoll && !ctx->dying && uring_submit(ctx, URING_SQ_ENTRIES)) {
+            busy_at = time_monotonic_us();
+        }
+
+        uring_req_t* req = uring_pop_work(ctx);
+        if (req) {
+            uring_run(ctx, req);
+            busy_at = time_monotonic_us();
+            continue;
+        }
+        if (ctx->dying) break;
+
+        // SQPOLL: keep looking for a while, so a steady stream needs no wakeups
+        if (sqpoll && time_monotonic_us() - busy_at < URING_SQPOLL_IDLE_US) {
+            scheduler_yield();
+            continue;
+        }
+
+        // Flag first, then look again: a submitter that misses the
+        // submission check sees the flag
+        wait_entry_t wait;
+        wait_prepare(&ctx->work_wq, &wait);
+        if (sqpoll) {
+            __atomic_or_fetch(&ctx->ring->sq_flags, URING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+        }
+        if (!ctx->work_head && !ctx->dying && !(sqpoll && uring_sq_ready(ctx))) {
+            wait_schedule(&wait, WAIT_FOREVER);
+        }
+        wait_finish(&wait);
+        if (sqpoll) {
+            __atomic_and_fetch(&ctx->ring->sq_flags, ~URING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+        }
+        busy_at = time_monotonic_us();
+    }
+
+    uring_release(ctx);
+}
+
+// ============================================================================
+// PUBLIC API
+// ============================================================================
+
+static uring_ctx_t* uring_lookup(int ring)
+{
+    if (ring < 0 || ring >= URING_MAX_RINGS) return NULL;
+    uring_ctx_t* ctx = &urings[ring];
+    if (!ctx->used || ctx->dying || ctx->owner != scheduler_get_current_task_id()) {
+        return NULL;
+    }
+    return ctx;
+}
+
+int uring_setup(uint32_t flags)
+{
+    if (flags & ~URING_SETUP_SQPOLL) return -1;
+
+    void* kaddr;
+    int shmid = shm_create_kernel(sizeof(uring_t), &kaddr);
+    if (shmid < 0) {
+        KERROR("uring: no memory for the rings");
+        return -1;
+    }
+
+    uint64_t lock_flags = spin_lock_irqsave(&urings_lock);
+    int id = -1;
+    for (int i = 0; i < URING_MAX_RINGS; i++) {
+        if (!urings[i].used) {
+            id = i;
+            memset(&urings[i], 0, sizeof(uring_ctx_t));
+            urings[i].used = true;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&urings_lock, lock_flags);
+    if (id < 0) {
+        shm_remove(shmid);
+        KERROR("uring: all %d rings in use", URING_MAX_RINGS);
+        return -1;
+    }
+
+    // The segment comes zeroed: both rings start empty
+    uring_ctx_t* ctx = &urings[id];
+    ctx->owner = scheduler_get_current_task_id();
+    ctx->flags = flags;
+    ctx->shmid = shmid;
+    ctx->ring = (uring_t*)kaddr;
+    ctx->vm = scheduler_get_current_vm();
+    wait_queue_init(&ctx->work_wq);
+    wait_queue_init(&ctx->cq_wq);
+
+    if (scheduler_create_task(uring_worker, ctx, 8192, URING_WORKER_PRIORITY, "uring") < 0) {
+        shm_remove(shmid);
+        ctx->used = false;
+        KERROR("uring: no worker task");
+        return -1;
+    }
+    return id;
+}
+
+int uring_enter(int ring, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    uring_ctx_t* ctx = uring_lookup(ring);
+    if (!ctx) return -1;
+    __atomic_fetch_add(&uring_enters, 1, __ATOMIC_RELAXED);
+
+    int submitted = 0;
+    if (ctx->flags & URING_SETUP_SQPOLL) {
+        if (flags & URING_ENTER_SQ_WAKEUP) {
+            __atomic_fetch_add(&uring_sqpoll_wakeups, 1, __ATOMIC_RELAXED);
+            wake_up(&ctx->work_wq);
+        }
+    } else if (to_submit) {
+        submitted = (int)uring_submit(ctx, to_submit);
+    }
+
+    if (min_complete > URING_CQ_ENTRIES) min_complete = URING_CQ_ENTRIES;
+    if (min_complete) {
+        wait_entry_t wait;
+        for (;;) {
+            wait_prepare(&ctx->cq_wq, &wait);
+            // Stop when enough are there, or when no more can come
+            if (uring_cq_used(ctx) >= min_complete || ctx->dying ||
+                (ctx->inflight == 0 && !((ctx->flags & URING_SETUP_SQPOLL) && uring_sq_ready(ctx)))) {
+                break;
+            }
+            wait_schedule(&wait, WAIT_FOREVER);
+            wait_finish(&wait);
+        }
+        wait_finish(&wait);
+    }
+    return submitted;
+}
+
+int uring_register_buffer(int ring, void* addr, size_t len)
+{
+    uring_ctx_t* ctx = uring_lookup(ring);
+    if (!ctx || !addr || len == 0) return -1;
+
+    int slot = -1;
+    for (int i = 0; i < URING_MAX_BUFFERS; i++) {
+        if (!ctx->buffers[i].base) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) return -1;
+
+    uintptr_t base = (uintptr_t)addr & ~(uintptr_t)(PAGE_SIZE - 1);
+    size_t pages = (ALIGN_UP((uintptr_t)addr + len, PAGE_SIZE) - base) / PAGE_SIZE;
+    if (!ctx->vm) return slot;  // Kernel memory needs no pinning
+
+    uintptr_t* frames = kmalloc_tracked(pages * sizeof(uintptr_t), "uring_buffer");
+    if (!frames) return -1;
+    if (vmm_pin_frames(base, pages, frames) < 0) {
+        kfree_tracked(frames);
+        return -1;
+    }
+
+    ctx->buffers[slot].pages = pages;
+    ctx->buffers[slot].frames = frames;
+    __atomic_store_n(&ctx->buffers[slot].base, base, __ATOMIC_RELEASE);  // SQPOLL worker may look now
+    return slot;
+}
+
+// Make a file (URING_OBJ_FILE) or socket (URING_OBJ_SOCKET) nameable by
+// the ring's requests. The caller keeps it alive until the ring is gone.
+int uring_register_object(int ring, int type, void* obj)
+{
+    uring_ctx_t* ctx = uring_lookup(ring);
+    if (!ctx || !obj || (type != URING_OBJ_FILE && type != URING_OBJ_SOCKET)) return -1;
+
+    uint64_t flags = spin_lock_irqsave(&ctx->lock);
+    int index = uring_object_alloc_locked(ctx, type, obj);
+    spin_unlock_irqrestore(&ctx->lock, flags);
+    return index;
+}
+
+int uring_destroy(int ring)
+{
+    uring_ctx_t* ctx = uring_lookup(ring);
+    if (!ctx) return -1;
+
+    // The worker finishes what it has, fails the rest and frees the slot
+    ctx->dying = true;
+    wake_up(&ctx->work_wq);
+    wake_up(&ctx->cq_wq);
+    return 0;
+}
+
+uring_t* uring_get(int ring)
+{
+    uring_ctx_t* ctx = uring_lookup(ring);
+    return ctx ? ctx->ring : NULL;
+}
+
+void uring_get_stats(void)
+{
+    KINFO("=== uring Statistics ===");
+    int active = 0;
+    for (int i = 0; i < URING_MAX_RINGS; i++) {
+        if (urings[i].used) active++;
+    }
+    KINFO("Rings: %d active, %lu enters", active, uring_enters);
+    KINFO("Requests: %lu submitted, %lu completed, %lu waited on sockets", uring_submitted,
+          uring_completed, uring_socket_waits);
+    KINFO("SQPOLL wakeups: %lu", uring_sqpoll_wakeups);
+}
+
+// ============================================================================
+// SYSCALL INTERFACE
+// ============================================================================
+
+int64_t sys_uring_setup(uint32_t flags)
+{
+    return uring_setup(flags);
+}
+
+int64_t sys_uring_enter(int ring, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    return uring_enter(ring, to_submit, min_complete, flags);
+}
+
+// The rings, mapped into the caller
+uring_t* sys_uring_map(int ring)
+{
+    uring_ctx_t* ctx = uring_lookup(ring);
+    if (!ctx) return NULL;
+
+    void* addr = shm_attached_at(ctx->shmid);
+    if (!addr) {
+        addr = sys_shmat(ctx->shmid, NULL, 0);
+        if ((intptr_t)addr < 0) return NULL;
+    }
+    return (uring_t*)addr;
+}
+
+int64_t sys_uring_register(int ring, void* addr, size_t len)
+{
+    return uring_register_buffer(ring, addr, len);
+}
+
+int64_t sys_uring_destroy(int ring)
+{
+    return uring_destroy(ring);
+}
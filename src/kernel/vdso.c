@@ -0,0 +1,243 @@
+#include "kernel.h"
+#include "vdso.h"
+#include "vmm.h"
+#include "io.h"
+
+/*
+ * vDSO clock page
+ * Userspace reads the clock from a read-only page instead of trapping into
+ * sys_get_ticks. The routines in .vdso.text run in ring 3 from their user
+ * mapping, so they may only touch the data page and must not call into
+ * kernel text.
+ */
+
+// CMOS real-time clock
+#define CMOS_INDEX       0x70
+#define CMOS_DATA        0x71
+#define RTC_SECONDS      0x00
+#define RTC_MINUTES      0x02
+#define RTC_HOURS        0x04
+#define RTC_DAY          0x07
+#define RTC_MONTH        0x08
+#define RTC_YEAR         0x09
+#define RTC_STATUS_A     0x0A
+#define RTC_STATUS_B     0x0B
+#define RTC_UPDATING     0x80  // Status A: registers are changing
+#define RTC_BINARY       0x04  // Status B: binary rather than BCD
+#define RTC_24HOUR       0x02  // Status B: 24-hour clock
+#define RTC_PM           0x80  // Hours bit in 12-hour mode
+
+#define VDSO_SECTION __attribute__((section(".vdso.text"), used, noinline))
+
+// The data page on its own, so mapping it exposes nothing else
+static union {
+    vdso_data_t data;
+    uint8_t page[PAGE_SIZE];
+} vdso_page __attribute__((aligned(PAGE_SIZE)));
+
+extern char __vdso_text_start[];
+extern char __vdso_text_end[];
+
+// ============================================================================
+// USER ROUTINES (run from VDSO_TEXT_ADDR)
+// ============================================================================
+
+static inline __attribute__((always_inline)) const volatile vdso_data_t* vdso_user_data(void)
+{
+    return (const volatile vdso_data_t*)VDSO_DATA_ADDR;
+}
+
+static inline __attribute__((always_inline)) uint64_t vdso_read_ns(const volatile vdso_data_t* vd,
+                                                                   uint64_t* offset)
+{
+    uint32_t seq;
+    uint64_t ns;
+    do {
+        while ((seq = vd->seq) & 1) {
+            __asm__ volatile("pause");
+        }
+        __asm__ volatile("" ::: "memory");
+
+        if (vd->tsc_ok) {
+            uint32_t lo, hi;
+            __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+            uint64_t cycles = (((uint64_t)hi << 32) | lo) - vd->tsc_base;
+            ns = (uint64_t)(((unsigned __int128)cycles * vd->tsc_ns_mult) >> 32);
+        } else {
+            ns = vd->coarse_ns;
+        }
+        *offset = vd->realtime_offset_ns;
+
+        __asm__ volatile("" ::: "memory");
+    } while (vd->seq != seq);
+    return ns;
+}
+
+VDSO_SECTION uint64_t __vdso_time_ns(uint32_t clock)
+{
+    uint64_t offset;
+    uint64_t ns = vdso_read_ns(vdso_user_data(), &offset);
+    return clock == VDSO_CLOCK_REALTIME ? ns + offset : ns;
+}
+
+VDSO_SECTION uint64_t __vdso_get_ticks(void)
+{
+    const volatile vdso_data_t* vd = vdso_user_data();
+    uint64_t offset;
+    uint64_t ns = vdso_read_ns(vd, &offset);
+    return ns / (vd->tick_us * 1000);
+}
+
+VDSO_SECTION uint64_t __vdso_realtime_ms(void)
+{
+    uint64_t offset;
+    uint64_t ns = vdso_read_ns(vdso_user_data(), &offset);
+    return (ns + offset) / 1000000;
+}
+
+// ============================================================================
+// KERNEL SIDE
+// ============================================================================
+
+static inline void vdso_write_begin(void)
+{
+    vdso_page.data.seq++;
+    __asm__ volatile("" ::: "memory");
+}
+
+static inline void vdso_write_end(void)
+{
+    __asm__ volatile("" ::: "memory");
+    vdso_page.data.seq++;
+}
+
+void vdso_update_clock(uint64_t tsc_base, uint64_t tsc_ns_mult, uint64_t tick_us)
+{
+    uint64_t flags = irq_save();  // The PIT tick is the other writer
+    vdso_write_begin();
+    vdso_page.data.tsc_base = tsc_base;
+    vdso_page.data.tsc_ns_mult = tsc_ns_mult;
+    vdso_page.data.tsc_ok = tsc_ns_mult != 0;
+    vdso_page.data.tick_us = tick_us;
+    vdso_write_end();
+    irq_restore(flags);
+}
+
+void vdso_update_coarse(uint64_t now_ns)
+{
+    vdso_write_begin();
+    vdso_page.data.coarse_ns = now_ns;
+    vdso_write_end();
+}
+
+uint64_t vdso_realtime_offset_ns(void)
+{
+    return vdso_page.data.realtime_offset_ns;
+}
+
+static uint8_t rtc_read(uint8_t reg)
+{
+    outb(CMOS_INDEX, reg);
+    return inb(CMOS_DATA);
+}
+
+static uint8_t rtc_decode(uint8_t v, bool binary)
+{
+    return binary ? v : (uint8_t)((v & 0x0F) + (v >> 4) * 10);
+}
+
+// Seconds since 1970-01-01 from the CMOS clock (assumed UTC, 20xx)
+static uint64_t rtc_read_epoch(void)
+{
+    uint8_t sec, min, hour, day, mon, year;
+    do {
+        while (rtc_read(RTC_STATUS_A) & RTC_UPDATING);
+        sec = rtc_read(RTC_SECONDS);
+        min = rtc_read(RTC_MINUTES);
+        hour = rtc_read(RTC_HOURS);
+        day = rtc_read(RTC_DAY);
+        mon = rtc_read(RTC_MONTH);
+        year = rtc_read(RTC_YEAR);
+    } while (rtc_read(RTC_SECONDS) != sec);
+
+    uint8_t status = rtc_read(RTC_STATUS_B);
+    bool binary = status & RTC_BINARY;
+    bool pm = !(status & RTC_24HOUR) && (hour & RTC_PM);
+
+    sec = rtc_decode(sec, binary);
+    min = rtc_decode(min, binary);
+    hour = rtc_decode(hour & ~RTC_PM, binary);
+    day = rtc_decode(day, binary);
+    mon = rtc_decode(mon, binary);
+    int64_t y = 2000 + rtc_decode(year, binary);
+    if (!(status & RTC_24HOUR)) {
+        hour = (hour % 12) + (pm ? 12 : 0);
+    }
+    if (mon < 1 || mon > 12 || day < 1 || day > 31) {
+        return 0;
+    }
+
+    // Days from civil date (proleptic Gregorian, March-based year)
+    if (mon <= 2) y--;
+    int64_t era = y / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = era * 146097 + doe - 719468;
+
+    return (uint64_t)days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+static uint64_t vdso_user_addr(void* fn)
+{
+    return VDSO_TEXT_ADDR + ((uintptr_t)fn - (uintptr_t)__vdso_text_start);
+}
+
+void vdso_init(void)
+{
+    vdso_data_t* vd = &vdso_page.data;
+
+    uint64_t tsc_base, tsc_ns_mult;
+    timer_get_clock(&tsc_base, &tsc_ns_mult);
+    vdso_update_clock(tsc_base, tsc_ns_mult, 1000000 / timer_get_frequency());
+
+    uint64_t epoch = rtc_read_epoch();
+    vdso_write_begin();
+    vd->realtime_offset_ns = epoch * 1000000000ULL - time_monotonic_ns();
+    vd->time_ns = (vdso_time_ns_fn)vdso_user_addr(__vdso_time_ns);
+    vd->get_ticks = (vdso_ticks_fn)vdso_user_addr(__vdso_get_ticks);
+    vd->realtime_ms = (vdso_ticks_fn)vdso_user_addr(__vdso_realtime_ms);
+    vdso_write_end();
+
+    // Read-only for ring 3; the kernel keeps writing through its own mapping
+    if (vmm_map_page(VDSO_DATA_ADDR, (uintptr_t)&vdso_page, PAGE_PRESENT | PAGE_USER) < 0) {
+        KERROR("vDSO: failed to map data page");
+        return;
+    }
+
+    size_t text_size = (size_t)(__vdso_text_end - __vdso_text_start);
+    for (size_t off = 0; off < text_size; off += PAGE_SIZE) {
+        if (vmm_map_page(VDSO_TEXT_ADDR + off, (uintptr_t)__vdso_text_start + off,
+                         PAGE_PRESENT | PAGE_USER) < 0) {
+            KERROR("vDSO: failed to map text page");
+            return;
+        }
+    }
+
+    KINFO("vDSO: data at 0x%lx, %lu bytes of text at 0x%lx (%s clock)",
+          VDSO_DATA_ADDR, text_size, VDSO_TEXT_ADDR, vd->tsc_ok ? "TSC" : "PIT");
+}
+
+// The same pages in a context built from scratch: forked ones inherit them
+// from the kernel context, a program execve() loads doesn't
+int vdso_map(vm_context_t* ctx)
+{
+    size_t text_pages = ((size_t)(__vdso_text_end - __vdso_text_start) + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (vmm_map_kernel_frames(ctx, VDSO_DATA_ADDR, (uintptr_t)&vdso_page, 1, PROT_READ) < 0 ||
+        vmm_map_kernel_frames(ctx, VDSO_TEXT_ADDR, (uintptr_t)__vdso_text_start, text_pages,
+                              PROT_READ | PROT_EXEC) < 0) {
+        KERROR("vDSO: failed to map into context %p", ctx);
+        return -1;
+    }
+    return 0;
+}
@@ -5,6 +5,7 @@
 
 #include "net.h"
 #include "kernel.h"
+#include "sync.h"
 
 // ============================================================================
 // DATA STRUCTURES
@@ -28,64 +29,318 @@ typedef struct {
 #define ARP_OP_REQUEST 1
 #define ARP_OP_REPLY   2
 
-// ARP Cache Entry
-typedef struct {
+// Neighbor states
+#define ARP_INCOMPLETE 0    // Request outstanding: packets wait on the entry
+#define ARP_REACHABLE  1    // Confirmed within the reachable time
+#define ARP_STALE      2    // Still used, but a request goes out to confirm it
+
+// ARP Cache Entry. Chains change under arp_lock and are walked locklessly
+// under RCU; mac, state and confirmed_ms are read under seq.
+typedef struct arp_entry {
+    struct arp_entry* next;       // Hash chain
     ip_addr_t ip;
+    seqcount_t seq;
     mac_addr_t mac;
-    uint64_t timestamp;
-    int valid;
+    int state;
+    uint64_t confirmed_ms;        // Last ARP packet from the neighbor
+    uint64_t probe_ms;            // Last request sent for it
+    uint32_t probes;              // Requests sent since the last confirmation
+    net_interface_t* netif;       // Where it was seen or asked for
+    packet_t* queue_head;         // Waiting for the address (INCOMPLETE)
+    packet_t* queue_tail;
+    uint32_t queue_len;
+    rcu_head_t rcu;               // Freed after lockless readers are done
 } arp_entry_t;
 
-#define ARP_CACHE_SIZE 64
-static arp_entry_t arp_cache[ARP_CACHE_SIZE];
+#define ARP_HASH_BITS       8
+#define ARP_HASH_SIZE       (1 << ARP_HASH_BITS)
+#define ARP_MAX_ENTRIES     4096
+#define ARP_QUEUE_LEN       8           // Packets held per unresolved neighbor
+#define ARP_RETRANS_MS      1000        // Between requests
+#define ARP_MAX_PROBES      3           // Requests before a neighbor is given up
+#define ARP_SCAN_BATCH      32          // Requests sent per pass of the ARP task
+#define ARP_TASK_PRIORITY   10
+
+static arp_entry_t* arp_table[ARP_HASH_SIZE];
+static spinlock_t arp_lock = SPINLOCK_INIT;
+static uint32_t arp_entries;
+
+// Aging (arp_set_aging)
+static uint32_t arp_reachable_ms = 30000;   // Confirmed entries used without asking
+static uint32_t arp_gc_ms = 300000;          // Unconfirmed this long: dropped
+
+// Statistics
+static uint64_t arp_queued;
+static uint64_t arp_queue_drops;
+static uint64_t arp_failed;
+
+static const mac_addr_t arp_broadcast = { { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } };
+
+// ============================================================================
+// NEIGHBOR TABLE
+// ============================================================================
+
+static inline uint32_t arp_hashfn(ip_addr_t ip)
+{
+    return (ip * 0x9E3779B1u) >> (32 - ARP_HASH_BITS);
+}
+
+// Caller holds arp_lock
+static arp_entry_t* arp_find(ip_addr_t ip)
+{
+    for (arp_entry_t* e = arp_table[arp_hashfn(ip)]; e; e = e->next) {
+        if (e->ip == ip) return e;
+    }
+    return NULL;
+}
+
+// Lockless: caller is inside rcu_read_lock()
+static arp_entry_t* arp_find_rcu(ip_addr_t ip)
+{
+    for (arp_entry_t* e = rcu_dereference(arp_table[arp_hashfn(ip)]); e;
+         e = rcu_dereference(e->next)) {
+        if (e->ip == ip) return e;
+    }
+    return NULL;
+}
+
+// A consistent copy of what lockless readers use, inside rcu_read_lock()
+static int arp_read_entry(arp_entry_t* e, mac_addr_t* mac, uint64_t* confirmed_ms)
+{
+    int state;
+    uint32_t seq;
+    do {
+        seq = read_seqcount_begin(&e->seq);
+        *mac = e->mac;
+        *confirmed_ms = e->confirmed_ms;
+        state = e->state;
+    } while (read_seqcount_retry(&e->seq, seq));
+    return state;
+}
+
+// Caller holds arp_lock; NULL when the table is full
+static arp_entry_t* arp_create(ip_addr_t ip, net_interface_t* netif)
+{
+    if (arp_entries >= ARP_MAX_ENTRIES) return NULL;
+
+    arp_entry_t* e = kmalloc_tracked(sizeof(arp_entry_t), "arp_entry");
+    if (!e) return NULL;
+    memset(e, 0, sizeof(arp_entry_t));
+    e->ip = ip;
+    e->state = ARP_INCOMPLETE;
+    e->netif = netif;
+
+    uint32_t h = arp_hashfn(ip);
+    e->next = arp_table[h];
+    rcu_assign_pointer(arp_table[h], e);
+    arp_entries++;
+    return e;
+}
+
+static void arp_free_rcu(rcu_head_t* head)
+{
+    kfree_tracked((arp_entry_t*)((uintptr_t)head - __builtin_offsetof(arp_entry_t, rcu)));
+}
+
+// Caller holds arp_lock; returns the entry's queued packets for freeing
+static packet_t* arp_remove(arp_entry_t** link)
+{
+    arp_entry_t* e = *link;
+    packet_t* queue = e->queue_head;
+    rcu_assign_pointer(*link, e->next);
+    arp_entries--;
+    call_rcu(&e->rcu, arp_free_rcu);
+    return queue;
+}
+
+static void arp_free_queue(packet_t* pkt)
+{
+    while (pkt) {
+        packet_t* next = pkt->next;
+        net_free_packet(pkt);
+        pkt = next;
+    }
+}
+
+static void arp_send(net_interface_t* netif, uint16_t opcode, const uint8_t* target_hw,
+                     ip_addr_t target_ip, mac_addr_t dest_mac)
+{
+    packet_t* pkt = net_alloc_packet(sizeof(arp_header_t));
+    if (!pkt) return;
+
+    arp_header_t* arp = packet_put(pkt, sizeof(arp_header_t));
+    arp->hw_type = htons(1);
+    arp->proto_type = htons(ETH_P_IP);
+    arp->hw_len = 6;
+    arp->proto_len = 4;
+    arp->opcode = htons(opcode);
+
+    // My info
+    memcpy(arp->sender_hw, netif->mac_addr.addr, 6);
+    arp->sender_ip = netif->ip_addr;
+
+    // Target info (zero in a request)
+    if (target_hw) {
+        memcpy(arp->target_hw, target_hw, 6);
+    } else {
+        memset(arp->target_hw, 0, 6);
+    }
+    arp->target_ip = target_ip;
+
+    ethernet_output(netif, pkt, dest_mac, ETH_P_ARP);
+}
 
 // ============================================================================
 // ARP IMPLEMENTATION
 // ============================================================================
 
+// A neighbor's address learned or confirmed. Only neighbors already in the
+// table are updated unless create is set (the packet was meant for us), so
+// broadcast chatter doesn't fill it. Packets waiting on it go out.
+static void arp_confirm(net_interface_t* netif, ip_addr_t ip, const uint8_t* mac, bool create)
+{
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
+    arp_entry_t* e = arp_find(ip);
+    if (!e && create) e = arp_create(ip, netif);
+    if (!e) {
+        spin_unlock_irqrestore(&arp_lock, flags);
+        return;
+    }
+
+    write_seqcount_begin(&e->seq);
+    memcpy(e->mac.addr, mac, 6);
+    e->state = ARP_REACHABLE;
+    e->confirmed_ms = time_monotonic_ms();
+    write_seqcount_end(&e->seq);
+    e->probes = 0;
+    if (netif) e->netif = netif;
+
+    packet_t* queue = e->queue_head;
+    e->queue_head = NULL;
+    e->queue_tail = NULL;
+    e->queue_len = 0;
+    mac_addr_t dest_mac = e->mac;
+    spin_unlock_irqrestore(&arp_lock, flags);
+
+    while (queue) {
+        packet_t* next = queue->next;
+        queue->next = NULL;
+        ethernet_output(queue->netif, queue, dest_mac, ETH_P_IP);
+        queue = next;
+    }
+}
+
 void arp_update_cache(ip_addr_t ip, uint8_t* mac)
 {
-    // Update existing
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (arp_cache[i].valid && arp_cache[i].ip == ip) {
-            memcpy(arp_cache[i].mac.addr, mac, 6);
-            arp_cache[i].timestamp = sys_get_ticks();
-            return;
+    arp_confirm(NULL, ip, mac, true);
+}
+
+int arp_lookup(ip_addr_t ip, mac_addr_t* mac)
+{
+    int ret = -1;
+    uint64_t flags = rcu_read_lock();
+    arp_entry_t* e = arp_find_rcu(ip);
+    if (e) {
+        mac_addr_t found;
+        uint64_t confirmed_ms;
+        if (arp_read_entry(e, &found, &confirmed_ms) != ARP_INCOMPLETE) {
+            *mac = found;
+            ret = 0;
         }
     }
-    
-    // Add new (find empty or oldest)
-    int idx = -1;
-    uint64_t oldest = -1;
-    
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (!arp_cache[i].valid) {
-            idx = i;
-            break;
+    rcu_read_unlock(flags);
+    return ret;
+}
+
+// Send an IPv4 packet to a neighbor on netif. An unresolved neighbor gets a
+// request and the packet waits for the reply (the oldest waiting packet
+// makes room when its queue is full); a stale one is used while it is
+// asked again. Takes ownership of pkt.
+int arp_output(net_interface_t* netif, packet_t* pkt, ip_addr_t next_hop)
+{
+    uint64_t now = time_monotonic_ms();
+
+    // A neighbor confirmed recently, the usual case, needs no lock
+    uint64_t flags = rcu_read_lock();
+    arp_entry_t* e = arp_find_rcu(next_hop);
+    if (e) {
+        mac_addr_t dest_mac;
+        uint64_t confirmed_ms;
+        if (arp_read_entry(e, &dest_mac, &confirmed_ms) == ARP_REACHABLE &&
+            now - confirmed_ms < arp_reachable_ms) {
+            rcu_read_unlock(flags);
+            return ethernet_output(netif, pkt, dest_mac, ETH_P_IP);
+        }
+    }
+    rcu_read_unlock(flags);
+
+    flags = spin_lock_irqsave(&arp_lock);
+    e = arp_find(next_hop);
+
+    if (e && e->state != ARP_INCOMPLETE) {
+        bool probe = false;
+        if (e->state == ARP_REACHABLE && now - e->confirmed_ms >= arp_reachable_ms) {
+            write_seqcount_begin(&e->seq);
+            e->state = ARP_STALE;
+            write_seqcount_end(&e->seq);
+        }
+        if (e->state == ARP_STALE && now - e->probe_ms >= ARP_RETRANS_MS) {
+            e->probe_ms = now;
+            e->probes++;
+            probe = true;
         }
-        if (arp_cache[i].timestamp < oldest) {
-            oldest = arp_cache[i].timestamp;
-            idx = i;
+        mac_addr_t dest_mac = e->mac;
+        spin_unlock_irqrestore(&arp_lock, flags);
+
+        if (probe) arp_send(netif, ARP_OP_REQUEST, NULL, next_hop, arp_broadcast);
+        return ethernet_output(netif, pkt, dest_mac, ETH_P_IP);
+    }
+
+    bool request = false;
+    if (!e) {
+        e = arp_create(next_hop, netif);
+        if (!e) {
+            spin_unlock_irqrestore(&arp_lock, flags);
+            KWARN("IPv4: ARP table full, dropping packet for %x", next_hop);
+            net_free_packet(pkt);
+            return -1;
         }
+        e->probe_ms = now;
+        e->probes = 1;
+        request = true;
     }
-    
-    if (idx >= 0) {
-        arp_cache[idx].ip = ip;
-        memcpy(arp_cache[idx].mac.addr, mac, 6);
-        arp_cache[idx].timestamp = sys_get_ticks();
-        arp_cache[idx].valid = 1;
+
+    packet_t* dropped = NULL;
+    if (e->queue_len >= ARP_QUEUE_LEN) {
+        dropped = e->queue_head;
+        e->queue_head = dropped->next;
+        if (!e->queue_head) e->queue_tail = NULL;
+        e->queue_len--;
+        arp_queue_drops++;
+    }
+    pkt->next = NULL;
+    pkt->netif = netif;
+    if (e->queue_tail) {
+        e->queue_tail->next = pkt;
+    } else {
+        e->queue_head = pkt;
     }
+    e->queue_tail = pkt;
+    e->queue_len++;
+    arp_queued++;
+    spin_unlock_irqrestore(&arp_lock, flags);
+
+    if (dropped) net_free_packet(dropped);
+    if (request) arp_send(netif, ARP_OP_REQUEST, NULL, next_hop, arp_broadcast);
+    return 0;
 }
 
-int arp_lookup(ip_addr_t ip, mac_addr_t* mac)
+void arp_set_aging(uint32_t reachable_ms, uint32_t gc_ms)
 {
-    for (int i = 0; i < ARP_CACHE_SIZE; i++) {
-        if (arp_cache[i].valid && arp_cache[i].ip == ip) {
-            *mac = arp_cache[i].mac;
-            return 0;
-        }
-    }
-    return -1;
+    uint64_t flags = spin_lock_irqsave(&arp_lock);
+    if (reachable_ms) arp_reachable_ms = reachable_ms;
+    if (gc_ms) arp_gc_ms = gc_ms > arp_reachable_ms ? gc_ms : arp_reachable_ms;
+    spin_unlock_irqrestore(&arp_lock, flags);
 }
 
 static int arp_input(net_interface_t* netif, packet_t* pkt)
@@ -101,43 +356,98 @@ static int arp_input(net_interface_t* netif, packet_t* pkt)
     if (hw_type != 1 || proto_type != ETH_P_IP) return -1;
     
     // Update cache with sender info
-    arp_update_cache(arp->sender_ip, arp->sender_hw);
+    bool for_us = arp->target_ip == netif->ip_addr;
+    arp_confirm(netif, arp->sender_ip, arp->sender_hw, for_us);
     
     // If it's a request for us, send reply
-    if (opcode == ARP_OP_REQUEST && arp->target_ip == netif->ip_addr) {
+    if (opcode == ARP_OP_REQUEST && for_us) {
         KDEBUG("ARP: Request for %x from %x", arp->target_ip, arp->sender_ip);
         
-        packet_t* reply = net_alloc_packet(sizeof(eth_header_t) + sizeof(arp_header_t));
-        if (!reply) return -1;
-        
-        // Reserve space for Ethernet header
-        reply->data += sizeof(eth_header_t);
-        reply->len = sizeof(arp_header_t);
-        
-        arp_header_t* rep_arp = (arp_header_t*)reply->data;
-        rep_arp->hw_type = htons(1);
-        rep_arp->proto_type = htons(ETH_P_IP);
-        rep_arp->hw_len = 6;
-        rep_arp->proto_len = 4;
-        rep_arp->opcode = htons(ARP_OP_REPLY);
-        
-        // My info
-        memcpy(rep_arp->sender_hw, netif->mac_addr.addr, 6);
-        rep_arp->sender_ip = netif->ip_addr;
-        
-        // Target info (requester)
-        memcpy(rep_arp->target_hw, arp->sender_hw, 6);
-        rep_arp->target_ip = arp->sender_ip;
-        
-        // Send it
         mac_addr_t dest_mac;
         memcpy(dest_mac.addr, arp->sender_hw, 6);
-        ethernet_output(netif, reply, dest_mac, ETH_P_ARP);
+        arp_send(netif, ARP_OP_REPLY, arp->sender_hw, arp->sender_ip, dest_mac);
     }
     
     return 0;
 }
 
+// ============================================================================
+// AGING
+// ============================================================================
+
+// Once a second: resend requests for unresolved neighbors, give up on the
+// ones that never answered, and drop entries unconfirmed for arp_gc_ms
+static void arp_task(void* arg)
+{
+    (void)arg;
+
+    for (;;) {
+        timer_sleep(ARP_RETRANS_MS);
+
+        struct {
+            net_interface_t* netif;
+            ip_addr_t ip;
+        } requests[ARP_SCAN_BATCH];
+        int count = 0;
+        packet_t* dead = NULL;
+        uint64_t now = time_monotonic_ms();
+
+        uint64_t flags = spin_lock_irqsave(&arp_lock);
+        for (int i = 0; i < ARP_HASH_SIZE; i++) {
+            arp_entry_t** link = &arp_table[i];
+            while (*link) {
+                arp_entry_t* e = *link;
+                bool expire;
+                if (e->state == ARP_INCOMPLETE) {
+                    expire = e->probes >= ARP_MAX_PROBES && now - e->probe_ms >= ARP_RETRANS_MS;
+                    if (expire) {
+                        arp_failed++;
+                    } else if (now - e->probe_ms >= ARP_RETRANS_MS && count < ARP_SCAN_BATCH) {
+                        e->probe_ms = now;
+                        e->probes++;
+                        requests[count].netif = e->netif;
+                        requests[count].ip = e->ip;
+                        count++;
+                    }
+                } else {
+                    expire = now - e->confirmed_ms >= arp_gc_ms;
+                }
+
+                if (!expire) {
+                    link = &e->next;
+                    continue;
+                }
+                packet_t* queue = arp_remove(link);
+                while (queue) {
+                    packet_t* next = queue->next;
+                    queue->next = dead;
+                    dead = queue;
+                    queue = next;
+                }
+            }
+        }
+        spin_unlock_irqrestore(&arp_lock, flags);
+
+        arp_free_queue(dead);
+        for (int i = 0; i < count; i++) {
+            arp_send(requests[i].netif, ARP_OP_REQUEST, NULL, requests[i].ip, arp_broadcast);
+        }
+    }
+}
+
+void arp_init(void)
+{
+    if (scheduler_create_task(arp_task, NULL, 8192, ARP_TASK_PRIORITY, "arp") < 0) {
+        KWARN("ARP: No aging task, unresolved neighbors will not be retried");
+    }
+}
+
+void arp_get_stats(void)
+{
+    KINFO("ARP: %u neighbors, %lu packets queued, %lu queue drops, %lu unresolved",
+          arp_entries, arp_queued, arp_queue_drops, arp_failed);
+}
+
 // ============================================================================
 // ETHERNET IMPLEMENTATION
 // ============================================================================
@@ -148,12 +458,9 @@ int ethernet_input(net_interface_t* netif, packet_t* pkt)
         return -1;
     }
     
-    eth_header_t* eth = (eth_header_t*)pkt->data;
-    pkt->l2_header = eth;
-    
     // Strip header
-    pkt->data += sizeof(eth_header_t);
-    pkt->len -= sizeof(eth_header_t);
+    eth_header_t* eth = packet_pull(pkt, sizeof(eth_header_t));
+    pkt->l2_header = eth;
     
     uint16_t type = ntohs(eth->type);
     pkt->protocol = type;
@@ -176,15 +483,13 @@ int ethernet_input(net_interface_t* netif, packet_t* pkt)
 int ethernet_output(net_interface_t* netif, packet_t* pkt, mac_addr_t dest_mac, uint16_t type)
 {
     // Prepend Ethernet header
-    if (pkt->data - pkt->head < sizeof(eth_header_t)) {
+    eth_header_t* eth = packet_push(pkt, sizeof(eth_header_t));
+    if (!eth) {
         KERROR("ETH: Not enough headroom for header");
+        net_free_packet(pkt);
         return -1;
     }
     
-    pkt->data -= sizeof(eth_header_t);
-    pkt->len += sizeof(eth_header_t);
-    
-    eth_header_t* eth = (eth_header_t*)pkt->data;
     memcpy(eth->dest, dest_mac.addr, 6);
     memcpy(eth->src, netif->mac_addr.addr, 6);
     eth->type = htons(type);
@@ -0,0 +1,259 @@
+/*
+ * Fair Queue Packet Scheduler
+ * Per-interface pacing: each flow's packets leave no sooner than its
+ * pacing rate allows, flows share the link round robin
+ */
+
+#include "net.h"
+#include "kernel.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+#define FQ_QUANTUM          (2 * 1514)      // Bytes a flow sends per round
+#define FQ_INITIAL_QUANTUM  (10 * 1514)     // Head start for a flow that was idle
+#define FQ_LIMIT            10000           // Packets queued on the interface
+#define FQ_FLOW_LIMIT       1000            // Packets queued per flow
+#define FQ_MAX_DELAY_US     1000000         // Cap on one packet's pacing gap
+#define FQ_BATCH            16              // Packets handed to the driver per lock hold
+
+// Which list a flow is on
+#define FQ_IDLE        0
+#define FQ_NEW         1                    // Just became active: served first
+#define FQ_OLD         2
+#define FQ_THROTTLED   3                    // Waiting for time_next_us
+
+// ============================================================================
+// FLOW LISTS
+// ============================================================================
+
+static void fq_list_add(net_flow_t** head, net_flow_t** tail, net_flow_t* flow)
+{
+    flow->next = NULL;
+    if (*tail) {
+        (*tail)->next = flow;
+    } else {
+        *head = flow;
+    }
+    *tail = flow;
+}
+
+static net_flow_t* fq_list_pop(net_flow_t** head, net_flow_t** tail)
+{
+    net_flow_t* flow = *head;
+    if (flow) {
+        *head = flow->next;
+        if (!*head) *tail = NULL;
+        flow->next = NULL;
+    }
+    return flow;
+}
+
+// Throttled flows are kept sorted by departure time
+static void fq_throttle(net_fq_t* fq, net_flow_t* flow)
+{
+    net_flow_t** link = &fq->throttled;
+    while (*link && (*link)->time_next_us <= flow->time_next_us) link = &(*link)->next;
+    flow->next = *link;
+    *link = flow;
+    flow->list = FQ_THROTTLED;
+    fq->throttled_count++;
+}
+
+// Flows whose time has come go back to the round robin
+static void fq_unthrottle(net_fq_t* fq, uint64_t now)
+{
+    while (fq->throttled && fq->throttled->time_next_us <= now) {
+        net_flow_t* flow = fq->throttled;
+        fq->throttled = flow->next;
+        flow->list = FQ_OLD;
+        fq_list_add(&fq->old_head, &fq->old_tail, flow);
+    }
+}
+
+// ============================================================================
+// SCHEDULING
+// ============================================================================
+
+// Next packet allowed to leave now, or NULL (the timer is then armed for
+// the earliest throttled flow). Called with the lock held.
+static packet_t* fq_dequeue(net_fq_t* fq, uint64_t now)
+{
+    if (!fq->packets) return NULL;
+    fq_unthrottle(fq, now);
+
+    for (;;) {
+        bool from_new = fq->new_head != NULL;
+        net_flow_t* flow = from_new ? fq->new_head : fq->old_head;
+        if (!flow) {
+            if (fq->throttled) ktimer_arm(&fq->timer, fq->throttled->time_next_us);
+            return NULL;
+        }
+
+        // Out of credit for this round: to the back, with a fresh quantum
+        if (flow->credit <= 0) {
+            flow->credit += FQ_QUANTUM;
+            if (from_new) {
+                fq_list_pop(&fq->new_head, &fq->new_tail);
+            } else {
+                fq_list_pop(&fq->old_head, &fq->old_tail);
+            }
+            flow->list = FQ_OLD;
+            fq_list_add(&fq->old_head, &fq->old_tail, flow);
+            continue;
+        }
+
+        packet_t* pkt = flow->head;
+        if (pkt && flow->time_next_us > now) {
+            if (from_new) {
+                fq_list_pop(&fq->new_head, &fq->new_tail);
+            } else {
+                fq_list_pop(&fq->old_head, &fq->old_tail);
+            }
+            fq_throttle(fq, flow);
+            continue;
+        }
+
+        if (!pkt) {
+            // Emptied. A new flow still gets its turn among the old ones,
+            // so one that keeps going idle can't jump the queue every time.
+            if (from_new) {
+                fq_list_pop(&fq->new_head, &fq->new_tail);
+                if (fq->old_head) {
+                    flow->list = FQ_OLD;
+                    fq_list_add(&fq->old_head, &fq->old_tail, flow);
+                    continue;
+                }
+            } else {
+                fq_list_pop(&fq->old_head, &fq->old_tail);
+            }
+            flow->list = FQ_IDLE;
+            continue;
+        }
+
+        flow->head = pkt->next;
+        if (!flow->head) flow->tail = NULL;
+        pkt->next = NULL;
+        flow->qlen--;
+        fq->packets--;
+        flow->credit -= (int32_t)packet_length(pkt);
+
+        // The gap this packet earns the flow at its pacing rate
+        uint64_t rate = flow->rate;
+        if (rate) {
+            uint64_t delay = (uint64_t)packet_length(pkt) * 1000000 / rate;
+            if (delay > FQ_MAX_DELAY_US) delay = FQ_MAX_DELAY_US;
+            flow->time_next_us = now + delay;
+        }
+        return pkt;
+    }
+}
+
+// Send whatever may leave now. One CPU at a time runs the queue, so the
+// driver sees each flow's packets in order; a CPU that finds it running
+// leaves the work to that one.
+static void fq_run(net_interface_t* netif)
+{
+    net_fq_t* fq = netif->fq;
+    uint64_t flags = spin_lock_irqsave(&fq->lock);
+    if (fq->running) {
+        fq->again = true;
+        spin_unlock_irqrestore(&fq->lock, flags);
+        return;
+    }
+    fq->running = true;
+
+    for (;;) {
+        fq->again = false;
+        packet_t* batch[FQ_BATCH];
+        int count = 0;
+        uint64_t now = time_monotonic_us();
+        while (count < FQ_BATCH) {
+            packet_t* pkt = fq_dequeue(fq, now);
+            if (!pkt) break;
+            batch[count++] = pkt;
+        }
+        if (count == 0 && !fq->again) break;
+
+        spin_unlock_irqrestore(&fq->lock, flags);
+        for (int i = 0; i < count; i++) net_dev_xmit(netif, batch[i]);
+        flags = spin_lock_irqsave(&fq->lock);
+    }
+
+    fq->running = false;
+    spin_unlock_irqrestore(&fq->lock, flags);
+}
+
+// Interrupt context: the earliest throttled flow may send again
+static void fq_timer_fire(void* arg)
+{
+    fq_run((net_interface_t*)arg);
+}
+
+// ============================================================================
+// PUBLIC API
+// ============================================================================
+
+void net_flow_init(net_flow_t* flow)
+{
+    memset(flow, 0, sizeof(net_flow_t));
+    flow->list = FQ_IDLE;
+}
+
+int net_fq_attach(net_interface_t* netif)
+{
+    net_fq_t* fq = kmalloc_tracked(sizeof(net_fq_t), "net_fq");
+    if (!fq) return -1;
+
+    memset(fq, 0, sizeof(net_fq_t));
+    fq->lock = (spinlock_t)SPINLOCK_INIT;
+    ktimer_init(&fq->timer, fq_timer_fire, netif);
+    netif->fq = fq;
+    return 0;
+}
+
+// Queue a packet behind its flow; net_tx_packet() sends the ones with no
+// flow straight to the driver
+int net_fq_enqueue(net_interface_t* netif, packet_t* pkt)
+{
+    net_fq_t* fq = netif->fq;
+    net_flow_t* flow = pkt->flow;
+
+    uint64_t flags = spin_lock_irqsave(&fq->lock);
+    if (fq->packets >= FQ_LIMIT || flow->qlen >= FQ_FLOW_LIMIT) {
+        fq->drops++;
+        spin_unlock_irqrestore(&fq->lock, flags);
+        netif->tx_dropped++;
+        net_free_packet(pkt);
+        return -1;
+    }
+
+    pkt->next = NULL;
+    if (flow->tail) {
+        flow->tail->next = pkt;
+    } else {
+        flow->head = pkt;
+    }
+    flow->tail = pkt;
+    flow->qlen++;
+    fq->packets++;
+
+    if (flow->list == FQ_IDLE) {
+        flow->credit = FQ_INITIAL_QUANTUM;
+        flow->list = FQ_NEW;
+        fq_list_add(&fq->new_head, &fq->new_tail, flow);
+    }
+    spin_unlock_irqrestore(&fq->lock, flags);
+
+    fq_run(netif);
+    return 0;
+}
+
+void net_fq_get_stats(net_interface_t* netif)
+{
+    net_fq_t* fq = netif->fq;
+    if (!fq) return;
+    KINFO("%s: %u packets queued, %lu throttles, %lu drops", netif->name, fq->packets,
+          fq->throttled_count, fq->drops);
+}
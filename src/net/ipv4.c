@@ -19,25 +19,57 @@
 // CHECKSUM
 // ============================================================================
 
-uint16_t checksum(void* data, uint32_t len)
+// Loads 8 bytes at a time; x86 doesn't mind the alignment
+typedef uint64_t __attribute__((may_alias, aligned(1))) csum_u64_t;
+typedef uint32_t __attribute__((may_alias, aligned(1))) csum_u32_t;
+typedef uint16_t __attribute__((may_alias, aligned(1))) csum_u16_t;
+
+// The ones' complement sum is the same whichever word size it is added
+// in, so sum 32-bit halves of 64-bit loads into a 64-bit accumulator (no
+// carries to chase: it can't overflow below 2^31 words) and fold once
+uint32_t csum_partial(const void* data, uint32_t len, uint32_t sum)
 {
-    uint32_t sum = 0;
-    uint16_t* ptr = (uint16_t*)data;
-    
-    while (len > 1) {
-        sum += *ptr++;
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t acc = sum;
+    
+    while (len >= 32) {
+        uint64_t a = *(const csum_u64_t*)p;
+        uint64_t b = *(const csum_u64_t*)(p + 8);
+        uint64_t c = *(const csum_u64_t*)(p + 16);
+        uint64_t d = *(const csum_u64_t*)(p + 24);
+        acc += (a & 0xFFFFFFFF) + (a >> 32) + (b & 0xFFFFFFFF) + (b >> 32);
+        acc += (c & 0xFFFFFFFF) + (c >> 32) + (d & 0xFFFFFFFF) + (d >> 32);
+        p += 32;
+        len -= 32;
+    }
+    while (len >= 8) {
+        uint64_t a = *(const csum_u64_t*)p;
+        acc += (a & 0xFFFFFFFF) + (a >> 32);
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        acc += *(const csum_u32_t*)p;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        acc += *(const csum_u16_t*)p;
+        p += 2;
         len -= 2;
     }
-    
     if (len > 0) {
-        sum += *(uint8_t*)ptr;
+        acc += *p;  // Odd byte is the high-order half of a word on the wire
     }
     
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    }
-    
-    return ~sum;
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    return (uint32_t)acc;
+}
+
+uint16_t checksum(void* data, uint32_t len)
+{
+    return csum_fold(csum_partial(data, len, 0));
 }
 
 // ============================================================================
@@ -49,6 +81,9 @@ static int icmp_input(net_interface_t* netif, packet_t* pkt)
     if (pkt->len < sizeof(icmp_header_t)) return -1;
     
     icmp_header_t* icmp = (icmp_header_t*)pkt->data;
+    if (!(pkt->flags & PACKET_CSUM_VERIFIED) && checksum(icmp, pkt->len) != 0) {
+        return -1;
+    }
     
     if (icmp->type == ICMP_ECHO_REQUEST) {
         KDEBUG("ICMP: Echo Request from %s", "remote"); // Need to pass src ip
@@ -58,30 +93,20 @@ static int icmp_input(net_interface_t* netif, packet_t* pkt)
         
         // We need to send a reply.
         // Allocate new packet for reply to be clean
-        packet_t* reply = net_alloc_packet(NET_MAX_PACKET_SIZE);
-        if (!reply) return -1;
-        
-        // Copy payload
         uint32_t payload_len = pkt->len - sizeof(icmp_header_t);
+        packet_t* reply = net_alloc_packet(sizeof(icmp_header_t) + payload_len);
+        if (!reply) return -1;
         
-        // Reserve headers
-        reply->data += sizeof(eth_header_t) + sizeof(ipv4_header_t);
-        
-        icmp_header_t* rep_icmp = (icmp_header_t*)reply->data;
+        // Headers below ICMP go into the headroom. The reply is the
+        // request with another type, so its checksum is the request's
+        // patched for that one word rather than summed again.
+        icmp_header_t* rep_icmp = packet_put(reply, sizeof(icmp_header_t) + payload_len);
+        memcpy(rep_icmp, icmp, sizeof(icmp_header_t) + payload_len);
         rep_icmp->type = ICMP_ECHO_REPLY;
         rep_icmp->code = 0;
-        rep_icmp->id = icmp->id;
-        rep_icmp->sequence = icmp->sequence;
-        rep_icmp->checksum = 0;
-        
-        // Copy data
-        memcpy(reply->data + sizeof(icmp_header_t), 
-               pkt->data + sizeof(icmp_header_t), payload_len);
-               
-        reply->len = sizeof(icmp_header_t) + payload_len;
-        
-        // Calculate checksum
-        rep_icmp->checksum = checksum(rep_icmp, reply->len);
+        rep_icmp->checksum = csum_replace2(icmp->checksum,
+                                           (uint16_t)(icmp->type | (icmp->code << 8)),
+                                           ICMP_ECHO_REPLY);
         
         // Get source IP from original IP header (which is in l3_header)
         ipv4_header_t* orig_ip = (ipv4_header_t*)pkt->l3_header;
@@ -106,7 +131,14 @@ int ipv4_input(net_interface_t* netif, packet_t* pkt)
     if (ip->version != 4) return -1;
     
     uint32_t header_len = ip->ihl * 4;
-    if (pkt->len < header_len) return -1;
+    if (header_len < sizeof(ipv4_header_t) || pkt->len < header_len) return -1;
+    if (!(pkt->flags & PACKET_CSUM_VERIFIED) && checksum(ip, header_len) != 0) return -1;
+    
+    // Drop Ethernet padding: the transport checksums end with the datagram
+    uint32_t total_len = ntohs(ip->total_len);
+    if (total_len < header_len || total_len > pkt->len) return -1;
+    pkt->len = total_len;
+    pkt->tail = pkt->data + total_len;
     
     // Check destination
     // Accept if it matches interface IP, or is broadcast, or loopback
@@ -119,8 +151,7 @@ int ipv4_input(net_interface_t* netif, packet_t* pkt)
     }
     
     // Strip header
-    pkt->data += header_len;
-    pkt->len -= header_len;
+    packet_pull(pkt, header_len);
     
     // Dispatch
     switch (ip->protocol) {
@@ -153,20 +184,17 @@ int ipv4_output(packet_t* pkt, ip_addr_t dest_ip, uint8_t protocol)
     }
     
     // Prepend IP header
-    if (pkt->data - pkt->head < sizeof(ipv4_header_t)) {
+    ipv4_header_t* ip = packet_push(pkt, sizeof(ipv4_header_t));
+    if (!ip) {
         KERROR("IPv4: No headroom");
         net_free_packet(pkt);
         return -1;
     }
     
-    pkt->data -= sizeof(ipv4_header_t);
-    pkt->len += sizeof(ipv4_header_t);
-    
-    ipv4_header_t* ip = (ipv4_header_t*)pkt->data;
     ip->version = 4;
     ip->ihl = 5;
     ip->tos = 0;
-    ip->total_len = htons(pkt->len);
+    ip->total_len = htons(packet_length(pkt));
     ip->id = htons(0); // Should increment
     ip->frag_off = htons(0x4000); // Don't fragment
     ip->ttl = 64;
@@ -175,6 +203,24 @@ int ipv4_output(packet_t* pkt, ip_addr_t dest_ip, uint8_t protocol)
     ip->dest_ip = dest_ip;
     ip->checksum = 0;
     ip->checksum = checksum(ip, sizeof(ipv4_header_t));
+    pkt->l3_header = ip;
+    
+    // Transport checksum over the pseudo-header: the interface finishes it
+    // if it can, else it is done here in full. A GSO packet's datagrams get
+    // theirs when it is split.
+    if (pkt->flags & PACKET_CSUM_PARTIAL) {
+        uint32_t l4_len = packet_length(pkt) - sizeof(ipv4_header_t);
+        uint16_t* check = (uint16_t*)((uint8_t*)pkt->l4_header + pkt->csum_offset);
+        uint32_t pseudo = csum_pseudo(ip->src_ip, ip->dest_ip, l4_len, protocol);
+        if ((netif->features & NETIF_F_IP_CSUM) || pkt->gso_size) {
+            *check = (uint16_t)~csum_fold(pseudo);
+        } else {
+            *check = 0;
+            *check = csum_fold(packet_csum(pkt, pkt->l4_header, pseudo));
+            if (*check == 0 && protocol == IPPROTO_UDP) *check = 0xFFFF;  // 0 means none
+            pkt->flags &= ~PACKET_CSUM_PARTIAL;
+        }
+    }
     
     // Resolve MAC
     mac_addr_t dest_mac;
@@ -190,15 +236,8 @@ int ipv4_output(packet_t* pkt, ip_addr_t dest_ip, uint8_t protocol)
             next_hop = netif->gateway;
         }
         
-        // Need ARP lookup function exposed
-        extern int arp_lookup(ip_addr_t ip, mac_addr_t* mac);
-        if (arp_lookup(next_hop, &dest_mac) < 0) {
-            // ARP miss - should queue packet and send ARP request
-            // For now, just drop and warn
-            KWARN("IPv4: ARP miss for %x", next_hop);
-            net_free_packet(pkt);
-            return -1;
-        }
+        // Resolves it, or holds the packet until the reply
+        return arp_output(netif, pkt, next_hop);
     }
     
     return ethernet_output(netif, pkt, dest_mac, ETH_P_IP);
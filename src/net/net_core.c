@@ -5,6 +5,8 @@
 
 #include "net.h"
 #include "kernel.h"
+#include "smp.h"
+#include "page_cache.h"
 
 // ============================================================================
 // GLOBALS
@@ -13,51 +15,217 @@
 static net_interface_t* interfaces = NULL;
 static net_interface_t* default_interface = NULL;
 
-// Packet pool (simplified slab allocator for packets)
-// In a real kernel, this would use the slab allocator we implemented
-static packet_t* packet_pool = NULL; 
-static uint32_t packet_count = 0;
+// Packet pool: NET_PACKET_POOL_SIZE packets with a fixed buffer each, two
+// to a PMM page, recycled through per-CPU free lists. A CPU refills from
+// and spills to the shared list a batch at a time, so packets freed on the
+// CPU that received them mostly never touch the lock. Packets too big for
+// a pool buffer, or allocated while the pool is empty, come from the heap.
+#define NET_PCPU_BATCH  32      // Packets moved to or from the shared list at once
+#define NET_PCPU_MAX    64      // A CPU's list spills beyond this
+
+typedef struct {
+    packet_t* free;
+    uint32_t count;
+} __attribute__((aligned(64))) percpu_packets_t;
+
+static packet_t packet_pool[NET_PACKET_POOL_SIZE];
+static uint32_t packet_count = 0;          // Pooled packets (with a buffer)
+static percpu_packets_t percpu_packets[MAX_CPUS];
+static packet_t* shared_packets = NULL;
+static uint32_t shared_count = 0;
+static spinlock_t pool_lock = SPINLOCK_INIT;
+
+// Statistics
+static uint64_t pool_allocs = 0;
+static uint64_t heap_allocs = 0;           // Oversized, or the pool ran dry
 
 // ============================================================================
 // PACKET MANAGEMENT
 // ============================================================================
 
+// Carve the pool's buffers out of PMM pages; as many as memory allows
+static void net_pool_init(void)
+{
+    const uint32_t per_page = PAGE_SIZE / NET_MAX_PACKET_SIZE;
+    while (packet_count + per_page <= NET_PACKET_POOL_SIZE) {
+        uint8_t* page = (uint8_t*)pmm_alloc_pages(1);
+        if (!page) break;
+        for (uint32_t i = 0; i < per_page; i++) {
+            packet_t* pkt = &packet_pool[packet_count++];
+            pkt->head = page + i * NET_MAX_PACKET_SIZE;
+            pkt->total_len = NET_MAX_PACKET_SIZE;
+            pkt->flags = PACKET_POOLED;
+            pkt->next = shared_packets;
+            shared_packets = pkt;
+            shared_count++;
+        }
+    }
+}
+
+static packet_t* pool_get(void)
+{
+    uint64_t flags = irq_save();
+    percpu_packets_t* pc = &percpu_packets[smp_cpu_id()];
+    if (!pc->free) {
+        spin_lock(&pool_lock);
+        while (shared_packets && pc->count < NET_PCPU_BATCH) {
+            packet_t* pkt = shared_packets;
+            shared_packets = pkt->next;
+            shared_count--;
+            pkt->next = pc->free;
+            pc->free = pkt;
+            pc->count++;
+        }
+        spin_unlock(&pool_lock);
+    }
+
+    packet_t* pkt = pc->free;
+    if (pkt) {
+        pc->free = pkt->next;
+        pc->count--;
+    }
+    irq_restore(flags);
+    return pkt;
+}
+
+static void pool_put(packet_t* pkt)
+{
+    uint64_t flags = irq_save();
+    percpu_packets_t* pc = &percpu_packets[smp_cpu_id()];
+    pkt->next = pc->free;
+    pc->free = pkt;
+    pc->count++;
+
+    if (pc->count > NET_PCPU_MAX) {
+        // Hand a batch back: transmit-heavy CPUs free what others allocate
+        packet_t* first = pc->free;
+        packet_t* last = first;
+        for (uint32_t i = 1; i < NET_PCPU_BATCH; i++) last = last->next;
+        pc->free = last->next;
+        pc->count -= NET_PCPU_BATCH;
+
+        spin_lock(&pool_lock);
+        last->next = shared_packets;
+        shared_packets = first;
+        shared_count += NET_PCPU_BATCH;
+        spin_unlock(&pool_lock);
+    }
+    irq_restore(flags);
+}
+
 packet_t* net_alloc_packet(uint32_t size)
 {
-    // Allocate packet structure + buffer
-    // For now, we just use kmalloc. In production, use a pool.
-    packet_t* pkt = kmalloc_tracked(sizeof(packet_t), "net_packet");
-    if (!pkt) return NULL;
-    
-    uint32_t alloc_size = size > NET_MAX_PACKET_SIZE ? size : NET_MAX_PACKET_SIZE;
-    pkt->head = kmalloc_tracked(alloc_size, "net_buffer");
-    if (!pkt->head) {
-        kfree_tracked(pkt);
-        return NULL;
+    packet_t* pkt = size <= NET_MAX_PAYLOAD ? pool_get() : NULL;
+    if (pkt) {
+        pool_allocs++;
+    } else {
+        // Every header field is set below and the buffer is written before
+        // it is read, so neither allocation needs zeroing
+        pkt = kmalloc_tracked_flags(sizeof(packet_t), "net_packet", GFP_KERNEL);
+        if (!pkt) return NULL;
+
+        uint32_t alloc_size = NET_PACKET_HEADROOM + (size > NET_MAX_PAYLOAD ? size : NET_MAX_PAYLOAD);
+        pkt->head = kmalloc_tracked_flags(alloc_size, "net_buffer", GFP_KERNEL);
+        if (!pkt->head) {
+            kfree_tracked(pkt);
+            return NULL;
+        }
+        pkt->total_len = alloc_size;
+        pkt->flags = 0;
+        heap_allocs++;
     }
-    
-    pkt->data = pkt->head;
-    pkt->tail = pkt->head;
-    pkt->end = pkt->head + alloc_size;
+
+    pkt->flags &= PACKET_POOLED;  // Checksum state is per use
+    pkt->csum_offset = 0;
+    pkt->gso_size = 0;
+    pkt->data = pkt->head + NET_PACKET_HEADROOM;
+    pkt->tail = pkt->data;
+    pkt->end = pkt->head + pkt->total_len;
     pkt->len = 0;
-    pkt->total_len = alloc_size;
+    pkt->data_len = 0;
+    pkt->nr_frags = 0;
     pkt->next = NULL;
     pkt->prev = NULL;
     pkt->netif = NULL;
-    
+    pkt->flow = NULL;
+    pkt->protocol = 0;
+    pkt->l2_header = NULL;
+    pkt->l3_header = NULL;
+    pkt->l4_header = NULL;
+
     return pkt;
 }
 
 void net_free_packet(packet_t* pkt)
 {
     if (!pkt) return;
-    
+
+    for (uint8_t i = 0; i < pkt->nr_frags; i++) page_cache_put(pkt->frags[i].page);
+    pkt->nr_frags = 0;
+
+    if (pkt->flags & PACKET_POOLED) {
+        pool_put(pkt);
+        return;
+    }
     if (pkt->head) {
         kfree_tracked(pkt->head);
     }
     kfree_tracked(pkt);
 }
 
+int packet_add_frag(packet_t* pkt, struct cached_page* page, uint8_t* data, uint32_t len)
+{
+    if (pkt->nr_frags >= PACKET_MAX_FRAGS) return -1;
+    packet_frag_t* frag = &pkt->frags[pkt->nr_frags++];
+    frag->page = page;
+    frag->data = data;
+    frag->len = len;
+    pkt->data_len += len;
+    return 0;
+}
+
+int packet_linearize(packet_t* pkt)
+{
+    if ((uint32_t)(pkt->end - pkt->tail) < pkt->data_len) return -1;
+    for (uint8_t i = 0; i < pkt->nr_frags; i++) {
+        memcpy(packet_put(pkt, pkt->frags[i].len), pkt->frags[i].data, pkt->frags[i].len);
+        page_cache_put(pkt->frags[i].page);
+    }
+    pkt->nr_frags = 0;
+    pkt->data_len = 0;
+    return 0;
+}
+
+// A piece starting at an odd offset lands byte-swapped in the running sum
+static inline uint32_t csum_add_at(uint32_t sum, uint32_t piece, uint32_t offset)
+{
+    if (offset & 1) piece = (piece >> 8) | (piece << 24);
+    sum += piece;
+    return sum + (sum < piece);
+}
+
+uint32_t packet_csum(const packet_t* pkt, const void* p, uint32_t sum)
+{
+    uint32_t offset = (uint32_t)(pkt->tail - (const uint8_t*)p);
+    sum = csum_partial(p, offset, sum);
+    for (uint8_t i = 0; i < pkt->nr_frags; i++) {
+        sum = csum_add_at(sum, csum_partial(pkt->frags[i].data, pkt->frags[i].len, 0), offset);
+        offset += pkt->frags[i].len;
+    }
+    return sum;
+}
+
+void net_get_stats(void)
+{
+    uint32_t cached = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) cached += percpu_packets[cpu].count;
+    KINFO("=== Packet Pool Statistics ===");
+    KINFO("Pooled packets: %u (%u shared, %u in per-CPU lists)", packet_count, shared_count, cached);
+    KINFO("Allocations: %lu from the pool, %lu from the heap", pool_allocs, heap_allocs);
+    for (net_interface_t* netif = interfaces; netif; netif = netif->next) net_fq_get_stats(netif);
+    arp_get_stats();
+}
+
 // ============================================================================
 // INTERFACE MANAGEMENT
 // ============================================================================
@@ -73,6 +241,11 @@ int net_register_interface(net_interface_t* netif)
         default_interface = netif;
     }
     
+    // Pace what goes on a wire; loopback has no queue to overflow
+    if (!(netif->flags & 0x08) && net_fq_attach(netif) < 0) {
+        KWARN("NET: No fair queue for %s, sending unpaced", netif->name);
+    }
+    
     KINFO("NET: Registered interface %s (MAC: %02x:%02x:%02x:%02x:%02x:%02x)",
           netif->name,
           netif->mac_addr.addr[0], netif->mac_addr.addr[1], netif->mac_addr.addr[2],
@@ -110,21 +283,42 @@ int net_rx_packet(net_interface_t* netif, packet_t* pkt)
     netif->rx_bytes += pkt->len;
     pkt->netif = netif;
     
-    // Pass to Ethernet layer
-    return ethernet_input(netif, pkt);
+    // Pass to Ethernet layer; replies are new packets, so this one is done
+    int ret = ethernet_input(netif, pkt);
+    net_free_packet(pkt);
+    return ret;
 }
 
 int net_tx_packet(net_interface_t* netif, packet_t* pkt)
 {
     if (!netif || !pkt) return -1;
-    
+
+    // Paced flows leave when their rate allows
+    if (netif->fq && pkt->flow) return net_fq_enqueue(netif, pkt);
+    return net_dev_xmit(netif, pkt);
+}
+
+int net_dev_xmit(net_interface_t* netif, packet_t* pkt)
+{
+    // Datagrams the interface can't split from a GSO packet are split here
+    if (pkt->gso_size && !(netif->features & NETIF_F_GSO_UDP)) return udp_gso_segment(netif, pkt);
+
+    // Fragments the interface can't gather are copied in here
+    if (pkt->nr_frags && !(netif->features & NETIF_F_SG) && packet_linearize(pkt) < 0) {
+        netif->tx_dropped++;
+        net_free_packet(pkt);
+        return -1;
+    }
+
     // If interface has a send function, call it
     if (netif->send_packet) {
         netif->tx_packets++;
-        netif->tx_bytes += pkt->len;
+        netif->tx_bytes += packet_length(pkt);
         return netif->send_packet(netif, pkt);
     }
     
+    netif->tx_dropped++;
+    net_free_packet(pkt);
     return -1;
 }
 
@@ -142,6 +336,7 @@ static int loopback_send(net_interface_t* netif, packet_t* pkt)
     // to avoid stack overflow. Here we recurse directly for simplicity.
     
     KDEBUG("LOOPBACK: Bouncing packet %d bytes", pkt->len);
+    pkt->flags = (uint16_t)((pkt->flags & PACKET_POOLED) | PACKET_CSUM_VERIFIED);  // Never left memory
     return net_rx_packet(netif, pkt);
 }
 
@@ -154,6 +349,7 @@ void net_init_loopback(void)
     loopback_if.ip_addr = 0x7F000001; // 127.0.0.1
     loopback_if.netmask = 0xFF000000; // 255.0.0.0
     loopback_if.flags = 0x09; // UP | LOOPBACK
+    loopback_if.features = NETIF_F_IP_CSUM | NETIF_F_RXCSUM;
     loopback_if.send_packet = loopback_send;
     
     net_register_interface(&loopback_if);
@@ -167,7 +363,12 @@ void net_init(void)
 {
     KINFO("Initializing Network Subsystem...");
     
+    net_pool_init();
+    KINFO("NET: %u pooled packets of %u bytes (%u headroom)", packet_count,
+          NET_MAX_PACKET_SIZE, NET_PACKET_HEADROOM);
+    
     net_init_loopback();
+    arp_init();
     tcp_init();
     
     KINFO("Network Subsystem Initialized.");
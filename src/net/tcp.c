@@ -5,10 +5,15 @@
  * - Full state machine (LISTEN, SYN_SENT, ESTABLISHED, etc.)
  * - BBR v1 Congestion Control
  * - Sequence number management
+ * - Send and receive rings, out-of-order queue, SACK and timestamps
+ * - RFC 6298 retransmission timer with fast retransmit and recovery
+ * - Zero-copy sendfile: page cache data sent by reference
  */
 
 #include "net.h"
 #include "kernel.h"
+#include "io.h"
+#include "page_cache.h"
 
 // ============================================================================
 // DATA STRUCTURES
@@ -49,24 +54,121 @@ typedef enum {
 } tcp_state_t;
 
 // BBR State
+#define BBR_BW_ROUNDS 10       // Bandwidth filter window, in round trips
+
 typedef struct {
     uint64_t min_rtt_us;       // Minimum RTT seen
     uint64_t min_rtt_stamp;    // When min_rtt was seen
     uint64_t probe_rtt_done_stamp;
+    bool probe_rtt_round_done;
     
-    uint32_t btl_bw;           // Bottleneck bandwidth estimate
+    uint32_t btl_bw;           // Bottleneck bandwidth estimate, bytes/s
+    uint32_t bw_rounds[BBR_BW_ROUNDS]; // Best delivery rate of each recent round
     uint32_t pacing_gain;
     uint32_t cwnd_gain;
+    uint64_t pacing_rate;      // Bytes/s, what pcb->flow paces at
     
     int mode;                  // STARTUP, DRAIN, PROBE_BW, PROBE_RTT
     uint32_t cycle_idx;
+    uint64_t cycle_stamp;      // Start of the PROBE_BW phase
+    
+    uint64_t round_count;      // Round trips so far
+    uint64_t next_round_delivered; // The round ends once delivered reaches this
+    bool round_start;
+    uint32_t full_bw;          // STARTUP: bandwidth at the last 25% growth
+    uint32_t full_bw_count;    // Rounds since
+    bool filled_pipe;
+    uint32_t prior_cwnd;       // Restored after recovery and PROBE_RTT
+    bool packet_conservation;  // First round of recovery
 } bbr_state_t;
 
+
+// Sequence space comparisons (mod 2^32)
+#define SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
+// Options
+#define TCPOPT_EOL        0
+#define TCPOPT_NOP        1
+#define TCPOPT_MSS        2
+#define TCPOPT_SACK_PERM  4
+#define TCPOPT_SACK       5
+#define TCPOPT_TIMESTAMP  8
+#define TCP_MAX_SACKS     4
+
+#define TCP_MSS_DEFAULT   536           // Peer sent no MSS option
+#define TCP_MSS_LOCAL     1460          // Ethernet MTU less IPv4 and TCP headers
+#define TCP_BUF_SIZE      65536         // Send and receive rings, per direction
+#define TCP_MAX_WINDOW    65535         // No window scaling
+#define TCP_BACKLOG       128
+
+// Retransmission timeout (RFC 6298), in microseconds
+#define TCP_RTO_INITIAL   1000000
+#define TCP_RTO_MIN       200000
+#define TCP_RTO_MAX       60000000
+#define TCP_SYN_RETRIES   6
+#define TCP_MAX_RETRIES   15
+#define TCP_TIME_WAIT_US  30000000      // 2 * MSL
+#define TCP_DUPACK_THRESH 3
+
+// A sent segment not yet acknowledged. Its data stays in the send ring
+// until then, so the record is only the sequence range and its history.
+#define SEG_SACKED        0x01          // Peer holds it (SACK); not in flight
+#define SEG_LOST          0x02          // Presumed lost: resend when cwnd allows
+#define SEG_RETRANS       0x04          // Resent since it was marked lost
+#define SEG_EVER_RETRANS  0x08          // Karn: no RTT sample from its own send time
+
+typedef struct tcp_seg {
+    struct tcp_seg* next;
+    uint32_t seq;
+    uint32_t len;                       // Sequence space: data plus SYN/FIN
+    uint8_t tcp_flags;                  // TCP_SYN / TCP_FIN carried
+    uint8_t state;                      // SEG_*
+    uint64_t sent_us;                   // Last transmission
+    uint64_t delivered;                 // pcb->delivered at that transmission
+} tcp_seg_t;
+
+// Page cache data queued by tcp_sendpage(), by reference: a sequence
+// range the send ring skips, holding a pin on its page
+typedef struct tcp_page {
+    struct tcp_page* next;
+    uint32_t seq;
+    uint32_t len;
+    cached_page_t* page;
+    uint8_t* data;
+} tcp_page_t;
+
+// Data received beyond a hole, kept in sequence order without overlaps
+typedef struct tcp_ooo {
+    struct tcp_ooo* next;
+    uint32_t seq;
+    uint32_t len;
+    uint8_t data[];
+} tcp_ooo_t;
+
+// Options carried by a received segment
+typedef struct {
+    uint16_t mss;
+    bool sack_ok;
+    bool ts_ok;
+    uint32_t tsval;
+    uint32_t tsecr;
+    int nsacks;
+    uint32_t sack[TCP_MAX_SACKS][2];    // [start, end)
+} tcp_opts_t;
+
 // TCP Control Block (TCB)
-typedef struct tcp_pcb {
-    struct tcp_pcb* next;
+struct tcp_pcb {
+    struct tcp_pcb* hash_next;        // Chain in the bucket below
+    struct tcp_pcb** hash_bucket;     // NULL while in neither table
+    spinlock_t* hash_lock;
     
+    spinlock_t lock;                  // Everything below
+    wait_queue_t wait;                // Readers, writers, connect and accept
     tcp_state_t state;
+    int error;                        // Reset or timed out
     
     ip_addr_t local_ip;
     uint16_t local_port;
@@ -78,237 +180,1949 @@ typedef struct tcp_pcb {
     uint32_t snd_wnd;    // Send window
     uint32_t snd_wl1;    // Seq num of last window update
     uint32_t snd_wl2;    // Ack num of last window update
+    uint32_t iss;
+    uint16_t mss;        // Largest segment the peer takes
+    bool fin_queued;     // Close requested: FIN follows the data
     
     uint32_t rcv_nxt;    // Receive next
     uint32_t rcv_wnd;    // Receive window
+    uint32_t irs;
+    
+    // Send data from snd_buf_seq on, sent or not, until acknowledged:
+    // written bytes copied into the ring, sendfile bytes by reference
+    uint8_t* snd_buf;
+    uint32_t snd_head;
+    uint32_t snd_len;
+    uint32_t snd_buf_seq;
+    tcp_page_t* snd_pages;   // Page ranges among the ring bytes, in order
+    tcp_page_t* snd_pages_tail;
+    uint32_t snd_page_len;   // Bytes in them
+    
+    // Receive ring: in-order data the application hasn't read
+    uint8_t* rcv_buf;
+    uint32_t rcv_head;
+    uint32_t rcv_len;
+    bool rcv_fin;        // Peer's FIN consumed: reads end after the ring
+    
+    tcp_seg_t* rtx_head; // Sent, unacknowledged, in sequence order
+    tcp_seg_t* rtx_tail;
+    tcp_ooo_t* ooo;      // Out-of-order data
+    uint32_t ooo_last;   // Start of the newest out-of-order arrival (first SACK block)
+    
+    // Options agreed in the handshake
+    bool sack_ok;
+    bool ts_ok;
+    uint32_t ts_recent;  // Peer's timestamp to echo
+    
+    // RTT estimation and retransmission (RFC 6298)
+    uint64_t srtt_us;    // 0 until the first sample
+    uint64_t rttvar_us;
+    uint64_t rto_us;     // From the estimator; doubled per retry when armed
+    uint32_t retries;    // Consecutive timeouts
+    ktimer_t timer;      // RTO, zero-window probe or TIME_WAIT
+    struct tcp_pcb* timer_next;
+    bool timer_queued;
+    
+    // Loss recovery
+    uint32_t dupacks;
+    bool in_recovery;
+    uint32_t recovery_point; // snd_nxt when recovery began
+    uint32_t highest_sack;
+    uint64_t delivered;      // Bytes acknowledged or SACKed, ever
     
     // Congestion Control
     uint32_t cwnd;       // Congestion window
-    uint32_t ssthresh;   // Slow start threshold
     bbr_state_t bbr;     // BBR state
+    net_flow_t flow;     // Our queue in the interface's pacing scheduler
+    
+    // Listener: connections waiting for tcp_accept(); child: its listener
+    struct tcp_pcb* parent;
+    struct tcp_pcb* accept_head;
+    struct tcp_pcb* accept_tail;
+    struct tcp_pcb* accept_next;
+    uint32_t backlog;    // Children not yet accepted, handshake done or not
+    
+    packet_t* xmit_head; // Segments built under the lock, sent after it
+    packet_t* xmit_tail;
+};
+
+
+// ============================================================================
+// CONNECTION TABLES
+// ============================================================================
+
+/*
+ * Segments find their PCB in one of two hashes: connections by 4-tuple
+ * (sized from memory at boot) and listeners by local port. Lookups from
+ * any CPU walk the chains with no lock, following pointers published with
+ * release stores; inserts and removals take the bucket's stripe lock. An
+ * unhashed PCB stays valid for walkers already on it, so it must not be
+ * freed while a lookup could still hold it.
+ */
+#define TCP_EHASH_MIN     4096
+#define TCP_EHASH_MAX     (1U << 18)    // 100k connections at under one per bucket
+#define TCP_LHASH_BITS    9
+#define TCP_LOCK_STRIPES  256
+
+static tcp_pcb_t** tcp_ehash;                       // Connections
+static uint32_t tcp_ehash_mask;
+static tcp_pcb_t* tcp_lhash[1 << TCP_LHASH_BITS];   // Listeners
+static spinlock_t tcp_hash_locks[TCP_LOCK_STRIPES];
+static uint64_t tcp_hash_secret;                    // Keeps chains unguessable
+
+// Keyed hash of a 4-tuple: table chains and initial sequence numbers
+static inline uint32_t tcp_tuple_hash(ip_addr_t laddr, uint16_t lport, ip_addr_t raddr, uint16_t rport)
+{
+    uint64_t h = (((uint64_t)laddr << 32) | raddr) ^ tcp_hash_secret;
+    h ^= (((uint64_t)lport << 16) | rport) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+static inline uint32_t tcp_ehashfn(ip_addr_t laddr, uint16_t lport, ip_addr_t raddr, uint16_t rport)
+{
+    return tcp_tuple_hash(laddr, lport, raddr, rport) & tcp_ehash_mask;
+}
+
+static inline uint32_t tcp_lhashfn(uint16_t lport)
+{
+    return ((uint32_t)lport * 0x9E3779B1u) >> (32 - TCP_LHASH_BITS);
+}
+
+static void tcp_hash_insert(tcp_pcb_t* pcb, tcp_pcb_t** bucket, spinlock_t* lock)
+{
+    uint64_t flags = spin_lock_irqsave(lock);
+    pcb->hash_next = *bucket;
+    pcb->hash_bucket = bucket;
+    pcb->hash_lock = lock;
+    __atomic_store_n(bucket, pcb, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(lock, flags);
+}
+
+// Out of whichever table it is in; walkers already on it can still step past
+static void tcp_unhash(tcp_pcb_t* pcb)
+{
+    if (!pcb->hash_bucket) return;
     
-} tcp_pcb_t;
+    spinlock_t* lock = pcb->hash_lock;
+    uint64_t flags = spin_lock_irqsave(lock);
+    tcp_pcb_t** link = pcb->hash_bucket;
+    while (*link != pcb) link = &(*link)->hash_next;
+    __atomic_store_n(link, pcb->hash_next, __ATOMIC_RELEASE);
+    pcb->hash_bucket = NULL;
+    spin_unlock_irqrestore(lock, flags);
+}
+
+// Into the connection table, once the 4-tuple is set
+static void tcp_hash(tcp_pcb_t* pcb)
+{
+    uint32_t h = tcp_ehashfn(pcb->local_ip, pcb->local_port, pcb->remote_ip, pcb->remote_port);
+    tcp_unhash(pcb);
+    tcp_hash_insert(pcb, &tcp_ehash[h], &tcp_hash_locks[h % TCP_LOCK_STRIPES]);
+}
+
+static tcp_pcb_t* tcp_lookup_established(ip_addr_t laddr, uint16_t lport,
+                                         ip_addr_t raddr, uint16_t rport)
+{
+    tcp_pcb_t* p = __atomic_load_n(&tcp_ehash[tcp_ehashfn(laddr, lport, raddr, rport)],
+                                   __ATOMIC_ACQUIRE);
+    for (; p; p = __atomic_load_n(&p->hash_next, __ATOMIC_ACQUIRE)) {
+        if (p->local_port == lport && p->remote_port == rport &&
+            p->remote_ip == raddr && p->local_ip == laddr) {
+            return p;
+        }
+    }
+    return NULL;
+}
 
-static tcp_pcb_t* tcp_pcbs = NULL;
+// A listener bound to laddr wins over one on the wildcard address
+static tcp_pcb_t* tcp_lookup_listener(ip_addr_t laddr, uint16_t lport)
+{
+    tcp_pcb_t* wildcard = NULL;
+    tcp_pcb_t* p = __atomic_load_n(&tcp_lhash[tcp_lhashfn(lport)], __ATOMIC_ACQUIRE);
+    for (; p; p = __atomic_load_n(&p->hash_next, __ATOMIC_ACQUIRE)) {
+        if (p->local_port != lport) continue;
+        if (p->local_ip == laddr) return p;
+        if (p->local_ip == 0) wildcard = p;
+    }
+    return wildcard;
+}
 
 // ============================================================================
 // BBR CONGESTION CONTROL
 // ============================================================================
 
+/*
+ * BBR v1: the window and pacing rate come from a model of the path, the
+ * bottleneck bandwidth (best delivery rate over the last BBR_BW_ROUNDS
+ * round trips) and the propagation RTT (lowest RTT in BBR_MIN_RTT_WIN_US).
+ * STARTUP doubles the rate each round until bandwidth stops growing, DRAIN
+ * empties the queue that built, PROBE_BW cycles the gain around 1 to find
+ * more bandwidth, and PROBE_RTT briefly cuts the window to remeasure
+ * min_rtt. The pacing rate goes to the interface's fair queue through
+ * pcb->flow. Gains are in thousandths.
+ */
 #define BBR_STARTUP 0
 #define BBR_DRAIN   1
 #define BBR_PROBE_BW 2
 #define BBR_PROBE_RTT 3
 
+#define BBR_HIGH_GAIN         2885          // 2/ln(2)
+#define BBR_DRAIN_GAIN        346           // 1/high_gain
+#define BBR_CWND_GAIN         2000
+#define BBR_MIN_RTT_WIN_US    10000000
+#define BBR_PROBE_RTT_US      200000
+#define BBR_FULL_BW_ROUNDS    3             // Rounds without 25% growth end STARTUP
+
+static const uint32_t bbr_cycle_gain[8] = { 1250, 750, 1000, 1000, 1000, 1000, 1000, 1000 };
+
+static uint32_t tcp_in_flight(tcp_pcb_t* pcb);
+
+static inline uint32_t bbr_min_cwnd(tcp_pcb_t* pcb)
+{
+    return 4 * pcb->mss;
+}
+
+// Bytes the path holds at gain, 0 while the model is still empty
+static uint64_t bbr_bdp(tcp_pcb_t* pcb, uint32_t gain)
+{
+    if (!pcb->bbr.btl_bw || pcb->bbr.min_rtt_us == ~0ULL) return 0;
+    return (uint64_t)pcb->bbr.btl_bw * pcb->bbr.min_rtt_us / 1000000 * gain / 1000;
+}
+
+static void bbr_set_pacing_rate(tcp_pcb_t* pcb)
+{
+    uint64_t rate;
+    if (pcb->bbr.btl_bw) {
+        rate = (uint64_t)pcb->bbr.btl_bw * pcb->bbr.pacing_gain / 1000;
+    } else {
+        // No sample yet: the initial window per RTT (1ms before the first)
+        uint64_t rtt = pcb->srtt_us ? pcb->srtt_us : 1000;
+        rate = (uint64_t)pcb->cwnd * 1000000 / rtt * pcb->bbr.pacing_gain / 1000;
+    }
+
+    // Until the pipe is full, an early low sample must not slow startup
+    if (pcb->bbr.filled_pipe || rate > pcb->bbr.pacing_rate) {
+        pcb->bbr.pacing_rate = rate;
+    }
+    pcb->flow.rate = pcb->bbr.pacing_rate;
+}
+
+static void bbr_enter_probe_bw(tcp_pcb_t* pcb, uint64_t now)
+{
+    pcb->bbr.mode = BBR_PROBE_BW;
+    pcb->bbr.cwnd_gain = BBR_CWND_GAIN;
+    // Start anywhere but the drain phase, so flows don't cycle in step
+    pcb->bbr.cycle_idx = 2 + (uint32_t)(now % 6);
+    pcb->bbr.pacing_gain = bbr_cycle_gain[pcb->bbr.cycle_idx];
+    pcb->bbr.cycle_stamp = now;
+}
+
+// Restored once recovery or PROBE_RTT ends
+static void bbr_save_cwnd(tcp_pcb_t* pcb)
+{
+    if (!pcb->in_recovery && pcb->bbr.mode != BBR_PROBE_RTT) {
+        pcb->bbr.prior_cwnd = pcb->cwnd;
+    } else if (pcb->cwnd > pcb->bbr.prior_cwnd) {
+        pcb->bbr.prior_cwnd = pcb->cwnd;
+    }
+}
+
 void bbr_init(tcp_pcb_t* pcb)
 {
+    memset(&pcb->bbr, 0, sizeof(bbr_state_t));
     pcb->bbr.min_rtt_us = ~0ULL;
-    pcb->bbr.btl_bw = 0;
+    pcb->bbr.min_rtt_stamp = time_monotonic_us();
     pcb->bbr.mode = BBR_STARTUP;
-    pcb->bbr.pacing_gain = 2885; // 2/ln(2) * 1000
-    pcb->bbr.cwnd_gain = 2885;
+    pcb->bbr.pacing_gain = BBR_HIGH_GAIN;
+    pcb->bbr.cwnd_gain = BBR_HIGH_GAIN;
     
     pcb->cwnd = 10 * 1460; // Initial cwnd
+    bbr_set_pacing_rate(pcb);
     
     KDEBUG("TCP: BBR Initialized for PCB %p", pcb);
 }
 
+// An RTT sample, with the bytes delivered while that segment was out
 void bbr_update_model(tcp_pcb_t* pcb, uint64_t rtt_us, uint32_t delivered_bytes)
 {
-    // Update Min RTT
-    if (rtt_us < pcb->bbr.min_rtt_us || pcb->bbr.min_rtt_us == ~0ULL) {
-        pcb->bbr.min_rtt_us = rtt_us;
-        pcb->bbr.min_rtt_stamp = sys_get_ticks();
+    bbr_state_t* bbr = &pcb->bbr;
+    uint64_t now = time_monotonic_us();
+    uint32_t in_flight = tcp_in_flight(pcb);
+    
+    // A round trip ends when data sent after the last one began is acked
+    uint64_t prior_delivered = pcb->delivered - delivered_bytes;
+    bbr->round_start = false;
+    if (prior_delivered >= bbr->next_round_delivered) {
+        bbr->next_round_delivered = pcb->delivered;
+        bbr->round_count++;
+        bbr->round_start = true;
+        bbr->bw_rounds[bbr->round_count % BBR_BW_ROUNDS] = 0;
+        bbr->packet_conservation = false;
     }
     
-    // Update Bottleneck Bandwidth
-    // bw = delivered / rtt
-    uint32_t bw = (delivered_bytes * 1000000) / (rtt_us + 1);
-    if (bw > pcb->bbr.btl_bw) {
-        pcb->bbr.btl_bw = bw;
+    // Update Bottleneck Bandwidth: windowed max of bw = delivered / rtt
+    uint64_t bw = ((uint64_t)delivered_bytes * 1000000) / (rtt_us + 1);
+    if (bw > 0xFFFFFFFF) bw = 0xFFFFFFFF;
+    uint32_t* slot = &bbr->bw_rounds[bbr->round_count % BBR_BW_ROUNDS];
+    if (bw > *slot) *slot = (uint32_t)bw;
+    bbr->btl_bw = 0;
+    for (int i = 0; i < BBR_BW_ROUNDS; i++) {
+        if (bbr->bw_rounds[i] > bbr->btl_bw) bbr->btl_bw = bbr->bw_rounds[i];
     }
     
-    // State transitions (simplified)
-    if (pcb->bbr.mode == BBR_STARTUP) {
-        if (pcb->bbr.btl_bw > 0) {
-            // If bandwidth plateaued, switch to DRAIN
-            // (Simplified logic for demo)
+    // Pipe full once bandwidth stops growing by a quarter per round
+    if (bbr->round_start && !bbr->filled_pipe) {
+        if (bbr->btl_bw >= (uint64_t)bbr->full_bw * 5 / 4) {
+            bbr->full_bw = bbr->btl_bw;
+            bbr->full_bw_count = 0;
+        } else if (++bbr->full_bw_count >= BBR_FULL_BW_ROUNDS) {
+            bbr->filled_pipe = true;
         }
     }
+    
+    // Update Min RTT, forgetting one older than the window
+    bool expired = now - bbr->min_rtt_stamp > BBR_MIN_RTT_WIN_US;
+    if (rtt_us <= bbr->min_rtt_us || expired) {
+        bbr->min_rtt_us = rtt_us;
+        bbr->min_rtt_stamp = now;
+    }
+    
+    // State transitions
+    if (bbr->mode == BBR_STARTUP && bbr->filled_pipe) {
+        bbr->mode = BBR_DRAIN;
+        bbr->pacing_gain = BBR_DRAIN_GAIN;
+        bbr->cwnd_gain = BBR_HIGH_GAIN;
+    }
+    if (bbr->mode == BBR_DRAIN && in_flight <= bbr_bdp(pcb, 1000)) {
+        bbr_enter_probe_bw(pcb, now);
+    }
+    if (bbr->mode == BBR_PROBE_BW) {
+        // Each phase lasts a min_rtt; probing up holds until the extra is
+        // in flight, draining ends as soon as the queue is gone
+        uint32_t gain = bbr->pacing_gain;
+        bool next = now - bbr->cycle_stamp > bbr->min_rtt_us;
+        if (gain > 1000) {
+            next = next && (in_flight >= bbr_bdp(pcb, gain) || pcb->in_recovery);
+        } else if (gain < 1000) {
+            next = next || in_flight <= bbr_bdp(pcb, 1000);
+        }
+        if (next) {
+            bbr->cycle_idx = (bbr->cycle_idx + 1) % 8;
+            bbr->pacing_gain = bbr_cycle_gain[bbr->cycle_idx];
+            bbr->cycle_stamp = now;
+        }
+    }
+    
+    // PROBE_RTT: min_rtt went stale, so hold a minimal window for a round
+    // and BBR_PROBE_RTT_US to let the queue drain and measure again
+    if (expired && bbr->mode != BBR_PROBE_RTT) {
+        bbr_save_cwnd(pcb);
+        bbr->mode = BBR_PROBE_RTT;
+        bbr->pacing_gain = 1000;
+        bbr->cwnd_gain = 1000;
+        bbr->probe_rtt_done_stamp = 0;
+    }
+    if (bbr->mode == BBR_PROBE_RTT) {
+        if (!bbr->probe_rtt_done_stamp && in_flight <= bbr_min_cwnd(pcb)) {
+            bbr->probe_rtt_done_stamp = now + BBR_PROBE_RTT_US;
+            bbr->probe_rtt_round_done = false;
+            bbr->next_round_delivered = pcb->delivered;
+        } else if (bbr->probe_rtt_done_stamp) {
+            if (bbr->round_start) bbr->probe_rtt_round_done = true;
+            if (bbr->probe_rtt_round_done && now > bbr->probe_rtt_done_stamp) {
+                bbr->min_rtt_stamp = now;
+                if (pcb->cwnd < bbr->prior_cwnd) pcb->cwnd = bbr->prior_cwnd;
+                if (bbr->filled_pipe) {
+                    bbr_enter_probe_bw(pcb, now);
+                } else {
+                    bbr->mode = BBR_STARTUP;
+                    bbr->pacing_gain = BBR_HIGH_GAIN;
+                    bbr->cwnd_gain = BBR_HIGH_GAIN;
+                }
+            }
+        }
+    }
+    
+    bbr_set_pacing_rate(pcb);
+}
+
+// Window after an ACK delivered acked bytes: toward cwnd_gain * BDP
+static void bbr_on_ack(tcp_pcb_t* pcb, uint32_t acked)
+{
+    uint64_t target = bbr_bdp(pcb, pcb->bbr.cwnd_gain);
+    if (target) target += 3 * pcb->mss;  // Room for delayed and stretched ACKs
+    uint64_t cwnd = pcb->cwnd;
+    
+    if (pcb->in_recovery && pcb->bbr.packet_conservation) {
+        // Packet conservation: one out for each one delivered
+        uint64_t conserve = (uint64_t)tcp_in_flight(pcb) + acked;
+        if (cwnd < conserve) cwnd = conserve;
+    } else if (pcb->bbr.filled_pipe) {
+        cwnd += acked;
+        if (target && cwnd > target) cwnd = target;
+    } else if (!target || cwnd < target) {
+        cwnd += acked;
+    }
+    
+    if (pcb->bbr.mode == BBR_PROBE_RTT && cwnd > bbr_min_cwnd(pcb)) cwnd = bbr_min_cwnd(pcb);
+    if (cwnd < bbr_min_cwnd(pcb)) cwnd = bbr_min_cwnd(pcb);
+    if (cwnd > 4 * TCP_BUF_SIZE) cwnd = 4 * TCP_BUF_SIZE;
+    pcb->cwnd = (uint32_t)cwnd;
+    bbr_set_pacing_rate(pcb);
+}
+
+// Loss: for a round, send only as fast as data is delivered
+static void bbr_start_conservation(tcp_pcb_t* pcb)
+{
+    pcb->bbr.packet_conservation = true;
+    pcb->bbr.next_round_delivered = pcb->delivered;
+}
+
+// Fast retransmit: hold the window at what is still in flight
+static void bbr_enter_recovery(tcp_pcb_t* pcb, uint32_t in_flight)
+{
+    bbr_save_cwnd(pcb);
+    bbr_start_conservation(pcb);
+    pcb->cwnd = in_flight > bbr_min_cwnd(pcb) ? in_flight : bbr_min_cwnd(pcb);
+}
+
+static void bbr_exit_recovery(tcp_pcb_t* pcb)
+{
+    pcb->bbr.packet_conservation = false;
+    if (pcb->cwnd < pcb->bbr.prior_cwnd) pcb->cwnd = pcb->bbr.prior_cwnd;
+}
+
+// Timeout: everything is presumed gone, restart from one segment
+static void bbr_on_rto(tcp_pcb_t* pcb)
+{
+    bbr_save_cwnd(pcb);
+    bbr_start_conservation(pcb);
+    pcb->cwnd = pcb->mss;
 }
 
+
 // ============================================================================
 // TCP CORE
 // ============================================================================
 
-tcp_pcb_t* tcp_new(void)
+#define TCP_TIMER_PRIORITY 10
+
+// Expired PCB timers, handed from interrupt context to the timer task
+static spinlock_t tcp_timer_lock = SPINLOCK_INIT;
+static tcp_pcb_t* tcp_timer_list = NULL;
+static wait_queue_t tcp_timer_wq = WAIT_QUEUE_INIT;
+
+static uint16_t tcp_next_port = 49152;    // Ephemeral range
+
+// Received segment, header fields in host order
+typedef struct {
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t flags;
+    uint16_t wnd;
+    uint8_t* data;
+    uint32_t len;
+    tcp_opts_t opts;
+} tcp_rx_t;
+
+static void tcp_output(tcp_pcb_t* pcb, bool probe);
+static void tcp_timer_fire(void* arg);
+
+static inline uint32_t tcp_get32(const uint8_t* p)
 {
-    tcp_pcb_t* pcb = kmalloc_tracked(sizeof(tcp_pcb_t), "tcp_pcb");
-    if (!pcb) return NULL;
-    
-    memset(pcb, 0, sizeof(tcp_pcb_t));
-    pcb->state = TCP_CLOSED;
-    pcb->rcv_wnd = 8192; // 8KB window
-    
-    bbr_init(pcb);
-    
-    pcb->next = tcp_pcbs;
-    tcp_pcbs = pcb;
-    
-    return pcb;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
 }
 
-int tcp_bind(tcp_pcb_t* pcb, ip_addr_t ip, uint16_t port)
+static inline void tcp_put32(uint8_t* p, uint32_t v)
 {
-    pcb->local_ip = ip;
-    pcb->local_port = port;
-    return 0;
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
 }
 
-int tcp_listen(tcp_pcb_t* pcb)
+// Timestamp option clock
+static inline uint32_t tcp_now_ms(void)
 {
-    pcb->state = TCP_LISTEN;
-    return 0;
+    return (uint32_t)time_monotonic_ms();
 }
 
-static int tcp_send_packet(tcp_pcb_t* pcb, uint8_t flags, void* data, uint32_t len)
+static inline uint64_t tcp_lock(tcp_pcb_t* pcb)
 {
-    packet_t* pkt = net_alloc_packet(NET_MAX_PACKET_SIZE);
-    if (!pkt) return -1;
-    
-    // Reserve headers
-    pkt->data += sizeof(eth_header_t) + sizeof(ipv4_header_t) + sizeof(tcp_header_t);
-    
-    // Copy data
-    if (len > 0) {
-        memcpy(pkt->data, data, len);
+    return spin_lock_irqsave(&pcb->lock);
+}
+
+// Drop the lock, then send what was built under it: a reply looped back
+// to this host comes straight back into tcp_input(), which locks again
+static void tcp_unlock(tcp_pcb_t* pcb, uint64_t flags)
+{
+    packet_t* pkt = pcb->xmit_head;
+    ip_addr_t dest = pcb->remote_ip;
+    pcb->xmit_head = pcb->xmit_tail = NULL;
+    spin_unlock_irqrestore(&pcb->lock, flags);
+
+    while (pkt) {
+        packet_t* next = pkt->next;
+        pkt->next = NULL;
+        ipv4_output(pkt, dest, IPPROTO_TCP);
+        pkt = next;
     }
-    pkt->len = len;
-    
-    // Prepend TCP header
-    pkt->data -= sizeof(tcp_header_t);
-    pkt->len += sizeof(tcp_header_t);
-    
-    tcp_header_t* tcp = (tcp_header_t*)pkt->data;
+}
+
+// ============================================================================
+// OPTIONS
+// ============================================================================
+
+static void tcp_parse_options(const uint8_t* p, uint32_t len, tcp_opts_t* o)
+{
+    memset(o, 0, sizeof(*o));
+    while (len > 0) {
+        uint8_t kind = p[0];
+        if (kind == TCPOPT_EOL) break;
+        if (kind == TCPOPT_NOP) {
+            p++;
+            len--;
+            continue;
+        }
+        if (len < 2 || p[1] < 2 || p[1] > len) break;
+
+        uint8_t olen = p[1];
+        switch (kind) {
+            case TCPOPT_MSS:
+                if (olen == 4) o->mss = (uint16_t)((p[2] << 8) | p[3]);
+                break;
+            case TCPOPT_SACK_PERM:
+                if (olen == 2) o->sack_ok = true;
+                break;
+            case TCPOPT_TIMESTAMP:
+                if (olen == 10) {
+                    o->ts_ok = true;
+                    o->tsval = tcp_get32(p + 2);
+                    o->tsecr = tcp_get32(p + 6);
+                }
+                break;
+            case TCPOPT_SACK:
+                for (uint32_t i = 2; i + 8 <= olen && o->nsacks < TCP_MAX_SACKS; i += 8) {
+                    o->sack[o->nsacks][0] = tcp_get32(p + i);
+                    o->sack[o->nsacks][1] = tcp_get32(p + i + 4);
+                    o->nsacks++;
+                }
+                break;
+        }
+        p += olen;
+        len -= olen;
+    }
+}
+
+// Out-of-order data as SACK blocks: the one holding the newest arrival
+// first (RFC 2018), then the rest in sequence order
+static int tcp_sack_blocks(tcp_pcb_t* pcb, uint32_t blocks[][2], int max)
+{
+    int n = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (tcp_ooo_t* e = pcb->ooo; e && n < max; ) {
+            uint32_t start = e->seq;
+            uint32_t end = e->seq + e->len;
+            while (e->next && e->next->seq == end) {
+                e = e->next;
+                end += e->len;
+            }
+            e = e->next;
+
+            bool newest = SEQ_GEQ(pcb->ooo_last, start) && SEQ_LT(pcb->ooo_last, end);
+            if (newest == (pass == 0)) {
+                blocks[n][0] = start;
+                blocks[n][1] = end;
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+// Options for an outgoing segment; their length is a multiple of 4
+static uint32_t tcp_write_options(tcp_pcb_t* pcb, uint8_t* opt, bool syn)
+{
+    uint8_t* p = opt;
+
+    if (syn) {
+        *p++ = TCPOPT_MSS;
+        *p++ = 4;
+        *p++ = TCP_MSS_LOCAL >> 8;
+        *p++ = TCP_MSS_LOCAL & 0xFF;
+        if (pcb->sack_ok) {
+            *p++ = TCPOPT_NOP;
+            *p++ = TCPOPT_NOP;
+            *p++ = TCPOPT_SACK_PERM;
+            *p++ = 2;
+        }
+    }
+    if (pcb->ts_ok) {
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_TIMESTAMP;
+        *p++ = 10;
+        tcp_put32(p, tcp_now_ms());
+        tcp_put32(p + 4, pcb->ts_recent);
+        p += 8;
+    }
+    if (!syn && pcb->sack_ok && pcb->ooo) {
+        uint32_t blocks[TCP_MAX_SACKS][2];
+        int n = tcp_sack_blocks(pcb, blocks, (int)(40 - (p - opt) - 4) / 8);
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_SACK;
+        *p++ = (uint8_t)(2 + 8 * n);
+        for (int i = 0; i < n; i++) {
+            tcp_put32(p, blocks[i][0]);
+            tcp_put32(p + 4, blocks[i][1]);
+            p += 8;
+        }
+    }
+    return (uint32_t)(p - opt);
+}
+
+// ============================================================================
+// OUTPUT
+// ============================================================================
+
+// Window to advertise: free receive ring
+static uint32_t tcp_rcv_window(tcp_pcb_t* pcb)
+{
+    if (!pcb->rcv_buf) return 0;
+    uint32_t free = TCP_BUF_SIZE - pcb->rcv_len;
+    return free < TCP_MAX_WINDOW ? free : TCP_MAX_WINDOW;
+}
+
+// End of the data queued to send
+static inline uint32_t tcp_snd_end(tcp_pcb_t* pcb)
+{
+    return pcb->snd_buf_seq + pcb->snd_len + pcb->snd_page_len;
+}
+
+// Page range holding seq, or NULL if it is ring data
+static tcp_page_t* tcp_find_page(tcp_pcb_t* pcb, uint32_t seq)
+{
+    for (tcp_page_t* pg = pcb->snd_pages; pg && SEQ_LEQ(pg->seq, seq); pg = pg->next) {
+        if (SEQ_LT(seq, pg->seq + pg->len)) return pg;
+    }
+    return NULL;
+}
+
+// How much of len bytes from seq one segment takes: ring data or a run of
+// adjacent page ranges (one fragment each), not both
+static uint32_t tcp_snd_run(tcp_pcb_t* pcb, uint32_t seq, uint32_t len)
+{
+    tcp_page_t* pg = pcb->snd_pages;
+    while (pg && SEQ_LEQ(pg->seq + pg->len, seq)) pg = pg->next;
+    if (!pg) return len;
+    if (SEQ_LT(seq, pg->seq)) return pg->seq - seq < len ? pg->seq - seq : len;
+
+    uint32_t run = 0;
+    for (int frags = 0; pg && frags < PACKET_MAX_FRAGS && run < len; frags++) {
+        run = pg->seq + pg->len - seq;
+        if (!pg->next || pg->next->seq != pg->seq + pg->len) break;
+        pg = pg->next;
+    }
+    return run < len ? run : len;
+}
+
+// Send ring position of seq: the ring holds the stream minus the page ranges
+static uint32_t tcp_ring_offset(tcp_pcb_t* pcb, uint32_t seq)
+{
+    uint32_t skip = seq - pcb->snd_buf_seq;
+    for (tcp_page_t* pg = pcb->snd_pages; pg && SEQ_LT(pg->seq, seq); pg = pg->next) {
+        skip -= pg->len;
+    }
+    return (pcb->snd_head + skip) % TCP_BUF_SIZE;
+}
+
+// Build a segment carrying data_len bytes of send data from seq and queue
+// it to go out once the lock is dropped. Ring data is copied in; page data
+// goes as fragments, each with its own pin.
+static void tcp_emit(tcp_pcb_t* pcb, uint32_t seq, uint8_t flags, uint32_t data_len)
+{
+    tcp_page_t* pg = data_len > 0 ? tcp_find_page(pcb, seq) : NULL;
+    packet_t* pkt = net_alloc_packet(pg ? 0 : data_len);
+    if (!pkt) return;  // As good as lost on the wire; the timer resends it
+
+    if (pg) {
+        for (uint32_t at = seq, left = data_len; left > 0; pg = pg->next) {
+            uint32_t off = at - pg->seq;
+            uint32_t n = pg->len - off < left ? pg->len - off : left;
+            page_cache_hold(pg->page);
+            packet_add_frag(pkt, pg->page, pg->data + off, n);
+            at += n;
+            left -= n;
+        }
+    } else if (data_len > 0) {
+        uint8_t* dst = packet_put(pkt, data_len);
+        uint32_t off = tcp_ring_offset(pcb, seq);
+        uint32_t first = TCP_BUF_SIZE - off;
+        if (first > data_len) first = data_len;
+        memcpy(dst, pcb->snd_buf + off, first);
+        memcpy(dst + first, pcb->snd_buf, data_len - first);
+    }
+
+    uint8_t opts[40];
+    uint32_t opt_len = tcp_write_options(pcb, opts, flags & TCP_SYN);
+    tcp_header_t* tcp = packet_push(pkt, sizeof(tcp_header_t) + opt_len);
+    pcb->rcv_wnd = tcp_rcv_window(pcb);
     tcp->src_port = htons(pcb->local_port);
     tcp->dest_port = htons(pcb->remote_port);
-    tcp->seq_num = htonl(pcb->snd_nxt);
-    tcp->ack_num = htonl(pcb->rcv_nxt);
-    tcp->data_offset = (sizeof(tcp_header_t) / 4) << 4;
+    tcp->seq_num = htonl(seq);
+    tcp->ack_num = (flags & TCP_ACK) ? htonl(pcb->rcv_nxt) : 0;
+    tcp->data_offset = (uint8_t)(((sizeof(tcp_header_t) + opt_len) / 4) << 4);
     tcp->flags = flags;
-    tcp->window = htons(pcb->rcv_wnd);
+    tcp->window = htons((uint16_t)pcb->rcv_wnd);
     tcp->urgent_ptr = 0;
     tcp->checksum = 0;
-    
-    // Pseudo-header checksum would go here
-    
-    // Update sequence number
-    if (flags & (TCP_SYN | TCP_FIN)) {
-        pcb->snd_nxt++;
+    memcpy(tcp + 1, opts, opt_len);
+
+    // Summed with the pseudo-header once ipv4_output() knows the source
+    pkt->l4_header = tcp;
+    pkt->csum_offset = __builtin_offsetof(tcp_header_t, checksum);
+    pkt->flags |= PACKET_CSUM_PARTIAL;
+    pkt->flow = &pcb->flow;  // Leaves at the BBR pacing rate
+
+    if (pcb->xmit_tail) {
+        pcb->xmit_tail->next = pkt;
+    } else {
+        pcb->xmit_head = pkt;
     }
-    pcb->snd_nxt += len;
-    
-    return ipv4_output(pkt, pcb->remote_ip, IPPROTO_TCP);
+    pcb->xmit_tail = pkt;
 }
 
-int tcp_input(net_interface_t* netif, packet_t* pkt)
+static void tcp_send_ack(tcp_pcb_t* pcb)
 {
-    if (pkt->len < sizeof(tcp_header_t)) return -1;
-    
-    tcp_header_t* tcp = (tcp_header_t*)pkt->data;
-    pkt->l4_header = tcp;
-    
-    uint16_t src_port = ntohs(tcp->src_port);
-    uint16_t dest_port = ntohs(tcp->dest_port);
-    uint32_t seq = ntohl(tcp->seq_num);
-    uint32_t ack = ntohl(tcp->ack_num);
-    uint8_t flags = tcp->flags;
-    
-    // Find PCB
-    tcp_pcb_t* pcb = NULL;
-    for (tcp_pcb_t* p = tcp_pcbs; p != NULL; p = p->next) {
-        if (p->local_port == dest_port) {
-            // Check remote if connected
-            if (p->state != TCP_LISTEN && p->state != TCP_CLOSED) {
-                if (p->remote_port == src_port) { // And IP check
-                    pcb = p;
-                    break;
-                }
-            } else if (p->state == TCP_LISTEN) {
-                pcb = p; // Found listener
-                // Keep searching for specific match though
-            }
-        }
-    }
-    
-    if (!pcb) {
-        // Send RST
-        return 0;
-    }
-    
-    // State Machine
-    switch (pcb->state) {
-        case TCP_LISTEN:
-            if (flags & TCP_SYN) {
-                KDEBUG("TCP: SYN received on port %d", dest_port);
-                
-                // Create new PCB for connection
-                tcp_pcb_t* npcb = tcp_new();
-                npcb->local_ip = netif->ip_addr;
-                npcb->local_port = dest_port;
-                npcb->remote_ip = ((ipv4_header_t*)pkt->l3_header)->src_ip;
-                npcb->remote_port = src_port;
-                npcb->state = TCP_SYN_RECEIVED;
-                npcb->rcv_nxt = seq + 1;
-                npcb->snd_nxt = 12345; // Random ISN
-                
-                // Send SYN+ACK
-                tcp_send_packet(npcb, TCP_SYN | TCP_ACK, NULL, 0);
-            }
-            break;
-            
-        case TCP_SYN_SENT:
-            if ((flags & TCP_SYN) && (flags & TCP_ACK)) {
-                KDEBUG("TCP: SYN+ACK received");
-                pcb->state = TCP_ESTABLISHED;
-                pcb->snd_una = ack;
-                pcb->rcv_nxt = seq + 1;
-                
-                // Send ACK
-                tcp_send_packet(pcb, TCP_ACK, NULL, 0);
-                
-                KINFO("TCP: Connection established with %d.%d.%d.%d:%d",
-                      (pcb->remote_ip >> 24) & 0xFF, (pcb->remote_ip >> 16) & 0xFF,
-                      (pcb->remote_ip >> 8) & 0xFF, pcb->remote_ip & 0xFF,
-                      pcb->remote_port);
-            }
-            break;
-            
-        case TCP_ESTABLISHED:
-            if (flags & TCP_ACK) {
-                // Update BBR model
-                // RTT = now - timestamp_of_sent_packet (simplified)
-                bbr_update_model(pcb, 1000, 0); // Dummy values
-                
-                pcb->snd_una = ack;
-            }
-            if (flags & TCP_FIN) {
-                KDEBUG("TCP: FIN received");
-                pcb->state = TCP_CLOSE_WAIT;
-                pcb->rcv_nxt++;
-                tcp_send_packet(pcb, TCP_ACK, NULL, 0);
-            }
-            // Handle data...
-            break;
-            
-        default:
-            break;
+    tcp_emit(pcb, pcb->snd_nxt, TCP_ACK, 0);
+}
+
+// (Re)transmit a segment from the retransmission queue
+static void tcp_xmit_seg(tcp_pcb_t* pcb, tcp_seg_t* seg)
+{
+    uint32_t data_len = seg->len - ((seg->tcp_flags & TCP_SYN) ? 1 : 0) -
+                        ((seg->tcp_flags & TCP_FIN) ? 1 : 0);
+    uint8_t flags = seg->tcp_flags;
+    if (pcb->state != TCP_SYN_SENT) flags |= TCP_ACK;
+    if (data_len > 0) flags |= TCP_PSH;
+
+    seg->sent_us = time_monotonic_us();
+    seg->delivered = pcb->delivered;
+    tcp_emit(pcb, seg->seq, flags, data_len);
+}
+
+static tcp_seg_t* tcp_queue_seg(tcp_pcb_t* pcb, uint32_t len, uint8_t tcp_flags)
+{
+    tcp_seg_t* seg = kmalloc_tracked(sizeof(tcp_seg_t), "tcp_seg");
+    if (!seg) return NULL;
+
+    seg->next = NULL;
+    seg->seq = pcb->snd_nxt;
+    seg->len = len;
+    seg->tcp_flags = tcp_flags;
+    seg->state = 0;
+    if (pcb->rtx_tail) {
+        pcb->rtx_tail->next = seg;
+    } else {
+        pcb->rtx_head = seg;
     }
-    
-    return 0;
+    pcb->rtx_tail = seg;
+    pcb->snd_nxt += len;
+    return seg;
 }
 
-void tcp_init(void)
+// Bytes still in the network: sent, not SACKed, and not given up as lost
+// unless resent since
+static uint32_t tcp_in_flight(tcp_pcb_t* pcb)
 {
-    KINFO("TCP: Initialized with BBR Congestion Control");
+    uint32_t bytes = 0;
+    for (tcp_seg_t* seg = pcb->rtx_head; seg; seg = seg->next) {
+        if (seg->state & SEG_SACKED) continue;
+        if ((seg->state & SEG_LOST) && !(seg->state & SEG_RETRANS)) continue;
+        bytes += seg->len;
+    }
+    return bytes;
+}
+
+// Retransmit what is marked lost, then send new data, as far as cwnd and
+// the peer's window allow. A probe sends one byte into a closed window.
+static void tcp_output(tcp_pcb_t* pcb, bool probe)
+{
+    uint32_t in_flight = tcp_in_flight(pcb);
+
+    for (tcp_seg_t* seg = pcb->rtx_head; seg; seg = seg->next) {
+        if (!(seg->state & SEG_LOST) || (seg->state & (SEG_RETRANS | SEG_SACKED))) continue;
+        if (in_flight && in_flight + seg->len > pcb->cwnd) return;
+        seg->state |= SEG_RETRANS | SEG_EVER_RETRANS;
+        tcp_xmit_seg(pcb, seg);
+        in_flight += seg->len;
+    }
+
+    if (pcb->state != TCP_ESTABLISHED && pcb->state != TCP_CLOSE_WAIT &&
+        pcb->state != TCP_FIN_WAIT_1 && pcb->state != TCP_LAST_ACK) {
+        return;
+    }
+
+    for (;;) {
+        uint32_t data_end = tcp_snd_end(pcb);
+        if (SEQ_GT(pcb->snd_nxt, data_end)) return;  // FIN already sent
+        uint32_t unsent = data_end - pcb->snd_nxt;
+        if (unsent == 0 && !pcb->fin_queued) return;
+
+        uint32_t len = unsent < pcb->mss ? unsent : pcb->mss;
+        uint32_t wnd_end = pcb->snd_una + pcb->snd_wnd;
+        uint32_t room = SEQ_GT(wnd_end, pcb->snd_nxt) ? wnd_end - pcb->snd_nxt : 0;
+        if (probe) {
+            if (len > (room ? room : 1)) len = room ? room : 1;
+        } else if (len > 0 && SEQ_GT(pcb->snd_nxt + len, wnd_end)) {
+            // Fill the window only with a full segment or the last of the data
+            if (room < pcb->mss && room < unsent) return;
+            len = room;
+        }
+        if (!probe && in_flight && in_flight + len > pcb->cwnd) return;
+        len = tcp_snd_run(pcb, pcb->snd_nxt, len);
+
+        bool fin = pcb->fin_queued && len == unsent;
+        tcp_seg_t* seg = tcp_queue_seg(pcb, len + (fin ? 1 : 0), fin ? TCP_FIN : 0);
+        if (!seg) return;
+        tcp_xmit_seg(pcb, seg);
+        in_flight += seg->len;
+        if (fin || probe) return;
+    }
+}
+
+// RTO while anything is outstanding; otherwise a probe timer while data
+// waits on the peer's window
+static void tcp_rearm(tcp_pcb_t* pcb, bool restart)
+{
+    if (pcb->state == TCP_TIME_WAIT || pcb->state == TCP_CLOSED) return;
+
+    if (pcb->rtx_head || SEQ_GT(tcp_snd_end(pcb), pcb->snd_nxt)) {
+        uint64_t rto = pcb->rto_us << (pcb->retries < 16 ? pcb->retries : 16);
+        if (rto > TCP_RTO_MAX) rto = TCP_RTO_MAX;
+        if (restart || !ktimer_pending(&pcb->timer)) ktimer_arm_in(&pcb->timer, rto);
+    } else {
+        ktimer_cancel(&pcb->timer);
+    }
+}
+
+// Reply to a segment that has no connection (RFC 793 reset generation)
+static void tcp_send_reset(ipv4_header_t* ip, tcp_header_t* in, uint32_t seg_len)
+{
+    if (in->flags & TCP_RST) return;
+
+    packet_t* pkt = net_alloc_packet(0);
+    if (!pkt) return;
+
+    tcp_header_t* tcp = packet_push(pkt, sizeof(tcp_header_t));
+    tcp->src_port = in->dest_port;
+    tcp->dest_port = in->src_port;
+    if (in->flags & TCP_ACK) {
+        tcp->seq_num = in->ack_num;
+        tcp->ack_num = 0;
+        tcp->flags = TCP_RST;
+    } else {
+        tcp->seq_num = 0;
+        tcp->ack_num = htonl(ntohl(in->seq_num) + seg_len);
+        tcp->flags = TCP_RST | TCP_ACK;
+    }
+    tcp->data_offset = (sizeof(tcp_header_t) / 4) << 4;
+    tcp->window = 0;
+    tcp->urgent_ptr = 0;
+    tcp->checksum = 0;
+
+    pkt->l4_header = tcp;
+    pkt->csum_offset = __builtin_offsetof(tcp_header_t, checksum);
+    pkt->flags |= PACKET_CSUM_PARTIAL;
+    ipv4_output(pkt, ip->src_ip, IPPROTO_TCP);
+}
+
+// ============================================================================
+// CONNECTION SETUP AND TEARDOWN
+// ============================================================================
+
+tcp_pcb_t* tcp_new(void)
+{
+    tcp_pcb_t* pcb = kmalloc_tracked(sizeof(tcp_pcb_t), "tcp_pcb");
+    if (!pcb) return NULL;
+
+    memset(pcb, 0, sizeof(tcp_pcb_t));
+    pcb->state = TCP_CLOSED;
+    wait_queue_init(&pcb->wait);
+    ktimer_init(&pcb->timer, tcp_timer_fire, pcb);
+    pcb->mss = TCP_MSS_DEFAULT;
+    pcb->rto_us = TCP_RTO_INITIAL;
+    net_flow_init(&pcb->flow);
+
+    bbr_init(pcb);
+
+    return pcb;
+}
+
+static int tcp_alloc_buffers(tcp_pcb_t* pcb)
+{
+    pcb->snd_buf = kmalloc_tracked(TCP_BUF_SIZE, "tcp_sndbuf");
+    pcb->rcv_buf = kmalloc_tracked(TCP_BUF_SIZE, "tcp_rcvbuf");
+    if (!pcb->snd_buf || !pcb->rcv_buf) {
+        if (pcb->snd_buf) kfree_tracked(pcb->snd_buf);
+        if (pcb->rcv_buf) kfree_tracked(pcb->rcv_buf);
+        pcb->snd_buf = pcb->rcv_buf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Drop send data before ack, ring bytes and page ranges in stream order
+static void tcp_snd_release(tcp_pcb_t* pcb, uint32_t ack)
+{
+    uint32_t end = tcp_snd_end(pcb);
+    if (SEQ_GT(ack, end)) ack = end;  // Past the data: our FIN
+
+    while (SEQ_LT(pcb->snd_buf_seq, ack)) {
+        uint32_t n = ack - pcb->snd_buf_seq;
+        tcp_page_t* pg = pcb->snd_pages;
+        if (pg && pg->seq == pcb->snd_buf_seq) {
+            if (n < pg->len) {
+                pg->seq += n;
+                pg->data += n;
+                pg->len -= n;
+            } else {
+                n = pg->len;
+                pcb->snd_pages = pg->next;
+                if (!pcb->snd_pages) pcb->snd_pages_tail = NULL;
+                page_cache_put(pg->page);
+                kfree_tracked(pg);
+            }
+            pcb->snd_page_len -= n;
+        } else {
+            uint32_t ring = pg ? pg->seq - pcb->snd_buf_seq : pcb->snd_len;
+            if (n > ring) n = ring;
+            pcb->snd_head = (pcb->snd_head + n) % TCP_BUF_SIZE;
+            pcb->snd_len -= n;
+        }
+        pcb->snd_buf_seq += n;
+    }
+}
+
+static void tcp_free_queues(tcp_pcb_t* pcb)
+{
+    while (pcb->snd_pages) {
+        tcp_page_t* pg = pcb->snd_pages;
+        pcb->snd_pages = pg->next;
+        page_cache_put(pg->page);
+        kfree_tracked(pg);
+    }
+    pcb->snd_pages_tail = NULL;
+    pcb->snd_page_len = 0;
+    while (pcb->rtx_head) {
+        tcp_seg_t* seg = pcb->rtx_head;
+        pcb->rtx_head = seg->next;
+        kfree_tracked(seg);
+    }
+    pcb->rtx_tail = NULL;
+    while (pcb->ooo) {
+        tcp_ooo_t* e = pcb->ooo;
+        pcb->ooo = e->next;
+        kfree_tracked(e);
+    }
+}
+
+// Initial send sequence (RFC 6528): a clock plus a keyed hash of the tuple
+static void tcp_start(tcp_pcb_t* pcb)
+{
+    pcb->iss = (uint32_t)(time_monotonic_us() / 4) +
+               tcp_tuple_hash(pcb->local_ip, pcb->local_port, pcb->remote_ip, pcb->remote_port);
+    pcb->snd_una = pcb->iss;
+    pcb->snd_nxt = pcb->iss;
+    pcb->highest_sack = pcb->iss;
+    pcb->snd_buf_seq = pcb->iss + 1;
+    pcb->snd_head = 0;
+    pcb->snd_len = 0;
+}
+
+// The connection is over (err: why, 0 for a clean close). The PCB stays
+// allocated: lockless lookups may still hold it, and the owner may too.
+static void tcp_set_closed(tcp_pcb_t* pcb, int err)
+{
+    // Still in its handshake: give the listener its backlog slot back
+    if (pcb->parent) {
+        uint64_t flags = spin_lock_irqsave(&pcb->parent->lock);
+        pcb->parent->backlog--;
+        spin_unlock_irqrestore(&pcb->parent->lock, flags);
+        pcb->parent = NULL;
+    }
+
+    pcb->state = TCP_CLOSED;
+    if (err) pcb->error = err;
+    tcp_unhash(pcb);
+    ktimer_cancel(&pcb->timer);
+    tcp_free_queues(pcb);
+    if (pcb->snd_buf) kfree_tracked(pcb->snd_buf);
+    if (pcb->rcv_buf) kfree_tracked(pcb->rcv_buf);
+    pcb->snd_buf = pcb->rcv_buf = NULL;
+    pcb->snd_len = pcb->rcv_len = 0;
+    wake_up(&pcb->wait);
+}
+
+static void tcp_enter_time_wait(tcp_pcb_t* pcb)
+{
+    pcb->state = TCP_TIME_WAIT;
+    tcp_free_queues(pcb);
+    kfree_tracked(pcb->snd_buf);
+    kfree_tracked(pcb->rcv_buf);
+    pcb->snd_buf = pcb->rcv_buf = NULL;
+    pcb->snd_len = pcb->rcv_len = 0;
+    ktimer_arm_in(&pcb->timer, TCP_TIME_WAIT_US);
+    wake_up(&pcb->wait);
+}
+
+// Handshake done: hand the connection to the listener's accept queue
+static void tcp_established(tcp_pcb_t* pcb)
+{
+    pcb->state = TCP_ESTABLISHED;
+    wake_up(&pcb->wait);
+
+    tcp_pcb_t* parent = pcb->parent;
+    if (!parent) return;
+    pcb->parent = NULL;  // Its backlog slot now belongs to the queue entry
+
+    uint64_t flags = spin_lock_irqsave(&parent->lock);
+    pcb->accept_next = NULL;
+    if (parent->accept_tail) {
+        parent->accept_tail->accept_next = pcb;
+    } else {
+        parent->accept_head = pcb;
+    }
+    parent->accept_tail = pcb;
+    spin_unlock_irqrestore(&parent->lock, flags);
+    wake_up(&parent->wait);
+}
+
+// SYN for a listener: a child connection in SYN_RECEIVED answers it
+static void tcp_listen_input(tcp_pcb_t* listener, ipv4_header_t* ip, tcp_header_t* tcp,
+                             tcp_rx_t* rx)
+{
+    uint64_t flags = tcp_lock(listener);
+    bool room = listener->state == TCP_LISTEN && listener->backlog < TCP_BACKLOG;
+    if (room) listener->backlog++;
+    tcp_unlock(listener, flags);
+    if (!room) return;  // The client will send the SYN again
+
+    tcp_pcb_t* npcb = tcp_new();
+    if (!npcb || tcp_alloc_buffers(npcb) < 0) {
+        if (npcb) kfree_tracked(npcb);
+        flags = tcp_lock(listener);
+        listener->backlog--;
+        tcp_unlock(listener, flags);
+        return;
+    }
+
+    KDEBUG("TCP: SYN received on port %d", ntohs(tcp->dest_port));
+    npcb->local_ip = ip->dest_ip;
+    npcb->local_port = ntohs(tcp->dest_port);
+    npcb->remote_ip = ip->src_ip;
+    npcb->remote_port = ntohs(tcp->src_port);
+    npcb->parent = listener;
+    npcb->irs = rx->seq;
+    npcb->rcv_nxt = rx->seq + 1;
+    npcb->snd_wnd = rx->wnd;
+    npcb->mss = rx->opts.mss ? (rx->opts.mss < TCP_MSS_LOCAL ? rx->opts.mss : TCP_MSS_LOCAL)
+                             : TCP_MSS_DEFAULT;
+    npcb->sack_ok = rx->opts.sack_ok;
+    npcb->ts_ok = rx->opts.ts_ok;
+    npcb->ts_recent = rx->opts.tsval;
+    tcp_start(npcb);
+    npcb->snd_wl1 = rx->seq;
+    npcb->snd_wl2 = npcb->iss;
+    npcb->state = TCP_SYN_RECEIVED;
+
+    // Locked before it is findable, so its ACK waits for the SYN+ACK
+    flags = tcp_lock(npcb);
+    tcp_hash(npcb);
+    tcp_seg_t* seg = tcp_queue_seg(npcb, 1, TCP_SYN);
+    if (seg) tcp_xmit_seg(npcb, seg);
+    tcp_rearm(npcb, true);
+    tcp_unlock(npcb, flags);
+}
+
+// ============================================================================
+// INPUT
+// ============================================================================
+
+// RFC 6298 estimator
+static void tcp_rtt_sample(tcp_pcb_t* pcb, uint64_t rtt_us)
+{
+    if (pcb->srtt_us == 0) {
+        pcb->srtt_us = rtt_us;
+        pcb->rttvar_us = rtt_us / 2;
+    } else {
+        uint64_t diff = pcb->srtt_us > rtt_us ? pcb->srtt_us - rtt_us : rtt_us - pcb->srtt_us;
+        pcb->rttvar_us = (3 * pcb->rttvar_us + diff) / 4;
+        pcb->srtt_us = (7 * pcb->srtt_us + rtt_us) / 8;
+    }
+
+    uint64_t rto = pcb->srtt_us + (4 * pcb->rttvar_us > 1000 ? 4 * pcb->rttvar_us : 1000);
+    if (rto < TCP_RTO_MIN) rto = TCP_RTO_MIN;
+    if (rto > TCP_RTO_MAX) rto = TCP_RTO_MAX;
+    pcb->rto_us = rto;
+}
+
+// Mark segments the peer reports holding; returns bytes newly SACKed
+static uint32_t tcp_sack_update(tcp_pcb_t* pcb, tcp_rx_t* rx)
+{
+    uint32_t newly = 0;
+    if (SEQ_LT(pcb->highest_sack, pcb->snd_una)) pcb->highest_sack = pcb->snd_una;  // Stale
+    for (int i = 0; i < rx->opts.nsacks; i++) {
+        uint32_t start = rx->opts.sack[i][0];
+        uint32_t end = rx->opts.sack[i][1];
+        if (!SEQ_LT(start, end) || SEQ_LEQ(end, pcb->snd_una) || SEQ_GT(end, pcb->snd_nxt)) continue;
+
+        for (tcp_seg_t* seg = pcb->rtx_head; seg; seg = seg->next) {
+            if (SEQ_GEQ(seg->seq, end)) break;
+            if (SEQ_LT(seg->seq, start) || SEQ_GT(seg->seq + seg->len, end)) continue;
+            if (!(seg->state & SEG_SACKED)) {
+                seg->state |= SEG_SACKED;
+                newly += seg->len;
+            }
+        }
+        if (SEQ_GT(end, pcb->highest_sack)) pcb->highest_sack = end;
+    }
+    return newly;
+}
+
+// In recovery with SACK: holes below the highest SACKed byte are lost
+static void tcp_mark_lost(tcp_pcb_t* pcb)
+{
+    for (tcp_seg_t* seg = pcb->rtx_head; seg; seg = seg->next) {
+        if (SEQ_GEQ(seg->seq, pcb->highest_sack)) break;
+        if (!(seg->state & (SEG_SACKED | SEG_LOST))) seg->state |= SEG_LOST;
+    }
+}
+
+static uint32_t tcp_sacked_bytes(tcp_pcb_t* pcb)
+{
+    uint32_t bytes = 0;
+    for (tcp_seg_t* seg = pcb->rtx_head; seg; seg = seg->next) {
+        if (seg->state & SEG_SACKED) bytes += seg->len;
+    }
+    return bytes;
+}
+
+// Acknowledgment processing: retire acknowledged segments, sample the
+// RTT, grow or cut cwnd, and detect loss. -1 if it acks unsent data.
+static int tcp_ack(tcp_pcb_t* pcb, tcp_rx_t* rx)
+{
+    uint32_t ack = rx->ack;
+    if (SEQ_GT(ack, pcb->snd_nxt)) {
+        tcp_send_ack(pcb);
+        return -1;
+    }
+
+    uint32_t delivered = pcb->sack_ok ? tcp_sack_update(pcb, rx) : 0;
+    bool dupack = ack == pcb->snd_una && rx->len == 0 && !(rx->flags & (TCP_SYN | TCP_FIN)) &&
+                  rx->wnd == pcb->snd_wnd && pcb->rtx_head;
+
+    bool advanced = SEQ_GT(ack, pcb->snd_una);
+    if (advanced) {
+        bool sample = false;
+        bool sample_retrans = false;
+        uint64_t sample_sent = 0;
+        uint64_t sample_delivered = 0;
+
+        while (pcb->rtx_head && SEQ_GT(ack, pcb->rtx_head->seq)) {
+            tcp_seg_t* seg = pcb->rtx_head;
+            uint32_t seg_end = seg->seq + seg->len;
+            uint32_t covered = SEQ_GEQ(ack, seg_end) ? seg->len : ack - seg->seq;
+            // Sample from what this ACK delivers; a SACKed segment may
+            // have reached the peer long ago
+            if (!(seg->state & SEG_SACKED)) {
+                delivered += covered;
+                sample = true;
+                sample_retrans = seg->state & SEG_EVER_RETRANS;
+                sample_sent = seg->sent_us;
+                sample_delivered = seg->delivered;
+            }
+
+            if (covered < seg->len) {
+                seg->seq = ack;  // Partly acknowledged: keep the rest
+                seg->len -= covered;
+                seg->tcp_flags &= (uint8_t)~TCP_SYN;
+                break;
+            }
+            pcb->rtx_head = seg->next;
+            kfree_tracked(seg);
+        }
+        if (!pcb->rtx_head) pcb->rtx_tail = NULL;
+
+        // Release acknowledged data from the send ring and page ranges
+        if (SEQ_GT(ack, pcb->snd_buf_seq)) {
+            uint32_t before = pcb->snd_buf_seq;
+            tcp_snd_release(pcb, ack);
+            if (pcb->snd_buf_seq != before) wake_up(&pcb->wait);
+        }
+        pcb->snd_una = ack;
+        pcb->retries = 0;
+        pcb->dupacks = 0;
+        pcb->delivered += delivered;
+
+        // Both the send time (only for a segment sent once: Karn) and the
+        // timestamp echo bound the RTT from above; lost ACKs inflate the
+        // first, a stale echo the second, so take the smaller
+        uint64_t rtt = 0;
+        if (sample && !sample_retrans) {
+            rtt = time_monotonic_us() - sample_sent;
+        }
+        if (sample && pcb->ts_ok && rx->opts.ts_ok && rx->opts.tsecr &&
+            (!sample_retrans || SEQ_GEQ(rx->opts.tsecr, (uint32_t)(sample_sent / 1000)))) {
+            uint64_t ts_rtt = (uint64_t)(uint32_t)(tcp_now_ms() - rx->opts.tsecr) * 1000;
+            if (ts_rtt && (!rtt || ts_rtt < rtt)) rtt = ts_rtt;
+        }
+        if (rtt) {
+            tcp_rtt_sample(pcb, rtt);
+            bbr_update_model(pcb, rtt, (uint32_t)(pcb->delivered - sample_delivered));
+        }
+
+        if (pcb->in_recovery) {
+            if (SEQ_GEQ(ack, pcb->recovery_point)) {
+                pcb->in_recovery = false;
+                bbr_exit_recovery(pcb);
+            } else if (!pcb->sack_ok && pcb->rtx_head) {
+                // NewReno partial ACK: the next hole is lost too
+                pcb->rtx_head->state = (uint8_t)((pcb->rtx_head->state | SEG_LOST) & ~SEG_RETRANS);
+            }
+        }
+    } else {
+        pcb->delivered += delivered;
+        if (dupack) pcb->dupacks++;
+    }
+
+    // Window update (RFC 793), from the newest segment only
+    if (SEQ_LT(pcb->snd_wl1, rx->seq) ||
+        (pcb->snd_wl1 == rx->seq && SEQ_LEQ(pcb->snd_wl2, ack))) {
+        pcb->snd_wnd = rx->wnd;
+        pcb->snd_wl1 = rx->seq;
+        pcb->snd_wl2 = ack;
+    }
+
+    // Fast retransmit on three duplicates, or as much SACKed above a hole
+    if (!pcb->in_recovery && pcb->rtx_head &&
+        (pcb->dupacks >= TCP_DUPACK_THRESH ||
+         (pcb->sack_ok && tcp_sacked_bytes(pcb) >= TCP_DUPACK_THRESH * pcb->mss))) {
+        uint32_t in_flight = tcp_in_flight(pcb);
+        bbr_enter_recovery(pcb, in_flight);
+        pcb->in_recovery = true;
+        pcb->recovery_point = pcb->snd_nxt;
+        if (!(pcb->rtx_head->state & SEG_SACKED)) {
+            pcb->rtx_head->state = (uint8_t)((pcb->rtx_head->state | SEG_LOST) & ~SEG_RETRANS);
+        }
+    }
+    if (pcb->in_recovery && pcb->sack_ok) tcp_mark_lost(pcb);
+    if (delivered) bbr_on_ack(pcb, delivered);
+
+    tcp_rearm(pcb, advanced || delivered > 0);
+    return 0;
+}
+
+static void tcp_rcv_append(tcp_pcb_t* pcb, const uint8_t* data, uint32_t len)
+{
+    uint32_t off = (pcb->rcv_head + pcb->rcv_len) % TCP_BUF_SIZE;
+    uint32_t first = TCP_BUF_SIZE - off;
+    if (first > len) first = len;
+    memcpy(pcb->rcv_buf + off, data, first);
+    memcpy(pcb->rcv_buf, data + first, len - first);
+    pcb->rcv_len += len;
+    pcb->rcv_nxt += len;
+}
+
+// Keep data past a hole, splitting it around what is already held
+static void tcp_ooo_insert(tcp_pcb_t* pcb, uint32_t seq, const uint8_t* data, uint32_t len)
+{
+    pcb->ooo_last = seq;
+    tcp_ooo_t** link = &pcb->ooo;
+    while (len > 0) {
+        tcp_ooo_t* e = *link;
+        if (e && SEQ_GEQ(seq, e->seq + e->len)) {
+            link = &e->next;
+            continue;
+        }
+        if (e && SEQ_GEQ(seq, e->seq)) {
+            uint32_t skip = e->seq + e->len - seq;  // Already held
+            if (skip >= len) return;
+            seq += skip;
+            data += skip;
+            len -= skip;
+            link = &e->next;
+            continue;
+        }
+
+        uint32_t n = len;
+        if (e && SEQ_LT(e->seq, seq + len)) n = e->seq - seq;
+        tcp_ooo_t* piece = kmalloc_tracked(sizeof(tcp_ooo_t) + n, "tcp_ooo");
+        if (!piece) return;
+        piece->seq = seq;
+        piece->len = n;
+        memcpy(piece->data, data, n);
+        piece->next = e;
+        *link = piece;
+        link = &piece->next;
+        seq += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// The hole before the out-of-order data filled: move what now follows on
+static void tcp_ooo_drain(tcp_pcb_t* pcb)
+{
+    while (pcb->ooo && SEQ_LEQ(pcb->ooo->seq, pcb->rcv_nxt)) {
+        tcp_ooo_t* e = pcb->ooo;
+        uint32_t skip = pcb->rcv_nxt - e->seq;
+        if (skip < e->len) tcp_rcv_append(pcb, e->data + skip, e->len - skip);
+        pcb->ooo = e->next;
+        kfree_tracked(e);
+    }
+}
+
+static void tcp_data_input(tcp_pcb_t* pcb, uint32_t seq, const uint8_t* data, uint32_t len)
+{
+    if (!pcb->rcv_buf) return;
+
+    // Trim what is already in and what falls past the window
+    if (SEQ_LT(seq, pcb->rcv_nxt)) {
+        uint32_t skip = pcb->rcv_nxt - seq;
+        if (skip >= len) return;
+        seq += skip;
+        data += skip;
+        len -= skip;
+    }
+    uint32_t wnd_end = pcb->rcv_nxt + tcp_rcv_window(pcb);
+    if (SEQ_GEQ(seq, wnd_end)) return;
+    if (SEQ_GT(seq + len, wnd_end)) len = wnd_end - seq;
+
+    if (seq == pcb->rcv_nxt) {
+        tcp_rcv_append(pcb, data, len);
+        tcp_ooo_drain(pcb);
+        wake_up(&pcb->wait);
+    } else {
+        tcp_ooo_insert(pcb, seq, data, len);
+    }
+}
+
+static void tcp_syn_sent_input(tcp_pcb_t* pcb, tcp_rx_t* rx)
+{
+    if ((rx->flags & TCP_ACK) && (SEQ_LEQ(rx->ack, pcb->iss) || SEQ_GT(rx->ack, pcb->snd_nxt))) {
+        return;
+    }
+    if (rx->flags & TCP_RST) {
+        if (rx->flags & TCP_ACK) tcp_set_closed(pcb, -1);  // Refused
+        return;
+    }
+    if (!(rx->flags & TCP_SYN) || !(rx->flags & TCP_ACK)) return;  // No simultaneous open
+
+    KDEBUG("TCP: SYN+ACK received");
+    pcb->irs = rx->seq;
+    pcb->rcv_nxt = rx->seq + 1;
+    if (rx->opts.mss) pcb->mss = rx->opts.mss < TCP_MSS_LOCAL ? rx->opts.mss : TCP_MSS_LOCAL;
+    pcb->sack_ok = pcb->sack_ok && rx->opts.sack_ok;
+    pcb->ts_ok = pcb->ts_ok && rx->opts.ts_ok;
+    pcb->ts_recent = rx->opts.tsval;
+
+    tcp_ack(pcb, rx);
+    pcb->snd_wnd = rx->wnd;
+    pcb->snd_wl1 = rx->seq;
+    pcb->snd_wl2 = rx->ack;
+    tcp_established(pcb);
+    tcp_send_ack(pcb);
+
+    KINFO("TCP: Connection established with %d.%d.%d.%d:%d",
+          (pcb->remote_ip >> 24) & 0xFF, (pcb->remote_ip >> 16) & 0xFF,
+          (pcb->remote_ip >> 8) & 0xFF, pcb->remote_ip & 0xFF,
+          pcb->remote_port);
+    tcp_output(pcb, false);
+    tcp_rearm(pcb, false);
+}
+
+// A segment for a connection, with its lock held
+static void tcp_process(tcp_pcb_t* pcb, tcp_rx_t* rx)
+{
+    if (pcb->state == TCP_CLOSED || pcb->state == TCP_LISTEN) return;
+    if (pcb->state == TCP_SYN_SENT) {
+        tcp_syn_sent_input(pcb, rx);
+        return;
+    }
+
+    // Peer's timestamp to echo (RFC 7323), duplicates included: their
+    // ACK then measures the retransmission, not the original
+    if (pcb->ts_ok && rx->opts.ts_ok && SEQ_LEQ(rx->seq, pcb->rcv_nxt) &&
+        SEQ_GEQ(rx->opts.tsval, pcb->ts_recent)) {
+        pcb->ts_recent = rx->opts.tsval;
+    }
+
+    // Some of the segment must fall in the receive window (RFC 793)
+    uint32_t wnd = tcp_rcv_window(pcb);
+    uint32_t wnd_end = pcb->rcv_nxt + wnd;
+    bool acceptable;
+    if (rx->len == 0) {
+        acceptable = rx->seq == pcb->rcv_nxt ||
+                     (wnd && SEQ_GEQ(rx->seq, pcb->rcv_nxt) && SEQ_LT(rx->seq, wnd_end));
+    } else {
+        uint32_t last = rx->seq + rx->len - 1;
+        acceptable = wnd && ((SEQ_GEQ(rx->seq, pcb->rcv_nxt) && SEQ_LT(rx->seq, wnd_end)) ||
+                             (SEQ_GEQ(last, pcb->rcv_nxt) && SEQ_LT(last, wnd_end)));
+    }
+    if (!acceptable) {
+        if (!(rx->flags & TCP_RST)) tcp_send_ack(pcb);  // Duplicate: re-ACK, with SACKs
+        return;
+    }
+
+    if (rx->flags & TCP_RST) {
+        if (pcb->state != TCP_TIME_WAIT) tcp_set_closed(pcb, -1);  // RFC 1337
+        return;
+    }
+    if (rx->flags & TCP_SYN) {
+        tcp_send_ack(pcb);  // Challenge ACK (RFC 5961)
+        return;
+    }
+    if (!(rx->flags & TCP_ACK)) return;
+
+    if (pcb->state == TCP_SYN_RECEIVED) {
+        if (!SEQ_GT(rx->ack, pcb->snd_una) || SEQ_GT(rx->ack, pcb->snd_nxt)) return;
+        tcp_established(pcb);
+    }
+    if (tcp_ack(pcb, rx) < 0) return;
+
+    // Our FIN sent and everything acknowledged
+    bool fin_acked = pcb->fin_queued && !pcb->rtx_head &&
+                     SEQ_GT(pcb->snd_nxt, tcp_snd_end(pcb));
+    if (fin_acked) {
+        if (pcb->state == TCP_FIN_WAIT_1) {
+            pcb->state = TCP_FIN_WAIT_2;
+        } else if (pcb->state == TCP_CLOSING) {
+            tcp_enter_time_wait(pcb);
+            return;
+        } else if (pcb->state == TCP_LAST_ACK) {
+            tcp_set_closed(pcb, 0);
+            return;
+        }
+    }
+
+    bool need_ack = false;
+    if (rx->len > 0 && (pcb->state == TCP_ESTABLISHED || pcb->state == TCP_FIN_WAIT_1 ||
+                        pcb->state == TCP_FIN_WAIT_2)) {
+        tcp_data_input(pcb, rx->seq, rx->data, rx->len);
+        need_ack = true;
+    }
+
+    // FIN, once everything before it is in
+    if ((rx->flags & TCP_FIN) && !pcb->rcv_fin && rx->seq + rx->len == pcb->rcv_nxt) {
+        KDEBUG("TCP: FIN received");
+        pcb->rcv_nxt++;
+        pcb->rcv_fin = true;
+        need_ack = true;
+        wake_up(&pcb->wait);
+        if (pcb->state == TCP_ESTABLISHED) {
+            pcb->state = TCP_CLOSE_WAIT;
+        } else if (pcb->state == TCP_FIN_WAIT_1) {
+            pcb->state = TCP_CLOSING;
+        } else if (pcb->state == TCP_FIN_WAIT_2) {
+            tcp_send_ack(pcb);
+            tcp_enter_time_wait(pcb);
+            return;
+        }
+    }
+
+    if (need_ack) tcp_send_ack(pcb);
+    tcp_output(pcb, false);
+    tcp_rearm(pcb, false);
+}
+
+int tcp_input(net_interface_t* netif, packet_t* pkt)
+{
+    (void)netif;  // Demux goes by the packet's own addresses
+    if (pkt->len < sizeof(tcp_header_t)) return -1;
+
+    tcp_header_t* tcp = (tcp_header_t*)pkt->data;
+    ipv4_header_t* ip = (ipv4_header_t*)pkt->l3_header;
+    pkt->l4_header = tcp;
+
+    if (!(pkt->flags & PACKET_CSUM_VERIFIED)) {
+        uint32_t pseudo = csum_pseudo(ip->src_ip, ip->dest_ip, pkt->len, IPPROTO_TCP);
+        if (csum_fold(csum_partial(tcp, pkt->len, pseudo)) != 0) return -1;
+    }
+
+    uint32_t hdr_len = (tcp->data_offset >> 4) * 4;
+    if (hdr_len < sizeof(tcp_header_t) || hdr_len > pkt->len) return -1;
+
+    tcp_rx_t rx;
+    rx.seq = ntohl(tcp->seq_num);
+    rx.ack = ntohl(tcp->ack_num);
+    rx.flags = tcp->flags;
+    rx.wnd = ntohs(tcp->window);
+    rx.data = pkt->data + hdr_len;
+    rx.len = pkt->len - hdr_len;
+    tcp_parse_options((uint8_t*)(tcp + 1), hdr_len - sizeof(tcp_header_t), &rx.opts);
+
+    uint16_t src_port = ntohs(tcp->src_port);
+    uint16_t dest_port = ntohs(tcp->dest_port);
+
+    // Find PCB: the connection itself, else a listener for a new one
+    tcp_pcb_t* pcb = tcp_lookup_established(ip->dest_ip, dest_port, ip->src_ip, src_port);
+    if (pcb) {
+        uint64_t flags = tcp_lock(pcb);
+        tcp_process(pcb, &rx);
+        tcp_unlock(pcb, flags);
+        return 0;
+    }
+
+    pcb = tcp_lookup_listener(ip->dest_ip, dest_port);
+    if (pcb && (rx.flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN) {
+        tcp_listen_input(pcb, ip, tcp, &rx);
+        return 0;
+    }
+
+    tcp_send_reset(ip, tcp, rx.len + ((rx.flags & TCP_SYN) ? 1 : 0) + ((rx.flags & TCP_FIN) ? 1 : 0));
+    return 0;
+}
+
+// ============================================================================
+// TIMERS
+// ============================================================================
+
+// Interrupt context: queue the PCB for the timer task
+static void tcp_timer_fire(void* arg)
+{
+    tcp_pcb_t* pcb = (tcp_pcb_t*)arg;
+
+    uint64_t flags = spin_lock_irqsave(&tcp_timer_lock);
+    if (!pcb->timer_queued) {
+        pcb->timer_queued = true;
+        pcb->timer_next = tcp_timer_list;
+        tcp_timer_list = pcb;
+    }
+    spin_unlock_irqrestore(&tcp_timer_lock, flags);
+    wake_up(&tcp_timer_wq);
+}
+
+static void tcp_timeout(tcp_pcb_t* pcb)
+{
+    if (ktimer_pending(&pcb->timer)) return;  // Re-armed since it fired
+
+    if (pcb->state == TCP_TIME_WAIT) {
+        tcp_set_closed(pcb, 0);
+        return;
+    }
+    if (pcb->state == TCP_CLOSED || pcb->state == TCP_LISTEN) return;
+
+    if (!pcb->rtx_head) {
+        tcp_output(pcb, true);  // Zero-window probe
+        tcp_rearm(pcb, true);
+        return;
+    }
+
+    uint32_t limit = (pcb->state == TCP_SYN_SENT || pcb->state == TCP_SYN_RECEIVED)
+                     ? TCP_SYN_RETRIES : TCP_MAX_RETRIES;
+    if (++pcb->retries > limit) {
+        KDEBUG("TCP: Connection to port %d timed out", pcb->remote_port);
+        tcp_set_closed(pcb, -1);
+        return;
+    }
+
+    // Back off; everything outstanding except what the peer SACKed is
+    // presumed lost and goes again, starting from one segment of cwnd
+    bbr_on_rto(pcb);
+    pcb->in_recovery = true;
+    pcb->recovery_point = pcb->snd_nxt;
+    pcb->dupacks = 0;
+    for (tcp_seg_t* seg = pcb->rtx_head; seg; seg = seg->next) {
+        if (!(seg->state & SEG_SACKED)) {
+            seg->state = (uint8_t)((seg->state & SEG_EVER_RETRANS) | SEG_LOST);
+        }
+    }
+
+    tcp_output(pcb, false);
+    tcp_rearm(pcb, true);
+}
+
+static void tcp_timer_task(void* arg)
+{
+    (void)arg;
+    wait_entry_t wait;
+
+    for (;;) {
+        wait_prepare(&tcp_timer_wq, &wait);
+        uint64_t flags = spin_lock_irqsave(&tcp_timer_lock);
+        tcp_pcb_t* pcb = tcp_timer_list;
+        if (pcb) {
+            tcp_timer_list = pcb->timer_next;
+            pcb->timer_queued = false;
+        }
+        spin_unlock_irqrestore(&tcp_timer_lock, flags);
+
+        if (!pcb) wait_schedule(&wait, WAIT_FOREVER);
+        wait_finish(&wait);
+        if (!pcb) continue;
+
+        flags = tcp_lock(pcb);
+        tcp_timeout(pcb);
+        tcp_unlock(pcb, flags);
+    }
+}
+
+// ============================================================================
+// CONNECTION API
+// ============================================================================
+
+int tcp_bind(tcp_pcb_t* pcb, ip_addr_t ip, uint16_t port)
+{
+    pcb->local_ip = ip;
+    pcb->local_port = port;
+    return 0;
+}
+
+int tcp_listen(tcp_pcb_t* pcb)
+{
+    uint32_t h = tcp_lhashfn(pcb->local_port);
+    tcp_unhash(pcb);
+    pcb->state = TCP_LISTEN;
+    tcp_hash_insert(pcb, &tcp_lhash[h], &tcp_hash_locks[h % TCP_LOCK_STRIPES]);
+    return 0;
+}
+
+// Next established connection; blocks until there is one
+tcp_pcb_t* tcp_accept(tcp_pcb_t* listener)
+{
+    wait_entry_t wait;
+    tcp_pcb_t* child = NULL;
+
+    for (;;) {
+        wait_prepare(&listener->wait, &wait);
+        uint64_t flags = tcp_lock(listener);
+        if (listener->state != TCP_LISTEN) {
+            tcp_unlock(listener, flags);
+            break;
+        }
+        child = listener->accept_head;
+        if (child) {
+            listener->accept_head = child->accept_next;
+            if (!listener->accept_head) listener->accept_tail = NULL;
+            listener->backlog--;
+            tcp_unlock(listener, flags);
+            break;
+        }
+        tcp_unlock(listener, flags);
+        wait_schedule(&wait, WAIT_FOREVER);
+        wait_finish(&wait);
+    }
+    wait_finish(&wait);
+    return child;
+}
+
+// Active open; blocks until the handshake completes or fails
+int tcp_connect(tcp_pcb_t* pcb, ip_addr_t ip, uint16_t port)
+{
+    if (pcb->state != TCP_CLOSED || tcp_alloc_buffers(pcb) < 0) return -1;
+
+    // Source address as ipv4_output() will route it
+    net_interface_t* netif = (ip & 0xFF000000) == 0x7F000000 ? net_get_interface("lo")
+                                                             : net_get_default_interface();
+    if (!netif) {
+        tcp_set_closed(pcb, -1);
+        return -1;
+    }
+
+    uint64_t flags = tcp_lock(pcb);
+    pcb->local_ip = netif->ip_addr;
+    if (pcb->local_port == 0) {
+        pcb->local_port = __atomic_fetch_add(&tcp_next_port, 1, __ATOMIC_RELAXED);
+        if (pcb->local_port < 49152) pcb->local_port += 49152;
+    }
+    pcb->remote_ip = ip;
+    pcb->remote_port = port;
+    pcb->sack_ok = true;  // Offered; kept if the SYN+ACK agrees
+    pcb->ts_ok = true;
+    pcb->error = 0;
+    tcp_start(pcb);
+    pcb->state = TCP_SYN_SENT;
+    tcp_hash(pcb);
+    tcp_seg_t* seg = tcp_queue_seg(pcb, 1, TCP_SYN);
+    if (seg) tcp_xmit_seg(pcb, seg);
+    tcp_rearm(pcb, true);
+    tcp_unlock(pcb, flags);
+
+    wait_entry_t wait;
+    for (;;) {
+        wait_prepare(&pcb->wait, &wait);
+        if (__atomic_load_n(&pcb->state, __ATOMIC_ACQUIRE) != TCP_SYN_SENT) break;
+        wait_schedule(&wait, WAIT_FOREVER);
+    }
+    wait_finish(&wait);
+    return pcb->state == TCP_CLOSED ? -1 : 0;
+}
+
+// Queue data for sending; blocks while the send ring is full. Returns the
+// bytes queued, or -1 if the connection can't send.
+ssize_t tcp_write(tcp_pcb_t* pcb, const void* data, size_t len)
+{
+    const uint8_t* src = (const uint8_t*)data;
+    size_t done = 0;
+    wait_entry_t wait;
+
+    while (done < len) {
+        wait_prepare(&pcb->wait, &wait);
+        uint64_t flags = tcp_lock(pcb);
+        if ((pcb->state != TCP_ESTABLISHED && pcb->state != TCP_CLOSE_WAIT) || pcb->fin_queued) {
+            tcp_unlock(pcb, flags);
+            wait_finish(&wait);
+            break;
+        }
+
+        uint32_t room = TCP_BUF_SIZE - pcb->snd_len - pcb->snd_page_len;
+        if (room == 0) {
+            tcp_unlock(pcb, flags);
+            wait_schedule(&wait, WAIT_FOREVER);
+            wait_finish(&wait);
+            continue;
+        }
+        wait_finish(&wait);  // Not sleeping: copy as a running task
+
+        uint32_t n = len - done < room ? (uint32_t)(len - done) : room;
+        uint32_t off = (pcb->snd_head + pcb->snd_len) % TCP_BUF_SIZE;
+        uint32_t first = TCP_BUF_SIZE - off;
+        if (first > n) first = n;
+        memcpy(pcb->snd_buf + off, src + done, first);
+        memcpy(pcb->snd_buf, src + done + first, n - first);
+        pcb->snd_len += n;
+        done += n;
+
+        tcp_output(pcb, false);
+        tcp_rearm(pcb, false);
+        tcp_unlock(pcb, flags);
+    }
+    return done ? (ssize_t)done : (len ? -1 : 0);
+}
+
+ssize_t tcp_sendpage(tcp_pcb_t* pcb, cached_page_t* page, uint32_t offset, uint32_t len)
+{
+    if (offset > PAGE_SIZE || len > PAGE_SIZE - offset) return -1;
+
+    size_t done = 0;
+    wait_entry_t wait;
+
+    while (done < len) {
+        wait_prepare(&pcb->wait, &wait);
+        uint64_t flags = tcp_lock(pcb);
+        if ((pcb->state != TCP_ESTABLISHED && pcb->state != TCP_CLOSE_WAIT) || pcb->fin_queued) {
+            tcp_unlock(pcb, flags);
+            wait_finish(&wait);
+            break;
+        }
+
+        uint32_t room = TCP_BUF_SIZE - pcb->snd_len - pcb->snd_page_len;
+        if (room == 0) {
+            tcp_unlock(pcb, flags);
+            wait_schedule(&wait, WAIT_FOREVER);
+            wait_finish(&wait);
+            continue;
+        }
+        wait_finish(&wait);
+
+        uint32_t n = len - done < room ? (uint32_t)(len - done) : room;
+        uint8_t* data = page->data + offset + done;
+        uint32_t seq = tcp_snd_end(pcb);
+
+        // Carries straight on from the last range: grow it
+        tcp_page_t* tail = pcb->snd_pages_tail;
+        if (tail && tail->page == page && tail->seq + tail->len == seq && tail->data + tail->len == data) {
+            tail->len += n;
+        } else {
+            tcp_page_t* pg = kmalloc_tracked(sizeof(tcp_page_t), "tcp_page");
+            if (!pg) {
+                tcp_unlock(pcb, flags);
+                break;
+            }
+            page_cache_hold(page);
+            pg->next = NULL;
+            pg->seq = seq;
+            pg->len = n;
+            pg->page = page;
+            pg->data = data;
+            if (tail) {
+                tail->next = pg;
+            } else {
+                pcb->snd_pages = pg;
+            }
+            pcb->snd_pages_tail = pg;
+        }
+        pcb->snd_page_len += n;
+        done += n;
+
+        tcp_output(pcb, false);
+        tcp_rearm(pcb, false);
+        tcp_unlock(pcb, flags);
+    }
+    return done ? (ssize_t)done : (len ? -1 : 0);
+}
+
+ssize_t tcp_sendfile(tcp_pcb_t* pcb, struct file* file, loff_t* pos, size_t count)
+{
+    struct inode* inode = file->f_inode;
+    page_mapping_t* mapping = inode ? inode->i_mapping : NULL;
+    if (!mapping) return -1;  // Not in the page cache: nothing to lend
+
+    loff_t local = (loff_t)file->f_pos;
+    loff_t* at = pos ? pos : &local;
+    uint64_t offset = (uint64_t)*at;
+    if (offset >= inode->i_size) return 0;
+    if (count > inode->i_size - offset) count = inode->i_size - offset;
+
+    size_t done = 0;
+    while (done < count) {
+        uint64_t index = (offset + done) / PAGE_SIZE;
+        uint32_t in_page = (uint32_t)((offset + done) % PAGE_SIZE);
+        uint32_t n = PAGE_SIZE - in_page;
+        if (n > count - done) n = (uint32_t)(count - done);
+
+        // The file's readahead window, as for read()
+        uint64_t ra_start;
+        uint32_t ra_count;
+        bool ahead = page_cache_ra_advance(&file->f_ra, index, 1, &ra_start, &ra_count);
+        cached_page_t* page = page_cache_get(mapping, index);
+        if (!page) break;
+        if (ahead) {
+            uint64_t end = (inode->i_size + PAGE_SIZE - 1) / PAGE_SIZE;
+            if (ra_start < end) {
+                page_cache_readahead(mapping, ra_start, ra_start + ra_count > end ? end - ra_start : ra_count);
+            }
+        }
+
+        ssize_t sent = tcp_sendpage(pcb, page, in_page, n);
+        page_cache_put(page);
+        if (sent > 0) done += (size_t)sent;
+        if (sent < (ssize_t)n) break;
+    }
+
+    *at += (loff_t)done;
+    if (!pos) file->f_pos = (uint64_t)local;
+    return done ? (ssize_t)done : (count ? -1 : 0);
+}
+
+// Received data; blocks until there is some. 0 once the peer has closed
+// and everything is read, -1 if the connection was reset or timed out.
+ssize_t tcp_read(tcp_pcb_t* pcb, void* buffer, size_t len)
+{
+    uint8_t* dst = (uint8_t*)buffer;
+    ssize_t ret = 0;
+    wait_entry_t wait;
+
+    for (;;) {
+        wait_prepare(&pcb->wait, &wait);
+        uint64_t flags = tcp_lock(pcb);
+        if (pcb->rcv_len > 0 && len > 0) {
+            wait_finish(&wait);
+            uint32_t n = len < pcb->rcv_len ? (uint32_t)len : pcb->rcv_len;
+            uint32_t first = TCP_BUF_SIZE - pcb->rcv_head;
+            if (first > n) first = n;
+            memcpy(dst, pcb->rcv_buf + pcb->rcv_head, first);
+            memcpy(dst + first, pcb->rcv_buf, n - first);
+            pcb->rcv_head = (pcb->rcv_head + n) % TCP_BUF_SIZE;
+            pcb->rcv_len -= n;
+
+            // Tell the peer once the window has opened by two segments
+            if (tcp_rcv_window(pcb) >= pcb->rcv_wnd + 2 * pcb->mss && !pcb->rcv_fin &&
+                pcb->state != TCP_CLOSED) {
+                tcp_send_ack(pcb);
+            }
+            tcp_unlock(pcb, flags);
+            ret = n;
+            break;
+        }
+        bool done = pcb->rcv_fin || pcb->state == TCP_CLOSED || len == 0;
+        ret = pcb->error ? -1 : 0;
+        tcp_unlock(pcb, flags);
+        if (!done) wait_schedule(&wait, WAIT_FOREVER);
+        wait_finish(&wait);
+        if (done) break;
+    }
+    return ret;
+}
+
+// Readiness for epoll_ctl(). Reads the fields without the lock, which
+// wakeups hold, so a stale answer just means another pass.
+uint32_t tcp_poll(void* obj, wait_queue_t** wq)
+{
+    tcp_pcb_t* pcb = (tcp_pcb_t*)obj;
+    uint32_t events = 0;
+    *wq = &pcb->wait;
+
+    if (pcb->state == TCP_LISTEN) {
+        return pcb->accept_head ? EPOLLIN : 0;
+    }
+    if (pcb->rcv_len > 0) events |= EPOLLIN;
+    if (pcb->rcv_fin) events |= EPOLLIN | EPOLLRDHUP;
+    if ((pcb->state == TCP_ESTABLISHED || pcb->state == TCP_CLOSE_WAIT) && !pcb->fin_queued &&
+        pcb->snd_len + pcb->snd_page_len < TCP_BUF_SIZE) {
+        events |= EPOLLOUT;
+    }
+    if (pcb->state == TCP_CLOSED) {
+        events |= EPOLLHUP | EPOLLIN;
+        if (pcb->error) events |= EPOLLERR;
+    }
+    return events;
+}
+
+// Orderly close: FIN after the queued data
+int tcp_close(tcp_pcb_t* pcb)
+{
+    uint64_t flags = tcp_lock(pcb);
+    switch (pcb->state) {
+        case TCP_SYN_RECEIVED:
+        case TCP_ESTABLISHED:
+            pcb->fin_queued = true;
+            pcb->state = TCP_FIN_WAIT_1;
+            break;
+        case TCP_CLOSE_WAIT:
+            pcb->fin_queued = true;
+            pcb->state = TCP_LAST_ACK;
+            break;
+        case TCP_LISTEN:
+        case TCP_SYN_SENT:
+            tcp_set_closed(pcb, 0);
+            break;
+        default:
+            break;
+    }
+    tcp_output(pcb, false);
+    tcp_rearm(pcb, false);
+    tcp_unlock(pcb, flags);
+    return 0;
+}
+
+void tcp_init(void)
+{
+    // One connection bucket per 32KB of memory, within bounds
+    uint64_t want = pmm_get_total_pages() / 8;
+    uint32_t buckets = TCP_EHASH_MIN;
+    while (buckets < TCP_EHASH_MAX && (uint64_t)buckets * 2 <= want) buckets *= 2;
+
+    size_t pages = ((size_t)buckets * sizeof(tcp_pcb_t*) + PAGE_SIZE - 1) / PAGE_SIZE;
+    tcp_ehash = (tcp_pcb_t**)pmm_alloc_pages(pages);
+    if (!tcp_ehash) {
+        buckets = PAGE_SIZE / sizeof(tcp_pcb_t*);
+        pages = 1;
+        tcp_ehash = (tcp_pcb_t**)pmm_alloc_pages(1);
+        if (!tcp_ehash) PANIC("TCP: No memory for the connection table");
+    }
+    memset(tcp_ehash, 0, pages * PAGE_SIZE);
+    tcp_ehash_mask = buckets - 1;
+    tcp_hash_secret = rdtsc() * 0x9E3779B97F4A7C15ULL;
+
+    if (scheduler_create_task(tcp_timer_task, NULL, 16384, TCP_TIMER_PRIORITY, "tcp_timer") < 0) {
+        KWARN("TCP: No timer task, connections will not retransmit");
+    }
+
+    KINFO("TCP: Initialized with BBR Congestion Control, %u connection buckets", buckets);
 }
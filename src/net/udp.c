@@ -6,6 +6,16 @@
 #include "net.h"
 #include "kernel.h"
 
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+#define UDP_HASH_SIZE      64            // Bound ports
+#define UDP_RCVBUF         131072        // Receive ring per socket, records included
+#define UDP_MAX_PAYLOAD    65507         // 65535 less IPv4 and UDP headers
+#define UDP_MAX_GSO_SIZE   1472          // A datagram per Ethernet frame
+#define UDP_MAX_SEGMENTS   64            // Datagrams in one GSO send or coalesced receive
+
 // ============================================================================
 // DATA STRUCTURES
 // ============================================================================
@@ -17,6 +27,168 @@ typedef struct {
     uint16_t checksum;
 } __attribute__((packed)) udp_header_t;
 
+// In front of each datagram in a receive ring. Records are padded to 8
+// bytes, so a header never wraps; the data may.
+typedef struct {
+    ip_addr_t src_ip;
+    uint16_t src_port;
+    uint16_t len;
+} udp_rec_t;
+
+#define UDP_REC_SIZE(len)  ((sizeof(udp_rec_t) + (len) + 7) & ~7u)
+
+struct udp_pcb {
+    struct udp_pcb* hash_next;
+    bool hashed;
+    ip_addr_t local_ip;
+    uint16_t local_port;
+    bool gro;                  // recvmmsg() coalesces runs of datagrams
+
+    spinlock_t lock;           // Receive ring
+    wait_queue_t wait;         // Readers
+    uint8_t* rcv_buf;
+    uint32_t rcv_head;
+    uint32_t rcv_used;         // Bytes of records
+    uint32_t rcv_count;        // Datagrams
+    uint64_t drops;            // Arrived to a full ring
+};
+
+static udp_pcb_t* udp_hash[UDP_HASH_SIZE];
+static spinlock_t udp_hash_lock = SPINLOCK_INIT;
+static uint16_t udp_next_port = 49152;    // Ephemeral range
+
+// ============================================================================
+// RECEIVE RING (pcb->lock held)
+// ============================================================================
+
+static void udp_ring_write(udp_pcb_t* pcb, uint32_t off, const void* src, uint32_t len)
+{
+    off %= UDP_RCVBUF;
+    uint32_t first = UDP_RCVBUF - off;
+    if (first > len) first = len;
+    memcpy(pcb->rcv_buf + off, src, first);
+    memcpy(pcb->rcv_buf, (const uint8_t*)src + first, len - first);
+}
+
+static void udp_ring_read(udp_pcb_t* pcb, uint32_t off, void* dst, uint32_t len)
+{
+    off %= UDP_RCVBUF;
+    uint32_t first = UDP_RCVBUF - off;
+    if (first > len) first = len;
+    memcpy(dst, pcb->rcv_buf + off, first);
+    memcpy((uint8_t*)dst + first, pcb->rcv_buf, len - first);
+}
+
+static int udp_queue(udp_pcb_t* pcb, ip_addr_t src_ip, uint16_t src_port, const void* data, uint16_t len)
+{
+    uint32_t size = UDP_REC_SIZE(len);
+    if (pcb->rcv_used + size > UDP_RCVBUF) {
+        pcb->drops++;
+        return -1;
+    }
+
+    uint32_t off = pcb->rcv_head + pcb->rcv_used;
+    udp_rec_t* rec = (udp_rec_t*)(pcb->rcv_buf + off % UDP_RCVBUF);
+    rec->src_ip = src_ip;
+    rec->src_port = src_port;
+    rec->len = len;
+    udp_ring_write(pcb, off + sizeof(udp_rec_t), data, len);
+    pcb->rcv_used += size;
+    pcb->rcv_count++;
+    return 0;
+}
+
+static inline udp_rec_t* udp_ring_first(udp_pcb_t* pcb)
+{
+    return (udp_rec_t*)(pcb->rcv_buf + pcb->rcv_head);
+}
+
+static inline void udp_ring_consume(udp_pcb_t* pcb, udp_rec_t* rec)
+{
+    uint32_t size = UDP_REC_SIZE(rec->len);
+    pcb->rcv_head = (pcb->rcv_head + size) % UDP_RCVBUF;
+    pcb->rcv_used -= size;
+    pcb->rcv_count--;
+}
+
+// One message's worth: the next datagram, or with GRO a run of them from
+// the same sender, all the size of the first but maybe a shorter last one
+static void udp_dequeue_msg(udp_pcb_t* pcb, udp_msg_t* msg)
+{
+    udp_rec_t* rec = udp_ring_first(pcb);
+    ip_addr_t src_ip = rec->src_ip;
+    uint16_t src_port = rec->src_port;
+    uint16_t size = rec->len;
+    uint32_t done = 0;
+    uint32_t segs = 0;
+
+    msg->addr.ip = src_ip;
+    msg->addr.port = ntohs(src_port);
+    msg->gso_size = 0;
+
+    do {
+        uint32_t n = rec->len < msg->len - done ? rec->len : msg->len - done;  // Excess is cut off
+        udp_ring_read(pcb, pcb->rcv_head + sizeof(udp_rec_t), (uint8_t*)msg->buf + done, n);
+        done += n;
+        segs++;
+        bool last = rec->len < size;
+        udp_ring_consume(pcb, rec);
+        if (!pcb->gro || last || !pcb->rcv_count || segs >= UDP_MAX_SEGMENTS) break;
+
+        rec = udp_ring_first(pcb);
+    } while (rec->src_ip == src_ip && rec->src_port == src_port && rec->len <= size &&
+             done + rec->len <= msg->len);
+
+    msg->len = done;
+    if (segs > 1) msg->gso_size = size;
+}
+
+// ============================================================================
+// PORT TABLE (udp_hash_lock held)
+// ============================================================================
+
+static inline uint32_t udp_hashfn(uint16_t port)
+{
+    return port % UDP_HASH_SIZE;
+}
+
+static udp_pcb_t* udp_lookup(ip_addr_t ip, uint16_t port)
+{
+    for (udp_pcb_t* pcb = udp_hash[udp_hashfn(port)]; pcb; pcb = pcb->hash_next) {
+        if (pcb->local_port == port && (pcb->local_ip == 0 || pcb->local_ip == ip)) return pcb;
+    }
+    return NULL;
+}
+
+static int udp_hash_insert(udp_pcb_t* pcb, ip_addr_t ip, uint16_t port)
+{
+    uint64_t flags = spin_lock_irqsave(&udp_hash_lock);
+    if (pcb->hashed) {
+        spin_unlock_irqrestore(&udp_hash_lock, flags);
+        return -1;
+    }
+
+    // Port 0: the next free ephemeral one
+    for (int tries = 0; port == 0 && tries < 16384; tries++) {
+        uint16_t candidate = udp_next_port++;
+        if (udp_next_port == 0) udp_next_port = 49152;
+        if (!udp_lookup(0, candidate)) port = candidate;
+    }
+    if (port == 0 || udp_lookup(ip, port)) {
+        spin_unlock_irqrestore(&udp_hash_lock, flags);
+        return -1;
+    }
+
+    pcb->local_ip = ip;
+    pcb->local_port = port;
+    uint32_t h = udp_hashfn(port);
+    pcb->hash_next = udp_hash[h];
+    udp_hash[h] = pcb;
+    pcb->hashed = true;
+    spin_unlock_irqrestore(&udp_hash_lock, flags);
+    return 0;
+}
+
 // ============================================================================
 // UDP IMPLEMENTATION
 // ============================================================================
@@ -26,43 +198,235 @@ int udp_input(net_interface_t* netif, packet_t* pkt)
     if (pkt->len < sizeof(udp_header_t)) return -1;
     
     udp_header_t* udp = (udp_header_t*)pkt->data;
-    pkt->l4_header = udp;
+    uint16_t length = ntohs(udp->length);
+    if (length < sizeof(udp_header_t) || length > pkt->len) return -1;
+    
+    // A zero checksum means the sender didn't compute one
+    ipv4_header_t* ip = (ipv4_header_t*)pkt->l3_header;
+    if (!(pkt->flags & PACKET_CSUM_VERIFIED) && udp->checksum != 0) {
+        uint32_t pseudo = csum_pseudo(ip->src_ip, ip->dest_ip, length, IPPROTO_UDP);
+        if (csum_fold(csum_partial(udp, length, pseudo)) != 0) return -1;
+    }
     
     // Strip header
-    pkt->data += sizeof(udp_header_t);
-    pkt->len -= sizeof(udp_header_t);
+    packet_pull(pkt, sizeof(udp_header_t));
+    pkt->l4_header = udp;
     
     uint16_t dest_port = ntohs(udp->dest_port);
     
-    KDEBUG("UDP: Packet received for port %d", dest_port);
+    // Copied into the socket's ring under the table lock, so it can't be
+    // closed underneath
+    uint64_t flags = spin_lock_irqsave(&udp_hash_lock);
+    udp_pcb_t* pcb = udp_lookup(ip->dest_ip, dest_port);
+    if (!pcb) {
+        spin_unlock_irqrestore(&udp_hash_lock, flags);
+        KDEBUG("UDP: No socket on port %d", dest_port);
+        return 0;
+    }
     
-    // Find socket bound to this port and queue packet
-    // (Socket layer not implemented in this step)
+    spin_lock(&pcb->lock);
+    int ret = udp_queue(pcb, ip->src_ip, udp->src_port, pkt->data, length - sizeof(udp_header_t));
+    spin_unlock(&pcb->lock);
+    if (ret == 0) wake_up(&pcb->wait);
+    spin_unlock_irqrestore(&udp_hash_lock, flags);
     
-    return 0;
+    return ret;
 }
 
-int udp_send(sockaddr_in_t* src, sockaddr_in_t* dest, void* data, uint32_t len)
+// One datagram, or with gso_size a stack of them in one packet that the
+// interface (or net_dev_xmit()) splits
+static int udp_output(uint16_t src_port, sockaddr_in_t* dest, const void* data, uint32_t len,
+                      uint16_t gso_size)
 {
-    packet_t* pkt = net_alloc_packet(NET_MAX_PACKET_SIZE);
+    packet_t* pkt = net_alloc_packet(len);
     if (!pkt) return -1;
     
-    // Reserve headers
-    pkt->data += sizeof(eth_header_t) + sizeof(ipv4_header_t) + sizeof(udp_header_t);
-    
     // Copy data
-    memcpy(pkt->data, data, len);
-    pkt->len = len;
+    memcpy(packet_put(pkt, len), data, len);
     
     // Prepend UDP header
-    pkt->data -= sizeof(udp_header_t);
-    pkt->len += sizeof(udp_header_t);
-    
-    udp_header_t* udp = (udp_header_t*)pkt->data;
-    udp->src_port = htons(src->port);
+    udp_header_t* udp = packet_push(pkt, sizeof(udp_header_t));
+    udp->src_port = htons(src_port);
     udp->dest_port = htons(dest->port);
     udp->length = htons(len + sizeof(udp_header_t));
-    udp->checksum = 0; // Optional in IPv4
+    udp->checksum = 0;
+    
+    // Summed with the pseudo-header once ipv4_output() knows the source
+    pkt->l4_header = udp;
+    pkt->csum_offset = __builtin_offsetof(udp_header_t, checksum);
+    pkt->flags |= PACKET_CSUM_PARTIAL;
+    if (len > gso_size) pkt->gso_size = gso_size;
     
     return ipv4_output(pkt, dest->ip, IPPROTO_UDP);
 }
+
+int udp_send(sockaddr_in_t* src, sockaddr_in_t* dest, void* data, uint32_t len)
+{
+    if (len > UDP_MAX_PAYLOAD) return -1;
+    return udp_output(src->port, dest, data, len, 0);
+}
+
+// Split a GSO packet for an interface that can't: each datagram gets a
+// copy of the headers with its own lengths and checksums. Called with the
+// frame built (pkt->data at the Ethernet header); takes ownership.
+int udp_gso_segment(net_interface_t* netif, packet_t* pkt)
+{
+    if (pkt->nr_frags && packet_linearize(pkt) < 0) {
+        netif->tx_dropped++;
+        net_free_packet(pkt);
+        return -1;
+    }
+
+    uint32_t ip_off = (uint32_t)((uint8_t*)pkt->l3_header - pkt->data);
+    uint32_t udp_off = (uint32_t)((uint8_t*)pkt->l4_header - pkt->data);
+    uint32_t hdr_len = udp_off + sizeof(udp_header_t);
+    const uint8_t* payload = pkt->data + hdr_len;
+    uint32_t left = pkt->len - hdr_len;
+    int ret = 0;
+
+    while (left > 0) {
+        uint32_t n = left < pkt->gso_size ? left : pkt->gso_size;
+        packet_t* seg = net_alloc_packet(hdr_len + n);
+        if (!seg) {
+            netif->tx_dropped++;
+            ret = -1;
+            break;
+        }
+        uint8_t* frame = packet_put(seg, hdr_len + n);
+        memcpy(frame, pkt->data, hdr_len);
+        memcpy(frame + hdr_len, payload, n);
+        seg->protocol = pkt->protocol;
+        seg->l2_header = frame;
+        seg->l3_header = frame + ip_off;
+        seg->l4_header = frame + udp_off;
+
+        ipv4_header_t* ip = (ipv4_header_t*)seg->l3_header;
+        udp_header_t* udp = (udp_header_t*)seg->l4_header;
+        uint32_t l4_len = sizeof(udp_header_t) + n;
+        ip->total_len = htons(udp_off - ip_off + l4_len);
+        ip->checksum = 0;
+        ip->checksum = checksum(ip, udp_off - ip_off);
+        udp->length = htons(l4_len);
+
+        uint32_t pseudo = csum_pseudo(ip->src_ip, ip->dest_ip, l4_len, IPPROTO_UDP);
+        if (netif->features & NETIF_F_IP_CSUM) {
+            udp->checksum = (uint16_t)~csum_fold(pseudo);
+            seg->csum_offset = __builtin_offsetof(udp_header_t, checksum);
+            seg->flags |= PACKET_CSUM_PARTIAL;
+        } else {
+            udp->checksum = 0;
+            udp->checksum = csum_fold(csum_partial(udp, l4_len, pseudo));
+            if (udp->checksum == 0) udp->checksum = 0xFFFF;  // 0 means none
+        }
+
+        if (net_dev_xmit(netif, seg) < 0) ret = -1;
+        payload += n;
+        left -= n;
+    }
+
+    net_free_packet(pkt);
+    return ret;
+}
+
+// ============================================================================
+// SOCKETS
+// ============================================================================
+
+udp_pcb_t* udp_new(void)
+{
+    udp_pcb_t* pcb = kmalloc_tracked(sizeof(udp_pcb_t), "udp_pcb");
+    if (!pcb) return NULL;
+    memset(pcb, 0, sizeof(udp_pcb_t));
+
+    pcb->rcv_buf = kmalloc_tracked(UDP_RCVBUF, "udp_rcvbuf");
+    if (!pcb->rcv_buf) {
+        kfree_tracked(pcb);
+        return NULL;
+    }
+    pcb->lock = (spinlock_t)SPINLOCK_INIT;
+    wait_queue_init(&pcb->wait);
+    return pcb;
+}
+
+int udp_bind(udp_pcb_t* pcb, ip_addr_t ip, uint16_t port)
+{
+    if (!pcb) return -1;
+    return udp_hash_insert(pcb, ip, port);
+}
+
+void udp_set_gro(udp_pcb_t* pcb, bool on)
+{
+    uint64_t flags = spin_lock_irqsave(&pcb->lock);
+    pcb->gro = on;
+    spin_unlock_irqrestore(&pcb->lock, flags);
+}
+
+int udp_close(udp_pcb_t* pcb)
+{
+    if (!pcb) return -1;
+
+    // Out of the table first: udp_input() holds its lock while it delivers
+    uint64_t flags = spin_lock_irqsave(&udp_hash_lock);
+    if (pcb->hashed) {
+        udp_pcb_t** link = &udp_hash[udp_hashfn(pcb->local_port)];
+        while (*link != pcb) link = &(*link)->hash_next;
+        *link = pcb->hash_next;
+        pcb->hashed = false;
+    }
+    spin_unlock_irqrestore(&udp_hash_lock, flags);
+
+    if (pcb->drops) KDEBUG("UDP: Port %d dropped %lu datagrams", pcb->local_port, pcb->drops);
+    kfree_tracked(pcb->rcv_buf);
+    kfree_tracked(pcb);
+    return 0;
+}
+
+int udp_sendmmsg(udp_pcb_t* pcb, udp_msg_t* msgs, int count)
+{
+    if (!pcb || !msgs || count <= 0) return -1;
+    if (!pcb->hashed && udp_hash_insert(pcb, 0, 0) < 0) return -1;  // Implicit bind
+
+    int sent = 0;
+    for (; sent < count; sent++) {
+        udp_msg_t* msg = &msgs[sent];
+        uint16_t gso_size = msg->len > msg->gso_size ? msg->gso_size : 0;
+        if (msg->len > UDP_MAX_PAYLOAD || gso_size > UDP_MAX_GSO_SIZE ||
+            (gso_size && (msg->len + gso_size - 1) / gso_size > UDP_MAX_SEGMENTS)) {
+            break;
+        }
+        if (udp_output(pcb->local_port, &msg->addr, msg->buf, msg->len, gso_size) < 0) break;
+    }
+    return sent > 0 ? sent : -1;
+}
+
+int udp_recvmmsg(udp_pcb_t* pcb, udp_msg_t* msgs, int count, uint64_t deadline_us)
+{
+    if (!pcb || !msgs || count <= 0) return -1;
+
+    wait_entry_t wait;
+    for (;;) {
+        wait_prepare(&pcb->wait, &wait);
+        uint64_t flags = spin_lock_irqsave(&pcb->lock);
+        if (pcb->rcv_count > 0) {
+            wait_finish(&wait);
+            int received = 0;
+            while (received < count && pcb->rcv_count > 0) {
+                udp_dequeue_msg(pcb, &msgs[received++]);
+            }
+            spin_unlock_irqrestore(&pcb->lock, flags);
+            return received;
+        }
+        spin_unlock_irqrestore(&pcb->lock, flags);
+
+        int timed_out = deadline_us == 0 ? -1 : wait_schedule(&wait, deadline_us);
+        wait_finish(&wait);
+        if (timed_out < 0) return 0;
+    }
+}
+
+uint32_t udp_poll(void* obj, wait_queue_t** wq)
+{
+    udp_pcb_t* pcb = (udp_pcb_t*)obj;
+    *wq = &pcb->wait;
+    return (pcb->rcv_count > 0 ? EPOLLIN : 0) | EPOLLOUT;
+}
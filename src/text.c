@@ -0,0 +1,302 @@
+/*
+ * Text Rendering
+ * A built-in 5x7 font, pre-rasterized into an atlas per color pair, and a
+ * cache of whole rasterized lines so text that is drawn again (labels,
+ * terminal rows, the clock) is one blit per line instead of a pass over
+ * every glyph bit
+ */
+
+#include "kernel.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+#define FONT_FIRST       0x20              // ' '
+#define FONT_LAST        0x7E              // '~'
+#define FONT_GLYPHS      (FONT_LAST - FONT_FIRST + 1)
+#define FONT_GLYPH_W     5                 // Inked columns; the cell adds one of spacing
+#define FONT_GLYPH_H     7
+#define FONT_CELL_PIXELS (TEXT_CELL_W * TEXT_CELL_H)
+
+#define ATLAS_CACHE      8                 // Color pairs kept rasterized
+#define LINE_CACHE       32                // Rasterized lines kept
+#define LINE_MAX_CHARS   128               // Longer text is drawn in pieces
+
+// ============================================================================
+// FONT
+// ============================================================================
+
+// One byte per row, bit 4 the leftmost column
+static const uint8_t font_5x7[FONT_GLYPHS][FONT_GLYPH_H] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // ' '
+    { 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 },  // '!'
+    { 0x0A, 0x0A, 0x0A, 0x00, 0x00, 0x00, 0x00 },  // '"'
+    { 0x0A, 0x0A, 0x1F, 0x0A, 0x1F, 0x0A, 0x0A },  // '#'
+    { 0x04, 0x0F, 0x14, 0x0E, 0x05, 0x1E, 0x04 },  // '$'
+    { 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 },  // '%'
+    { 0x0C, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0D },  // '&'
+    { 0x0C, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00 },  // '''
+    { 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 },  // '('
+    { 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 },  // ')'
+    { 0x00, 0x04, 0x15, 0x0E, 0x15, 0x04, 0x00 },  // '*'
+    { 0x00, 0x04, 0x04, 0x1F, 0x04, 0x04, 0x00 },  // '+'
+    { 0x00, 0x00, 0x00, 0x00, 0x0C, 0x04, 0x08 },  // ','
+    { 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 },  // '-'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C },  // '.'
+    { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 },  // '/'
+    { 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E },  // '0'
+    { 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E },  // '1'
+    { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F },  // '2'
+    { 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E },  // '3'
+    { 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 },  // '4'
+    { 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E },  // '5'
+    { 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E },  // '6'
+    { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },  // '7'
+    { 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E },  // '8'
+    { 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C },  // '9'
+    { 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00 },  // ':'
+    { 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x04, 0x08 },  // ';'
+    { 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 },  // '<'
+    { 0x00, 0x00, 0x1F, 0x00, 0x1F, 0x00, 0x00 },  // '='
+    { 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 },  // '>'
+    { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 },  // '?'
+    { 0x0E, 0x11, 0x01, 0x0D, 0x15, 0x15, 0x0E },  // '@'
+    { 0x0E, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 },  // 'A'
+    { 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E },  // 'B'
+    { 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E },  // 'C'
+    { 0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C },  // 'D'
+    { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F },  // 'E'
+    { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10 },  // 'F'
+    { 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F },  // 'G'
+    { 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 },  // 'H'
+    { 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E },  // 'I'
+    { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C },  // 'J'
+    { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },  // 'K'
+    { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F },  // 'L'
+    { 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11 },  // 'M'
+    { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 },  // 'N'
+    { 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E },  // 'O'
+    { 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10 },  // 'P'
+    { 0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D },  // 'Q'
+    { 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11 },  // 'R'
+    { 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E },  // 'S'
+    { 0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },  // 'T'
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E },  // 'U'
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04 },  // 'V'
+    { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A },  // 'W'
+    { 0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11 },  // 'X'
+    { 0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04 },  // 'Y'
+    { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F },  // 'Z'
+    { 0x0E, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0E },  // '['
+    { 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00 },  // backslash
+    { 0x0E, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0E },  // ']'
+    { 0x04, 0x0A, 0x11, 0x00, 0x00, 0x00, 0x00 },  // '^'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1F },  // '_'
+    { 0x08, 0x04, 0x02, 0x00, 0x00, 0x00, 0x00 },  // '`'
+    { 0x00, 0x00, 0x0E, 0x01, 0x0F, 0x11, 0x0F },  // 'a'
+    { 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x1E },  // 'b'
+    { 0x00, 0x00, 0x0E, 0x10, 0x10, 0x11, 0x0E },  // 'c'
+    { 0x01, 0x01, 0x0D, 0x13, 0x11, 0x11, 0x0F },  // 'd'
+    { 0x00, 0x00, 0x0E, 0x11, 0x1F, 0x10, 0x0E },  // 'e'
+    { 0x06, 0x09, 0x08, 0x1C, 0x08, 0x08, 0x08 },  // 'f'
+    { 0x00, 0x0F, 0x11, 0x11, 0x0F, 0x01, 0x0E },  // 'g'
+    { 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x11 },  // 'h'
+    { 0x04, 0x00, 0x0C, 0x04, 0x04, 0x04, 0x0E },  // 'i'
+    { 0x02, 0x00, 0x06, 0x02, 0x02, 0x12, 0x0C },  // 'j'
+    { 0x10, 0x10, 0x12, 0x14, 0x18, 0x14, 0x12 },  // 'k'
+    { 0x0C, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E },  // 'l'
+    { 0x00, 0x00, 0x1A, 0x15, 0x15, 0x11, 0x11 },  // 'm'
+    { 0x00, 0x00, 0x16, 0x19, 0x11, 0x11, 0x11 },  // 'n'
+    { 0x00, 0x00, 0x0E, 0x11, 0x11, 0x11, 0x0E },  // 'o'
+    { 0x00, 0x00, 0x1E, 0x11, 0x1E, 0x10, 0x10 },  // 'p'
+    { 0x00, 0x00, 0x0D, 0x13, 0x0F, 0x01, 0x01 },  // 'q'
+    { 0x00, 0x00, 0x16, 0x19, 0x10, 0x10, 0x10 },  // 'r'
+    { 0x00, 0x00, 0x0E, 0x10, 0x0E, 0x01, 0x1E },  // 's'
+    { 0x08, 0x08, 0x1C, 0x08, 0x08, 0x09, 0x06 },  // 't'
+    { 0x00, 0x00, 0x11, 0x11, 0x11, 0x13, 0x0D },  // 'u'
+    { 0x00, 0x00, 0x11, 0x11, 0x11, 0x0A, 0x04 },  // 'v'
+    { 0x00, 0x00, 0x11, 0x11, 0x15, 0x15, 0x0A },  // 'w'
+    { 0x00, 0x00, 0x11, 0x0A, 0x04, 0x0A, 0x11 },  // 'x'
+    { 0x00, 0x00, 0x11, 0x11, 0x0F, 0x01, 0x0E },  // 'y'
+    { 0x00, 0x00, 0x1F, 0x02, 0x04, 0x08, 0x1F },  // 'z'
+    { 0x02, 0x04, 0x04, 0x08, 0x04, 0x04, 0x02 },  // '{'
+    { 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },  // '|'
+    { 0x08, 0x04, 0x04, 0x02, 0x04, 0x04, 0x08 },  // '}'
+    { 0x00, 0x00, 0x08, 0x15, 0x02, 0x00, 0x00 },  // '~'
+};
+
+// ============================================================================
+// CACHES
+// ============================================================================
+
+// Every glyph of the font in one color pair, cell after cell
+typedef struct {
+    uint32_t fg, bg;
+    uint32_t last_used;
+    uint32_t* pixels;              // FONT_GLYPHS cells of FONT_CELL_PIXELS
+} text_atlas_t;
+
+// One line of text as drawn: TEXT_CELL_H rows of len * TEXT_CELL_W pixels
+typedef struct {
+    uint32_t hash;
+    uint32_t fg, bg;
+    int len;                       // 0 = unused
+    uint32_t last_used;
+    char text[LINE_MAX_CHARS];
+    uint32_t* pixels;
+} text_line_t;
+
+static text_atlas_t atlases[ATLAS_CACHE];
+static text_line_t lines[LINE_CACHE];
+static uint32_t text_clock = 0;    // LRU stamp
+static spinlock_t text_lock = SPINLOCK_INIT;
+static uint64_t line_hits = 0, line_misses = 0;
+
+// Rasterize the font in fg on bg (bg 0: transparent)
+static void atlas_fill(text_atlas_t* atlas, uint32_t fg, uint32_t bg)
+{
+    for (int g = 0; g < FONT_GLYPHS; g++) {
+        uint32_t* cell = atlas->pixels + g * FONT_CELL_PIXELS;
+        for (int y = 0; y < TEXT_CELL_H; y++) {
+            uint8_t bits = y < FONT_GLYPH_H ? font_5x7[g][y] : 0;
+            for (int x = 0; x < TEXT_CELL_W; x++) {
+                bool ink = x < FONT_GLYPH_W && (bits & (0x10 >> x));
+                cell[y * TEXT_CELL_W + x] = ink ? fg : bg;
+            }
+        }
+    }
+    atlas->fg = fg;
+    atlas->bg = bg;
+}
+
+// The atlas for a color pair, rasterizing over the least recently used
+static text_atlas_t* atlas_get(uint32_t fg, uint32_t bg)
+{
+    text_atlas_t* victim = NULL;
+    for (int i = 0; i < ATLAS_CACHE; i++) {
+        text_atlas_t* atlas = &atlases[i];
+        if (atlas->pixels && atlas->fg == fg && atlas->bg == bg) {
+            atlas->last_used = ++text_clock;
+            return atlas;
+        }
+        if (!victim || !atlas->pixels || (victim->pixels && atlas->last_used < victim->last_used)) {
+            victim = atlas;
+        }
+    }
+
+    if (!victim->pixels) {
+        victim->pixels = kmalloc_tracked(FONT_GLYPHS * FONT_CELL_PIXELS * sizeof(uint32_t), "text_atlas");
+        if (!victim->pixels) return NULL;
+    }
+    atlas_fill(victim, fg, bg);
+    victim->last_used = ++text_clock;
+    return victim;
+}
+
+static uint32_t line_hash(const char* text, int len, uint32_t fg, uint32_t bg)
+{
+    uint32_t h = 2166136261U ^ fg ^ (bg * 16777619U);
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)text[i]) * 16777619U;
+    }
+    return h;
+}
+
+// Glyph cells row by row from the atlas into the line image
+static void line_render(text_line_t* line, const text_atlas_t* atlas)
+{
+    size_t pitch = (size_t)line->len * TEXT_CELL_W;
+    for (int i = 0; i < line->len; i++) {
+        int c = (uint8_t)line->text[i];
+        int g = (c >= FONT_FIRST && c <= FONT_LAST) ? c - FONT_FIRST : '?' - FONT_FIRST;
+        const uint32_t* cell = atlas->pixels + g * FONT_CELL_PIXELS;
+        uint32_t* dst = line->pixels + i * TEXT_CELL_W;
+        for (int y = 0; y < TEXT_CELL_H; y++) {
+            memcpy(dst + y * pitch, cell + y * TEXT_CELL_W, TEXT_CELL_W * sizeof(uint32_t));
+        }
+    }
+}
+
+// The rasterized line for this text, from the cache or built now
+static text_line_t* line_get(const char* text, int len, uint32_t fg, uint32_t bg)
+{
+    uint32_t hash = line_hash(text, len, fg, bg);
+    text_line_t* victim = NULL;
+    for (int i = 0; i < LINE_CACHE; i++) {
+        text_line_t* line = &lines[i];
+        if (line->len == len && line->hash == hash && line->fg == fg && line->bg == bg &&
+            memcmp(line->text, text, len) == 0) {
+            line->last_used = ++text_clock;
+            line_hits++;
+            return line;
+        }
+        if (!victim || (victim->len && (!line->len || line->last_used < victim->last_used))) {
+            victim = line;
+        }
+    }
+    line_misses++;
+
+    text_atlas_t* atlas = atlas_get(fg, bg);
+    if (!atlas) return NULL;
+    if (!victim->pixels) {
+        victim->pixels = kmalloc_tracked(LINE_MAX_CHARS * FONT_CELL_PIXELS * sizeof(uint32_t), "text_line");
+        if (!victim->pixels) return NULL;
+    }
+
+    victim->hash = hash;
+    victim->fg = fg;
+    victim->bg = bg;
+    victim->len = len;
+    memcpy(victim->text, text, len);
+    line_render(victim, atlas);
+    victim->last_used = ++text_clock;
+    return victim;
+}
+
+// ============================================================================
+// PUBLIC API
+// ============================================================================
+
+int text_width(const char* text)
+{
+    return text ? (int)strlen(text) * TEXT_CELL_W : 0;
+}
+
+// Draw text with its top left at (x, y) on a 32-bit surface, only inside
+// clip. bg 0 leaves the pixels between strokes alone. Returns the width
+// covered, clipped or not.
+int text_draw(uint32_t* surface, size_t pitch, const rect_t* clip, int x, int y,
+              const char* text, uint32_t fg, uint32_t bg)
+{
+    if (!surface || !clip || !text) return 0;
+    int total = (int)strlen(text);
+
+    uint64_t flags = spin_lock_irqsave(&text_lock);
+    for (int start = 0; start < total; start += LINE_MAX_CHARS) {
+        int len = total - start < LINE_MAX_CHARS ? total - start : LINE_MAX_CHARS;
+        rect_t area = { x + start * TEXT_CELL_W, y, len * TEXT_CELL_W, TEXT_CELL_H };
+        rect_t r;
+        if (!rect_intersect(&area, clip, &r)) continue;
+
+        text_line_t* line = line_get(text + start, len, fg, bg);
+        if (!line) break;
+
+        // The visible part of the line image, in one blit
+        size_t line_pitch = (size_t)len * TEXT_CELL_W;
+        const uint32_t* src = line->pixels + (size_t)(r.y - area.y) * line_pitch + (r.x - area.x);
+        uint32_t* dst = surface + (size_t)r.y * pitch + r.x;
+        if (bg >> 24 == 0xFF) {
+            blit_copy_rect(dst, pitch, src, line_pitch, r.width, r.height);
+        } else {
+            blit_over_rect(dst, pitch, src, line_pitch, r.width, r.height);
+        }
+    }
+    spin_unlock_irqrestore(&text_lock, flags);
+    return total * TEXT_CELL_W;
+}
+
+void text_get_stats(void)
+{
+    KINFO("Text: %lu line cache hits, %lu misses", line_hits, line_misses);
+}